@@ -5,6 +5,7 @@ import {
   ClientMessagesEvent,
   HelloEvent,
   Room,
+  ServerMessagesCorrectedEvent,
   ServerMessagesEvent,
   User,
 } from "@/lib/apiTypes";
@@ -218,6 +219,33 @@ describe("chat page", () => {
       );
     });
 
+    test("Message corrections", async () => {
+      // Set up
+      const server = new WS(process.env.NEXT_PUBLIC_WEBSOCKET_URL);
+      render(<ChatPage />);
+      await server.connected;
+      server.send(JSON.stringify(helloEvt));
+      expect(screen.getByText("Message 1 wasm")).toBeInTheDocument();
+      expect(screen.getAllByText("Message 2 wasm")).toHaveLength(2);
+
+      // A message couldn't be stored, and another one got a different ID
+      const correctedEvt: ServerMessagesCorrectedEvent = {
+        type: "serverMessagesCorrected",
+        payload: {
+          roomId: "wasm",
+          messages: [
+            { id: "2-0", newId: null },
+            { id: "1-0", newId: "1-5" },
+          ],
+        },
+      };
+      server.send(JSON.stringify(correctedEvt));
+
+      // The message that couldn't be stored is removed. The other one stays
+      expect(screen.queryByText("Message 2 wasm")).toBeNull();
+      expect(screen.getAllByText("Message 1 wasm")).toHaveLength(2);
+    });
+
     test("On authentication failure, navigate to the login page", async () => {
       // Set up
       const server = new WS(process.env.NEXT_PUBLIC_WEBSOCKET_URL);
@@ -68,7 +68,25 @@ export type ServerMessagesEvent = {
   };
 };
 
-export type AnyServerEvent = HelloEvent | ServerMessagesEvent;
+// A message that was broadcast before being stored, and got a different ID.
+// A null newId means that the message couldn't be stored, and must be discarded
+export type MessageIdCorrection = {
+  id: string;
+  newId: string | null;
+};
+
+export type ServerMessagesCorrectedEvent = {
+  type: "serverMessagesCorrected";
+  payload: {
+    roomId: string;
+    messages: MessageIdCorrection[];
+  };
+};
+
+export type AnyServerEvent =
+  | HelloEvent
+  | ServerMessagesEvent
+  | ServerMessagesCorrectedEvent;
 
 export type ClientMessagesEvent = {
   type: "clientMessages";
@@ -1,12 +1,17 @@
 import Head from "@/components/Head";
 import Header from "@/components/Header";
 import RoomEntry from "@/components/RoomEntry";
-import { useCallback, useEffect, useReducer, useRef } from "react";
+import { useCallback, useEffect, useReducer, useRef, useState } from "react";
 import {
   parseWebsocketMessage,
   serializeMessagesEvent,
 } from "@/lib/apiSerialization";
-import { ServerMessage, Room, User } from "@/lib/apiTypes";
+import {
+  MessageIdCorrection,
+  ServerMessage,
+  Room,
+  User,
+} from "@/lib/apiTypes";
 import { MyMessage, OtherUserMessage } from "@/components/Message";
 import MessageInputBar from "@/components/MessageInputBar";
 import autoAnimate from "@formkit/auto-animate";
@@ -42,6 +47,16 @@ type AddMessagesAction = {
   };
 };
 
+// Changes the IDs of messages in a certain room, removing the ones that
+// the server couldn't store
+type CorrectMessagesAction = {
+  type: "correct_messages";
+  payload: {
+    roomId: string;
+    corrections: MessageIdCorrection[];
+  };
+};
+
 // Sets the current active room (e.g. when the user clicks in a room)
 type SetCurrentRoomAction = {
   type: "set_current_room";
@@ -51,7 +66,11 @@ type SetCurrentRoomAction = {
 };
 
 // Any of the above
-type Action = SetInitialStateAction | AddMessagesAction | SetCurrentRoomAction;
+type Action =
+  | SetInitialStateAction
+  | AddMessagesAction
+  | CorrectMessagesAction
+  | SetCurrentRoomAction;
 
 // A Message, either from our user or from another user
 const Message = ({
@@ -120,6 +139,31 @@ function doAddMessages(state: State, action: AddMessagesAction): State {
   };
 }
 
+function doCorrectMessages(
+  state: State,
+  action: CorrectMessagesAction,
+): State {
+  // Find the room
+  const room = state.rooms[action.payload.roomId];
+  if (!room) return state; // We don't know what the server is talking about
+
+  // Apply the corrections
+  const newIds = new Map<string, string | null>();
+  for (const { id, newId } of action.payload.corrections) newIds.set(id, newId);
+  const messages = room.messages
+    .filter((msg) => newIds.get(msg.id) !== null)
+    .map((msg) =>
+      newIds.has(msg.id) ? { ...msg, id: newIds.get(msg.id) } : msg,
+    );
+  return {
+    ...state,
+    rooms: {
+      ...state.rooms,
+      [action.payload.roomId]: { ...room, messages },
+    },
+  };
+}
+
 function getLastMessageTimestamp(room: Room): number {
   return room.messages.length > 0 ? room.messages[0].timestamp : 0;
 }
@@ -148,6 +192,8 @@ function reducer(state: State, action: Action): State {
       return doSetInitialState(action);
     case "add_messages":
       return doAddMessages(state, action);
+    case "correct_messages":
+      return doCorrectMessages(state, action);
     case "set_current_room":
       return {
         ...state,
@@ -240,6 +286,20 @@ export const ChatScreen = ({
 // Websocket close code to signal that authentication is required
 const CODE_POLICY_VIOLATION = 1008;
 
+// Websocket close code sent when the server is restarting
+const CODE_SERVICE_RESTART = 1012;
+
+// Parses the time to wait before reconnecting, sent by the server
+// in the close reason when it restarts
+function parseReconnectDelay(reason: string): number {
+  try {
+    const delay = JSON.parse(reason).reconnectAfterMs;
+    return typeof delay === "number" && delay >= 0 ? delay : 0;
+  } catch {
+    return 0;
+  }
+}
+
 // The actual component
 export default function ChatPage() {
   // State management
@@ -271,6 +331,9 @@ export default function ChatPage() {
 
   const router = useRouter();
 
+  // Incremented to create a new websocket after the server restarts
+  const [connectionId, setConnectionId] = useState(0);
+
   // Handle server websocket messages
   const onWebsocketMessage = useCallback((event: MessageEvent) => {
     const { type, payload } = parseWebsocketMessage(event.data);
@@ -293,6 +356,15 @@ export default function ChatPage() {
           },
         });
         break;
+      case "serverMessagesCorrected":
+        dispatch({
+          type: "correct_messages",
+          payload: {
+            roomId: payload.roomId,
+            corrections: payload.messages,
+          },
+        });
+        break;
     }
   }, []);
 
@@ -302,6 +374,13 @@ export default function ChatPage() {
       if (event.code === CODE_POLICY_VIOLATION) {
         clearHasAuth();
         router.replace("/login");
+      } else if (event.code === CODE_SERVICE_RESTART) {
+        // The server tells each client a different delay, so they
+        // don't all reconnect at the same time
+        setTimeout(
+          () => setConnectionId((id) => id + 1),
+          parseReconnectDelay(event.reason),
+        );
       }
     },
     [router],
@@ -320,7 +399,7 @@ export default function ChatPage() {
       websocketRef.current.removeEventListener("close", onClose);
       websocketRef.current.close();
     };
-  }, [onWebsocketMessage, onClose]);
+  }, [onWebsocketMessage, onClose, connectionId]);
 
   // Handle loading state
   if (state.loading) return <p>Loading...</p>;
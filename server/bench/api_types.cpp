@@ -0,0 +1,122 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Measures serializing the events sent by the server: hello_event (sent when
+// a session starts) and server_messages_event (sent once per broadcast),
+// and converting them to MessagePack, for clients using the binary protocol.
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "bench_utils.hpp"
+#include "business_types.hpp"
+#include "timestamp.hpp"
+#include "util/msgpack.hpp"
+
+using namespace chat;
+using chat::bench::run_benchmark;
+
+namespace {
+
+constexpr std::size_t num_users = 10;
+
+// A message as typically posted by users
+message make_message(std::size_t idx)
+{
+    return message{
+        std::to_string(1691666793896 + idx) + "-0",
+        "Hello world! This is a reasonably-sized chat message, with \"escapes\" and some unicode: \xc3\xb1.",
+        parse_timestamp(1691666793896 + static_cast<std::int64_t>(idx)),
+        static_cast<std::int64_t>(idx % num_users),
+        nullptr,
+    };
+}
+
+username_map make_usernames()
+{
+    username_map res;
+    for (std::size_t i = 0; i < num_users; ++i)
+        res[static_cast<std::int64_t>(i)] = "user" + std::to_string(i);
+    return res;
+}
+
+// The rooms in a hello event, each with the given number of messages
+std::vector<room> make_rooms(std::size_t num_messages)
+{
+    std::vector<room> res;
+    for (const char* id : {"beast", "async", "db", "wasm"})
+    {
+        room r{id, id, {}};
+        for (std::size_t i = 0; i < num_messages; ++i)
+            r.history.messages.push_back(make_message(i));
+        r.history.has_more = true;
+        res.push_back(std::move(r));
+    }
+    return res;
+}
+
+// Stores the encoded representation in every message, as the history cache does
+void encode_messages(std::vector<room>& rooms, const username_map& usernames)
+{
+    for (auto& r : rooms)
+    {
+        for (auto& msg : r.history.messages)
+            msg.encoded = encode_message(msg, usernames.at(msg.user_id));
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    auto iterations = bench::get_iterations(argc, argv, 10000u);
+    user me{1, "user1"};
+    auto usernames = make_usernames();
+
+    for (std::size_t num_messages : {0u, 10u, 100u})
+    {
+        auto rooms = make_rooms(num_messages);
+        std::cout << "hello_event with 4 rooms of " << num_messages << " messages ("
+                  << hello_event{me, rooms, usernames}.to_json().size() << " bytes)\n";
+        run_benchmark("  to_json", iterations, [&] {
+            return hello_event{me, rooms, usernames}.to_json().size();
+        });
+
+        encode_messages(rooms, usernames);
+        run_benchmark("  to_json, pre-encoded messages", iterations, [&] {
+            return hello_event{me, rooms, usernames}.to_json().size();
+        });
+
+        auto json = hello_event{me, rooms, usernames}.to_json();
+        std::cout << "  MessagePack: " << json_to_msgpack(json)->size() << " bytes\n";
+        run_benchmark("  json_to_msgpack", iterations, [&] { return json_to_msgpack(json)->size(); });
+    }
+
+    for (std::size_t num_messages : {1u, 10u})
+    {
+        std::vector<message> messages;
+        for (std::size_t i = 0; i < num_messages; ++i)
+        {
+            messages.push_back(make_message(i));
+            messages.back().user_id = me.id;
+        }
+        std::cout << "server_messages_event with " << num_messages << " messages ("
+                  << server_messages_event{"beast", me, messages}.to_json().size() << " bytes)\n";
+        run_benchmark("  to_json", iterations * 10u, [&] {
+            return server_messages_event{"beast", me, messages}.to_json().size();
+        });
+
+        // Broadcast messages are converted once, and shared by all the binary sessions
+        auto json = server_messages_event{"beast", me, messages}.to_json();
+        std::cout << "  MessagePack: " << json_to_msgpack(json)->size() << " bytes\n";
+        run_benchmark("  json_to_msgpack", iterations * 10u, [&] { return json_to_msgpack(json)->size(); });
+    }
+}
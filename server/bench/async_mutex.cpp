@@ -0,0 +1,141 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Measures async_mutex and concurrent_async_mutex under contention: several coroutines
+// (like the sessions writing to a websocket) repeatedly lock the mutex, yield while
+// holding it (like a write would), and unlock it. Prints the time per acquisition,
+// and the longest wait to acquire the mutex, which stays bounded because the mutexes are fair.
+// The number of acquisitions per coroutine is the only argument.
+
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bench_utils.hpp"
+#include "util/async_mutex.hpp"
+
+using namespace chat;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Tracks the longest wait, across threads
+struct wait_stats
+{
+    std::atomic<std::int64_t> max_wait_ns{0};
+
+    void record(clock_type::duration wait)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+        auto prev = max_wait_ns.load(std::memory_order_relaxed);
+        while (prev < ns && !max_wait_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed))
+            ;
+    }
+};
+
+// Launches num_coroutines coroutines in ctx, each acquiring mtx num_iterations times
+template <class Mutex>
+void launch(
+    boost::asio::io_context& ctx,
+    Mutex& mtx,
+    std::size_t num_coroutines,
+    std::size_t num_iterations,
+    wait_stats& stats
+)
+{
+    for (std::size_t i = 0; i < num_coroutines; ++i)
+    {
+        boost::asio::spawn(
+            ctx,
+            [&mtx, num_iterations, &stats](boost::asio::yield_context yield) {
+                for (std::size_t j = 0; j < num_iterations; ++j)
+                {
+                    auto start = clock_type::now();
+                    auto guard = mtx.lock_with_guard(yield);
+                    stats.record(clock_type::now() - start);
+                    boost::asio::post(yield);
+                }
+            },
+            boost::asio::detached
+        );
+    }
+}
+
+void print_results(
+    std::string_view name,
+    clock_type::duration elapsed,
+    std::size_t num_acquisitions,
+    const wait_stats& stats
+)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    std::cout << name << ": " << static_cast<double>(ns) / num_acquisitions << " ns/acquisition, "
+              << stats.max_wait_ns.load() / 1000 << " us max wait\n";
+}
+
+// All the coroutines run in a single thread
+void measure_single_thread(std::size_t num_coroutines, std::size_t num_iterations)
+{
+    boost::asio::io_context ctx;
+    async_mutex mtx(ctx.get_executor());
+    wait_stats stats;
+    launch(ctx, mtx, num_coroutines, num_iterations, stats);
+    auto start = clock_type::now();
+    ctx.run();
+    std::cout << num_coroutines << " coroutines, ";
+    print_results("async_mutex", clock_type::now() - start, num_coroutines * num_iterations, stats);
+}
+
+// Coroutines run in num_threads threads, each with its own io_context
+void measure_multi_thread(std::size_t num_threads, std::size_t num_coroutines, std::size_t num_iterations)
+{
+    concurrent_async_mutex mtx;
+    wait_stats stats;
+    std::vector<boost::asio::io_context> contexts(num_threads);
+    for (auto& ctx : contexts)
+        launch(ctx, mtx, num_coroutines, num_iterations, stats);
+
+    auto start = clock_type::now();
+    std::vector<std::thread> threads;
+    for (auto& ctx : contexts)
+        threads.emplace_back([&ctx] { ctx.run(); });
+    for (auto& t : threads)
+        t.join();
+    std::cout << num_threads << " threads x " << num_coroutines << " coroutines, ";
+    print_results(
+        "concurrent_async_mutex",
+        clock_type::now() - start,
+        num_threads * num_coroutines * num_iterations,
+        stats
+    );
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    auto num_iterations = bench::get_iterations(argc, argv, 10000u);
+
+    for (std::size_t num_coroutines : {1u, 10u, 100u})
+        measure_single_thread(num_coroutines, num_iterations);
+
+    auto num_threads = (std::max)(std::thread::hardware_concurrency(), 2u);
+    for (std::size_t num_coroutines : {1u, 10u})
+        measure_multi_thread(num_threads, num_coroutines, num_iterations);
+}
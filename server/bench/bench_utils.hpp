@@ -0,0 +1,46 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_BENCH_BENCH_UTILS_HPP
+#define SERVERTECHCHAT_SERVER_BENCH_BENCH_UTILS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+// Helpers shared by the microbenchmarks
+
+namespace chat {
+namespace bench {
+
+// The number of iterations to run, from the first command-line argument
+inline std::size_t get_iterations(int argc, char** argv, std::size_t default_value)
+{
+    return argc > 1 ? std::strtoul(argv[1], nullptr, 10) : default_value;
+}
+
+// Runs fn iterations times and prints the average time per iteration.
+// fn returns a value that is accumulated, so the compiler can't optimize calls away
+template <class Fn>
+void run_benchmark(std::string_view name, std::size_t iterations, Fn fn)
+{
+    std::size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+        checksum += fn();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    std::cout << name << ": " << static_cast<double>(ns) / iterations << " ns/iteration (checksum "
+              << checksum << ")\n";
+}
+
+}  // namespace bench
+}  // namespace chat
+
+#endif
@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Compares the streaming client_event_parser against parsing
+// into a boost::json DOM and converting it with value_to.
+
+#include <boost/describe/class.hpp>
+#include <boost/json/parse.hpp>
+#include <boost/json/value_to.hpp>
+#include <boost/variant2/variant.hpp>
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "bench_utils.hpp"
+#include "error.hpp"
+
+using namespace chat;
+using chat::bench::run_benchmark;
+
+namespace {
+
+// Mirrors of the event types, with Describe metadata. The actual metadata is
+// private to api_types.cpp, and defining it again would be an ODR violation
+struct dom_client_message
+{
+    std::string content;
+};
+BOOST_DESCRIBE_STRUCT(dom_client_message, (), (content))
+
+struct dom_client_messages_event
+{
+    std::string roomId;
+    std::vector<dom_client_message> messages;
+};
+BOOST_DESCRIBE_STRUCT(dom_client_messages_event, (), (roomId, messages))
+
+// The DOM-based parser, as parse_client_event used to be implemented
+std::size_t dom_parse(std::string_view from)
+{
+    error_code ec;
+    auto msg = boost::json::parse(from, ec);
+    if (ec)
+        return 0u;
+    const auto* obj = msg.if_object();
+    if (!obj)
+        return 0u;
+    const auto* type = obj->if_contains("type");
+    const auto* payload = obj->if_contains("payload");
+    if (!type || !payload || *type != "clientMessages")
+        return 0u;
+    auto evt = boost::json::try_value_to<dom_client_messages_event>(*payload);
+    return evt.has_value() ? evt->messages.size() : 0u;
+}
+
+// Generates a clientMessages event with the given number of messages
+std::string make_event(std::size_t num_messages)
+{
+    std::string res = R"({"type":"clientMessages","payload":{"roomId":"beast","messages":[)";
+    for (std::size_t i = 0; i < num_messages; ++i)
+    {
+        if (i > 0u)
+            res += ',';
+        res += R"({"content":"Hello world! This is a reasonably-sized chat message, with \"escapes\"."})";
+    }
+    res += "]}}";
+    return res;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    auto iterations = bench::get_iterations(argc, argv, 100000u);
+
+    for (std::size_t num_messages : {1u, 10u, 100u})
+    {
+        auto input = make_event(num_messages);
+        std::cout << "clientMessages with " << num_messages << " messages (" << input.size() << " bytes)\n";
+
+        run_benchmark("  boost::json::parse + value_to", iterations, [&] { return dom_parse(input); });
+
+        run_benchmark("  parse_client_event", iterations, [&] {
+            auto evt = parse_client_event(input);
+            const auto* msgs = boost::variant2::get_if<client_messages_event>(&evt);
+            return msgs ? msgs->messages.size() : 0u;
+        });
+
+        client_event_parser parser;
+        run_benchmark("  client_event_parser", iterations, [&] {
+            auto evt = parser.parse(input);
+            const auto* msgs = boost::variant2::get_if<client_messages_event>(&evt);
+            return msgs ? msgs->messages.size() : 0u;
+        });
+    }
+}
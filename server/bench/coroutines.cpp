@@ -0,0 +1,188 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Compares stackful coroutines (boost::asio::spawn with our pooled stacks), as used
+// by sessions, with stackless ones (boost::asio::coroutine), which are what
+// a C++20 awaitable compiles down to: the memory used by an idle coroutine
+// waiting on a timer (like an idle session waiting for messages), and the cost
+// of suspending and resuming a coroutine through the io_context.
+// The number of coroutines is the only argument.
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <unistd.h>
+
+#include "bench_utils.hpp"
+#include "error.hpp"
+#include "util/stack_pool.hpp"
+
+using namespace chat;
+
+namespace {
+
+// The virtual and resident memory of the process, in bytes, from /proc/self/statm
+struct memory_usage
+{
+    std::size_t virtual_bytes{};
+    std::size_t resident_bytes{};
+};
+
+memory_usage get_memory_usage()
+{
+    memory_usage res;
+    std::size_t size = 0, resident = 0;
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (std::fscanf(f, "%zu %zu", &size, &resident) == 2)
+        {
+            auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            res = {size * page, resident * page};
+        }
+        std::fclose(f);
+    }
+    return res;
+}
+
+// Waits on a timer, like an idle session would
+struct stackless_waiter : boost::asio::coroutine
+{
+    boost::asio::steady_timer* timer;
+
+    void operator()(error_code = {})
+    {
+        BOOST_ASIO_CORO_REENTER(*this)
+        {
+            BOOST_ASIO_CORO_YIELD timer->async_wait(std::move(*this));
+        }
+    }
+};
+
+// Suspends and resumes itself the given number of times
+struct stackless_yielder : boost::asio::coroutine
+{
+    boost::asio::any_io_executor ex;
+    std::size_t remaining;
+
+    void operator()()
+    {
+        BOOST_ASIO_CORO_REENTER(*this)
+        {
+            while (remaining-- != 0u)
+            {
+                BOOST_ASIO_CORO_YIELD boost::asio::post(ex, std::move(*this));
+            }
+        }
+    }
+};
+
+// Launches num_coroutines idle coroutines with launch_fn, and prints the memory used by each one
+template <class LaunchFn>
+void measure_idle(std::string_view name, std::size_t num_coroutines, LaunchFn launch_fn)
+{
+    boost::asio::io_context ctx;
+    std::deque<boost::asio::steady_timer> timers;
+    for (std::size_t i = 0; i < num_coroutines; ++i)
+        timers.emplace_back(ctx, (boost::asio::steady_timer::time_point::max)());
+
+    // Run them until they're all waiting
+    auto before = get_memory_usage();
+    for (auto& timer : timers)
+        launch_fn(ctx, timer);
+    ctx.poll();
+    auto after = get_memory_usage();
+
+    std::cout << name << ": " << (after.virtual_bytes - before.virtual_bytes) / num_coroutines
+              << " virtual bytes, " << (after.resident_bytes - before.resident_bytes) / num_coroutines
+              << " resident bytes per idle coroutine\n";
+
+    // Finish them
+    for (auto& timer : timers)
+        timer.cancel();
+    ctx.run();
+}
+
+// Runs num_switches suspensions and resumptions with launch_fn, and prints the time each one takes
+template <class LaunchFn>
+void measure_switches(std::string_view name, std::size_t num_switches, LaunchFn launch_fn)
+{
+    boost::asio::io_context ctx;
+    launch_fn(ctx);
+    auto start = std::chrono::steady_clock::now();
+    ctx.run();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                  .count();
+    std::cout << name << ": " << static_cast<double>(ns) / num_switches << " ns/switch\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    auto num_coroutines = bench::get_iterations(argc, argv, 10000u);
+
+    // Stacks are mapped once per coroutine, but only the pages they touch are resident
+    measure_idle("stackful (session stack)", num_coroutines, [](auto& ctx, auto& timer) {
+        boost::asio::spawn(
+            ctx,
+            std::allocator_arg,
+            session_stack_allocator(),
+            [&timer](boost::asio::yield_context yield) {
+                error_code ec;
+                timer.async_wait(yield[ec]);
+            },
+            boost::asio::detached
+        );
+    });
+    measure_idle("stackful (task stack)", num_coroutines, [](auto& ctx, auto& timer) {
+        boost::asio::spawn(
+            ctx,
+            std::allocator_arg,
+            task_stack_allocator(),
+            [&timer](boost::asio::yield_context yield) {
+                error_code ec;
+                timer.async_wait(yield[ec]);
+            },
+            boost::asio::detached
+        );
+    });
+    measure_idle("stackless", num_coroutines, [](auto&, auto& timer) {
+        stackless_waiter w;
+        w.timer = &timer;
+        w();
+    });
+
+    // Context switches. The pools have been filled by the previous runs
+    auto num_switches = num_coroutines * 100u;
+    measure_switches("stackful", num_switches, [num_switches](auto& ctx) {
+        boost::asio::spawn(
+            ctx,
+            std::allocator_arg,
+            session_stack_allocator(),
+            [num_switches](boost::asio::yield_context yield) {
+                for (std::size_t i = 0; i < num_switches; ++i)
+                    boost::asio::post(yield);
+            },
+            boost::asio::detached
+        );
+    });
+    measure_switches("stackless", num_switches, [num_switches](auto& ctx) {
+        stackless_yielder{{}, ctx.get_executor(), num_switches}();
+    });
+}
@@ -0,0 +1,523 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Load generator for the websocket API. Creates some user accounts against a
+// running server, opens many authenticated websocket sessions, and posts messages
+// to rooms at a fixed rate. Every session is a member of the default rooms, so each message
+// is delivered to every session. The time between sending a message and receiving it in each
+// session is recorded, and a report with throughput and latency percentiles is printed.
+//
+// Usage: loadgen [--name=value]..., see print_usage for the options.
+// Messages are sent on a fixed schedule (open loop), and latencies are measured from
+// the time a message was scheduled to be sent. A server that falls behind thus shows
+// up as increased latency, rather than as a lower send rate.
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/write.hpp>
+#include <boost/beast/websocket/stream.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "util/metrics.hpp"
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+namespace websocket = boost::beast::websocket;
+using boost::system::error_code;
+using asio::ip::tcp;
+using std::chrono::steady_clock;
+
+namespace {
+
+// Command-line options
+struct config
+{
+    std::string host{"localhost"};
+    std::string port{"8080"};
+    std::size_t clients{1000};     // Websocket sessions to open
+    std::size_t users{10};         // Accounts to create. Sessions are distributed among them
+    std::size_t senders{100};      // Sessions that post messages
+    double rate{100.0};            // Messages per second, across all senders
+    std::size_t message_size{64};  // Bytes per message
+    std::size_t warmup{5};         // Seconds before starting measurements
+    std::size_t duration{30};      // Seconds measured
+    std::size_t threads{(std::max)(std::thread::hardware_concurrency(), 1u)};  // Each runs an io_context
+    std::uint64_t seed{1};         // Seeds room selection and send schedules
+    std::vector<std::string> rooms{"beast", "async", "db", "wasm"};
+};
+
+void print_usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [--name=value]...\n"
+              << "Options (defaults in parentheses):\n"
+              << "  --host          Server host (localhost)\n"
+              << "  --port          Server port (8080)\n"
+              << "  --clients       Websocket sessions to open (1000)\n"
+              << "  --users         User accounts to create (10)\n"
+              << "  --senders       Sessions that post messages (100)\n"
+              << "  --rate          Messages per second, across all senders (100)\n"
+              << "  --message-size  Bytes per message (64)\n"
+              << "  --warmup        Seconds to run before measuring (5)\n"
+              << "  --duration      Seconds to measure (30)\n"
+              << "  --threads       Client threads (hardware concurrency)\n"
+              << "  --seed          Random seed (1)\n"
+              << "  --rooms         Comma-separated rooms to post to (beast,async,db,wasm)\n";
+}
+
+std::vector<std::string> split_rooms(std::string_view value)
+{
+    std::vector<std::string> res;
+    while (!value.empty())
+    {
+        auto pos = value.find(',');
+        auto room = value.substr(0, pos);
+        if (!room.empty())
+            res.emplace_back(room);
+        value = pos == std::string_view::npos ? std::string_view() : value.substr(pos + 1);
+    }
+    return res;
+}
+
+// Returns false on error
+bool parse_args(int argc, char** argv, config& cfg)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.substr(0, 2) != "--" || eq == std::string_view::npos)
+            return false;
+        auto name = arg.substr(2, eq - 2);
+        std::string value(arg.substr(eq + 1));
+        auto to_size = [&value] {
+            return static_cast<std::size_t>(std::strtoull(value.c_str(), nullptr, 10));
+        };
+
+        if (name == "host")
+            cfg.host = value;
+        else if (name == "port")
+            cfg.port = value;
+        else if (name == "clients")
+            cfg.clients = to_size();
+        else if (name == "users")
+            cfg.users = to_size();
+        else if (name == "senders")
+            cfg.senders = to_size();
+        else if (name == "rate")
+            cfg.rate = std::strtod(value.c_str(), nullptr);
+        else if (name == "message-size")
+            cfg.message_size = to_size();
+        else if (name == "warmup")
+            cfg.warmup = to_size();
+        else if (name == "duration")
+            cfg.duration = to_size();
+        else if (name == "threads")
+            cfg.threads = to_size();
+        else if (name == "seed")
+            cfg.seed = to_size();
+        else if (name == "rooms")
+            cfg.rooms = split_rooms(value);
+        else
+            return false;
+    }
+
+    cfg.senders = (std::min)(cfg.senders, cfg.clients);
+    return cfg.clients > 0u && cfg.users > 0u && cfg.senders > 0u && cfg.rate > 0.0 && cfg.threads > 0u &&
+           cfg.duration > 0u && !cfg.rooms.empty();
+}
+
+// Creates an account and returns its session ID. Throws on error
+std::string create_account(const config& cfg, const tcp::resolver::results_type& endpoints, std::size_t idx)
+{
+    // Usernames must be unique across runs
+    auto run_id = std::chrono::system_clock::now().time_since_epoch().count();
+    auto username = "loadgen-" + std::to_string(run_id) + '-' + std::to_string(idx);
+
+    asio::io_context ctx;
+    beast::tcp_stream stream(ctx);
+    stream.connect(endpoints);
+
+    http::request<http::string_body> req(http::verb::post, "/api/create-account", 11);
+    req.set(http::field::host, cfg.host);
+    req.set(http::field::content_type, "application/json");
+    req.body() = R"({"username":")" + username + R"(","email":")" + username +
+                 R"(@loadgen.test","password":"Loadgen-password-10"})";
+    req.prepare_payload();
+    http::write(stream, req);
+
+    beast::flat_buffer buff;
+    http::response<http::string_body> res;
+    http::read(stream, buff, res);
+    if (res.result_int() / 100u != 2u)
+        throw std::runtime_error("Creating account " + username + " failed: " + res.body());
+
+    // The cookie looks like sid=<value>; attributes...
+    std::string_view cookie = res[http::field::set_cookie];
+    if (cookie.substr(0, 4) != "sid=")
+        throw std::runtime_error("Creating account " + username + " didn't return a session cookie");
+    cookie = cookie.substr(4);
+    return std::string(cookie.substr(0, cookie.find(';')));
+}
+
+// The time a message was scheduled, in nanoseconds since the steady clock's epoch
+std::int64_t to_ns(steady_clock::time_point tp)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+}
+
+// Messages sent by the load generator have the form lg:<scheduled time>:<padding>
+constexpr std::string_view content_marker = R"("content":"lg:)";
+
+std::string make_event(std::string_view room_id, std::int64_t scheduled_ns, std::size_t message_size)
+{
+    std::string content = "lg:" + std::to_string(scheduled_ns) + ':';
+    if (content.size() < message_size)
+        content.append(message_size - content.size(), 'x');
+    return R"({"type":"clientMessages","payload":{"roomId":")" + std::string(room_id) +
+           R"(","messages":[{"content":")" + content + R"("}]}})";
+}
+
+// State shared between all threads
+struct shared_run_state
+{
+    const config& cfg;
+    tcp::resolver::results_type endpoints;
+    std::vector<std::string> session_ids;
+
+    std::atomic<std::size_t> connected{0};
+    std::atomic<std::size_t> finished_connecting{0};  // Successfully or not
+    std::atomic<bool> stopping{false};
+
+    // The measurement window, in nanoseconds. Messages scheduled inside
+    // the window are counted. Zero until set by the main thread
+    std::atomic<std::int64_t> send_start_ns{0};
+    std::atomic<std::int64_t> window_start_ns{0};
+    std::atomic<std::int64_t> window_end_ns{0};
+
+    bool in_window(std::int64_t ns) const noexcept
+    {
+        return ns >= window_start_ns.load(std::memory_order_relaxed) &&
+               ns < window_end_ns.load(std::memory_order_relaxed);
+    }
+};
+
+// Per-thread results. Only accessed by the owning thread until it's
+// joined, so it doesn't need synchronization
+struct thread_stats
+{
+    chat::histogram_snapshot latency;
+    std::uint64_t max_latency_ns{};
+    std::uint64_t sent{};
+    std::uint64_t delivered{};
+    std::uint64_t connect_errors{};
+    std::uint64_t read_errors{};
+    std::uint64_t write_errors{};
+
+    void merge(const thread_stats& other)
+    {
+        for (std::size_t i = 0; i < latency.buckets.size(); ++i)
+            latency.buckets[i] += other.latency.buckets[i];
+        latency.sum_ns += other.latency.sum_ns;
+        max_latency_ns = (std::max)(max_latency_ns, other.max_latency_ns);
+        sent += other.sent;
+        delivered += other.delivered;
+        connect_errors += other.connect_errors;
+        read_errors += other.read_errors;
+        write_errors += other.write_errors;
+    }
+};
+
+using websocket_type = websocket::stream<beast::tcp_stream>;
+
+// Completion handler for coroutines. A failing client shouldn't abort the run
+void log_exception(std::exception_ptr exc)
+{
+    if (!exc)
+        return;
+    try
+    {
+        std::rethrow_exception(exc);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << "Client coroutine failed: " << err.what() << '\n';
+    }
+}
+
+// Records the latency of all our messages contained in an event
+void record_deliveries(std::string_view event, shared_run_state& st, thread_stats& stats)
+{
+    auto now_ns = to_ns(steady_clock::now());
+    for (auto pos = event.find(content_marker); pos != std::string_view::npos;
+         pos = event.find(content_marker, pos + 1u))
+    {
+        auto scheduled_ns = std::strtoll(event.data() + pos + content_marker.size(), nullptr, 10);
+        if (!st.in_window(scheduled_ns))
+            continue;
+        auto ns = static_cast<std::uint64_t>((std::max)(now_ns - scheduled_ns, std::int64_t(0)));
+        ++stats.latency.buckets[chat::latency_buckets::index(ns)];
+        stats.latency.sum_ns += ns;
+        stats.max_latency_ns = (std::max)(stats.max_latency_ns, ns);
+        ++stats.delivered;
+    }
+}
+
+// Posts messages on a fixed schedule until the run stops
+void run_sender(
+    websocket_type& ws,
+    std::size_t client_idx,
+    shared_run_state& st,
+    thread_stats& stats,
+    asio::yield_context yield
+)
+{
+    const auto& cfg = st.cfg;
+    asio::steady_timer timer(yield.get_executor());
+    std::mt19937_64 rng(cfg.seed + client_idx);
+    std::uniform_int_distribution<std::size_t> room_dist(0u, cfg.rooms.size() - 1u);
+    auto interval = std::chrono::duration_cast<steady_clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(cfg.senders) / cfg.rate)
+    );
+
+    // Wait until all clients have connected
+    while (st.send_start_ns.load(std::memory_order_acquire) == 0)
+    {
+        timer.expires_after(std::chrono::milliseconds(10));
+        timer.async_wait(yield);
+        if (st.stopping.load(std::memory_order_relaxed))
+            return;
+    }
+
+    // Spread senders' first messages over the interval, to avoid bursts
+    auto next = steady_clock::time_point(std::chrono::nanoseconds(st.send_start_ns.load())) +
+                std::chrono::duration_cast<steady_clock::duration>(
+                    interval * std::uniform_real_distribution<double>(0.0, 1.0)(rng)
+                );
+
+    std::string event;
+    while (!st.stopping.load(std::memory_order_relaxed))
+    {
+        error_code ec;
+        timer.expires_at(next);
+        timer.async_wait(yield[ec]);
+        if (st.stopping.load(std::memory_order_relaxed))
+            return;
+
+        auto scheduled_ns = to_ns(next);
+        event = make_event(cfg.rooms[room_dist(rng)], scheduled_ns, cfg.message_size);
+        ws.async_write(asio::buffer(event), yield[ec]);
+        if (ec)
+        {
+            ++stats.write_errors;
+            return;
+        }
+        if (st.in_window(scheduled_ns))
+            ++stats.sent;
+        next += interval;
+    }
+}
+
+// Connects a websocket session and reads messages until the run stops
+void run_client(std::size_t client_idx, shared_run_state& st, thread_stats& stats, asio::yield_context yield)
+{
+    const auto& cfg = st.cfg;
+    // The sender shares ownership of the websocket, so it's kept alive
+    // until both coroutines finish, even if reading fails first
+    auto ws_ptr = std::make_shared<websocket_type>(yield.get_executor());
+    auto& ws = *ws_ptr;
+    error_code ec;
+
+    // Connect and authenticate using the session cookie
+    const auto& sid = st.session_ids[client_idx % st.session_ids.size()];
+    ws.next_layer().async_connect(st.endpoints, yield[ec]);
+    if (!ec)
+    {
+        ws.set_option(websocket::stream_base::decorator([&sid](websocket::request_type& req) {
+            req.set(http::field::cookie, "sid=" + sid);
+        }));
+        ws.async_handshake(cfg.host, "/api/ws", yield[ec]);
+        ws.text(true);
+    }
+
+    // The first message is the hello event
+    beast::flat_buffer buff;
+    if (!ec)
+        ws.async_read(buff, yield[ec]);
+    ++st.finished_connecting;
+    if (ec)
+    {
+        ++stats.connect_errors;
+        return;
+    }
+    ++st.connected;
+    buff.consume(buff.size());
+
+    // Senders post from a separate coroutine. A websocket supports one read and one write in parallel
+    if (client_idx < cfg.senders)
+    {
+        asio::spawn(
+            yield.get_executor(),
+            [ws_ptr, client_idx, &st, &stats](asio::yield_context yield) {
+                run_sender(*ws_ptr, client_idx, st, stats, yield);
+            },
+            log_exception
+        );
+    }
+
+    // Read events
+    while (true)
+    {
+        ws.async_read(buff, yield[ec]);
+        if (ec)
+        {
+            if (!st.stopping.load(std::memory_order_relaxed))
+                ++stats.read_errors;
+            return;
+        }
+        std::string_view event(static_cast<const char*>(buff.data().data()), buff.size());
+        record_deliveries(event, st, stats);
+        buff.consume(buff.size());
+    }
+}
+
+double to_ms(std::uint64_t ns) { return static_cast<double>(ns) / 1e6; }
+
+void print_report(
+    const config& cfg,
+    const shared_run_state& st,
+    const thread_stats& stats,
+    std::chrono::duration<double> connect_time
+)
+{
+    auto secs = static_cast<double>(cfg.duration);
+    auto& os = std::cout;
+    os << "loadgen report\n";
+    os << "  server:     " << cfg.host << ':' << cfg.port << '\n';
+    os << "  clients:    " << cfg.clients << " (users " << cfg.users << ", senders " << cfg.senders
+       << ", threads " << cfg.threads << ")\n";
+    os << "  rooms:      ";
+    for (std::size_t i = 0; i < cfg.rooms.size(); ++i)
+        os << (i ? "," : "") << cfg.rooms[i];
+    os << '\n';
+    os << "  schedule:   " << cfg.rate << " msg/s, " << cfg.message_size << " bytes, seed " << cfg.seed
+       << ", warmup " << cfg.warmup << " s, duration " << cfg.duration << " s\n";
+    os << "  connected:  " << st.connected.load() << '/' << cfg.clients << " in " << connect_time.count()
+       << " s\n";
+    os << "  sent:       " << stats.sent << " (" << stats.sent / secs << " msg/s)\n";
+    os << "  delivered:  " << stats.delivered << " (" << stats.delivered / secs << " msg/s, "
+       << (stats.sent ? static_cast<double>(stats.delivered) / stats.sent : 0.0) << " per message)\n";
+    os << "  latency ms: p50 " << to_ms(stats.latency.quantile(0.5));
+    os << ", p90 " << to_ms(stats.latency.quantile(0.9));
+    os << ", p99 " << to_ms(stats.latency.quantile(0.99));
+    os << ", p99.9 " << to_ms(stats.latency.quantile(0.999));
+    os << ", max " << to_ms(stats.max_latency_ns) << '\n';
+    os << "  errors:     connect " << stats.connect_errors << ", read " << stats.read_errors << ", write "
+       << stats.write_errors << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    config cfg;
+    if (!parse_args(argc, argv, cfg))
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        // Resolve the server once
+        asio::io_context resolve_ctx;
+        tcp::resolver resolver(resolve_ctx);
+        shared_run_state st{cfg, resolver.resolve(cfg.host, cfg.port), {}};
+
+        // Create the accounts. This is slow (the server hashes passwords), so keep users low
+        std::cerr << "Creating " << cfg.users << " accounts...\n";
+        for (std::size_t i = 0; i < cfg.users; ++i)
+            st.session_ids.push_back(create_account(cfg, st.endpoints, i));
+
+        // Distribute clients among threads, each with its own io_context
+        std::cerr << "Connecting " << cfg.clients << " sessions...\n";
+        std::vector<thread_stats> stats(cfg.threads);
+        std::vector<std::unique_ptr<asio::io_context>> contexts;
+        for (std::size_t i = 0; i < cfg.threads; ++i)
+            contexts.push_back(std::make_unique<asio::io_context>(1));
+        for (std::size_t i = 0; i < cfg.clients; ++i)
+        {
+            auto thread_idx = i % cfg.threads;
+            asio::spawn(
+                *contexts[thread_idx],
+                [i, &st, &local_stats = stats[thread_idx]](asio::yield_context yield) {
+                    run_client(i, st, local_stats, yield);
+                },
+                log_exception
+            );
+        }
+        std::vector<std::thread> threads;
+        for (auto& ctx : contexts)
+            threads.emplace_back([&ctx] { ctx->run(); });
+
+        // Wait for all connections to complete
+        auto connect_start = steady_clock::now();
+        while (st.finished_connecting.load() < cfg.clients)
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::chrono::duration<double> connect_time = steady_clock::now() - connect_start;
+
+        // Start sending, warm up and measure. Then leave some time for in-flight messages to arrive
+        auto send_start = steady_clock::now();
+        auto window_start = send_start + std::chrono::seconds(cfg.warmup);
+        auto window_end = window_start + std::chrono::seconds(cfg.duration);
+        st.window_start_ns = to_ns(window_start);
+        st.window_end_ns = to_ns(window_end);
+        st.send_start_ns = to_ns(send_start);
+        std::cerr << "Running for " << cfg.warmup + cfg.duration << " seconds...\n";
+        std::this_thread::sleep_until(window_end + std::chrono::seconds(2));
+
+        // Stop
+        st.stopping = true;
+        for (auto& ctx : contexts)
+            ctx->stop();
+        for (auto& t : threads)
+            t.join();
+
+        thread_stats total;
+        for (const auto& s : stats)
+            total.merge(s);
+        print_report(cfg, st, total, connect_time);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
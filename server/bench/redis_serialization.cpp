@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Measures the serialization of messages to Redis streams and parsing
+// room history responses, in both the binary and the legacy JSON formats.
+
+#include <boost/redis/resp3/node.hpp>
+#include <boost/redis/resp3/type.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench_utils.hpp"
+#include "business_types.hpp"
+#include "services/redis_serialization.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+using chat::bench::run_benchmark;
+namespace resp3 = boost::redis::resp3;
+
+namespace {
+
+message make_message(std::size_t idx)
+{
+    return message{
+        "",
+        "Hello world! This is a reasonably-sized chat message, with \"escapes\" and some unicode: \xc3\xb1.",
+        parse_timestamp(1691666793896 + static_cast<std::int64_t>(idx)),
+        static_cast<std::int64_t>(idx % 10u),
+        nullptr,
+    };
+}
+
+// The legacy JSON representation of a message
+std::string make_json_payload(const message& msg)
+{
+    return R"({"user_id":)" + std::to_string(msg.user_id) + R"(,"content":")" + msg.content +
+           R"(","timestamp":)" + std::to_string(serialize_timestamp(msg.timestamp)) + "}";
+}
+
+// The response to an XREVRANGE for each room, as returned by Boost.Redis
+std::vector<resp3::node> make_history_response(std::size_t num_rooms, std::size_t num_messages, bool json)
+{
+    std::vector<resp3::node> res;
+    for (std::size_t room = 0; room < num_rooms; ++room)
+    {
+        res.push_back({resp3::type::array, num_messages, 0u, ""});
+        for (std::size_t i = 0; i < num_messages; ++i)
+        {
+            auto msg = make_message(i);
+            res.push_back({resp3::type::array, 2u, 1u, ""});
+            res.push_back({resp3::type::blob_string, 0u, 2u, std::to_string(1691666793896 + i) + "-0"});
+            res.push_back({resp3::type::array, 2u, 2u, ""});
+            res.push_back({resp3::type::blob_string, 0u, 3u, "payload"});
+            auto payload = json ? make_json_payload(msg) : serialize_redis_message(msg);
+            res.push_back({resp3::type::blob_string, 0u, 3u, std::move(payload)});
+        }
+    }
+    return res;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    auto iterations = bench::get_iterations(argc, argv, 10000u);
+
+    auto msg = make_message(0u);
+    std::cout << "serialize_redis_message (" << serialize_redis_message(msg).size() << " bytes)\n";
+    run_benchmark("  binary", iterations * 100u, [&] { return serialize_redis_message(msg).size(); });
+
+    // A hello event reads 4 rooms with a full message batch each
+    for (std::size_t num_messages : {1u, 100u})
+    {
+        std::cout << "parse_room_history_batch with 4 rooms of " << num_messages << " messages\n";
+        for (bool json : {false, true})
+        {
+            auto nodes = make_history_response(4u, num_messages, json);
+            run_benchmark(json ? "  JSON messages" : "  binary messages", iterations, [&] {
+                auto res = parse_room_history_batch(nodes);
+                return res.has_value() ? res->size() : 0u;
+            });
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Measures the utilities used when authenticating requests: base64 (session IDs
+// and password hashes), Cookie header parsing, email validation and scrypt.
+
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "bench_utils.hpp"
+#include "util/base64.hpp"
+#include "util/cookie.hpp"
+#include "util/email.hpp"
+#include "util/scrypt.hpp"
+
+using namespace chat;
+using chat::bench::run_benchmark;
+
+int main(int argc, char** argv)
+{
+    auto iterations = bench::get_iterations(argc, argv, 100000u);
+
+    // Session IDs are 16 random bytes. Password hashes and salts are 32.
+    // Compare every kernel supported by this CPU
+    constexpr std::pair<base64_kernel, std::string_view> kernels[]{
+        {base64_kernel::scalar, "scalar"},
+        {base64_kernel::ssse3,  "ssse3" },
+        {base64_kernel::avx2,   "avx2"  },
+    };
+    for (std::size_t size : {16u, 32u, 1024u, 65536u})
+    {
+        std::vector<unsigned char> input(size);
+        for (std::size_t i = 0; i < size; ++i)
+            input[i] = static_cast<unsigned char>(i * 7u);
+        auto encoded = base64_encode(input);
+
+        std::cout << "base64 with " << size << " bytes\n";
+        for (auto [kernel, kernel_name] : kernels)
+        {
+            if (!base64_kernel_supported(kernel))
+                continue;
+            std::string suffix = " (" + std::string(kernel_name) + ")";
+            run_benchmark("  base64_encode" + suffix, iterations, [&, k = kernel] {
+                return base64_encode(input, true, k).size();
+            });
+            run_benchmark("  base64_decode" + suffix, iterations, [&, k = kernel] {
+                auto res = base64_decode(encoded, true, k);
+                return res.has_value() ? res->size() : 0u;
+            });
+        }
+    }
+
+    // A Cookie header as sent by browsers, with some analytics cookies before the session one
+    constexpr std::string_view cookie_header =
+        "_ga=GA1.1.1234567890.1691666793; _ga_ABCDEF=GS1.1.1691666793.1.1.1691666800.0.0.0; "
+        "theme=dark; sid=q83vEjRWeJCrze8SNFZ4kA";
+    std::cout << "cookie_list (" << cookie_header.size() << " bytes)\n";
+    run_benchmark("  iterate", iterations, [&] {
+        std::size_t res = 0;
+        for (auto cookie : cookie_list(cookie_header))
+            res += cookie.value.size();
+        return res;
+    });
+    run_benchmark("  find_cookie", iterations, [&] {
+        auto res = cookie_list(cookie_header).find_cookie("sid");
+        return res ? res->size() : 0u;
+    });
+
+    std::cout << "is_email\n";
+    for (std::string_view email : {"user@example.com", "a.very.long.email.address+tag@subdomain.example.org"})
+        run_benchmark("  " + std::string(email), iterations, [&] { return is_email(email) ? 1u : 0u; });
+
+    // scrypt is intentionally expensive. Use the parameters we use for passwords
+    const unsigned char salt[salt_size]{};
+    std::cout << "scrypt_generate_hash (ln=" << default_ln << ", r=" << default_r << ", p=" << default_p
+              << ")\n";
+    run_benchmark("  hash", (std::max)(iterations / 10000u, std::size_t(1)), [&] {
+        return static_cast<std::size_t>(scrypt_generate_hash("Useruser10!", scrypt_params{}, salt)[0]);
+    });
+}
@@ -9,10 +9,14 @@
 #define SERVERTECHCHAT_SERVER_INCLUDE_API_API_TYPES_HPP
 
 #include <boost/core/span.hpp>
+#include <boost/json/storage_ptr.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <cstddef>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "business_types.hpp"
 #include "error.hpp"
@@ -44,8 +48,8 @@ struct create_account_request
     // Password to use.
     std::string password;
 
-    // Parses a request from a JSON string
-    static result<create_account_request> from_json(std::string_view from);
+    // Parses a request from a JSON string. The intermediate DOM is allocated using sp
+    static result<create_account_request> from_json(std::string_view from, boost::json::storage_ptr sp = {});
 };
 
 // The request for POST /login
@@ -57,8 +61,8 @@ struct login_request
     // Password to use.
     std::string password;
 
-    // Parses a request from a JSON string
-    static result<login_request> from_json(std::string_view from);
+    // Parses a request from a JSON string. The intermediate DOM is allocated using sp
+    static result<login_request> from_json(std::string_view from, boost::json::storage_ptr sp = {});
 };
 
 // A message as sent by the client
@@ -81,21 +85,89 @@ struct request_room_history_event
     std::string roomId;
 
     // ID of the earliest-in-time message that the client has.
-    // This is a pagination mechanism.
+    // This is a pagination mechanism: only messages older than this one are sent.
+    // If empty, the most recent messages are sent.
     std::string firstMessageId;
 };
 
+// Sent by the client to become a member of a room. Once joined, the client
+// receives the room's messages, including in subsequent sessions.
+struct join_room_event
+{
+    std::string roomId;
+};
+
+// The kinds of ephemeral activity that clients may report
+enum class activity_kind
+{
+    // The user is typing a message in the room
+    typing,
+
+    // The user is online, looking at the room
+    presence,
+
+    // The user has read the room's messages, up to a certain message
+    read,
+};
+
+// The wire representation of an activity_kind: "typing", "presence" or "read"
+std::string_view to_string(activity_kind kind) noexcept;
+
+// Sent by the client to report ephemeral activity (typing indicators, presence, read receipts)
+// in a room. These events are broadcast to the room's members, but never persisted,
+// and may be coalesced or discarded under load.
+struct client_activity_event
+{
+    std::string roomId;
+    activity_kind kind;
+
+    // For read receipts, the ID of the most recent message read. Empty for the other kinds
+    std::string messageId;
+};
+
+// Sent by the client to search the messages of a room it's a member of.
+// Only recent messages are searchable (see search_index)
+struct search_room_event
+{
+    std::string roomId;
+
+    // The words to search for. Messages containing all of them are returned
+    std::string query;
+};
+
 // A variant that can represent any event that may be received from the client,
 // or an error_code, if the client sent an invalid message
 using any_client_event = boost::variant2::variant<
     error_code,  // Invalid, used to report errors
     client_messages_event,
-    request_room_history_event>;
+    request_room_history_event,
+    join_room_event,
+    client_activity_event,
+    search_room_event>;
 
 // Parses a message received from the websocket client into a variant
 // holding any of the valid client-side events.
 any_client_event parse_client_event(std::string_view from);
 
+// A reusable parser for client events. It uses a streaming (SAX) JSON parser
+// that fills the events directly, without building a DOM. Parsing state is
+// reused between messages, so a session should keep an instance for its lifetime.
+// Unknown keys are ignored. Missing keys yield boost::json::error::size_mismatch.
+class client_event_parser
+{
+    struct impl;
+    std::unique_ptr<impl> impl_;
+
+public:
+    client_event_parser();
+    client_event_parser(client_event_parser&&) noexcept;
+    client_event_parser& operator=(client_event_parser&&) noexcept;
+    ~client_event_parser();
+
+    // Parses a message, like parse_client_event
+    any_client_event parse(std::string_view from);
+};
+
 //
 // Outgoing messages (HTTP responses and server events)
 //
@@ -130,13 +202,45 @@ struct api_error
     std::string to_json() const;
 };
 
+// An account that couldn't be created by POST /import-accounts
+struct import_account_error
+{
+    // The line of the request body containing the account, starting at 1
+    std::size_t line;
+
+    // Why it couldn't be created
+    api_error_id error_id;
+
+    // A human-readable explanation of the error. Empty for duplicate usernames and emails
+    std::string_view error_message;
+};
+
+// The response to POST /import-accounts
+struct import_accounts_response
+{
+    // The number of accounts created
+    std::size_t created;
+
+    // The accounts that couldn't be created, in the order they appear in the request
+    boost::span<const import_account_error> errors;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
+// Computes the JSON representation of a message, as included in server events.
+// The result may be stored in message::encoded, so events containing the message
+// are composed by copying the encoded bytes, rather than serializing the message again.
+std::shared_ptr<const std::string> encode_message(const message& msg, std::string_view username);
+
 // Sent to the client when it connects
 struct hello_event
 {
     // The current authenticated user
     const user& me;
 
-    // The list of chat rooms, with some message history
+    // The rooms the user is a member of. If the client requested lazy history loading,
+    // rooms don't contain any messages and have hasMoreMessages set
     boost::span<const room> rooms;
 
     // A user_id -> username map, to resolve user IDs into usernames
@@ -146,6 +250,19 @@ struct hello_event
     std::string to_json() const;
 };
 
+// Sent to the client as a response to a join_room_event
+struct room_joined_event
+{
+    // The room that was joined, with some message history (unless history is loaded lazily)
+    const room& joined_room;
+
+    // A user_id -> username map, to resolve user IDs into usernames
+    const username_map& usernames;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
 // Broadcast by the server to all clients in a room to signal that some messages arrived
 struct server_messages_event
 {
@@ -162,6 +279,107 @@ struct server_messages_event
     std::string to_json() const;
 };
 
+// A server_messages_event with messages sent by several users. Composed when the messages
+// published to a room within a short time are merged into a single broadcast
+// (see broadcast_aggregator). Serialized like server_messages_event
+struct aggregated_server_messages_event
+{
+    // The room ID
+    std::string_view room_id;
+
+    // The actual messages
+    boost::span<const message> messages;
+
+    // A user_id -> username map, containing the users that sent the messages
+    const username_map& usernames;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
+// An owning version of server_messages_event, obtained by parsing its JSON representation.
+// Used by the components that observe the messages broadcast to clients.
+struct parsed_server_messages_event
+{
+    // The room ID
+    std::string room_id;
+
+    // A user_id -> username map, containing the users that sent the messages
+    username_map usernames;
+
+    // The actual messages
+    std::vector<message> messages;
+};
+
+// Parses a JSON string generated by server_messages_event::to_json.
+// The intermediate DOM is allocated using sp
+result<parsed_server_messages_event> parse_server_messages_event(
+    std::string_view from,
+    boost::json::storage_ptr sp = {}
+);
+
+// A change to a message that was broadcast before being stored (see optimistic broadcast)
+struct message_id_correction
+{
+    // The ID the message was broadcast with
+    std::string id;
+
+    // The ID the message was stored with. Empty if the message couldn't be stored,
+    // in which case clients should discard it
+    std::string new_id;
+};
+
+// Broadcast by the server to all clients in a room when some messages that were
+// broadcast before being stored got a different ID, or couldn't be stored
+struct server_messages_corrected_event
+{
+    // The room ID
+    std::string_view room_id;
+
+    // The messages that changed
+    boost::span<const message_id_correction> corrections;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
+// An owning version of server_messages_corrected_event, obtained by parsing its JSON representation
+struct parsed_server_messages_corrected_event
+{
+    // The room ID
+    std::string room_id;
+
+    // The messages that changed
+    std::vector<message_id_correction> corrections;
+};
+
+// Parses a JSON string generated by server_messages_corrected_event::to_json.
+// The intermediate DOM is allocated using sp
+result<parsed_server_messages_corrected_event> parse_server_messages_corrected_event(
+    std::string_view from,
+    boost::json::storage_ptr sp = {}
+);
+
+// Broadcast by the server to all clients in a room when a user reports some activity.
+// Composed from a client_activity_event
+struct server_activity_event
+{
+    // The room ID
+    std::string_view room_id;
+
+    // The user that reported the activity
+    const user& sending_user;
+
+    // What the user is doing
+    activity_kind kind;
+
+    // For read receipts, the ID of the most recent message read
+    std::string_view message_id;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
 // Sent to the client as a response to a request_room_history_event
 struct room_history_event
 {
@@ -178,6 +396,45 @@ struct room_history_event
     std::string to_json() const;
 };
 
+// Same as room_history_event, but composed from messages that reference a database
+// response. This avoids copying messages that won't be cached
+struct room_history_view_event
+{
+    // The room ID
+    std::string_view room_id;
+
+    // The actual messages, most recent first
+    boost::span<const message_view> messages;
+
+    // true if there are more messages that could be loaded
+    bool has_more;
+
+    // A user_id -> username map, to resolve user IDs into usernames
+    const username_map& usernames;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
+// Sent to the client as a response to a search_room_event
+struct room_search_results_event
+{
+    // The room ID
+    std::string_view room_id;
+
+    // The query, as sent by the client
+    std::string_view query;
+
+    // The messages that matched, most recent first
+    boost::span<const message> messages;
+
+    // A user_id -> username map, to resolve user IDs into usernames
+    const username_map& usernames;
+
+    // Serializes the object as a JSON string.
+    std::string to_json() const;
+};
+
 }  // namespace chat
 
 #endif
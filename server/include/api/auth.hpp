@@ -25,6 +25,19 @@ response_builder::response_type handle_create_account(
     boost::asio::yield_context yield
 );
 
+// POST /import-accounts. Creates accounts in bulk (e.g. when migrating users from another system).
+// The request body has an account per line, as a JSON object with the same fields as /create-account
+// (Content-Type: application/x-ndjson). Requests must carry an "Authorization: Bearer <token>" header,
+// with the token in IMPORT_ACCOUNTS_TOKEN. If it's unset, imports are disabled and this returns 404.
+// The response contains the number of accounts created, and the lines that couldn't be created
+// (e.g. because their username or email already exist). Accounts are created in batches,
+// so if the request fails, some of them may have been created. No sessions are created
+response_builder::response_type handle_import_accounts(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
 // POST /login
 response_builder::response_type handle_login(
     request_context& ctx,
@@ -32,6 +45,13 @@ response_builder::response_type handle_login(
     boost::asio::yield_context yield
 );
 
+// POST /logout
+response_builder::response_type handle_logout(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
 }  // namespace chat
 
 #endif
@@ -0,0 +1,48 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_API_METRICS_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_API_METRICS_HPP
+
+#include <boost/asio/spawn.hpp>
+
+#include "request_context.hpp"
+
+// API handler functions for monitoring endpoints
+
+namespace chat {
+
+class shared_state;
+
+// GET /metrics. Exports server metrics in the Prometheus text format.
+// Disabled (404) if METRICS_ENABLED is set to false
+response_builder::response_type handle_metrics(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
+// GET /traces. Exports the most recent traces kept by the global trace_collector, as JSON.
+// Disabled (404) if METRICS_ENABLED is set to false
+response_builder::response_type handle_traces(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
+// GET /ready. Returns 200 once the server has set up the databases and warmed up
+// the caches of all threads, and 503 before that, or while draining.
+// For load balancer health checks, so it's enabled even if METRICS_ENABLED is false
+response_builder::response_type handle_ready(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
+}  // namespace chat
+
+#endif
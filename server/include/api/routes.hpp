@@ -0,0 +1,90 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_API_ROUTES_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_API_ROUTES_HPP
+
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/url/segments_encoded_view.hpp>
+
+#include <string_view>
+
+#include "request_context.hpp"
+
+// The HTTP API endpoints (/api/...) are described by a static route table.
+// Requests are matched against it without allocating, and then go through
+// a pipeline of middleware, which may reply instead of the endpoint handler
+// (e.g. if the databases aren't ready yet).
+
+namespace chat {
+
+class shared_state;
+
+// All endpoint handlers have this signature. param is the extra path segment,
+// for routes that take one, and empty otherwise
+using api_handler = response_builder::response_type (*)(
+    request_context& ctx,
+    shared_state& st,
+    std::string_view param,
+    boost::asio::yield_context yield
+);
+
+// An API endpoint
+struct api_route
+{
+    // The path segment after /api
+    std::string_view path;
+
+    // Does the route take an extra path segment, like /api/uploads/<id>?
+    bool has_param;
+
+    // The method the route accepts, or http::verb::unknown if the handler checks it
+    boost::beast::http::verb method;
+
+    // Endpoints using the databases can't be served until the schema has been set up.
+    // Monitoring endpoints don't use them
+    bool requires_db;
+
+    api_handler handler;
+};
+
+// The result of matching a request against the route table
+struct api_route_match
+{
+    // The route for the requested path, or nullptr if none matches it
+    const api_route* route;
+
+    // Does the route accept the requested method?
+    bool method_allowed;
+
+    // The extra path segment, for routes that take one
+    std::string_view param;
+};
+
+// Finds the route for a request, given the percent-encoded segments of its path,
+// which must start with "api". Doesn't allocate
+api_route_match match_api_route(
+    boost::urls::segments_encoded_view segs,
+    boost::beast::http::verb method
+) noexcept;
+
+// Returns whether the body of a request should be streamed (see body_stream)
+// rather than read into memory before invoking the handler. This is the case
+// for file uploads and account imports, which may not fit in memory
+bool streams_request_body(boost::beast::http::verb method, std::string_view target) noexcept;
+
+// Serves a request to /api/..., finding its route and running it through the middleware
+response_builder::response_type handle_api_request(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
+}  // namespace chat
+
+#endif
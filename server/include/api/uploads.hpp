@@ -0,0 +1,51 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_API_UPLOADS_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_API_UPLOADS_HPP
+
+#include <boost/asio/spawn.hpp>
+
+#include <string_view>
+
+#include "request_context.hpp"
+
+// API handler functions for file uploads (see upload_store). All of them require authentication,
+// and return 404 if uploads are disabled. The protocol resembles tus (https://tus.io):
+//   - POST /uploads creates an upload. The Upload-Length header contains the file size, and
+//     Upload-Content-Type its content type (application/octet-stream by default). Returns 201,
+//     with the upload's URL in the Location header.
+//   - PATCH /uploads/<id> appends the request body to the upload. The Upload-Offset header
+//     must match the number of bytes received so far (409 otherwise). Returns 204,
+//     with the updated Upload-Offset. If the request is interrupted, the bytes received are kept.
+//   - HEAD /uploads/<id> returns the Upload-Offset and Upload-Length of an upload, to resume it.
+//   - GET /uploads/<id> downloads a complete upload.
+// Only the user that created an upload can append to it. Any authenticated user can download it,
+// so messages can reference uploads by URL.
+
+namespace chat {
+
+class shared_state;
+
+// POST /uploads
+response_builder::response_type handle_create_upload(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+);
+
+// HEAD, GET or PATCH /uploads/<upload_id>
+response_builder::response_type handle_upload(
+    request_context& ctx,
+    shared_state& st,
+    std::string_view upload_id,
+    boost::asio::yield_context yield
+);
+
+}  // namespace chat
+
+#endif
@@ -8,7 +8,9 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_BUSINESS_TYPES_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_BUSINESS_TYPES_HPP
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 #include "timestamp.hpp"
@@ -35,6 +37,9 @@ struct auth_user
     // User ID
     std::int64_t id;
 
+    // Username. Signed session tokens contain it
+    std::string username;
+
     // PHC-format password hash
     std::string hashed_password;
 };
@@ -53,6 +58,22 @@ struct message
 
     // ID of the user that sent the message
     std::int64_t user_id{};
+
+    // The message's JSON representation, as sent to clients, or nullptr if it
+    // hasn't been computed yet. Messages are immutable once stored, so this can be
+    // computed once and shared by all the events containing the message (see encode_message).
+    std::shared_ptr<const std::string> encoded{};
+};
+
+// A message that doesn't own its strings. Used to compose events directly
+// from database responses, without copying messages. The buffers it points
+// to must be kept alive by its user.
+struct message_view
+{
+    std::string_view id;
+    std::string_view content;
+    timestamp_t timestamp;
+    std::int64_t user_id{};
 };
 
 // A room history message batch
@@ -63,6 +84,10 @@ struct message_batch
 
     // true if there are more messages that could be loaded
     bool has_more{};
+
+    // true if the batch only contains the messages newer than the ones a reconnecting
+    // client already has. Clients merge these into their history, rather than replacing it
+    bool is_delta{};
 };
 
 // A chat room
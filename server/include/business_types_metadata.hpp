@@ -17,7 +17,7 @@
 
 namespace chat {
 
-BOOST_DESCRIBE_STRUCT(auth_user, (), (id, hashed_password))
+BOOST_DESCRIBE_STRUCT(auth_user, (), (id, username, hashed_password))
 BOOST_DESCRIBE_STRUCT(user, (), (id, username))
 
 }  // namespace chat
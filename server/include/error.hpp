@@ -60,6 +60,18 @@ enum class errc
     invalid_base64,  // attempt to decode an invalid base64 string
     uncaught_exception,    // an API handler threw an unexpected exception
     invalid_content_type,  // an endpoint received an unsupported Content-Type
+    queue_full,            // a bounded queue can't accept more work
+    invalid_config,        // a configuration value (e.g. an environment variable) is invalid
+    slow_consumer,         // a client didn't read messages fast enough, and its send queue overflowed
+    not_room_member,       // a client attempted to use a room it hasn't joined
+    hpack_decode_error,    // a HTTP/2 header block was malformed
+    http2_protocol_error,  // a HTTP/2 peer violated the protocol
+    spool_full,            // the local message spool can't hold more messages
+    spool_corrupted,       // a file that should contain a message spool has an invalid format
+    upload_in_progress,    // another request is writing to the same upload
+    upload_corrupted,      // the metadata of an upload has an invalid format
+    snapshot_corrupted,    // a file that should contain a history snapshot is invalid or has another version
+    too_many_uploads,      // a user can't create more uploads until they complete some of them
 };
 
 // The error category for errc
@@ -0,0 +1,41 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_HTTP2_SESSION_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_HTTP2_SESSION_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+
+#include <memory>
+
+#include "util/client_socket.hpp"
+
+namespace chat {
+
+// Forward declaration
+class shared_state;
+
+// Whether HTTP/2 is enabled (the default). Otherwise, all clients use HTTP/1.1
+bool http2_enabled();
+
+// Runs a HTTP/2 session until the connection is closed or an error is encountered.
+// buff contains any data already read from the socket, starting with the client preface.
+// Requests are handled concurrently, each one in its own coroutine, by the same
+// handlers used for HTTP/1.1. Websockets are only supported over HTTP/1.1.
+void run_http2_session(
+    client_socket&& stream,
+    boost::beast::flat_buffer&& buff,
+    std::shared_ptr<shared_state> state,
+    const boost::asio::ip::address& client_address,
+    boost::asio::yield_context yield
+);
+
+}  // namespace chat
+
+#endif
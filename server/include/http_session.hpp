@@ -8,25 +8,53 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_HTTP_SESSION_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_HTTP_SESSION_HPP
 
+#include <boost/asio/ip/address.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/message_generator.hpp>
+#include <boost/beast/http/string_body.hpp>
 
 #include <cstddef>
 #include <memory>
+#include <optional>
+
+#include "util/admission_controller.hpp"
+#include "util/client_socket.hpp"
+#include "util/sendfile.hpp"
 
 namespace chat {
 
-// Forward declaration
+// Forward declarations
 class shared_state;
+class arena;
+class body_stream;
 
 // Runs a HTTP session until the connection is closed or an error is encountered.
 // This will serve static files over HTTP or run a websocket session, depending
-// on what the client requested.
+// on what the client requested. The TLS handshake, if any, must have been performed.
+// admission holds the memory reserved for the connection, and is used to reserve
+// more if the connection is upgraded to a websocket
 void run_http_session(
-    boost::asio::ip::tcp::socket&& socket,
+    client_socket&& stream,
+    admission_controller::ticket& admission,
     std::shared_ptr<shared_state> state,
     boost::asio::yield_context yield
 );
 
+// Handles a request, independently of the protocol version it was received with.
+// If the response body must be sent directly from a file,
+// the response only contains the headers, and file is set.
+// If body is not null, req doesn't contain the body, which is read from body instead
+boost::beast::http::message_generator handle_http_request(
+    boost::beast::http::request<boost::beast::http::string_body>&& req,
+    arena& request_arena,
+    const boost::asio::ip::address& client_address,
+    shared_state& st,
+    std::optional<file_transfer>& file,
+    boost::asio::yield_context yield,
+    body_stream* body = nullptr
+);
+
 }  // namespace chat
 
 #endif
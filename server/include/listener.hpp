@@ -17,16 +17,27 @@
 
 namespace chat {
 
-// Forward declaration
+// Forward declarations
 class shared_state;
+class tls_context;
 
 // Launchs a HTTP listener that will accept connections in a loop until
 // the underlying I/O context is stopped. Returns a non-zero error_code
 // if the listener was unable to launch (e.g. the port to bind to is not available).
+// If reuse_port is true, the SO_REUSEPORT option is set, which allows several
+// listeners (one per thread) to bind to the same endpoint. The kernel then
+// load-balances incoming connections between them.
+// If tls is not null, connections secured with TLS are also accepted on tls_endpoint.
+// If incoming_cpu is not negative, the listening sockets prefer connections whose packets
+// are processed by that CPU (SO_INCOMING_CPU). This should be the CPU the listener runs on.
 error_code launch_http_listener(
     boost::asio::any_io_executor ex,
     boost::asio::ip::tcp::endpoint listening_endpoint,
-    std::shared_ptr<shared_state> state
+    std::shared_ptr<shared_state> state,
+    bool reuse_port = false,
+    std::shared_ptr<const tls_context> tls = nullptr,
+    boost::asio::ip::tcp::endpoint tls_endpoint = {},
+    int incoming_cpu = -1
 );
 
 }  // namespace chat
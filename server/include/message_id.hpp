@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_MESSAGE_ID_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_MESSAGE_ID_HPP
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Helpers to work with message IDs.
+// Message IDs are Redis stream IDs, with format <milliseconds>-<sequence number>.
+// Both components are unsigned integers. IDs are ordered by (milliseconds, sequence number)
+
+namespace chat {
+
+struct parsed_message_id
+{
+    std::uint64_t ms;
+    std::uint64_t seq;
+};
+
+// Parses a message ID. The sequence number may be omitted, in which case it's zero.
+// Returns an empty optional if id is not valid
+inline std::optional<parsed_message_id> parse_message_id(std::string_view id) noexcept
+{
+    // Parses an unsigned integer spanning all the input
+    auto parse_number = [](std::string_view s, std::uint64_t& to) {
+        if (s.empty() || s.front() < '0' || s.front() > '9')
+            return false;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), to);
+        return res.ec == std::errc() && res.ptr == s.data() + s.size();
+    };
+
+    parsed_message_id res{};
+    auto dash_pos = id.find('-');
+    if (!parse_number(id.substr(0, dash_pos), res.ms))
+        return std::nullopt;
+    if (dash_pos != std::string_view::npos && !parse_number(id.substr(dash_pos + 1), res.seq))
+        return std::nullopt;
+    return res;
+}
+
+// Orders message IDs, by time and then by sequence number
+inline bool operator<(const parsed_message_id& lhs, const parsed_message_id& rhs) noexcept
+{
+    return lhs.ms < rhs.ms || (lhs.ms == rhs.ms && lhs.seq < rhs.seq);
+}
+
+// Formats a message ID into its string representation
+inline std::string format_message_id(parsed_message_id id)
+{
+    return std::to_string(id.ms) + '-' + std::to_string(id.seq);
+}
+
+}  // namespace chat
+
+#endif
@@ -8,6 +8,8 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_REQUEST_CONTEXT_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_REQUEST_CONTEXT_HPP
 
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/spawn.hpp>
 #include <boost/beast/http/error.hpp>
 #include <boost/beast/http/field.hpp>
 #include <boost/beast/http/fields.hpp>
@@ -15,17 +17,22 @@
 #include <boost/beast/http/message_generator.hpp>
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/verb.hpp>
+#include <boost/core/span.hpp>
 #include <boost/url/error_types.hpp>
 #include <boost/url/url_view.hpp>
 
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 
 #include "api/api_types.hpp"
 #include "error.hpp"
+#include "util/arena.hpp"
+#include "util/sendfile.hpp"
 
 // Contains a request_context class, which encapsulates a Boost.Beast HTTP request
 // and provides an easy way to build HTTP responses.
@@ -60,12 +67,45 @@ public:
         return *this;
     }
 
+    // Sets a header in the response, replacing any previous value
+    response_builder& set_header(std::string_view name, std::string_view value)
+    {
+        assert(!used_);
+        header_.set(name, value);
+        return *this;
+    }
+
     // Sends a file as response. If only_headers is true, it will only send
     // the headers, and not the body (useful for HEAD requests).
     // Sends a 404 reponse if the file doesn't exist.
     // path must be absolute. No sanitization is performed on path - care must be
     // taken to prevent directory traversal attacks.
-    response_type file_response(const char* path, bool only_headers = false);
+    // range is the value of the Range header (empty if not present). Single ranges are honored.
+    // Big files and ranges are not sent as part of the returned response: the returned
+    // response only contains the headers, and the body must be sent afterwards
+    // using the file_transfer returned by request_context::take_file_transfer.
+    // content_type is the Content-Type of the response. If empty, it's inferred from path.
+    response_type file_response(
+        const char* path,
+        bool only_headers = false,
+        std::string_view range = {},
+        std::string_view content_type = {}
+    );
+
+    // Sends a file held in memory as response. The content type is inferred from path.
+    // content is not copied, so it must be kept alive until the response is sent.
+    // content_encoding is the value of the Content-Encoding header (empty for none).
+    response_type memory_file_response(
+        std::string_view path,
+        std::string_view content,
+        std::string_view etag,
+        std::string_view content_encoding,
+        bool only_headers = false
+    );
+
+    // Returns a "not modified" response (304), for conditional requests
+    // that matched the passed ETag.
+    response_type not_modified(std::string_view etag);
 
     // Sends a 200 response with a JSON body. The type T must have a to_json() const
     // member function returning a string that performs the JSON serialization.
@@ -75,9 +115,15 @@ public:
         return json_response_impl(value.to_json());
     }
 
+    // Sends a 200 response with a text body of the given content type.
+    response_type text_response(std::string content, std::string_view content_type);
+
     // Returns an empty response (204).
     response_type empty_response();
 
+    // Returns an empty response with a 201 status and a Location header pointing to location.
+    response_type created(std::string_view location);
+
     // Returns a "method not allowed" response with a simple plaintext body.
     response_type method_not_allowed()
     {
@@ -96,6 +142,42 @@ public:
         return plaintext_response(boost::beast::http::status::not_found, "Not found");
     }
 
+    // Returns an "unauthorized" response with a simple plaintext body.
+    // Used when an endpoint requires authentication, but the session cookie is missing or invalid.
+    response_type unauthorized_text()
+    {
+        return plaintext_response(boost::beast::http::status::unauthorized, "Unauthorized");
+    }
+
+    // Returns a "conflict" response with a simple plaintext body.
+    // Used when a request conflicts with the current state of a resource
+    response_type conflict_text(std::string why)
+    {
+        return plaintext_response(boost::beast::http::status::conflict, std::move(why));
+    }
+
+    // Returns a "payload too large" response with a simple plaintext body.
+    response_type payload_too_large_text()
+    {
+        return plaintext_response(boost::beast::http::status::payload_too_large, "Payload too large");
+    }
+
+    // Returns a "service unavailable" response with a simple plaintext body.
+    // Used when the server is overloaded and sheds load. Clients may retry after some time.
+    response_type service_unavailable_text()
+    {
+        header_.set(boost::beast::http::field::retry_after, "1");
+        return plaintext_response(boost::beast::http::status::service_unavailable, "Service unavailable");
+    }
+
+    // Returns a "too many requests" response with a simple plaintext body.
+    // Used when a client exceeds a rate limit. retry_after is the suggested time to wait
+    response_type too_many_requests_text(std::chrono::seconds retry_after)
+    {
+        header_.set(boost::beast::http::field::retry_after, std::to_string(retry_after.count()));
+        return plaintext_response(boost::beast::http::status::too_many_requests, "Too many requests");
+    }
+
     // Returns an error response, with a JSON body describing what happened.
     // See the api_error struct for the JSON schema of this response.
     // Used by the API, to communicate errors that are likely  to happen during normal operation
@@ -134,6 +216,7 @@ private:
     bool keep_alive_;
     header_type header_;
     bool used_{};
+    std::optional<file_transfer> file_transfer_;
 
     response_builder(unsigned version, bool keep_alive);
     response_type plaintext_response(boost::beast::http::status status, std::string content);
@@ -157,6 +240,19 @@ private:
     friend class request_context;
 };
 
+// Reads the body of a request incrementally. Endpoints that accept bodies too big
+// to be held in memory (like uploads) get their body through this interface,
+// rather than having it read before the handler is invoked
+class body_stream
+{
+public:
+    virtual ~body_stream() = default;
+
+    // Reads some body bytes into buff, returning the number of bytes read.
+    // Returns zero once the entire body has been read
+    virtual result<std::size_t> read_some(boost::span<char> buff, boost::asio::yield_context yield) = 0;
+};
+
 // Encapsulates a Boost.Beast request and provides an easy way to build responses.
 // Intended to be passed to the HTTP API handler functions.
 class request_context
@@ -165,9 +261,22 @@ public:
     // The Boost.Beast request type
     using request_type = boost::beast::http::request<boost::beast::http::string_body>;
 
-    // Constructor
-    request_context(request_type&& req)
-        : request_(std::move(req)), response_(request_.version(), request_.keep_alive())
+    // Constructor. Temporary objects created while handling the request
+    // are allocated from request_arena, which must outlive this object.
+    // client_address is the address of the peer that sent the request.
+    // If body is not null, the request body hasn't been read yet, and is read from body,
+    // which must outlive this object
+    request_context(
+        request_type&& req,
+        arena& request_arena,
+        boost::asio::ip::address client_address = boost::asio::ip::address(),
+        body_stream* body = nullptr
+    )
+        : request_(std::move(req)),
+          response_(request_.version(), request_.keep_alive()),
+          arena_(&request_arena),
+          client_address_(client_address),
+          body_(body)
     {
     }
 
@@ -188,7 +297,7 @@ public:
 
     // Attempts to parse the request body as JSON, and converts the result
     // to type T. T must have a static member function with signature
-    // result<T> from_json(std::string_view).
+    // result<T> from_json(std::string_view, boost::json::storage_ptr).
     // The request content-type is validated before attempting the parse.
     template <class T>
     result<T> parse_json_body() const
@@ -197,16 +306,47 @@ public:
         if (!is_json_content_type())
             CHAT_RETURN_ERROR(errc::invalid_content_type)
 
-        // Parse the json
-        return T::from_json(request_.body());
+        // Parse the json. The DOM is only used during parsing, so it can live in the arena
+        return T::from_json(request_.body(), arena_->json_storage());
     }
 
+    // Reads the next bytes of the request body into buff, returning the number of bytes read
+    // (zero at the end of the body). The body is read from the body_stream passed
+    // to the constructor or, if there is none, from the request held in memory.
+    result<std::size_t> read_body_some(boost::span<char> buff, boost::asio::yield_context yield);
+
+    // Returns the value of a request header, or an empty string if it's not present
+    std::string_view request_header(boost::beast::http::field name) const
+    {
+        auto it = request_.find(name);
+        return it == request_.end() ? std::string_view() : std::string_view(it->value());
+    }
+
+    // Returns all the request headers
+    const boost::beast::http::fields& request_headers() const noexcept { return request_; }
+
+    // Returns the address of the peer that sent the request
+    const boost::asio::ip::address& client_address() const noexcept { return client_address_; }
+
     // Returns a response_builder object
     response_builder& response() noexcept { return response_; }
 
+    // Returns the file contents that must be sent after the response, if any (see file_response)
+    std::optional<file_transfer> take_file_transfer() noexcept
+    {
+        return std::exchange(response_.file_transfer_, std::nullopt);
+    }
+
+    // Returns the arena to use for temporary objects while handling the request
+    arena& request_arena() noexcept { return *arena_; }
+
 private:
     request_type request_;
     response_builder response_;
+    arena* arena_;
+    boost::asio::ip::address client_address_;
+    body_stream* body_;
+    std::size_t body_offset_{};
     std::optional<boost::urls::url_view> target_;
 
     bool is_json_content_type() const;
@@ -0,0 +1,38 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_ROOMS_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_ROOMS_HPP
+
+#include <array>
+#include <string_view>
+
+// The chat rooms created when the database is set up. Rooms are stored in MySQL,
+// and every user is a member of the default ones. Other rooms are created
+// by inserting them in the rooms table, and users join them explicitly.
+// Default rooms are displayed in the order they're listed here.
+
+namespace chat {
+
+inline constexpr std::array<std::string_view, 4> default_room_ids{
+    "beast",
+    "async",
+    "db",
+    "wasm",
+};
+
+// User-facing room names, in the same order as default_room_ids
+inline constexpr std::array<std::string_view, default_room_ids.size()> default_room_names{
+    "Boost.Beast",
+    "Boost.Async",
+    "Database connectors",
+    "Web assembly",
+};
+
+}  // namespace chat
+
+#endif
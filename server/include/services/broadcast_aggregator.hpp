@@ -0,0 +1,97 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_BROADCAST_AGGREGATOR_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_BROADCAST_AGGREGATOR_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/core/span.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "business_types.hpp"
+
+// Broadcasting a serverMessages event costs a message per subscriber, so busy rooms with
+// many subscribers make fan-out the bottleneck. For these rooms, the messages published
+// within a short window are merged into a single serverMessages event, bounding the number
+// of broadcasts per second regardless of how many messages are sent.
+
+namespace chat {
+
+class pubsub_service;
+
+// Configures broadcast aggregation
+struct broadcast_aggregation_config
+{
+    // Rooms with at least this many subscribers in a shard are aggregated. Zero disables aggregation
+    std::size_t min_subscribers{1000u};
+
+    // Messages published to an aggregated room within this window are merged
+    std::chrono::milliseconds window{5};
+
+    // Pending messages are published before the window ends if a room accumulates this many
+    std::size_t max_messages{256u};
+};
+
+// Reads the broadcast_aggregation_config from the environment: BROADCAST_AGGREGATION_SUBSCRIBERS
+// sets the minimum number of subscribers, and BROADCAST_AGGREGATION_MS the window
+const broadcast_aggregation_config& get_broadcast_aggregation_config();
+
+// Publishes the messages sent by users as serverMessages events, aggregating them
+// for rooms with many subscribers. There is one per shard. Not thread-safe.
+class broadcast_aggregator
+{
+    // The messages waiting for the window to end, for a room
+    struct pending_room
+    {
+        std::string room_id;
+        std::vector<message> messages;
+        username_map usernames;
+    };
+
+    pubsub_service& pubsub_;
+    broadcast_aggregation_config cfg_;
+
+    // In the order the rooms got their first pending message
+    std::vector<pending_room> pending_;
+    boost::asio::steady_timer flush_timer_;
+
+    pending_room* find_pending(std::string_view room_id) noexcept;
+    void publish_pending(pending_room& room);
+
+public:
+    // pubsub must outlive this object
+    broadcast_aggregator(
+        boost::asio::any_io_executor ex,
+        pubsub_service& pubsub,
+        const broadcast_aggregation_config& cfg = get_broadcast_aggregation_config()
+    );
+    broadcast_aggregator(const broadcast_aggregator&) = delete;
+    broadcast_aggregator& operator=(const broadcast_aggregator&) = delete;
+
+    // Publishes messages, sent by sending_user, to the subscribers of room_id.
+    // If the room has few subscribers, they're published straight away, as a single event.
+    // Otherwise, they're published once the window ends, merged with the other messages
+    // published to the room in the meantime. Messages in a room are always published in order
+    void publish_messages(
+        std::string_view room_id,
+        const user& sending_user,
+        boost::span<const message> msgs
+    );
+
+    // Publishes all pending messages straight away
+    void flush();
+};
+
+}  // namespace chat
+
+#endif
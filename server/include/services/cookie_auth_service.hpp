@@ -11,7 +11,12 @@
 #include <boost/asio/spawn.hpp>
 #include <boost/beast/http/fields.hpp>
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
 
 #include "business_types.hpp"
 #include "error.hpp"
@@ -21,25 +26,74 @@
 // The session ID alone is enough to authenticate a client (so it constitutes
 // an authentication token).
 // Session IDs are transmitted to the client and back using HTTP cookies.
+// Sessions are looked up on every websocket connection, so the users they
+// map to are cached for a short time. Concurrent lookups of the same session
+// share a single round trip to Redis and MySQL.
+// If a session_token_signer is configured, new sessions are signed tokens instead
+// (see session_token.hpp), which are verified without contacting Redis or MySQL.
+// Logging out adds the token to a revocation set in Redis. Each shard keeps
+// a Bloom filter of the revoked tokens, reloaded periodically, and only asks Redis
+// about the tokens the filter contains. Session IDs issued before enabling tokens keep working.
 
 namespace chat {
 
 // Forward declarations
 class redis_client;
 class mysql_client;
+class pubsub_service;
+class session_token_signer;
 
 class cookie_auth_service
 {
+    class session_cache;
+
     redis_client* redis_;
     mysql_client* mysql_;
+    pubsub_service* pubsub_;
+    const session_token_signer* signer_;
+    std::shared_ptr<session_cache> cache_;
+
+    result_with_message<user> lookup_session(std::string_view session_id, boost::asio::yield_context yield);
+    result_with_message<user> lookup_session_uncached(
+        std::string_view session_id,
+        boost::asio::yield_context yield
+    );
+    result_with_message<user> verify_token(std::string_view token, boost::asio::yield_context yield);
+    result_with_message<bool> is_token_revoked(std::string_view token_id, boost::asio::yield_context yield);
+    bool load_revocations(boost::asio::yield_context yield);
 
 public:
-    cookie_auth_service(redis_client& redis, mysql_client& mysql) noexcept : redis_(&redis), mysql_(&mysql) {}
+    // Creates a service caching up to cache_size sessions, for cache_ttl.
+    // A zero cache_ttl disables caching. pubsub should be the pubsub_service for
+    // the shard this service runs in. It's used to invalidate cached sessions
+    // in all shards on logout, and must outlive this object.
+    // If signer is not null, sessions are signed tokens, and the revoked tokens
+    // are reloaded from Redis every revocation_refresh. signer must outlive this object.
+    cookie_auth_service(
+        redis_client& redis,
+        mysql_client& mysql,
+        pubsub_service& pubsub,
+        std::size_t cache_size,
+        std::chrono::seconds cache_ttl,
+        const session_token_signer* signer = nullptr,
+        std::chrono::seconds revocation_refresh = std::chrono::seconds(10)
+    );
+    cookie_auth_service(const cookie_auth_service&) = delete;
+    cookie_auth_service& operator=(const cookie_auth_service&) = delete;
+    ~cookie_auth_service();
 
-    // Allocates a new session ID for the passed user ID (by storing it in Redis),
+    // Allocates a new session for the passed user (by storing it in Redis, or by signing a token),
     // and returns an appropriate Set-Cookie header.
     result_with_message<std::string> generate_session_cookie(
         std::int64_t user_id,
+        std::string_view username,
+        boost::asio::yield_context yield
+    );
+
+    // Removes the session the request's cookie refers to, if any, and returns
+    // a Set-Cookie header that clears the cookie in the client.
+    result_with_message<std::string> invalidate_session_cookie(
+        const boost::beast::http::fields& req_headers,
         boost::asio::yield_context yield
     );
 
@@ -54,6 +108,7 @@ public:
 
     // Verifies that the user is authenticated via a cookie, returning the associated user.
     // Works like user_id_from_cookie, but also looks up the user in MySQL.
+    // Both lookups are cached. Tokens contain the user, so they don't need any lookup.
     result_with_message<user> user_from_cookie(
         const boost::beast::http::fields& req_headers,
         boost::asio::yield_context yield
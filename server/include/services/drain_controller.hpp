@@ -0,0 +1,105 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_DRAIN_CONTROLLER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_DRAIN_CONTROLLER_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <unordered_set>
+
+// Coordinates a graceful shutdown (drain) within a shard. When draining starts,
+// listeners stop accepting connections, and long-lived connections are asked to finish:
+// websocket clients are told to reconnect after a random delay, so they don't all
+// reconnect to the remaining instances at the same time. Operations that shouldn't be
+// interrupted (like storing messages) are tracked, so the shard can wait for them to finish.
+
+namespace chat {
+
+// Something that must finish when the server drains, like a listener or a websocket session
+class drainable
+{
+public:
+    virtual ~drainable() {}
+
+    // Asks the object to finish. reconnect_delay is the time clients should wait
+    // before reconnecting. Called once, from the shard's thread
+    virtual void on_drain(std::chrono::milliseconds reconnect_delay) = 0;
+};
+
+class drain_controller
+{
+    struct registration_deleter
+    {
+        drain_controller* self;
+        void operator()(drainable* obj) const noexcept { self->remove(obj); }
+    };
+
+    struct operation_deleter
+    {
+        void operator()(drain_controller* self) const noexcept { self->finish_operation(); }
+    };
+
+    bool draining_{false};
+    std::chrono::milliseconds max_reconnect_delay_{};
+    std::unordered_set<drainable*> drainables_;
+    std::size_t pending_operations_{0};
+    std::minstd_rand rng_;
+
+    // Cancelled to notify wait_idle when things finish while draining
+    boost::asio::steady_timer idle_timer_;
+
+    std::chrono::milliseconds random_reconnect_delay();
+    void remove(drainable* obj) noexcept;
+    void finish_operation() noexcept;
+    void notify_if_idle() noexcept;
+
+public:
+    // ex must be the shard's executor
+    explicit drain_controller(boost::asio::any_io_executor ex);
+
+    // Whether draining started. Connections should finish as soon as possible
+    bool draining() const noexcept { return draining_; }
+
+    // Registers an object, which will be notified when draining starts.
+    // If it already started, obj is notified right away (from a separate handler).
+    // The returned guard unregisters the object, and must be destroyed before it
+    using registration = std::unique_ptr<drainable, registration_deleter>;
+    registration add(drainable& obj);
+
+    // Signals that an operation that shouldn't be interrupted is starting.
+    // The operation finishes when the returned guard is destroyed
+    using operation_guard = std::unique_ptr<drain_controller, operation_deleter>;
+    operation_guard start_operation() noexcept
+    {
+        ++pending_operations_;
+        return operation_guard(this);
+    }
+
+    // The number of registered objects and in-progress operations
+    std::size_t num_drainables() const noexcept { return drainables_.size(); }
+    std::size_t num_pending_operations() const noexcept { return pending_operations_; }
+
+    // Starts draining, notifying every registered object. Clients are told to reconnect
+    // after a random delay between zero and max_reconnect_delay
+    void start(std::chrono::milliseconds max_reconnect_delay);
+
+    // Waits until all registered objects have been unregistered and all operations
+    // have finished. Returns false if this didn't happen within timeout.
+    // start() must have been called before
+    bool wait_idle(std::chrono::steady_clock::duration timeout, boost::asio::yield_context yield);
+};
+
+}  // namespace chat
+
+#endif
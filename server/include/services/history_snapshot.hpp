@@ -0,0 +1,148 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_HISTORY_SNAPSHOT_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_HISTORY_SNAPSHOT_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/core/span.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+
+// After a restart, the history served in hello events must be loaded from the databases
+// before the caches are warm. To avoid this, the recent history held by room_history_cache,
+// together with the usernames it references, is periodically written to a snapshot file.
+// On startup, the file is mapped into memory and loaded into the caches, so hello events
+// can be served straight away. The caches are then reconciled with Redis in the background
+// (see startup.hpp).
+
+namespace chat {
+
+class bounded_thread_pool;
+class room_history_cache;
+class startup_tracker;
+
+// Composes the contents of a snapshot file. Rooms are added by calling begin_room,
+// followed by add_message for each of its messages. Not thread-safe
+class history_snapshot_builder
+{
+    std::string body_;
+    std::uint32_t num_rooms_{0u};
+    std::vector<std::pair<std::int64_t, std::string>> usernames_;
+
+public:
+    history_snapshot_builder();
+
+    // Adds a room with num_messages messages, which must be added next, newest first.
+    // has_more is true if the room has older messages than the ones in the snapshot
+    void begin_room(std::string_view room_id, bool has_more, std::size_t num_messages);
+    void add_message(const message& msg);
+
+    // Adds the username of a user referenced by the messages
+    void add_username(std::int64_t user_id, std::string_view username);
+
+    // Returns the contents of the file. The builder can't be used after this
+    std::string finish();
+};
+
+// A room in a snapshot. Strings point into the snapshot file
+struct history_snapshot_room
+{
+    std::string_view id;
+    bool has_more;
+
+    // Messages, newest first
+    std::vector<message_view> messages;
+};
+
+// A snapshot file, mapped into memory. Read-only, so it's thread-safe
+class history_snapshot
+{
+    void* data_{nullptr};
+    std::size_t size_{0u};
+    std::vector<history_snapshot_room> rooms_;
+    std::vector<std::pair<std::int64_t, std::string_view>> usernames_;
+
+    history_snapshot() = default;
+    bool parse();
+
+public:
+    history_snapshot(const history_snapshot&) = delete;
+    history_snapshot& operator=(const history_snapshot&) = delete;
+    ~history_snapshot();
+
+    // Maps the snapshot stored at path. Fails with errc::snapshot_corrupted if the file
+    // doesn't contain a valid snapshot, or it was written by an incompatible version
+    static result<std::unique_ptr<history_snapshot>> open(const std::string& path);
+
+    // The rooms in the snapshot, and the usernames referenced by their messages
+    boost::span<const history_snapshot_room> rooms() const noexcept { return rooms_; }
+    boost::span<const std::pair<std::int64_t, std::string_view>> usernames() const noexcept
+    {
+        return usernames_;
+    }
+};
+
+// Writes a snapshot file, as composed by history_snapshot_builder. The contents are written
+// to a temporary file which replaces the old one, so readers never see a partial snapshot.
+// Performs blocking I/O, so it shouldn't run in the event loop threads
+error_code write_history_snapshot(const std::string& path, std::string_view contents);
+
+// A background task that periodically snapshots a room_history_cache into a file.
+// The cache is read in its shard, and the file is written in a thread pool.
+// Snapshots are only written once the history has been reloaded from the databases,
+// so a partially warm cache never replaces a full snapshot.
+// cache, pool and startup must outlive this object
+class history_snapshotter
+{
+    room_history_cache* cache_;
+    bounded_thread_pool* pool_;
+    const startup_tracker* startup_;
+    std::string path_;
+    boost::asio::steady_timer timer_;
+    bool cancelled_{false};
+
+    // How often snapshots are written
+    std::chrono::seconds interval_;
+
+    void run(boost::asio::yield_context yield);
+    error_code write_snapshot(boost::asio::yield_context yield);
+
+public:
+    // Snapshots are written every HISTORY_SNAPSHOT_INTERVAL seconds. ex must be the cache's executor
+    history_snapshotter(
+        boost::asio::any_io_executor ex,
+        room_history_cache& cache,
+        bounded_thread_pool& pool,
+        const startup_tracker& startup,
+        std::string path
+    );
+    history_snapshotter(const history_snapshotter&) = delete;
+    history_snapshotter& operator=(const history_snapshotter&) = delete;
+
+    // Launches the snapshot loop, in detached mode. The loop runs until cancel is called
+    void start_run();
+
+    // Stops the loop, writing a last snapshot. To be called at shutdown
+    void cancel();
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,106 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_LOGIN_RATE_LIMITER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_LOGIN_RATE_LIMITER_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "util/lru_cache.hpp"
+#include "util/token_bucket.hpp"
+
+// Limits the rate of login attempts, to make online password guessing impractical.
+// Every attempt takes a token from a bucket keyed by the client's IP address
+// (IPv6 addresses are grouped by /64 prefix). Failed attempts also take a token
+// from a bucket keyed by the email being tried, so a single account can't be
+// attacked from many addresses. Both checks happen before looking up the user
+// or verifying the password, so rejected attempts are cheap.
+// Buckets are stored in Redis, so limits apply across all server instances.
+// Each shard also keeps local buckets with the same parameters, which reject
+// floods without contacting Redis. If Redis fails, attempts are allowed.
+
+namespace chat {
+
+// Forward declarations
+class redis_client;
+
+// The outcome of checking a login attempt
+enum class login_limit_result
+{
+    allowed,        // the attempt may proceed
+    ip_limited,     // too many attempts from the client's address
+    email_limited,  // too many failed attempts for the email
+};
+
+class login_rate_limiter
+{
+public:
+    struct config
+    {
+        // If false, all attempts are allowed
+        bool enabled;
+
+        // Every login attempt takes a token from this bucket
+        token_bucket_params per_ip;
+
+        // Every failed login attempt takes a token from this bucket
+        token_bucket_params per_email_failures;
+
+        // The maximum number of local buckets of each kind
+        std::size_t local_cache_size;
+    };
+
+    // Creates a limiter storing its buckets in redis, which should be
+    // the Redis client for the shard this limiter runs in
+    login_rate_limiter(redis_client& redis, const config& cfg);
+
+    // Checks whether a login attempt for email from client_address is allowed,
+    // taking a token from the address' bucket
+    login_limit_result check_attempt(
+        const boost::asio::ip::address& client_address,
+        std::string_view email,
+        boost::asio::yield_context yield
+    );
+
+    // Records a failed login attempt for email. Call it after check_attempt
+    void record_failure(std::string_view email, boost::asio::yield_context yield);
+
+    // The time clients should wait before retrying after being limited
+    std::chrono::seconds retry_after(login_limit_result res) const noexcept;
+
+private:
+    using bucket_cache = lru_cache<std::string, token_bucket>;
+
+    redis_client* redis_;
+    config cfg_;
+    bucket_cache local_ip_buckets_;
+    bucket_cache local_email_buckets_;
+
+    bool take_tokens(
+        bucket_cache& local_buckets,
+        const std::string& key,
+        const token_bucket_params& params,
+        double cost,
+        boost::asio::yield_context yield
+    );
+};
+
+// Returns the key for the bucket limiting attempts from addr. Exposed for testing
+std::string login_limit_ip_key(const boost::asio::ip::address& addr);
+
+// Returns the key for the bucket limiting failed attempts for email. Exposed for testing
+std::string login_limit_email_key(std::string_view email);
+
+}  // namespace chat
+
+#endif
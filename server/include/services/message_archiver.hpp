@@ -0,0 +1,50 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_ARCHIVER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_ARCHIVER_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+
+#include <memory>
+
+// A background task that moves old messages from Redis into MySQL.
+// Room streams would otherwise grow without bounds, since they're held in memory.
+// Only the most recent messages of each room are kept in Redis. Older ones are
+// inserted into MySQL and then trimmed from the stream. room_history_service
+// reads archived messages when clients scroll past what Redis holds.
+
+namespace chat {
+
+class mysql_client;
+class redis_client;
+
+// This is an interface to reduce compile times.
+class message_archiver
+{
+public:
+    virtual ~message_archiver() {}
+
+    // Launches the archiving loop, in detached mode. The loop runs periodically until cancel is called
+    virtual void start_run() = 0;
+
+    // Stops the archiving loop. To be called at shutdown
+    virtual void cancel() = 0;
+};
+
+// Creates a message_archiver for all the rooms stored in MySQL. redis and mysql should be clients
+// running in ex, and must outlive the archiver.
+// Archiving is idempotent, so several server instances may run archivers concurrently.
+std::unique_ptr<message_archiver> create_message_archiver(
+    boost::asio::any_io_executor ex,
+    redis_client& redis,
+    mysql_client& mysql
+);
+
+}  // namespace chat
+
+#endif
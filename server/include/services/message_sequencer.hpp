@@ -0,0 +1,71 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_SEQUENCER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_SEQUENCER_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "message_id.hpp"
+
+// Generates message IDs in the server, so messages can be broadcast before
+// Redis stores them (see optimistic broadcast in the architecture docs).
+
+namespace chat {
+
+// Generates snowflake-style message IDs, which are valid Redis stream IDs.
+// The milliseconds part is the wall clock. The sequence number combines a counter
+// with the node number, so server instances with different node numbers never
+// generate the same ID. IDs generated by a sequencer are strictly increasing,
+// even if the clock goes backwards. Thread-safe and lock-free, so a single
+// sequencer is shared by all the threads in the server.
+class message_sequencer
+{
+    // The last ID generated, as (milliseconds << counter_bits) | counter.
+    // A counter overflow carries into the milliseconds
+    std::atomic<std::uint64_t> last_;
+    std::uint64_t node_number_;
+
+    parsed_message_id to_message_id(std::uint64_t state) const noexcept;
+
+public:
+    // Bits of the sequence number used by the node number, and by the counter
+    static constexpr unsigned node_bits = 10u;
+    static constexpr unsigned counter_bits = 20u;
+    static constexpr std::uint64_t max_node_number = (std::uint64_t(1) << node_bits) - 1u;
+
+    // Only the lower node_bits bits of node_number are used
+    explicit message_sequencer(std::uint64_t node_number) noexcept
+        : last_(0u), node_number_(node_number & max_node_number)
+    {
+    }
+
+    std::uint64_t node_number() const noexcept { return node_number_; }
+
+    // Generates an ID, given the current time, in milliseconds since the epoch
+    parsed_message_id next(std::uint64_t now_ms) noexcept;
+
+    // Same, using the system clock
+    parsed_message_id next() noexcept;
+
+    // Makes sure that IDs generated from now on are greater than id.
+    // Used when we learn about IDs generated elsewhere (e.g. by other server instances)
+    void observe(parsed_message_id id) noexcept;
+};
+
+// The sequencer used by all threads. The node number is taken from NODE_NUMBER,
+// which should be different for each server instance. If not set, a random one is used
+message_sequencer& global_message_sequencer();
+
+// Whether NODE_NUMBER contains a valid node number. Random node numbers may collide,
+// so features using global_message_sequencer require it
+bool node_number_configured();
+
+}  // namespace chat
+
+#endif
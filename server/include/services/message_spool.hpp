@@ -0,0 +1,167 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_SPOOL_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_MESSAGE_SPOOL_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+
+// A durable log of messages on local disk, where messages are stored
+// while Redis is unavailable (see spooling redis_client).
+
+namespace chat {
+
+// A message waiting in the spool, together with the room it was sent to
+struct spooled_message
+{
+    std::string room_id;
+    message msg;
+};
+
+// The state of a spool, exported as metrics
+struct spool_stats
+{
+    // Messages waiting to be replayed
+    std::size_t depth;
+
+    // Bytes used by these messages, and the maximum number of bytes the spool can hold
+    std::size_t used_bytes;
+    std::size_t capacity_bytes;
+
+    // The age of the oldest message waiting to be replayed. Zero if there are none
+    std::chrono::milliseconds lag;
+};
+
+// An append-only log of messages, stored in a fixed-size file mapped into memory.
+// Messages are appended at the end, and removed from the beginning once they've been
+// replayed, so they're replayed in the order they were appended. When all the messages
+// have been removed, the space is reused. Each record has a checksum, so a record that
+// was partially written when the process crashed is discarded when the spool is opened again.
+// Data reaches the kernel when it's appended, so it survives process crashes. To survive
+// power failures too, enable sync, which flushes the file to disk on every change.
+// Records use the native byte order, so files can't be moved between architectures.
+// Not thread-safe: see shared_message_spool.
+class message_spool
+{
+    int fd_{-1};
+    unsigned char* data_{nullptr};
+    std::size_t capacity_{0u};
+    bool sync_{false};
+
+    std::uint64_t generation_{0u};  // Changes every time the space is reused
+    std::size_t read_offset_{0u};   // The oldest record
+    std::size_t write_offset_{0u};  // Where the next record will be written
+    std::size_t depth_{0u};
+
+    message_spool() = default;
+
+    // A record read from the file, and the offset of the next one
+    struct record
+    {
+        spooled_message value;
+        std::size_t next_offset;
+    };
+    std::optional<record> read_record(std::size_t offset) const;
+    void write_header() noexcept;
+    void flush(std::size_t offset, std::size_t size) noexcept;
+
+public:
+    message_spool(const message_spool&) = delete;
+    message_spool& operator=(const message_spool&) = delete;
+    ~message_spool();
+
+    // Opens the spool stored at path, creating it if it doesn't exist, with capacity bytes.
+    // Messages left by a previous run are kept, to be replayed. Fails with errc::spool_corrupted
+    // if the file exists but doesn't contain a spool
+    static result<std::unique_ptr<message_spool>> open(
+        const std::string& path,
+        std::size_t capacity,
+        bool sync
+    );
+
+    // Appends messages sent to room_id. Messages must have their IDs set. Either all
+    // of them or none are appended. Fails with errc::spool_full if there is no space for them
+    error_code append(std::string_view room_id, boost::span<const message> messages);
+
+    // Retrieves up to max_messages of the oldest messages, oldest first, without removing them
+    std::vector<spooled_message> peek(std::size_t max_messages) const;
+
+    // Removes the num_messages oldest messages, once they've been replayed
+    void pop(std::size_t num_messages);
+
+    // Is there any message waiting to be replayed?
+    bool empty() const;
+
+    // The current state of the spool
+    spool_stats stats() const;
+};
+
+// The spool used by all shards. It's owned by a single shard, and only accessed from its thread:
+// other shards post their appends to the owner, and only the owner replays the spool, which
+// keeps messages in order. Its state is mirrored in atomics, so it can be checked from any thread.
+// Thread-safe: a single object is shared by all shards, but no lock is taken.
+class shared_message_spool
+{
+    std::unique_ptr<message_spool> spool_;
+    boost::asio::any_io_executor owner_;
+    std::size_t capacity_bytes_;
+
+    // Updated by the owner after every change
+    std::atomic<std::size_t> depth_{0u};
+    std::atomic<std::size_t> used_bytes_{0u};
+    std::atomic<std::int64_t> oldest_timestamp_{0};  // As serialized by serialize_timestamp
+
+    void update_stats() noexcept;
+
+public:
+    // Shares spool, which will be owned by the shard running in owner
+    shared_message_spool(std::unique_ptr<message_spool> spool, boost::asio::any_io_executor owner);
+
+    // The executor of the shard owning the spool
+    const boost::asio::any_io_executor& owner() const noexcept { return owner_; }
+
+    // Like message_spool::append, but may be called from any shard. Runs in the owner,
+    // suspending the calling coroutine until it's done
+    error_code append(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    );
+
+    // Like message_spool::peek and message_spool::pop. Must only be called from the owner's thread
+    std::vector<spooled_message> peek(std::size_t max_messages) const { return spool_->peek(max_messages); }
+    void pop(std::size_t num_messages);
+
+    // Like message_spool::empty and message_spool::stats. May be called from any thread,
+    // and reflect the state after the last change made by the owner
+    bool empty() const noexcept { return depth_.load(std::memory_order_relaxed) == 0u; }
+    spool_stats stats() const noexcept;
+};
+
+// Opens the spool used by all shards, configured by REDIS_SPOOL_PATH, REDIS_SPOOL_SIZE_MB
+// and REDIS_SPOOL_SYNC, to be owned by the shard running in owner. Returns nullptr
+// if the spool is disabled (REDIS_SPOOL_PATH is empty, the default) or can't be opened
+std::unique_ptr<shared_message_spool> create_shared_message_spool(boost::asio::any_io_executor owner);
+
+}  // namespace chat
+
+#endif
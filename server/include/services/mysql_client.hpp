@@ -13,9 +13,14 @@
 #include <boost/core/span.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "business_types.hpp"
 #include "error.hpp"
@@ -25,6 +30,50 @@
 
 namespace chat {
 
+// The connection pools used by mysql_client. Queries that only read data
+// use the read pool, so bursts of writes don't starve them, and vice versa.
+// Reads that tolerate stale data use the replica pool, which connects to
+// a replica if one is configured (otherwise, these use the read pool)
+enum class mysql_pool_kind
+{
+    read,
+    write,
+    replica,
+};
+
+// Usage metrics for a connection pool, since the client was created
+struct mysql_pool_stats
+{
+    // The maximum number of connections the pool may open
+    std::size_t max_size{};
+
+    // Connections currently checked out, and the maximum ever checked out at once.
+    // The pool doesn't close connections, so peak_in_use - in_use are idle
+    // (if peak_in_use is bigger than the pool's initial size)
+    std::size_t in_use{};
+    std::size_t peak_in_use{};
+
+    // Successful and failed attempts to get a connection from the pool
+    std::uint64_t checkouts{};
+    std::uint64_t checkout_errors{};
+
+    // Time spent waiting for connections to become available
+    std::chrono::microseconds total_wait{};
+    std::chrono::microseconds max_wait{};
+
+    // Connections returned to the pool with a reset (i.e. without return_without_reset).
+    // Resetting requires a round trip to the server the next time the connection is used
+    std::uint64_t resets{};
+};
+
+// A user to be created by mysql_client::create_users
+struct new_user
+{
+    std::string_view username;
+    std::string_view email;
+    std::string_view hashed_password;
+};
+
 // Using an interface to reduce build times and improve testability
 class mysql_client
 {
@@ -43,6 +92,9 @@ public:
     // Cancels the MySQL connection pool task. To be called at shutdown
     virtual void cancel() = 0;
 
+    // Retrieves usage metrics for one of the connection pools
+    virtual mysql_pool_stats pool_stats(mysql_pool_kind kind) const = 0;
+
     // Creates a new user object with the given attributes.
     // Returns the ID of the newly created object on success.
     // Retuns errc::username_exists or errc::email_exists if the passed username
@@ -54,6 +106,17 @@ public:
         boost::asio::yield_context yield
     ) = 0;
 
+    // Creates several users within a single transaction, inserting them with a multi-row INSERT.
+    // Returns a result for each user, in order: the ID of the newly created user, or
+    // errc::username_exists or errc::email_exists if its username or email already exist
+    // (or are used by a previous user in the list). Duplicates don't prevent the rest of users
+    // from being created. The users are sent in a single query, so lists should be kept small
+    // enough to fit in MySQL's max_allowed_packet (a few thousand users).
+    virtual result_with_message<std::vector<result<std::int64_t>>> create_users(
+        boost::span<const new_user> users,
+        boost::asio::yield_context yield
+    ) = 0;
+
     // Retrieves a user's authentication details, given the user's email.
     // Returns errc::not_found if the user doesn't exist.
     virtual result_with_message<auth_user> get_user_by_email(
@@ -61,6 +124,17 @@ public:
         boost::asio::yield_context yield
     ) = 0;
 
+    // Replaces a user's hashed password with new_hashed_password, as long as it's still
+    // old_hashed_password. This is used to upgrade hashes with outdated params, and makes
+    // concurrent upgrades for the same user safe. Updating a user that doesn't exist,
+    // or whose password has changed, is not an error.
+    virtual error_with_message update_password(
+        std::int64_t user_id,
+        std::string_view old_hashed_password,
+        std::string_view new_hashed_password,
+        boost::asio::yield_context yield
+    ) = 0;
+
     // Retrieves a user by ID.
     // Returns errc::not_found if it doesn't exist.
     virtual result_with_message<user> get_user_by_id(
@@ -71,15 +145,74 @@ public:
     // Retrieves the usernames associated to the passed user_ids.
     // The lookup is performed in batch, for efficiency reasons.
     // If a user ID doesn't exist, it's excluded from the returned map.
+    // Usernames never change, so this is served by the replica pool. Users created
+    // in the last moments may not be found.
     virtual result_with_message<username_map> get_usernames(
         boost::span<const std::int64_t> user_ids,
         boost::asio::yield_context yield
     ) = 0;
+
+    // Retrieves all the rooms in the server, in display order.
+    // Returned rooms don't contain any history.
+    virtual result_with_message<std::vector<room>> get_rooms(boost::asio::yield_context yield) = 0;
+
+    // Retrieves the rooms a user is a member of (default rooms and rooms the user joined),
+    // in display order. Returned rooms don't contain any history.
+    virtual result_with_message<std::vector<room>> get_user_rooms(
+        std::int64_t user_id,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Makes a user a member of a room. Joining a room twice is not an error.
+    // Returns the joined room, without history, or errc::not_found if the room doesn't exist.
+    virtual result_with_message<room> join_room(
+        std::int64_t user_id,
+        std::string_view room_id,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Stores old messages evicted from Redis. Messages that are already archived
+    // are ignored, so archiving the same messages several times is safe.
+    virtual error_with_message archive_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Retrieves up to max_count archived messages for a room, newest first.
+    // If before_id is set, only messages older than before_id are returned.
+    // If allow_replica is true, the query is served by the replica pool, and may
+    // miss the most recently archived messages.
+    virtual result_with_message<std::vector<message>> get_archived_messages(
+        std::string_view room_id,
+        std::optional<std::string_view> before_id,
+        std::size_t max_count,
+        bool allow_replica,
+        boost::asio::yield_context yield
+    ) = 0;
 };
 
-// Creates a concrete implementation of mysql_client
+// Creates a concrete implementation of mysql_client.
+// The server address, credentials and pool sizes are read from environment variables
+// (see the documentation for details). Each client has its own connection pools.
 std::unique_ptr<mysql_client> create_mysql_client(boost::asio::any_io_executor ex);
 
+// Retrieves usage metrics for a kind of connection pool, added across all the clients
+// created by create_mysql_client (there's one per thread). peak_in_use is the sum of the pools' peaks,
+// and max_wait the biggest wait in any of them. Zero for the replica pool if no replica is configured
+mysql_pool_stats get_mysql_pool_stats(mysql_pool_kind kind);
+
+// Creates a mysql_client that caches the results of get_user_by_id and get_usernames
+// in an LRU cache holding up to max_size users, forwarding the rest of operations to inner.
+// Found users are cached for ttl, and IDs that don't exist, for negative_ttl.
+// The returned object is not thread-safe, so it should be used within a single shard.
+std::unique_ptr<mysql_client> create_caching_mysql_client(
+    std::unique_ptr<mysql_client> inner,
+    std::size_t max_size,
+    std::chrono::seconds ttl,
+    std::chrono::seconds negative_ttl
+);
+
 }  // namespace chat
 
 #endif
@@ -10,16 +10,23 @@
 
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/error.hpp>
-#include <boost/asio/spawn.hpp>
 #include <boost/core/span.hpp>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "error.hpp"
+#include "util/token_bucket.hpp"
+#include "util/websocket_frame.hpp"
 
-// An in-memory publish-subscribe mechanism. Used to broadcast messages between clients.
+// A publish-subscribe mechanism. Used to broadcast messages between clients,
+// and to deliver messages to all the sessions of a user. Subscriptions are held in memory.
+// Messages can optionally be exchanged with other server instances using Redis Pub/Sub.
 
 namespace chat {
 
@@ -29,11 +36,37 @@ class message_subscriber
 public:
     virtual ~message_subscriber() {}
 
-    // Called when a message is received. The function is run in its own coroutine,
-    // and gets passed a yield_context, allowing for async code within it.
-    virtual void on_message(std::string_view message, boost::asio::yield_context yield) = 0;
+    // Called when a message is received. This is called synchronously from publish,
+    // once per subscriber, so it must not block or throw. It will usually enqueue the message
+    // to be processed later. The message is shared between all subscribers, and may be
+    // retained as long as required. It's framed only once, so websocket subscribers
+    // can write it without encoding it again.
+    virtual void on_message(std::shared_ptr<const framed_message> message) = 0;
+
+    // Called when an ephemeral message (see pubsub_service::publish_ephemeral) is received.
+    // Like on_message, this must not block or throw. Subscribers may discard these
+    // messages when they're busy, so they don't push out regular ones. Ephemeral messages
+    // have their own formats, so by default they're ignored.
+    virtual void on_ephemeral_message(std::shared_ptr<const framed_message>) {}
 };
 
+// Configures how ephemeral messages are published
+struct ephemeral_config
+{
+    // Ephemeral messages with the same topic and key published within this window
+    // are coalesced: only the last one is delivered, once the window ends.
+    // Zero disables coalescing
+    std::chrono::milliseconds coalesce_window{200};
+
+    // Limits the ephemeral messages delivered by each shard. Messages
+    // exceeding it are discarded. Coalesced messages don't count
+    token_bucket_params rate{1000.0, 1000.0};
+};
+
+// Reads the ephemeral_config from the environment. EPHEMERAL_COALESCE_MS sets the
+// coalescing window, and EPHEMERAL_RATE_PER_SECOND the rate (and burst) limit
+const ephemeral_config& get_ephemeral_config();
+
 // This is an interface to reduce compile times.
 class pubsub_service
 {
@@ -48,6 +81,13 @@ class pubsub_service
 public:
     virtual ~pubsub_service() {}
 
+    // Starts the connection used to exchange messages with other server instances,
+    // if cross-node delivery is enabled. Otherwise, this is a no-op.
+    virtual void start_run() = 0;
+
+    // Cancels the connection launched by start_run, if any.
+    virtual void cancel() = 0;
+
     // Subscribes a subscriber object to the given topic IDs. When a message
     // for any of these topics is received (via a call to publish),
     // message_subscriber::on_message will be called.
@@ -56,15 +96,43 @@ public:
         boost::span<const std::string_view> topic_ids
     ) = 0;
 
-    // Removes all subscriptions for the given subscriber.
+    // Registers subscriber as one of the sessions of the given user, so it receives the
+    // messages published with publish_to_user. This is an index separate from topics
+    // (there's no topic per user), with a single lookup per delivery.
+    virtual void subscribe_user(std::shared_ptr<message_subscriber> subscriber, std::int64_t user_id) = 0;
+
+    // Removes all subscriptions for the given subscriber, including user ones.
     // Subscriptions are matched by subscriber identity (i.e. pointer comparison).
     // If the subscriber doesn't exist, the function is a no-op.
     virtual void unsubscribe(message_subscriber& subscriber) = 0;
 
+    // The number of subscribers to the given topic in this shard. Subscribers in other shards
+    // and server instances aren't counted
+    virtual std::size_t num_subscribers(std::string_view topic_id) const = 0;
+
     // Publishes a message to the given topic.
-    // All subscribers are notified in parallel, each getting its own coroutine.
+    // Subscribers in this shard are notified before this function returns.
+    // If this service is part of a sharded group, subscribers in other shards
+    // are notified, too, in their own threads. If cross-node delivery is enabled,
+    // the message is also published to Redis, reaching subscribers in other server instances.
     virtual void publish(std::string_view topic_id, std::string message) = 0;
 
+    // Publishes a message to all the sessions of a user (e.g. a notification for all their devices).
+    // Delivered like publish: synchronously to the sessions in this shard, and to other
+    // shards and server instances, if any. Subscribers get it through on_message.
+    virtual void publish_to_user(std::int64_t user_id, std::string message) = 0;
+
+    // Publishes an ephemeral message (e.g. a typing indicator) to the given topic.
+    // These are delivered like regular messages, but are meant for high-frequency,
+    // low-value events that can be lost: messages with the same topic_id and
+    // coalesce_key are coalesced, and messages exceeding the shard's rate limit
+    // are discarded (see ephemeral_config). Subscribers are notified asynchronously.
+    virtual void publish_ephemeral(
+        std::string_view topic_id,
+        std::string_view coalesce_key,
+        std::string message
+    ) = 0;
+
     // RAII-style subscribe. When the guard is destroyed, the subscription is removed.
     using subscriber_guard = std::unique_ptr<message_subscriber, subscriber_deleter>;
     subscriber_guard subscribe_guarded(
@@ -80,7 +148,23 @@ public:
 
 // Create a concrete pubsub_service. The executor is used to launch the coroutines
 // where subscribe callbacks run.
-std::unique_ptr<pubsub_service> create_pubsub_service(boost::asio::any_io_executor ex);
+std::unique_ptr<pubsub_service> create_pubsub_service(
+    boost::asio::any_io_executor ex,
+    const ephemeral_config& ephemeral_cfg = get_ephemeral_config()
+);
+
+// Creates a group of pubsub_service shards, one per executor. Used when the server
+// runs several threads, each one with its own io_context. A message published in
+// any shard is delivered to the subscribers of all shards. Each shard must only be
+// used from the thread running its executor, and all shards must outlive any
+// pending deliveries (i.e. they should be destroyed after all threads have been joined).
+// If cross_node is true, messages are also exchanged with other server instances
+// using Redis Pub/Sub, through a dedicated connection owned by the first shard.
+std::vector<std::unique_ptr<pubsub_service>> create_sharded_pubsub_service(
+    boost::span<const boost::asio::any_io_executor> executors,
+    bool cross_node = false,
+    const ephemeral_config& ephemeral_cfg = get_ephemeral_config()
+);
 
 }  // namespace chat
 
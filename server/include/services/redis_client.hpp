@@ -11,6 +11,7 @@
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/core/span.hpp>
+#include <boost/redis/resp3/node.hpp>
 
 #include <chrono>
 #include <memory>
@@ -21,12 +22,18 @@
 
 #include "business_types.hpp"
 #include "error.hpp"
+#include "util/circuit_breaker.hpp"
+#include "util/token_bucket.hpp"
 
 // A high-level, specialized Redis client. It implements the operations
 // required by our server, abstracting away the actual Redis commands.
 
 namespace chat {
 
+class shared_message_spool;
+class pubsub_service;
+class sharded_search_index;
+
 // Using an interface to reduce build times and improve testability
 class redis_client
 {
@@ -52,22 +59,81 @@ public:
 
         // The last message we have fo this room; leave empty for "from the latest"
         std::optional<std::string_view> last_message_id;
+
+        // If set, only messages newer than this one are retrieved. Used to send
+        // reconnecting clients only the messages they missed
+        std::optional<std::string_view> since_message_id{};
+    };
+
+    // Where a history read may be served from
+    enum class read_preference
+    {
+        // The primary. The read observes every write completed before it
+        primary,
+
+        // A replica, if one is configured (otherwise, the primary). Replicas may lag behind,
+        // so the read may miss recently stored messages
+        replica,
     };
 
     // Retrieves a batch of room history for several rooms
     virtual result_with_message<std::vector<message_batch>> get_room_history(
         boost::span<const room_histoy_request> reqs,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Retrieves history for a single room, as a raw Redis response. Messages can be parsed
+    // from it without copying them using parse_room_history_views. The response is
+    // guaranteed to be a successful response to a single XREVRANGE
+    virtual result_with_message<std::vector<boost::redis::resp3::node>> get_room_history_nodes(
+        const room_histoy_request& req,
+        read_preference pref,
         boost::asio::yield_context yield
     ) = 0;
 
     // Inserts a batch of messages into a certain room's history.
-    // Returns the IDs of the inserted messages
+    // Returns the IDs of the inserted messages.
+    // Room streams are capped to an approximate maximum length, discarding the
+    // oldest messages. These should be archived before this happens (see message_archiver)
     virtual result_with_message<std::vector<std::string>> store_messages(
         std::string_view room_id,
         boost::span<const message> messages,
         boost::asio::yield_context yield
     ) = 0;
 
+    // Inserts a batch of messages into a certain room's history, using the IDs they already have
+    // (e.g. generated by a message_sequencer). The messages must be sorted by ID.
+    // A message whose ID is not greater than the last one in the stream (e.g. because
+    // another server instance stored a message with a greater ID) gets an ID assigned by Redis.
+    // Returns the IDs the messages were stored with, which are the passed ones unless this happens.
+    // Messages that Redis failed to store get an empty ID, while the others are still stored.
+    // Not group committed: messages are stored once the caller has published them,
+    // so this doesn't affect message latency
+    virtual result_with_message<std::vector<std::string>> store_messages_with_ids(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Retrieves up to max_count of the oldest messages in a room, excluding
+    // the keep_count most recent ones. Messages are returned oldest first.
+    // Used to archive old messages
+    virtual result_with_message<std::vector<message>> get_oldest_messages(
+        std::string_view room_id,
+        std::size_t keep_count,
+        std::size_t max_count,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Removes the messages of a room with IDs lower than min_id. Removal is exact,
+    // so archiving can rely on trimmed messages not being returned again
+    virtual error_with_message trim_messages(
+        std::string_view room_id,
+        std::string_view min_id,
+        boost::asio::yield_context yield
+    ) = 0;
+
     // Sets a certain key to a value, with the given time to live.
     // If the key already exists, the operation fails with already_exists
     virtual error_with_message set_nonexisting_key(
@@ -83,10 +149,76 @@ public:
         std::string_view key,
         boost::asio::yield_context yield
     ) = 0;
+
+    // Removes the specified key. Succeeds if the key does not exist
+    virtual error_with_message delete_key(std::string_view key, boost::asio::yield_context yield) = 0;
+
+    // Atomically takes cost tokens from the token bucket stored at key, creating it full if
+    // it doesn't exist. Returns whether there were enough tokens. A cost of zero checks that
+    // at least a token is available, without taking any. Buckets are refilled using
+    // the Redis server clock, so they're consistent across server instances.
+    // Keys expire once their buckets would be full again
+    virtual result_with_message<bool> take_tokens(
+        std::string_view key,
+        token_bucket_params params,
+        double cost,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Adds member to the set stored at key, until expiry. Expired members are removed.
+    // Expiry times use the local clock, so they should be much longer than clock differences
+    virtual error_with_message add_to_expiring_set(
+        std::string_view key,
+        std::string_view member,
+        std::chrono::system_clock::time_point expiry,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Retrieves the members of the set stored at key that haven't expired
+    virtual result_with_message<std::vector<std::string>> get_expiring_set(
+        std::string_view key,
+        boost::asio::yield_context yield
+    ) = 0;
+
+    // Returns whether member is in the set stored at key, and hasn't expired
+    virtual result_with_message<bool> expiring_set_contains(
+        std::string_view key,
+        std::string_view member,
+        boost::asio::yield_context yield
+    ) = 0;
 };
 
-// Creates a concrete implementation of redis_client
-std::unique_ptr<redis_client> create_redis_client(boost::asio::any_io_executor ex);
+// Creates a concrete implementation of redis_client. If fail_fast_stores is set, store_messages
+// fails with boost::redis::error::not_connected while Redis is not connected, without sending
+// the messages, instead of waiting for the connection to be re-established.
+// This is what create_spooling_redis_client expects from its inner client
+std::unique_ptr<redis_client> create_redis_client(
+    boost::asio::any_io_executor ex,
+    bool fail_fast_stores = false
+);
+
+// Creates a redis_client that adds the messages it stores to index,
+// forwarding all operations to inner.
+std::unique_ptr<redis_client> create_indexing_redis_client(
+    std::unique_ptr<redis_client> inner,
+    sharded_search_index& index
+);
+
+// Creates a redis_client that stores messages in spool when Redis is unavailable, forwarding
+// the rest of operations to inner. Failed stores open a circuit breaker configured by params.
+// While it's open, or while the spool is not empty, messages are spooled without contacting Redis,
+// and get their IDs from global_message_sequencer. Stores that failed after being sent to Redis
+// are not spooled, since Redis may have applied them, and spooling them would duplicate the messages.
+// If ex is the spool's owner, a background task replays the spool, publishing
+// a server_messages_corrected_event to pubsub for messages stored with a different ID.
+// The returned object is not thread-safe, so it should be used within a single shard.
+std::unique_ptr<redis_client> create_spooling_redis_client(
+    boost::asio::any_io_executor ex,
+    std::unique_ptr<redis_client> inner,
+    shared_message_spool& spool,
+    pubsub_service& pubsub,
+    circuit_breaker_params params
+);
 
 }  // namespace chat
 
@@ -0,0 +1,67 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_REDIS_CLUSTER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_REDIS_CLUSTER_HPP
+
+#include <boost/core/span.hpp>
+#include <boost/redis/resp3/node.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+// Helpers to talk to a Redis Cluster, used by redis_client.
+// In a cluster, keys are distributed between nodes. Each key belongs to one of
+// 16384 hash slots, and each slot is served by a single node at a given time.
+// See https://redis.io/docs/reference/cluster-spec/
+
+namespace chat {
+
+// The number of hash slots in a Redis Cluster
+inline constexpr std::size_t redis_num_slots = 16384u;
+
+// Computes the hash slot for a key. If the key contains a hash tag
+// (a non-empty substring between the first { and the next }), only the tag is hashed
+std::uint16_t redis_hash_slot(std::string_view key);
+
+// A redirection sent by a cluster node, when asked for a key it doesn't serve.
+// These are sent as errors with the form "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>".
+struct redis_redirect
+{
+    // MOVED errors indicate that the slot is now served by another node.
+    // ASK errors are sent while a slot is being migrated: only the next command
+    // should be sent to the other node, preceded by ASKING
+    bool is_ask;
+    std::uint16_t slot;
+    std::string host;
+    std::string port;
+};
+
+// Parses an error message as a redirection. Returns an empty optional if it's any other error
+std::optional<redis_redirect> parse_redis_redirect(std::string_view error_message);
+
+// A range of slots served by a node, as reported by CLUSTER SLOTS
+struct redis_slot_range
+{
+    std::uint16_t first;
+    std::uint16_t last;  // inclusive
+    std::string host;
+    std::string port;
+};
+
+// Parses a CLUSTER SLOTS response. Only primary nodes are reported
+result<std::vector<redis_slot_range>> parse_cluster_slots(boost::span<const boost::redis::resp3::node> from);
+
+}  // namespace chat
+
+#endif
@@ -11,6 +11,9 @@
 #include <boost/core/span.hpp>
 #include <boost/redis/resp3/node.hpp>
 
+#include <deque>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "business_types.hpp"
@@ -28,16 +31,56 @@ using node_span = boost::span<const boost::redis::resp3::node>;
 // (i.e. several batched XREVRANGEs)
 result<std::vector<message_batch>> parse_room_history_batch(node_span from);
 
+// A room history batch that references a Redis response, rather than copying it
+struct message_view_batch
+{
+    // The messages, most recent first. They point into the parsed nodes or into storage
+    std::vector<message_view> messages;
+
+    // Contents that couldn't be referenced from the response (messages in the legacy JSON format).
+    // A deque keeps references stable while it grows
+    std::deque<std::string> storage;
+};
+
+// Parses the result of getting the history for a single room (a single XREVRANGE)
+// without copying message IDs or contents. The returned views point into nodes,
+// so they must be kept alive while the result is used
+result<message_view_batch> parse_room_history_views(node_span from);
+
 // Parses the response of a batch of XADDs. The response of each XADD is a string,
 // containing the ID of the inserted record. Calling execute with vector<string>
 // doesn't work because Boost.Redis will attempt to parse a single response containing
 // an array of strings, instead of multiple responses with a single string
 result<std::vector<std::string>> parse_batch_xadd_response(node_span from);
 
-// We store messages in streams as serialized JSON objects. Serialize
-// a message into its JSON representation
+// Parses a response consisting of a single array of strings (e.g. the one
+// returned by a Lua script that returns a table of strings)
+result<std::vector<std::string>> parse_string_array(node_span from);
+
+// A message received via Redis Pub/Sub, as a pmessage push
+struct redis_pubsub_message
+{
+    // The channel the message was published to
+    std::string_view channel;
+
+    // The published message
+    std::string_view payload;
+};
+
+// Parses a sequence of Redis server pushes, as received by a connection subscribed
+// using PSUBSCRIBE. Pushes other than pmessage (e.g. subscription confirmations) are skipped.
+// The returned views point into the passed nodes.
+result<std::vector<redis_pubsub_message>> parse_pubsub_pushes(node_span from);
+
+// We store messages in streams using a compact binary format, which is cheaper
+// to parse than JSON. Serializes a message into this representation.
+// parse_room_history_batch also accepts messages stored as JSON by older versions
 std::string serialize_redis_message(const message& msg);
 
+// Parses a message serialized by serialize_redis_message (or stored as JSON by older versions).
+// The returned message has an empty ID, since these are not part of the payload
+result<message> deserialize_redis_message(std::string_view payload);
+
 }  // namespace chat
 
 #endif
@@ -0,0 +1,136 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_ROOM_HISTORY_CACHE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_ROOM_HISTORY_CACHE_HPP
+
+#include <boost/core/span.hpp>
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/pubsub_service.hpp"
+#include "util/arena.hpp"
+#include "util/single_flight.hpp"
+
+namespace chat {
+
+class history_snapshot;
+class history_snapshot_builder;
+struct parsed_server_messages_corrected_event;
+
+// An in-memory cache holding the most recent messages of each room, used to
+// compose the hello event without accessing Redis or MySQL.
+// The cache subscribes to the pubsub_service to be notified of new messages,
+// so it's kept up to date with messages sent from any shard or server instance.
+// There is a cache per shard, so this class is not thread-safe.
+class room_history_cache final : public message_subscriber,
+                                 public std::enable_shared_from_this<room_history_cache>
+{
+public:
+    // The result of loading history from the database
+    using load_result = result_with_message<std::pair<std::vector<message_batch>, username_map>>;
+
+private:
+    struct room_entry
+    {
+        // Does this entry contain valid data?
+        bool loaded{false};
+
+        // Was the data loaded from a snapshot? It may miss messages sent until it's reloaded
+        bool stale{false};
+
+        // Number of loads from the database in progress
+        std::size_t pending_loads{0};
+
+        // Messages, newest first
+        std::deque<message> messages;
+
+        // Are there more messages in the database than the ones we hold?
+        bool has_more{false};
+
+        // Messages received while the entry was being loaded, oldest first
+        std::vector<message> received_while_loading;
+
+        // Has the cache subscribed to this room?
+        bool subscribed{false};
+    };
+
+    pubsub_service* pubsub_;
+    std::size_t max_messages_;
+    std::map<std::string, room_entry, std::less<>> rooms_;
+    username_map usernames_;
+
+    // Scratch memory used to parse messages
+    arena parse_arena_;
+
+    // Loads in progress, by room IDs
+    single_flight<load_result> loads_;
+
+    room_entry& get_entry(std::string_view room_id);
+    void add_newest(room_entry& entry, message msg);
+    void on_corrections(parsed_server_messages_corrected_event& evt);
+    void prune_usernames();
+
+public:
+    // Creates a cache holding up to max_messages for each room.
+    // pubsub should be the pubsub_service for the shard the cache runs in, and must outlive it.
+    room_history_cache(pubsub_service& pubsub, std::size_t max_messages)
+        : pubsub_(&pubsub), max_messages_(max_messages)
+    {
+    }
+
+    // Retrieves the cached history for the given rooms, together with the usernames
+    // of the users that sent the messages. Returns an empty optional if any room is not in the cache.
+    std::optional<std::pair<std::vector<message_batch>, username_map>> get(
+        boost::span<const std::string_view> room_ids
+    ) const;
+
+    // Must be called before loading history for the given rooms from the database.
+    // Messages received until the load is finished are recorded, so they are not lost
+    void begin_load(boost::span<const std::string_view> room_ids);
+
+    // Stores history loaded from the database, after begin_load. batches should
+    // contain an entry per room, with the most recent messages first.
+    void finish_load(
+        boost::span<const std::string_view> room_ids,
+        boost::span<const message_batch> batches,
+        const username_map& usernames
+    );
+
+    // Must be called if a load started by begin_load fails
+    void abort_load(boost::span<const std::string_view> room_ids);
+
+    // Populates the rooms that aren't loaded yet with the history in a snapshot.
+    // Rooms populated like this are served, but are replaced by the next load
+    // for them, which records the messages received meanwhile, as usual
+    void load_snapshot(const history_snapshot& snapshot);
+
+    // Adds the rooms loaded from the database to a snapshot, with the usernames they reference
+    void save_snapshot(history_snapshot_builder& builder) const;
+
+    // Used to coalesce concurrent loads for the same rooms, so a burst of cache misses
+    // (e.g. many clients reconnecting after a restart) results in a single load
+    single_flight<load_result>& loads() noexcept { return loads_; }
+
+    // Subscriber callback. Receives server_messages_event and server_messages_corrected_event JSONs
+    void on_message(std::shared_ptr<const framed_message> message) override final;
+};
+
+}  // namespace chat
+
+#endif
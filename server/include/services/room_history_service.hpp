@@ -11,6 +11,8 @@
 #include <boost/asio/spawn.hpp>
 #include <boost/core/span.hpp>
 
+#include <optional>
+#include <string>
 #include <string_view>
 #include <utility>
 
@@ -23,14 +25,39 @@ namespace chat {
 
 class mysql_client;
 class redis_client;
+class room_history_cache;
 
 class room_history_service
 {
     redis_client* redis_;
     mysql_client* mysql_;
+    room_history_cache* cache_;
+
+    // Loads history from the databases. If allow_replica is true, reads may be served
+    // by replicas, and may miss the most recent messages. since_ids is either empty,
+    // or has an entry per room (see get_room_history_since)
+    result_with_message<std::pair<std::vector<message_batch>, username_map>> get_room_history_uncached(
+        boost::span<const std::string_view> room_ids,
+        std::optional<std::string_view> first_message_id,
+        boost::span<const std::string_view> since_ids,
+        bool allow_replica,
+        boost::asio::yield_context yield
+    );
+
+    // Loads the most recent history from the databases into the cache
+    result_with_message<std::pair<std::vector<message_batch>, username_map>> load_into_cache(
+        boost::span<const std::string_view> room_ids,
+        boost::asio::yield_context yield
+    );
 
 public:
-    room_history_service(redis_client& redis, mysql_client& mysql) noexcept : redis_(&redis), mysql_(&mysql)
+    // If cache is not nullptr, the most recent history is served from it when possible
+    room_history_service(
+        redis_client& redis,
+        mysql_client& mysql,
+        room_history_cache* cache = nullptr
+    ) noexcept
+        : redis_(&redis), mysql_(&mysql), cache_(cache)
     {
     }
 
@@ -46,9 +73,39 @@ public:
         boost::asio::yield_context yield
     );
 
+    // Loads the most recent history for the given rooms into the cache, even if
+    // it's already cached. Used to reconcile entries populated from a snapshot. Requires a cache
+    error_with_message reload_cached_history(
+        boost::span<const std::string_view> room_ids,
+        boost::asio::yield_context yield
+    );
+
+    // Same as the above, for clients that reconnect and already have some history.
+    // since_ids has an entry per room, with the ID of the most recent message the client has,
+    // or an empty string if it has none. For rooms with an ID, only the newer messages are
+    // returned, as a delta batch (message_batch::is_delta). If the client missed too many
+    // messages (a whole batch), the most recent history is returned instead, as usual
+    result_with_message<std::pair<std::vector<message_batch>, username_map>> get_room_history_since(
+        boost::span<const std::string_view> room_ids,
+        boost::span<const std::string_view> since_ids,
+        boost::asio::yield_context yield
+    );
+
     // Same as the above, but for an individual room.
+    // If first_message_id is set, only messages older than the one with this ID are retrieved.
+    // This allows clients to paginate through history. These requests bypass the cache.
     result_with_message<std::pair<message_batch, username_map>> get_room_history(
         std::string_view room_id,
+        std::optional<std::string_view> first_message_id,
+        boost::asio::yield_context yield
+    );
+
+    // Retrieves history for an individual room, as a serialized room_history_event.
+    // Uncached requests compose the event from the Redis response directly,
+    // without copying messages into intermediate objects.
+    result_with_message<std::string> get_room_history_event(
+        std::string_view room_id,
+        std::optional<std::string_view> first_message_id,
         boost::asio::yield_context yield
     );
 };
@@ -0,0 +1,138 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_SEARCH_INDEX_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_SEARCH_INDEX_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "business_types.hpp"
+
+// An in-memory full-text index of the messages in each room, used
+// to answer searchRoom events without scanning the room's history.
+
+namespace chat {
+
+// Splits text into search terms: sequences of letters and digits, lowercased.
+// Non-ASCII characters are considered letters, so words in any language are indexed,
+// but only ASCII letters are lowercased. Terms longer than max_search_term_size are discarded.
+// Duplicate terms are returned once
+std::vector<std::string> tokenize_search_terms(std::string_view text);
+
+constexpr std::size_t max_search_term_size = 64u;
+
+// Configures a search_index
+struct search_index_config
+{
+    // The maximum number of messages indexed for a room. When it's reached,
+    // the oldest messages are removed from the index
+    std::size_t max_room_messages;
+
+    // The approximate maximum memory used by the index. When it's reached,
+    // the least recently updated rooms are removed from the index
+    std::size_t max_bytes;
+};
+
+// Indexes the most recent messages stored in each room. Messages are indexed
+// incrementally, as they're stored. An index for a room contains the messages themselves,
+// and a posting list for each term, with the messages that contain it.
+// Posting lists hold message numbers (assigned in insertion order), delta and
+// varint-encoded, so they use about a byte per entry.
+// Not thread-safe: see sharded_search_index.
+class search_index
+{
+    struct room_index;
+
+    search_index_config cfg_;
+
+    // Rooms, most recently updated first
+    std::list<std::unique_ptr<room_index>> rooms_;
+    std::unordered_map<std::string, std::list<std::unique_ptr<room_index>>::iterator> room_lookup_;
+    std::size_t total_bytes_{0u};
+
+    room_index* find_room(std::string_view room_id) const;
+
+public:
+    explicit search_index(search_index_config cfg);
+    search_index(const search_index&) = delete;
+    search_index& operator=(const search_index&) = delete;
+    ~search_index();
+
+    // Indexes messages stored in room_id. Messages must have their IDs set,
+    // and be passed in the order they were stored
+    void add_messages(std::string_view room_id, boost::span<const message> messages);
+
+    // Returns up to max_results messages in room_id containing all the terms in query,
+    // most recent first. Returns no results if the query contains no terms
+    std::vector<message> search(std::string_view room_id, std::string_view query, std::size_t max_results)
+        const;
+
+    // The number of rooms in the index
+    std::size_t num_rooms() const;
+
+    // The approximate memory used by the index
+    std::size_t memory_usage() const;
+};
+
+// The search index used by all shards. Rooms are partitioned between shards: each room
+// is indexed by a single shard (its owner), in a search_index only accessed from the owner's thread.
+// Other shards post the messages to index and their searches to the owner.
+// Each shard gets an equal part of the memory budget.
+// Thread-safe: a single object is shared by all shards, but no lock is taken.
+class sharded_search_index
+{
+    struct shard;
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    shard& owner(std::string_view room_id) const;
+
+public:
+    // Creates an index with a shard for each executor
+    sharded_search_index(boost::span<const boost::asio::any_io_executor> executors, search_index_config cfg);
+    sharded_search_index(const sharded_search_index&) = delete;
+    sharded_search_index& operator=(const sharded_search_index&) = delete;
+    ~sharded_search_index();
+
+    // Indexes messages stored in room_id in the room's owner. Doesn't wait
+    // for the messages to be indexed. Messages must have their IDs set,
+    // and be passed in the order they were stored
+    void add_messages(std::string_view room_id, boost::span<const message> messages);
+
+    // Like search_index::search. Runs in the room's owner, suspending the calling coroutine until it's done
+    std::vector<message> search(
+        std::string_view room_id,
+        std::string_view query,
+        std::size_t max_results,
+        boost::asio::yield_context yield
+    ) const;
+
+    // The number of rooms in the index, as of the last update of each shard
+    std::size_t num_rooms() const noexcept;
+
+    // The approximate memory used by the index, as of the last update of each shard
+    std::size_t memory_usage() const noexcept;
+};
+
+// Creates the search index, configured by SEARCH_INDEX_ROOM_MESSAGES and SEARCH_INDEX_MAX_MB,
+// with a shard for each executor. Returns nullptr if indexing is disabled (SEARCH_INDEX_ENABLED=0)
+std::unique_ptr<sharded_search_index> create_sharded_search_index(
+    boost::span<const boost::asio::any_io_executor> executors
+);
+
+}  // namespace chat
+
+#endif
@@ -47,6 +47,9 @@ public:
         std::string_view session_id,
         boost::asio::yield_context yield
     );
+
+    // Removes the given session, if it exists. Used to log users out
+    error_with_message invalidate_session(std::string_view session_id, boost::asio::yield_context yield);
 };
 
 }  // namespace chat
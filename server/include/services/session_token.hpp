@@ -0,0 +1,93 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_SESSION_TOKEN_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_SESSION_TOKEN_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+// Stateless session tokens: the user a session belongs to and its expiry time,
+// signed with HMAC-SHA256. Verifying a token is a pure CPU operation, so
+// authenticating a request doesn't need Redis. Tokens can't be removed once issued,
+// so logging out adds them to a revocation list (see cookie_auth_service).
+// A token is <payload>.<signature>, both base64-encoded, without padding.
+// The payload contains a format version, the ID of the key that signed it, the expiry time,
+// the user ID, a random token ID (used for revocation) and the username.
+
+namespace chat {
+
+// A key used to sign tokens. IDs identify keys, so they can be rotated
+struct session_token_key
+{
+    std::uint32_t id;
+    std::string secret;
+};
+
+// The contents of a verified token
+struct session_token_claims
+{
+    std::int64_t user_id;
+    std::string username;
+    std::chrono::system_clock::time_point expiry;
+
+    // Identifies the token, to revoke it. Random, base64-encoded
+    std::string token_id;
+};
+
+// The minimum size of a session_token_key secret, in bytes
+constexpr std::size_t min_session_token_secret_size = 32u;
+
+// Parses a list of keys, in the format id:secret,id:secret. Secrets can't contain commas,
+// and must have at least min_session_token_secret_size bytes.
+// Fails with errc::invalid_config if the list is malformed or empty
+result<std::vector<session_token_key>> parse_session_token_keys(std::string_view input);
+
+// Returns whether a session cookie value is a token, rather than a session ID stored in Redis
+inline bool is_session_token(std::string_view cookie_value) noexcept
+{
+    return cookie_value.find('.') != std::string_view::npos;
+}
+
+// Signs and verifies tokens. The first key signs new tokens. The rest are only used
+// for verification, so tokens signed with them remain valid until they expire.
+// To rotate keys, add a new key in front of the list; once tokens signed with the old one
+// have expired, remove it. Thread-safe, since it's immutable.
+class session_token_signer
+{
+    std::vector<session_token_key> keys_;
+
+public:
+    // keys must not be empty
+    explicit session_token_signer(std::vector<session_token_key> keys);
+
+    // Creates a new token, with a random token ID
+    std::string sign(
+        std::int64_t user_id,
+        std::string_view username,
+        std::chrono::system_clock::time_point expiry
+    ) const;
+
+    // Verifies a token, returning its contents. Fails with errc::requires_auth if the token
+    // is malformed, has an invalid signature, was signed by an unknown key, or has expired by now.
+    // Doesn't check revocation
+    result<session_token_claims> verify(std::string_view token, std::chrono::system_clock::time_point now)
+        const;
+};
+
+// The signer shared by all threads, with the keys in SESSION_TOKEN_KEYS.
+// Returns nullptr if the variable is unset or invalid, in which case sessions are stored in Redis
+const session_token_signer* global_session_token_signer();
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,89 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_STARTUP_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_STARTUP_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/core/span.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Server startup. Listeners accept connections straight away, while the
+// databases are set up and caches are warmed up in the background:
+//   - Redis connections and MySQL pools are launched for all shards at once (start_run).
+//   - Meanwhile, the first shard sets up the database schema.
+//   - Once the schema is ready, every shard preloads its caches concurrently:
+//     the room list and the most recent history of every room (which also fills the
+//     username cache), as served in hello events.
+// API requests and websocket upgrades get a 503 response until the schema is ready.
+// GET /api/ready reports whether the schema is ready and all shards have warmed up, for load balancers.
+// If a history snapshot is available (see history_snapshot.hpp), every shard loads it
+// into its cache straight away and is considered warm. The cached history is then
+// reloaded from the databases, as above, while the snapshot is being served.
+
+namespace chat {
+
+class history_snapshot;
+class shared_state;
+
+// Tracks the progress of startup. Thread-safe
+class startup_tracker
+{
+    std::chrono::steady_clock::time_point start_;
+    std::atomic<bool> db_ready_{false};
+    std::atomic<std::size_t> pending_steps_;  // shards to warm up, plus the schema
+    std::atomic<std::size_t> pending_reloads_;
+    std::atomic<std::int64_t> startup_ms_{-1};
+
+    void on_step_done() noexcept;
+
+public:
+    // Startup is complete once the schema has been set up and num_shards have warmed up
+    explicit startup_tracker(std::size_t num_shards) noexcept;
+    startup_tracker(const startup_tracker&) = delete;
+    startup_tracker& operator=(const startup_tracker&) = delete;
+
+    // Has the database schema been set up? Requests using the databases require this
+    bool db_ready() const noexcept { return db_ready_.load(std::memory_order_acquire); }
+
+    // Has the schema been set up, and have all shards warmed up? The server can serve traffic then
+    bool ready() const noexcept { return startup_ms_.load(std::memory_order_acquire) >= 0; }
+
+    // Have all shards loaded their caches from the databases? Shards warmed up from a snapshot
+    // are ready before this happens, while their caches still hold the snapshot's entries
+    bool history_reloaded() const noexcept { return pending_reloads_.load(std::memory_order_acquire) == 0u; }
+
+    // The time it took for the server to be ready (as per ready()), since this object was created.
+    // Zero if it's not ready yet
+    std::chrono::milliseconds startup_time() const noexcept;
+
+    // To be called by the startup tasks
+    void on_db_ready() noexcept;
+    void on_shard_warm() noexcept;
+    void on_shard_reloaded() noexcept;
+};
+
+// Launches the startup tasks described above. shards[i] must run in executors[i],
+// and must have been started. If setting up the schema fails with an error other
+// than a connection error, an exception is thrown from the first shard's io_context.
+// Failed preloads are retried until they succeed, since shards without caches would
+// overload the databases. tracker must outlive the shards. snapshot may be nullptr
+void launch_startup(
+    boost::span<const boost::asio::any_io_executor> executors,
+    boost::span<const std::shared_ptr<shared_state>> shards,
+    startup_tracker& tracker,
+    std::shared_ptr<const history_snapshot> snapshot = nullptr
+);
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,98 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_TOPIC_REGISTRY_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_TOPIC_REGISTRY_HPP
+
+#include <boost/container_hash/hash.hpp>
+#include <boost/core/span.hpp>
+#include <boost/unordered/unordered_flat_map.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "services/pubsub_service.hpp"
+
+namespace chat {
+
+// The subscriptions held by a pubsub_service shard. Publishing is the hot path,
+// so subscribers are stored in a contiguous vector per topic, found with a single
+// hash lookup. Topic IDs are interned once, and referred to by dense integer handles.
+// Subscriptions are removed in constant time, by swapping them with the last one in the vector.
+// Not thread-safe: each shard owns its registry.
+class topic_registry
+{
+public:
+    // Identifies an interned topic. Handles are dense (0, 1, 2...) and belong to a single registry
+    using topic_handle = std::uint32_t;
+
+private:
+    // Heterogeneous lookup, to avoid creating strings when publishing
+    struct string_hash
+    {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view s) const noexcept
+        {
+            return boost::hash<std::string_view>{}(s);
+        }
+    };
+
+    // Where a subscriber is placed: topics_[handle].subscribers[index]
+    struct position
+    {
+        topic_handle handle;
+        std::uint32_t index;
+    };
+
+    // The subscribers of each topic, indexed by topic handle
+    std::vector<std::vector<std::shared_ptr<message_subscriber>>> topics_;
+
+    // Topic ID => handle
+    boost::unordered_flat_map<std::string, topic_handle, string_hash, std::equal_to<>> handles_;
+
+    // Subscriber identity => the positions it occupies, used to unsubscribe
+    boost::unordered_flat_map<const message_subscriber*, std::vector<position>> positions_;
+
+public:
+    // Returns the handle for topic_id, interning it if it doesn't exist yet
+    topic_handle intern(std::string_view topic_id);
+
+    // Returns the handle for topic_id, if it has been interned
+    std::optional<topic_handle> find(std::string_view topic_id) const noexcept;
+
+    // The number of interned topics. Topics stay interned after their subscribers are removed
+    std::size_t num_topics() const noexcept { return topics_.size(); }
+
+    // Subscribes subscriber to the given topics
+    void subscribe(
+        std::shared_ptr<message_subscriber> subscriber,
+        boost::span<const std::string_view> topic_ids
+    );
+
+    // Removes all the subscriptions of the given subscriber. No-op if it has none
+    void unsubscribe(const message_subscriber& subscriber);
+
+    // The subscribers of a topic. Valid until the registry is modified,
+    // so message_subscriber callbacks must not subscribe or unsubscribe while iterating it
+    boost::span<const std::shared_ptr<message_subscriber>> subscribers(topic_handle handle) const noexcept
+    {
+        return topics_[handle];
+    }
+    boost::span<const std::shared_ptr<message_subscriber>> subscribers(std::string_view topic_id
+    ) const noexcept;
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,159 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_UPLOAD_STORE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_SERVICES_UPLOAD_STORE_HPP
+
+#include <boost/core/span.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "error.hpp"
+
+// Files uploaded by users (e.g. images to be shared in rooms), stored in a local directory.
+// Uploads are resumable: an upload is created with its total size, and its contents are then
+// appended in one or more requests, in order. If a request is interrupted, the bytes received
+// so far are kept, and the client can resume from there. Once all bytes have been received,
+// the upload is complete and can be downloaded. Each upload uses two files:
+// <id>.meta, with the upload's owner, size and content type, and <id>.part, with its contents,
+// which is renamed to <id>.data when the upload completes. Incomplete uploads are also
+// recorded as an empty pending/<user ID>/<id> file, so the ones created by a user can be counted.
+
+namespace chat {
+
+// The size of an upload ID. IDs are random and hex-encoded
+constexpr std::size_t upload_id_size = 32u;
+
+// Returns whether value has the format of an upload ID. Paths are built from IDs,
+// so IDs received from clients must be validated with this function
+bool is_upload_id(std::string_view value) noexcept;
+
+// Returns whether value is acceptable as the content type of an upload
+bool is_valid_upload_content_type(std::string_view value) noexcept;
+
+// The state of an upload
+struct upload_info
+{
+    // The user that created the upload
+    std::int64_t user_id;
+
+    // The size of the file being uploaded, and how many bytes have been received
+    std::uint64_t size;
+    std::uint64_t offset;
+
+    // As provided by the user when creating the upload
+    std::string content_type;
+
+    bool complete() const noexcept { return offset == size; }
+};
+
+// Appends data to an upload. Only one writer can exist for each upload at a time.
+// Closing the writer (by destroying it) makes the upload available to other writers
+class upload_writer
+{
+    int fd_{-1};
+    std::string dir_;
+    std::string id_;
+    std::uint64_t size_{};
+    std::uint64_t offset_{};
+
+public:
+    upload_writer() = default;
+    upload_writer(int fd, std::string dir, std::string id, std::uint64_t size, std::uint64_t offset) noexcept
+        : fd_(fd), dir_(std::move(dir)), id_(std::move(id)), size_(size), offset_(offset)
+    {
+    }
+    upload_writer(const upload_writer&) = delete;
+    upload_writer(upload_writer&& rhs) noexcept
+        : fd_(std::exchange(rhs.fd_, -1)),
+          dir_(std::move(rhs.dir_)),
+          id_(std::move(rhs.id_)),
+          size_(rhs.size_),
+          offset_(rhs.offset_)
+    {
+    }
+    upload_writer& operator=(const upload_writer&) = delete;
+    upload_writer& operator=(upload_writer&& rhs) noexcept
+    {
+        std::swap(fd_, rhs.fd_);
+        std::swap(dir_, rhs.dir_);
+        std::swap(id_, rhs.id_);
+        std::swap(size_, rhs.size_);
+        std::swap(offset_, rhs.offset_);
+        return *this;
+    }
+    ~upload_writer();
+
+    // The total size of the upload, and the number of bytes written so far
+    std::uint64_t size() const noexcept { return size_; }
+    std::uint64_t offset() const noexcept { return offset_; }
+
+    // Appends data to the upload. data.size() must not exceed size() - offset().
+    // When the last byte is written, the upload is completed
+    error_code write(boost::span<const char> data);
+};
+
+// Stores uploads in a directory. Thread-safe: it holds no state besides its configuration,
+// and uploads are locked while being written
+class upload_store
+{
+    std::string dir_;
+    std::uint64_t max_size_;
+    std::size_t max_pending_;
+    std::chrono::seconds pending_ttl_;
+
+    std::string pending_dir(std::int64_t user_id) const;
+
+public:
+    // Uploads are stored in dir, which is created if it doesn't exist.
+    // Uploads can't be bigger than max_size bytes. Each user may have up to max_pending
+    // incomplete uploads. Incomplete uploads that haven't been written for pending_ttl are abandoned
+    upload_store(
+        std::string dir,
+        std::uint64_t max_size,
+        std::size_t max_pending,
+        std::chrono::seconds pending_ttl
+    );
+
+    std::uint64_t max_size() const noexcept { return max_size_; }
+    std::chrono::seconds pending_ttl() const noexcept { return pending_ttl_; }
+
+    // Creates an empty upload, returning its ID. size must be between 1 and max_size().
+    // Fails with errc::too_many_uploads if the user already has max_pending incomplete uploads.
+    // The user's abandoned uploads are removed first, and don't count. Concurrent calls
+    // for the same user may exceed the limit by the number of calls
+    result<std::string> create(std::int64_t user_id, std::uint64_t size, std::string_view content_type);
+
+    // Retrieves the state of an upload. Fails with errc::not_found if it doesn't exist
+    result<upload_info> get(std::string_view id) const;
+
+    // Opens an upload to append data to it. Fails with errc::not_found if it doesn't exist
+    // or is complete, and with errc::upload_in_progress if another writer has it open
+    result<upload_writer> open_writer(std::string_view id);
+
+    // The path of the file with the contents of an upload. Only exists once the upload completes
+    std::string data_path(std::string_view id) const;
+
+    // Removes the files of abandoned uploads, and files left by crashes.
+    // Uploads open by a writer are never removed. Returns the number of uploads removed.
+    // This performs blocking filesystem operations, so it shouldn't run in an event loop
+    std::size_t remove_abandoned();
+};
+
+// The store shared by all threads, storing uploads in UPLOAD_DIR. Configured by UPLOAD_MAX_SIZE_MB,
+// UPLOAD_MAX_PENDING and UPLOAD_PENDING_TTL.
+// Returns nullptr if UPLOAD_DIR is unset, in which case uploads are disabled
+upload_store* global_upload_store();
+
+}  // namespace chat
+
+#endif
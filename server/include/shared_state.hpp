@@ -13,6 +13,8 @@
 #include <memory>
 #include <string>
 
+#include "util/scrypt.hpp"
+
 namespace chat {
 
 // Forward declaration
@@ -20,9 +22,22 @@ class session_map;
 class redis_client;
 class mysql_client;
 class cookie_auth_service;
+class login_rate_limiter;
 class pubsub_service;
+class broadcast_aggregator;
+class bounded_thread_pool;
+class room_history_cache;
+class static_file_cache;
+class drain_controller;
+class admission_controller;
+class startup_tracker;
+class sharded_search_index;
+class shared_message_spool;
 
-// Contains singleton objects shared by all sessions in the server
+// Contains singleton objects shared by all sessions in the server.
+// When the server runs several threads, there is a shared_state object per
+// thread (a shard), which is only accessed from that thread. This way, objects
+// held here don't need to be thread-safe.
 class shared_state
 {
     struct
@@ -30,12 +45,39 @@ class shared_state
         std::string doc_root_;
         std::unique_ptr<redis_client> redis_;
         std::unique_ptr<mysql_client> mysql_;
-        std::unique_ptr<cookie_auth_service> cookie_auth_;
         std::unique_ptr<pubsub_service> pubsub_;
+        std::unique_ptr<broadcast_aggregator> aggregator_;
+        std::unique_ptr<cookie_auth_service> cookie_auth_;
+        std::unique_ptr<login_rate_limiter> login_limiter_;
+        bounded_thread_pool* hashing_pool_;
+        scrypt_params password_params_;
+        std::shared_ptr<room_history_cache> history_cache_;
+        const static_file_cache* static_files_;
+        std::unique_ptr<drain_controller> drainer_;
+        admission_controller* admission_;
+        startup_tracker* startup_;
+        sharded_search_index* search_index_;
+        shared_message_spool* spool_;
     } impl_;
 
 public:
-    shared_state(std::string doc_root, boost::asio::any_io_executor ex);
+    // Creates the shared state for the given executor, which must be the one
+    // that the shard will be running on. pubsub should be created using the same
+    // executor. hashing_pool, static_files, admission, startup, search_index and spool are shared
+    // between all shards, and must outlive this object. search_index and spool are nullptr if disabled.
+    // password_params are used to hash new passwords, and to upgrade outdated hashes on login.
+    shared_state(
+        std::string doc_root,
+        boost::asio::any_io_executor ex,
+        std::unique_ptr<pubsub_service> pubsub,
+        bounded_thread_pool& hashing_pool,
+        scrypt_params password_params,
+        const static_file_cache& static_files,
+        admission_controller& admission,
+        startup_tracker& startup,
+        sharded_search_index* search_index,
+        shared_message_spool* spool
+    );
     shared_state(const shared_state&) = delete;
     shared_state(shared_state&&) noexcept;
     shared_state& operator=(const shared_state&) = delete;
@@ -46,7 +88,18 @@ public:
     redis_client& redis() noexcept { return *impl_.redis_; }
     mysql_client& mysql() noexcept { return *impl_.mysql_; }
     cookie_auth_service& cookie_auth() noexcept { return *impl_.cookie_auth_; }
+    login_rate_limiter& login_limiter() noexcept { return *impl_.login_limiter_; }
     pubsub_service& pubsub() noexcept { return *impl_.pubsub_; }
+    broadcast_aggregator& aggregator() noexcept { return *impl_.aggregator_; }
+    bounded_thread_pool& hashing_pool() noexcept { return *impl_.hashing_pool_; }
+    scrypt_params password_params() const noexcept { return impl_.password_params_; }
+    room_history_cache& history_cache() noexcept { return *impl_.history_cache_; }
+    const static_file_cache& static_files() const noexcept { return *impl_.static_files_; }
+    drain_controller& drainer() noexcept { return *impl_.drainer_; }
+    admission_controller& admission() noexcept { return *impl_.admission_; }
+    startup_tracker& startup() noexcept { return *impl_.startup_; }
+    sharded_search_index* search_index() noexcept { return impl_.search_index_; }
+    shared_message_spool* spool() noexcept { return impl_.spool_; }
 };
 
 }  // namespace chat
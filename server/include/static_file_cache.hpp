@@ -0,0 +1,106 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_STATIC_FILE_CACHE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_STATIC_FILE_CACHE_HPP
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// An in-memory cache for the static files in the document root (the frontend bundle).
+// Files are loaded once at startup, together with any precompressed variants
+// (file.gz and file.br) that exist next to them, and served from memory afterwards.
+
+namespace chat {
+
+// The encodings a static file may be served with
+enum class content_encoding
+{
+    identity,
+    gzip,
+    br,
+};
+
+// The value of the Content-Encoding header for an encoding. Empty for identity
+std::string_view to_string(content_encoding value) noexcept;
+
+// Selects the encoding to serve, given the value of the Accept-Encoding header and
+// the variants that are available. Compressed variants are preferred over identity,
+// and brotli over gzip, as long as the client accepts them.
+content_encoding choose_content_encoding(std::string_view accept_encoding, bool has_gzip, bool has_br);
+
+// Returns true if the value of an If-None-Match header matches etag,
+// using the weak comparison function, as required by RFC 9110
+bool etag_matches(std::string_view if_none_match, std::string_view etag);
+
+// The cache is immutable once loaded, so it can be shared between threads
+class static_file_cache
+{
+public:
+    // A file, encoded with a certain encoding
+    struct representation
+    {
+        std::string content;
+
+        // Strong ETag, including the quotes. Different for each representation
+        std::string etag;
+    };
+
+    // A cached file
+    struct entry
+    {
+        representation identity;
+        std::optional<representation> gzip;
+        std::optional<representation> br;
+
+        // Returns the representation for the given encoding, which must be available
+        const representation& get(content_encoding enc) const noexcept
+        {
+            return enc == content_encoding::gzip ? *gzip : enc == content_encoding::br ? *br : identity;
+        }
+    };
+
+    // Creates an empty cache
+    static_file_cache() = default;
+
+    // Loads the files in doc_root. Files bigger than max_file_size are not cached,
+    // and loading stops once max_total_size bytes are held, including compressed variants.
+    static static_file_cache load(
+        const std::string& doc_root,
+        std::size_t max_total_size,
+        std::size_t max_file_size
+    );
+
+    // Adds a file to the cache. path is the URL path used to look it up (e.g. /index.html)
+    void add(
+        std::string path,
+        std::string content,
+        std::optional<std::string> gzip,
+        std::optional<std::string> br
+    );
+
+    // Looks up a file by URL path. Returns nullptr if the file is not cached
+    const entry* find(std::string_view path) const;
+
+    // Number of cached files
+    std::size_t size() const noexcept { return entries_.size(); }
+
+    // Total number of bytes held, including compressed variants
+    std::size_t size_bytes() const noexcept { return size_bytes_; }
+
+private:
+    std::map<std::string, entry, std::less<>> entries_;
+    std::size_t size_bytes_{0};
+};
+
+}  // namespace chat
+
+#endif
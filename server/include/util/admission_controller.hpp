@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ADMISSION_CONTROLLER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ADMISSION_CONTROLLER_HPP
+
+#include <atomic>
+#include <cstddef>
+
+#include "util/websocket_frame.hpp"
+
+// Admission control for client connections. Every connection is charged an estimate
+// of the memory it may use at its peak (its coroutine stack and buffers), and new connections
+// are rejected when either the maximum number of connections or the memory budget
+// would be exceeded. This keeps a connection flood from making the process run out of memory.
+
+namespace chat {
+
+// Limits on the resources used by client connections
+struct admission_config
+{
+    // Maximum number of concurrent client connections. Zero means no limit
+    std::size_t max_connections{10000u};
+
+    // Maximum memory (in bytes) that connections may use, as estimated by
+    // the functions below. Zero means no limit
+    std::size_t memory_budget{0u};
+
+    // Size of the stack of the coroutines running sessions, in bytes
+    std::size_t session_stack_size{128u * 1024u};
+
+    // Maximum size of a message received from a websocket client, in bytes
+    std::size_t websocket_max_message_size{64u * 1024u};
+};
+
+// Reads the admission config from the environment (MAX_CONNECTIONS, MEMORY_BUDGET_MB,
+// SESSION_STACK_SIZE_KB and WEBSOCKET_MAX_MESSAGE_SIZE). It's only read once
+const admission_config& get_admission_config();
+
+// The estimated peak memory used by a HTTP connection, including its coroutine stack
+// and the buffers required to parse requests and, if required, to run TLS
+std::size_t http_connection_cost(const admission_config& cfg, bool tls) noexcept;
+
+// The estimated memory required by a websocket session, in addition to http_connection_cost.
+// This includes the buffer for the biggest message we accept and, if compression
+// is offered, the compressor and decompressor state
+std::size_t websocket_session_cost(
+    const admission_config& cfg,
+    const websocket_compression_options& compression
+) noexcept;
+
+// Tracks the number of connections and the memory charged to them.
+// A single object is shared by all threads. This class is thread-safe.
+class admission_controller
+{
+    std::size_t max_connections_;
+    std::size_t memory_budget_;
+    std::atomic<std::size_t> connections_{0};
+    std::atomic<std::size_t> memory_{0};
+
+    bool try_acquire_memory(std::size_t bytes) noexcept;
+    void release(std::size_t connections, std::size_t bytes) noexcept;
+
+public:
+    // The right to keep a connection open. Releases the connection and the memory
+    // reserved for it when destroyed. Empty (false) if the connection was rejected
+    class ticket
+    {
+        friend class admission_controller;
+
+        admission_controller* self_{};
+        std::size_t bytes_{};
+
+        ticket(admission_controller* self, std::size_t bytes) noexcept : self_(self), bytes_(bytes) {}
+
+    public:
+        ticket() = default;
+        ticket(const ticket&) = delete;
+        ticket(ticket&& rhs) noexcept : self_(rhs.self_), bytes_(rhs.bytes_) { rhs.self_ = nullptr; }
+        ticket& operator=(const ticket&) = delete;
+        ticket& operator=(ticket&& rhs) noexcept;
+        ~ticket();
+
+        explicit operator bool() const noexcept { return self_ != nullptr; }
+
+        // The memory reserved by this connection
+        std::size_t reserved_memory() const noexcept { return bytes_; }
+
+        // Reserves more memory for this connection, e.g. when it's upgraded to a websocket.
+        // Returns false if this would exceed the budget, leaving the ticket unchanged.
+        // The ticket must not be empty
+        bool reserve(std::size_t extra_bytes) noexcept;
+    };
+
+    // Limits of zero mean no limit
+    admission_controller(std::size_t max_connections, std::size_t memory_budget) noexcept
+        : max_connections_(max_connections), memory_budget_(memory_budget)
+    {
+    }
+    admission_controller(const admission_controller&) = delete;
+    admission_controller& operator=(const admission_controller&) = delete;
+
+    // Admits a new connection, reserving bytes of memory for it.
+    // Returns an empty ticket if any of the limits would be exceeded
+    ticket try_admit(std::size_t bytes) noexcept;
+
+    // The current number of connections and the memory reserved by them
+    std::size_t num_connections() const noexcept { return connections_.load(std::memory_order_relaxed); }
+    std::size_t reserved_memory() const noexcept { return memory_.load(std::memory_order_relaxed); }
+};
+
+}  // namespace chat
+
+#endif
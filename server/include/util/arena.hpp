@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ARENA_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ARENA_HPP
+
+#include <boost/json/memory_resource.hpp>
+#include <boost/json/storage_ptr.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+namespace chat {
+
+// Scratch memory for the objects created while handling a single request or
+// websocket frame (e.g. JSON DOMs or temporary vectors). Memory is handed out
+// sequentially from a buffer that is allocated once, and is released in bulk by reset().
+// If the buffer is exhausted, further allocations go to the heap until reset.
+// Objects allocated from the arena must be destroyed before calling reset().
+// Each connection owns an arena, so this class is not thread-safe.
+class arena
+{
+    // Adapts resource_ to the memory resource type used by Boost.JSON
+    class json_resource final : public boost::json::memory_resource
+    {
+        std::pmr::memory_resource* inner_;
+
+        void* do_allocate(std::size_t n, std::size_t align) override { return inner_->allocate(n, align); }
+        void do_deallocate(void* p, std::size_t n, std::size_t align) override
+        {
+            inner_->deallocate(p, n, align);
+        }
+        bool do_is_equal(const boost::json::memory_resource& rhs) const noexcept override
+        {
+            return this == &rhs;
+        }
+
+    public:
+        explicit json_resource(std::pmr::memory_resource* inner) noexcept : inner_(inner) {}
+    };
+
+    std::size_t size_;
+    std::unique_ptr<unsigned char[]> buffer_;
+    std::pmr::monotonic_buffer_resource resource_;
+    json_resource json_resource_;
+
+public:
+    // Creates an arena with a buffer of the given size
+    explicit arena(std::size_t size = 4096u)
+        : size_(size),
+          buffer_(new unsigned char[size]),
+          resource_(buffer_.get(), size_),
+          json_resource_(&resource_)
+    {
+    }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    // A memory resource allocating from the arena, for std::pmr containers
+    std::pmr::memory_resource* resource() noexcept { return &resource_; }
+
+    // The same, for Boost.JSON values
+    boost::json::storage_ptr json_storage() noexcept { return boost::json::storage_ptr(&json_resource_); }
+
+    // Releases all the memory allocated from the arena, so the buffer can be reused
+    void reset() noexcept { resource_.release(); }
+};
+
+}  // namespace chat
+
+#endif
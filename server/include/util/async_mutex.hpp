@@ -8,29 +8,40 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ASYNC_MUTEX_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ASYNC_MUTEX_HPP
 
+#include <boost/asio/any_completion_handler.hpp>
 #include <boost/asio/any_io_executor.hpp>
-#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/spawn.hpp>
 
 #include <cassert>
+#include <cstddef>
 #include <deque>
 #include <memory>
-
-#include "error.hpp"
+#include <mutex>
+#include <utility>
 
 namespace chat {
 
 // An asynchronous mutex to guarantee mutual exclusion in async code. This is
 // similar to Python's asyncio.Mutex. Note that this is not thread-safe - it
 // ensures mutual exclusion between coroutines.
+// The mutex is fair: coroutines acquire it in the order they called lock.
+// When it's unlocked with coroutines waiting, ownership is handed to the first one
+// directly, without unlocking it, so no other coroutine can acquire it in between.
 class async_mutex
 {
+    using handler_type = boost::asio::any_completion_handler<void()>;
+
+    // Waiters are resumed through this executor
+    boost::asio::any_io_executor ex_;
+
     // Is the mutex locked?
     bool locked_{false};
 
-    // Acts as a condition variable, so that coroutines waiting to acquire
-    // the mutex can be notified when another coroutine releases it
-    boost::asio::experimental::channel<void(error_code)> chan_;
+    // Coroutines waiting to acquire the mutex, in the order they called lock
+    std::deque<handler_type> waiters_;
 
     struct guard_deleter
     {
@@ -39,7 +50,7 @@ class async_mutex
 
 public:
     // Constructors, assignments, destructor
-    async_mutex(boost::asio::any_io_executor ex) : chan_(std::move(ex)) {}
+    async_mutex(boost::asio::any_io_executor ex) : ex_(std::move(ex)) {}
     async_mutex(const async_mutex&) = delete;
     async_mutex(async_mutex&&) = default;
     async_mutex& operator=(const async_mutex&) = delete;
@@ -49,45 +60,155 @@ public:
     // Is the mutex locked?
     bool locked() const noexcept { return locked_; }
 
-    // Suspends the current coroutine until the mutex can be acquired, then acquire it
+    // The number of coroutines waiting to acquire the mutex
+    std::size_t num_waiters() const noexcept { return waiters_.size(); }
+
+    // Suspends the current coroutine until the mutex can be acquired, then acquire it.
+    // Doesn't suspend if the mutex is not locked
     void lock(boost::asio::yield_context yield)
     {
-        // Most of the time this loop will be executed zero times (if unlocked)
-        // or once (if locked). Race conditions could make another coroutine, different
-        // from the one waked by async_receive, acquire the lock before it. This loop guards against it.
-        while (locked_)
+        if (try_lock())
+            return;
+
+        // Wait for our turn. The mutex is ours when we're resumed
+        boost::asio::async_initiate<boost::asio::yield_context, void()>(
+            [this](handler_type handler) { waiters_.push_back(std::move(handler)); },
+            yield
+        );
+        assert(locked_);
+    }
+
+    // Try to acquire without suspending
+    bool try_lock() noexcept
+    {
+        if (locked_)
+            return false;
+        locked_ = true;
+        return true;
+    }
+
+    // Unlock. The mutex must be locked. If there are coroutines waiting,
+    // the first one becomes the owner, and is resumed
+    void unlock() noexcept
+    {
+        assert(locked_);
+        if (waiters_.empty())
         {
-            // Wait to be notified
-            error_code ec;
-            chan_.async_receive(yield[ec]);
-            assert(!ec);
+            locked_ = false;
+            return;
         }
 
-        // Mark as locked
-        locked_ = true;
+        // Handlers must not run inside unlock, so post the handler
+        auto handler = std::move(waiters_.front());
+        waiters_.pop_front();
+        boost::asio::post(ex_, std::move(handler));
+    }
+
+    using guard = std::unique_ptr<async_mutex, guard_deleter>;
+    guard lock_with_guard(boost::asio::yield_context yield)
+    {
+        lock(yield);
+        return guard(this);
+    }
+};
+
+// Like async_mutex, but thread-safe: it may be used by coroutines running in different
+// threads or io_contexts. Waiters are resumed in their own executors. The state is
+// protected by a std::mutex, which is only held for a few instructions, and never
+// while suspending or resuming coroutines. The uncontended lock and unlock cost an atomic
+// operation each. Use async_mutex if all the coroutines run in the same thread.
+class concurrent_async_mutex
+{
+    using work_guard_type = boost::asio::executor_work_guard<boost::asio::any_io_executor>;
+
+    // A coroutine waiting to acquire the mutex. The work guard keeps its io_context
+    // running while it waits, even if the owner runs in a different one
+    struct waiter
+    {
+        work_guard_type work;
+        boost::asio::any_completion_handler<void()> handler;
+    };
+
+    mutable std::mutex mtx_;
+    bool locked_{false};
+    std::deque<waiter> waiters_;
+
+    struct guard_deleter
+    {
+        void operator()(concurrent_async_mutex* self) const noexcept { self->unlock(); }
+    };
+
+public:
+    // Constructors, assignments, destructor
+    concurrent_async_mutex() = default;
+    concurrent_async_mutex(const concurrent_async_mutex&) = delete;
+    concurrent_async_mutex& operator=(const concurrent_async_mutex&) = delete;
+    ~concurrent_async_mutex() = default;
+
+    // Is the mutex locked? This may change as soon as it returns, so use it for diagnostics only
+    bool locked() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return locked_;
+    }
+
+    // Suspends the current coroutine until the mutex can be acquired, then acquire it.
+    // Doesn't suspend if the mutex is not locked. The coroutine is resumed in its own executor
+    void lock(boost::asio::yield_context yield)
+    {
+        if (try_lock())
+            return;
+
+        boost::asio::async_initiate<boost::asio::yield_context, void()>(
+            [this](boost::asio::any_completion_handler<void()> handler, boost::asio::any_io_executor ex) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (locked_)
+                {
+                    waiters_.push_back(waiter{boost::asio::make_work_guard(ex), std::move(handler)});
+                    return;
+                }
+
+                // Unlocked after our try_lock: it's ours
+                locked_ = true;
+                lock.unlock();
+                boost::asio::post(ex, std::move(handler));
+            },
+            yield,
+            yield.get_executor()
+        );
     }
 
     // Try to acquire without suspending
     bool try_lock() noexcept
     {
+        std::lock_guard<std::mutex> lock(mtx_);
         if (locked_)
             return false;
         locked_ = true;
         return true;
     }
 
-    // Unlock. The mutex must be locked
+    // Unlock. The mutex must be locked. If there are coroutines waiting,
+    // the first one becomes the owner, and is resumed in its executor
     void unlock() noexcept
     {
-        // Unlock
+        std::unique_lock<std::mutex> lock(mtx_);
         assert(locked_);
-        locked_ = false;
+        if (waiters_.empty())
+        {
+            locked_ = false;
+            return;
+        }
+        auto w = std::move(waiters_.front());
+        waiters_.pop_front();
+        lock.unlock();
 
-        // Notify any waiting coroutines
-        chan_.try_send(error_code());
+        auto ex = w.work.get_executor();
+        boost::asio::post(ex, std::move(w.handler));
+        w.work.reset();
     }
 
-    using guard = std::unique_ptr<async_mutex, guard_deleter>;
+    using guard = std::unique_ptr<concurrent_async_mutex, guard_deleter>;
     guard lock_with_guard(boost::asio::yield_context yield)
     {
         lock(yield);
@@ -12,6 +12,7 @@
 
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "error.hpp"
 
@@ -25,6 +26,29 @@ std::string base64_encode(boost::span<const unsigned char> input, bool with_padd
 // no padding is expected at the end of the string.
 result<std::vector<unsigned char>> base64_decode(std::string_view input, bool with_padding = true);
 
+// The implementations available for base64_encode and base64_decode. Vectorized kernels
+// process most of the input, and the scalar code handles the rest (including padding
+// and errors). Only available on x86-64. Kernels are sorted by preference
+enum class base64_kernel
+{
+    scalar,
+    ssse3,
+    avx2,
+};
+
+// Whether the CPU supports the given kernel. The overloads without a kernel
+// argument use the best kernel supported by the CPU
+bool base64_kernel_supported(base64_kernel kernel) noexcept;
+
+// Like the above, but using the given kernel. kernel must be supported by the CPU.
+// Intended for tests and benchmarks
+std::string base64_encode(boost::span<const unsigned char> input, bool with_padding, base64_kernel kernel);
+result<std::vector<unsigned char>> base64_decode(
+    std::string_view input,
+    bool with_padding,
+    base64_kernel kernel
+);
+
 }  // namespace chat
 
 #endif
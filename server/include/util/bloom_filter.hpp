@@ -0,0 +1,81 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_BLOOM_FILTER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_BLOOM_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace chat {
+
+// A probabilistic set of strings. contains() never returns false for a string that was added,
+// but may return true for strings that weren't (a false positive). With 10 bits per
+// expected element and 7 hash functions, false positives happen about 1% of the time.
+// Elements can't be removed: the filter should be rebuilt instead. Not thread-safe.
+class bloom_filter
+{
+    static constexpr std::size_t bits_per_element = 10u;
+    static constexpr std::size_t num_hashes = 7u;
+
+    std::vector<std::uint64_t> words_;
+    std::size_t num_bits_;
+
+    // Derives the num_hashes bit positions from two independent hashes
+    // (Kirsch and Mitzenmacher, "Less hashing, same performance")
+    template <class Fn>
+    void for_each_bit(std::string_view value, Fn&& fn) const
+    {
+        std::uint64_t h1 = std::hash<std::string_view>{}(value);
+
+        // A splitmix64 finalizer, to get a second hash out of the first one
+        std::uint64_t h2 = h1 + 0x9e3779b97f4a7c15u;
+        h2 = (h2 ^ (h2 >> 30)) * 0xbf58476d1ce4e5b9u;
+        h2 = (h2 ^ (h2 >> 27)) * 0x94d049bb133111ebu;
+        h2 = (h2 ^ (h2 >> 31)) | 1u;
+
+        for (std::size_t i = 0; i < num_hashes; ++i)
+            fn(static_cast<std::size_t>((h1 + i * h2) % num_bits_));
+    }
+
+public:
+    // Creates an empty filter sized for expected_size elements. Adding more
+    // elements works, but increases the false positive rate
+    explicit bloom_filter(std::size_t expected_size = 0u)
+        : words_(((expected_size < 64u ? 64u : expected_size) * bits_per_element + 63u) / 64u),
+          num_bits_(words_.size() * 64u)
+    {
+    }
+
+    // Adds a value to the filter
+    void add(std::string_view value)
+    {
+        for_each_bit(value, [this](std::size_t bit) {
+            words_[bit / 64u] |= std::uint64_t(1) << (bit % 64u);
+        });
+    }
+
+    // Returns false if value was never added, and true if it probably was
+    bool contains(std::string_view value) const
+    {
+        bool res = true;
+        for_each_bit(value, [this, &res](std::size_t bit) {
+            res = res && (words_[bit / 64u] & (std::uint64_t(1) << (bit % 64u)));
+        });
+        return res;
+    }
+
+    // The memory used by the filter, in bytes
+    std::size_t memory_usage() const noexcept { return words_.size() * sizeof(std::uint64_t); }
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,174 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_BOUNDED_THREAD_POOL_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_BOUNDED_THREAD_POOL_HPP
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include "error.hpp"
+
+namespace chat {
+
+// A thread pool to run CPU-intensive tasks (like password hashing) outside
+// the event loop threads. The number of tasks that may be pending at any given
+// time is limited, so that a burst of requests doesn't make latency grow without bound.
+// This class is thread-safe.
+class bounded_thread_pool
+{
+public:
+    // Statistics about the pool
+    struct stats_t
+    {
+        // Number of tasks that are either running or waiting to run
+        std::size_t pending;
+
+        // Number of tasks rejected because the queue was full
+        std::uint64_t rejected;
+
+        // Number of tasks that completed execution
+        std::uint64_t completed;
+    };
+
+    // Creates a pool with num_threads threads, allowing up to max_pending tasks
+    // (running or enqueued) at any given time.
+    bounded_thread_pool(std::size_t num_threads, std::size_t max_pending)
+        : pool_(num_threads), max_pending_(max_pending)
+    {
+    }
+    bounded_thread_pool(const bounded_thread_pool&) = delete;
+    bounded_thread_pool& operator=(const bounded_thread_pool&) = delete;
+    ~bounded_thread_pool() = default;
+
+    // Runs fn() in the pool, suspending the calling coroutine until it's done,
+    // and returns fn's result. The coroutine is resumed in its original executor.
+    // If the maximum number of pending tasks has been reached, fn is not run
+    // and errc::queue_full is returned.
+    // Exceptions thrown by fn are propagated to the calling coroutine.
+    template <class Fn>
+    result<std::invoke_result_t<Fn&>> run(Fn fn, boost::asio::yield_context yield)
+    {
+        using return_type = std::invoke_result_t<Fn&>;
+
+        // Check that we can accept more work
+        if (!try_acquire())
+            CHAT_RETURN_ERROR(errc::queue_full)
+
+        return boost::asio::async_initiate<boost::asio::yield_context, void(std::exception_ptr, return_type)>(
+            [this](auto handler, Fn fn) {
+                // Make the handler's executor aware that there's outstanding work.
+                // Otherwise, the io_context could run out of work and return
+                auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler));
+                using task_type = task<Fn, decltype(handler), decltype(work)>;
+                boost::asio::post(pool_, task_type{this, std::move(fn), std::move(handler), std::move(work)});
+            },
+            yield,
+            std::move(fn)
+        );
+    }
+
+    // Retrieves the current pool statistics
+    stats_t stats() const noexcept
+    {
+        return {
+            pending_.load(std::memory_order_relaxed),
+            rejected_.load(std::memory_order_relaxed),
+            completed_.load(std::memory_order_relaxed),
+        };
+    }
+
+    // Stops the pool and waits for the threads to exit. Tasks that didn't start
+    // execution are discarded. To be called at shutdown, once all the event loops
+    // have been stopped
+    void stop_and_join()
+    {
+        pool_.stop();
+        pool_.join();
+    }
+
+private:
+    // The function object posted to the pool. Runs fn, then dispatches
+    // the completion handler back to the original executor
+    template <class Fn, class Handler, class WorkGuard>
+    struct task
+    {
+        bounded_thread_pool* self;
+        Fn fn;
+        Handler handler;
+        WorkGuard work;
+
+        void operator()()
+        {
+            // Run the function, capturing any exception
+            std::exception_ptr exc;
+            std::invoke_result_t<Fn&> res{};
+            try
+            {
+                res = fn();
+            }
+            catch (...)
+            {
+                exc = std::current_exception();
+            }
+
+            // Update counters
+            self->release();
+
+            // Resume the coroutine in its executor
+            boost::asio::dispatch(
+                work.get_executor(),
+                [handler = std::move(handler), exc, res = std::move(res)]() mutable {
+                    std::move(handler)(exc, std::move(res));
+                }
+            );
+            work.reset();
+        }
+    };
+
+    boost::asio::thread_pool pool_;
+    std::size_t max_pending_;
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<std::uint64_t> rejected_{0};
+    std::atomic<std::uint64_t> completed_{0};
+
+    bool try_acquire() noexcept
+    {
+        auto current = pending_.load(std::memory_order_relaxed);
+        do
+        {
+            if (current >= max_pending_)
+            {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!pending_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    void release() noexcept
+    {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        completed_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+}  // namespace chat
+
+#endif
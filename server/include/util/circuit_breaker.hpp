@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CIRCUIT_BREAKER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CIRCUIT_BREAKER_HPP
+
+#include <chrono>
+#include <cstddef>
+
+namespace chat {
+
+// Configures a circuit_breaker
+struct circuit_breaker_params
+{
+    // Consecutive failures that open the circuit
+    std::size_t failure_threshold;
+
+    // How long the circuit stays open before letting a request through again
+    std::chrono::milliseconds open_duration;
+};
+
+// A circuit breaker, to stop sending requests to a service that is failing.
+// The circuit starts closed, letting all requests through. After failure_threshold
+// consecutive failures, it opens, and requests are rejected without being sent.
+// Once open_duration has elapsed, a single request (a probe) is let through:
+// if it succeeds, the circuit closes again. Otherwise, it stays open for another open_duration.
+// Not thread-safe
+class circuit_breaker
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    enum class state
+    {
+        closed,     // Requests are let through
+        open,       // Requests are rejected
+        half_open,  // A probe is in progress. Other requests are rejected
+    };
+
+    explicit circuit_breaker(circuit_breaker_params params) noexcept : params_(params) {}
+
+    state get_state() const noexcept { return state_; }
+
+    // Returns whether a request may be sent at time now. If it returns true,
+    // the outcome of the request must be reported with on_success or on_failure
+    bool allow(clock_type::time_point now) noexcept
+    {
+        switch (state_)
+        {
+        case state::closed: return true;
+        case state::open:
+            if (now < open_until_)
+                return false;
+            state_ = state::half_open;
+            return true;
+        default: return false;
+        }
+    }
+
+    // Reports that a request succeeded. Closes the circuit
+    void on_success() noexcept
+    {
+        state_ = state::closed;
+        failures_ = 0u;
+    }
+
+    // Reports that a request failed at time now. Returns true if this opened the circuit
+    bool on_failure(clock_type::time_point now) noexcept
+    {
+        if (state_ == state::closed && ++failures_ < params_.failure_threshold)
+            return false;
+        bool opened = state_ == state::closed;
+        state_ = state::open;
+        open_until_ = now + params_.open_duration;
+        return opened;
+    }
+
+private:
+    circuit_breaker_params params_;
+    state state_{state::closed};
+    std::size_t failures_{0u};
+    clock_type::time_point open_until_{};
+};
+
+}  // namespace chat
+
+#endif
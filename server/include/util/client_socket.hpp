@@ -0,0 +1,243 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CLIENT_SOCKET_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CLIENT_SOCKET_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/compose.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "error.hpp"
+
+// A connection accepted by the listener: a TCP socket, optionally secured with TLS.
+// OpenSSL is driven directly over the socket (rather than using asio::ssl's memory BIOs),
+// so it can hand encryption over to the kernel (kTLS) once the handshake is done.
+// When that happens, writes go straight to the socket, and sendfile can be used.
+
+// Forward declaration, to avoid including OpenSSL headers
+struct ssl_st;
+
+namespace chat {
+
+// Forward declaration
+class tls_context;
+
+class client_socket
+{
+    // What a non-blocking TLS operation needs to make progress
+    enum class tls_wait
+    {
+        none,   // it completed, successfully or not
+        read,   // the socket must become readable
+        write,  // the socket must become writable
+    };
+
+    struct tls_io_result
+    {
+        std::size_t bytes;
+        tls_wait wait;
+        error_code ec;
+    };
+
+    struct ssl_deleter
+    {
+        void operator()(ssl_st* ssl) const noexcept;
+    };
+
+    boost::asio::ip::tcp::socket sock_;
+    std::unique_ptr<ssl_st, ssl_deleter> ssl_;
+
+    // Set if the kernel encrypts the data we write
+    bool ktls_send_{false};
+
+    // Small buffers are coalesced here before being written, to avoid tiny TLS records
+    std::string write_buffer_;
+
+    // Performs a TLS read or write without blocking. Defined in the .cpp to keep OpenSSL out of this header
+    tls_io_result tls_read(boost::asio::mutable_buffer buff);
+    tls_io_result tls_write(boost::asio::const_buffer buff);
+
+    // Writes without TLS or with kTLS go directly to the socket
+    bool writes_to_socket() const noexcept { return !ssl_ || ktls_send_; }
+
+    static constexpr std::size_t coalesce_limit = 16u * 1024u;
+
+    template <class Buffers>
+    boost::asio::mutable_buffer first_buffer(const Buffers& buffers)
+    {
+        auto last = boost::asio::buffer_sequence_end(buffers);
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != last; ++it)
+        {
+            boost::asio::mutable_buffer buff(*it);
+            if (buff.size() != 0u)
+                return buff;
+        }
+        return {};
+    }
+
+    // Selects the data for a TLS write. Small buffers are copied, so they end up in a single record
+    template <class Buffers>
+    boost::asio::const_buffer coalesce(const Buffers& buffers)
+    {
+        auto first = boost::asio::buffer_sequence_begin(buffers);
+        auto last = boost::asio::buffer_sequence_end(buffers);
+        for (; first != last && boost::asio::const_buffer(*first).size() == 0u; ++first)
+            ;
+        if (first == last)
+            return {};
+        boost::asio::const_buffer head(*first);
+        if (head.size() >= coalesce_limit || std::next(first) == last)
+            return head;
+
+        write_buffer_.clear();
+        for (; first != last && write_buffer_.size() < coalesce_limit; ++first)
+        {
+            boost::asio::const_buffer buff(*first);
+            auto size = (std::min)(buff.size(), coalesce_limit - write_buffer_.size());
+            write_buffer_.append(static_cast<const char*>(buff.data()), size);
+        }
+        return boost::asio::buffer(write_buffer_);
+    }
+
+    // Runs a TLS read or write, waiting for the socket as required. Completions are never
+    // invoked from the initiating function, as required by Asio
+    template <class Buffer, bool is_read>
+    struct tls_op
+    {
+        client_socket& self_;
+        Buffer buff_;
+        enum
+        {
+            starting,
+            waiting,
+            posted
+        } state_{starting};
+        tls_io_result result_{};
+
+        template <class Self>
+        void operator()(Self& self, error_code ec = {})
+        {
+            if (state_ == posted)
+                return self.complete(result_.ec, result_.bytes);
+            if (ec)
+                return self.complete(ec, 0u);
+
+            bool first_call = state_ == starting;
+            if constexpr (is_read)
+                result_ = self_.tls_read(buff_);
+            else
+                result_ = self_.tls_write(buff_);
+
+            if (result_.wait != tls_wait::none)
+            {
+                state_ = waiting;
+                self_.sock_.async_wait(
+                    result_.wait == tls_wait::read ? boost::asio::ip::tcp::socket::wait_read
+                                                   : boost::asio::ip::tcp::socket::wait_write,
+                    std::move(self)
+                );
+            }
+            else if (first_call)
+            {
+                state_ = posted;
+                boost::asio::post(self_.sock_.get_executor(), std::move(self));
+            }
+            else
+            {
+                self.complete(result_.ec, result_.bytes);
+            }
+        }
+    };
+
+public:
+    using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+    // Wraps a socket. The connection is in plaintext until tls_handshake is called
+    explicit client_socket(boost::asio::ip::tcp::socket&& sock) noexcept;
+    client_socket(const client_socket&) = delete;
+    client_socket(client_socket&&) noexcept;
+    client_socket& operator=(const client_socket&) = delete;
+    client_socket& operator=(client_socket&&) noexcept;
+    ~client_socket();
+
+    executor_type get_executor() noexcept { return sock_.get_executor(); }
+
+    // The underlying socket. Bytes must not be read or written through it
+    // unless the connection is plaintext or kernel TLS is in use (see writes_to_socket)
+    boost::asio::ip::tcp::socket& socket() noexcept { return sock_; }
+
+    // Whether TLS is being used
+    bool is_tls() const noexcept { return ssl_ != nullptr; }
+
+    // Whether the data we write is encrypted by the kernel. Always false for plaintext connections
+    bool ktls_send() const noexcept { return ktls_send_; }
+
+    // Runs the server side of the TLS handshake. Fails if it doesn't complete within timeout
+    error_code tls_handshake(
+        const tls_context& ctx,
+        std::chrono::steady_clock::duration timeout,
+        boost::asio::yield_context yield
+    );
+
+    // Reads some data, decrypting it as required
+    template <class MutableBufferSequence, class ReadToken>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadToken&& token)
+    {
+        if (!ssl_)
+            return sock_.async_read_some(buffers, std::forward<ReadToken>(token));
+        return boost::asio::async_compose<ReadToken, void(error_code, std::size_t)>(
+            tls_op<boost::asio::mutable_buffer, true>{*this, first_buffer(buffers)},
+            token,
+            sock_
+        );
+    }
+
+    // Writes some data, encrypting it as required
+    template <class ConstBufferSequence, class WriteToken>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteToken&& token)
+    {
+        if (writes_to_socket())
+            return sock_.async_write_some(buffers, std::forward<WriteToken>(token));
+        return boost::asio::async_compose<WriteToken, void(error_code, std::size_t)>(
+            tls_op<boost::asio::const_buffer, false>{*this, coalesce(buffers)},
+            token,
+            sock_
+        );
+    }
+
+    // Sends a TLS close_notify alert, if TLS is in use. This is best-effort:
+    // if the socket is not writable, the alert is not sent
+    void send_close_notify() noexcept;
+
+    // Sends close_notify and shuts down the socket for sending
+    void shutdown_send(error_code& ec) noexcept;
+
+    // Sends close_notify and closes the socket
+    void close(error_code& ec) noexcept;
+};
+
+// Called by Beast when websocket operations time out
+inline void beast_close_socket(client_socket& sock)
+{
+    error_code ec;
+    sock.socket().close(ec);
+}
+
+}  // namespace chat
+
+#endif
@@ -167,6 +167,10 @@ public:
 
     // One-past-the-end sentinel iterator
     const_iterator end() const noexcept { return const_iterator(); }
+
+    // Returns the value of the first cookie named name, or std::nullopt if
+    // there is none. Equivalent to iterating the list, but faster
+    std::optional<std::string_view> find_cookie(std::string_view name) const noexcept;
 };
 
 }  // namespace chat
@@ -0,0 +1,45 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CPU_AFFINITY_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_CPU_AFFINITY_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "error.hpp"
+
+// Helpers to pin event loops to CPUs. A pinned thread allocates memory from its
+// NUMA node (Linux allocates pages on the node of the CPU that first touches them),
+// so each shard's caches and buffers stay local to the core running it.
+// Only supported on Linux: elsewhere, these functions fail with operation_not_supported.
+
+namespace chat {
+
+// The CPUs this process is allowed to run on (e.g. as restricted by taskset or cgroups),
+// in ascending order. Empty if they can't be determined
+std::vector<int> available_cpus();
+
+// The CPU that shard number shard_idx should be pinned to: the available CPUs are assigned in order,
+// wrapping around if there are more shards than CPUs. cpus must not be empty
+inline int shard_cpu(const std::vector<int>& cpus, std::size_t shard_idx)
+{
+    return cpus[shard_idx % cpus.size()];
+}
+
+// Restricts the calling thread to run only on the given CPU
+error_code pin_current_thread(int cpu);
+
+// Sets SO_INCOMING_CPU on a listening socket. When several SO_REUSEPORT listeners are bound
+// to the same port, the kernel prefers handing a new connection to the listener whose CPU
+// processed its packets, so the connection is served by the core that receives its traffic.
+// This only has an effect if NIC queues (RSS) or RPS steer traffic to the CPUs running the shards
+error_code set_incoming_cpu(int native_socket, int cpu);
+
+}  // namespace chat
+
+#endif
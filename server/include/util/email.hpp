@@ -8,9 +8,12 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_EMAIL_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_EMAIL_HPP
 
+#include <string_view>
+
 namespace chat {
 
-// Returns true if the given string is a valid email (by pattern matching)
+// Returns true if the given string is a valid email (by pattern matching).
+// Doesn't allocate. The string should be UTF-8 encoded
 bool is_email(std::string_view str);
 
 }  // namespace chat
@@ -0,0 +1,33 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ENV_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_ENV_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Helpers to read configuration from environment variables.
+
+namespace chat {
+
+// Returns the value of the given environment variable, or default_value if it's not set
+std::string get_env_string(const char* name, std::string_view default_value);
+
+// Returns the value of the given environment variable, parsed as an unsigned integer.
+// Returns default_value if the variable is not set or doesn't contain a valid integer
+std::size_t get_env_size(const char* name, std::size_t default_value);
+
+// Returns the value of the given environment variable, parsed as a boolean
+// ("1", "true", "yes" and "on" are true; "0", "false", "no" and "off" are false).
+// Returns default_value if the variable is not set or doesn't contain a valid value
+bool get_env_bool(const char* name, bool default_value);
+
+}  // namespace chat
+
+#endif
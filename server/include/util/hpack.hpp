@@ -0,0 +1,126 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HPACK_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HPACK_HPP
+
+#include <boost/core/span.hpp>
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+// HPACK header compression, as used by HTTP/2 (RFC 7541).
+
+namespace chat {
+
+// A header field. Names are lowercase, as required by HTTP/2
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+};
+
+// The size of the dynamic tables used by both endpoints, unless changed with SETTINGS
+inline constexpr std::size_t hpack_default_table_size = 4096u;
+
+// The dynamic table shared by an encoder and the peer's decoder. Newest entries first
+class hpack_dynamic_table
+{
+    std::deque<hpack_header> entries_;
+    std::size_t size_{0};
+    std::size_t max_size_;
+
+    void evict(std::size_t max_size);
+
+public:
+    explicit hpack_dynamic_table(std::size_t max_size) noexcept : max_size_(max_size) {}
+
+    // The number of entries
+    std::size_t num_entries() const noexcept { return entries_.size(); }
+
+    // The size of the entries, as defined by the RFC (32 bytes of overhead per entry)
+    std::size_t size() const noexcept { return size_; }
+    std::size_t max_size() const noexcept { return max_size_; }
+
+    // Evicts entries until size() <= max_size
+    void set_max_size(std::size_t max_size);
+
+    // Adds an entry, evicting old ones as required. An entry bigger than
+    // max_size() empties the table, and is not added
+    void add(std::string_view name, std::string_view value);
+
+    // Entry i (zero is the newest one). i must be less than num_entries()
+    const hpack_header& at(std::size_t i) const noexcept { return entries_[i]; }
+};
+
+// Decodes the header blocks sent by a peer. There is a decoder per connection
+class hpack_decoder
+{
+    hpack_dynamic_table table_;
+    std::size_t max_table_size_;
+
+public:
+    // max_table_size is the dynamic table size we advertise (SETTINGS_HEADER_TABLE_SIZE)
+    explicit hpack_decoder(std::size_t max_table_size = hpack_default_table_size) noexcept
+        : table_(max_table_size), max_table_size_(max_table_size)
+    {
+    }
+
+    // Decodes a complete header block, appending the fields to headers.
+    // Fails if the block is malformed, or if the decoded fields exceed max_list_size
+    // (computed as specified for SETTINGS_MAX_HEADER_LIST_SIZE). Errors are fatal for the connection.
+    error_code decode(
+        boost::span<const unsigned char> block,
+        std::vector<hpack_header>& headers,
+        std::size_t max_list_size
+    );
+
+    const hpack_dynamic_table& table() const noexcept { return table_; }
+};
+
+// Encodes header blocks to be sent to a peer. Fields are added to the dynamic table,
+// so headers repeated across responses (like content-type) are sent as a single byte.
+// Fields that change with every response (like content-length) or that are
+// sensitive (like set-cookie) are never indexed. Strings are Huffman-encoded if that
+// makes them shorter.
+class hpack_encoder
+{
+    hpack_dynamic_table table_;
+
+    // Set when the peer changes the maximum table size. Signaled at the start of the next block
+    bool table_size_changed_{false};
+    std::size_t min_table_size_{0};
+
+public:
+    explicit hpack_encoder(std::size_t max_table_size = hpack_default_table_size) noexcept
+        : table_(max_table_size), min_table_size_(max_table_size)
+    {
+    }
+
+    // Sets the maximum dynamic table size, as received in the peer's SETTINGS_HEADER_TABLE_SIZE
+    void set_max_table_size(std::size_t value);
+
+    // Encodes a complete header block, appending it to out
+    void encode(boost::span<const hpack_header> headers, std::string& out);
+
+    const hpack_dynamic_table& table() const noexcept { return table_; }
+};
+
+// Huffman-encodes input using the HPACK code, appending the result to out. Exposed for testing
+void hpack_huffman_encode(std::string_view input, std::string& out);
+
+// Decodes a Huffman-encoded string, appending the result to out. Exposed for testing
+error_code hpack_huffman_decode(boost::span<const unsigned char> input, std::string& out);
+
+}  // namespace chat
+
+#endif
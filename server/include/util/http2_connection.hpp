@@ -0,0 +1,214 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HTTP2_CONNECTION_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HTTP2_CONNECTION_HPP
+
+#include <boost/core/span.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+#include "util/hpack.hpp"
+#include "util/sendfile.hpp"
+
+// The server side of the HTTP/2 protocol (RFC 9113): framing, stream multiplexing,
+// flow control and header compression. It doesn't perform any I/O: bytes received
+// from the client are passed in, and frames to be sent are retrieved as bytes.
+// This keeps protocol logic testable. http2_session.hpp runs it over a socket.
+// Server push and the extended CONNECT protocol are not supported.
+
+namespace chat {
+
+// Error codes sent in RST_STREAM and GOAWAY frames (RFC 9113, section 7)
+enum class http2_error_code : std::uint32_t
+{
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    enhance_your_calm = 0xb,
+};
+
+// A complete request, received on a stream
+struct http2_request
+{
+    std::uint32_t stream_id;
+
+    // Pseudo-headers (like :method and :path) come first
+    std::vector<hpack_header> headers;
+
+    std::string body;
+};
+
+// A response to a request
+struct http2_response
+{
+    // Must start with :status. Names must be lowercase
+    std::vector<hpack_header> headers;
+
+    // If file is set, the body is read from it. Otherwise, body is sent
+    std::string body;
+    std::optional<file_transfer> file;
+};
+
+class http2_connection
+{
+public:
+    // What we accept from clients
+    struct config
+    {
+        // Requests being handled at the same time, including the ones reset by the client
+        // whose handlers are still running. Additional ones are refused
+        std::uint32_t max_concurrent_streams{100};
+
+        // Limit for the size of request headers, as defined by SETTINGS_MAX_HEADER_LIST_SIZE
+        std::uint32_t max_header_list_size{16384};
+
+        // Streams with bigger request bodies are reset
+        std::size_t max_body_size{10000};
+
+        // Limit for the size of the frames we send in reply to the client's (like PING and
+        // SETTINGS acknowledgements) that haven't been retrieved yet. If the client keeps sending
+        // frames without reading our replies, the connection fails with ENHANCE_YOUR_CALM
+        std::size_t max_control_size{65536};
+    };
+
+    // The first bytes sent by clients. Used to detect HTTP/2 with prior knowledge
+    static constexpr std::string_view client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    // Creates a connection. Our SETTINGS frame is queued to be sent
+    explicit http2_connection(const config& cfg);
+
+    // Processes bytes received from the client, which don't need to be split at frame boundaries.
+    // Complete requests can then be retrieved with take_requests. Fails on connection errors:
+    // a GOAWAY frame is queued, and the connection should be closed once it's written.
+    // Further data is ignored
+    error_code on_data(boost::span<const unsigned char> data);
+
+    // Returns the requests received since the last call
+    std::vector<http2_request> take_requests() { return std::exchange(requests_, {}); }
+
+    // Submits the response for a request. Ignored if the stream was reset by the client.
+    // Every request returned by take_requests must be completed by calling either this
+    // function or reset_stream, since the request counts against the stream limit until then
+    void submit_response(std::uint32_t stream_id, http2_response&& response);
+
+    // Resets a stream whose request couldn't be handled
+    void reset_stream(std::uint32_t stream_id, http2_error_code code);
+
+    // Stops accepting new streams by sending a GOAWAY frame. Streams in progress are completed
+    void shutdown();
+
+    // Appends frames that are ready to be sent to out, until around max_size bytes are appended.
+    // Frames for different streams are interleaved, subject to flow control.
+    // Returns whether anything was appended
+    bool write_frames(std::string& out, std::size_t max_size);
+
+    // Whether the connection can be closed: a GOAWAY has been sent or received, all streams
+    // have been completed, and all frames have been retrieved
+    bool done() const noexcept;
+
+    // The number of streams receiving a request or sending a response
+    std::size_t num_streams() const noexcept { return streams_.size(); }
+
+private:
+    struct stream
+    {
+        // The request, until it's complete
+        std::vector<hpack_header> headers;
+        std::string body;
+        bool request_complete{false};
+
+        // How much data we may send, as allowed by the client
+        std::int64_t send_window;
+
+        // The response being sent
+        bool has_response{false};
+        bool headers_sent{false};
+        http2_response response;
+        std::uint64_t bytes_sent{0};
+        std::uint64_t body_size{0};
+
+        explicit stream(std::int64_t send_window) noexcept : send_window(send_window) {}
+    };
+
+    config cfg_;
+    hpack_decoder decoder_;
+    hpack_encoder encoder_;
+    std::unordered_map<std::uint32_t, stream> streams_;
+
+    // Streams with a response to be sent, in round-robin order
+    std::deque<std::uint32_t> sending_;
+
+    // Received data not yet processed, and output frames not related to responses
+    std::string input_;
+    std::string control_;
+
+    std::vector<http2_request> requests_;
+
+    // Streams whose request has been retrieved, but that have no response yet.
+    // They may have been reset by the client
+    std::unordered_set<std::uint32_t> handling_;
+
+    // Connection state
+    bool preface_received_{false};
+    bool failed_{false};
+    bool goaway_sent_{false};
+    bool goaway_received_{false};
+    std::uint32_t last_stream_id_{0};
+
+    // A header block split across HEADERS and CONTINUATION frames
+    std::uint32_t continuation_stream_{0};
+    bool continuation_end_stream_{false};
+    std::string header_block_;
+
+    // Client settings
+    std::uint32_t peer_initial_window_size_;
+    std::uint32_t peer_max_frame_size_;
+    std::int64_t connection_send_window_;
+
+    error_code on_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    error_code on_headers(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    error_code on_continuation(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    error_code on_header_block(std::uint32_t id, bool end_stream);
+    error_code on_data_frame(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    error_code on_settings(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    error_code on_window_update(std::uint32_t id, std::string_view payload);
+    void on_request_complete(std::uint32_t id, stream& s);
+    std::size_t num_active_streams() const noexcept;
+    error_code connection_error(http2_error_code code);
+    void stream_error(std::uint32_t id, http2_error_code code);
+    bool write_stream_frame(std::uint32_t id, stream& s, std::string& out, std::size_t max_size);
+};
+
+// Utilities to compose frames. Exposed for testing
+void http2_append_frame_header(
+    std::string& out,
+    std::size_t length,
+    std::uint8_t type,
+    std::uint8_t flags,
+    std::uint32_t stream_id
+);
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HTTP_RANGE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_HTTP_RANGE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Helpers to handle HTTP range requests (RFC 9110, section 14)
+
+namespace chat {
+
+// A range of bytes within a file
+struct byte_range
+{
+    // First byte in the range
+    std::uint64_t offset;
+
+    // Number of bytes in the range
+    std::uint64_t size;
+};
+
+// The result of parsing a Range header
+struct parsed_range
+{
+    enum kind_t
+    {
+        // No usable range was requested: the entire file should be sent.
+        // This includes syntactically invalid headers and multiple ranges, which
+        // servers are allowed to ignore
+        none,
+
+        // A single, valid range was requested
+        single,
+
+        // The request can't be satisfied (416)
+        unsatisfiable,
+    } kind;
+
+    // The requested range, if kind == single
+    byte_range range;
+};
+
+// Parses the value of a Range header, for a file with file_size bytes
+parsed_range parse_range_header(std::string_view value, std::uint64_t file_size);
+
+// Formats the value of a Content-Range header, for a 206 response
+std::string format_content_range(byte_range range, std::uint64_t file_size);
+
+// Formats the value of a Content-Range header, for a 416 response
+std::string format_unsatisfiable_content_range(std::uint64_t file_size);
+
+}  // namespace chat
+
+#endif
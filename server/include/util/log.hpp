@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_LOG_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_LOG_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// A process-wide, asynchronous logger. Records are placed in a lock-free
+// ring buffer and written to stderr by a background thread, so logging never
+// blocks the event loop threads. If the buffer is full, records are dropped.
+// Before start_logging is called (and after stop_logging), records are written synchronously.
+
+namespace chat {
+
+// Severity levels
+enum class log_level
+{
+    debug,
+    info,
+    warning,
+    error,
+};
+
+// Parses a level name (debug, info, warning or error)
+std::optional<log_level> parse_log_level(std::string_view name) noexcept;
+
+// Launches the background thread. Records with a level lower than min_level are discarded.
+// Must be called once, before any other thread is launched
+void start_logging(log_level min_level);
+
+// Writes any pending records and stops the background thread.
+// Must be called after all other threads have finished
+void stop_logging();
+
+// Returns true if a record with the given level would be logged. Use it to skip
+// composing records that would be discarded
+bool should_log(log_level level) noexcept;
+
+// Enqueues a record. Records longer than an implementation-defined limit are truncated.
+// Thread-safe, never blocks
+void log_message(log_level level, std::string_view msg) noexcept;
+
+// The number of records dropped because the ring buffer was full
+std::uint64_t log_dropped_count() noexcept;
+
+// Lets through one of every N calls. Used to log high-frequency events.
+// Thread-safe
+class log_sampler
+{
+    std::size_t rate_;
+    std::atomic<std::size_t> counter_{0};
+
+public:
+    // rate = 0 disables sampling
+    explicit log_sampler(std::size_t rate) noexcept : rate_(rate) {}
+
+    // Returns true if this event should be logged
+    bool operator()() noexcept
+    {
+        return rate_ != 0u && counter_.fetch_add(1u, std::memory_order_relaxed) % rate_ == 0u;
+    }
+};
+
+}  // namespace chat
+
+#endif
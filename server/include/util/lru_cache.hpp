@@ -0,0 +1,111 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_LRU_CACHE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_LRU_CACHE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace chat {
+
+// A bounded key-value cache, with per-entry expiry times. When the cache is full,
+// the least recently used entry is evicted. Expired entries are removed on lookup.
+// Time is passed explicitly to all functions, which makes testing easier.
+// Not thread-safe.
+template <class Key, class Value>
+class lru_cache
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+private:
+    struct entry
+    {
+        Key key;
+        Value value;
+        clock_type::time_point expires_at;
+    };
+
+    // Most recently used entries first
+    std::list<entry> entries_;
+
+    // Lookup index into entries_
+    std::unordered_map<Key, typename std::list<entry>::iterator> index_;
+
+    std::size_t max_size_;
+
+    using index_iterator = typename std::unordered_map<Key, typename std::list<entry>::iterator>::iterator;
+
+    void erase_entry(index_iterator it)
+    {
+        entries_.erase(it->second);
+        index_.erase(it);
+    }
+
+public:
+    // Creates a cache holding max_size entries, at most
+    explicit lru_cache(std::size_t max_size) : max_size_(max_size == 0u ? 1u : max_size) {}
+
+    // The number of entries in the cache, including expired ones that haven't been removed yet
+    std::size_t size() const noexcept { return index_.size(); }
+
+    // Looks up an entry, marking it as the most recently used one.
+    // Returns nullptr if the entry doesn't exist or is expired at time now.
+    // The returned pointer is valid until the cache is next modified.
+    const Value* get(const Key& key, clock_type::time_point now)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+        if (it->second->expires_at <= now)
+        {
+            erase_entry(it);
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->value;
+    }
+
+    // Inserts or replaces an entry, valid until expires_at.
+    // If the cache is full, the least recently used entry is evicted.
+    void put(const Key& key, Value value, clock_type::time_point expires_at)
+    {
+        auto it = index_.find(key);
+        if (it != index_.end())
+        {
+            // Replace the entry
+            it->second->value = std::move(value);
+            it->second->expires_at = expires_at;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return;
+        }
+
+        // Make room
+        if (index_.size() >= max_size_)
+            erase_entry(index_.find(entries_.back().key));
+
+        // Insert
+        entries_.push_front(entry{key, std::move(value), expires_at});
+        index_.emplace(key, entries_.begin());
+    }
+
+    // Removes an entry, if present
+    void erase(const Key& key)
+    {
+        auto it = index_.find(key);
+        if (it != index_.end())
+            erase_entry(it);
+    }
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,185 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_MESSAGE_QUEUE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_MESSAGE_QUEUE_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "error.hpp"
+#include "util/websocket_frame.hpp"
+
+namespace chat {
+
+// What to do when a message_queue is full and a new message arrives
+enum class overflow_policy
+{
+    // Discard the oldest message in the queue
+    drop_oldest,
+
+    // Discard all queued messages, and ask the consumer to re-synchronize
+    // (e.g. by sending a snapshot of the current state)
+    coalesce,
+
+    // Discard all queued messages and make the consumer fail with errc::slow_consumer
+    disconnect,
+};
+
+// A bounded queue of messages, with a single consumer coroutine.
+// Producers never block: if the queue is full, the overflow policy is applied.
+// This keeps memory usage bounded when the consumer is slow (e.g. a client
+// that doesn't read from its socket). Messages are reference-counted, so the
+// same message can be queued to many consumers without copies.
+// Like async_mutex, this is not thread-safe.
+class message_queue
+{
+public:
+    using message_type = std::shared_ptr<const framed_message>;
+
+    // Constructors, assignments, destructor
+    message_queue(boost::asio::any_io_executor ex, std::size_t max_size, overflow_policy policy)
+        : max_size_(max_size == 0u ? 1u : max_size), policy_(policy), chan_(std::move(ex))
+    {
+    }
+    message_queue(const message_queue&) = delete;
+    message_queue(message_queue&&) = default;
+    message_queue& operator=(const message_queue&) = delete;
+    message_queue& operator=(message_queue&&) = default;
+    ~message_queue() = default;
+
+    // Number of messages currently in the queue
+    std::size_t size() const noexcept { return messages_.size(); }
+
+    // Number of messages discarded because the queue was full
+    std::uint64_t dropped() const noexcept { return dropped_; }
+
+    // Whether pop would complete without suspending: there are messages,
+    // a re-synchronization is pending, or the queue has overflowed or been closed.
+    // Consumers that only run while there's work to do use this to know when to exit
+    bool ready() const noexcept { return closed_ || overflowed_ || resync_ || !messages_.empty(); }
+
+    // Adds a message to the queue. Never suspends. If the queue has been closed
+    // or has overflowed with the disconnect policy, the message is discarded.
+    void push(message_type msg)
+    {
+        // While a re-synchronization is pending, messages are discarded,
+        // since they will be included in the snapshot
+        if (closed_ || overflowed_ || resync_)
+        {
+            ++dropped_;
+            return;
+        }
+
+        if (messages_.size() >= max_size_)
+        {
+            // Apply the overflow policy
+            switch (policy_)
+            {
+            case overflow_policy::drop_oldest:
+                messages_.pop_front();
+                ++dropped_;
+                break;
+            case overflow_policy::coalesce:
+                dropped_ += messages_.size() + 1u;
+                messages_.clear();
+                resync_ = true;
+                notify();
+                return;
+            case overflow_policy::disconnect:
+                dropped_ += messages_.size() + 1u;
+                messages_.clear();
+                overflowed_ = true;
+                notify();
+                return;
+            }
+        }
+
+        messages_.push_back(std::move(msg));
+        notify();
+    }
+
+    // Suspends the current coroutine until a message is available, then removes it
+    // from the queue and returns it. Returns a nullptr message if the consumer should
+    // re-synchronize (coalesce policy). Fails with errc::slow_consumer if the queue
+    // overflowed (disconnect policy), and with asio::error::operation_aborted if closed.
+    // Only a single coroutine may call pop at a time.
+    result<message_type> pop(boost::asio::yield_context yield)
+    {
+        while (true)
+        {
+            if (closed_)
+                return error_code(boost::asio::error::operation_aborted);
+            if (overflowed_)
+                CHAT_RETURN_ERROR(errc::slow_consumer)
+            if (resync_)
+            {
+                resync_ = false;
+                return message_type();
+            }
+            if (!messages_.empty())
+            {
+                auto res = std::move(messages_.front());
+                messages_.pop_front();
+                return res;
+            }
+
+            // Wait to be notified
+            error_code ec;
+            chan_.async_receive(yield[ec]);
+            assert(!ec);
+        }
+    }
+
+    // Removes a message from the queue and returns it, without suspending.
+    // Returns nullptr if no message is immediately available.
+    message_type try_pop() noexcept
+    {
+        if (messages_.empty())
+            return message_type();
+        auto res = std::move(messages_.front());
+        messages_.pop_front();
+        return res;
+    }
+
+    // Closes the queue. Any pending and subsequent pop operations will fail
+    // with asio::error::operation_aborted. Queued messages are discarded.
+    void close() noexcept
+    {
+        closed_ = true;
+        messages_.clear();
+        notify();
+    }
+
+private:
+    std::deque<message_type> messages_;
+    std::size_t max_size_;
+    overflow_policy policy_;
+    std::uint64_t dropped_{0};
+    bool resync_{false};
+    bool overflowed_{false};
+    bool closed_{false};
+
+    // Acts as a condition variable, so that the consumer can be notified
+    // when something happens. try_send only succeeds if the consumer is waiting
+    boost::asio::experimental::channel<void(error_code)> chan_;
+
+    void notify() noexcept { chan_.try_send(error_code()); }
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,194 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_METRICS_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_METRICS_HPP
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "util/tracing.hpp"
+
+// Process-wide counters and latency histograms, exported in the Prometheus
+// text format by the /api/metrics endpoint.
+// Recording is lock-free: each thread writes to its own shard, using relaxed
+// atomic loads and stores (no read-modify-write instructions), and shards are
+// only added together when metrics are exported. This makes recording cheap
+// enough to be always enabled.
+
+namespace chat {
+
+// The counters we record. Counters only increase
+enum class counter_id : std::size_t
+{
+    connections_accepted,         // TCP connections accepted by the listeners
+    websocket_sessions_started,   // Authenticated websocket sessions that started running
+    websocket_sessions_finished,  // Websocket sessions that finished, for any reason
+    messages_published,           // Messages published by the local pubsub_service
+    user_messages_published,      // Messages published to all the sessions of a user
+    login_rate_limited_ip,        // Login attempts rejected because of too many attempts from an IP
+    login_rate_limited_email,     // Login attempts rejected because of too many failures for an email
+    login_rate_limiter_errors,    // Errors contacting Redis when checking login rate limits
+    http2_connections,            // Connections that negotiated HTTP/2
+    http2_streams,                // Requests received over HTTP/2 connections
+    tls_handshakes,               // TLS handshakes completed successfully
+    tls_handshake_errors,         // TLS handshakes that failed or timed out
+    tls_sessions_resumed,         // TLS handshakes that resumed a previous session
+    tls_ktls_send,                // TLS connections where the kernel encrypts the data we send
+    connections_rejected,         // Connections closed on accept because of connection or memory limits
+    websocket_upgrades_rejected,  // Websocket upgrades rejected because of the memory budget
+    coroutine_stacks_mapped,      // Coroutine stacks allocated from the OS, because the pool was empty
+    coroutine_stacks_reused,      // Coroutine stacks taken from the pool
+    websocket_buffers_released,   // Websocket read buffers released after reading a big message
+    websocket_bytes_released,     // Memory released from websocket read buffers, in bytes
+    ephemeral_published,          // Ephemeral messages (e.g. typing indicators) published, after coalescing
+    ephemeral_coalesced,          // Ephemeral messages replaced by a more recent one before being published
+    ephemeral_rate_limited,       // Ephemeral messages discarded because of the pubsub rate limit
+    ephemeral_shed,               // Ephemeral messages not sent to a websocket client because it was busy
+    hello_rooms_delta,            // Rooms sent to reconnecting clients with only the messages they missed
+    hello_rooms_full_resync,      // Rooms sent in full to reconnecting clients, who missed too many messages
+    optimistic_ids_reassigned,    // Optimistically broadcast messages that Redis stored with a different ID
+    optimistic_messages_lost,     // Optimistically broadcast messages that couldn't be stored
+    redis_spooled_messages,       // Messages stored in the local spool because Redis was unavailable
+    redis_spool_replayed,         // Spooled messages stored in Redis once it was back
+    redis_spool_rejected,         // Messages that couldn't be spooled because the spool was full
+    redis_spool_dropped,          // Spooled messages dropped because Redis rejected them
+    redis_breaker_opened,         // Times the Redis circuit breaker opened
+    session_revocation_checks,    // Session tokens checked in Redis, because they may have been revoked
+    uploads_completed,            // Uploads whose last byte has been received
+    upload_bytes,                 // Bytes of uploaded files received
+    accounts_imported,            // Accounts created through bulk imports
+    broadcasts_aggregated,        // Message batches merged into another broadcast, in busy rooms
+    messages_throttled,           // Message batches delayed because the client sent too many messages
+    num_counters,                 // Must be the last one
+};
+
+// The latency histograms we record
+enum class histogram_id : std::size_t
+{
+    publish_fanout,       // Delivering a message to the subscribers in a thread
+    websocket_write,      // Writing a message (or a batch) to a websocket client
+    websocket_lock_wait,  // Waiting for other writers to finish before writing to a websocket
+    hello_build,          // Retrieving data for and serializing a hello event
+    scrypt_queue,         // Waiting for a password hashing thread
+
+    // Redis operations, by name
+    redis_get_room_history,
+    redis_get_room_history_nodes,
+    redis_store_messages,
+    redis_store_messages_with_ids,
+    redis_get_oldest_messages,
+    redis_trim_messages,
+    redis_set_nonexisting_key,
+    redis_get_int_key,
+    redis_delete_key,
+    redis_take_tokens,
+    redis_add_to_expiring_set,
+    redis_get_expiring_set,
+    redis_expiring_set_contains,
+
+    // MySQL operations, by name
+    mysql_create_user,
+    mysql_create_users,
+    mysql_get_user_by_email,
+    mysql_update_password,
+    mysql_get_user_by_id,
+    mysql_get_usernames,
+    mysql_get_rooms,
+    mysql_get_user_rooms,
+    mysql_join_room,
+    mysql_archive_messages,
+    mysql_get_archived_messages,
+
+    num_histograms,  // Must be the last one
+};
+
+// HDR-style bucketing for latency histograms. Values (in nanoseconds) are
+// grouped in buckets with a bounded relative error: values below 16 get a bucket each,
+// and every power of two above that is split into 8 buckets (an error below 12.5%).
+// Values above max_value are recorded as max_value.
+struct latency_buckets
+{
+    static constexpr std::size_t sub_bucket_bits = 3;
+    static constexpr std::size_t max_exponent = 43;  // about 2.4 hours
+    static constexpr std::uint64_t max_value = (std::uint64_t(1) << (max_exponent + 1u)) - 1u;
+    static constexpr std::size_t num_buckets = (max_exponent - sub_bucket_bits + 2u) << sub_bucket_bits;
+
+    // The bucket where value is recorded
+    static std::size_t index(std::uint64_t value) noexcept;
+
+    // The biggest value recorded in the given bucket
+    static std::uint64_t upper_bound(std::size_t index) noexcept;
+};
+
+// The state of a latency histogram at a certain point in time
+struct histogram_snapshot
+{
+    std::array<std::uint64_t, latency_buckets::num_buckets> buckets{};
+    std::uint64_t sum_ns{};  // The sum of all recorded values
+
+    // The total number of recorded values
+    std::uint64_t count() const noexcept;
+
+    // The value below or at which a fraction q (0 <= q <= 1) of the recorded values are.
+    // Values are approximated by the upper bound of their buckets. Zero if the histogram is empty
+    std::uint64_t quantile(double q) const noexcept;
+};
+
+// Adds n to a counter
+void increment_counter(counter_id id, std::uint64_t n = 1u) noexcept;
+
+// Records a value in a latency histogram. Negative values are recorded as zero
+void record_latency(histogram_id id, std::chrono::nanoseconds value) noexcept;
+
+// The name of the spans recorded by latency_timer for the given histogram (e.g. "redis.store_messages")
+std::string_view histogram_span_name(histogram_id id) noexcept;
+
+// Records the time elapsed between its construction and its destruction.
+// If the function being timed was invoked with traced_call, the time is also
+// recorded as a span in the caller's trace. Timers should thus be created
+// at the beginning of the function, before yielding.
+class latency_timer
+{
+    histogram_id id_;
+    trace* trace_;
+    std::chrono::steady_clock::time_point start_;
+
+public:
+    explicit latency_timer(histogram_id id) noexcept
+        : id_(id), trace_(take_handed_off_trace()), start_(std::chrono::steady_clock::now())
+    {
+    }
+    latency_timer(const latency_timer&) = delete;
+    latency_timer& operator=(const latency_timer&) = delete;
+    ~latency_timer()
+    {
+        auto end = std::chrono::steady_clock::now();
+        record_latency(id_, end - start_);
+        if (trace_)
+            trace_->add_span(histogram_span_name(id_), start_, end);
+    }
+
+    // The trace this operation is part of, or nullptr. Can be used to record sub-spans
+    trace* get_trace() const noexcept { return trace_; }
+};
+
+// Retrieves the current value of a counter and a histogram, aggregated across threads
+std::uint64_t get_counter(counter_id id);
+histogram_snapshot get_histogram(histogram_id id);
+
+// Serializes all metrics in the Prometheus text exposition format.
+// Histograms are exported as summaries, with quantiles computed by the server
+std::string format_metrics();
+
+}  // namespace chat
+
+#endif
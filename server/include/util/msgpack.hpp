@@ -0,0 +1,43 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_MSGPACK_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_MSGPACK_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+
+// Conversions between JSON and MessagePack, used by clients that negotiate the binary
+// websocket protocol. Events keep a single definition (the JSON in api_types.hpp), and
+// are converted to or from MessagePack at the websocket boundary. Both formats share
+// the same data model, so the conversion is lossless.
+
+namespace chat {
+
+// Encodes a JSON document as MessagePack. Integers use their smallest representation,
+// and other numbers are encoded as 64-bit floats. Fails if json is not valid JSON
+result<std::string> json_to_msgpack(std::string_view json);
+
+// Decodes a MessagePack document as JSON. Map keys must be strings, and binary
+// and extension types are not supported, since they have no JSON equivalent.
+// Fails if data is not a single, valid MessagePack object
+result<std::string> msgpack_to_json(std::string_view data);
+
+// The maximum size of a MessagePack array header
+inline constexpr std::size_t max_msgpack_array_header_size = 5u;
+
+// Writes the header of a MessagePack array with num_elements elements into buff,
+// which must have space for max_msgpack_array_header_size bytes. Returns the number of bytes written.
+// This allows composing arrays of elements that have already been encoded
+std::size_t write_msgpack_array_header(unsigned char* buff, std::size_t num_elements) noexcept;
+
+}  // namespace chat
+
+#endif
@@ -8,18 +8,48 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_PASSWORD_HASH_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_PASSWORD_HASH_HPP
 
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <string_view>
 
+#include "util/scrypt.hpp"
+
 namespace chat {
 
-// Hashes a password using scrypt and a random salt. Returns a PHC-format string
+// Hashes a password using scrypt, the given params and a random salt. Returns a PHC-format string
 // that can be inserted in DB and passed to verify_password
-std::string hash_password(std::string_view passwd);
+std::string hash_password(std::string_view passwd, scrypt_params params = {});
 
 // Checks whether the incoming password matches the given hashed password
 bool verify_password(std::string_view passwd, std::string_view hashed_passwd);
 
+// The result of verify_password with rehashing
+struct password_check_result
+{
+    // Whether the password matched
+    bool matches;
+
+    // If the password matched but was hashed with params weaker than the current ones,
+    // the password hashed again with the current params. Empty otherwise.
+    // The caller should replace the stored hash with this one
+    std::string rehashed;
+};
+
+// Like verify_password, but also rehashes the password if its params are weaker than current_params.
+// Hashes with stronger params are kept, so lowering the params doesn't rehash every account
+password_check_result verify_password(
+    std::string_view passwd,
+    std::string_view hashed_passwd,
+    scrypt_params current_params
+);
+
+// Benchmarks scrypt_generate_hash on this machine and returns the most expensive params
+// that hash a password within target and use at most max_memory bytes.
+// Only ln is adjusted, and the result is never weaker than the defaults. This takes a few
+// times target to run. Intended to be called once, at startup
+scrypt_params calibrate_scrypt_params(std::chrono::milliseconds target, std::size_t max_memory);
+
 }  // namespace chat
 
 #endif
@@ -0,0 +1,139 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RING_BUFFER_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RING_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace chat {
+
+// A bounded, lock-free queue, safe to use from several producer and consumer threads.
+// This is Dmitry Vyukov's bounded MPMC queue: each cell has a sequence number that
+// tells producers and consumers whether the cell is ready for them. Elements are
+// not constructed or destroyed on push and pop: the caller fills or
+// consumes the cell's element in-place, so T should be cheap to overwrite.
+template <class T>
+class ring_buffer
+{
+    struct cell
+    {
+        std::atomic<std::size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    std::size_t mask_;
+
+    // Producer and consumer positions live in different cache lines, to avoid false sharing
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<std::size_t> dequeue_pos_{0};
+
+    static std::size_t round_capacity(std::size_t v) noexcept
+    {
+        std::size_t res = 2u;
+        while (res < v)
+            res *= 2u;
+        return res;
+    }
+
+public:
+    // Creates a buffer with room for at least capacity elements.
+    // The actual capacity is rounded up to a power of two.
+    explicit ring_buffer(std::size_t capacity)
+        : cells_(new cell[round_capacity(capacity)]), mask_(round_capacity(capacity) - 1u)
+    {
+        for (std::size_t i = 0; i <= mask_; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ring_buffer(const ring_buffer&) = delete;
+    ring_buffer& operator=(const ring_buffer&) = delete;
+    ~ring_buffer() = default;
+
+    // The maximum number of elements the buffer may hold
+    std::size_t capacity() const noexcept { return mask_ + 1u; }
+
+    // Tries to add an element to the buffer. If there is room, calls fill(T&)
+    // with the element to be written and returns true. Returns false if the buffer is full.
+    // Never blocks.
+    template <class Fn>
+    bool try_push(Fn&& fill)
+    {
+        cell* c = nullptr;
+        auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &cells_[pos & mask_];
+            auto seq = c->seq.load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (dif == 0)
+            {
+                // The cell is free. Try to claim it
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                // The cell still holds an element from the previous lap: we're full
+                return false;
+            }
+            else
+            {
+                // Another producer claimed the cell. Retry
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Write the element and publish it
+        fill(c->data);
+        c->seq.store(pos + 1u, std::memory_order_release);
+        return true;
+    }
+
+    // Tries to remove an element from the buffer. If there is one, calls consume(T&)
+    // with it and returns true. Returns false if the buffer is empty. Never blocks.
+    template <class Fn>
+    bool try_pop(Fn&& consume)
+    {
+        cell* c = nullptr;
+        auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &cells_[pos & mask_];
+            auto seq = c->seq.load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1u);
+            if (dif == 0)
+            {
+                // The cell holds an element. Try to claim it
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                // No element has been written to the cell yet: we're empty
+                return false;
+            }
+            else
+            {
+                // Another consumer claimed the cell. Retry
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Read the element and make the cell available for the next lap
+        consume(c->data);
+        c->seq.store(pos + mask_ + 1u, std::memory_order_release);
+        return true;
+    }
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RUN_ON_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RUN_ON_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+namespace chat {
+
+// Runs fn() in ex, suspending the calling coroutine until it's done, and returns fn's result.
+// This is how a shard accesses state owned by another shard: the state is only ever touched
+// from its owner's thread, so it doesn't need locking. The coroutine is resumed in its
+// original executor. fn may reference the caller's variables, since the caller is suspended
+// while fn runs. Exceptions thrown by fn are propagated to the calling coroutine.
+// fn's return type must be default-constructible.
+template <class Fn>
+std::invoke_result_t<Fn&> run_on(boost::asio::any_io_executor ex, Fn fn, boost::asio::yield_context yield)
+{
+    using return_type = std::invoke_result_t<Fn&>;
+
+    return boost::asio::async_initiate<boost::asio::yield_context, void(std::exception_ptr, return_type)>(
+        [](auto handler, boost::asio::any_io_executor ex, Fn fn) {
+            // Make the handler's executor aware that there's outstanding work.
+            // Otherwise, the io_context could run out of work and return
+            auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler));
+            boost::asio::post(
+                std::move(ex),
+                [fn = std::move(fn), handler = std::move(handler), work = std::move(work)]() mutable {
+                    // Run the function, capturing any exception
+                    std::exception_ptr exc;
+                    return_type res{};
+                    try
+                    {
+                        res = fn();
+                    }
+                    catch (...)
+                    {
+                        exc = std::current_exception();
+                    }
+
+                    // Resume the coroutine in its executor
+                    boost::asio::dispatch(
+                        work.get_executor(),
+                        [handler = std::move(handler), exc, res = std::move(res)]() mutable {
+                            std::move(handler)(exc, std::move(res));
+                        }
+                    );
+                    work.reset();
+                }
+            );
+        },
+        yield,
+        std::move(ex),
+        std::move(fn)
+    );
+}
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RUN_PARALLEL_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_RUN_PARALLEL_HPP
+
+#include <boost/asio/detached.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <cstddef>
+#include <memory>
+
+#include "error.hpp"
+#include "util/stack_pool.hpp"
+
+namespace chat {
+
+// Runs fn(i, yield) for i in [0, n) concurrently, and waits for all of them to finish.
+// Coroutines run in the caller's executor, so fn may access the caller's state without locking.
+// fn should only perform I/O (like database requests), since it runs in a small stack
+template <class Function>
+void run_parallel(std::size_t n, Function fn, boost::asio::yield_context yield)
+{
+    if (n == 1u)
+    {
+        fn(std::size_t(0), yield);
+        return;
+    }
+
+    // Never expires. Cancelled when the last coroutine finishes
+    std::size_t pending = n;
+    boost::asio::steady_timer done(yield.get_executor(), (boost::asio::steady_timer::time_point::max)());
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        boost::asio::spawn(
+            yield.get_executor(),
+            std::allocator_arg,
+            task_stack_allocator(),
+            [&fn, &pending, &done, i](boost::asio::yield_context child_yield) {
+                fn(i, child_yield);
+                if (--pending == 0u)
+                    done.cancel();
+            },
+            boost::asio::detached
+        );
+    }
+    while (pending != 0u)
+    {
+        error_code ignored;
+        done.async_wait(yield[ignored]);
+    }
+}
+
+}  // namespace chat
+
+#endif
@@ -32,6 +32,10 @@ constexpr std::uint64_t default_r = 8;
 constexpr std::uint64_t default_p = 1;
 constexpr std::size_t hash_size = 32;
 
+// The maximum amount of memory scrypt_generate_hash may use. Hashes requiring
+// more memory than this are rejected
+constexpr std::size_t scrypt_max_memory = 256u << 20;  // 256MiB
+
 // Algorithm parameters, user-independent
 struct scrypt_params
 {
@@ -39,6 +43,18 @@ struct scrypt_params
     std::uint64_t r{default_r};
     std::uint64_t p{default_p};
 };
+inline bool operator==(const scrypt_params& lhs, const scrypt_params& rhs) noexcept
+{
+    return lhs.ln == rhs.ln && lhs.r == rhs.r && lhs.p == rhs.p;
+}
+inline bool operator!=(const scrypt_params& lhs, const scrypt_params& rhs) noexcept { return !(lhs == rhs); }
+
+// The amount of memory, in bytes, required to hash a password with the given params
+constexpr std::uint64_t scrypt_memory_size(scrypt_params params) noexcept
+{
+    // This is how OpenSSL computes it: 128 * r * (N + 2) for the working area, plus 128 * r * p
+    return 128u * params.r * ((std::uint64_t(1) << params.ln) + 2u + params.p);
+}
 
 // The result of parsing a scypt PHC string. Note that salt and hash
 // can have a different size than the defaults listed here. Allowing this
@@ -60,7 +76,8 @@ std::string scrypt_phc_serialize(
     boost::span<const unsigned char, hash_size> hash
 );
 
-// Hashes the given password with the given salt and params
+// Hashes the given password with the given salt and params.
+// Throws if params require more than scrypt_max_memory
 std::array<unsigned char, hash_size> scrypt_generate_hash(
     std::string_view passwd,
     scrypt_params params,
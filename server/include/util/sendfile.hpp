@@ -0,0 +1,69 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_SENDFILE_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_SENDFILE_HPP
+
+#include <boost/asio/spawn.hpp>
+
+#include <chrono>
+#include <utility>
+
+#include "error.hpp"
+#include "util/http_range.hpp"
+
+// Helpers to send file contents to a socket without copying them into userspace buffers.
+// Used to serve big static files: HTTP headers are written normally, and the body is then
+// sent directly from the file to the socket.
+
+namespace chat {
+
+// Forward declaration
+class client_socket;
+
+// A region of an open file, to be sent after the response headers. Owns the file descriptor
+class file_transfer
+{
+    int fd_{-1};
+    byte_range range_{};
+
+public:
+    // Takes ownership of fd, which must be a file opened for reading
+    file_transfer(int fd, byte_range range) noexcept : fd_(fd), range_(range) {}
+    file_transfer(const file_transfer&) = delete;
+    file_transfer(file_transfer&& rhs) noexcept : fd_(std::exchange(rhs.fd_, -1)), range_(rhs.range_) {}
+    file_transfer& operator=(const file_transfer&) = delete;
+    file_transfer& operator=(file_transfer&& rhs) noexcept
+    {
+        std::swap(fd_, rhs.fd_);
+        std::swap(range_, rhs.range_);
+        return *this;
+    }
+    ~file_transfer();
+
+    int native_handle() const noexcept { return fd_; }
+    byte_range range() const noexcept { return range_; }
+    void set_range(byte_range value) noexcept { range_ = value; }
+
+    // Releases ownership of the file descriptor, returning it
+    int release() noexcept { return std::exchange(fd_, -1); }
+};
+
+// Sends a file region to a socket. On Linux, this uses sendfile, unless the connection
+// uses TLS and the kernel can't encrypt the data. Otherwise, the file is read in chunks.
+// If the socket doesn't become writable within timeout
+// (e.g. because the client stopped reading), the operation fails.
+error_code async_send_file(
+    client_socket& sock,
+    const file_transfer& file,
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+);
+
+}  // namespace chat
+
+#endif
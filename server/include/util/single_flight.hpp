@@ -0,0 +1,138 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_SINGLE_FLIGHT_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_SINGLE_FLIGHT_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "error.hpp"
+
+namespace chat {
+
+// Coalesces concurrent calls sharing the same key, so that only one of them is executed.
+// Coroutines calling run() with a key for which a call is already in progress wait for it
+// to finish, and get a copy of its result (or its exception). Once a call finishes, its key
+// is forgotten: results are not cached (combine this class with lru_cache for that).
+// This is similar to Go's singleflight. Note that this is not thread-safe - all calls
+// should be made from coroutines running in the same thread.
+template <class T>
+class single_flight
+{
+    struct call
+    {
+        // Never expires. Cancelled when the call finishes, to wake up waiters
+        boost::asio::steady_timer done;
+
+        // Set when the call finishes
+        std::optional<T> result;
+        std::exception_ptr exc;
+
+        explicit call(boost::asio::any_io_executor ex)
+            : done(std::move(ex), (boost::asio::steady_timer::time_point::max)())
+        {
+        }
+
+        bool finished() const noexcept { return result.has_value() || exc != nullptr; }
+    };
+
+    // Calls in progress, by key
+    std::map<std::string, std::shared_ptr<call>, std::less<>> calls_;
+
+    void finish(std::string_view key, const std::shared_ptr<call>& c)
+    {
+        // The key may have been forgotten and reused by another call
+        auto it = calls_.find(key);
+        if (it != calls_.end() && it->second == c)
+            calls_.erase(it);
+
+        // Notify any waiters
+        c->done.cancel();
+    }
+
+public:
+    // Constructors, assignments, destructor
+    single_flight() = default;
+    single_flight(const single_flight&) = delete;
+    single_flight(single_flight&&) = default;
+    single_flight& operator=(const single_flight&) = delete;
+    single_flight& operator=(single_flight&&) = default;
+    ~single_flight() = default;
+
+    // The number of calls in progress
+    std::size_t size() const noexcept { return calls_.size(); }
+
+    // Is there a call in progress for key?
+    bool in_progress(std::string_view key) const { return calls_.find(key) != calls_.end(); }
+
+    // If there is a call in progress for key, waits for it and returns its result.
+    // Otherwise, invokes fn(yield), which must return a T, and shares its result with
+    // any coroutine calling run with the same key in the meantime.
+    template <class Function>
+    T run(std::string_view key, Function&& fn, boost::asio::yield_context yield)
+    {
+        // Join a call in progress
+        auto it = calls_.find(key);
+        if (it != calls_.end())
+        {
+            auto c = it->second;
+            while (!c->finished())
+            {
+                error_code ignored;
+                c->done.async_wait(yield[ignored]);
+            }
+            if (c->exc)
+                std::rethrow_exception(c->exc);
+            return *c->result;
+        }
+
+        // Perform the call ourselves
+        auto c = std::make_shared<call>(yield.get_executor());
+        calls_.emplace(std::string(key), c);
+        try
+        {
+            c->result.emplace(std::forward<Function>(fn)(yield));
+        }
+        catch (...)
+        {
+            c->exc = std::current_exception();
+            finish(key, c);
+            throw;
+        }
+        finish(key, c);
+
+        // If nobody else is waiting for the result, we don't need to copy it
+        if (c.use_count() == 1)
+            return std::move(*c->result);
+        return *c->result;
+    }
+
+    // Makes subsequent calls for key start a new call, rather than waiting for the one in progress.
+    // The call in progress, if any, is not affected.
+    void forget(std::string_view key)
+    {
+        auto it = calls_.find(key);
+        if (it != calls_.end())
+            calls_.erase(it);
+    }
+};
+
+}  // namespace chat
+
+#endif
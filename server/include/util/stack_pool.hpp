@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_STACK_POOL_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_STACK_POOL_HPP
+
+#include <boost/context/stack_context.hpp>
+
+#include <cstddef>
+
+// Pooled stacks for stackful coroutines. Stacks are mapped with a guard page
+// (like Boost.Context's protected_fixedsize_stack), but are kept in a per-thread
+// free list when the coroutine finishes, rather than being unmapped. This avoids
+// a mmap/mprotect/munmap sequence per spawned coroutine.
+// Stacks come in a few size classes, since long-lived sessions need much
+// deeper stacks than coroutines that only perform I/O.
+
+namespace chat {
+
+// A Boost.Context StackAllocator that gets stacks from the current thread's pool.
+// Stacks may be deallocated from a different thread than the one that allocated them,
+// in which case they're returned to that thread's pool.
+// Meant to be passed to boost::asio::spawn, with std::allocator_arg
+class pooled_stack_allocator
+{
+    std::size_t size_;
+
+public:
+    // size is rounded up to the page size. A guard page is added to it
+    explicit pooled_stack_allocator(std::size_t size) noexcept;
+
+    // The size of the stacks allocated by this object, including the guard page
+    std::size_t size() const noexcept { return size_; }
+
+    // Gets a stack from the pool, or maps a new one if there are none. Throws std::bad_alloc on failure
+    boost::context::stack_context allocate();
+
+    // Returns a stack to the pool, or unmaps it if the pool is full
+    void deallocate(boost::context::stack_context& sctx) noexcept;
+};
+
+// An allocator for coroutines running sessions: HTTP and websocket sessions,
+// and HTTP/2 requests. These run request handlers, and need deep stacks.
+// The size is configured by SESSION_STACK_SIZE_KB (see admission_config)
+pooled_stack_allocator session_stack_allocator();
+
+// An allocator for coroutines that only perform I/O, like websocket write loops
+// and fan-out requests. The size is configured by TASK_STACK_SIZE_KB (64 by default)
+pooled_stack_allocator task_stack_allocator();
+
+// The number of stacks held in the current thread's pool
+std::size_t num_pooled_stacks() noexcept;
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,78 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TLS_CONTEXT_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TLS_CONTEXT_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+
+// Server-side TLS configuration, shared by all the connections secured by a listener.
+
+// Forward declaration, to avoid including OpenSSL headers
+struct ssl_ctx_st;
+
+namespace chat {
+
+struct tls_config
+{
+    // PEM files with the certificate chain and the private key
+    std::string cert_file;
+    std::string key_file;
+
+    // If set, a file with 80 random bytes used to encrypt session tickets. Servers sharing it
+    // can resume each other's sessions. Otherwise, a random key is generated at startup,
+    // which is shared by all threads
+    std::string ticket_key_file;
+
+    // Sessions for clients that don't support tickets are cached in memory
+    std::size_t session_cache_size{20480};
+
+    // How long resumed sessions are valid, in seconds
+    std::size_t session_timeout{7200};
+
+    // Whether to hand encryption over to the kernel when it supports it
+    bool ktls{true};
+
+    // Protocols offered with ALPN, by order of preference
+    std::vector<std::string> alpn_protocols{"http/1.1"};
+};
+
+// Reads the configuration from the environment (TLS_CERT_FILE, TLS_KEY_FILE,
+// TLS_TICKET_KEY_FILE, TLS_SESSION_CACHE_SIZE, TLS_SESSION_TIMEOUT and TLS_KTLS).
+// TLS_KEY_FILE defaults to TLS_CERT_FILE. TLS is disabled if cert_file is empty
+tls_config get_tls_config();
+
+// Wraps an OpenSSL context. It's thread-safe, so a single one is shared by all threads
+class tls_context
+{
+    struct ctx_deleter
+    {
+        void operator()(ssl_ctx_st* ctx) const noexcept;
+    };
+
+    std::unique_ptr<ssl_ctx_st, ctx_deleter> ctx_;
+
+    // The ALPN protocol list, in wire format. Heap-allocated, so OpenSSL can reference it
+    std::unique_ptr<std::string> alpn_;
+
+    tls_context(ssl_ctx_st* ctx, std::string alpn);
+
+public:
+    // Creates a context. Fails if the certificate or the keys can't be loaded
+    static result_with_message<tls_context> create(const tls_config& cfg);
+
+    ssl_ctx_st* native_handle() const noexcept { return ctx_.get(); }
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,74 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TOKEN_BUCKET_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+
+namespace chat {
+
+// Configures a token bucket rate limiter. The bucket holds up to capacity tokens,
+// and gains refill_per_second tokens every second. Every operation takes tokens,
+// and is rejected if there are not enough of them.
+struct token_bucket_params
+{
+    double capacity;
+    double refill_per_second;
+
+    // The time it takes for an empty bucket to become full
+    std::chrono::milliseconds time_to_full() const noexcept
+    {
+        return std::chrono::milliseconds(static_cast<long long>(capacity / refill_per_second * 1000.0));
+    }
+};
+
+// A token bucket. Buckets start full. Not thread-safe
+class token_bucket
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    explicit token_bucket(double tokens, clock_type::time_point now) noexcept : tokens_(tokens), last_(now) {}
+
+    // The number of tokens at time now
+    double tokens(const token_bucket_params& params, clock_type::time_point now) noexcept
+    {
+        refill(params, now);
+        return tokens_;
+    }
+
+    // Takes cost tokens, if available. Returns whether the operation is allowed.
+    // A cost of zero checks that at least a token is available, without taking any
+    bool try_take(const token_bucket_params& params, double cost, clock_type::time_point now) noexcept
+    {
+        refill(params, now);
+        if (tokens_ < (std::max)(cost, 1.0))
+            return false;
+        tokens_ -= cost;
+        return true;
+    }
+
+private:
+    double tokens_;
+    clock_type::time_point last_;
+
+    void refill(const token_bucket_params& params, clock_type::time_point now) noexcept
+    {
+        if (now > last_)
+        {
+            std::chrono::duration<double> elapsed = now - last_;
+            tokens_ = (std::min)(params.capacity, tokens_ + elapsed.count() * params.refill_per_second);
+            last_ = now;
+        }
+    }
+};
+
+}  // namespace chat
+
+#endif
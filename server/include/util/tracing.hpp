@@ -0,0 +1,174 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TRACING_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_TRACING_HPP
+
+#include <boost/core/span.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Lightweight tracing for websocket events. A trace records the spans
+// (Redis and MySQL operations, serialization, fan-out...) that took place
+// while handling a single event. Traces live in the stack of the coroutine
+// handling the event and hold a fixed number of spans, so recording doesn't allocate.
+// When the event is handled, the trace is kept if it was sampled or slow,
+// and kept traces can be retrieved using the /api/traces endpoint.
+
+namespace chat {
+
+// The spans recorded while handling a single operation
+class trace
+{
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr std::size_t max_spans = 16;
+
+    struct span
+    {
+        std::string_view name;           // Must point to a string literal
+        std::chrono::nanoseconds start;  // Since the trace started
+        std::chrono::nanoseconds duration;
+    };
+
+    // name must point to a string literal
+    explicit trace(std::string_view name) noexcept : name_(name), start_(clock::now()) {}
+    trace(const trace&) = delete;
+    trace& operator=(const trace&) = delete;
+
+    std::string_view name() const noexcept { return name_; }
+    clock::time_point start_time() const noexcept { return start_; }
+    boost::span<const span> spans() const noexcept { return {spans_.data(), num_spans_}; }
+
+    // The number of spans that didn't fit in the trace
+    std::size_t dropped_spans() const noexcept { return num_dropped_; }
+
+    // Records a span. name must point to a string literal
+    void add_span(std::string_view name, clock::time_point start, clock::time_point end) noexcept
+    {
+        if (num_spans_ == max_spans)
+            ++num_dropped_;
+        else
+            spans_[num_spans_++] = span{name, start - start_, end - start};
+    }
+
+private:
+    std::string_view name_;
+    clock::time_point start_;
+    std::array<span, max_spans> spans_{};
+    std::size_t num_spans_{};
+    std::size_t num_dropped_{};
+};
+
+// Records a span from its construction to its destruction. A null trace makes this a no-op
+class trace_span
+{
+    trace* trace_;
+    std::string_view name_;
+    trace::clock::time_point start_;
+
+public:
+    trace_span(trace* t, std::string_view name) noexcept
+        : trace_(t), name_(name), start_(t ? trace::clock::now() : trace::clock::time_point())
+    {
+    }
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+    ~trace_span()
+    {
+        if (trace_)
+            trace_->add_span(name_, start_, trace::clock::now());
+    }
+};
+
+// Propagating traces. Services don't receive traces as parameters. Instead, the caller
+// hands the trace over to the callee by invoking it within traced_call. Instrumented
+// functions take the trace using take_handed_off_trace as the first thing they do,
+// before yielding. This guarantees that the trace is never seen by other coroutines
+// running in the same thread. Only instrumented functions should be invoked with traced_call.
+namespace detail {
+extern thread_local trace* handed_off_trace;
+}
+
+template <class Fn>
+decltype(auto) traced_call(trace* t, Fn&& fn)
+{
+    struct guard
+    {
+        // In case the callee didn't take it
+        ~guard() { detail::handed_off_trace = nullptr; }
+    } g;
+    detail::handed_off_trace = t;
+    return std::forward<Fn>(fn)();
+}
+
+// Retrieves the trace handed off by traced_call, if any. Returns nullptr otherwise
+inline trace* take_handed_off_trace() noexcept { return std::exchange(detail::handed_off_trace, nullptr); }
+
+// A trace that has been kept, for export
+struct trace_record
+{
+    std::uint64_t id;
+    std::string_view name;
+    std::chrono::system_clock::time_point start;
+    std::chrono::nanoseconds duration;
+    std::vector<trace::span> spans;
+    std::size_t dropped_spans;
+    bool slow;  // Kept because it exceeded the slow threshold, rather than by sampling
+};
+
+// Decides which traces to keep, and stores the most recent ones in a fixed-size buffer.
+// Thread-safe. Traces are kept if one in every sample_rate (zero disables sampling),
+// or if they took longer than slow_threshold (zero disables it).
+// Only kept traces require locking, so this is cheap for most events.
+class trace_collector
+{
+    std::uint64_t sample_rate_;
+    std::chrono::nanoseconds slow_threshold_;
+    std::size_t capacity_;
+    std::atomic<std::uint64_t> num_finished_{0};
+
+    mutable std::mutex mtx_;
+    std::vector<trace_record> records_;  // Circular buffer
+    std::size_t next_{};                 // Where the next record will be placed
+    std::uint64_t next_id_{1};
+
+public:
+    trace_collector(std::uint64_t sample_rate, std::chrono::nanoseconds slow_threshold, std::size_t capacity);
+
+    // Whether any trace can be kept. If false, callers may skip recording traces
+    bool enabled() const noexcept
+    {
+        return capacity_ != 0u && (sample_rate_ != 0u || slow_threshold_.count() != 0);
+    }
+
+    // Called when the traced operation finishes. Returns whether the trace was kept
+    bool finish(const trace& t, trace::clock::time_point end = trace::clock::now());
+
+    // The kept traces, most recent first
+    std::vector<trace_record> records() const;
+};
+
+// The process-wide collector, configured by the TRACE_SAMPLE_RATE,
+// TRACE_SLOW_THRESHOLD_MS and TRACE_BUFFER_SIZE environment variables
+trace_collector& global_trace_collector();
+
+// Serializes kept traces as a JSON array, durations in microseconds
+std::string format_traces(boost::span<const trace_record> records);
+
+}  // namespace chat
+
+#endif
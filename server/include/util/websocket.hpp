@@ -8,19 +8,36 @@
 #ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_WEBSOCKET_HPP
 #define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_WEBSOCKET_HPP
 
-#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/buffer.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/string_body.hpp>
+#include <boost/core/span.hpp>
 
+#include <cstddef>
 #include <memory>
 #include <string_view>
 
 #include "error.hpp"
+#include "util/client_socket.hpp"
+#include "util/websocket_frame.hpp"
 
 namespace chat {
 
+// The websocket subprotocols (Sec-WebSocket-Protocol) supported by the server.
+// Messages are JSON text by default. Clients that negotiate msgpack_subprotocol
+// exchange the same messages as binary frames, encoded with MessagePack (see msgpack.hpp)
+inline constexpr std::string_view json_subprotocol = "chat.json";
+inline constexpr std::string_view msgpack_subprotocol = "chat.msgpack";
+
+// Clears a buffer used to read websocket messages, before reading the next one.
+// If its capacity exceeds max_capacity (because a big message was read),
+// its memory is released, so it's not kept for the rest of the session.
+// Returns the number of bytes released
+std::size_t reset_read_buffer(boost::beast::flat_buffer& buff, std::size_t max_capacity);
+
 // A wrapper around beast's websocket stream that handles concurrent writes
 // and reduces build times by keeping Beast instantiations in a separate .cpp file.
 class websocket
@@ -29,7 +46,11 @@ class websocket
     struct impl;
     std::unique_ptr<impl> impl_;
 
-    error_code write_locked_impl(std::string_view buff, boost::asio::yield_context yield);
+    error_code write_locked_impl(
+        boost::span<const boost::asio::const_buffer> buffers,
+        boost::asio::yield_context yield
+    );
+    error_code write_framed_locked_impl(const framed_message& msg, boost::asio::yield_context yield);
     void lock_writes_impl(boost::asio::yield_context yield) noexcept;
     void unlock_writes_impl() noexcept;
 
@@ -42,23 +63,31 @@ public:
     using upgrade_request_type = boost::beast::http::request<boost::beast::http::string_body>;
 
     // Constructors, assignments, destructor
-    websocket(
-        boost::asio::ip::tcp::socket sock,
-        upgrade_request_type&& upgrade_request,
-        boost::beast::flat_buffer buffer
-    );
+    websocket(client_socket sock, upgrade_request_type&& upgrade_request, boost::beast::flat_buffer buffer);
     websocket(const websocket&) = delete;
     websocket(websocket&&) noexcept;
     websocket& operator=(const websocket&) = delete;
     websocket& operator=(websocket&&) noexcept;
     ~websocket();
 
+    // Returns the executor associated to the underlying socket
+    boost::asio::any_io_executor get_executor();
+
     // Returns the upgrade HTTP request
     const upgrade_request_type& upgrade_request() const noexcept;
 
-    // Runs the websocket handshake. Must be called before any other operation
+    // Runs the websocket handshake. Must be called before any other operation.
+    // Compression is offered using the settings from the environment
     error_code accept(boost::asio::yield_context yield);
 
+    // Like accept, but using the given compression settings for this session
+    error_code accept(const websocket_compression_options& compression, boost::asio::yield_context yield);
+
+    // Did the client negotiate msgpack_subprotocol during the handshake? If it did,
+    // all messages are written as binary frames, and pre-framed messages are written
+    // using their MessagePack form. Converting other messages is up to the caller
+    bool binary() const noexcept;
+
     // Reads a message from the client. The returned view is valid until the next
     // read is performed. Only a single read should be outstanding at each time
     // (unlike writes, reads are not serialized).
@@ -69,6 +98,15 @@ public:
     // A write is roughly equivalent to lock_writes() + write_locked() + releasing the guard
     error_code write(std::string_view buff, boost::asio::yield_context yield);
 
+    // Writes a single message to the client, composed of several buffers (gathered write).
+    // The message is the concatenation of all the buffers. Writes are serialized, as above
+    error_code write(boost::span<const boost::asio::const_buffer> buffers, boost::asio::yield_context yield);
+
+    // Writes a message that has been framed beforehand, usually shared by many websockets.
+    // The frame is written to the socket as-is, unless the session's compression settings
+    // require Beast to compress the message itself. Writes are serialized, as above
+    error_code write(const framed_message& msg, boost::asio::yield_context yield);
+
     // Locks writes until the returned guard is destroyed. Other coroutines
     // calling write will be suspended until the guard is released.
     using write_guard = std::unique_ptr<websocket, write_guard_deleter>;
@@ -87,11 +125,26 @@ public:
     )
     {
         assert(guard.get() != nullptr);
-        return write_locked_impl(buff, yield);
+        boost::asio::const_buffer buffers[] = {boost::asio::buffer(buff)};
+        return write_locked_impl(buffers, yield);
+    }
+
+    // Like write_locked, but for a pre-framed message
+    error_code write_locked(
+        const framed_message& msg,
+        [[maybe_unused]] write_guard& guard,
+        boost::asio::yield_context yield
+    )
+    {
+        assert(guard.get() != nullptr);
+        return write_framed_locked_impl(msg, yield);
     }
 
     // Closes the websocket, sending close_code to the client.
     error_code close(unsigned close_code, boost::asio::yield_context yield);
+
+    // Like close, but sending a reason string, too. It must be at most 123 bytes long
+    error_code close(unsigned close_code, std::string_view reason, boost::asio::yield_context yield);
 };
 
 }  // namespace chat
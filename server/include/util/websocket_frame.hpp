@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SERVERTECHCHAT_SERVER_INCLUDE_UTIL_WEBSOCKET_FRAME_HPP
+#define SERVERTECHCHAT_SERVER_INCLUDE_UTIL_WEBSOCKET_FRAME_HPP
+
+#include <boost/asio/buffer.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Helpers to encode websocket frames (RFC 6455) ourselves, so broadcast messages
+// can be framed once and written as-is to every subscriber.
+
+namespace chat {
+
+// permessage-deflate compression settings (RFC 7692). Compression is negotiated during
+// the handshake, so it's only used with clients that support it.
+struct websocket_compression_options
+{
+    // Offer compression to clients
+    bool enabled{true};
+
+    // Size of the compressor's sliding window, as a power of two (9 to 15).
+    // Bigger windows compress better, but use more memory per connection
+    int window_bits{15};
+
+    // Memory used by the compressor's internal state (1 to 9)
+    int mem_level{4};
+
+    // Compression level (0 to 9). Higher levels compress better, but are slower
+    int level{6};
+
+    // Messages smaller than this number of bytes are sent uncompressed
+    std::size_t threshold{1024};
+
+    // Compress each message independently. This compresses worse, but makes a message's
+    // compressed form the same for all sessions, so framed_message can compress it only once
+    bool no_context_takeover{false};
+};
+
+// Loads compression settings from the WS_DEFLATE* environment variables.
+// Out of range values are clamped to the valid range
+websocket_compression_options load_websocket_compression_options();
+
+// The settings loaded from the environment. Variables are only read the first time this is called
+const websocket_compression_options& default_websocket_compression_options();
+
+// A websocket text message, framed once so it can be written to any number of websockets
+// without re-encoding it. Server frames are not masked, so the same bytes are valid for any client.
+// If compression is enabled without context takeover, messages over the threshold are also
+// compressed once, for the clients that negotiated compression.
+// Payloads are JSON. Clients using the MessagePack protocol get a binary frame instead,
+// created when the first of them needs it.
+// Immutable once constructed (other than the lazily created binary frame),
+// so it can be shared between threads.
+class framed_message
+{
+    std::string frame_;
+    std::size_t header_size_;
+
+    // Empty if the message is not compressed. compressed_offset_ is where the frame begins
+    std::string compressed_frame_;
+    std::size_t compressed_offset_{0};
+    int compression_window_bits_{0};
+
+    // The binary frame, created by the first binary_frame() call
+    mutable std::once_flag binary_once_;
+    mutable std::string binary_frame_;
+    mutable std::size_t binary_header_size_{0};
+
+    void ensure_binary_frame() const;
+
+public:
+    // Frames payload, compressing it according to compression.
+    // Only messages of at least compression.threshold bytes are compressed, and only if
+    // no_context_takeover is set. Compression is skipped if it doesn't reduce the message size.
+    framed_message(std::string_view payload, const websocket_compression_options& compression);
+
+    // Same as above, using default_websocket_compression_options()
+    explicit framed_message(std::string_view payload)
+        : framed_message(payload, default_websocket_compression_options())
+    {
+    }
+
+    // The message contents
+    std::string_view payload() const noexcept { return std::string_view(frame_).substr(header_size_); }
+
+    // The entire frame, including the header, without compression
+    boost::asio::const_buffer frame() const noexcept { return boost::asio::buffer(frame_); }
+
+    // Do we have a compressed frame?
+    bool has_compressed_frame() const noexcept { return !compressed_frame_.empty(); }
+
+    // The entire frame, with its payload compressed and the RSV1 bit set. Requires has_compressed_frame()
+    boost::asio::const_buffer compressed_frame() const noexcept
+    {
+        return boost::asio::buffer(compressed_frame_) + compressed_offset_;
+    }
+
+    // The window size used to compress the message. Clients that negotiated a smaller
+    // window can't be sent the compressed frame
+    int compression_window_bits() const noexcept { return compression_window_bits_; }
+
+    // The message as a binary frame, with its payload converted to MessagePack (see msgpack.hpp).
+    // The conversion happens the first time this or binary_payload() are called, and its result
+    // is shared by all the sessions that use the binary protocol. Thread-safe.
+    // The frame's payload is empty if the message's payload is not valid JSON
+    boost::asio::const_buffer binary_frame() const;
+
+    // The MessagePack payload of binary_frame()
+    std::string_view binary_payload() const;
+};
+
+// The maximum size of a frame header written by the server (which doesn't mask frames)
+inline constexpr std::size_t max_frame_header_size = 10u;
+
+// Writes a frame header for a final, unmasked frame into buff, which must have space
+// for max_frame_header_size bytes. Returns the number of bytes written
+std::size_t write_frame_header(
+    unsigned char* buff,
+    std::uint8_t opcode,
+    bool compressed,
+    std::uint64_t payload_size
+) noexcept;
+
+// Follows the frames in a sequence of bytes written to a websocket, to know where frames end.
+// Used to find the points where we can write our own frames without corrupting others
+class websocket_frame_tracker
+{
+    unsigned char header_[14]{};
+    std::size_t header_size_{0};
+    std::uint64_t remaining_{0};
+
+    // Size of the header being parsed, or 0 if we don't have enough bytes to know yet
+    std::size_t expected_header_size() const noexcept;
+
+public:
+    // Are we between two frames?
+    bool at_boundary() const noexcept { return header_size_ == 0u && remaining_ == 0u; }
+
+    // Processes bytes written to the stream
+    void consume(boost::asio::const_buffer data) noexcept;
+};
+
+}  // namespace chat
+
+#endif
@@ -8,7 +8,6 @@
 #include "api/api_types.hpp"
 
 #include <boost/describe/class.hpp>
-#include <boost/json/array.hpp>
 #include <boost/json/object.hpp>
 #include <boost/json/parse.hpp>
 #include <boost/json/serialize.hpp>
@@ -16,8 +15,15 @@
 #include <boost/json/value_to.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include "business_types.hpp"
 #include "timestamp.hpp"
@@ -60,23 +66,59 @@ struct wire_api_error
 };
 BOOST_DESCRIBE_STRUCT(wire_api_error, (), (id, message))
 
-// User wire format
-struct wire_user
+// Import results wire format
+struct wire_import_account_error
+{
+    std::size_t line;
+    std::string_view id;
+    std::string_view message;
+};
+BOOST_DESCRIBE_STRUCT(wire_import_account_error, (), (line, id, message))
+
+struct wire_import_accounts_response
+{
+    std::size_t created;
+    std::vector<wire_import_account_error> errors;
+};
+BOOST_DESCRIBE_STRUCT(wire_import_accounts_response, (), (created, errors))
+
+// Wire formats for server events, used to parse them
+struct parsed_wire_user
 {
     std::int64_t id;
-    std::string_view username;
+    std::string username;
 };
-BOOST_DESCRIBE_STRUCT(wire_user, (), (id, username))
+BOOST_DESCRIBE_STRUCT(parsed_wire_user, (), (id, username))
 
-// Server message wire format
-struct wire_server_message
+struct parsed_wire_server_message
 {
-    std::string_view id;
-    std::string_view content;
-    wire_user user;
+    std::string id;
+    std::string content;
+    parsed_wire_user user;
     std::int64_t timestamp;
 };
-BOOST_DESCRIBE_STRUCT(wire_server_message, (), (id, content, user, timestamp))
+BOOST_DESCRIBE_STRUCT(parsed_wire_server_message, (), (id, content, user, timestamp))
+
+struct parsed_wire_server_messages
+{
+    std::string roomId;
+    std::vector<parsed_wire_server_message> messages;
+};
+BOOST_DESCRIBE_STRUCT(parsed_wire_server_messages, (), (roomId, messages))
+
+struct parsed_wire_message_correction
+{
+    std::string id;
+    std::optional<std::string> newId;
+};
+BOOST_DESCRIBE_STRUCT(parsed_wire_message_correction, (), (id, newId))
+
+struct parsed_wire_server_messages_corrected
+{
+    std::string roomId;
+    std::vector<parsed_wire_message_correction> messages;
+};
+BOOST_DESCRIBE_STRUCT(parsed_wire_server_messages_corrected, (), (roomId, messages))
 
 }  // namespace
 
@@ -86,11 +128,11 @@ BOOST_DESCRIBE_STRUCT(wire_server_message, (), (id, content, user, timestamp))
 
 // Helper for HTTP requests
 template <class RequestType>
-static result<RequestType> parse_generic_request(std::string_view from)
+static result<RequestType> parse_generic_request(std::string_view from, boost::json::storage_ptr sp)
 {
     // Parse the JSON
     error_code ec;
-    auto msg = boost::json::parse(from, ec);
+    auto msg = boost::json::parse(from, ec, std::move(sp));
     if (ec)
         CHAT_RETURN_ERROR(ec)
 
@@ -98,62 +140,110 @@ static result<RequestType> parse_generic_request(std::string_view from)
     return boost::json::try_value_to<RequestType>(msg);
 }
 
-result<create_account_request> create_account_request::from_json(std::string_view from)
+result<create_account_request> create_account_request::from_json(
+    std::string_view from,
+    boost::json::storage_ptr sp
+)
 {
-    return parse_generic_request<create_account_request>(from);
+    return parse_generic_request<create_account_request>(from, std::move(sp));
 }
 
-result<login_request> login_request::from_json(std::string_view from)
+result<login_request> login_request::from_json(std::string_view from, boost::json::storage_ptr sp)
 {
-    return parse_generic_request<login_request>(from);
+    return parse_generic_request<login_request>(from, std::move(sp));
 }
 
 chat::any_client_event chat::parse_client_event(std::string_view from)
+{
+    return client_event_parser().parse(from);
+}
+
+// Helper to parse server events. Checks the event type and parses the payload into a wire struct
+template <class WireType>
+static result<WireType> parse_server_event(
+    std::string_view from,
+    std::string_view type,
+    boost::json::storage_ptr sp
+)
 {
     error_code ec;
 
     // Parse the JSON
-    auto msg = boost::json::parse(from, ec);
+    auto msg = boost::json::parse(from, ec, std::move(sp));
     if (ec)
         CHAT_RETURN_ERROR(ec)
 
-    // Get the message type
+    // Check the message type
     const auto* obj = msg.if_object();
     if (!obj)
         CHAT_RETURN_ERROR(errc::websocket_parse_error)
-    auto it = obj->find("type");
-    if (it == obj->end())
+    const auto* type_value = obj->if_contains("type");
+    if (!type_value || !type_value->is_string() || type_value->get_string() != type)
         CHAT_RETURN_ERROR(errc::websocket_parse_error)
-    const auto& type = it->value();
 
-    // Get the payload
-    it = obj->find("payload");
-    if (it == obj->end())
+    // Parse the payload
+    const auto* payload = obj->if_contains("payload");
+    if (!payload)
         CHAT_RETURN_ERROR(errc::websocket_parse_error)
-    const auto& payload = it->value();
+    auto parsed_payload = boost::json::try_value_to<WireType>(*payload);
+    if (parsed_payload.has_error())
+        CHAT_RETURN_ERROR(parsed_payload.error())
+    return std::move(*parsed_payload);
+}
 
-    // Parse the message, depending on its type
-    if (type == "clientMessages")
-    {
-        // Parse the payload
-        auto parsed_payload = boost::json::try_value_to<client_messages_event>(payload);
-        if (parsed_payload.has_error())
-            CHAT_RETURN_ERROR(parsed_payload.error())
-        return parsed_payload.value();
-    }
-    else if (type == "requestRoomHistory")
+result<parsed_server_messages_event> chat::parse_server_messages_event(
+    std::string_view from,
+    boost::json::storage_ptr sp
+)
+{
+    auto parsed_payload = parse_server_event<parsed_wire_server_messages>(
+        from,
+        "serverMessages",
+        std::move(sp)
+    );
+    if (parsed_payload.has_error())
+        return parsed_payload.error();
+
+    // Compose the result. Aggregated events contain messages sent by several users
+    parsed_server_messages_event res{std::move(parsed_payload->roomId), {}, {}};
+    res.messages.reserve(parsed_payload->messages.size());
+    for (auto& wire_msg : parsed_payload->messages)
     {
-        // Parse the payload
-        auto parsed_payload = boost::json::try_value_to<request_room_history_event>(payload);
-        if (parsed_payload.has_error())
-            CHAT_RETURN_ERROR(parsed_payload.error())
-        return parsed_payload.value();
+        res.usernames[wire_msg.user.id] = std::move(wire_msg.user.username);
+        res.messages.push_back(message{
+            std::move(wire_msg.id),
+            std::move(wire_msg.content),
+            parse_timestamp(wire_msg.timestamp),
+            wire_msg.user.id,
+        });
     }
-    else
+    return res;
+}
+
+result<parsed_server_messages_corrected_event> chat::parse_server_messages_corrected_event(
+    std::string_view from,
+    boost::json::storage_ptr sp
+)
+{
+    auto parsed_payload = parse_server_event<parsed_wire_server_messages_corrected>(
+        from,
+        "serverMessagesCorrected",
+        std::move(sp)
+    );
+    if (parsed_payload.has_error())
+        return parsed_payload.error();
+
+    // Compose the result. A null newId means that the message was lost
+    parsed_server_messages_corrected_event res{std::move(parsed_payload->roomId), {}};
+    res.corrections.reserve(parsed_payload->messages.size());
+    for (auto& wire_correction : parsed_payload->messages)
     {
-        // Unknown typpe
-        CHAT_RETURN_ERROR(errc::websocket_parse_error)
+        res.corrections.push_back(message_id_correction{
+            std::move(wire_correction.id),
+            std::move(wire_correction.newId).value_or(std::string()),
+        });
     }
+    return res;
 }
 
 //
@@ -174,100 +264,371 @@ static std::string_view to_string(api_error_id input)
 
 std::string api_error::to_json() const
 {
-    wire_api_error err{to_string(error_id), error_message};
+    // Qualified, since chat::to_string(activity_kind) would hide it
+    wire_api_error err{::to_string(error_id), error_message};
     return boost::json::serialize(boost::json::value_from(err));
 }
 
-static boost::json::value serialize_message(const message& input, std::string_view username)
+std::string import_accounts_response::to_json() const
 {
-    return boost::json::value_from(wire_server_message{
-        input.id,
-        input.content,
-        wire_user{input.user_id, username},
-        serialize_timestamp(input.timestamp),
-    });
+    wire_import_accounts_response res{created, {}};
+    res.errors.reserve(errors.size());
+    for (const auto& err : errors)
+        res.errors.push_back({err.line, ::to_string(err.error_id), err.error_message});
+    return boost::json::serialize(boost::json::value_from(res));
 }
 
-static boost::json::array serialize_messages(
-    boost::span<const message> messages,
+//
+// Server events are composed by appending to a string, rather than building a DOM.
+// Messages are usually already encoded (see encode_message), so composing an event
+// involves mostly copying bytes.
+//
+
+// Appends a JSON string literal, escaping any characters as required
+static void append_string(std::string& output, std::string_view value)
+{
+    static constexpr char hex_digits[] = "0123456789abcdef";
+
+    output += '"';
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"': output += "\\\""; break;
+        case '\\': output += "\\\\"; break;
+        case '\n': output += "\\n"; break;
+        case '\r': output += "\\r"; break;
+        case '\t': output += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20u)
+            {
+                // Other control characters
+                output += "\\u00";
+                output += hex_digits[static_cast<unsigned char>(c) >> 4];
+                output += hex_digits[static_cast<unsigned char>(c) & 0x0f];
+            }
+            else
+            {
+                output += c;
+            }
+        }
+    }
+    output += '"';
+}
+
+// Appends an object key, including the trailing colon
+static void append_key(std::string& output, std::string_view key)
+{
+    append_string(output, key);
+    output += ':';
+}
+
+static void append_bool(std::string& output, bool value) { output += value ? "true" : "false"; }
+
+static void append_user(std::string& output, std::int64_t id, std::string_view username)
+{
+    output += '{';
+    append_key(output, "id");
+    output += std::to_string(id);
+    output += ',';
+    append_key(output, "username");
+    append_string(output, username);
+    output += '}';
+}
+
+static void append_message(std::string& output, const message& input, std::string_view username)
+{
+    // Use the memoized representation, if available
+    if (input.encoded)
+    {
+        output += *input.encoded;
+        return;
+    }
+
+    output += '{';
+    append_key(output, "id");
+    append_string(output, input.id);
+    output += ',';
+    append_key(output, "content");
+    append_string(output, input.content);
+    output += ',';
+    append_key(output, "user");
+    append_user(output, input.user_id, username);
+    output += ',';
+    append_key(output, "timestamp");
+    output += std::to_string(serialize_timestamp(input.timestamp));
+    output += '}';
+}
+
+static void append_message(std::string& output, const message_view& input, std::string_view username)
+{
+    output += '{';
+    append_key(output, "id");
+    append_string(output, input.id);
+    output += ',';
+    append_key(output, "content");
+    append_string(output, input.content);
+    output += ',';
+    append_key(output, "user");
+    append_user(output, input.user_id, username);
+    output += ',';
+    append_key(output, "timestamp");
+    output += std::to_string(serialize_timestamp(input.timestamp));
+    output += '}';
+}
+
+// Works for both message and message_view
+template <class Message>
+static void append_messages(
+    std::string& output,
+    boost::span<const Message> messages,
     const username_map& usernames
 )
 {
-    boost::json::array res;
-    res.reserve(messages.size());
-    for (const auto& msg : messages)
+    output += '[';
+    for (std::size_t i = 0; i < messages.size(); ++i)
     {
+        if (i > 0u)
+            output += ',';
+
         // Lookup the username in the map. Default to empty if not found
+        const auto& msg = messages[i];
         auto it = usernames.find(msg.user_id);
         auto username = it == usernames.end() ? std::string_view() : std::string_view(it->second);
 
-        res.push_back(serialize_message(msg, username));
+        append_message(output, msg, username);
     }
-    return res;
+    output += ']';
 }
 
-static boost::json::array serialize_messages(boost::span<const message> messages, const user& sending_user)
+static void append_messages(
+    std::string& output,
+    boost::span<const message> messages,
+    const user& sending_user
+)
 {
-    boost::json::array res;
-    res.reserve(messages.size());
-    for (const auto& msg : messages)
+    output += '[';
+    for (std::size_t i = 0; i < messages.size(); ++i)
     {
-        assert(msg.user_id == sending_user.id);
-        res.push_back(serialize_message(msg, sending_user.username));
+        if (i > 0u)
+            output += ',';
+        assert(messages[i].user_id == sending_user.id);
+        append_message(output, messages[i], sending_user.username);
     }
-    return res;
+    output += ']';
 }
 
-static boost::json::object serialize_room(const room& input, const username_map& usernames)
+static void append_room(std::string& output, const room& input, const username_map& usernames)
 {
-    boost::json::object res({
-        {"id",              input.id              },
-        {"name",            input.name            },
-        {"hasMoreMessages", input.history.has_more},
-    });
-    res.emplace("messages", serialize_messages(input.history.messages, usernames));
-    return res;
+    output += '{';
+    append_key(output, "id");
+    append_string(output, input.id);
+    output += ',';
+    append_key(output, "name");
+    append_string(output, input.name);
+    output += ',';
+    append_key(output, "hasMoreMessages");
+    append_bool(output, input.history.has_more);
+    output += ',';
+    append_key(output, "messages");
+    append_messages<message>(output, input.history.messages, usernames);
+    if (input.history.is_delta)
+    {
+        output += ',';
+        append_key(output, "isDelta");
+        append_bool(output, true);
+    }
+    output += '}';
 }
 
-static std::string serialize_event(std::string_view type, boost::json::object payload)
+// Starts an event, leaving output ready to write the payload object contents
+static void begin_event(std::string& output, std::string_view type)
 {
-    boost::json::object evt;
-    evt.emplace("type", type);
-    evt.emplace("payload", std::move(payload));
-    return boost::json::serialize(evt);
+    output += '{';
+    append_key(output, "type");
+    append_string(output, type);
+    output += ',';
+    append_key(output, "payload");
+    output += '{';
+}
+
+// Finishes an event started by begin_event
+static void end_event(std::string& output) { output += "}}"; }
+
+std::shared_ptr<const std::string> chat::encode_message(const message& msg, std::string_view username)
+{
+    auto res = std::make_shared<std::string>();
+    append_message(*res, msg, username);
+    return res;
 }
 
 std::string hello_event::to_json() const
 {
+    std::string res;
+    begin_event(res, "hello");
+
     // Current user
-    auto json_me = boost::json::value_from(wire_user{me.id, me.username});
+    append_key(res, "me");
+    append_user(res, me.id, me.username);
+    res += ',';
 
     // Rooms
-    boost::json::array json_rooms;
-    json_rooms.reserve(rooms.size());
-    for (const auto& room : rooms)
-        json_rooms.push_back(serialize_room(room, usernames));
-
-    // Event
-    boost::json::object payload;
-    payload.emplace("me", std::move(json_me));
-    payload.emplace("rooms", std::move(json_rooms));
-    return serialize_event("hello", std::move(payload));
+    append_key(res, "rooms");
+    res += '[';
+    for (std::size_t i = 0; i < rooms.size(); ++i)
+    {
+        if (i > 0u)
+            res += ',';
+        append_room(res, rooms[i], usernames);
+    }
+    res += ']';
+
+    end_event(res);
+    return res;
+}
+
+std::string room_joined_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "roomJoined");
+    append_key(res, "room");
+    append_room(res, joined_room, usernames);
+    end_event(res);
+    return res;
 }
 
 std::string server_messages_event::to_json() const
 {
-    boost::json::object payload;
-    payload.emplace("roomId", room_id);
-    payload.emplace("messages", serialize_messages(messages, sending_user));
-    return serialize_event("serverMessages", std::move(payload));
+    std::string res;
+    begin_event(res, "serverMessages");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "messages");
+    append_messages(res, messages, sending_user);
+    end_event(res);
+    return res;
+}
+
+std::string aggregated_server_messages_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "serverMessages");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "messages");
+    append_messages<message>(res, messages, usernames);
+    end_event(res);
+    return res;
+}
+
+std::string server_messages_corrected_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "serverMessagesCorrected");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "messages");
+    res += '[';
+    for (std::size_t i = 0; i < corrections.size(); ++i)
+    {
+        if (i > 0u)
+            res += ',';
+        res += '{';
+        append_key(res, "id");
+        append_string(res, corrections[i].id);
+        res += ',';
+        append_key(res, "newId");
+        if (corrections[i].new_id.empty())
+            res += "null";
+        else
+            append_string(res, corrections[i].new_id);
+        res += '}';
+    }
+    res += ']';
+    end_event(res);
+    return res;
+}
+
+std::string_view chat::to_string(activity_kind kind) noexcept
+{
+    switch (kind)
+    {
+    case activity_kind::typing: return "typing";
+    case activity_kind::presence: return "presence";
+    case activity_kind::read: return "read";
+    default: return "";
+    }
+}
+
+std::string server_activity_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "serverActivity");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "user");
+    append_user(res, sending_user.id, sending_user.username);
+    res += ',';
+    append_key(res, "kind");
+    append_string(res, to_string(kind));
+    if (kind == activity_kind::read)
+    {
+        res += ',';
+        append_key(res, "messageId");
+        append_string(res, message_id);
+    }
+    end_event(res);
+    return res;
 }
 
 std::string room_history_event::to_json() const
 {
-    boost::json::object payload;
-    payload.emplace("roomId", room_id);
-    payload.emplace("messages", serialize_messages(history.messages, usernames));
-    payload.emplace("hasMoreMessages", history.has_more);
-    return serialize_event("roomHistory", std::move(payload));
+    std::string res;
+    begin_event(res, "roomHistory");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "messages");
+    append_messages<message>(res, history.messages, usernames);
+    res += ',';
+    append_key(res, "hasMoreMessages");
+    append_bool(res, history.has_more);
+    end_event(res);
+    return res;
+}
+
+std::string room_search_results_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "roomSearchResults");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "query");
+    append_string(res, query);
+    res += ',';
+    append_key(res, "messages");
+    append_messages<message>(res, messages, usernames);
+    end_event(res);
+    return res;
+}
+
+std::string room_history_view_event::to_json() const
+{
+    std::string res;
+    begin_event(res, "roomHistory");
+    append_key(res, "roomId");
+    append_string(res, room_id);
+    res += ',';
+    append_key(res, "messages");
+    append_messages(res, messages, usernames);
+    res += ',';
+    append_key(res, "hasMoreMessages");
+    append_bool(res, has_more);
+    end_event(res);
+    return res;
 }
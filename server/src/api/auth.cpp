@@ -6,13 +6,36 @@
 //
 
 #include "api/auth.hpp"
+
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
 #include "api/api_types.hpp"
+#include "error.hpp"
 #include "request_context.hpp"
 #include "services/cookie_auth_service.hpp"
+#include "services/login_rate_limiter.hpp"
 #include "services/mysql_client.hpp"
 #include "shared_state.hpp"
+#include "util/bounded_thread_pool.hpp"
 #include "util/email.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
 #include "util/password_hash.hpp"
+#include "util/run_parallel.hpp"
+#include "util/scrypt.hpp"
 
 using namespace chat;
 namespace http = boost::beast::http;
@@ -23,6 +46,45 @@ static constexpr std::size_t max_email_size = 100u;
 static constexpr std::size_t min_password_size = 10u;
 static constexpr std::size_t max_password_size = 100u;
 
+// Imports are read and created in batches. Each batch is inserted in a single transaction
+static constexpr std::size_t import_batch_size = 500u;
+
+// Lines in imports are bigger than this only if they contain invalid accounts
+static constexpr std::size_t max_import_line_size = 4096u;
+
+// How long to wait before retrying when the hashing pool is full
+static constexpr std::chrono::milliseconds import_hashing_retry{50};
+
+// Imports are authorized by this token. They're disabled if it's empty
+static const std::string& import_accounts_token()
+{
+    static const std::string res = get_env_string("IMPORT_ACCOUNTS_TOKEN", "");
+    return res;
+}
+
+// The maximum number of passwords an import may have in the hashing pool at once.
+// The pool is shared with logins and account creations, so they aren't starved
+static std::size_t import_hashing_concurrency()
+{
+    static const std::size_t res = (std::max)(get_env_size("IMPORT_HASHING_CONCURRENCY", 2u), std::size_t(1));
+    return res;
+}
+
+// Validates the parameters of a new account. Returns an explanation of what's wrong,
+// or an empty string if they're valid
+static std::string_view validate_new_account(const create_account_request& params)
+{
+    if (params.username.size() < min_username_size || params.username.size() > max_username_size)
+        return "username: invalid size";
+    if (params.email.size() > max_email_size)
+        return "email: too long";
+    if (!is_email(params.email))
+        return "email: invalid format";
+    if (params.password.size() < min_password_size || params.password.size() > max_password_size)
+        return "password: invalid size";
+    return {};
+}
+
 // Ensure that both username not found and invalid password responses are equal
 static response_builder::response_type login_failed(response_builder& resp)
 {
@@ -42,19 +104,25 @@ response_builder::response_type chat::handle_create_account(
     const auto& req_params = parse_result.value();
 
     // Validate params
-    if (req_params.username.size() < min_username_size || req_params.username.size() > max_username_size)
-        return ctx.response().bad_request_json("username: invalid size");
-    if (req_params.email.size() > max_email_size)
-        return ctx.response().bad_request_json("email: too long");
-    if (!is_email(req_params.email))
-        return ctx.response().bad_request_json("email: invalid format");
-    if (req_params.password.size() < min_password_size || req_params.password.size() > max_password_size)
-        return ctx.response().bad_request_json("password: invalid size");
+    auto validation_error = validate_new_account(req_params);
+    if (!validation_error.empty())
+        return ctx.response().bad_request_json(validation_error);
 
-    // Hash the password before insertion. TODO: this is an ultra-expensive
-    // computation that should be run in a thread pool.
-    // https://github.com/anarthal/servertech-chat/issues/47
-    auto hashed_passwd = hash_password(req_params.password);
+    // Hash the password before insertion. This is an ultra-expensive computation,
+    // so it's run in a thread pool, to avoid blocking the event loop.
+    // If the pool is overloaded, shed load
+    auto hash_result = st.hashing_pool().run(
+        [passwd = req_params.password,
+         params = st.password_params(),
+         enqueued = std::chrono::steady_clock::now()] {
+            record_latency(histogram_id::scrypt_queue, std::chrono::steady_clock::now() - enqueued);
+            return hash_password(passwd, params);
+        },
+        yield
+    );
+    if (hash_result.has_error())
+        return ctx.response().service_unavailable_text();
+    const auto& hashed_passwd = hash_result.value();
 
     // Execute the operation
     auto user_id_result = st.mysql().create_user(req_params.username, req_params.email, hashed_passwd, yield);
@@ -72,12 +140,267 @@ response_builder::response_type chat::handle_create_account(
     }
 
     // Generate a session cookie
-    auto session_cookie_result = st.cookie_auth().generate_session_cookie(*user_id_result, yield);
+    auto session_cookie_result = st.cookie_auth()
+                                     .generate_session_cookie(*user_id_result, req_params.username, yield);
     if (session_cookie_result.has_error())
         return ctx.response().internal_server_error(session_cookie_result.error());
     return ctx.response().set_cookie(*session_cookie_result).empty_response();
 }
 
+namespace {
+
+// A line of an import
+struct import_row
+{
+    // The line number, starting at 1
+    std::size_t line;
+
+    // Why the account is invalid. Empty for valid accounts
+    std::string_view error;
+
+    create_account_request params;
+};
+
+// The outcome of an import
+struct import_results
+{
+    std::size_t created{0u};
+    std::vector<import_account_error> errors;
+};
+
+}  // namespace
+
+// Parses and validates a line of an import, adding it to batch. Blank lines are ignored
+static void add_import_row(
+    std::vector<import_row>& batch,
+    std::size_t line_number,
+    std::string_view line,
+    bool too_long
+)
+{
+    if (!too_long && line.find_first_not_of(" \t\r") == std::string_view::npos)
+        return;
+    import_row row{line_number, {}, {}};
+    if (too_long)
+    {
+        row.error = "Line too long";
+    }
+    else
+    {
+        // The JSON DOM is discarded after parsing each line. Using the request arena
+        // would make it grow with the size of the import
+        auto parse_result = create_account_request::from_json(line);
+        if (parse_result.has_error())
+        {
+            row.error = "Invalid account provided";
+        }
+        else
+        {
+            row.error = validate_new_account(*parse_result);
+            row.params = std::move(*parse_result);
+        }
+    }
+    batch.push_back(std::move(row));
+}
+
+// Hashes a password in the hashing pool. Imports aren't interactive, so if the pool is full,
+// we wait for other requests to free space, rather than shedding load
+static std::string hash_import_password(
+    shared_state& st,
+    const std::string& password,
+    boost::asio::steady_timer& timer,
+    boost::asio::yield_context yield
+)
+{
+    while (true)
+    {
+        auto hash_result = st.hashing_pool().run(
+            [passwd = password, params = st.password_params(), enqueued = std::chrono::steady_clock::now()] {
+                record_latency(histogram_id::scrypt_queue, std::chrono::steady_clock::now() - enqueued);
+                return hash_password(passwd, params);
+            },
+            yield
+        );
+        if (hash_result.has_value())
+            return std::move(*hash_result);
+
+        error_code ignored;
+        timer.expires_after(import_hashing_retry);
+        timer.async_wait(yield[ignored]);
+    }
+}
+
+// Creates the valid accounts in a batch, recording the outcome of every row
+static error_with_message import_batch(
+    shared_state& st,
+    boost::span<const import_row> batch,
+    import_results& results,
+    boost::asio::yield_context yield
+)
+{
+    // Hash the passwords in parallel. Each coroutine hashes every concurrency-th row,
+    // so the import never has more than concurrency passwords in the pool.
+    // Exceptions can't leave the coroutines, so they're rethrown once all of them are done
+    std::vector<std::string> hashes(batch.size());
+    std::exception_ptr exc;
+    auto concurrency = (std::min)(import_hashing_concurrency(), batch.size());
+    run_parallel(
+        concurrency,
+        [&](std::size_t first, boost::asio::yield_context child_yield) {
+            boost::asio::steady_timer timer(child_yield.get_executor());
+            for (std::size_t i = first; i < batch.size() && !exc; i += concurrency)
+            {
+                if (!batch[i].error.empty())
+                    continue;
+                try
+                {
+                    hashes[i] = hash_import_password(st, batch[i].params.password, timer, child_yield);
+                }
+                catch (const std::exception&)
+                {
+                    exc = std::current_exception();
+                }
+            }
+        },
+        yield
+    );
+    if (exc)
+        std::rethrow_exception(exc);
+
+    // Insert the valid accounts
+    std::vector<new_user> users;
+    users.reserve(batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+        if (batch[i].error.empty())
+            users.push_back({batch[i].params.username, batch[i].params.email, hashes[i]});
+    }
+    auto create_result = st.mysql().create_users(users, yield);
+    if (create_result.has_error())
+        return std::move(create_result).error();
+
+    // Record the outcome, in order
+    auto created_before = results.created;
+    std::size_t user_index = 0u;
+    for (const auto& row : batch)
+    {
+        if (!row.error.empty())
+        {
+            results.errors.push_back({row.line, api_error_id::bad_request, row.error});
+            continue;
+        }
+        const auto& user_result = (*create_result)[user_index++];
+        if (user_result.has_value())
+            ++results.created;
+        else if (user_result.error() == errc::username_exists)
+            results.errors.push_back({row.line, api_error_id::username_exists, ""});
+        else
+            results.errors.push_back({row.line, api_error_id::email_exists, ""});
+    }
+    increment_counter(counter_id::accounts_imported, results.created - created_before);
+    return {};
+}
+
+response_builder::response_type chat::handle_import_accounts(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+)
+{
+    // Check that imports are enabled and the client is authorized
+    const auto& token = import_accounts_token();
+    if (token.empty())
+        return ctx.response().not_found_text();
+    constexpr std::string_view bearer_prefix = "Bearer ";
+    auto auth_header = ctx.request_header(http::field::authorization);
+    if (auth_header.substr(0, bearer_prefix.size()) != bearer_prefix)
+        return ctx.response().unauthorized_text();
+    auth_header.remove_prefix(bearer_prefix.size());
+    if (!time_safe_equals(
+            {reinterpret_cast<const unsigned char*>(auth_header.data()), auth_header.size()},
+            {reinterpret_cast<const unsigned char*>(token.data()), token.size()}
+        ))
+    {
+        return ctx.response().unauthorized_text();
+    }
+    if (ctx.request_header(http::field::content_type) != "application/x-ndjson")
+        return ctx.response().bad_request_json("Invalid body provided");
+
+    // Read the body as it arrives, creating the accounts every time a batch is complete.
+    // Lines may span several reads, so they're accumulated in line.
+    // Coroutine stacks are small, so the buffer is allocated in the heap
+    constexpr std::size_t chunk_size = 64u * 1024u;
+    std::vector<char> buff(chunk_size);
+    std::string line;
+    bool line_too_long = false;
+    std::size_t line_number = 0u;
+    std::vector<import_row> batch;
+    batch.reserve(import_batch_size);
+    import_results results;
+
+    auto end_line = [&] {
+        add_import_row(batch, ++line_number, line, line_too_long);
+        line.clear();
+        line_too_long = false;
+    };
+    auto flush_batch = [&] {
+        auto err = import_batch(st, batch, results, yield);
+        batch.clear();
+        return err;
+    };
+
+    while (true)
+    {
+        auto bytes_read = ctx.read_body_some(buff, yield);
+        if (bytes_read.has_error())
+        {
+            // The accounts in the batches completed so far are kept
+            log_error(bytes_read.error(), "Reading import body");
+            return ctx.response().bad_request_text("Error reading body");
+        }
+        if (*bytes_read == 0u)
+            break;
+
+        std::string_view chunk(buff.data(), *bytes_read);
+        while (!chunk.empty())
+        {
+            auto pos = chunk.find('\n');
+            auto part = chunk.substr(0, pos);
+            if (line_too_long || line.size() + part.size() > max_import_line_size)
+            {
+                line_too_long = true;
+                line.clear();
+            }
+            else
+            {
+                line += part;
+            }
+            if (pos == std::string_view::npos)
+                break;
+            chunk.remove_prefix(pos + 1u);
+            end_line();
+            if (batch.size() == import_batch_size)
+            {
+                auto err = flush_batch();
+                if (err.ec)
+                    return ctx.response().internal_server_error(err);
+            }
+        }
+    }
+
+    // The last line may not end with a newline
+    if (!line.empty() || line_too_long)
+        end_line();
+    if (!batch.empty())
+    {
+        auto err = flush_batch();
+        if (err.ec)
+            return ctx.response().internal_server_error(err);
+    }
+
+    return ctx.response().json_response(import_accounts_response{results.created, results.errors});
+}
+
 response_builder::response_type chat::handle_login(
     request_context& ctx,
     shared_state& st,
@@ -98,6 +421,11 @@ response_builder::response_type chat::handle_login(
     if (req_params.password.size() < min_password_size || req_params.password.size() > max_password_size)
         return ctx.response().bad_request_json("password: invalid size");
 
+    // Reject password guessing before doing any expensive work
+    auto limit_result = st.login_limiter().check_attempt(ctx.client_address(), req_params.email, yield);
+    if (limit_result != login_limit_result::allowed)
+        return ctx.response().too_many_requests_text(st.login_limiter().retry_after(limit_result));
+
     // Retrieve user by email
     auto user_result = st.mysql().get_user_by_email(req_params.email, yield);
 
@@ -106,23 +434,61 @@ response_builder::response_type chat::handle_login(
     {
         auto err = std::move(user_result).error();
         if (err.ec == errc::not_found)
-            return login_failed(ctx.response());  // email not found
+        {
+            // email not found
+            st.login_limiter().record_failure(req_params.email, yield);
+            return login_failed(ctx.response());
+        }
         else
             return ctx.response().internal_server_error(err);
     }
     const auto& user = user_result.value();
 
-    // Verify password. TODO: this function requires a lot of computing,
-    // it should be run in a thread pool
-    // https://github.com/anarthal/servertech-chat/issues/47
-    if (!verify_password(req_params.password, user.hashed_password))
+    // Verify password. This function requires a lot of computing,
+    // so it's run in a thread pool. If the pool is overloaded, shed load.
+    // If the hash params are out of date, this also rehashes the password
+    auto verify_result = st.hashing_pool().run(
+        [passwd = req_params.password,
+         hashed_passwd = user.hashed_password,
+         params = st.password_params(),
+         enqueued = std::chrono::steady_clock::now()] {
+            record_latency(histogram_id::scrypt_queue, std::chrono::steady_clock::now() - enqueued);
+            return verify_password(passwd, hashed_passwd, params);
+        },
+        yield
+    );
+    if (verify_result.has_error())
+        return ctx.response().service_unavailable_text();
+    if (!verify_result->matches)
     {
+        st.login_limiter().record_failure(req_params.email, yield);
         return login_failed(ctx.response());
     }
 
+    // Store the upgraded hash. This is an optimization, so failing to do it doesn't fail the login
+    if (!verify_result->rehashed.empty())
+    {
+        auto err = st.mysql().update_password(user.id, user.hashed_password, verify_result->rehashed, yield);
+        if (err.ec)
+            log_error(err, "Upgrading password hash");
+    }
+
     // Generate a session cookie
-    auto session_cookie_result = st.cookie_auth().generate_session_cookie(user.id, yield);
+    auto session_cookie_result = st.cookie_auth().generate_session_cookie(user.id, user.username, yield);
+    if (session_cookie_result.has_error())
+        return ctx.response().internal_server_error(session_cookie_result.error());
+    return ctx.response().set_cookie(*session_cookie_result).empty_response();
+}
+
+response_builder::response_type chat::handle_logout(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+)
+{
+    // Remove the session, if any, and clear the cookie. Logging out without a session is not an error
+    auto session_cookie_result = st.cookie_auth().invalidate_session_cookie(ctx.request_headers(), yield);
     if (session_cookie_result.has_error())
         return ctx.response().internal_server_error(session_cookie_result.error());
     return ctx.response().set_cookie(*session_cookie_result).empty_response();
-}
\ No newline at end of file
+}
@@ -7,46 +7,57 @@
 
 #include "api/chat_websocket.hpp"
 
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast/websocket/rfc6455.hpp>
 #include <boost/core/span.hpp>
+#include <boost/url/parse.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "api/api_types.hpp"
 #include "business_types.hpp"
 #include "error.hpp"
+#include "message_id.hpp"
+#include "services/broadcast_aggregator.hpp"
 #include "services/cookie_auth_service.hpp"
+#include "services/drain_controller.hpp"
+#include "services/message_sequencer.hpp"
 #include "services/pubsub_service.hpp"
 #include "services/redis_client.hpp"
 #include "services/room_history_service.hpp"
+#include "services/search_index.hpp"
 #include "shared_state.hpp"
+#include "util/arena.hpp"
+#include "util/env.hpp"
+#include "util/message_queue.hpp"
+#include "util/metrics.hpp"
+#include "util/msgpack.hpp"
+#include "util/stack_pool.hpp"
+#include "util/token_bucket.hpp"
+#include "util/tracing.hpp"
 #include "util/websocket.hpp"
 
 using namespace chat;
 
 namespace {
 
-// Rooms are static for now.
-static constexpr std::array<std::string_view, 4> room_ids{
-    "beast",
-    "async",
-    "db",
-    "wasm",
-};
-
-static constexpr std::array<std::string_view, room_ids.size()> room_names{
-    "Boost.Beast",
-    "Boost.Async",
-    "Database connectors",
-    "Web assembly",
-};
-
 // An owning type containing data for the hello event.
 struct hello_data
 {
@@ -54,27 +65,204 @@ struct hello_data
     username_map usernames;
 };
 
-// Retrieves the data required to send the hello event
-static result_with_message<hello_data> get_hello_data(shared_state& st, boost::asio::yield_context yield)
+// The most recent message a reconnecting client has for each room, by room ID
+using last_seen_map = std::unordered_map<std::string, std::string>;
+
+// Retrieves the data required to send the hello event, for the given rooms.
+// If lazy_history is true, no history is loaded: rooms are sent with hasMoreMessages set,
+// and the client requests history for each room when it's opened.
+// Rooms in last_seen only get the messages newer than the ones the client has, if possible
+static result_with_message<hello_data> get_hello_data(
+    shared_state& st,
+    boost::span<const room> rooms,
+    bool lazy_history,
+    const last_seen_map& last_seen,
+    boost::asio::yield_context yield
+)
 {
-    // Retrieve room history
-    room_history_service history_service(st.redis(), st.mysql());
-    auto history_result = history_service.get_room_history(room_ids, yield);
+    // Copy the rooms before yielding, since the caller may modify them
+    hello_data res{{rooms.begin(), rooms.end()}, {}};
+    if (lazy_history)
+    {
+        for (auto& r : res.rooms)
+            r.history = message_batch{{}, true};
+        return res;
+    }
+
+    // Retrieve room history. This is usually served from the cache
+    std::vector<std::string_view> room_ids;
+    room_ids.reserve(res.rooms.size());
+    for (const auto& r : res.rooms)
+        room_ids.push_back(r.id);
+    room_history_service history_service(st.redis(), st.mysql(), &st.history_cache());
+    std::vector<std::string_view> since_ids;
+    if (!last_seen.empty())
+    {
+        since_ids.reserve(res.rooms.size());
+        for (const auto& r : res.rooms)
+        {
+            auto it = last_seen.find(r.id);
+            since_ids.push_back(it == last_seen.end() ? std::string_view() : std::string_view(it->second));
+        }
+    }
+    auto history_result = since_ids.empty()
+                              ? history_service.get_room_history(room_ids, yield)
+                              : history_service.get_room_history_since(room_ids, since_ids, yield);
     if (history_result.has_error())
         return std::move(history_result).error();
-    assert(history_result->first.size() == room_ids.size());
+    assert(history_result->first.size() == res.rooms.size());
 
     // Compose hello data
-    hello_data res{{}, std::move(history_result->second)};
-    res.rooms.reserve(room_ids.size());
-    for (std::size_t i = 0; i < room_ids.size(); ++i)
+    res.usernames = std::move(history_result->second);
+    for (std::size_t i = 0; i < res.rooms.size(); ++i)
+        res.rooms[i].history = std::move(history_result->first[i]);
+
+    return res;
+}
+
+// Writes an event serialized as JSON, converting it to MessagePack first
+// if the client negotiated the binary protocol
+static error_code write_event(websocket& ws, std::string_view payload, boost::asio::yield_context yield)
+{
+    if (!ws.binary())
+        return ws.write(payload, yield);
+    auto encoded = json_to_msgpack(payload);
+    if (encoded.has_error())
+        return encoded.error();
+    return ws.write(*encoded, yield);
+}
+
+// Is room_id one of rooms?
+static bool contains_room(boost::span<const room> rooms, std::string_view room_id)
+{
+    return std::find_if(rooms.begin(), rooms.end(), [room_id](const room& r) { return r.id == room_id; }
+           ) != rooms.end();
+}
+
+// In optimistic broadcast mode, messages get their IDs from a message_sequencer,
+// and are broadcast before being stored, which saves a Redis round trip.
+// Read once from the environment
+static bool optimistic_broadcast_enabled()
+{
+    static const bool res = get_env_bool("OPTIMISTIC_BROADCAST", false);
+    return res;
+}
+
+// Stores messages that have already been broadcast, in the background. If Redis stored any of them
+// with a different ID, or they couldn't be stored, broadcasts the corrections, so clients and
+// caches can fix the messages they have. If the server is shutting down, it waits for this to finish
+static void store_broadcast_messages(
+    boost::asio::any_io_executor ex,
+    std::shared_ptr<shared_state> st,
+    std::string room_id,
+    std::vector<message> msgs
+)
+{
+    auto drain_guard = st->drainer().start_operation();
+    boost::asio::spawn(
+        ex,
+        std::allocator_arg,
+        task_stack_allocator(),
+        [st = std::move(st),
+         room_id = std::move(room_id),
+         msgs = std::move(msgs),
+         drain_guard = std::move(drain_guard)](boost::asio::yield_context yield) {
+            std::vector<message_id_correction> corrections;
+            auto ids = st->redis().store_messages_with_ids(room_id, msgs, yield);
+            if (ids.has_error())
+            {
+                log_error(ids.error(), "Storing broadcast messages");
+                increment_counter(counter_id::optimistic_messages_lost, msgs.size());
+                for (const auto& msg : msgs)
+                    corrections.push_back(message_id_correction{msg.id, ""});
+            }
+            else
+            {
+                // IDs only change if a message with a greater ID was stored first (e.g. by another
+                // server instance). Make sure that we don't generate IDs lower than that one again.
+                // Messages that couldn't be stored have an empty ID
+                assert(ids->size() == msgs.size());
+                std::size_t num_lost = 0u;
+                for (std::size_t i = 0; i < msgs.size(); ++i)
+                {
+                    auto& new_id = ids.value()[i];
+                    if (new_id == msgs[i].id)
+                        continue;
+                    if (new_id.empty())
+                        ++num_lost;
+                    else if (auto parsed = parse_message_id(new_id))
+                        global_message_sequencer().observe(*parsed);
+                    corrections.push_back(message_id_correction{msgs[i].id, std::move(new_id)});
+                }
+                if (num_lost)
+                {
+                    log_error(
+                        errc::redis_command_failed,
+                        "Storing broadcast messages. Messages have been lost"
+                    );
+                }
+                increment_counter(counter_id::optimistic_messages_lost, num_lost);
+                increment_counter(counter_id::optimistic_ids_reassigned, corrections.size() - num_lost);
+            }
+            if (!corrections.empty())
+            {
+                // Corrections must not reach clients before the messages they correct
+                st->aggregator().flush();
+                auto payload = server_messages_corrected_event{room_id, corrections}.to_json();
+                st->pubsub().publish(room_id, std::move(payload));
+            }
+        },
+        boost::asio::detached
+    );
+}
+
+// Limits the messages each session can send, to bound the work a single client causes.
+// WEBSOCKET_MESSAGES_PER_SECOND sets the rate (zero disables the limit),
+// and WEBSOCKET_MESSAGES_BURST the number of messages that can be sent at once
+static const token_bucket_params& get_send_rate()
+{
+    static const token_bucket_params res{
+        static_cast<double>((std::max)(get_env_size("WEBSOCKET_MESSAGES_BURST", 50u), std::size_t(1u))),
+        static_cast<double>(get_env_size("WEBSOCKET_MESSAGES_PER_SECOND", 20u)),
+    };
+    return res;
+}
+
+// Waits until a session can send num_messages, as limited by its budget. The session
+// doesn't read from the client meanwhile, so TCP pushes back on it. Batches bigger
+// than the burst size wait for the budget to be full, and empty it
+static error_code wait_for_send_budget(
+    token_bucket& budget,
+    std::size_t num_messages,
+    boost::asio::any_io_executor ex,
+    boost::asio::yield_context yield
+)
+{
+    const auto& params = get_send_rate();
+    if (params.refill_per_second <= 0.0)
+        return {};
+    double cost = (std::min)(static_cast<double>(num_messages), params.capacity);
+    for (bool throttled = false;; throttled = true)
     {
-        res.rooms.push_back(
-            room{std::string(room_ids[i]), std::string(room_names[i]), std::move(history_result->first[i])}
+        auto now = token_bucket::clock_type::now();
+        if (budget.try_take(params, cost, now))
+            return {};
+        if (!throttled)
+            increment_counter(counter_id::messages_throttled);
+
+        // Sleep until the missing tokens have been refilled
+        std::chrono::duration<double> wait_time(
+            ((std::max)(cost, 1.0) - budget.tokens(params, now)) / params.refill_per_second
+        );
+        boost::asio::steady_timer timer(
+            ex,
+            std::chrono::duration_cast<boost::asio::steady_timer::duration>(wait_time)
         );
+        error_code ec;
+        timer.async_wait(yield[ec]);
+        if (ec)
+            return ec;
     }
-
-    return res;
 }
 
 struct event_handler_visitor
@@ -82,32 +270,78 @@ struct event_handler_visitor
     const user& current_user;
     websocket& ws;
     shared_state& st;
+
+    // Keeps st alive in tasks that may outlive the session (like background stores)
+    const std::shared_ptr<shared_state>& st_ptr;
+    arena& frame_arena;
+
+    // The session, as a pubsub subscriber, and the rooms it's subscribed to
+    const std::shared_ptr<message_subscriber>& subscriber;
+    std::vector<room>& joined_rooms;
+    bool lazy_history;
+
+    // Limits the messages the session can send
+    token_bucket& send_budget;
+
+    // The trace for this event, or nullptr if tracing is disabled
+    trace* evt_trace;
+
     boost::asio::yield_context yield;
 
+    // Writes a response to the client
+    error_code write_response(std::string_view payload) const
+    {
+        trace_span span(evt_trace, "websocket.write");
+        return traced_call(evt_trace, [&] { return write_event(ws, payload, yield); });
+    }
+
     // Parsing error
     error_with_message operator()(error_code ec) const noexcept { return error_with_message{ec}; }
 
     // Messages event
     error_with_message operator()(client_messages_event& evt) const
     {
+        // Users may only post to rooms they're a member of
+        if (!contains_room(joined_rooms, evt.roomId))
+            return error_with_message{errc::not_room_member};
+
+        // Don't let a single client flood the room
+        auto budget_ec = wait_for_send_budget(send_budget, evt.messages.size(), ws.get_executor(), yield);
+        if (budget_ec)
+            return error_with_message{budget_ec};
+
         // Set the timestamp
         auto timestamp = timestamp_t::clock::now();
 
-        // Compose a message array
-        std::vector<message> msgs;
+        // Compose a message array. It's only needed while handling the event
+        std::pmr::vector<message> msgs(frame_arena.resource());
         msgs.reserve(evt.messages.size());
         for (auto& msg : evt.messages)
         {
             msgs.push_back(message{
-                "",  // blank ID, will be assigned by Redis
+                "",  // blank ID, will be assigned by Redis or the sequencer
                 std::move(msg.content),
                 timestamp,
                 current_user.id,
             });
         }
 
-        // Store it in Redis
-        auto ids_result = st.redis().store_messages(evt.roomId, msgs, yield);
+        // In optimistic mode, broadcast the messages first, and store them later
+        if (optimistic_broadcast_enabled())
+        {
+            auto& sequencer = global_message_sequencer();
+            for (auto& msg : msgs)
+                msg.id = format_message_id(sequencer.next());
+            traced_call(evt_trace, [&] { st.aggregator().publish_messages(evt.roomId, current_user, msgs); });
+            store_broadcast_messages(ws.get_executor(), st_ptr, evt.roomId, {msgs.begin(), msgs.end()});
+            return {};
+        }
+
+        // Store it in Redis. If the server is shutting down, it waits for this to finish
+        auto drain_guard = st.drainer().start_operation();
+        auto ids_result = traced_call(evt_trace, [&] {
+            return st.redis().store_messages(evt.roomId, msgs, yield);
+        });
         if (ids_result.has_error())
             return std::move(ids_result).error();
         auto& ids = ids_result.value();
@@ -117,61 +351,483 @@ struct event_handler_visitor
         for (std::size_t i = 0; i < msgs.size(); ++i)
             msgs[i].id = std::move(ids[i]);
 
-        // Compose a server_messages event with all data we have
-        server_messages_event server_evt{evt.roomId, current_user, msgs};
-
-        // Broadcast the event to all clients
-        st.pubsub().publish(evt.roomId, server_evt.to_json());
+        // Broadcast the messages to all clients, as a serverMessages event
+        traced_call(evt_trace, [&] { st.aggregator().publish_messages(evt.roomId, current_user, msgs); });
         return {};
     }
 
     // Request room history event
     error_with_message operator()(chat::request_room_history_event& evt) const
     {
-        // Get room history
-        room_history_service svc(st.redis(), st.mysql());
-        auto history = svc.get_room_history(evt.roomId, yield);
-        if (history.has_error())
-            return std::move(history).error();
-
-        // Compose a room_history event
-        chat::room_history_event response_evt{evt.roomId, history->first, history->second};
-        auto payload = response_evt.to_json();
+        if (!contains_room(joined_rooms, evt.roomId))
+            return error_with_message{errc::not_room_member};
+
+        // Get room history. If the client sent a message ID, we only retrieve older messages
+        std::optional<std::string_view> first_message_id;
+        if (!evt.firstMessageId.empty())
+            first_message_id = evt.firstMessageId;
+        // The response is composed directly from the database response
+        auto payload = [&] {
+            trace_span span(evt_trace, "history.load");
+            room_history_service svc(st.redis(), st.mysql(), &st.history_cache());
+            return svc.get_room_history_event(evt.roomId, first_message_id, yield);
+        }();
+        if (payload.has_error())
+            return std::move(payload).error();
 
         // Send it
-        chat::error_code ec;
-        ws.write(payload, yield[ec]);
-        return {ec};
+        return {write_response(*payload)};
+    }
+
+    // Join room event
+    error_with_message operator()(join_room_event& evt) const
+    {
+        // Joining a room twice just sends the room again
+        auto it = std::find_if(joined_rooms.begin(), joined_rooms.end(), [&evt](const room& r) {
+            return r.id == evt.roomId;
+        });
+        room joined;
+        if (it != joined_rooms.end())
+        {
+            joined = room{it->id, it->name, {}};
+        }
+        else
+        {
+            // Store the membership. Fails with errc::not_found if the room doesn't exist
+            auto room_result = traced_call(evt_trace, [&] {
+                return st.mysql().join_room(current_user.id, evt.roomId, yield);
+            });
+            if (room_result.has_error())
+                return std::move(room_result).error();
+
+            // Subscribe before retrieving history, so no message is missed. Messages
+            // for the room may reach the client before the roomJoined event
+            joined = std::move(room_result.value());
+            std::string_view topic_ids[] = {joined.id};
+            st.pubsub().subscribe(subscriber, topic_ids);
+            joined_rooms.push_back(room{joined.id, joined.name, {}});
+        }
+
+        // Retrieve history, unless the client loads it lazily
+        username_map usernames;
+        if (lazy_history)
+        {
+            joined.history.has_more = true;
+        }
+        else
+        {
+            trace_span span(evt_trace, "history.load");
+            room_history_service svc(st.redis(), st.mysql(), &st.history_cache());
+            auto history = svc.get_room_history(joined.id, std::nullopt, yield);
+            if (history.has_error())
+                return std::move(history).error();
+            joined.history = std::move(history->first);
+            usernames = std::move(history->second);
+        }
+
+        // Send the response
+        std::string payload;
+        {
+            trace_span span(evt_trace, "serialize");
+            payload = room_joined_event{joined, usernames}.to_json();
+        }
+        return {write_response(payload)};
+    }
+
+    // Activity event (typing, presence, read receipts). These are ephemeral:
+    // they're broadcast, but never stored, so they don't wait for Redis
+    error_with_message operator()(client_activity_event& evt) const
+    {
+        if (!contains_room(joined_rooms, evt.roomId))
+            return error_with_message{errc::not_room_member};
+
+        std::string payload;
+        {
+            trace_span span(evt_trace, "serialize");
+            payload = server_activity_event{evt.roomId, current_user, evt.kind, evt.messageId}.to_json();
+        }
+
+        // Each user only has a state of each kind in a room, so more recent events
+        // replace older ones that haven't been delivered yet
+        auto coalesce_key = std::to_string(current_user.id);
+        coalesce_key += ':';
+        coalesce_key += to_string(evt.kind);
+        st.pubsub().publish_ephemeral(evt.roomId, coalesce_key, std::move(payload));
+        return {};
+    }
+
+    // Search room event. Served from the in-memory index, so only recent messages are found
+    error_with_message operator()(search_room_event& evt) const
+    {
+        if (!contains_room(joined_rooms, evt.roomId))
+            return error_with_message{errc::not_room_member};
+
+        static const std::size_t max_results = get_env_size("SEARCH_MAX_RESULTS", 50u);
+        std::vector<message> results;
+        if (auto* index = st.search_index())
+        {
+            trace_span span(evt_trace, "search");
+            results = index->search(evt.roomId, evt.query, max_results, yield);
+        }
+
+        // Look up usernames
+        std::vector<std::int64_t> user_ids;
+        for (const auto& msg : results)
+            user_ids.push_back(msg.user_id);
+        std::sort(user_ids.begin(), user_ids.end());
+        user_ids.erase(std::unique(user_ids.begin(), user_ids.end()), user_ids.end());
+        username_map usernames;
+        if (!user_ids.empty())
+        {
+            auto usernames_result = traced_call(evt_trace, [&] {
+                return st.mysql().get_usernames(user_ids, yield);
+            });
+            if (usernames_result.has_error())
+                return std::move(usernames_result).error();
+            usernames = std::move(*usernames_result);
+        }
+
+        // Send the response
+        std::string payload;
+        {
+            trace_span span(evt_trace, "serialize");
+            payload = room_search_results_event{evt.roomId, evt.query, results, usernames}.to_json();
+        }
+        return {write_response(payload)};
+    }
+};
+
+// The names of the traces recorded when handling each event
+struct trace_name_visitor
+{
+    std::string_view operator()(error_code) const noexcept { return "invalidEvent"; }
+    std::string_view operator()(const client_messages_event&) const noexcept { return "clientMessages"; }
+    std::string_view operator()(const request_room_history_event&) const noexcept
+    {
+        return "requestRoomHistory";
     }
+    std::string_view operator()(const join_room_event&) const noexcept { return "joinRoom"; }
+    std::string_view operator()(const client_activity_event&) const noexcept { return "clientActivity"; }
+    std::string_view operator()(const search_room_event&) const noexcept { return "searchRoom"; }
+};
+
+// Reads the overflow policy for the send queues from the environment
+static overflow_policy get_overflow_policy()
+{
+    constexpr const char* var_name = "WEBSOCKET_OVERFLOW_POLICY";
+    auto value = get_env_string(var_name, "drop_oldest");
+    if (value == "drop_oldest")
+        return overflow_policy::drop_oldest;
+    else if (value == "coalesce")
+        return overflow_policy::coalesce;
+    else if (value == "disconnect")
+        return overflow_policy::disconnect;
+    log_error(errc::invalid_config, var_name, value);
+    return overflow_policy::drop_oldest;
+}
+
+// Configuration for the per-session send queues. Read once from the environment
+struct send_queue_config
+{
+    std::size_t max_size;
+    overflow_policy policy;
 };
 
+static const send_queue_config& get_send_queue_config()
+{
+    static const send_queue_config res{get_env_size("WEBSOCKET_QUEUE_SIZE", 128u), get_overflow_policy()};
+    return res;
+}
+
+// Maximum number of events to send in a single websocket message
+static constexpr std::size_t max_batch_size = 64;
+
+// Returns whether the websocket URL has a query parameter with the given value
+static bool has_query_param(
+    const websocket::upgrade_request_type& req,
+    std::string_view key,
+    std::string_view value
+)
+{
+    auto url = boost::urls::parse_origin_form(req.target());
+    if (url.has_error())
+        return false;
+    auto params = url->params();
+    auto it = params.find(key);
+    return it != params.end() && (*it).value == value;
+}
+
+// Clients can declare that they support receiving several events in a single
+// websocket message, as a JSON array, by connecting to a URL with ?batch=1
+static bool supports_batching(const websocket::upgrade_request_type& req)
+{
+    return has_query_param(req, "batch", "1");
+}
+
+// Clients connecting with ?history=lazy get a hello event without room history,
+// and request it with requestRoomHistory events when they open a room
+static bool uses_lazy_history(const websocket::upgrade_request_type& req)
+{
+    return has_query_param(req, "history", "lazy");
+}
+
+// Clients that reconnect send the ID of the most recent message they have for each room,
+// as ?since=<room_id>:<message_id> (once per room), so the hello event only contains
+// the messages they missed. Invalid entries are ignored
+static last_seen_map get_last_seen(const websocket::upgrade_request_type& req)
+{
+    last_seen_map res;
+    auto url = boost::urls::parse_origin_form(req.target());
+    if (url.has_error())
+        return res;
+    for (auto param : url->params())
+    {
+        if (param.key != "since")
+            continue;
+
+        // Room IDs may contain colons, but message IDs can't
+        std::string_view value = param.value;
+        auto pos = value.rfind(':');
+        if (pos == std::string_view::npos || !parse_message_id(value.substr(pos + 1u)))
+            continue;
+        res[std::string(value.substr(0, pos))] = value.substr(pos + 1u);
+    }
+    return res;
+}
+
 // Messages are broadcast between sessions using the pubsub_service.
 // We must implement the message_subscriber interface to use it.
 // Each websocket session becomes a subscriber.
 // We use room IDs as topic IDs, and websocket message payloads as subscription messages.
+// Broadcast messages are placed in a bounded queue, and written to the client
+// by a single writer coroutine. A slow client thus consumes a constant amount of memory.
+// The writer only runs while there are messages to send, so idle sessions
+// don't hold a coroutine stack for it.
 class chat_websocket_session final : public message_subscriber,
+                                     public drainable,
                                      public std::enable_shared_from_this<chat_websocket_session>
 {
     websocket ws_;
     std::shared_ptr<shared_state> st_;
+    message_queue send_queue_;
+    user current_user_{};
+    client_event_parser parser_;
+
+    // Scratch memory for handling client events. Reset after each event
+    arena frame_arena_{1024u};
+
+    // Limits the messages the client can send
+    token_bucket send_budget_{get_send_rate().capacity, token_bucket::clock_type::now()};
+
+    // Did the client declare that it supports batched messages?
+    bool batch_messages_{false};
+
+    // The event being handled, converted from MessagePack to JSON, for binary sessions.
+    // Parsed events point into it, so it must outlive them
+    std::string decoded_event_;
+
+    // Did the client request a hello without room history?
+    bool lazy_history_{false};
+
+    // The rooms the user is a member of, and this session is subscribed to. Without history
+    std::vector<room> rooms_;
+
+    // The messages the client had when it connected. Only used by the first hello
+    last_seen_map last_seen_;
+
+    // Can the writer be launched? Set once the hello has been sent, and cleared when the session ends
+    bool writer_enabled_{false};
+
+    // Is the writer coroutine running?
+    bool writer_running_{false};
+
+    // Writes msg, together with any other messages waiting in the queue, as a single
+    // websocket message containing a JSON array of events (or a MessagePack array, for binary sessions).
+    // This saves system calls and network packets when there are many messages to be sent.
+    error_code write_batch(message_queue::message_type msg, boost::asio::yield_context yield)
+    {
+        // Collect the messages to send. We keep references to them until the write completes
+        std::vector<message_queue::message_type> batch{std::move(msg)};
+        while (batch.size() < max_batch_size)
+        {
+            auto next = send_queue_.try_pop();
+            if (!next)
+                break;
+            batch.push_back(std::move(next));
+        }
+
+        // A single message doesn't need to be wrapped into an array, so its frame can be used
+        if (batch.size() == 1u)
+            return ws_.write(*batch.front(), yield);
+
+        // Compose the buffers, without copying the messages: [msg1,msg2,msg3]
+        std::vector<boost::asio::const_buffer> buffers;
+        if (ws_.binary())
+        {
+            // An array header followed by the encoded messages
+            unsigned char header[max_msgpack_array_header_size]{};
+            buffers.reserve(batch.size() + 1u);
+            buffers.push_back(boost::asio::buffer(header, write_msgpack_array_header(header, batch.size())));
+            for (const auto& item : batch)
+                buffers.push_back(boost::asio::buffer(item->binary_payload()));
+            return ws_.write(buffers, yield);
+        }
+        buffers.reserve(batch.size() * 2u + 1u);
+        for (const auto& item : batch)
+        {
+            buffers.push_back(boost::asio::buffer(buffers.empty() ? "[" : ",", 1));
+            buffers.push_back(boost::asio::buffer(item->payload()));
+        }
+        buffers.push_back(boost::asio::buffer("]", 1));
+
+        // Write them all as a single message
+        return ws_.write(buffers, yield);
+    }
+
+    // Retrieves the data required for the hello event, and sends it
+    error_with_message send_hello(boost::asio::yield_context yield)
+    {
+        std::optional<latency_timer> build_timer(std::in_place, histogram_id::hello_build);
+        auto hello_data = get_hello_data(*st_, rooms_, lazy_history_, last_seen_, yield);
+
+        // Later hellos re-synchronize clients that lost messages, so they must be complete
+        last_seen_.clear();
+        if (hello_data.has_error())
+            return hello_data.error();
+        auto serialized = hello_event{current_user_, hello_data->rooms, hello_data->usernames}.to_json();
+        build_timer.reset();
+        return {write_event(ws_, serialized, yield)};
+    }
+
+    // Launches the writer if there is something to write and it's not running.
+    // Stacks are pooled, so launching a coroutine is cheap
+    void maybe_start_writer()
+    {
+        if (!writer_enabled_ || writer_running_ || !send_queue_.ready())
+            return;
+
+        // The writer holds a reference to the session, since it may outlive it
+        writer_running_ = true;
+        boost::asio::spawn(
+            ws_.get_executor(),
+            std::allocator_arg,
+            task_stack_allocator(),
+            [self = shared_from_this()](boost::asio::yield_context yield) {
+                self->write_loop(yield);
+                self->writer_running_ = false;
+            },
+            boost::asio::detached
+        );
+    }
+
+    // Writes queued messages to the client, until the queue is empty or closed, or an error happens.
+    // Messages are only popped when available, so this never waits for new messages
+    void write_loop(boost::asio::yield_context yield)
+    {
+        while (send_queue_.ready())
+        {
+            // Get the next message. This doesn't suspend, since the queue is ready.
+            // Errors are final, so no other writer is launched after them
+            auto msg = send_queue_.pop(yield);
+            if (msg.has_error())
+            {
+                writer_enabled_ = false;
+                // If the client can't keep up with the messages we send,
+                // close the connection. The read loop will exit, too.
+                // Closing writes a frame, so it must not run concurrently with other writes
+                if (msg.error() == errc::slow_consumer)
+                {
+                    log_error(msg.error(), "Closing websocket");
+                    auto guard = ws_.lock_writes(yield);
+                    ws_.close(boost::beast::websocket::try_again_later, yield);  // Ignore the result
+                }
+                return;
+            }
+
+            // A nullptr message means that messages have been discarded. Send the
+            // current state again, so the client can catch up
+            error_with_message err;
+            if (!*msg)
+            {
+                err = send_hello(yield);
+            }
+            else
+            {
+                latency_timer write_timer(histogram_id::websocket_write);
+                if (batch_messages_)
+                    err.ec = write_batch(std::move(*msg), yield);
+                else
+                    err.ec = ws_.write(**msg, yield);
+            }
+            if (err.ec)
+            {
+                // Writes fail after the session is closed because the server is draining
+                writer_enabled_ = false;
+                if (!st_->drainer().draining())
+                    log_error(err, "Writing to websocket");
+                return;
+            }
+        }
+    }
 
 public:
-    chat_websocket_session(websocket socket, std::shared_ptr<shared_state> state) noexcept
-        : ws_(std::move(socket)), st_(std::move(state))
+    chat_websocket_session(websocket socket, std::shared_ptr<shared_state> state)
+        : ws_(std::move(socket)),
+          st_(std::move(state)),
+          send_queue_(
+              ws_.get_executor(),
+              get_send_queue_config().max_size,
+              get_send_queue_config().policy
+          ),
+          batch_messages_(supports_batching(ws_.upgrade_request())),
+          lazy_history_(uses_lazy_history(ws_.upgrade_request())),
+          last_seen_(get_last_seen(ws_.upgrade_request()))
     {
     }
 
     // Subscriber callback
-    void on_message(std::string_view serialized_message, boost::asio::yield_context yield) override final
+    void on_message(std::shared_ptr<const framed_message> serialized_message) override final
+    {
+        send_queue_.push(std::move(serialized_message));
+        maybe_start_writer();
+    }
+
+    // Ephemeral messages are discarded if the client is falling behind, so they never
+    // make the queue overflow and push out regular messages
+    void on_ephemeral_message(std::shared_ptr<const framed_message> serialized_message) override final
+    {
+        if (send_queue_.size() >= (get_send_queue_config().max_size + 1u) / 2u)
+        {
+            increment_counter(counter_id::ephemeral_shed);
+            return;
+        }
+        on_message(std::move(serialized_message));
+    }
+
+    // Called when the server starts draining. Closes the session, asking the client to reconnect
+    // after the given delay, so clients don't reconnect to the remaining servers all at once
+    void on_drain(std::chrono::milliseconds reconnect_delay) override final
     {
-        ws_.write(serialized_message, yield);
+        boost::asio::spawn(
+            ws_.get_executor(),
+            std::allocator_arg,
+            task_stack_allocator(),
+            [self = shared_from_this(), reconnect_delay](boost::asio::yield_context yield) {
+                // The reason is sent as JSON, like the rest of our messages. It's at most 123 bytes long
+                auto reason = "{\"reconnectAfterMs\":" + std::to_string(reconnect_delay.count()) + "}";
+
+                // Closing writes a frame, so it must not run concurrently with other writes.
+                // The read loop exits once the client replies. Errors are ignored
+                auto guard = self->ws_.lock_writes(yield);
+                self->ws_.close(boost::beast::websocket::service_restart, reason, yield);
+            },
+            boost::asio::detached
+        );
     }
 
     // Runs the session until completion
     error_with_message run(boost::asio::yield_context yield)
     {
-        error_code ec;
-
         // Check that the user is authenticated
         auto user_result = st_->cookie_auth().user_from_cookie(ws_.upgrade_request(), yield);
         if (user_result.has_error())
@@ -184,30 +840,60 @@ public:
             ws_.close(boost::beast::websocket::policy_error, yield);  // Ignore the result
             return {};
         }
-        const auto& current_user = user_result.value();
+        current_user_ = std::move(user_result.value());
 
-        // Lock writes in the websocket. This ensures that no message is written before the hello.
-        auto write_guard = ws_.lock_writes(yield);
-
-        // Subscribe to messages for the available rooms
-        auto pubsub_guard = st_->pubsub().subscribe_guarded(shared_from_this(), room_ids);
-
-        // Retrieve the data required for the hello message
-        auto hello_data = get_hello_data(*st_, yield);
-        if (hello_data.has_error())
-            return hello_data.error();
-
-        // Compose the hello event and write it
-        hello_event hello_evt{current_user, hello_data->rooms, hello_data->usernames};
-        auto serialized_hello = hello_evt.to_json();
-        ec = ws_.write_locked(serialized_hello, write_guard, yield);
-        if (ec)
-            return {ec};
-
-        // Once the hello is sent, we can start sending messages through the websocket
-        write_guard.reset();
+        // Keep track of running sessions
+        increment_counter(counter_id::websocket_sessions_started);
+        struct session_counter
+        {
+            ~session_counter() { increment_counter(counter_id::websocket_sessions_finished); }
+        } counter_guard;
+
+        // Draining closes the session
+        auto drain_guard = st_->drainer().add(*this);
+
+        // Retrieve the rooms the user is a member of
+        auto rooms_result = st_->mysql().get_user_rooms(current_user_.id, yield);
+        if (rooms_result.has_error())
+            return std::move(rooms_result).error();
+        rooms_ = std::move(rooms_result.value());
+
+        // Subscribe to messages for these rooms. Messages are queued
+        // until the writer coroutine is launched, so none is written before the hello.
+        // Rooms joined later are subscribed to as well, and unsubscribed by the guard
+        std::vector<std::string_view> topic_ids;
+        topic_ids.reserve(rooms_.size());
+        for (const auto& r : rooms_)
+            topic_ids.push_back(r.id);
+        auto pubsub_guard = st_->pubsub().subscribe_guarded(shared_from_this(), topic_ids);
+
+        // Messages for the user (rather than for a room) reach all their sessions.
+        // The guard removes this subscription, too
+        st_->pubsub().subscribe_user(shared_from_this(), current_user_.id);
+
+        // Retrieve the data required for the hello message and send it
+        auto hello_err = send_hello(yield);
+        if (hello_err.ec)
+            return hello_err;
+
+        // Once the hello is sent, we can start sending messages through the websocket,
+        // including any that were queued while building the hello.
+        // Closing the queue makes a running writer exit
+        writer_enabled_ = true;
+        maybe_start_writer();
+        struct queue_closer
+        {
+            void operator()(chat_websocket_session* self) const noexcept
+            {
+                self->writer_enabled_ = false;
+                self->send_queue_.close();
+            }
+        };
+        std::unique_ptr<chat_websocket_session, queue_closer> queue_guard{this};
 
         // Read subsequent messages from the websocket and dispatch them
+        const std::shared_ptr<message_subscriber> self = shared_from_this();
+        auto& collector = global_trace_collector();
         while (true)
         {
             // Read a message
@@ -215,13 +901,41 @@ public:
             if (raw_msg.has_error())
                 return {raw_msg.error()};
 
-            // Deserialize it
-            auto msg = chat::parse_client_event(raw_msg.value());
+            // Binary sessions send MessagePack, which shares the JSON data model
+            std::string_view payload = raw_msg.value();
+            if (ws_.binary())
+            {
+                auto decoded = msgpack_to_json(payload);
+                if (decoded.has_error())
+                    return {decoded.error()};
+                decoded_event_ = std::move(*decoded);
+                payload = decoded_event_;
+            }
 
-            // Dispatch
-            auto err = boost::variant2::visit(event_handler_visitor{current_user, ws_, *st_, yield}, msg);
+            // Deserialize it
+            auto msg = parser_.parse(payload);
+
+            // Dispatch, tracing the event if enabled
+            trace evt_trace(boost::variant2::visit(trace_name_visitor{}, msg));
+            event_handler_visitor visitor{
+                current_user_,
+                ws_,
+                *st_,
+                st_,
+                frame_arena_,
+                self,
+                rooms_,
+                lazy_history_,
+                send_budget_,
+                collector.enabled() ? &evt_trace : nullptr,
+                yield,
+            };
+            auto err = boost::variant2::visit(visitor, msg);
+            if (collector.enabled())
+                collector.finish(evt_trace);
             if (err.ec)
                 return err;
+            frame_arena_.reset();
         }
     }
 };
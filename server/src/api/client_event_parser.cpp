@@ -0,0 +1,423 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/json/basic_parser_impl.hpp>
+#include <boost/json/error.hpp>
+#include <boost/json/parse_options.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "error.hpp"
+#include "message_id.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Parses the wire representation of an activity_kind
+std::optional<activity_kind> parse_activity_kind(std::string_view value)
+{
+    for (auto kind : {activity_kind::typing, activity_kind::presence, activity_kind::read})
+    {
+        if (value == to_string(kind))
+            return kind;
+    }
+    return std::nullopt;
+}
+
+// Handler for boost::json::basic_parser. Client events look like:
+//   {"type": "<event type>", "payload": {"roomId": "...", "messages": [{"content": "..."}], ...}}
+// Since keys may appear in any order, the handler collects all the fields that
+// any event may contain, and the event is composed once the document is complete.
+class event_handler
+{
+    // Where we are in the document
+    enum class location
+    {
+        none,      // outside the root object
+        root,      // in the root object
+        payload,   // in the payload object
+        messages,  // in the messages array
+        message,   // in an object within the messages array
+        done,      // the root object has been closed
+    };
+
+    // The key of the value we're expecting
+    enum class field
+    {
+        none,
+        type,
+        payload,
+        room_id,
+        messages,
+        first_message_id,
+        message_id,
+        kind,
+        query,
+        content,
+        unknown,  // values for unknown keys are ignored
+    };
+
+    location loc_{location::none};
+    field field_{field::none};
+
+    // If we're inside a value with an unknown key, the nesting level within that value
+    std::size_t skip_depth_{0};
+
+    // Keys and strings may be received in parts
+    std::string key_;
+    bool in_string_{false};
+
+    // Collected fields
+    std::string type_;
+    std::string room_id_;
+    std::string first_message_id_;
+    std::string message_id_;
+    std::string kind_;
+    std::string query_;
+    std::vector<client_message> messages_;
+    bool has_type_{}, has_payload_{}, has_room_id_{}, has_first_message_id_{}, has_messages_{};
+    bool has_message_id_{}, has_kind_{}, has_query_{}, has_content_{};
+
+    static bool fail(error_code& ec, error_code what = errc::websocket_parse_error)
+    {
+        ec = what;
+        return false;
+    }
+
+    // Looks up a key in the current object
+    field to_field(std::string_view key) const
+    {
+        switch (loc_)
+        {
+        case location::root:
+            if (key == "type")
+                return field::type;
+            if (key == "payload")
+                return field::payload;
+            break;
+        case location::payload:
+            if (key == "roomId")
+                return field::room_id;
+            if (key == "messages")
+                return field::messages;
+            if (key == "firstMessageId")
+                return field::first_message_id;
+            if (key == "messageId")
+                return field::message_id;
+            if (key == "kind")
+                return field::kind;
+            if (key == "query")
+                return field::query;
+            break;
+        case location::message:
+            if (key == "content")
+                return field::content;
+            break;
+        default: break;
+        }
+        return field::unknown;
+    }
+
+    // Returns the string to store the current string value into
+    std::string* string_target()
+    {
+        switch (field_)
+        {
+        case field::type: has_type_ = true; return &type_;
+        case field::room_id: has_room_id_ = true; return &room_id_;
+        case field::first_message_id: has_first_message_id_ = true; return &first_message_id_;
+        case field::message_id: has_message_id_ = true; return &message_id_;
+        case field::kind: has_kind_ = true; return &kind_;
+        case field::query: has_query_ = true; return &query_;
+        case field::content: has_content_ = true; return &messages_.back().content;
+        default: return nullptr;
+        }
+    }
+
+    // Handles a (possibly partial) string value
+    bool on_string_value(std::string_view s, error_code& ec)
+    {
+        if (skip_depth_ > 0u || field_ == field::unknown)
+            return true;
+        auto* target = string_target();
+        if (!target)
+            return fail(ec);
+
+        // Replace any previous value, in case of duplicate keys
+        if (!in_string_)
+            target->clear();
+        target->append(s);
+        in_string_ = true;
+        return true;
+    }
+
+    // Handles a number, boolean or null
+    bool on_scalar(error_code& ec)
+    {
+        if (skip_depth_ > 0u || field_ == field::unknown)
+            return true;
+        return fail(ec);
+    }
+
+    bool on_container_begin(bool is_object, error_code& ec)
+    {
+        // Nested values within unknown keys
+        if (skip_depth_ > 0u)
+        {
+            ++skip_depth_;
+            return true;
+        }
+        if (field_ == field::unknown)
+        {
+            skip_depth_ = 1u;
+            return true;
+        }
+
+        // Known structure
+        if (is_object && loc_ == location::none)
+        {
+            loc_ = location::root;
+        }
+        else if (is_object && field_ == field::payload)
+        {
+            loc_ = location::payload;
+            has_payload_ = true;
+        }
+        else if (!is_object && field_ == field::messages)
+        {
+            loc_ = location::messages;
+            has_messages_ = true;
+            messages_.clear();
+        }
+        else if (is_object && loc_ == location::messages)
+        {
+            loc_ = location::message;
+            messages_.emplace_back();
+            has_content_ = false;
+        }
+        else
+        {
+            return fail(ec);
+        }
+
+        field_ = field::none;
+        return true;
+    }
+
+    bool on_container_end(error_code& ec)
+    {
+        if (skip_depth_ > 0u)
+        {
+            --skip_depth_;
+            return true;
+        }
+
+        switch (loc_)
+        {
+        case location::root: loc_ = location::done; break;
+        case location::payload: loc_ = location::root; break;
+        case location::messages: loc_ = location::payload; break;
+        case location::message:
+            if (!has_content_)
+                return fail(ec, boost::json::error::size_mismatch);
+            loc_ = location::messages;
+            break;
+        default: return fail(ec);
+        }
+        field_ = field::none;
+        return true;
+    }
+
+public:
+    static constexpr std::size_t max_object_size = std::size_t(-1);
+    static constexpr std::size_t max_array_size = std::size_t(-1);
+    static constexpr std::size_t max_key_size = std::size_t(-1);
+    static constexpr std::size_t max_string_size = std::size_t(-1);
+
+    bool on_document_begin(error_code&)
+    {
+        // Reset any state from previous messages. Buffers keep their capacity
+        loc_ = location::none;
+        field_ = field::none;
+        skip_depth_ = 0u;
+        key_.clear();
+        in_string_ = false;
+        type_.clear();
+        room_id_.clear();
+        first_message_id_.clear();
+        message_id_.clear();
+        kind_.clear();
+        query_.clear();
+        messages_.clear();
+        has_type_ = has_payload_ = has_room_id_ = has_first_message_id_ = has_messages_ = false;
+        has_message_id_ = has_kind_ = has_query_ = false;
+        return true;
+    }
+
+    bool on_document_end(error_code&) { return true; }
+    bool on_object_begin(error_code& ec) { return on_container_begin(true, ec); }
+    bool on_object_end(std::size_t, error_code& ec) { return on_container_end(ec); }
+    bool on_array_begin(error_code& ec) { return on_container_begin(false, ec); }
+    bool on_array_end(std::size_t, error_code& ec) { return on_container_end(ec); }
+
+    bool on_key_part(boost::json::string_view s, std::size_t, error_code&)
+    {
+        if (skip_depth_ == 0u)
+            key_.append(s.data(), s.size());
+        return true;
+    }
+
+    bool on_key(boost::json::string_view s, std::size_t, error_code& ec)
+    {
+        if (skip_depth_ > 0u)
+            return true;
+
+        // Keys are only valid in objects. Arrays of objects are handled by on_container_begin
+        if (loc_ == location::messages)
+            return fail(ec);
+
+        key_.append(s.data(), s.size());
+        field_ = to_field(key_);
+        key_.clear();
+        return true;
+    }
+
+    bool on_string_part(boost::json::string_view s, std::size_t, error_code& ec)
+    {
+        return on_string_value({s.data(), s.size()}, ec);
+    }
+
+    bool on_string(boost::json::string_view s, std::size_t, error_code& ec)
+    {
+        if (!on_string_value({s.data(), s.size()}, ec))
+            return false;
+        in_string_ = false;
+        if (skip_depth_ == 0u)
+        {
+            // Strings within the messages array are not valid messages
+            if (loc_ == location::messages && field_ != field::unknown)
+                return fail(ec);
+            field_ = field::none;
+        }
+        return true;
+    }
+
+    bool on_number_part(boost::json::string_view, error_code&) { return true; }
+    bool on_int64(std::int64_t, boost::json::string_view, error_code& ec) { return on_scalar(ec); }
+    bool on_uint64(std::uint64_t, boost::json::string_view, error_code& ec) { return on_scalar(ec); }
+    bool on_double(double, boost::json::string_view, error_code& ec) { return on_scalar(ec); }
+    bool on_bool(bool, error_code& ec) { return on_scalar(ec); }
+    bool on_null(error_code& ec) { return on_scalar(ec); }
+    bool on_comment_part(boost::json::string_view, error_code&) { return true; }
+    bool on_comment(boost::json::string_view, error_code&) { return true; }
+
+    // Composes the event, once the document has been parsed successfully
+    any_client_event get_event()
+    {
+        if (!has_type_ || !has_payload_)
+            CHAT_RETURN_ERROR(errc::websocket_parse_error)
+
+        if (type_ == "clientMessages")
+        {
+            if (!has_room_id_ || !has_messages_)
+                CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+            return client_messages_event{std::move(room_id_), std::move(messages_)};
+        }
+        else if (type_ == "requestRoomHistory")
+        {
+            if (!has_room_id_ || !has_first_message_id_)
+                CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+
+            // The message ID is used as a pagination cursor, so it must be valid
+            if (!first_message_id_.empty() && !parse_message_id(first_message_id_))
+                CHAT_RETURN_ERROR(errc::websocket_parse_error)
+            return request_room_history_event{std::move(room_id_), std::move(first_message_id_)};
+        }
+        else if (type_ == "joinRoom")
+        {
+            if (!has_room_id_)
+                CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+            if (room_id_.empty())
+                CHAT_RETURN_ERROR(errc::websocket_parse_error)
+            return join_room_event{std::move(room_id_)};
+        }
+        else if (type_ == "clientActivity")
+        {
+            if (!has_room_id_ || !has_kind_)
+                CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+            auto kind = parse_activity_kind(kind_);
+            if (!kind)
+                CHAT_RETURN_ERROR(errc::websocket_parse_error)
+
+            // Read receipts point to a message, which must be valid. Other kinds don't
+            if (*kind == activity_kind::read)
+            {
+                if (!has_message_id_)
+                    CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+                if (!parse_message_id(message_id_))
+                    CHAT_RETURN_ERROR(errc::websocket_parse_error)
+            }
+            else
+            {
+                message_id_.clear();
+            }
+            return client_activity_event{std::move(room_id_), *kind, std::move(message_id_)};
+        }
+        else if (type_ == "searchRoom")
+        {
+            if (!has_room_id_ || !has_query_)
+                CHAT_RETURN_ERROR(boost::json::error::size_mismatch)
+            return search_room_event{std::move(room_id_), std::move(query_)};
+        }
+        else
+        {
+            // Unknown type
+            CHAT_RETURN_ERROR(errc::websocket_parse_error)
+        }
+    }
+};
+
+}  // namespace
+
+struct client_event_parser::impl
+{
+    boost::json::basic_parser<event_handler> parser{boost::json::parse_options()};
+};
+
+client_event_parser::client_event_parser() : impl_(new impl) {}
+
+client_event_parser::client_event_parser(client_event_parser&&) noexcept = default;
+
+client_event_parser& client_event_parser::operator=(client_event_parser&&) noexcept = default;
+
+client_event_parser::~client_event_parser() {}
+
+any_client_event client_event_parser::parse(std::string_view from)
+{
+    auto& parser = impl_->parser;
+
+    // Run the parser over the entire message
+    error_code ec;
+    parser.reset();
+    auto bytes_parsed = parser.write_some(false, from.data(), from.size(), ec);
+    if (ec)
+        CHAT_RETURN_ERROR(ec)
+    if (bytes_parsed != from.size())
+        CHAT_RETURN_ERROR(boost::json::error::extra_data)
+
+    // Compose the event
+    return parser.handler().get_event();
+}
@@ -0,0 +1,251 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "api/metrics.hpp"
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "request_context.hpp"
+#include "services/drain_controller.hpp"
+#include "services/message_spool.hpp"
+#include "services/mysql_client.hpp"
+#include "services/search_index.hpp"
+#include "services/startup.hpp"
+#include "shared_state.hpp"
+#include "util/bounded_thread_pool.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+#include "util/tracing.hpp"
+
+using namespace chat;
+
+// The content type defined by the Prometheus text exposition format
+static constexpr std::string_view metrics_content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+// Monitoring endpoints are enabled by default
+static bool monitoring_enabled()
+{
+    static const bool res = get_env_bool("METRICS_ENABLED", true);
+    return res;
+}
+
+// Whether load balancers should send traffic to us: once the schema has been set up
+// and the caches have been warmed up, and until we start draining
+static bool accepting_traffic(shared_state& st) { return st.startup().ready() && !st.drainer().draining(); }
+
+namespace {
+
+// The MySQL connection pools, as exported in the "pool" label
+struct mysql_pool_info
+{
+    mysql_pool_kind kind;
+    std::string_view label;
+};
+
+}  // namespace
+
+static constexpr mysql_pool_info mysql_pools[] = {
+    {mysql_pool_kind::read,    "read"   },
+    {mysql_pool_kind::write,   "write"  },
+    {mysql_pool_kind::replica, "replica"},
+};
+
+// Serializes a metric with a sample for each connection pool. Each shard has its own pools,
+// so values are added across shards
+template <class Fn>
+static void format_mysql_pool_metric(
+    std::string& to,
+    const std::array<mysql_pool_stats, std::size(mysql_pools)>& stats,
+    std::string_view name,
+    std::string_view type,
+    std::string_view help,
+    Fn get_value
+)
+{
+    to += "# HELP ";
+    to += name;
+    to += ' ';
+    to += help;
+    to += "\n# TYPE ";
+    to += name;
+    to += ' ';
+    to += type;
+    to += '\n';
+    for (std::size_t i = 0; i < std::size(mysql_pools); ++i)
+    {
+        // The replica pool only exists if a replica has been configured
+        if (stats[i].max_size == 0u)
+            continue;
+        to += name;
+        to += "{pool=\"";
+        to += mysql_pools[i].label;
+        to += "\"} ";
+        to += std::to_string(get_value(stats[i]));
+        to += '\n';
+    }
+}
+
+response_builder::response_type chat::handle_metrics(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context
+)
+{
+    if (!monitoring_enabled())
+        return ctx.response().not_found_text();
+
+    // Process-wide metrics
+    auto res = format_metrics();
+
+    // The password hashing pool is shared by all threads
+    auto pool_stats = st.hashing_pool().stats();
+    res += "# HELP chat_hashing_pool_pending Password hashing tasks running or waiting to run\n";
+    res += "# TYPE chat_hashing_pool_pending gauge\n";
+    res += "chat_hashing_pool_pending " + std::to_string(pool_stats.pending) + '\n';
+    res += "# HELP chat_hashing_pool_rejected_total Password hashing tasks rejected by a full pool\n";
+    res += "# TYPE chat_hashing_pool_rejected_total counter\n";
+    res += "chat_hashing_pool_rejected_total " + std::to_string(pool_stats.rejected) + '\n';
+
+    // So is the message spool, if enabled
+    if (const auto* spool = st.spool())
+    {
+        auto spool_stats = spool->stats();
+        double lag = static_cast<double>(spool_stats.lag.count()) / 1000.0;
+        res += "# HELP chat_redis_spool_depth Messages waiting in the spool to be stored in Redis\n";
+        res += "# TYPE chat_redis_spool_depth gauge\n";
+        res += "chat_redis_spool_depth " + std::to_string(spool_stats.depth) + '\n';
+        res += "# HELP chat_redis_spool_bytes Bytes used by the spool\n";
+        res += "# TYPE chat_redis_spool_bytes gauge\n";
+        res += "chat_redis_spool_bytes " + std::to_string(spool_stats.used_bytes) + '\n';
+        res += "# HELP chat_redis_spool_capacity_bytes Bytes the spool can hold\n";
+        res += "# TYPE chat_redis_spool_capacity_bytes gauge\n";
+        res += "chat_redis_spool_capacity_bytes " + std::to_string(spool_stats.capacity_bytes) + '\n';
+        res += "# HELP chat_redis_spool_lag_seconds Age of the oldest message in the spool\n";
+        res += "# TYPE chat_redis_spool_lag_seconds gauge\n";
+        res += "chat_redis_spool_lag_seconds " + std::to_string(lag) + '\n';
+    }
+
+    // And the search index
+    if (const auto* index = st.search_index())
+    {
+        res += "# HELP chat_search_index_rooms Rooms in the search index\n";
+        res += "# TYPE chat_search_index_rooms gauge\n";
+        res += "chat_search_index_rooms " + std::to_string(index->num_rooms()) + '\n';
+        res += "# HELP chat_search_index_bytes Approximate memory used by the search index\n";
+        res += "# TYPE chat_search_index_bytes gauge\n";
+        res += "chat_search_index_bytes " + std::to_string(index->memory_usage()) + '\n';
+    }
+
+    // MySQL connection pools
+    std::array<mysql_pool_stats, std::size(mysql_pools)> mysql_stats;
+    for (std::size_t i = 0; i < std::size(mysql_pools); ++i)
+        mysql_stats[i] = get_mysql_pool_stats(mysql_pools[i].kind);
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_max_connections",
+        "gauge",
+        "Connections the MySQL pools may open",
+        [](const mysql_pool_stats& s) { return s.max_size; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_connections_in_use",
+        "gauge",
+        "MySQL connections currently checked out",
+        [](const mysql_pool_stats& s) { return s.in_use; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_idle_connections",
+        "gauge",
+        "MySQL connections opened by the pools and not checked out",
+        [](const mysql_pool_stats& s) { return s.peak_in_use - s.in_use; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_checkouts_total",
+        "counter",
+        "Connections obtained from the MySQL pools",
+        [](const mysql_pool_stats& s) { return s.checkouts; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_checkout_errors_total",
+        "counter",
+        "Failed attempts to get a connection from the MySQL pools",
+        [](const mysql_pool_stats& s) { return s.checkout_errors; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_wait_seconds_total",
+        "counter",
+        "Time spent waiting for MySQL connections to become available",
+        [](const mysql_pool_stats& s) { return static_cast<double>(s.total_wait.count()) / 1e6; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_max_wait_seconds",
+        "gauge",
+        "Longest wait for a MySQL connection",
+        [](const mysql_pool_stats& s) { return static_cast<double>(s.max_wait.count()) / 1e6; }
+    );
+    format_mysql_pool_metric(
+        res,
+        mysql_stats,
+        "chat_mysql_pool_resets_total",
+        "counter",
+        "MySQL connections returned to the pools with a reset, which costs a round trip",
+        [](const mysql_pool_stats& s) { return s.resets; }
+    );
+
+    // Startup time, so slow starts can be spotted
+    auto startup_s = static_cast<double>(st.startup().startup_time().count()) / 1000.0;
+    res += "# HELP chat_ready Whether the server is accepting traffic, as reported by /api/ready\n";
+    res += "# TYPE chat_ready gauge\n";
+    res += std::string("chat_ready ") + (accepting_traffic(st) ? "1" : "0") + '\n';
+    res += "# HELP chat_startup_seconds Time it took the server to start up, or zero if it's starting\n";
+    res += "# TYPE chat_startup_seconds gauge\n";
+    res += "chat_startup_seconds " + std::to_string(startup_s) + '\n';
+
+    return ctx.response().text_response(std::move(res), metrics_content_type);
+}
+
+response_builder::response_type chat::handle_traces(
+    request_context& ctx,
+    shared_state&,
+    boost::asio::yield_context
+)
+{
+    if (!monitoring_enabled())
+        return ctx.response().not_found_text();
+
+    auto records = global_trace_collector().records();
+    return ctx.response().text_response(format_traces(records), "application/json");
+}
+
+response_builder::response_type chat::handle_ready(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context
+)
+{
+    if (!accepting_traffic(st))
+        return ctx.response().service_unavailable_text();
+    return ctx.response().text_response("Ready", "text/plain");
+}
@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "api/routes.hpp"
+
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/url/segments_encoded_view.hpp>
+
+#include <cassert>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include "api/auth.hpp"
+#include "api/metrics.hpp"
+#include "api/uploads.hpp"
+#include "request_context.hpp"
+#include "services/startup.hpp"
+#include "shared_state.hpp"
+
+namespace http = boost::beast::http;
+using namespace chat;
+
+// Adapts a handler for a route without parameters to api_handler
+using plain_handler = response_builder::response_type (*)(
+    request_context&,
+    shared_state&,
+    boost::asio::yield_context
+);
+template <plain_handler Handler>
+static response_builder::response_type without_param(
+    request_context& ctx,
+    shared_state& st,
+    std::string_view,
+    boost::asio::yield_context yield
+)
+{
+    return Handler(ctx, st, yield);
+}
+
+// The API endpoints. There are few of them, so a linear search is faster than anything fancier
+static constexpr api_route routes[] = {
+    // path             param  method               requires_db  handler
+    {"create-account",  false, http::verb::post,    true,  &without_param<handle_create_account> },
+    {"import-accounts", false, http::verb::post,    true,  &without_param<handle_import_accounts>},
+    {"login",           false, http::verb::post,    true,  &without_param<handle_login>          },
+    {"logout",          false, http::verb::post,    true,  &without_param<handle_logout>         },
+    {"uploads",         false, http::verb::post,    true,  &without_param<handle_create_upload>  },
+    {"uploads",         true,  http::verb::unknown, true,  &handle_upload                        },
+    {"metrics",         false, http::verb::get,     false, &without_param<handle_metrics>        },
+    {"traces",          false, http::verb::get,     false, &without_param<handle_traces>         },
+    {"ready",           false, http::verb::get,     false, &without_param<handle_ready>          },
+};
+
+// Middleware runs, in order, for requests that matched a route and method.
+// It either returns a response, which is sent instead of running the handler,
+// or an empty optional, to let the request through
+using api_middleware = std::optional<response_builder::response_type> (*)(
+    request_context& ctx,
+    shared_state& st,
+    const api_route& route
+);
+
+static std::optional<response_builder::response_type> require_db_ready(
+    request_context& ctx,
+    shared_state& st,
+    const api_route& route
+)
+{
+    if (route.requires_db && !st.startup().db_ready())
+        return ctx.response().service_unavailable_text();
+    return std::nullopt;
+}
+
+static constexpr api_middleware middleware[] = {
+    &require_db_ready,
+};
+
+static std::string_view to_string_view(boost::urls::pct_string_view value) noexcept
+{
+    return {value.data(), value.size()};
+}
+
+// Requests with bodies that may not fit in memory
+static constexpr std::string_view uploads_prefix = "/api/uploads/";
+static constexpr std::string_view import_accounts_path = "/api/import-accounts";
+
+bool chat::streams_request_body(http::verb method, std::string_view target) noexcept
+{
+    // File contents, sent by PATCH /api/uploads/<id>
+    if (method == http::verb::patch)
+        return target.substr(0, uploads_prefix.size()) == uploads_prefix;
+
+    // Accounts, one per line, sent by POST /api/import-accounts
+    if (method == http::verb::post)
+        return target.substr(0, target.find('?')) == import_accounts_path;
+
+    return false;
+}
+
+api_route_match chat::match_api_route(boost::urls::segments_encoded_view segs, http::verb method) noexcept
+{
+    assert(!segs.empty() && to_string_view(segs.front()) == "api");
+    api_route_match res{nullptr, false, {}};
+
+    // Paths look like /api/<path> or /api/<path>/<param>
+    auto num_segs = segs.size();
+    if (num_segs != 2u && num_segs != 3u)
+        return res;
+    auto it = std::next(segs.begin());
+    auto path = to_string_view(*it);
+    bool has_param = num_segs == 3u;
+
+    // A path may have several routes, with different methods
+    for (const auto& route : routes)
+    {
+        if (route.path != path || route.has_param != has_param)
+            continue;
+        res.route = &route;
+        res.param = has_param ? to_string_view(*std::next(it)) : std::string_view();
+        if (route.method == http::verb::unknown || route.method == method)
+        {
+            res.method_allowed = true;
+            return res;
+        }
+    }
+    return res;
+}
+
+response_builder::response_type chat::handle_api_request(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+)
+{
+    auto match = match_api_route(ctx.request_target().encoded_segments(), ctx.request_method());
+    if (!match.route)
+        return ctx.response().not_found_text();
+    if (!match.method_allowed)
+        return ctx.response().method_not_allowed();
+
+    for (auto fn : middleware)
+    {
+        auto res = fn(ctx, st, *match.route);
+        if (res)
+            return std::move(*res);
+    }
+    return match.route->handler(ctx, st, match.param, yield);
+}
@@ -0,0 +1,247 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "api/uploads.hpp"
+
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/core/span.hpp>
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "error.hpp"
+#include "request_context.hpp"
+#include "services/cookie_auth_service.hpp"
+#include "services/upload_store.hpp"
+#include "shared_state.hpp"
+#include "util/metrics.hpp"
+
+using namespace chat;
+namespace http = boost::beast::http;
+
+static constexpr std::string_view uploads_prefix = "/api/uploads/";
+static constexpr std::string_view default_content_type = "application/octet-stream";
+
+// Content types that can be safely displayed by browsers. Other uploads are downloaded as
+// attachments, so an uploaded HTML or SVG file can't run scripts in our origin
+static constexpr std::string_view inline_content_types[] = {
+    "image/png",
+    "image/jpeg",
+    "image/gif",
+    "image/webp",
+};
+
+// Parses a non-negative integer header. Returns false if it's missing or malformed
+static bool parse_size_header(std::string_view value, std::uint64_t& to)
+{
+    auto res = std::from_chars(value.data(), value.data() + value.size(), to);
+    return !value.empty() && res.ec == std::errc{} && res.ptr == value.data() + value.size();
+}
+
+static bool is_inline_content_type(std::string_view value)
+{
+    for (auto t : inline_content_types)
+    {
+        if (boost::beast::iequals(value, t))
+            return true;
+    }
+    return false;
+}
+
+response_builder::response_type chat::handle_create_upload(
+    request_context& ctx,
+    shared_state& st,
+    boost::asio::yield_context yield
+)
+{
+    auto* store = global_upload_store();
+    if (!store)
+        return ctx.response().not_found_text();
+
+    // Check that the user is authenticated
+    auto user_result = st.cookie_auth().user_id_from_cookie(ctx.request_headers(), yield);
+    if (user_result.has_error())
+    {
+        if (user_result.error().ec == errc::requires_auth)
+            return ctx.response().unauthorized_text();
+        return ctx.response().internal_server_error(user_result.error());
+    }
+
+    // Validate params
+    std::uint64_t size = 0u;
+    if (!parse_size_header(ctx.request_header("Upload-Length"), size) || size == 0u)
+        return ctx.response().bad_request_text("Upload-Length: invalid value");
+    if (size > store->max_size())
+        return ctx.response().payload_too_large_text();
+    auto content_type = ctx.request_header("Upload-Content-Type");
+    if (content_type.empty())
+        content_type = default_content_type;
+    if (!is_valid_upload_content_type(content_type))
+        return ctx.response().bad_request_text("Upload-Content-Type: invalid value");
+
+    // Create it
+    auto id = store->create(*user_result, size, content_type);
+    if (id.has_error() && id.error() == errc::too_many_uploads)
+        return ctx.response().conflict_text("Too many incomplete uploads");
+    if (id.has_error())
+        return ctx.response().internal_server_error(id.error(), "Creating upload");
+
+    std::string location(uploads_prefix);
+    location += *id;
+    ctx.response().set_header("Upload-Offset", "0");
+    return ctx.response().created(location);
+}
+
+// Appends the request body to an upload. The upload file is written before reading
+// more data from the socket, so a client that sends data faster than we can write it
+// is slowed down by TCP flow control, rather than having data buffered in memory
+static response_builder::response_type append_to_upload(
+    request_context& ctx,
+    upload_store& store,
+    std::int64_t user_id,
+    std::string_view id,
+    boost::asio::yield_context yield
+)
+{
+    // Only the creator of an upload can append to it. To other users, it looks like it doesn't exist
+    auto info = store.get(id);
+    if (info.has_error() && info.error() == errc::not_found)
+        return ctx.response().not_found_text();
+    if (info.has_error())
+        return ctx.response().internal_server_error(info.error(), "Retrieving upload");
+    if (info->user_id != user_id)
+        return ctx.response().not_found_text();
+    if (info->complete())
+        return ctx.response().conflict_text("Upload complete");
+
+    // Lock the upload
+    auto writer_result = store.open_writer(id);
+    if (writer_result.has_error())
+    {
+        auto ec = writer_result.error();
+        if (ec == errc::upload_in_progress)
+            return ctx.response().conflict_text("Upload in progress");
+        if (ec == errc::not_found)
+            return ctx.response().conflict_text("Upload complete");
+        return ctx.response().internal_server_error(ec, "Opening upload");
+    }
+    auto& writer = *writer_result;
+
+    // Clients must resume from where we are
+    std::uint64_t offset = 0u;
+    if (!parse_size_header(ctx.request_header("Upload-Offset"), offset))
+        return ctx.response().bad_request_text("Upload-Offset: invalid value");
+    ctx.response().set_header("Upload-Offset", std::to_string(writer.offset()));
+    if (offset != writer.offset())
+        return ctx.response().conflict_text("Upload-Offset doesn't match");
+
+    // Reject bodies that don't fit, if we know their size in advance
+    std::uint64_t body_size = 0u;
+    if (parse_size_header(ctx.request_header(http::field::content_length), body_size) &&
+        body_size > writer.size() - writer.offset())
+    {
+        return ctx.response().payload_too_large_text();
+    }
+
+    // Stream the body to the file. Coroutine stacks are small, so the buffer is allocated in the heap
+    constexpr std::size_t chunk_size = 64u * 1024u;
+    std::vector<char> buff(chunk_size);
+    while (true)
+    {
+        auto bytes_read = ctx.read_body_some(buff, yield);
+        if (bytes_read.has_error())
+        {
+            // The client went away. What we've written so far is kept, so it can resume
+            log_error(bytes_read.error(), "Reading upload body");
+            return ctx.response().bad_request_text("Error reading body");
+        }
+        if (*bytes_read == 0u)
+            break;
+        if (*bytes_read > writer.size() - writer.offset())
+            return ctx.response().payload_too_large_text();
+        auto ec = writer.write({buff.data(), *bytes_read});
+        if (ec)
+            return ctx.response().internal_server_error(ec, "Writing upload");
+        increment_counter(counter_id::upload_bytes, *bytes_read);
+    }
+
+    if (writer.offset() == writer.size())
+        increment_counter(counter_id::uploads_completed);
+    ctx.response().set_header("Upload-Offset", std::to_string(writer.offset()));
+    return ctx.response().empty_response();
+}
+
+response_builder::response_type chat::handle_upload(
+    request_context& ctx,
+    shared_state& st,
+    std::string_view upload_id,
+    boost::asio::yield_context yield
+)
+{
+    auto* store = global_upload_store();
+    if (!store || !is_upload_id(upload_id))
+        return ctx.response().not_found_text();
+
+    // Check that the user is authenticated
+    auto user_result = st.cookie_auth().user_id_from_cookie(ctx.request_headers(), yield);
+    if (user_result.has_error())
+    {
+        if (user_result.error().ec == errc::requires_auth)
+            return ctx.response().unauthorized_text();
+        return ctx.response().internal_server_error(user_result.error());
+    }
+
+    auto method = ctx.request_method();
+    if (method == http::verb::patch)
+    {
+        return append_to_upload(ctx, *store, *user_result, upload_id, yield);
+    }
+    else if (method == http::verb::head)
+    {
+        // The state of the upload, so it can be resumed
+        auto info = store->get(upload_id);
+        if (info.has_error() && info.error() == errc::not_found)
+            return ctx.response().not_found_text();
+        if (info.has_error())
+            return ctx.response().internal_server_error(info.error(), "Retrieving upload");
+        ctx.response().set_header("Upload-Offset", std::to_string(info->offset));
+        ctx.response().set_header("Upload-Length", std::to_string(info->size));
+        return ctx.response().empty_response();
+    }
+    else if (method == http::verb::get)
+    {
+        // Download it. Only complete uploads can be downloaded
+        auto info = store->get(upload_id);
+        if (info.has_error() && info.error() == errc::not_found)
+            return ctx.response().not_found_text();
+        if (info.has_error())
+            return ctx.response().internal_server_error(info.error(), "Retrieving upload");
+        if (!info->complete())
+            return ctx.response().not_found_text();
+        ctx.response().set_header("X-Content-Type-Options", "nosniff");
+        if (!is_inline_content_type(info->content_type))
+            ctx.response().set_header("Content-Disposition", "attachment");
+        auto path = store->data_path(upload_id);
+        return ctx.response().file_response(
+            path.c_str(),
+            false,
+            ctx.request_header(http::field::range),
+            info->content_type
+        );
+    }
+    else
+    {
+        return ctx.response().method_not_allowed();
+    }
+}
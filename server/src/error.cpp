@@ -11,9 +11,11 @@
 #include <boost/describe/enum_to_string.hpp>
 #include <boost/system/system_error.hpp>
 
-#include <iostream>
+#include <sstream>
 #include <string_view>
 
+#include "util/log.hpp"
+
 namespace chat {
 
 // Adds Boost.Describe metadata to errc. Required for describe::enum_to_string
@@ -30,7 +32,19 @@ BOOST_DESCRIBE_ENUM(
     requires_auth,
     invalid_base64,
     uncaught_exception,
-    invalid_content_type
+    invalid_content_type,
+    queue_full,
+    invalid_config,
+    slow_consumer,
+    not_room_member,
+    hpack_decode_error,
+    http2_protocol_error,
+    spool_full,
+    spool_corrupted,
+    upload_in_progress,
+    upload_corrupted,
+    snapshot_corrupted,
+    too_many_uploads
 )
 
 }  // namespace chat
@@ -67,10 +81,11 @@ void chat::log_error(error_code ec, std::string_view what, std::string_view diag
     if (ec == boost::asio::error::operation_aborted)
         return;
 
-    std::cerr << what << ": " << ec << ": " << ec.message();
+    std::ostringstream oss;
+    oss << what << ": " << ec << ": " << ec.message();
     if (ec.has_location())
-        std::cerr << " (" << ec.location() << ")";
+        oss << " (" << ec.location() << ")";
     if (!diagnostics.empty())
-        std::cerr << "\nDiagnostics: " << diagnostics;
-    std::cerr << '\n';
+        oss << "\nDiagnostics: " << diagnostics;
+    log_message(log_level::error, oss.str());
 }
\ No newline at end of file
@@ -0,0 +1,410 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "http2_session.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/cancel_after.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/message_generator.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "error.hpp"
+#include "http_session.hpp"
+#include "services/drain_controller.hpp"
+#include "shared_state.hpp"
+#include "util/arena.hpp"
+#include "util/client_socket.hpp"
+#include "util/env.hpp"
+#include "util/http2_connection.hpp"
+#include "util/metrics.hpp"
+#include "util/sendfile.hpp"
+#include "util/stack_pool.hpp"
+
+namespace http = boost::beast::http;
+using namespace chat;
+
+namespace {
+
+// Connections without streams in progress are closed after this time
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
+// Writing a chunk of frames must complete within this time
+constexpr auto write_timeout = std::chrono::seconds(30);
+
+// Frames are written in chunks of this size approximately. Streams are interleaved within a chunk
+constexpr std::size_t write_chunk_size = 64u * 1024u;
+
+// What we accept from clients. The body limit matches the one for HTTP/1.1
+const http2_connection::config& get_connection_config()
+{
+    static const http2_connection::config res{
+        static_cast<std::uint32_t>(get_env_size("HTTP2_MAX_CONCURRENT_STREAMS", 100u)),
+        16384u,
+        10000u,
+    };
+    return res;
+}
+
+// Connection-specific headers can't be sent over HTTP/2
+bool is_connection_specific_header(http::field f) noexcept
+{
+    return f == http::field::connection || f == http::field::keep_alive ||
+           f == http::field::proxy_connection || f == http::field::transfer_encoding ||
+           f == http::field::upgrade;
+}
+
+// Translates a request to the HTTP/1.1 message our handlers understand.
+// The request headers have already been validated by http2_connection
+http::request<http::string_body> to_http1_request(http2_request&& req)
+{
+    http::request<http::string_body> res;
+    res.version(11);
+
+    // Cookies may be split into several fields (RFC 9113, section 8.2.3), but HTTP/1.1 requires a single one
+    std::string cookies;
+
+    for (auto& h : req.headers)
+    {
+        if (h.name == ":method")
+            res.method_string(h.value);
+        else if (h.name == ":path")
+            res.target(h.value);
+        else if (h.name == ":authority" || h.name == "host")
+        {
+            if (res.find(http::field::host) == res.end())
+                res.set(http::field::host, h.value);
+        }
+        else if (h.name == "cookie")
+        {
+            if (!cookies.empty())
+                cookies += "; ";
+            cookies += h.value;
+        }
+        else if (h.name[0] != ':')
+            res.insert(h.name, h.value);
+    }
+    if (!cookies.empty())
+        res.set(http::field::cookie, cookies);
+
+    res.body() = std::move(req.body);
+    res.prepare_payload();
+    return res;
+}
+
+// Translates a response generated by our handlers. These are type-erased HTTP/1.1 messages,
+// so they are serialized and parsed again. This is cheap compared to generating them.
+// If skip_body is true, only the headers are used
+error_code to_http2_response(http::message_generator& msg, bool skip_body, http2_response& res)
+{
+    error_code ec;
+
+    // Serialize the message
+    std::string serialized;
+    while (!msg.is_done())
+    {
+        auto bufs = msg.prepare(ec);
+        if (ec)
+            return ec;
+        auto size = boost::asio::buffer_size(bufs);
+        auto offset = serialized.size();
+        serialized.resize(offset + size);
+        boost::asio::buffer_copy(boost::asio::buffer(&serialized[offset], size), bufs);
+        msg.consume(size);
+    }
+
+    // Parse it. The message is complete, so no more data is ever required
+    http::response_parser<http::string_body> parser;
+    parser.body_limit(boost::none);
+    parser.skip(skip_body);
+    parser.eager(true);
+    std::string_view remaining(serialized);
+    while (!parser.is_done())
+    {
+        if (remaining.empty())
+        {
+            // The body is delimited by the end of the message
+            parser.put_eof(ec);
+            if (ec)
+                return ec;
+            break;
+        }
+        auto bytes_parsed = parser.put(boost::asio::buffer(remaining.data(), remaining.size()), ec);
+        if (ec)
+            return ec;
+        remaining.remove_prefix(bytes_parsed);
+    }
+    auto parsed = parser.release();
+
+    // Compose the HTTP/2 response
+    res.headers.push_back({":status", std::to_string(parsed.result_int())});
+    for (const auto& field : parsed)
+    {
+        if (is_connection_specific_header(field.name()))
+            continue;
+        auto name = field.name_string();
+        auto value = field.value();
+        hpack_header h{std::string(name.data(), name.size()), std::string(value.data(), value.size())};
+        std::transform(h.name.begin(), h.name.end(), h.name.begin(), [](char c) {
+            return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+        });
+        res.headers.push_back(std::move(h));
+    }
+    res.body = std::move(parsed.body());
+    return error_code();
+}
+
+class http2_session final : public drainable, public std::enable_shared_from_this<http2_session>
+{
+    client_socket sock_;
+    std::shared_ptr<shared_state> st_;
+    boost::asio::ip::address client_address_;
+    http2_connection conn_;
+
+    // Cancelled to wake up the writer when there are frames to send
+    boost::asio::steady_timer write_notify_;
+
+    // Set when no more data will be read from the socket
+    bool reading_finished_{false};
+
+    std::array<unsigned char, 16384> read_buff_;
+
+    void notify_writer() { write_notify_.cancel(); }
+
+    // Processes data received from the client, launching a coroutine for each complete request
+    error_code on_received(boost::span<const unsigned char> data)
+    {
+        auto ec = conn_.on_data(data);
+        for (auto& req : conn_.take_requests())
+        {
+            increment_counter(counter_id::http2_streams);
+            boost::asio::spawn(
+                sock_.get_executor(),
+                std::allocator_arg,
+                session_stack_allocator(),
+                [self = shared_from_this(), req = std::move(req)](boost::asio::yield_context yield) mutable {
+                    self->handle_request(std::move(req), yield);
+                },
+                boost::asio::detached
+            );
+        }
+        notify_writer();
+        return ec;
+    }
+
+    void handle_request(http2_request&& req, boost::asio::yield_context yield)
+    {
+        auto stream_id = req.stream_id;
+
+        // Each request gets its own arena, since several ones may be running at the same time
+        arena request_arena;
+
+        // We don't communicate regular failures using exceptions, but
+        // unhandled exceptions shouldn't crash the server
+        try
+        {
+            auto http1_req = to_http1_request(std::move(req));
+            bool is_head = http1_req.method() == http::verb::head;
+            std::optional<file_transfer> file;
+            http::message_generator msg = handle_http_request(
+                std::move(http1_req),
+                request_arena,
+                client_address_,
+                *st_,
+                file,
+                yield
+            );
+
+            // Bodies sent from files are not part of the message
+            http2_response res;
+            auto ec = to_http2_response(msg, is_head || file.has_value(), res);
+            if (ec)
+            {
+                log_error(ec, "Translating a response to HTTP/2");
+                conn_.reset_stream(stream_id, http2_error_code::internal_error);
+            }
+            else
+            {
+                if (!is_head)
+                    res.file = std::move(file);
+                conn_.submit_response(stream_id, std::move(res));
+            }
+        }
+        catch (const std::exception& err)
+        {
+            log_error(
+                errc::uncaught_exception,
+                "Uncaught exception while handling a HTTP/2 request",
+                err.what()
+            );
+            conn_.reset_stream(stream_id, http2_error_code::internal_error);
+        }
+        notify_writer();
+    }
+
+    void read_loop(boost::asio::yield_context yield)
+    {
+        while (true)
+        {
+            error_code ec;
+            auto bytes_read = sock_.async_read_some(
+                boost::asio::buffer(read_buff_),
+                boost::asio::cancel_after(idle_timeout, yield[ec])
+            );
+
+            // If the connection is idle, close it. Clients downloading big
+            // responses may not send anything for a while
+            if (ec == boost::asio::error::operation_aborted && sock_.socket().is_open() &&
+                conn_.num_streams() != 0u)
+                continue;
+            if (ec)
+            {
+                if (ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted)
+                    log_error(ec, "HTTP/2 read");
+                break;
+            }
+
+            // On protocol errors, a GOAWAY frame is sent before closing the connection
+            if (on_received({read_buff_.data(), bytes_read}))
+                break;
+        }
+        reading_finished_ = true;
+        notify_writer();
+    }
+
+    void write_loop(boost::asio::yield_context yield)
+    {
+        error_code ec;
+        std::string frames;
+        while (true)
+        {
+            frames.clear();
+            if (conn_.write_frames(frames, write_chunk_size))
+            {
+                boost::asio::async_write(
+                    sock_,
+                    boost::asio::buffer(frames),
+                    boost::asio::cancel_after(write_timeout, yield[ec])
+                );
+                if (ec)
+                {
+                    log_error(ec, "HTTP/2 write");
+                    break;
+                }
+            }
+            else if (reading_finished_ || conn_.done())
+            {
+                break;
+            }
+            else
+            {
+                // Wait until there is something to write. The wait is cancelled by notify_writer
+                write_notify_.expires_at((std::chrono::steady_clock::time_point::max)());
+                write_notify_.async_wait(yield[ec]);
+            }
+        }
+
+        // This makes the reader exit, if it's still running. Handlers still running
+        // will complete, but their responses are discarded
+        sock_.send_close_notify();
+        sock_.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        sock_.socket().close(ec);
+    }
+
+public:
+    http2_session(
+        client_socket&& sock,
+        std::shared_ptr<shared_state> st,
+        const boost::asio::ip::address& client_address
+    )
+        : sock_(std::move(sock)),
+          st_(std::move(st)),
+          client_address_(client_address),
+          conn_(get_connection_config()),
+          write_notify_(sock_.get_executor())
+    {
+    }
+
+    // When the server drains, the client is told to stop opening streams with a GOAWAY.
+    // The connection is closed when the streams in progress finish
+    void on_drain(std::chrono::milliseconds) override
+    {
+        conn_.shutdown();
+        notify_writer();
+    }
+
+    void run(const boost::beast::flat_buffer& initial_data, boost::asio::yield_context yield)
+    {
+        auto drain_guard = st_->drainer().add(*this);
+
+        // Process the data that was read while detecting the protocol
+        auto data = initial_data.data();
+        auto ec = on_received({static_cast<const unsigned char*>(data.data()), data.size()});
+
+        // The reader holds a reference to the session, since it may outlive this function
+        if (ec)
+        {
+            reading_finished_ = true;
+        }
+        else
+        {
+            boost::asio::spawn(
+                yield.get_executor(),
+                std::allocator_arg,
+                task_stack_allocator(),
+                [self = shared_from_this()](boost::asio::yield_context yield) { self->read_loop(yield); },
+                boost::asio::detached
+            );
+        }
+
+        // Run until the connection is closed
+        write_loop(yield);
+    }
+};
+
+}  // namespace
+
+bool chat::http2_enabled()
+{
+    // HTTP/2 with prior knowledge is enabled by default
+    static const bool res = get_env_bool("HTTP2", true);
+    return res;
+}
+
+void chat::run_http2_session(
+    client_socket&& stream,
+    boost::beast::flat_buffer&& buff,
+    std::shared_ptr<shared_state> state,
+    const boost::asio::ip::address& client_address,
+    boost::asio::yield_context yield
+)
+{
+    increment_counter(counter_id::http2_connections);
+    auto session = std::make_shared<http2_session>(std::move(stream), std::move(state), client_address);
+    session->run(buff, yield);
+}
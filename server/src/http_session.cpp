@@ -7,10 +7,15 @@
 
 #include "http_session.hpp"
 
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/cancel_after.hpp>
 #include <boost/asio/error.hpp>
+#include <boost/asio/ip/address.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
-#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/buffer_body.hpp>
 #include <boost/beast/http/message_generator.hpp>
 #include <boost/beast/http/parser.hpp>
 #include <boost/beast/http/read.hpp>
@@ -19,19 +24,35 @@
 #include <boost/beast/http/verb.hpp>
 #include <boost/beast/websocket/error.hpp>
 #include <boost/beast/websocket/rfc6455.hpp>
+#include <boost/core/span.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <limits>
+#include <optional>
 #include <string_view>
 #include <utility>
 
-#include "api/auth.hpp"
 #include "api/chat_websocket.hpp"
+#include "api/routes.hpp"
 #include "error.hpp"
+#include "http2_session.hpp"
 #include "request_context.hpp"
+#include "services/drain_controller.hpp"
+#include "services/startup.hpp"
 #include "shared_state.hpp"
 #include "static_files.hpp"
+#include "util/admission_controller.hpp"
+#include "util/arena.hpp"
+#include "util/client_socket.hpp"
+#include "util/http2_connection.hpp"
+#include "util/metrics.hpp"
+#include "util/sendfile.hpp"
+#include "util/websocket_frame.hpp"
 
 namespace beast = boost::beast;
 namespace http = boost::beast::http;
@@ -49,55 +70,34 @@ static http::message_generator handle_http_request_impl(
         return ctx.response().bad_request_text("Invalid request target");
     auto target = ctx.request_target();
 
-    auto segs = target.segments();
-    auto method = ctx.request_method();
+    // API endpoints are matched against the route table. Anything else is a static file
+    auto segs = target.encoded_segments();
     if (!segs.empty() && segs.front() == "api")
-    {
-        // API endpoint. All endpoint handlers have the signature
-        // http::message_generator (request_context&, shared_state&, boost::asio::yield_context)
-        auto it = std::next(segs.begin());
-        auto seg = *it;
-        ++it;
-        if (seg == "create-account" && it == segs.end())
-        {
-            if (method == http::verb::post)
-                return handle_create_account(ctx, st, yield);
-            else
-                return ctx.response().method_not_allowed();
-        }
-        else if (seg == "login" && it == segs.end())
-        {
-            if (method == http::verb::post)
-                return handle_login(ctx, st, yield);
-            else
-                return ctx.response().method_not_allowed();
-        }
-        else
-        {
-            return ctx.response().not_found_text();
-        }
-    }
+        return handle_api_request(ctx, st, yield);
     else
-    {
-        // Static file
         return handle_static_file(ctx, st);
-    }
 }
 
-static http::message_generator handle_http_request(
+http::message_generator chat::handle_http_request(
     http::request<http::string_body>&& req,
+    arena& request_arena,
+    const boost::asio::ip::address& client_address,
     shared_state& st,
-    boost::asio::yield_context yield
+    std::optional<file_transfer>& file,
+    boost::asio::yield_context yield,
+    body_stream* body
 )
 {
     // Build a request context
-    request_context ctx(std::move(req));
+    request_context ctx(std::move(req), request_arena, client_address, body);
 
     // We don't communicate regular failures using exceptions, but
     // unhandled exceptions shouldn't crash the server.
     try
     {
-        return handle_http_request_impl(ctx, st, yield);
+        auto res = handle_http_request_impl(ctx, st, yield);
+        file = ctx.take_file_transfer();
+        return res;
     }
     catch (const std::exception& err)
     {
@@ -105,8 +105,233 @@ static http::message_generator handle_http_request(
     }
 }
 
+// Parses a request that has already been received, without reading from the socket.
+// Returns true if a complete request (or just its header, if header_only is true) was parsed.
+// Otherwise, the parser may contain a partial request, and reading should continue from the socket
+static bool parse_buffered_request(
+    http::request_parser<http::string_body>& parser,
+    beast::flat_buffer& buff,
+    bool header_only,
+    error_code& ec
+)
+{
+    auto is_done = [&parser, header_only] {
+        return header_only ? parser.is_header_done() : parser.is_done();
+    };
+    while (!is_done() && buff.size() != 0u)
+    {
+        auto bytes_parsed = parser.put(buff.data(), ec);
+        buff.consume(bytes_parsed);
+        if (ec == http::error::need_more)
+        {
+            ec = error_code();
+            return false;
+        }
+        else if (ec)
+        {
+            return false;
+        }
+    }
+    return is_done();
+}
+
+// The maximum size of request bodies, except for streamed ones (see body_stream)
+static constexpr std::uint64_t max_body_size = 10000u;
+
+// Reading or writing to a client must complete within this time
+static constexpr auto io_timeout = std::chrono::seconds(30);
+
+// Reads from the socket until either the HTTP/2 client preface has been received,
+// or the received data doesn't match it. Sets is_http2 accordingly
+static error_code read_http2_preface(
+    client_socket& stream,
+    beast::flat_buffer& buff,
+    bool& is_http2,
+    boost::asio::yield_context yield
+)
+{
+    constexpr auto preface = http2_connection::client_preface;
+    while (true)
+    {
+        std::string_view data(static_cast<const char*>(buff.data().data()), buff.size());
+        auto size = (std::min)(data.size(), preface.size());
+        is_http2 = data.substr(0, size) == preface;
+        if (is_http2 || data.substr(0, size) != preface.substr(0, size))
+            return error_code();
+
+        error_code ec;
+        auto bytes_read = stream.async_read_some(
+            buff.prepare(1024u),
+            boost::asio::cancel_after(io_timeout, yield[ec])
+        );
+        buff.commit(bytes_read);
+        if (ec)
+            return ec;
+    }
+}
+
+namespace {
+
+// Coalesces responses to pipelined requests, so they can be sent using a single write.
+// Small responses are serialized into a buffer that is reused across requests.
+// Big ones are written directly, after any responses that preceded them
+class response_batch
+{
+    // Flush once this many bytes have been serialized
+    static constexpr std::size_t max_buffered_bytes = 64u * 1024u;
+
+    beast::flat_buffer buff_;
+
+public:
+    bool empty() const noexcept { return buff_.size() == 0u; }
+
+    // Sends all the buffered responses
+    error_code flush(client_socket& stream, boost::asio::yield_context yield)
+    {
+        error_code ec;
+        if (!empty())
+        {
+            boost::asio::async_write(stream, buff_.data(), boost::asio::cancel_after(io_timeout, yield[ec]));
+            buff_.clear();
+        }
+        return ec;
+    }
+
+    // Adds a response to the batch, writing it and any buffered ones if required.
+    // If must_flush is true, all responses are written before returning
+    error_code add(
+        client_socket& stream,
+        http::message_generator msg,
+        bool must_flush,
+        boost::asio::yield_context yield
+    )
+    {
+        error_code ec;
+        while (!msg.is_done())
+        {
+            auto bufs = msg.prepare(ec);
+            if (ec)
+                return ec;
+            auto size = boost::asio::buffer_size(bufs);
+            if (buff_.size() + size > max_buffered_bytes)
+            {
+                // Too big to be copied. Send whatever preceded it, then the message
+                ec = flush(stream, yield);
+                if (ec)
+                    return ec;
+                beast::async_write(stream, std::move(msg), boost::asio::cancel_after(io_timeout, yield[ec]));
+                return ec;
+            }
+            buff_.commit(boost::asio::buffer_copy(buff_.prepare(size), bufs));
+            msg.consume(size);
+        }
+        return must_flush || buff_.size() >= max_buffered_bytes ? flush(stream, yield) : error_code();
+    }
+};
+
+// Closes idle connections when the server drains. Connections handling
+// a request are closed once the response has been sent
+struct http_drain_handler final : drainable
+{
+    client_socket& stream;
+
+    // Set while waiting for a new request
+    bool idle{false};
+
+    explicit http_drain_handler(client_socket& s) noexcept : stream(s) {}
+
+    void on_drain(std::chrono::milliseconds) override
+    {
+        if (idle)
+        {
+            error_code ec;
+            stream.close(ec);
+        }
+    }
+};
+
+// Reads the body of a request from the socket as the handler consumes it, rather than
+// reading it into memory first. Created once the request header has been read
+class socket_body_stream final : public body_stream
+{
+    client_socket& stream_;
+    beast::flat_buffer& buff_;
+    http::request_parser<http::buffer_body> parser_;
+    bool send_continue_;
+
+public:
+    socket_body_stream(
+        client_socket& stream,
+        beast::flat_buffer& buff,
+        http::request_parser<http::string_body>&& header_parser
+    )
+        : stream_(stream),
+          buff_(buff),
+          parser_(std::move(header_parser)),
+          send_continue_(beast::iequals(parser_.get()[http::field::expect], "100-continue"))
+    {
+    }
+
+    // Has the entire body been read?
+    bool done() const noexcept { return parser_.is_done(); }
+
+    result<std::size_t> read_some(boost::span<char> to, boost::asio::yield_context yield) override
+    {
+        if (parser_.is_done() || to.empty())
+            return std::size_t(0u);
+
+        // Clients sending Expect: 100-continue wait for our go-ahead before sending the body.
+        // If the handler rejects the request without reading the body, the client doesn't send it
+        error_code ec;
+        if (send_continue_)
+        {
+            send_continue_ = false;
+            constexpr std::string_view continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+            boost::asio::async_write(
+                stream_,
+                boost::asio::buffer(continue_response.data(), continue_response.size()),
+                boost::asio::cancel_after(io_timeout, yield[ec])
+            );
+            if (ec)
+                return ec;
+        }
+
+        // Reads until the buffer is full or the body ends
+        auto& body = parser_.get().body();
+        body.data = to.data();
+        body.size = to.size();
+        http::async_read(stream_, buff_, parser_, boost::asio::cancel_after(io_timeout, yield[ec]));
+        if (ec == http::error::need_buffer)
+            ec = error_code();
+        if (ec)
+            return ec;
+        return to.size() - body.size;
+    }
+};
+
+}  // namespace
+
+// Handles an error reading a request
+static void handle_read_error(client_socket& stream, shared_state& st, error_code ec)
+{
+    if (ec == http::error::end_of_stream)
+    {
+        // This means they closed the connection
+        stream.shutdown_send(ec);
+        return;
+    }
+
+    // Idle connections are closed when the server drains
+    if (st.drainer().draining())
+        return;
+
+    // An unknown error happened
+    log_error(ec, "read");
+}
+
 void chat::run_http_session(
-    boost::asio::ip::tcp::socket&& socket,
+    client_socket&& stream,
+    admission_controller::ticket& admission,
     std::shared_ptr<shared_state> state,
     boost::asio::yield_context yield
 )
@@ -116,87 +341,207 @@ void chat::run_http_session(
     // A buffer to read incoming client requests
     boost::beast::flat_buffer buff;
 
-    // A stream allows us to set quality-of-service parameters for the connection,
-    // like timeouts.
-    boost::beast::tcp_stream stream(std::move(socket));
+    // Scratch memory for handling requests, reused across requests
+    arena request_arena;
+
+    // Responses to pipelined requests, waiting to be sent
+    response_batch responses;
+
+    // The peer's address, used for rate limiting. Unspecified if it can't be retrieved
+    error_code endpoint_ec;
+    auto client_address = stream.socket().remote_endpoint(endpoint_ec).address();
+
+    // Clients with prior knowledge of HTTP/2 start by sending the connection preface,
+    // as do TLS clients that selected h2 with ALPN.
+    // Anything read while detecting it is kept in the buffer, and parsed as usual for HTTP/1.1
+    if (http2_enabled())
+    {
+        bool is_http2 = false;
+        ec = read_http2_preface(stream, buff, is_http2, yield);
+        if (ec == boost::asio::error::eof)
+            return;
+        else if (ec)
+            return log_error(ec, "read");
+
+        if (is_http2)
+            return run_http2_session(std::move(stream), std::move(buff), state, client_address, yield);
+    }
+
+    http_drain_handler drain_handler(stream);
+    auto drain_guard = state->drainer().add(drain_handler);
 
     while (true)
     {
         // Construct a new parser for each message
         boost::beast::http::request_parser<boost::beast::http::string_body> parser;
 
-        // Apply a reasonable limit to the allowed size
-        // of the body in bytes to prevent abuse.
-        parser.body_limit(10000);
+        // The body size limit is checked against Content-Length when the header is parsed,
+        // so it's only set once we know that the body won't be streamed
+        parser.body_limit((std::numeric_limits<std::uint64_t>::max)());
 
-        // Set the timeout.
-        stream.expires_after(std::chrono::seconds(30));
-
-        // Read a request
-        http::async_read(stream, buff, parser.get(), yield[ec]);
-
-        if (ec == http::error::end_of_stream)
+        // If the client pipelined requests, the next one may be already in the buffer.
+        // If it's not complete, send any pending responses before waiting for it
+        if (!responses.empty() && !parse_buffered_request(parser, buff, true, ec))
         {
-            // This means they closed the connection
-            stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
-            return;
+            if (ec)
+            {
+                responses.flush(stream, yield);
+                return log_error(ec, "read");
+            }
+            ec = responses.flush(stream, yield);
+            if (ec)
+                return log_error(ec, "write");
         }
-        else if (ec)
+
+        // Read the request header, or the rest of it
+        if (!parser.is_header_done())
         {
-            // An unknown error happened
-            return log_error(ec, "read");
+            drain_handler.idle = buff.size() == 0u && !parser.got_some();
+            http::async_read_header(stream, buff, parser, boost::asio::cancel_after(io_timeout, yield[ec]));
+            drain_handler.idle = false;
+            if (ec)
+                return handle_read_error(stream, *state, ec);
         }
 
-        // See if it is a WebSocket Upgrade
-        if (boost::beast::websocket::is_upgrade(parser.get()))
+        std::optional<file_transfer> file;
+        std::optional<http::message_generator> msg;
+        bool body_done = true;
+        if (streams_request_body(parser.get().method(), parser.get().target()))
         {
-            // Create a websocket, transferring ownership of the socket
-            // and the buffer (we're not using them again here)
-            websocket ws(stream.release_socket(), parser.release(), std::move(buff));
-
-            // Perform the session handshake
-            ec = ws.accept(yield);
+            // The handler reads the body as it arrives.
+            // It may write a 100 Continue response, so preceding responses go first
+            ec = responses.flush(stream, yield);
             if (ec)
-                return log_error(ec, "websocket accept");
+                return log_error(ec, "write");
+            http::request<http::string_body> req(parser.get().base());
+            socket_body_stream body(stream, buff, std::move(parser));
+            msg.emplace(
+                handle_http_request(std::move(req), request_arena, client_address, *state, file, yield, &body)
+            );
+            body_done = body.done();
+        }
+        else
+        {
+            // Apply a reasonable limit to the allowed size
+            // of the body in bytes to prevent abuse
+            parser.body_limit(max_body_size);
+            auto content_length = parser.content_length();
+            if (content_length && *content_length > max_body_size)
+            {
+                responses.flush(stream, yield);
+                return log_error(http::error::body_limit, "read");
+            }
 
-            // Run the websocket session. This will run until the client
-            // closes the connection or an error occurs.
-            // We don't use exceptions to communicate regular failures, but an
-            // unhandled exception in a websocket session shoudn't crash the server.
-            try
+            // Read the rest of the request, sending pending responses if we need to wait for it
+            if (!responses.empty() && !parse_buffered_request(parser, buff, false, ec))
             {
-                auto err = handle_chat_websocket(std::move(ws), state, yield);
-                if (err.ec && err.ec != boost::beast::websocket::error::closed)
-                    log_error(err, "Running chat websocket session");
+                if (ec)
+                {
+                    responses.flush(stream, yield);
+                    return log_error(ec, "read");
+                }
+                ec = responses.flush(stream, yield);
+                if (ec)
+                    return log_error(ec, "write");
             }
-            catch (const std::exception& err)
+            if (!parser.is_done())
             {
-                log_error(
-                    errc::uncaught_exception,
-                    "Uncaught exception while running websocket session",
-                    err.what()
-                );
+                http::async_read(stream, buff, parser, boost::asio::cancel_after(io_timeout, yield[ec]));
+                if (ec)
+                    return handle_read_error(stream, *state, ec);
             }
-            return;
-        }
 
-        // It's a regular HTTP request.
-        // Attempt to serve it and generate a response
-        http::message_generator msg = handle_http_request(parser.release(), *state, yield);
+            // See if it is a WebSocket Upgrade
+            if (boost::beast::websocket::is_upgrade(parser.get()))
+            {
+                // Responses to requests preceding the upgrade go first
+                ec = responses.flush(stream, yield);
+                if (ec)
+                    return log_error(ec, "write");
+
+                // Websocket sessions are long-lived and need bigger buffers. If they don't fit
+                // in the memory budget, tell the client to try later. Likewise if we're starting up,
+                // since sessions need the databases
+                const auto& compression = default_websocket_compression_options();
+                if (!state->startup().db_ready() ||
+                    !admission.reserve(websocket_session_cost(get_admission_config(), compression)))
+                {
+                    increment_counter(counter_id::websocket_upgrades_rejected);
+                    request_context ctx(parser.release(), request_arena, client_address);
+                    ec = responses.add(stream, ctx.response().service_unavailable_text(), true, yield);
+                    if (ec)
+                        return log_error(ec, "write");
+                    stream.shutdown_send(ec);
+                    return;
+                }
+
+                // Create a websocket, transferring ownership of the socket
+                // and the buffer (we're not using them again here).
+                // The websocket session handles draining by itself
+                drain_guard.reset();
+                websocket ws(std::move(stream), parser.release(), std::move(buff));
+                // Perform the session handshake
+                ec = ws.accept(yield);
+                if (ec)
+                    return log_error(ec, "websocket accept");
 
-        // Determine if we should close the connection
-        bool keep_alive = msg.keep_alive();
+                // Run the websocket session. This will run until the client
+                // closes the connection or an error occurs.
+                // We don't use exceptions to communicate regular failures, but an
+                // unhandled exception in a websocket session shoudn't crash the server.
+                try
+                {
+                    auto err = handle_chat_websocket(std::move(ws), state, yield);
+                    if (err.ec && err.ec != boost::beast::websocket::error::closed)
+                        log_error(err, "Running chat websocket session");
+                }
+                catch (const std::exception& err)
+                {
+                    log_error(
+                        errc::uncaught_exception,
+                        "Uncaught exception while running websocket session",
+                        err.what()
+                    );
+                }
+                return;
+            }
 
-        // Send the response
-        beast::async_write(stream, std::move(msg), yield[ec]);
+            // It's a regular HTTP request.
+            // Attempt to serve it and generate a response
+            msg.emplace(
+                handle_http_request(parser.release(), request_arena, client_address, *state, file, yield)
+            );
+        }
+
+        // Determine if we should close the connection. When draining, connections are
+        // closed after the response, so clients reconnect to other instances. Streamed bodies
+        // that weren't read completely can't be skipped, so their connections are closed, too
+        bool keep_alive = msg->keep_alive() && body_done && !state->drainer().draining();
+
+        // Send the response. If there are more pipelined requests, it may be kept
+        // in the batch until they're handled. Bodies sent from files require
+        // the headers to be sent first
+        bool must_flush = !keep_alive || file.has_value() || buff.size() == 0u;
+        ec = responses.add(stream, std::move(*msg), must_flush, yield);
         if (ec)
             return log_error(ec, "write");
 
+        // Send the body, if it wasn't part of the response
+        if (file)
+        {
+            ec = async_send_file(stream, *file, io_timeout, yield);
+            if (ec)
+                return log_error(ec, "sending file");
+        }
+
+        // Objects created while handling the request have been destroyed by now
+        request_arena.reset();
+
         // This means we should close the connection, usually because
         // the response indicated the "Connection: close" semantic.
         if (!keep_alive)
         {
-            stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+            stream.shutdown_send(ec);
             return;
         }
     }
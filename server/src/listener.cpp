@@ -8,19 +8,33 @@
 #include "listener.hpp"
 
 #include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/error.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/spawn.hpp>
-#include <boost/assert/source_location.hpp>
+#include <boost/asio/detail/socket_option.hpp>
 
+#include <chrono>
 #include <memory>
+#include <optional>
+#include <sys/socket.h>
 
 #include "error.hpp"
 #include "http_session.hpp"
-#include "services/mysql_client.hpp"
+#include "services/drain_controller.hpp"
 #include "shared_state.hpp"
+#include "util/admission_controller.hpp"
+#include "util/client_socket.hpp"
+#include "util/cpu_affinity.hpp"
+#include "util/metrics.hpp"
+#include "util/stack_pool.hpp"
+#include "util/tls_context.hpp"
 
 using namespace chat;
 
+// Asio doesn't provide a portable SO_REUSEPORT option, so we define our own.
+// We only target Linux, where this option is always available.
+using reuse_port_option = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
 // An exception handler for coroutines that rethrows any exception thrown by
 // the coroutine. We handle all known error cases with error_code's. If an
 // exception is raised, it's something critical, e.g. out of memory.
@@ -31,21 +45,59 @@ static constexpr auto rethrow_handler = [](std::exception_ptr ex) {
         std::rethrow_exception(ex);
 };
 
+// Performs the TLS handshake, if required, and runs the session
+static void run_session(
+    boost::asio::ip::tcp::socket&& sock,
+    admission_controller::ticket& admission,
+    std::shared_ptr<chat::shared_state> st,
+    const tls_context* tls,
+    boost::asio::yield_context yield
+)
+{
+    client_socket stream(std::move(sock));
+    if (tls)
+    {
+        // Clients that don't complete the handshake promptly are disconnected.
+        // Failures are logged by tls_handshake
+        auto ec = stream.tls_handshake(*tls, std::chrono::seconds(10), yield);
+        if (ec)
+            return;
+    }
+    run_http_session(std::move(stream), admission, std::move(st), yield);
+}
+
+// Closes an acceptor when the server drains, making its accept loop exit
+struct acceptor_closer final : drainable
+{
+    boost::asio::ip::tcp::acceptor& acceptor;
+
+    explicit acceptor_closer(boost::asio::ip::tcp::acceptor& acc) noexcept : acceptor(acc) {}
+
+    void on_drain(std::chrono::milliseconds) override
+    {
+        error_code ec;
+        acceptor.close(ec);
+    }
+};
+
 // The actual accept loop, coroutine-based
 static void accept_loop(
     boost::asio::ip::tcp::acceptor acceptor,
     std::shared_ptr<chat::shared_state> st,
+    std::shared_ptr<const tls_context> tls,
     boost::asio::yield_context yield
 )
 {
     error_code ec;
 
-    // Run DB setup code. If this fails is because something really bad happened
-    // (e.g. the SQL execution failed), so we throw an exception. Network errors
-    // are handled by setup_db.
-    auto err = st->mysql().setup_db(yield);
-    if (err.ec)
-        throw_exception_from_error(err, BOOST_CURRENT_LOCATION);
+    // New connections go to other server instances (or to other acceptors
+    // bound to the same port) once we start draining
+    acceptor_closer closer(acceptor);
+    auto drain_guard = st->drainer().add(closer);
+
+    // Limits on the number of connections and the memory they use
+    const auto& admission_cfg = get_admission_config();
+    const auto connection_cost = http_connection_cost(admission_cfg, tls != nullptr);
 
     // We accept connections in an infinite loop. When the io_context is stopped,
     // coroutines are "cancelled" by throwing an internal exception, exiting
@@ -54,58 +106,137 @@ static void accept_loop(
     {
         // Accept a new connection
         auto sock = acceptor.async_accept(yield[ec]);
-        if (ec)
+        if (ec == boost::asio::error::operation_aborted && st->drainer().draining())
+            return;
+        else if (ec)
             return chat::log_error(ec, "accept");
+        increment_counter(counter_id::connections_accepted);
+
+        // If we're at capacity, close the connection straight away. This is cheaper than
+        // sending a response, and keeps a connection flood from exhausting our memory
+        auto ticket = st->admission().try_admit(connection_cost);
+        if (!ticket)
+        {
+            increment_counter(counter_id::connections_rejected);
+            continue;
+        }
 
         // Launch a new session for this connection. Each session gets its
         // own stackful coroutine, so we can get back to listening for new connections.
+        // Stacks are sized explicitly, since they account for most of a connection's memory,
+        // and reused once the session finishes
         boost::asio::spawn(
             sock.get_executor(),
-            [state = st, socket = std::move(sock)](boost::asio::yield_context yield) mutable {
-                run_http_session(std::move(socket), std::move(state), yield);
-            },
+            std::allocator_arg,
+            session_stack_allocator(),
+            [state = st, socket = std::move(sock), ticket = std::move(ticket), tls](
+                boost::asio::yield_context yield
+            ) mutable { run_session(std::move(socket), ticket, std::move(state), tls.get(), yield); },
             rethrow_handler  // Propagate exceptions to the io_context
         );
     }
 }
 
-error_code chat::launch_http_listener(
+// Opens an acceptor and starts listening
+static boost::asio::ip::tcp::acceptor open_acceptor(
     boost::asio::any_io_executor ex,
     boost::asio::ip::tcp::endpoint listening_endpoint,
-    std::shared_ptr<shared_state> state
+    bool reuse_port,
+    int incoming_cpu,
+    error_code& ec
 )
 {
-    error_code ec;
-
     // An object that allows us to acept incoming TCP connections
     boost::asio::ip::tcp::acceptor acceptor{ex};
 
     // Open the acceptor
     acceptor.open(listening_endpoint.protocol(), ec);
     if (ec)
-        return ec;
+        return acceptor;
 
     // Allow address reuse
     acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
     if (ec)
-        return ec;
+        return acceptor;
+
+    // Allow several listeners to bind to the same port, if required
+    if (reuse_port)
+    {
+        acceptor.set_option(reuse_port_option(true), ec);
+        if (ec)
+            return acceptor;
+    }
+
+    // Prefer connections whose packets are processed by the CPU running this listener
+    if (incoming_cpu >= 0)
+    {
+        ec = set_incoming_cpu(acceptor.native_handle(), incoming_cpu);
+        if (ec)
+            return acceptor;
+    }
 
     // Bind to the server address
     acceptor.bind(listening_endpoint, ec);
     if (ec)
-        return ec;
+        return acceptor;
 
     // Start listening for connections
     acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+    return acceptor;
+}
+
+error_code chat::launch_http_listener(
+    boost::asio::any_io_executor ex,
+    boost::asio::ip::tcp::endpoint listening_endpoint,
+    std::shared_ptr<shared_state> state,
+    bool reuse_port,
+    std::shared_ptr<const tls_context> tls,
+    boost::asio::ip::tcp::endpoint tls_endpoint,
+    int incoming_cpu
+)
+{
+    error_code ec;
+
+    auto acceptor = open_acceptor(ex, listening_endpoint, reuse_port, incoming_cpu, ec);
     if (ec)
         return ec;
 
+    std::optional<boost::asio::ip::tcp::acceptor> tls_acceptor;
+    if (tls)
+    {
+        tls_acceptor = open_acceptor(ex, tls_endpoint, reuse_port, incoming_cpu, ec);
+        if (ec)
+            return ec;
+    }
+
     // Spawn a coroutine that will accept the connections. From this point,
     // everything is handled asynchronously, with stackful coroutines.
     boost::asio::spawn(
         std::move(ex),
-        [acceptor = std::move(acceptor), st = std::move(state)](boost::asio::yield_context yield) mutable {
-            accept_loop(std::move(acceptor), std::move(st), yield);
+        std::allocator_arg,
+        session_stack_allocator(),
+        [acceptor = std::move(acceptor),
+         tls_acceptor = std::move(tls_acceptor),
+         st = std::move(state),
+         tls = std::move(tls)](boost::asio::yield_context yield) mutable {
+            // Connections are accepted straight away, while the databases are set up
+            // in the background (see launch_startup)
+
+            // TLS connections are accepted by a separate coroutine
+            if (tls_acceptor)
+            {
+                boost::asio::spawn(
+                    yield.get_executor(),
+                    std::allocator_arg,
+                    session_stack_allocator(),
+                    [acceptor = std::move(*tls_acceptor), st, tls](boost::asio::yield_context yield) mutable {
+                        accept_loop(std::move(acceptor), std::move(st), std::move(tls), yield);
+                    },
+                    rethrow_handler
+                );
+            }
+
+            accept_loop(std::move(acceptor), std::move(st), nullptr, yield);
         },
         rethrow_handler  // Propagate exceptions to the io_context
     );
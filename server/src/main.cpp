@@ -5,80 +5,474 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/errc.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "error.hpp"
+#include "http2_session.hpp"
 #include "listener.hpp"
+#include "services/drain_controller.hpp"
+#include "services/history_snapshot.hpp"
+#include "services/message_sequencer.hpp"
+#include "services/message_archiver.hpp"
+#include "services/message_spool.hpp"
 #include "services/mysql_client.hpp"
+#include "services/pubsub_service.hpp"
 #include "services/redis_client.hpp"
+#include "services/search_index.hpp"
+#include "services/startup.hpp"
+#include "services/upload_store.hpp"
 #include "shared_state.hpp"
+#include "static_file_cache.hpp"
+#include "util/admission_controller.hpp"
+#include "util/bounded_thread_pool.hpp"
+#include "util/cpu_affinity.hpp"
+#include "util/env.hpp"
+#include "util/log.hpp"
+#include "util/password_hash.hpp"
+#include "util/tls_context.hpp"
 
 using namespace chat;
 
+// Returns the number of threads to use, given the command-line argument.
+// 0 means "one thread per core"
+static std::size_t get_num_threads(const char* arg)
+{
+    auto res = static_cast<std::size_t>(std::atoi(arg));
+    if (res == 0u)
+        res = std::thread::hardware_concurrency();
+    return res == 0u ? 1u : res;
+}
+
+// Pins the calling thread to the CPU assigned to a shard. No-op if cpus is empty (CPU_AFFINITY disabled)
+static void pin_to_shard(const std::vector<int>& cpus, std::size_t shard_idx)
+{
+    if (cpus.empty())
+        return;
+    auto ec = pin_current_thread(shard_cpu(cpus, shard_idx));
+    if (ec)
+        log_error(ec, "Pinning thread to CPU");
+}
+
+// Returns the params to use for password hashing. If a target latency is configured,
+// calibrates them by benchmarking. Otherwise, uses the defaults
+static scrypt_params get_password_params()
+{
+    auto target_ms = get_env_size("SCRYPT_CALIBRATE_MS", 0u);
+    if (target_ms == 0u)
+        return scrypt_params{};
+
+    auto res = calibrate_scrypt_params(
+        std::chrono::milliseconds(target_ms),
+        get_env_size("SCRYPT_MAX_MEMORY", 64u * 1024u * 1024u)
+    );
+    if (should_log(log_level::info))
+    {
+        log_message(
+            log_level::info,
+            "Calibrated password hashing params: ln=" + std::to_string(res.ln) +
+                ", r=" + std::to_string(res.r) + ", p=" + std::to_string(res.p)
+        );
+    }
+    return res;
+}
+
+// Creates the TLS context, shared by all threads, if TLS_CERT_FILE is set. Exits on error
+static std::shared_ptr<const tls_context> create_tls_context()
+{
+    auto cfg = get_tls_config();
+    if (cfg.cert_file.empty())
+        return nullptr;
+
+    // Clients supporting HTTP/2 negotiate it with ALPN
+    if (http2_enabled())
+        cfg.alpn_protocols = {"h2", "http/1.1"};
+
+    auto res = tls_context::create(cfg);
+    if (res.has_error())
+    {
+        log_error(res.error(), "Error creating the TLS context");
+        stop_logging();
+        exit(EXIT_FAILURE);
+    }
+    return std::make_shared<const tls_context>(std::move(res).value());
+}
+
+// Stops the services in a shard and its io_context. Must be called from the shard's thread
+static void stop_shard(shared_state& st, boost::asio::io_context& ctx)
+{
+    // Stop the Redis reconnection loop
+    st.redis().cancel();
+
+    // Stop the MySQL reconnection loop
+    st.mysql().cancel();
+
+    // Stop the cross-node pubsub connection
+    st.pubsub().cancel();
+
+    // Stop the io_context. This will cause run() to return
+    ctx.stop();
+}
+
+// Drains a shard, then stops it. Must be called from the shard's thread
+static void drain_shard(
+    std::shared_ptr<shared_state> st,
+    boost::asio::io_context& ctx,
+    std::chrono::steady_clock::duration timeout,
+    std::chrono::milliseconds reconnect_spread
+)
+{
+    st->drainer().start(reconnect_spread);
+    boost::asio::spawn(
+        ctx.get_executor(),
+        [st, &ctx, timeout](boost::asio::yield_context yield) {
+            auto& drainer = st->drainer();
+            if (!drainer.wait_idle(timeout, yield) && should_log(log_level::warning))
+            {
+                log_message(
+                    log_level::warning,
+                    "Drain timed out with " + std::to_string(drainer.num_drainables()) +
+                        " connection(s) and " + std::to_string(drainer.num_pending_operations()) +
+                        " operation(s) in progress"
+                );
+            }
+            stop_shard(*st, ctx);
+        },
+        boost::asio::detached
+    );
+}
+
+// Periodically removes abandoned uploads. Removing them performs blocking filesystem
+// operations, so it runs in pool. The loop runs until the io_context is stopped
+static void launch_upload_cleanup(
+    boost::asio::any_io_executor ex,
+    upload_store& store,
+    bounded_thread_pool& pool
+)
+{
+    boost::asio::spawn(
+        std::move(ex),
+        [&store, &pool](boost::asio::yield_context yield) {
+            boost::asio::steady_timer timer(yield.get_executor());
+            auto interval = (std::max)(store.pending_ttl() / 2, std::chrono::seconds(1));
+            while (true)
+            {
+                error_code ec;
+                timer.expires_after(interval);
+                timer.async_wait(yield[ec]);
+                if (ec)
+                    return;
+
+                // If the pool is busy, we'll try again later
+                auto res = pool.run([&store] { return store.remove_abandoned(); }, yield);
+                if (res.has_value() && *res > 0u && should_log(log_level::info))
+                    log_message(log_level::info, "Removed " + std::to_string(*res) + " abandoned upload(s)");
+            }
+        },
+        boost::asio::detached
+    );
+}
+
 int main(int argc, char* argv[])
 {
     // Check command line arguments.
-    if (argc != 4)
+    if (argc != 4 && argc != 5)
     {
-        std::cerr << "Usage: " << argv[0] << " <address> <port> <doc_root>\n"
+        std::cerr << "Usage: " << argv[0] << " <address> <port> <doc_root> [num_threads]\n"
                   << "Example:\n"
-                  << "    " << argv[0] << " 0.0.0.0 8080 .\n";
+                  << "    " << argv[0] << " 0.0.0.0 8080 .\n"
+                  << "num_threads defaults to 1. Pass 0 to use one thread per core.\n";
         return EXIT_FAILURE;
     }
 
     // Application config
-    const char* doc_root = argv[3];                               // Path to static files
-    const char* ip = argv[1];                                     // IP where the server will listen
-    auto port = static_cast<unsigned short>(std::atoi(argv[2]));  // Port
+    const char* doc_root = argv[3];                                       // Path to static files
+    const char* ip = argv[1];                                             // IP where the server will listen
+    auto port = static_cast<unsigned short>(std::atoi(argv[2]));          // Port
+    std::size_t num_threads = argc == 5 ? get_num_threads(argv[4]) : 1u;  // Number of threads
 
-    // An event loop, where the application will run. The server is single-
-    // threaded, so we set the concurrency hint to 1
-    boost::asio::io_context ioc{1};
+    // Launch the logger's background thread. This must be done before any other thread is launched
+    auto log_level_name = get_env_string("LOG_LEVEL", "info");
+    auto min_log_level = parse_log_level(log_level_name);
+    if (!min_log_level)
+        log_error(errc::invalid_config, "Invalid LOG_LEVEL", log_level_name);
+    start_logging(min_log_level.value_or(log_level::info));
 
-    // Singleton objects shared by all connections
-    auto st = std::make_shared<shared_state>(doc_root, ioc.get_executor());
+    // Optimistic broadcast and the message spool generate message IDs that embed the node number.
+    // IDs from instances with the same node number may collide, so it must be set explicitly
+    bool generates_ids = get_env_bool("OPTIMISTIC_BROADCAST", false) ||
+                         !get_env_string("REDIS_SPOOL_PATH", "").empty();
+    if (generates_ids && !node_number_configured())
+    {
+        log_error(
+            errc::invalid_config,
+            "OPTIMISTIC_BROADCAST and REDIS_SPOOL_PATH require NODE_NUMBER, between 0 and 1023"
+        );
+        stop_logging();
+        return EXIT_FAILURE;
+    }
+
+    // With CPU_AFFINITY, each event loop runs pinned to its own CPU, out of the ones
+    // this process may use. Shards don't share locks in the request path: state used
+    // by several shards is owned by one of them, and cores communicate by posting messages
+    // to each other (e.g. to broadcast messages, or to index them). Process-wide counters are atomic
+    std::vector<int> cpus;
+    if (get_env_bool("CPU_AFFINITY", false))
+    {
+        cpus = available_cpus();
+        if (cpus.empty())
+            log_error(errc::invalid_config, "CPU_AFFINITY: unknown CPUs, not pinning threads");
+    }
+
+    // Event loops, where the application will run. We use a thread-per-core
+    // architecture: each thread runs its own io_context, with its own listener
+    // and set of singleton objects. Each io_context is only run by a single thread,
+    // so we set the concurrency hint to 1
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<boost::asio::any_io_executor> executors;
+    contexts.reserve(num_threads);
+    executors.reserve(num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        executors.push_back(contexts.back()->get_executor());
+    }
+
+    // Password hashing is CPU intensive, so it runs in a separate thread pool,
+    // shared by all threads. The pool is bounded to shed load on login bursts.
+    // A pool without threads (or that can't accept any task) would hang every login
+    bounded_thread_pool hashing_pool{
+        (std::max)(get_env_size("HASHING_THREADS", 2u), std::size_t(1)),
+        (std::max)(get_env_size("HASHING_MAX_PENDING", 64u), std::size_t(1)),
+    };
+
+    // Parameters for new password hashes. If SCRYPT_CALIBRATE_MS is set, they're adjusted
+    // to the hardware we're running on. Existing hashes are upgraded on login
+    auto password_params = get_password_params();
+
+    // Static files are loaded once and served from memory by all threads
+    auto static_files = static_file_cache::load(
+        doc_root,
+        get_env_size("STATIC_CACHE_MAX_SIZE", 64u * 1024u * 1024u),
+        get_env_size("STATIC_CACHE_MAX_FILE_SIZE", 4u * 1024u * 1024u)
+    );
+
+    // Connections are limited globally, so that a connection flood doesn't exhaust our memory
+    const auto& admission_cfg = get_admission_config();
+    admission_controller admission{admission_cfg.max_connections, admission_cfg.memory_budget};
+
+    // Messages must be broadcast between all threads. If we're running several
+    // server instances, messages are exchanged between them via Redis, too
+    auto pubsub_shards = create_sharded_pubsub_service(executors, get_env_bool("CROSS_NODE_PUBSUB", false));
+
+    // Tracks when the server is ready to serve requests
+    startup_tracker startup{num_threads};
+
+    // The search index and the message spool are shared by all threads, but each room's index
+    // is owned by a single shard, and the first shard owns the spool.
+    // Other shards post their work to the owner
+    auto index = create_sharded_search_index(executors);
+    auto spool = create_shared_message_spool(executors.front());
+
+    // Singleton objects shared by all connections in each thread
+    std::vector<std::shared_ptr<shared_state>> states;
+    states.reserve(num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        // Memory is allocated in the NUMA node of the CPU that first touches it.
+        // Run on the shard's CPU while creating its objects, so they're local to it.
+        // Anything allocated later by the shard's thread is local, too
+        pin_to_shard(cpus, i);
+        states.push_back(
+            std::make_shared<shared_state>(
+                doc_root,
+                executors[i],
+                std::move(pubsub_shards[i]),
+                hashing_pool,
+                password_params,
+                static_files,
+                admission,
+                startup,
+                index.get(),
+                spool.get()
+            )
+        );
+    }
 
     // The physical endpoint where our server will listen
     boost::asio::ip::tcp::endpoint listening_endpoint{boost::asio::ip::make_address(ip), port};
 
+    // If TLS is enabled, secure connections are accepted on a separate port
+    auto tls = create_tls_context();
+    boost::asio::ip::tcp::endpoint tls_endpoint{
+        listening_endpoint.address(),
+        static_cast<unsigned short>(get_env_size("TLS_PORT", 8443u)),
+    };
+
     // A signal_set allows us to intercept SIGINT and SIGTERM and
     // exit gracefully
-    boost::asio::signal_set signals{ioc.get_executor(), SIGINT, SIGTERM};
+    boost::asio::signal_set signals{executors.front(), SIGINT, SIGTERM};
+
+    for (const auto& st : states)
+    {
+        // Launch the Redis connection
+        st->redis().start_run();
 
-    // Launch the Redis connection
-    st->redis().start_run();
+        // Launch the MySQL connection pool
+        st->mysql().start_run();
 
-    // Launch the MySQL connection pool
-    st->mysql().start_run();
+        // Launch the cross-node pubsub connection, if enabled
+        st->pubsub().start_run();
+    }
 
-    // Start listening for HTTP connections. This will run until the context is stopped
-    auto ec = launch_http_listener(ioc.get_executor(), listening_endpoint, st);
-    if (ec)
+    // With HISTORY_SNAPSHOT_FILE, the recent history is periodically saved to a file,
+    // which is loaded on startup, so hello events can be served before the databases are read
+    auto snapshot_path = get_env_string("HISTORY_SNAPSHOT_FILE", "");
+    std::shared_ptr<const history_snapshot> snapshot;
+    if (!snapshot_path.empty())
     {
-        log_error(ec, "Error launching the HTTP listener");
-        exit(EXIT_FAILURE);
+        // A missing file is expected on the first run. Otherwise, we warm up as usual
+        auto snapshot_result = history_snapshot::open(snapshot_path);
+        if (snapshot_result.has_value())
+            snapshot = std::move(*snapshot_result);
+        else if (snapshot_result.error() != boost::system::errc::no_such_file_or_directory)
+            log_error(snapshot_result.error(), "Opening the history snapshot");
+    }
+
+    // Set up the database schema once and warm up the caches of all shards,
+    // concurrently with the connections above
+    launch_startup(executors, states, startup, std::move(snapshot));
+
+    // Launch the task moving old messages from Redis to MySQL. A single shard is enough
+    auto archiver = create_message_archiver(
+        executors.front(),
+        states.front()->redis(),
+        states.front()->mysql()
+    );
+    archiver->start_run();
+
+    // Launch the task writing history snapshots. Shards cache the same history, so one is enough
+    std::unique_ptr<history_snapshotter> snapshotter;
+    if (!snapshot_path.empty())
+    {
+        snapshotter = std::make_unique<history_snapshotter>(
+            executors.front(),
+            states.front()->history_cache(),
+            hashing_pool,
+            startup,
+            snapshot_path
+        );
+        snapshotter->start_run();
     }
 
-    // Capture SIGINT and SIGTERM to perform a clean shutdown
-    signals.async_wait([st, &ioc](error_code, int) {
-        // Stop the Redis reconnection loop
-        st->redis().cancel();
+    // Incomplete uploads that clients never finish are removed. A single shard is enough
+    if (auto* uploads = global_upload_store())
+        launch_upload_cleanup(executors.front(), *uploads, hashing_pool);
 
-        // Stop the MySQL reconnection loop
-        st->mysql().cancel();
+    // Start listening for HTTP connections. This will run until the contexts are stopped.
+    // If we've got several threads, each one gets its own acceptor bound to the same port,
+    // and the kernel distributes connections between them. With LISTEN_REUSE_PORT, a new
+    // server process can bind to the port while this one drains, for zero-downtime restarts
+    bool reuse_port = num_threads > 1u || get_env_bool("LISTEN_REUSE_PORT", false);
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        auto ec = launch_http_listener(
+            executors[i],
+            listening_endpoint,
+            states[i],
+            reuse_port,
+            tls,
+            tls_endpoint,
+            reuse_port && !cpus.empty() ? shard_cpu(cpus, i) : -1
+        );
+        if (ec)
+        {
+            log_error(ec, "Error launching the HTTP listener");
+            stop_logging();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Capture SIGINT and SIGTERM to perform a clean shutdown. The first signal starts draining:
+    // listeners stop accepting connections, websocket clients are asked to reconnect after a random
+    // delay, and we wait for in-progress operations (like storing messages) to finish.
+    // A second signal, or the drain timeout, stops the server
+    auto drain_timeout = std::chrono::seconds(get_env_size("DRAIN_TIMEOUT", 30u));
+    auto reconnect_spread = std::chrono::milliseconds(get_env_size("DRAIN_RECONNECT_SPREAD_MS", 10000u));
+    auto stop_all = [&states, &contexts] {
+        for (std::size_t i = 0; i < states.size(); ++i)
+        {
+            // Objects in each shard must be accessed from its own thread
+            boost::asio::post(*contexts[i], [st = states[i], ctx = contexts[i].get()] {
+                stop_shard(*st, *ctx);
+            });
+        }
+    };
+    signals.async_wait([&, archiver = archiver.get(), snapshotter = snapshotter.get()](error_code, int) {
+        // The archiver and the snapshotter run in the first shard, so it's safe to access them here.
+        // The snapshotter writes a last snapshot before exiting
+        archiver->cancel();
+        if (snapshotter)
+            snapshotter->cancel();
+
+        // Don't wait for the drain to finish if we get signalled again
+        signals.async_wait([&stop_all](error_code ec, int) {
+            if (!ec)
+                stop_all();
+        });
+
+        if (should_log(log_level::info))
+            log_message(log_level::info, "Draining connections before exiting");
 
-        // Stop the io_context. This will cause run() to return
-        ioc.stop();
+        for (std::size_t i = 0; i < states.size(); ++i)
+        {
+            boost::asio::post(
+                *contexts[i],
+                [st = states[i], ctx = contexts[i].get(), drain_timeout, reconnect_spread] {
+                    drain_shard(st, *ctx, drain_timeout, reconnect_spread);
+                }
+            );
+        }
     });
 
-    // Run the io_context. This will block until the context is stopped by
+    // Run the io_contexts. Each one gets its own thread, with the first one
+    // running in the main thread. This will block until the contexts are stopped by
     // a signal and all outstanding async tasks are finished.
-    ioc.run();
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1u);
+    for (std::size_t i = 1; i < num_threads; ++i)
+    {
+        threads.emplace_back([ctx = contexts[i].get(), &cpus, i] {
+            pin_to_shard(cpus, i);
+            ctx->run();
+        });
+    }
+    pin_to_shard(cpus, 0u);
+    contexts.front()->run();
+    for (auto& t : threads)
+        t.join();
+
+    // Stop any pending hashing work
+    hashing_pool.stop_and_join();
+
+    // Write any pending log records
+    stop_logging();
 
     // (If we get here, it means we got a SIGINT or SIGTERM)
     return EXIT_SUCCESS;
@@ -11,14 +11,27 @@
 #include <boost/beast/http/fields.hpp>
 #include <boost/beast/http/file_body.hpp>
 #include <boost/beast/http/message.hpp>
+#include <boost/beast/http/span_body.hpp>
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
+#include <boost/core/span.hpp>
+#include <boost/system/system_category.hpp>
 #include <boost/url/parse.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <string_view>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "api/api_types.hpp"
 #include "error.hpp"
+#include "util/env.hpp"
+#include "util/http_range.hpp"
+#include "util/sendfile.hpp"
 
 using namespace chat;
 namespace http = boost::beast::http;
@@ -81,47 +94,139 @@ static std::string_view mime_type(std::string_view path)
     return "application/text";
 }
 
+// The error reported by the last failed system call
+static error_code last_system_error() { return error_code(errno, boost::system::system_category()); }
+
 response_builder::response_builder(unsigned version, bool keep_alive) : keep_alive_(keep_alive)
 {
     header_.version(version);
     header_.set(http::field::server, server_header);
 }
 
-response_builder::response_type response_builder::file_response(const char* path, bool is_head)
+response_builder::response_type response_builder::file_response(
+    const char* path,
+    bool is_head,
+    std::string_view range,
+    std::string_view content_type
+)
 {
+    // Files bigger than this are sent using async_send_file
+    static const std::uint64_t sendfile_min_size = get_env_size("SENDFILE_MIN_SIZE", 256u * 1024u);
+
     // Attempt to open the file
-    error_code ec;
-    http::file_body::value_type body;
-    body.open(path, beast::file_mode::scan, ec);
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && (errno == ENOENT || errno == ENOTDIR))
+        return not_found_text();
+    if (fd == -1)
+        return internal_server_error(last_system_error(), "Opening file");
+    file_transfer file(fd, {});
 
-    // Handle the case where the file doesn't exist
-    if (ec == boost::system::errc::no_such_file_or_directory)
+    // Get its size. Directories are not files
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0)
+        return internal_server_error(last_system_error(), "Reading file size");
+    if (!S_ISREG(file_stat.st_mode))
         return not_found_text();
+    const auto file_size = static_cast<std::uint64_t>(file_stat.st_size);
 
-    // Handle an unknown error
-    if (ec)
-        return internal_server_error(ec, "Opening file");
+    set_content_type(content_type.empty() ? mime_type(path) : content_type);
+    header_.set(http::field::accept_ranges, "bytes");
 
-    // Cache the size since we need it after the move
-    const auto size = body.size();
-    set_content_type(mime_type(path));
+    // Handle range requests
+    auto parsed = parse_range_header(range, file_size);
+    if (parsed.kind == parsed_range::unsatisfiable)
+    {
+        header_.result(http::status::range_not_satisfiable);
+        header_.set(http::field::content_range, format_unsatisfiable_content_range(file_size));
+        auto res = build_response<http::empty_body>();
+        res.content_length(0u);
+        return res;
+    }
+    else if (parsed.kind == parsed_range::single)
+    {
+        header_.result(http::status::partial_content);
+        header_.set(http::field::content_range, format_content_range(parsed.range, file_size));
+        file.set_range(parsed.range);
+    }
+    else
+    {
+        file.set_range({0u, file_size});
+    }
+    const auto content_length = file.range().size;
 
     if (is_head)
     {
         // Respond to HEAD request
         auto res = build_response<http::empty_body>();
-        res.content_length(size);
+        res.content_length(content_length);
+        return res;
+    }
+    else if (parsed.kind == parsed_range::single || file_size >= sendfile_min_size)
+    {
+        // Respond to GET request. The body is sent by the caller, without copying it into userspace
+        file_transfer_ = std::move(file);
+        auto res = build_response<http::empty_body>();
+        res.content_length(content_length);
         return res;
     }
     else
     {
-        // Respond to GET request
+        // Respond to GET request with a small file, using a regular body
+        error_code ec;
+        beast::file native_file;
+        native_file.native_handle(file.release());
+        http::file_body::value_type body;
+        body.reset(std::move(native_file), ec);
+        if (ec)
+            return internal_server_error(ec, "Opening file");
         auto res = build_response<http::file_body>(std::move(body));
-        res.content_length(size);
+        res.content_length(content_length);
         return res;
     }
 }
 
+response_builder::response_type response_builder::memory_file_response(
+    std::string_view path,
+    std::string_view content,
+    std::string_view etag,
+    std::string_view content_encoding,
+    bool only_headers
+)
+{
+    set_content_type(mime_type(path));
+    header_.set(http::field::etag, etag);
+
+    // Responses depend on Accept-Encoding, so caches must take it into account
+    header_.set(http::field::vary, "Accept-Encoding");
+    if (!content_encoding.empty())
+        header_.set(http::field::content_encoding, content_encoding);
+
+    if (only_headers)
+    {
+        // Respond to HEAD request
+        auto res = build_response<http::empty_body>();
+        res.content_length(content.size());
+        return res;
+    }
+    else
+    {
+        // Respond to GET request. The body points to content, rather than copying it
+        auto res = build_response<http::span_body<const char>>(
+            http::span_body<const char>::value_type(content.data(), content.size())
+        );
+        res.content_length(content.size());
+        return res;
+    }
+}
+
+response_builder::response_type response_builder::not_modified(std::string_view etag)
+{
+    header_.result(http::status::not_modified);
+    header_.set(http::field::etag, etag);
+    header_.set(http::field::vary, "Accept-Encoding");
+    return build_response<http::empty_body>();
+}
+
 response_builder::response_type response_builder::empty_response()
 {
     header_.result(http::status::no_content);
@@ -130,6 +235,26 @@ response_builder::response_type response_builder::empty_response()
     return res;
 }
 
+response_builder::response_type response_builder::created(std::string_view location)
+{
+    header_.result(http::status::created);
+    header_.set(http::field::location, location);
+    auto res = build_response<http::empty_body>();
+    res.prepare_payload();
+    return res;
+}
+
+response_builder::response_type response_builder::text_response(
+    std::string content,
+    std::string_view content_type
+)
+{
+    set_content_type(content_type);
+    auto res = build_response<http::string_body>(std::move(content));
+    res.prepare_payload();
+    return res;
+}
+
 response_builder::response_type response_builder::json_response_impl(std::string serialized_json)
 {
     set_content_type("application/json");
@@ -172,6 +297,19 @@ response_builder::response_type response_builder::internal_server_error(error_co
     );
 }
 
+result<std::size_t> request_context::read_body_some(boost::span<char> buff, boost::asio::yield_context yield)
+{
+    if (body_)
+        return body_->read_some(buff, yield);
+
+    // The body has already been read
+    const auto& body = request_.body();
+    auto size = (std::min)(buff.size(), body.size() - body_offset_);
+    std::copy_n(body.data() + body_offset_, size, buff.data());
+    body_offset_ += size;
+    return size;
+}
+
 error_code request_context::parse_request_target()
 {
     auto url_result = boost::urls::parse_origin_form(request_.target());
@@ -0,0 +1,131 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/broadcast_aggregator.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/pubsub_service.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+#include "util/tracing.hpp"
+
+using namespace chat;
+
+const broadcast_aggregation_config& chat::get_broadcast_aggregation_config()
+{
+    static const broadcast_aggregation_config res = [] {
+        broadcast_aggregation_config cfg;
+        cfg.min_subscribers = get_env_size("BROADCAST_AGGREGATION_SUBSCRIBERS", cfg.min_subscribers);
+        cfg.window = std::chrono::milliseconds(get_env_size("BROADCAST_AGGREGATION_MS", 5u));
+        return cfg;
+    }();
+    return res;
+}
+
+broadcast_aggregator::broadcast_aggregator(
+    boost::asio::any_io_executor ex,
+    pubsub_service& pubsub,
+    const broadcast_aggregation_config& cfg
+)
+    : pubsub_(pubsub), cfg_(cfg), flush_timer_(std::move(ex))
+{
+}
+
+broadcast_aggregator::pending_room* broadcast_aggregator::find_pending(std::string_view room_id) noexcept
+{
+    auto it = std::find_if(pending_.begin(), pending_.end(), [room_id](const pending_room& r) {
+        return r.room_id == room_id;
+    });
+    return it == pending_.end() ? nullptr : &*it;
+}
+
+void broadcast_aggregator::publish_pending(pending_room& room)
+{
+    auto payload = aggregated_server_messages_event{room.room_id, room.messages, room.usernames}.to_json();
+    pubsub_.publish(room.room_id, std::move(payload));
+}
+
+void broadcast_aggregator::publish_messages(
+    std::string_view room_id,
+    const user& sending_user,
+    boost::span<const message> msgs
+)
+{
+    // If we're being traced, record serializing and publishing the messages
+    auto* tr = take_handed_off_trace();
+
+    // Messages for rooms that already have pending messages must wait for them, to keep ordering
+    auto* room = find_pending(room_id);
+    bool aggregate = cfg_.min_subscribers > 0u && cfg_.window.count() > 0 &&
+                     pubsub_.num_subscribers(room_id) >= cfg_.min_subscribers;
+    if (!room && !aggregate)
+    {
+        std::string payload;
+        {
+            trace_span span(tr, "serialize");
+            payload = server_messages_event{room_id, sending_user, msgs}.to_json();
+        }
+        traced_call(tr, [&] { pubsub_.publish(room_id, std::move(payload)); });
+        return;
+    }
+
+    // Add the messages to the room's pending ones
+    bool first_pending = !room;
+    if (first_pending)
+    {
+        pending_.push_back(pending_room{std::string(room_id), {}, {}});
+        room = &pending_.back();
+    }
+    else
+    {
+        increment_counter(counter_id::broadcasts_aggregated);
+    }
+    room->messages.insert(room->messages.end(), msgs.begin(), msgs.end());
+    room->usernames[sending_user.id] = sending_user.username;
+
+    // Don't let events grow without bounds
+    if (room->messages.size() >= cfg_.max_messages)
+    {
+        auto detached = std::move(*room);
+        pending_.erase(pending_.begin() + (room - pending_.data()));
+        publish_pending(detached);
+        return;
+    }
+
+    // Wait for the window to end. A single timer serves all rooms with pending messages.
+    // The timer is owned by this object, so the handler only accesses it if it wasn't cancelled
+    if (first_pending && pending_.size() == 1u)
+    {
+        flush_timer_.expires_after(cfg_.window);
+        flush_timer_.async_wait([this](error_code ec) {
+            if (!ec)
+                flush();
+        });
+    }
+}
+
+void broadcast_aggregator::flush()
+{
+    // Publishing may cause more messages to be published, so detach the pending ones first
+    auto pending = std::move(pending_);
+    pending_.clear();
+    for (auto& room : pending)
+        publish_pending(room);
+}
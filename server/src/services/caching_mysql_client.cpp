@@ -0,0 +1,275 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/mysql_client.hpp"
+#include "util/lru_cache.hpp"
+#include "util/single_flight.hpp"
+#include "util/tracing.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Composes a key identifying a set of user IDs, for request coalescing. IDs must be sorted
+std::string user_ids_key(boost::span<const std::int64_t> user_ids)
+{
+    std::string res;
+    for (auto id : user_ids)
+    {
+        res += std::to_string(id);
+        res += ',';
+    }
+    return res;
+}
+
+// Decorates a mysql_client with a per-shard username cache. Usernames are looked up
+// every time a client connects or requests history, and they rarely change.
+// Concurrent cache misses for the same IDs are coalesced into a single query.
+class caching_mysql_client final : public mysql_client
+{
+    // An empty optional means that the user doesn't exist (negative entry)
+    using cache_type = lru_cache<std::int64_t, std::optional<std::string>>;
+
+    std::unique_ptr<mysql_client> inner_;
+    cache_type cache_;
+    std::chrono::seconds ttl_;
+    std::chrono::seconds negative_ttl_;
+    single_flight<result_with_message<user>> user_lookups_;
+    single_flight<result_with_message<username_map>> username_lookups_;
+
+    void store(std::int64_t user_id, std::optional<std::string> username)
+    {
+        auto ttl = username.has_value() ? ttl_ : negative_ttl_;
+        cache_.put(user_id, std::move(username), cache_type::clock_type::now() + ttl);
+    }
+
+public:
+    caching_mysql_client(
+        std::unique_ptr<mysql_client> inner,
+        std::size_t max_size,
+        std::chrono::seconds ttl,
+        std::chrono::seconds negative_ttl
+    )
+        : inner_(std::move(inner)), cache_(max_size), ttl_(ttl), negative_ttl_(negative_ttl)
+    {
+    }
+
+    error_with_message setup_db(boost::asio::yield_context yield) final override
+    {
+        return inner_->setup_db(yield);
+    }
+
+    void start_run() override final { inner_->start_run(); }
+
+    void cancel() override final { inner_->cancel(); }
+
+    mysql_pool_stats pool_stats(mysql_pool_kind kind) const override final
+    {
+        return inner_->pool_stats(kind);
+    }
+
+    result_with_message<std::int64_t> create_user(
+        std::string_view username,
+        std::string_view email,
+        std::string_view hashed_password,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        auto res = inner_->create_user(username, email, hashed_password, yield);
+
+        // The ID might have been cached as non-existent
+        if (res.has_value())
+            cache_.erase(*res);
+        return res;
+    }
+
+    result_with_message<std::vector<result<std::int64_t>>> create_users(
+        boost::span<const new_user> users,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        auto res = inner_->create_users(users, yield);
+
+        // The IDs might have been cached as non-existent
+        if (res.has_value())
+        {
+            for (const auto& id : *res)
+            {
+                if (id.has_value())
+                    cache_.erase(*id);
+            }
+        }
+        return res;
+    }
+
+    result_with_message<auth_user> get_user_by_email(std::string_view email, boost::asio::yield_context yield)
+        final override
+    {
+        return inner_->get_user_by_email(email, yield);
+    }
+
+    error_with_message update_password(
+        std::int64_t user_id,
+        std::string_view old_hashed_password,
+        std::string_view new_hashed_password,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->update_password(user_id, old_hashed_password, new_hashed_password, yield);
+    }
+
+    result_with_message<user> get_user_by_id(std::int64_t user_id, boost::asio::yield_context yield)
+        final override
+    {
+        // Cache lookup
+        const auto* entry = cache_.get(user_id, cache_type::clock_type::now());
+        if (entry)
+        {
+            if (!entry->has_value())
+                return error_with_message{errc::not_found, ""};
+            return user{user_id, **entry};
+        }
+
+        // Cache miss
+        return user_lookups_.run(
+            std::to_string(user_id),
+            [this, user_id](boost::asio::yield_context yield) {
+                auto res = inner_->get_user_by_id(user_id, yield);
+                if (res.has_value())
+                    store(user_id, res->username);
+                else if (res.error().ec == errc::not_found)
+                    store(user_id, std::nullopt);
+                return res;
+            },
+            yield
+        );
+    }
+
+    result_with_message<username_map> get_usernames(
+        boost::span<const std::int64_t> user_ids,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        // Take the trace before waiting for a lookup in progress, so other coroutines don't see it.
+        // It's handed over to the inner client if we run the query ourselves
+        auto* tr = take_handed_off_trace();
+
+        // Look up the cache, recording the IDs we don't have
+        username_map res;
+        std::vector<std::int64_t> misses;
+        auto now = cache_type::clock_type::now();
+        for (auto user_id : user_ids)
+        {
+            const auto* entry = cache_.get(user_id, now);
+            if (!entry)
+                misses.push_back(user_id);
+            else if (entry->has_value())
+                res.emplace(user_id, **entry);
+        }
+        if (misses.empty())
+            return res;
+
+        // Retrieve any missing IDs in a single batch. Clients requesting the
+        // same IDs concurrently share the query
+        std::sort(misses.begin(), misses.end());
+        misses.erase(std::unique(misses.begin(), misses.end()), misses.end());
+        auto db_res = username_lookups_.run(
+            user_ids_key(misses),
+            [this, &misses, tr](boost::asio::yield_context yield) {
+                auto db_res = traced_call(tr, [&] { return inner_->get_usernames(misses, yield); });
+
+                // Store the results. IDs that are not present don't exist
+                if (db_res.has_value())
+                {
+                    for (auto user_id : misses)
+                    {
+                        auto it = db_res->find(user_id);
+                        store(user_id, it == db_res->end() ? std::nullopt : std::optional(it->second));
+                    }
+                }
+                return db_res;
+            },
+            yield
+        );
+        if (db_res.has_error())
+            return std::move(db_res).error();
+
+        res.merge(*db_res);
+        return res;
+    }
+
+    result_with_message<std::vector<room>> get_rooms(boost::asio::yield_context yield) final override
+    {
+        return inner_->get_rooms(yield);
+    }
+
+    result_with_message<std::vector<room>> get_user_rooms(
+        std::int64_t user_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_user_rooms(user_id, yield);
+    }
+
+    result_with_message<room> join_room(
+        std::int64_t user_id,
+        std::string_view room_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->join_room(user_id, room_id, yield);
+    }
+
+    error_with_message archive_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->archive_messages(room_id, messages, yield);
+    }
+
+    result_with_message<std::vector<message>> get_archived_messages(
+        std::string_view room_id,
+        std::optional<std::string_view> before_id,
+        std::size_t max_count,
+        bool allow_replica,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_archived_messages(room_id, before_id, max_count, allow_replica, yield);
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<mysql_client> chat::create_caching_mysql_client(
+    std::unique_ptr<mysql_client> inner,
+    std::size_t max_size,
+    std::chrono::seconds ttl,
+    std::chrono::seconds negative_ttl
+)
+{
+    return std::unique_ptr<mysql_client>{
+        new caching_mysql_client(std::move(inner), max_size, ttl, negative_ttl)
+    };
+}
@@ -7,13 +7,25 @@
 
 #include "services/cookie_auth_service.hpp"
 
-#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "error.hpp"
 #include "services/mysql_client.hpp"
+#include "services/pubsub_service.hpp"
 #include "services/redis_client.hpp"
 #include "services/session_store.hpp"
+#include "services/session_token.hpp"
+#include "util/bloom_filter.hpp"
 #include "util/cookie.hpp"
+#include "util/lru_cache.hpp"
+#include "util/metrics.hpp"
+#include "util/single_flight.hpp"
 
 using namespace chat;
 namespace http = boost::beast::http;
@@ -21,46 +33,128 @@ namespace http = boost::beast::http;
 static constexpr std::string_view session_cookie_name = "sid";
 static constexpr std::chrono::seconds session_duration(3600 * 24 * 7);  // 7 days
 
-result_with_message<std::string> cookie_auth_service::generate_session_cookie(
-    std::int64_t user_id,
-    boost::asio::yield_context yield
-)
+// The pubsub topic used to notify all shards that a session has been invalidated.
+// Messages contain the session ID or token
+static constexpr std::string_view invalidation_topic = "$session-invalidation";
+
+// The Redis sorted set with the IDs of revoked tokens, scored by the tokens' expiry
+static constexpr std::string_view revocation_key = "revoked_session_tokens";
+
+namespace chat {
+
+// Caches the users associated to session IDs, and tracks the lookups in progress.
+// Subscribed to invalidation_topic, so sessions are removed from all shards on logout
+class cookie_auth_service::session_cache final : public message_subscriber
 {
-    // Generate a session token
-    session_store store{*redis_};
-    auto session_id_result = store.generate_session_id(user_id, session_duration, yield);
-    if (session_id_result.has_error())
-        return std::move(session_id_result).error();
+public:
+    using cache_type = lru_cache<std::string, user>;
 
-    // Generate the cookie to be set
-    return set_cookie_builder(session_cookie_name, *session_id_result)
-        .http_only(true)
-        .same_site(same_site_t::strict)
-        .max_age(session_duration)
-        .build_header();
-}
+    cache_type entries;
+    std::chrono::seconds ttl;
 
-result_with_message<std::int64_t> cookie_auth_service::user_id_from_cookie(
-    const boost::beast::http::fields& req,
-    boost::asio::yield_context yield
-)
+    // Concurrent lookups for the same session share a single call
+    single_flight<result_with_message<user>> lookups;
+
+    // Incremented each time a session is invalidated. Lookups that were in progress
+    // when this happened don't cache their results, since they may be stale
+    std::uint64_t generation{0};
+
+    // The IDs of revoked tokens, if tokens are enabled. Reloaded from Redis every revocation_refresh.
+    // Tokens revoked by this server are added as soon as they're revoked
+    const session_token_signer* signer;
+    bloom_filter revoked;
+    bool revoked_loaded{false};
+    std::chrono::steady_clock::time_point next_revocation_load{};
+    std::chrono::seconds revocation_refresh;
+    single_flight<bool> revocation_loads;
+
+    // Tokens revoked while a load is in progress, which the load may miss
+    bool revocation_load_in_progress{false};
+    std::vector<std::string> revoked_during_load;
+
+    session_cache(
+        std::size_t max_size,
+        std::chrono::seconds ttl,
+        const session_token_signer* signer,
+        std::chrono::seconds revocation_refresh
+    )
+        : entries(max_size), ttl(ttl), signer(signer), revocation_refresh(revocation_refresh)
+    {
+    }
+
+    void invalidate(const std::string& session_id)
+    {
+        entries.erase(session_id);
+        lookups.forget(session_id);
+        ++generation;
+    }
+
+    void revoke(std::string token_id)
+    {
+        revoked.add(token_id);
+        if (revocation_load_in_progress)
+            revoked_during_load.push_back(std::move(token_id));
+    }
+
+    void on_message(std::shared_ptr<const framed_message> message) override final
+    {
+        auto payload = message->payload();
+        if (signer && is_session_token(payload))
+        {
+            // Expired tokens don't need to be revoked
+            auto claims = signer->verify(payload, std::chrono::system_clock::now());
+            if (claims.has_value())
+                revoke(std::move(claims->token_id));
+        }
+        else
+        {
+            invalidate(std::string(payload));
+        }
+    }
+};
+
+}  // namespace chat
+
+// Retrieves the session ID from the request cookies, if present
+static std::optional<std::string_view> find_session_id(const http::fields& req)
 {
     // Get the Cookie header from the request
     auto it = req.find(http::field::cookie);
     if (it == req.end())
-        CHAT_RETURN_ERROR_WITH_MESSAGE(errc::requires_auth, "")
+        return std::nullopt;
 
     // Retrieve the session cookie
-    cookie_list cookies(it->value());
-    auto cookie_it = std::find_if(cookies.begin(), cookies.end(), [](const cookie_pair& p) {
-        return p.name == session_cookie_name;
-    });
-    if (cookie_it == cookies.end())
-        CHAT_RETURN_ERROR_WITH_MESSAGE(errc::requires_auth, "")
+    return cookie_list(it->value()).find_cookie(session_cookie_name);
+}
 
+cookie_auth_service::cookie_auth_service(
+    redis_client& redis,
+    mysql_client& mysql,
+    pubsub_service& pubsub,
+    std::size_t cache_size,
+    std::chrono::seconds cache_ttl,
+    const session_token_signer* signer,
+    std::chrono::seconds revocation_refresh
+)
+    : redis_(&redis),
+      mysql_(&mysql),
+      pubsub_(&pubsub),
+      signer_(signer),
+      cache_(std::make_shared<session_cache>(cache_size, cache_ttl, signer, revocation_refresh))
+{
+    pubsub_->subscribe(cache_, {&invalidation_topic, 1u});
+}
+
+cookie_auth_service::~cookie_auth_service() { pubsub_->unsubscribe(*cache_); }
+
+result_with_message<user> cookie_auth_service::lookup_session_uncached(
+    std::string_view session_id,
+    boost::asio::yield_context yield
+)
+{
     // Look it up in Redis
     session_store store{*redis_};
-    auto result = store.get_user_by_session(cookie_it->value, yield);
+    auto result = store.get_user_by_session(session_id, yield);
     if (result.has_error())
     {
         auto err = std::move(result).error();
@@ -69,7 +163,148 @@ result_with_message<std::int64_t> cookie_auth_service::user_id_from_cookie(
         else
             return err;
     }
-    return result.value();
+
+    // Retrieve the user
+    return mysql_->get_user_by_id(*result, yield);
+}
+
+result_with_message<user> cookie_auth_service::lookup_session(
+    std::string_view session_id,
+    boost::asio::yield_context yield
+)
+{
+    using cache_type = session_cache::cache_type;
+    std::string key(session_id);
+
+    // Cache lookup
+    const auto* entry = cache_->entries.get(key, cache_type::clock_type::now());
+    if (entry)
+        return *entry;
+
+    // Cache miss. If somebody else is already looking up this session, wait for them
+    return cache_->lookups.run(
+        key,
+        [&](boost::asio::yield_context yield) {
+            auto generation = cache_->generation;
+            auto res = lookup_session_uncached(session_id, yield);
+
+            // Store the result, unless a session was invalidated meanwhile
+            if (res.has_value() && cache_->ttl.count() > 0 && cache_->generation == generation)
+                cache_->entries.put(key, *res, cache_type::clock_type::now() + cache_->ttl);
+            return res;
+        },
+        yield
+    );
+}
+
+// Reloads the revoked tokens from Redis, if they haven't been loaded
+// for revocation_refresh. Returns whether they're loaded
+bool cookie_auth_service::load_revocations(boost::asio::yield_context yield)
+{
+    if (std::chrono::steady_clock::now() < cache_->next_revocation_load)
+        return cache_->revoked_loaded;
+
+    return cache_->revocation_loads.run(
+        "",
+        [this](boost::asio::yield_context yield) {
+            cache_->revocation_load_in_progress = true;
+            auto members = redis_->get_expiring_set(revocation_key, yield);
+            cache_->revocation_load_in_progress = false;
+            cache_->next_revocation_load = std::chrono::steady_clock::now() + cache_->revocation_refresh;
+
+            // On error, keep the old filter (if any), and try again later
+            if (members.has_error())
+            {
+                log_error(members.error(), "Loading revoked session tokens");
+                cache_->revoked_during_load.clear();
+                return cache_->revoked_loaded;
+            }
+
+            // Rebuild the filter, so it doesn't keep expired tokens
+            bloom_filter filter(members->size() * 2u);
+            for (const auto& token_id : *members)
+                filter.add(token_id);
+            for (const auto& token_id : cache_->revoked_during_load)
+                filter.add(token_id);
+            cache_->revoked_during_load.clear();
+            cache_->revoked = std::move(filter);
+            cache_->revoked_loaded = true;
+            return true;
+        },
+        yield
+    );
+}
+
+result_with_message<bool> cookie_auth_service::is_token_revoked(
+    std::string_view token_id,
+    boost::asio::yield_context yield
+)
+{
+    // Tokens not in the filter are not revoked. If we couldn't load it, we need to ask Redis
+    if (load_revocations(yield) && !cache_->revoked.contains(token_id))
+        return false;
+
+    // The token may be revoked (or it's a false positive). Redis knows for sure
+    increment_counter(counter_id::session_revocation_checks);
+    return redis_->expiring_set_contains(revocation_key, token_id, yield);
+}
+
+result_with_message<user> cookie_auth_service::verify_token(
+    std::string_view token,
+    boost::asio::yield_context yield
+)
+{
+    auto claims = signer_->verify(token, std::chrono::system_clock::now());
+    if (claims.has_error())
+        CHAT_RETURN_ERROR_WITH_MESSAGE(claims.error(), "")
+
+    auto revoked = is_token_revoked(claims->token_id, yield);
+    if (revoked.has_error())
+        return std::move(revoked).error();
+    if (*revoked)
+        CHAT_RETURN_ERROR_WITH_MESSAGE(errc::requires_auth, "")
+
+    return user{claims->user_id, std::move(claims->username)};
+}
+
+result_with_message<std::string> cookie_auth_service::generate_session_cookie(
+    std::int64_t user_id,
+    std::string_view username,
+    boost::asio::yield_context yield
+)
+{
+    // Generate a session token. Signed tokens don't need to be stored
+    std::string session_id;
+    if (signer_)
+    {
+        session_id = signer_->sign(user_id, username, std::chrono::system_clock::now() + session_duration);
+    }
+    else
+    {
+        session_store store{*redis_};
+        auto session_id_result = store.generate_session_id(user_id, session_duration, yield);
+        if (session_id_result.has_error())
+            return std::move(session_id_result).error();
+        session_id = std::move(*session_id_result);
+    }
+
+    // Generate the cookie to be set
+    return set_cookie_builder(session_cookie_name, session_id)
+        .http_only(true)
+        .same_site(same_site_t::strict)
+        .max_age(session_duration)
+        .build_header();
+}
+
+result_with_message<std::int64_t> cookie_auth_service::user_id_from_cookie(
+    const boost::beast::http::fields& req,
+    boost::asio::yield_context yield
+)
+{
+    auto res = user_from_cookie(req, yield);
+    if (res.has_error())
+        return std::move(res).error();
+    return res->id;
 }
 
 result_with_message<user> cookie_auth_service::user_from_cookie(
@@ -77,8 +312,50 @@ result_with_message<user> cookie_auth_service::user_from_cookie(
     boost::asio::yield_context yield
 )
 {
-    auto user_id_result = user_id_from_cookie(req_headers, yield);
-    if (user_id_result.has_error())
-        return std::move(user_id_result).error();
-    return mysql_->get_user_by_id(*user_id_result, yield);
+    auto session_id = find_session_id(req_headers);
+    if (!session_id.has_value())
+        CHAT_RETURN_ERROR_WITH_MESSAGE(errc::requires_auth, "")
+    if (signer_ && is_session_token(*session_id))
+        return verify_token(*session_id, yield);
+    return lookup_session(*session_id, yield);
+}
+
+result_with_message<std::string> cookie_auth_service::invalidate_session_cookie(
+    const boost::beast::http::fields& req_headers,
+    boost::asio::yield_context yield
+)
+{
+    auto session_id = find_session_id(req_headers);
+    if (signer_ && session_id.has_value() && is_session_token(*session_id))
+    {
+        // Revoke it until it expires. Invalid and expired tokens don't need to be revoked
+        auto claims = signer_->verify(*session_id, std::chrono::system_clock::now());
+        if (claims.has_value())
+        {
+            auto err = redis_->add_to_expiring_set(revocation_key, claims->token_id, claims->expiry, yield);
+            if (err.ec)
+                return err;
+
+            // Add it to the filters of all shards, including ours
+            pubsub_->publish(invalidation_topic, std::string(*session_id));
+        }
+    }
+    else if (session_id.has_value())
+    {
+        // Remove it from Redis
+        session_store store{*redis_};
+        auto err = store.invalidate_session(*session_id, yield);
+        if (err.ec)
+            return err;
+
+        // Remove it from the session caches of all shards, including ours
+        pubsub_->publish(invalidation_topic, std::string(*session_id));
+    }
+
+    // Instruct the client to remove the cookie
+    return set_cookie_builder(session_cookie_name, "")
+        .http_only(true)
+        .same_site(same_site_t::strict)
+        .max_age(std::chrono::seconds(0))
+        .build_header();
 }
@@ -0,0 +1,95 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/drain_controller.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+drain_controller::drain_controller(boost::asio::any_io_executor ex)
+    : rng_(std::random_device{}()), idle_timer_(std::move(ex))
+{
+}
+
+std::chrono::milliseconds drain_controller::random_reconnect_delay()
+{
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> dist(0, max_reconnect_delay_.count());
+    return std::chrono::milliseconds(dist(rng_));
+}
+
+void drain_controller::remove(drainable* obj) noexcept
+{
+    drainables_.erase(obj);
+    notify_if_idle();
+}
+
+void drain_controller::finish_operation() noexcept
+{
+    --pending_operations_;
+    notify_if_idle();
+}
+
+void drain_controller::notify_if_idle() noexcept
+{
+    if (draining_ && drainables_.empty() && pending_operations_ == 0u)
+        idle_timer_.cancel();
+}
+
+drain_controller::registration drain_controller::add(drainable& obj)
+{
+    drainables_.insert(&obj);
+    if (draining_)
+    {
+        // Late registrations happen during a request, so we shouldn't call obj from here
+        boost::asio::post(idle_timer_.get_executor(), [this, ptr = &obj, delay = random_reconnect_delay()] {
+            if (drainables_.count(ptr))
+                ptr->on_drain(delay);
+        });
+    }
+    return registration(&obj, registration_deleter{this});
+}
+
+void drain_controller::start(std::chrono::milliseconds max_reconnect_delay)
+{
+    if (draining_)
+        return;
+    draining_ = true;
+    max_reconnect_delay_ = max_reconnect_delay;
+
+    // Copy the objects, in case any of them unregisters while being notified
+    std::vector<drainable*> objs(drainables_.begin(), drainables_.end());
+    for (auto* obj : objs)
+        obj->on_drain(random_reconnect_delay());
+}
+
+bool drain_controller::wait_idle(
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!drainables_.empty() || pending_operations_ != 0u)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+
+        // The wait is cancelled by notify_if_idle
+        error_code ec;
+        idle_timer_.expires_at(deadline);
+        idle_timer_.async_wait(yield[ec]);
+    }
+    return true;
+}
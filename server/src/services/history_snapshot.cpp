@@ -0,0 +1,398 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/history_snapshot.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/crc.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/room_history_cache.hpp"
+#include "services/startup.hpp"
+#include "timestamp.hpp"
+#include "util/bounded_thread_pool.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+// The file starts with a header:
+//    magic number (8 bytes)
+//    format version (4 bytes)
+//    CRC-32 of the body (4 bytes)
+//    size of the body (8 bytes)
+// Followed by the body:
+//    number of rooms (4 bytes)
+//    for each room: ID length (2 bytes), ID, has_more (1 byte), number of messages (4 bytes),
+//       and each message, newest first: ID length (2 bytes), ID, content length (4 bytes),
+//       content, timestamp in milliseconds (8 bytes), user ID (8 bytes)
+//    number of usernames (4 bytes)
+//    for each username: user ID (8 bytes), username length (2 bytes), username
+// Integers use the native byte order, so files can't be moved between architectures.
+// Changing the layout requires bumping the version, so files written by older servers are ignored
+static constexpr std::uint64_t snapshot_magic = 0x504e534854414843u;  // "CHATHSNP"
+static constexpr std::uint32_t snapshot_version = 1u;
+static constexpr std::size_t header_size = 24u;
+
+static error_code errno_code() { return error_code(errno, boost::system::system_category()); }
+
+template <class T>
+static T load(const unsigned char* from) noexcept
+{
+    T res;
+    std::memcpy(&res, from, sizeof(T));
+    return res;
+}
+
+template <class T>
+static void store(unsigned char* to, T value) noexcept
+{
+    std::memcpy(to, &value, sizeof(T));
+}
+
+template <class T>
+static void append(std::string& to, T value)
+{
+    char buff[sizeof(T)];
+    std::memcpy(buff, &value, sizeof(T));
+    to.append(buff, sizeof(T));
+}
+
+// Appends a string prefixed by its length, as a SizeType
+template <class SizeType>
+static void append_string(std::string& to, std::string_view value)
+{
+    append(to, static_cast<SizeType>(value.size()));
+    to.append(value);
+}
+
+static std::uint32_t checksum(const unsigned char* first, std::size_t size) noexcept
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(first, size);
+    return crc.checksum();
+}
+
+namespace {
+
+// Reads values from the body of a snapshot. Reading past the end sets an error flag
+class body_reader
+{
+    const unsigned char* p_;
+    std::size_t remaining_;
+    bool ok_{true};
+
+    bool consume(std::size_t size) noexcept
+    {
+        if (!ok_ || remaining_ < size)
+            return ok_ = false;
+        remaining_ -= size;
+        return true;
+    }
+
+public:
+    body_reader(const unsigned char* data, std::size_t size) noexcept : p_(data), remaining_(size) {}
+
+    bool ok() const noexcept { return ok_; }
+    bool done() const noexcept { return ok_ && remaining_ == 0u; }
+
+    template <class T>
+    T read() noexcept
+    {
+        if (!consume(sizeof(T)))
+            return T{};
+        auto res = load<T>(p_);
+        p_ += sizeof(T);
+        return res;
+    }
+
+    template <class SizeType>
+    std::string_view read_string() noexcept
+    {
+        auto size = read<SizeType>();
+        if (!consume(size))
+            return {};
+        std::string_view res(reinterpret_cast<const char*>(p_), size);
+        p_ += size;
+        return res;
+    }
+};
+
+}  // namespace
+
+history_snapshot_builder::history_snapshot_builder()
+{
+    // Leave space for the number of rooms, which is known once we're done
+    append(body_, num_rooms_);
+}
+
+void history_snapshot_builder::begin_room(std::string_view room_id, bool has_more, std::size_t num_messages)
+{
+    append_string<std::uint16_t>(body_, room_id);
+    append(body_, static_cast<std::uint8_t>(has_more));
+    append(body_, static_cast<std::uint32_t>(num_messages));
+    ++num_rooms_;
+}
+
+void history_snapshot_builder::add_message(const message& msg)
+{
+    append_string<std::uint16_t>(body_, msg.id);
+    append_string<std::uint32_t>(body_, msg.content);
+    append(body_, static_cast<std::int64_t>(serialize_timestamp(msg.timestamp)));
+    append(body_, msg.user_id);
+}
+
+void history_snapshot_builder::add_username(std::int64_t user_id, std::string_view username)
+{
+    usernames_.emplace_back(user_id, username);
+}
+
+std::string history_snapshot_builder::finish()
+{
+    // Complete the body
+    store(reinterpret_cast<unsigned char*>(&body_[0]), num_rooms_);
+    append(body_, static_cast<std::uint32_t>(usernames_.size()));
+    for (const auto& u : usernames_)
+    {
+        append(body_, u.first);
+        append_string<std::uint16_t>(body_, u.second);
+    }
+
+    // Compose the file
+    std::string res(header_size, '\0');
+    auto* header = reinterpret_cast<unsigned char*>(&res[0]);
+    store(header, snapshot_magic);
+    store(header + 8, snapshot_version);
+    store(header + 12, checksum(reinterpret_cast<const unsigned char*>(body_.data()), body_.size()));
+    store(header + 16, static_cast<std::uint64_t>(body_.size()));
+    res += body_;
+    body_.clear();
+    return res;
+}
+
+history_snapshot::~history_snapshot()
+{
+    if (data_)
+        ::munmap(data_, size_);
+}
+
+bool history_snapshot::parse()
+{
+    // Header
+    const auto* p = static_cast<const unsigned char*>(data_);
+    if (size_ < header_size || load<std::uint64_t>(p) != snapshot_magic)
+        return false;
+    if (load<std::uint32_t>(p + 8) != snapshot_version || load<std::uint64_t>(p + 16) != size_ - header_size)
+        return false;
+    if (load<std::uint32_t>(p + 12) != checksum(p + header_size, size_ - header_size))
+        return false;
+
+    // Body. Counts are checked against the file size before reserving space,
+    // so a bogus count can't make us allocate huge amounts of memory
+    body_reader reader(p + header_size, size_ - header_size);
+    auto num_rooms = reader.read<std::uint32_t>();
+    if (num_rooms > size_)
+        return false;
+    rooms_.reserve(num_rooms);
+    for (std::uint32_t i = 0; i < num_rooms && reader.ok(); ++i)
+    {
+        history_snapshot_room room{};
+        room.id = reader.read_string<std::uint16_t>();
+        room.has_more = reader.read<std::uint8_t>() != 0u;
+        auto num_messages = reader.read<std::uint32_t>();
+        if (num_messages > size_)
+            return false;
+        room.messages.reserve(num_messages);
+        for (std::uint32_t j = 0; j < num_messages && reader.ok(); ++j)
+        {
+            message_view msg{};
+            msg.id = reader.read_string<std::uint16_t>();
+            msg.content = reader.read_string<std::uint32_t>();
+            msg.timestamp = parse_timestamp(reader.read<std::int64_t>());
+            msg.user_id = reader.read<std::int64_t>();
+            room.messages.push_back(msg);
+        }
+        rooms_.push_back(std::move(room));
+    }
+
+    auto num_usernames = reader.read<std::uint32_t>();
+    if (num_usernames > size_)
+        return false;
+    usernames_.reserve(num_usernames);
+    for (std::uint32_t i = 0; i < num_usernames && reader.ok(); ++i)
+    {
+        auto user_id = reader.read<std::int64_t>();
+        usernames_.emplace_back(user_id, reader.read_string<std::uint16_t>());
+    }
+
+    return reader.done();
+}
+
+result<std::unique_ptr<history_snapshot>> history_snapshot::open(const std::string& path)
+{
+    // The destructor releases the mapping if anything fails
+    std::unique_ptr<history_snapshot> res(new history_snapshot());
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        CHAT_RETURN_ERROR(errno_code())
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        auto ec = errno_code();
+        ::close(fd);
+        CHAT_RETURN_ERROR(ec)
+    }
+    res->size_ = static_cast<std::size_t>(st.st_size);
+    if (res->size_ < header_size)
+    {
+        ::close(fd);
+        CHAT_RETURN_ERROR(errc::snapshot_corrupted)
+    }
+
+    // Map it. The mapping stays valid after closing the file, and even if it's replaced
+    void* vp = ::mmap(nullptr, res->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto ec = vp == MAP_FAILED ? errno_code() : error_code();
+    ::close(fd);
+    if (ec)
+        CHAT_RETURN_ERROR(ec)
+    res->data_ = vp;
+
+    // Snapshots are read once, from start to end
+    ::madvise(vp, res->size_, MADV_SEQUENTIAL);
+
+    if (!res->parse())
+        CHAT_RETURN_ERROR(errc::snapshot_corrupted)
+    return res;
+}
+
+error_code chat::write_history_snapshot(const std::string& path, std::string_view contents)
+{
+    // Write the temporary file
+    auto tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        CHAT_RETURN_ERROR(errno_code())
+    error_code ec;
+    while (!contents.empty())
+    {
+        auto written = ::write(fd, contents.data(), contents.size());
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ec = errno_code();
+            break;
+        }
+        contents.remove_prefix(static_cast<std::size_t>(written));
+    }
+
+    // Make sure the contents reach the disk before the rename does
+    if (!ec && ::fsync(fd) != 0)
+        ec = errno_code();
+    if (::close(fd) != 0 && !ec)
+        ec = errno_code();
+
+    // Replace the old file
+    if (!ec && ::rename(tmp_path.c_str(), path.c_str()) != 0)
+        ec = errno_code();
+    if (ec)
+    {
+        ::unlink(tmp_path.c_str());
+        CHAT_RETURN_ERROR(ec)
+    }
+    return error_code();
+}
+
+history_snapshotter::history_snapshotter(
+    boost::asio::any_io_executor ex,
+    room_history_cache& cache,
+    bounded_thread_pool& pool,
+    const startup_tracker& startup,
+    std::string path
+)
+    : cache_(&cache),
+      pool_(&pool),
+      startup_(&startup),
+      path_(std::move(path)),
+      timer_(std::move(ex)),
+      interval_(get_env_size("HISTORY_SNAPSHOT_INTERVAL", 60u))
+{
+}
+
+error_code history_snapshotter::write_snapshot(boost::asio::yield_context yield)
+{
+    // A cache that is still warming up would yield an incomplete snapshot. This includes caches
+    // warmed up from a snapshot: entries are skipped until they're reloaded from the databases
+    if (!startup_->history_reloaded())
+        return error_code();
+
+    // Serialize the cache in its shard, then write the file in the pool
+    history_snapshot_builder builder;
+    cache_->save_snapshot(builder);
+    auto contents = std::make_shared<const std::string>(builder.finish());
+    auto res = pool_->run([this, contents] { return write_history_snapshot(path_, *contents); }, yield);
+    if (res.has_error())
+        return res.error();
+    return *res;
+}
+
+void history_snapshotter::run(boost::asio::yield_context yield)
+{
+    error_code ec;
+    while (true)
+    {
+        // Wait until the next run. If the timer wait errored, we were cancelled
+        timer_.expires_after(interval_);
+        timer_.async_wait(yield[ec]);
+
+        // Errors are logged and retried in the next run
+        auto write_ec = write_snapshot(yield);
+        if (write_ec)
+            log_error(write_ec, "Writing the history snapshot");
+        if (ec || cancelled_)
+            return;
+    }
+}
+
+void history_snapshotter::start_run()
+{
+    boost::asio::spawn(
+        timer_.get_executor(),
+        [this](boost::asio::yield_context yield) { run(yield); },
+        [](std::exception_ptr exc) {
+            if (exc)
+                std::rethrow_exception(exc);
+        }
+    );
+}
+
+void history_snapshotter::cancel()
+{
+    cancelled_ = true;
+    timer_.cancel();
+}
@@ -0,0 +1,195 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/redis_client.hpp"
+#include "services/search_index.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Decorates a redis_client, adding the messages it stores to a search index.
+// Messages are indexed with the IDs they were stored with, once they've been stored
+class indexing_redis_client final : public redis_client
+{
+    std::unique_ptr<redis_client> inner_;
+    sharded_search_index& index_;
+
+    void index_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        const std::vector<std::string>& ids
+    )
+    {
+        if (ids.size() != messages.size())
+            return;
+        // Messages that couldn't be stored have an empty ID
+        std::vector<message> msgs;
+        msgs.reserve(messages.size());
+        for (std::size_t i = 0; i < messages.size(); ++i)
+        {
+            if (ids[i].empty())
+                continue;
+            msgs.push_back(messages[i]);
+            msgs.back().id = ids[i];
+        }
+        index_.add_messages(room_id, msgs);
+    }
+
+public:
+    indexing_redis_client(std::unique_ptr<redis_client> inner, sharded_search_index& index)
+        : inner_(std::move(inner)), index_(index)
+    {
+    }
+
+    void start_run() final override { inner_->start_run(); }
+
+    void cancel() final override { inner_->cancel(); }
+
+    result_with_message<std::vector<message_batch>> get_room_history(
+        boost::span<const room_histoy_request> reqs,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_room_history(reqs, pref, yield);
+    }
+
+    result_with_message<std::vector<boost::redis::resp3::node>> get_room_history_nodes(
+        const room_histoy_request& req,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_room_history_nodes(req, pref, yield);
+    }
+
+    result_with_message<std::vector<std::string>> store_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        auto res = inner_->store_messages(room_id, messages, yield);
+        if (res.has_value())
+            index_messages(room_id, messages, *res);
+        return res;
+    }
+
+    result_with_message<std::vector<std::string>> store_messages_with_ids(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        auto res = inner_->store_messages_with_ids(room_id, messages, yield);
+        if (res.has_value())
+            index_messages(room_id, messages, *res);
+        return res;
+    }
+
+    result_with_message<std::vector<message>> get_oldest_messages(
+        std::string_view room_id,
+        std::size_t keep_count,
+        std::size_t max_count,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_oldest_messages(room_id, keep_count, max_count, yield);
+    }
+
+    error_with_message trim_messages(
+        std::string_view room_id,
+        std::string_view min_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->trim_messages(room_id, min_id, yield);
+    }
+
+    error_with_message set_nonexisting_key(
+        std::string_view key,
+        std::string_view value,
+        std::chrono::seconds ttl,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->set_nonexisting_key(key, value, ttl, yield);
+    }
+
+    result_with_message<std::int64_t> get_int_key(std::string_view key, boost::asio::yield_context yield)
+        final override
+    {
+        return inner_->get_int_key(key, yield);
+    }
+
+    error_with_message delete_key(std::string_view key, boost::asio::yield_context yield) final override
+    {
+        return inner_->delete_key(key, yield);
+    }
+
+    result_with_message<bool> take_tokens(
+        std::string_view key,
+        token_bucket_params params,
+        double cost,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->take_tokens(key, params, cost, yield);
+    }
+
+    error_with_message add_to_expiring_set(
+        std::string_view key,
+        std::string_view member,
+        std::chrono::system_clock::time_point expiry,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->add_to_expiring_set(key, member, expiry, yield);
+    }
+
+    result_with_message<std::vector<std::string>> get_expiring_set(
+        std::string_view key,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_expiring_set(key, yield);
+    }
+
+    result_with_message<bool> expiring_set_contains(
+        std::string_view key,
+        std::string_view member,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->expiring_set_contains(key, member, yield);
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<redis_client> chat::create_indexing_redis_client(
+    std::unique_ptr<redis_client> inner,
+    sharded_search_index& index
+)
+{
+    return std::unique_ptr<redis_client>{new indexing_redis_client(std::move(inner), index)};
+}
@@ -0,0 +1,128 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/login_rate_limiter.hpp"
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/network_v6.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+#include "services/redis_client.hpp"
+#include "util/metrics.hpp"
+
+using namespace chat;
+
+// IPv6 clients usually get a whole /64, so limiting individual addresses is pointless
+static constexpr unsigned short ipv6_prefix_length = 64u;
+
+std::string chat::login_limit_ip_key(const boost::asio::ip::address& addr)
+{
+    std::string res = "login-limit:ip:";
+    if (addr.is_v6())
+    {
+        auto v6 = addr.to_v6();
+        if (v6.is_v4_mapped())
+            res += boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, v6).to_string();
+        else
+            res += boost::asio::ip::make_network_v6(v6, ipv6_prefix_length).canonical().to_string();
+    }
+    else
+    {
+        res += addr.to_string();
+    }
+    return res;
+}
+
+std::string chat::login_limit_email_key(std::string_view email)
+{
+    // Emails are case-insensitive for login purposes
+    std::string res = "login-limit:email:";
+    for (char c : email)
+        res.push_back(c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c);
+    return res;
+}
+
+login_rate_limiter::login_rate_limiter(redis_client& redis, const config& cfg)
+    : redis_(&redis),
+      cfg_(cfg),
+      local_ip_buckets_(cfg.local_cache_size),
+      local_email_buckets_(cfg.local_cache_size)
+{
+}
+
+bool login_rate_limiter::take_tokens(
+    bucket_cache& local_buckets,
+    const std::string& key,
+    const token_bucket_params& params,
+    double cost,
+    boost::asio::yield_context yield
+)
+{
+    // The local bucket only sees this shard's attempts, so it holds at least
+    // as many tokens as the global one. If it rejects, Redis would too
+    auto now = token_bucket::clock_type::now();
+    const auto* cached = local_buckets.get(key, now);
+    token_bucket bucket = cached ? *cached : token_bucket(params.capacity, now);
+    bool allowed = bucket.try_take(params, cost, now);
+    if (cost != 0.0)
+        local_buckets.put(key, bucket, now + params.time_to_full());
+    if (!allowed)
+        return false;
+
+    // Check the global bucket. Being unable to contact Redis shouldn't prevent legitimate logins
+    auto res = redis_->take_tokens(key, params, cost, yield);
+    if (res.has_error())
+    {
+        increment_counter(counter_id::login_rate_limiter_errors);
+        log_error(res.error(), "Checking login rate limits");
+        return true;
+    }
+    return res.value();
+}
+
+login_limit_result login_rate_limiter::check_attempt(
+    const boost::asio::ip::address& client_address,
+    std::string_view email,
+    boost::asio::yield_context yield
+)
+{
+    if (!cfg_.enabled)
+        return login_limit_result::allowed;
+
+    if (!take_tokens(local_ip_buckets_, login_limit_ip_key(client_address), cfg_.per_ip, 1.0, yield))
+    {
+        increment_counter(counter_id::login_rate_limited_ip);
+        return login_limit_result::ip_limited;
+    }
+
+    // Don't take any token here: only failures are charged
+    if (!take_tokens(local_email_buckets_, login_limit_email_key(email), cfg_.per_email_failures, 0.0, yield))
+    {
+        increment_counter(counter_id::login_rate_limited_email);
+        return login_limit_result::email_limited;
+    }
+
+    return login_limit_result::allowed;
+}
+
+void login_rate_limiter::record_failure(std::string_view email, boost::asio::yield_context yield)
+{
+    if (cfg_.enabled)
+        take_tokens(local_email_buckets_, login_limit_email_key(email), cfg_.per_email_failures, 1.0, yield);
+}
+
+std::chrono::seconds login_rate_limiter::retry_after(login_limit_result res) const noexcept
+{
+    // The time until a token becomes available again, for an empty bucket
+    const auto& params = res == login_limit_result::email_limited ? cfg_.per_email_failures : cfg_.per_ip;
+    return std::chrono::seconds(static_cast<long long>(std::ceil(1.0 / params.refill_per_second)));
+}
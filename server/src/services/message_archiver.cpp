@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/message_archiver.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <string_view>
+
+#include "error.hpp"
+#include "message_id.hpp"
+#include "services/mysql_client.hpp"
+#include "services/redis_client.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+namespace {
+
+class message_archiver_impl final : public message_archiver
+{
+    redis_client* redis_;
+    mysql_client* mysql_;
+    boost::asio::steady_timer timer_;
+    bool cancelled_{false};
+
+    // How often archiving runs
+    std::chrono::seconds interval_;
+
+    // Number of messages to keep in Redis for each room
+    std::size_t keep_messages_;
+
+    // Maximum number of messages to move in a single step
+    std::size_t batch_size_;
+
+    // Archives old messages for a single room, in batches, until only keep_messages_ are left
+    error_with_message archive_room(std::string_view room_id, boost::asio::yield_context yield)
+    {
+        while (!cancelled_)
+        {
+            // Retrieve the messages to archive, oldest first
+            auto msgs = redis_->get_oldest_messages(room_id, keep_messages_, batch_size_, yield);
+            if (msgs.has_error())
+                return std::move(msgs).error();
+            if (msgs->empty())
+                return {};
+
+            // Store them in MySQL. This must happen before trimming, or messages could be lost
+            auto ec = mysql_->archive_messages(room_id, *msgs, yield);
+            if (ec.ec)
+                return ec;
+
+            // Remove them from Redis. MINID is inclusive, so we pass the ID after the last archived message
+            auto last_id = parse_message_id(msgs->back().id);
+            if (!last_id)
+                CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+            ec = redis_->trim_messages(room_id, format_message_id({last_id->ms, last_id->seq + 1u}), yield);
+            if (ec.ec)
+                return ec;
+
+            // If we got less messages than requested, we're done
+            if (msgs->size() < batch_size_)
+                return {};
+        }
+        return {};
+    }
+
+    void run(boost::asio::yield_context yield)
+    {
+        error_code ec;
+        while (!cancelled_)
+        {
+            // Wait until the next run. If the timer wait errored, we were cancelled
+            timer_.expires_after(interval_);
+            timer_.async_wait(yield[ec]);
+            if (ec)
+                return;
+
+            // Rooms may be created at any time, so we retrieve them on every run
+            auto rooms = mysql_->get_rooms(yield);
+            if (rooms.has_error())
+            {
+                log_error(rooms.error(), "Archiving messages: retrieving rooms");
+                continue;
+            }
+
+            // Archive each room. Errors are logged and retried in the next run
+            for (const auto& r : *rooms)
+            {
+                auto err = archive_room(r.id, yield);
+                if (err.ec)
+                    log_error(err, "Archiving messages");
+            }
+        }
+    }
+
+public:
+    message_archiver_impl(
+        boost::asio::any_io_executor ex,
+        redis_client& redis,
+        mysql_client& mysql
+    )
+        : redis_(&redis),
+          mysql_(&mysql),
+          timer_(std::move(ex)),
+          interval_(get_env_size("ARCHIVE_INTERVAL", 60u)),
+          keep_messages_(get_env_size("ARCHIVE_KEEP_MESSAGES", 1000u)),
+          batch_size_(get_env_size("ARCHIVE_BATCH_SIZE", 500u))
+    {
+        // Redis must always hold, at least, a full history batch
+        if (keep_messages_ < redis_client::message_batch_size)
+            keep_messages_ = redis_client::message_batch_size;
+        if (batch_size_ == 0u)
+            batch_size_ = 1u;
+    }
+
+    void start_run() override final
+    {
+        boost::asio::spawn(
+            timer_.get_executor(),
+            [this](boost::asio::yield_context yield) { run(yield); },
+            [](std::exception_ptr exc) {
+                if (exc)
+                    std::rethrow_exception(exc);
+            }
+        );
+    }
+
+    void cancel() override final
+    {
+        cancelled_ = true;
+        timer_.cancel();
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<message_archiver> chat::create_message_archiver(
+    boost::asio::any_io_executor ex,
+    redis_client& redis,
+    mysql_client& mysql
+)
+{
+    return std::unique_ptr<message_archiver>{new message_archiver_impl(std::move(ex), redis, mysql)};
+}
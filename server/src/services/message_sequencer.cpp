@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/message_sequencer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+#include "message_id.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+parsed_message_id message_sequencer::to_message_id(std::uint64_t state) const noexcept
+{
+    constexpr std::uint64_t counter_mask = (std::uint64_t(1) << counter_bits) - 1u;
+    return {state >> counter_bits, ((state & counter_mask) << node_bits) | node_number_};
+}
+
+parsed_message_id message_sequencer::next(std::uint64_t now_ms) noexcept
+{
+    // The first ID in the current millisecond, unless we already generated IDs
+    // for it (or for a later one, if the clock went backwards)
+    auto now_state = now_ms << counter_bits;
+    auto last = last_.load(std::memory_order_relaxed);
+    std::uint64_t res = 0u;
+    do
+    {
+        res = (std::max)(last + 1u, now_state);
+    } while (!last_.compare_exchange_weak(last, res, std::memory_order_relaxed));
+    return to_message_id(res);
+}
+
+parsed_message_id message_sequencer::next() noexcept
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    return next(static_cast<std::uint64_t>(now_ms));
+}
+
+void message_sequencer::observe(parsed_message_id id) noexcept
+{
+    // The next ID will have a greater counter, and thus a greater sequence number,
+    // whatever the node number that generated id. Sequence numbers that don't fit
+    // in our representation move us to the next millisecond
+    auto counter = id.seq >> node_bits;
+    auto state = (counter >> counter_bits) != 0u ? (id.ms + 1u) << counter_bits
+                                                : (id.ms << counter_bits) | counter;
+    auto last = last_.load(std::memory_order_relaxed);
+    while (last < state)
+    {
+        if (last_.compare_exchange_weak(last, state, std::memory_order_relaxed))
+            break;
+    }
+}
+
+bool chat::node_number_configured()
+{
+    return get_env_size("NODE_NUMBER", message_sequencer::max_node_number + 1u) <=
+           message_sequencer::max_node_number;
+}
+
+message_sequencer& chat::global_message_sequencer()
+{
+    static message_sequencer res(
+        get_env_size("NODE_NUMBER", std::random_device{}() & message_sequencer::max_node_number)
+    );
+    return res;
+}
@@ -0,0 +1,392 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/message_spool.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+#include <boost/crc.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/redis_serialization.hpp"
+#include "timestamp.hpp"
+#include "util/env.hpp"
+#include "util/run_on.hpp"
+
+using namespace chat;
+
+// The file starts with a header:
+//    magic number (8 bytes)
+//    generation (8 bytes)
+//    offset of the oldest record (8 bytes)
+//    reserved (8 bytes)
+// Followed by records:
+//    size of the body (4 bytes)
+//    CRC-32 of the generation and the body (4 bytes)
+//    generation (8 bytes)
+//    body: room ID length (2 bytes), room ID, message ID length (2 bytes),
+//          message ID, message serialized with serialize_redis_message.
+// Records are only valid if their generation matches the header's, so records left
+// before the space was reused are never mistaken for valid ones.
+static constexpr std::uint64_t spool_magic = 0x314c505354414843u;  // "CHATSPL1"
+static constexpr std::size_t header_size = 32u;
+static constexpr std::size_t record_header_size = 16u;
+
+static error_code errno_code() { return error_code(errno, boost::system::system_category()); }
+
+template <class T>
+static T load(const unsigned char* from) noexcept
+{
+    T res;
+    std::memcpy(&res, from, sizeof(T));
+    return res;
+}
+
+template <class T>
+static void store(unsigned char* to, T value) noexcept
+{
+    std::memcpy(to, &value, sizeof(T));
+}
+
+static std::uint32_t checksum(const unsigned char* first, std::size_t size) noexcept
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(first, size);
+    return crc.checksum();
+}
+
+message_spool::~message_spool()
+{
+    if (data_)
+        ::munmap(data_, capacity_);
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+std::optional<message_spool::record> message_spool::read_record(std::size_t offset) const
+{
+    // Header
+    if (capacity_ - offset < record_header_size)
+        return std::nullopt;
+    const unsigned char* p = data_ + offset;
+    auto body_size = load<std::uint32_t>(p);
+    auto crc = load<std::uint32_t>(p + 4);
+    auto generation = load<std::uint64_t>(p + 8);
+    if (body_size == 0u || generation != generation_ || body_size > capacity_ - offset - record_header_size)
+        return std::nullopt;
+    if (checksum(p + 8, body_size + 8u) != crc)
+        return std::nullopt;
+
+    // Body. Reads a length-prefixed string
+    std::string_view body(reinterpret_cast<const char*>(p + record_header_size), body_size);
+    auto read_string = [&body](std::string_view& to) {
+        if (body.size() < 2u)
+            return false;
+        auto size = load<std::uint16_t>(reinterpret_cast<const unsigned char*>(body.data()));
+        if (body.size() - 2u < size)
+            return false;
+        to = body.substr(2u, size);
+        body.remove_prefix(2u + size);
+        return true;
+    };
+    std::string_view room_id, id;
+    if (!read_string(room_id) || !read_string(id))
+        return std::nullopt;
+    auto msg = deserialize_redis_message(body);
+    if (msg.has_error())
+        return std::nullopt;
+    msg->id = id;
+
+    return record{
+        {std::string(room_id), std::move(*msg)},
+        offset + record_header_size + body_size
+    };
+}
+
+void message_spool::write_header() noexcept
+{
+    store(data_, spool_magic);
+    store(data_ + 8, generation_);
+    store(data_ + 16, static_cast<std::uint64_t>(read_offset_));
+    store(data_ + 24, std::uint64_t(0u));
+    flush(0u, header_size);
+}
+
+void message_spool::flush(std::size_t offset, std::size_t size) noexcept
+{
+    if (!sync_)
+        return;
+
+    // msync requires a page-aligned address
+    static const std::size_t page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    auto first = offset / page_size * page_size;
+    ::msync(data_ + first, offset + size - first, MS_SYNC);  // Errors are ignored
+}
+
+result<std::unique_ptr<message_spool>> message_spool::open(
+    const std::string& path,
+    std::size_t capacity,
+    bool sync
+)
+{
+    // The destructor releases the resources acquired here if anything fails
+    std::unique_ptr<message_spool> res(new message_spool());
+    res->sync_ = sync;
+
+    // Open the file. Its size is kept if it's bigger than capacity, so no record is lost
+    res->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (res->fd_ == -1)
+        CHAT_RETURN_ERROR(errno_code())
+    struct stat st;
+    if (::fstat(res->fd_, &st) != 0)
+        CHAT_RETURN_ERROR(errno_code())
+    auto file_size = static_cast<std::size_t>(st.st_size);
+    res->capacity_ = (std::max)(file_size, capacity);
+    if (res->capacity_ < header_size + record_header_size)
+        CHAT_RETURN_ERROR(errc::invalid_config)
+    if (file_size < res->capacity_ && ::ftruncate(res->fd_, static_cast<off_t>(res->capacity_)) != 0)
+        CHAT_RETURN_ERROR(errno_code())
+
+    // Map it. Changes are written to the file by the kernel
+    void* vp = ::mmap(nullptr, res->capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, res->fd_, 0);
+    if (vp == MAP_FAILED)
+        CHAT_RETURN_ERROR(errno_code())
+    res->data_ = static_cast<unsigned char*>(vp);
+
+    // A file we just created only contains zeros
+    auto magic = load<std::uint64_t>(res->data_);
+    if (file_size == 0u || (magic == 0u && load<std::uint64_t>(res->data_ + 8) == 0u))
+    {
+        res->generation_ = 1u;
+        res->read_offset_ = res->write_offset_ = header_size;
+        res->write_header();
+        return res;
+    }
+
+    // Otherwise, it should contain a valid header
+    res->generation_ = load<std::uint64_t>(res->data_ + 8);
+    auto read_offset = load<std::uint64_t>(res->data_ + 16);
+    if (magic != spool_magic || read_offset < header_size || read_offset > res->capacity_)
+        CHAT_RETURN_ERROR(errc::spool_corrupted)
+    res->read_offset_ = static_cast<std::size_t>(read_offset);
+
+    // Find the end of the valid records. Anything after it was left by a crash and is discarded
+    std::size_t offset = res->read_offset_;
+    while (auto rec = res->read_record(offset))
+    {
+        offset = rec->next_offset;
+        ++res->depth_;
+    }
+    res->write_offset_ = offset;
+
+    // If there is nothing to replay, the space can be reused
+    if (res->depth_ == 0u)
+    {
+        ++res->generation_;
+        res->read_offset_ = res->write_offset_ = header_size;
+        res->write_header();
+    }
+
+    return res;
+}
+
+error_code message_spool::append(std::string_view room_id, boost::span<const message> messages)
+{
+    // Serialize the bodies. IDs and room IDs are short
+    std::vector<std::string> payloads;
+    payloads.reserve(messages.size());
+    std::size_t total_size = 0u;
+    for (const auto& msg : messages)
+    {
+        if (room_id.size() > 0xffffu || msg.id.size() > 0xffffu)
+            CHAT_RETURN_ERROR(errc::spool_full)
+        payloads.push_back(serialize_redis_message(msg));
+        total_size += record_header_size + 4u + room_id.size() + msg.id.size() + payloads.back().size();
+    }
+
+    if (total_size > capacity_ - write_offset_)
+        CHAT_RETURN_ERROR(errc::spool_full)
+
+    // Write the records. The body goes first, so a record is complete when it becomes valid
+    auto first_offset = write_offset_;
+    for (std::size_t i = 0; i < messages.size(); ++i)
+    {
+        unsigned char* p = data_ + write_offset_;
+        unsigned char* body = p + record_header_size;
+        store(body, static_cast<std::uint16_t>(room_id.size()));
+        std::memcpy(body + 2, room_id.data(), room_id.size());
+        body += 2u + room_id.size();
+        store(body, static_cast<std::uint16_t>(messages[i].id.size()));
+        std::memcpy(body + 2, messages[i].id.data(), messages[i].id.size());
+        body += 2u + messages[i].id.size();
+        std::memcpy(body, payloads[i].data(), payloads[i].size());
+        body += payloads[i].size();
+
+        auto body_size = static_cast<std::uint32_t>(body - p - record_header_size);
+        store(p + 8, generation_);
+        store(p + 4, checksum(p + 8, body_size + 8u));
+        store(p, body_size);
+        write_offset_ += record_header_size + body_size;
+    }
+    depth_ += messages.size();
+    flush(first_offset, write_offset_ - first_offset);
+
+    return {};
+}
+
+std::vector<spooled_message> message_spool::peek(std::size_t max_messages) const
+{
+    std::vector<spooled_message> res;
+    res.reserve((std::min)(max_messages, depth_));
+    std::size_t offset = read_offset_;
+    while (res.size() < max_messages && offset < write_offset_)
+    {
+        auto rec = read_record(offset);
+        if (!rec)
+            break;
+        res.push_back(std::move(rec->value));
+        offset = rec->next_offset;
+    }
+    return res;
+}
+
+void message_spool::pop(std::size_t num_messages)
+{
+    for (std::size_t i = 0; i < num_messages && depth_ > 0u; ++i)
+    {
+        auto rec = read_record(read_offset_);
+        if (!rec)
+            break;
+        read_offset_ = rec->next_offset;
+        --depth_;
+    }
+
+    // Reuse the space once everything has been replayed
+    if (depth_ == 0u)
+    {
+        ++generation_;
+        read_offset_ = write_offset_ = header_size;
+    }
+    write_header();
+}
+
+bool message_spool::empty() const { return depth_ == 0u; }
+
+spool_stats message_spool::stats() const
+{
+    spool_stats res{depth_, write_offset_ - read_offset_, capacity_ - header_size, {}};
+    if (depth_ > 0u)
+    {
+        auto rec = read_record(read_offset_);
+        if (rec)
+        {
+            auto age = timestamp_t::clock::now() - rec->value.msg.timestamp;
+            auto age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(age);
+            res.lag = (std::max)(age_ms, std::chrono::milliseconds::zero());
+        }
+    }
+    return res;
+}
+
+shared_message_spool::shared_message_spool(
+    std::unique_ptr<message_spool> spool,
+    boost::asio::any_io_executor owner
+)
+    : spool_(std::move(spool)), owner_(std::move(owner)), capacity_bytes_(spool_->stats().capacity_bytes)
+{
+    update_stats();
+}
+
+void shared_message_spool::update_stats() noexcept
+{
+    // The lag changes with time, so we store the timestamp it was computed from
+    auto st = spool_->stats();
+    auto oldest = timestamp_t::clock::now() - st.lag;
+    oldest_timestamp_.store(serialize_timestamp(oldest), std::memory_order_relaxed);
+    used_bytes_.store(st.used_bytes, std::memory_order_relaxed);
+    depth_.store(st.depth, std::memory_order_relaxed);
+}
+
+error_code shared_message_spool::append(
+    std::string_view room_id,
+    boost::span<const message> messages,
+    boost::asio::yield_context yield
+)
+{
+    return run_on(
+        owner_,
+        [&] {
+            auto ec = spool_->append(room_id, messages);
+            if (!ec)
+                update_stats();
+            return ec;
+        },
+        yield
+    );
+}
+
+void shared_message_spool::pop(std::size_t num_messages)
+{
+    spool_->pop(num_messages);
+    update_stats();
+}
+
+spool_stats shared_message_spool::stats() const noexcept
+{
+    spool_stats res{
+        depth_.load(std::memory_order_relaxed),
+        used_bytes_.load(std::memory_order_relaxed),
+        capacity_bytes_,
+        {},
+    };
+    if (res.depth > 0u)
+    {
+        auto oldest = parse_timestamp(oldest_timestamp_.load(std::memory_order_relaxed));
+        auto age = std::chrono::duration_cast<std::chrono::milliseconds>(timestamp_t::clock::now() - oldest);
+        res.lag = (std::max)(age, std::chrono::milliseconds::zero());
+    }
+    return res;
+}
+
+std::unique_ptr<shared_message_spool> chat::create_shared_message_spool(boost::asio::any_io_executor owner)
+{
+    auto path = get_env_string("REDIS_SPOOL_PATH", "");
+    if (path.empty())
+        return nullptr;
+    auto spool = message_spool::open(
+        path,
+        get_env_size("REDIS_SPOOL_SIZE_MB", 64u) * 1024u * 1024u,
+        get_env_bool("REDIS_SPOOL_SYNC", false)
+    );
+    if (spool.has_error())
+    {
+        log_error(spool.error(), "Opening the message spool");
+        return nullptr;
+    }
+    return std::make_unique<shared_message_spool>(std::move(*spool), std::move(owner));
+}
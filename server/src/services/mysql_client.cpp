@@ -12,29 +12,55 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/core/span.hpp>
 #include <boost/describe/class.hpp>
 #include <boost/mysql/any_address.hpp>
 #include <boost/mysql/any_connection.hpp>
 #include <boost/mysql/common_server_errc.hpp>
 #include <boost/mysql/connection.hpp>
 #include <boost/mysql/connection_pool.hpp>
+#include <boost/mysql/defaults.hpp>
 #include <boost/mysql/diagnostics.hpp>
+#include <boost/mysql/field_view.hpp>
+#include <boost/mysql/format_sql.hpp>
 #include <boost/mysql/handshake_params.hpp>
 #include <boost/mysql/results.hpp>
+#include <boost/mysql/pooled_connection.hpp>
+#include <boost/mysql/sequence.hpp>
+#include <boost/mysql/statement.hpp>
 #include <boost/mysql/static_results.hpp>
 #include <boost/mysql/tcp.hpp>
 #include <boost/mysql/with_params.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "boost/mysql/connect_params.hpp"
 #include "business_types.hpp"
 #include "business_types_metadata.hpp"  // Required by static_results
 #include "error.hpp"
+#include "message_id.hpp"
+#include "rooms.hpp"
+#include "timestamp.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+#include "util/tracing.hpp"
 
 using namespace chat;
 namespace mysql = boost::mysql;
@@ -55,36 +81,92 @@ CREATE TABLE IF NOT EXISTS users (
     password TEXT NOT NULL,
     UNIQUE (username),
     UNIQUE (email)
+);
+CREATE TABLE IF NOT EXISTS messages (
+    room_id VARCHAR(100) NOT NULL,
+    id_ms BIGINT UNSIGNED NOT NULL,
+    id_seq BIGINT UNSIGNED NOT NULL,
+    user_id BIGINT NOT NULL,
+    content TEXT NOT NULL,
+    timestamp BIGINT NOT NULL,
+    PRIMARY KEY (room_id, id_ms, id_seq)
+);
+CREATE TABLE IF NOT EXISTS rooms (
+    id VARCHAR(100) PRIMARY KEY,
+    name VARCHAR(100) NOT NULL,
+    is_default BOOLEAN NOT NULL DEFAULT FALSE,
+    display_order INT NOT NULL DEFAULT 0
+);
+CREATE TABLE IF NOT EXISTS room_members (
+    user_id BIGINT NOT NULL,
+    room_id VARCHAR(100) NOT NULL,
+    PRIMARY KEY (user_id, room_id)
 )
 
 )SQL";
 
-// Returns the hostname to connect to. Defaults to localhost
-static std::string get_mysql_hostname()
-{
-    const char* host_c_str = std::getenv("MYSQL_HOST");
-    return host_c_str ? host_c_str : "localhost";
-}
+// The database our tables live in. Created by setup_code
+static constexpr std::string_view database_name = "servertech_chat";
 
-// Returns the default pool params to use.
-// This should be improved when implementing
-// https://github.com/anarthal/servertech-chat/issues/45
-static mysql::pool_params get_pool_params()
+// Configuration for a connection pool, read from environment variables
+struct pool_config
 {
-    mysql::pool_params res{
-        // The server address. We get the hostname fron an environment
-        // variable, and use the default port.
-        mysql::host_and_port{get_mysql_hostname()},
-
-        // The username to log in as
-        "root",
+    std::string hostname;
+    unsigned short port;
+    std::string username;
+    std::string password;
+    std::size_t initial_size;
+    std::size_t max_size;
+    std::chrono::seconds connect_timeout;
+    std::chrono::seconds retry_interval;
+    std::chrono::seconds ping_interval;
+};
 
-        // The password
-        "",
+// Loads the configuration for a pool. Variables are named <prefix><name> (e.g. MYSQL_HOST).
+// Variables that are not set take their values from defaults, if not null
+static pool_config load_pool_config(std::string_view prefix, const pool_config* defaults)
+{
+    auto var = [prefix](std::string_view name) {
+        std::string res{prefix};
+        res += name;
+        return res;
+    };
+    auto get_string = [&](std::string_view name, std::string_view default_value) {
+        return get_env_string(var(name).c_str(), default_value);
+    };
+    auto get_size = [&](std::string_view name, std::size_t default_value) {
+        return get_env_size(var(name).c_str(), default_value);
+    };
+    auto get_seconds = [&](std::string_view name, std::chrono::seconds default_value) {
+        return std::chrono::seconds(get_size(name, default_value.count()));
+    };
 
-        // The database to use
-        "servertech_chat",
+    return pool_config{
+        get_string("HOST", defaults ? defaults->hostname : "localhost"),
+        static_cast<unsigned short>(get_size("PORT", defaults ? defaults->port : mysql::default_port)),
+        get_string("USER", defaults ? defaults->username : "root"),
+        get_string("PASSWORD", defaults ? defaults->password : ""),
+        get_size("POOL_INITIAL_SIZE", defaults ? defaults->initial_size : 1u),
+        get_size("POOL_MAX_SIZE", defaults ? defaults->max_size : 16u),
+        get_seconds("CONNECT_TIMEOUT", defaults ? defaults->connect_timeout : std::chrono::seconds(20)),
+        get_seconds("RETRY_INTERVAL", defaults ? defaults->retry_interval : std::chrono::seconds(2)),
+        get_seconds("PING_INTERVAL", defaults ? defaults->ping_interval : std::chrono::seconds(3600)),
     };
+}
+
+// Returns the pool params to use for a certain configuration
+static mysql::pool_params get_pool_params(const pool_config& cfg)
+{
+    mysql::pool_params res;
+    res.server_address = mysql::host_and_port{cfg.hostname, cfg.port};
+    res.username = cfg.username;
+    res.password = cfg.password;
+    res.database = database_name;
+    res.initial_size = cfg.initial_size;
+    res.max_size = (std::max)(cfg.max_size, cfg.initial_size);
+    res.connect_timeout = cfg.connect_timeout;
+    res.retry_interval = cfg.retry_interval;
+    res.ping_interval = cfg.ping_interval;
 
     // Since our server will be running in the same node as the web server,
     // we don't need any encryption
@@ -93,11 +175,382 @@ static mysql::pool_params get_pool_params()
     return res;
 }
 
+// Frequent queries are run as server-side prepared statements, which avoids
+// formatting and parsing them on every execution. Statements are prepared lazily,
+// and cached per connection.
+// get_usernames takes a variable number of IDs, so it uses a statement per arity bucket:
+// bucket k has 2^k parameters, and unused parameters are filled repeating the last ID.
+// Lists bigger than the biggest bucket are run as text queries.
+static constexpr std::size_t num_usernames_buckets = 8;  // up to 128 IDs
+static constexpr std::size_t max_prepared_usernames = std::size_t(1) << (num_usernames_buckets - 1);
+
+enum class stmt_id : std::size_t
+{
+    create_user,
+    get_user_by_email,
+    update_password,
+    get_user_by_id,
+    get_user_rooms,
+    get_room_by_id,
+    insert_room_member,
+    get_usernames_bucket0,  // Must be the last one
+};
+
+static constexpr std::size_t num_statements =
+    static_cast<std::size_t>(stmt_id::get_usernames_bucket0) + num_usernames_buckets;
+
+// Returns the statement to use to look up num_ids usernames, and its number of parameters.
+// num_ids must be between 1 and max_prepared_usernames
+static std::pair<stmt_id, std::size_t> usernames_statement(std::size_t num_ids)
+{
+    assert(num_ids > 0u && num_ids <= max_prepared_usernames);
+    std::size_t bucket = 0;
+    while ((std::size_t(1) << bucket) < num_ids)
+        ++bucket;
+    return {
+        static_cast<stmt_id>(static_cast<std::size_t>(stmt_id::get_usernames_bucket0) + bucket),
+        std::size_t(1) << bucket,
+    };
+}
+
+// Returns the SQL for the given statement
+static std::string statement_sql(stmt_id id)
+{
+    switch (id)
+    {
+    case stmt_id::create_user:
+        return "INSERT INTO users (username, email, password) VALUES (?, ?, ?)";
+    case stmt_id::get_user_by_email:
+        // static_results requires that SQL field names
+        // match with C++ struct field names, so we use SQL aliases
+        return "SELECT id, username, password AS hashed_password FROM users WHERE email = ?";
+    case stmt_id::update_password: return "UPDATE users SET password = ? WHERE id = ? AND password = ?";
+    case stmt_id::get_user_by_id:
+        return "SELECT id, username FROM users WHERE id = ?";
+    case stmt_id::get_user_rooms:
+        // Default rooms, plus the ones the user joined
+        return "SELECT r.id, r.name FROM rooms r "
+               "LEFT JOIN room_members m ON m.room_id = r.id AND m.user_id = ? "
+               "WHERE r.is_default OR m.user_id IS NOT NULL ORDER BY r.display_order, r.id";
+    case stmt_id::get_room_by_id: return "SELECT id, name FROM rooms WHERE id = ?";
+    case stmt_id::insert_room_member:
+        // Joining a room twice is not an error
+        return "INSERT IGNORE INTO room_members (user_id, room_id) VALUES (?, ?)";
+    default:
+    {
+        // A get_usernames bucket
+        auto bucket = static_cast<std::size_t>(id) - static_cast<std::size_t>(stmt_id::get_usernames_bucket0);
+        std::size_t num_params = std::size_t(1) << bucket;
+        std::string res = "SELECT id, username FROM users WHERE id IN (?";
+        for (std::size_t i = 1; i < num_params; ++i)
+            res += ", ?";
+        res += ')';
+        return res;
+    }
+    }
+}
+
+// Maps an er_dup_entry error inserting a user to errc::username_exists or errc::email_exists.
+// As per MySQL documentation, error messages for er_dup_entry are formatted as:
+// Duplicate entry '%s' for key %d. Returns an empty error_code for other keys
+static error_code duplicate_user_error(const mysql::diagnostics& diag)
+{
+    if (diag.server_message().ends_with("'users.username'"))
+        return errc::username_exists;
+    else if (diag.server_message().ends_with("'users.email'"))
+        return errc::email_exists;
+    return error_code();
+}
+
+// Composes room objects, without history, from (id, name) rows
+static std::vector<room> to_rooms(boost::span<const std::tuple<std::string, std::string>> rows)
+{
+    std::vector<room> res;
+    res.reserve(rows.size());
+    for (const auto& row : rows)
+        res.push_back(room{std::get<0>(row), std::get<1>(row), {}});
+    return res;
+}
+
 namespace {
 
+// The prepared statements for a connection, indexed by stmt_id
+using connection_statements = std::array<std::optional<mysql::statement>, num_statements>;
+
+// The prepared statements of a connection's session. Statement IDs are only valid
+// within the session that prepared them, and are reused by later sessions. If the
+// pool re-establishes the connection, the connection ID changes, and the statements are discarded
+struct session_statements
+{
+    std::optional<std::uint32_t> connection_id;
+    connection_statements statements;
+};
+
+// The prepared statements for each connection in the pool
+using statement_cache = std::unordered_map<const mysql::any_connection*, session_statements>;
+
+// The metrics of a connection pool. Only the thread running the pool writes them,
+// so updates don't need read-modify-write operations. Atomics are still
+// required because get_mysql_pool_stats reads them from other threads
+struct pool_counters
+{
+    mysql_pool_kind kind;
+    std::atomic<std::size_t> max_size{};
+    std::atomic<std::size_t> in_use{};
+    std::atomic<std::size_t> peak_in_use{};
+    std::atomic<std::uint64_t> checkouts{};
+    std::atomic<std::uint64_t> checkout_errors{};
+    std::atomic<std::int64_t> total_wait_us{};
+    std::atomic<std::int64_t> max_wait_us{};
+    std::atomic<std::uint64_t> resets{};
+
+    explicit pool_counters(mysql_pool_kind kind) noexcept : kind(kind) {}
+
+    mysql_pool_stats load() const noexcept
+    {
+        mysql_pool_stats res;
+        res.max_size = max_size.load(std::memory_order_relaxed);
+        res.in_use = in_use.load(std::memory_order_relaxed);
+        res.peak_in_use = peak_in_use.load(std::memory_order_relaxed);
+        res.checkouts = checkouts.load(std::memory_order_relaxed);
+        res.checkout_errors = checkout_errors.load(std::memory_order_relaxed);
+        res.total_wait = std::chrono::microseconds(total_wait_us.load(std::memory_order_relaxed));
+        res.max_wait = std::chrono::microseconds(max_wait_us.load(std::memory_order_relaxed));
+        res.resets = resets.load(std::memory_order_relaxed);
+        return res;
+    }
+};
+
+// Single-writer updates
+template <class T>
+static void add(std::atomic<T>& value, T n) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+template <class T>
+static void subtract(std::atomic<T>& value, T n) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+}
+
+template <class T>
+static void raise_to(std::atomic<T>& value, T n) noexcept
+{
+    if (n > value.load(std::memory_order_relaxed))
+        value.store(n, std::memory_order_relaxed);
+}
+
+// The counters of all the pools ever created, so they can be added together.
+// Counters are never destroyed, so checkouts performed by clients
+// that have been destroyed are still exported
+class pool_registry
+{
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<pool_counters>> pools_;
+
+public:
+    pool_counters& create(mysql_pool_kind kind)
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        pools_.push_back(std::make_unique<pool_counters>(kind));
+        return *pools_.back();
+    }
+
+    mysql_pool_stats total(mysql_pool_kind kind)
+    {
+        mysql_pool_stats res;
+        std::lock_guard<std::mutex> guard(mtx_);
+        for (const auto& pool : pools_)
+        {
+            if (pool->kind != kind)
+                continue;
+            auto stats = pool->load();
+            res.max_size += stats.max_size;
+            res.in_use += stats.in_use;
+            res.peak_in_use += stats.peak_in_use;
+            res.checkouts += stats.checkouts;
+            res.checkout_errors += stats.checkout_errors;
+            res.total_wait += stats.total_wait;
+            res.max_wait = (std::max)(res.max_wait, stats.max_wait);
+            res.resets += stats.resets;
+        }
+        return res;
+    }
+};
+
+static pool_registry& global_pool_registry()
+{
+    static pool_registry res;
+    return res;
+}
+
+// A connection pool, together with its metrics
+struct instrumented_pool
+{
+    mysql::connection_pool pool;
+    pool_counters& stats;
+
+    instrumented_pool(boost::asio::any_io_executor ex, mysql::pool_params params, mysql_pool_kind kind)
+        : pool(std::move(ex), params), stats(global_pool_registry().create(kind))
+    {
+        stats.max_size.store(params.max_size, std::memory_order_relaxed);
+    }
+};
+
+// A connection checked out from the pool. Unless return_without_reset is called,
+// connections are reset when returned to the pool. This deallocates any prepared statements,
+// so the connection's entry in the cache is discarded, too
+class connection_handle
+{
+    mysql::pooled_connection conn_;
+    statement_cache* cache_;
+    pool_counters* stats_;
+
+    void release() noexcept
+    {
+        if (stats_)
+        {
+            subtract(stats_->in_use, std::size_t(1));
+            stats_ = nullptr;
+        }
+    }
+
+public:
+    connection_handle(mysql::pooled_connection conn, statement_cache& cache, pool_counters& stats) noexcept
+        : conn_(std::move(conn)), cache_(&cache), stats_(&stats)
+    {
+        add(stats_->in_use, std::size_t(1));
+        raise_to(stats_->peak_in_use, stats_->in_use.load(std::memory_order_relaxed));
+    }
+    connection_handle(connection_handle&& rhs) noexcept
+        : conn_(std::move(rhs.conn_)), cache_(rhs.cache_), stats_(std::exchange(rhs.stats_, nullptr))
+    {
+    }
+    connection_handle& operator=(connection_handle&&) = delete;
+    ~connection_handle()
+    {
+        if (conn_.valid())
+        {
+            cache_->erase(&conn_.get());
+            if (stats_)
+                add(stats_->resets, std::uint64_t(1));
+        }
+        release();
+    }
+
+    mysql::any_connection* operator->() noexcept { return &conn_.get(); }
+
+    // The prepared statements of the connection's current session
+    connection_statements& statements()
+    {
+        auto& entry = (*cache_)[&conn_.get()];
+        auto connection_id = conn_->connection_id();
+        if (entry.connection_id != connection_id)
+            entry = session_statements{connection_id, {}};
+        return entry.statements;
+    }
+
+    // Returns the connection to the pool, keeping its session state
+    void return_without_reset() noexcept
+    {
+        conn_.return_without_reset();
+        release();
+    }
+
+    // Retrieves the given statement, preparing it if required
+    result_with_message<mysql::statement> get_statement(
+        stmt_id id,
+        mysql::diagnostics& diag,
+        boost::asio::yield_context yield
+    )
+    {
+        auto& slot = statements()[static_cast<std::size_t>(id)];
+        if (!slot)
+        {
+            error_code ec;
+            auto stmt = conn_->async_prepare_statement(statement_sql(id), diag, yield[ec]);
+            if (ec)
+                return error_with_message{ec, diag.server_message()};
+            slot = stmt;
+        }
+        return *slot;
+    }
+
+    // Executes a prepared statement, preparing it if required. bind_fn(const mysql::statement&)
+    // should return the bound statement to execute. If the server no longer knows about the
+    // statement (which shouldn't happen, since statements are tied to the session), prepares it again.
+    // Server errors are written to diag, so they can be inspected by the caller.
+    template <class BindFn, class ResultsType>
+    error_code execute_statement(
+        stmt_id id,
+        BindFn&& bind_fn,
+        ResultsType& result,
+        mysql::diagnostics& diag,
+        boost::asio::yield_context yield
+    )
+    {
+        error_code ec;
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            auto stmt = get_statement(id, diag, yield);
+            if (stmt.has_error())
+                return stmt.error().ec;
+            conn_->async_execute(bind_fn(*stmt), result, diag, yield[ec]);
+            if (ec != mysql::common_server_errc::er_unknown_stmt_handler)
+                break;
+            statements() = connection_statements{};
+        }
+        return ec;
+    }
+};
+
 class mysql_client_impl final : public mysql_client
 {
-    mysql::connection_pool pool_;
+    pool_config write_config_;
+    instrumented_pool write_pool_;
+    instrumented_pool read_pool_;
+    std::optional<instrumented_pool> replica_pool_;  // Only if a replica is configured
+    statement_cache statements_;
+
+    instrumented_pool& get_pool(mysql_pool_kind kind) noexcept
+    {
+        switch (kind)
+        {
+        case mysql_pool_kind::write: return write_pool_;
+        case mysql_pool_kind::replica: return replica_pool_ ? *replica_pool_ : read_pool_;
+        default: return read_pool_;
+        }
+    }
+
+    // Retrieves a connection from the given pool. The wait is recorded as a span if tr is not null
+    result_with_message<connection_handle> get_connection(
+        mysql_pool_kind kind,
+        trace* tr,
+        boost::asio::yield_context yield
+    )
+    {
+        auto& pool = get_pool(kind);
+        mysql::diagnostics diag;
+        error_code ec;
+
+        // Get the connection, measuring how long we had to wait
+        auto start = std::chrono::steady_clock::now();
+        auto conn = pool.pool.async_get_connection(diag, yield[ec]);
+        auto end = std::chrono::steady_clock::now();
+        if (tr)
+            tr->add_span("mysql.get_connection", start, end);
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        add(pool.stats.total_wait_us, static_cast<std::int64_t>(wait.count()));
+        raise_to(pool.stats.max_wait_us, static_cast<std::int64_t>(wait.count()));
+        if (ec)
+        {
+            add(pool.stats.checkout_errors, std::uint64_t(1));
+            return error_with_message{ec, diag.server_message()};
+        }
+        add(pool.stats.checkouts, std::uint64_t(1));
+        return connection_handle(std::move(conn), statements_, pool.stats);
+    }
 
     // Functions to retrieve a MySQL connection with retries.
     // This is only used for the connection required by setup_db.
@@ -106,9 +559,9 @@ class mysql_client_impl final : public mysql_client
         // Connection params to use. Hostname, user and password are the same.
         // The database may not be created when we run this, so we leave it blank.
         mysql::connect_params params{
-            mysql::host_and_port{get_mysql_hostname()},
-            "root",
-            "",
+            mysql::host_and_port{write_config_.hostname, write_config_.port},
+            write_config_.username,
+            write_config_.password,
             "",
         };
         params.ssl = mysql::ssl_mode::disable;
@@ -147,8 +600,88 @@ class mysql_client_impl final : public mysql_client
         }
     }
 
+    // Retrieves the usernames for a non-empty set of IDs from the given pool.
+    // IDs that don't exist are not present in the result
+    result_with_message<username_map> query_usernames(
+        mysql_pool_kind kind,
+        boost::span<const std::int64_t> user_ids,
+        trace* tr,
+        boost::asio::yield_context yield
+    )
+    {
+        mysql::diagnostics diag;
+        error_code ec;
+
+        // Get a connection
+        auto conn = get_connection(kind, tr, yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Execute the query.
+        using row_t = std::tuple<std::int64_t, std::string>;
+        mysql::static_results<row_t> result;
+        if (user_ids.size() <= max_prepared_usernames)
+        {
+            // Use the prepared statement for the bucket. Extra parameters repeat the last ID,
+            // which doesn't alter the result
+            auto [id, num_params] = usernames_statement(user_ids.size());
+            std::array<mysql::field_view, max_prepared_usernames> params;
+            for (std::size_t i = 0; i < num_params; ++i)
+                params[i] = mysql::field_view(user_ids[(std::min)(i, user_ids.size() - 1u)]);
+            ec = conn->execute_statement(
+                id,
+                [&params, num_params = num_params](const mysql::statement& stmt) {
+                    return stmt.bind(params.begin(), params.begin() + num_params);
+                },
+                result,
+                diag,
+                yield
+            );
+        }
+        else
+        {
+            // Too many IDs for a prepared statement.
+            // We can safely do this because we checked that user_ids is not empty.
+            // Otherwise, the client-side generated query wouldn't be valid.
+            (*conn)->async_execute(
+                mysql::with_params("SELECT id, username FROM users WHERE id IN ({})", user_ids),
+                result,
+                diag,
+                yield[ec]
+            );
+        }
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
+        // We didn't do anything modifying the connection state, so we can
+        // explicitly return it, indicating that no reset is required.
+        conn->return_without_reset();
+
+        // Result
+        std::unordered_map<std::int64_t, std::string> res;
+        for (auto& elm : result.rows())
+            res.insert({std::get<0>(elm), std::move(std::get<1>(elm))});
+
+        // Done
+        return res;
+    }
+
 public:
-    mysql_client_impl(boost::asio::any_io_executor ex) : pool_(std::move(ex), get_pool_params()) {}
+    // Both pools connect to the same server, unless MYSQL_READ_HOST is set.
+    // The replica pool is only created if replica_config is set
+    mysql_client_impl(
+        boost::asio::any_io_executor ex,
+        pool_config write_config,
+        const pool_config& read_config,
+        const std::optional<pool_config>& replica_config
+    )
+        : write_config_(std::move(write_config)),
+          write_pool_(ex, get_pool_params(write_config_), mysql_pool_kind::write),
+          read_pool_(ex, get_pool_params(read_config), mysql_pool_kind::read)
+    {
+        if (replica_config)
+            replica_pool_.emplace(ex, get_pool_params(*replica_config), mysql_pool_kind::replica);
+    }
 
     error_with_message setup_db(boost::asio::yield_context yield) final override
     {
@@ -169,6 +702,33 @@ public:
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
+        // Create the default rooms. Rooms that already exist are left untouched
+        std::array<std::size_t, default_room_ids.size()> room_indices{};
+        for (std::size_t i = 0; i < room_indices.size(); ++i)
+            room_indices[i] = i;
+        conn.async_execute(
+            mysql::with_params(
+                "INSERT IGNORE INTO rooms (id, name, is_default, display_order) VALUES {}",
+                mysql::sequence(
+                    room_indices,
+                    [](std::size_t i, mysql::format_context_base& ctx) {
+                        mysql::format_sql_to(
+                            ctx,
+                            "({}, {}, TRUE, {})",
+                            default_room_ids[i],
+                            default_room_names[i],
+                            i
+                        );
+                    }
+                )
+            ),
+            result,
+            diag,
+            yield[ec]
+        );
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
         // Close the connection gracefully. Ignore any errors
         conn.async_close(yield[ec]);
 
@@ -177,17 +737,39 @@ public:
 
     void start_run() override final
     {
-        boost::asio::spawn(
-            pool_.get_executor(),
-            [pool = &pool_](boost::asio::yield_context yield) { pool->async_run(yield); },
-            [](std::exception_ptr exc) {
-                if (exc)
-                    std::rethrow_exception(exc);
-            }
-        );
+        std::vector<mysql::connection_pool*> pools{&write_pool_.pool, &read_pool_.pool};
+        if (replica_pool_)
+            pools.push_back(&replica_pool_->pool);
+        for (auto* pool : pools)
+        {
+            boost::asio::spawn(
+                pool->get_executor(),
+                [pool](boost::asio::yield_context yield) { pool->async_run(yield); },
+                [](std::exception_ptr exc) {
+                    if (exc)
+                        std::rethrow_exception(exc);
+                }
+            );
+        }
     }
 
-    void cancel() override final { pool_.cancel(); }
+    void cancel() override final
+    {
+        write_pool_.pool.cancel();
+        read_pool_.pool.cancel();
+        if (replica_pool_)
+            replica_pool_->pool.cancel();
+    }
+
+    mysql_pool_stats pool_stats(mysql_pool_kind kind) const override final
+    {
+        switch (kind)
+        {
+        case mysql_pool_kind::write: return write_pool_.stats.load();
+        case mysql_pool_kind::replica: return (replica_pool_ ? *replica_pool_ : read_pool_).stats.load();
+        default: return read_pool_.stats.load();
+        }
+    }
 
     result_with_message<std::int64_t> create_user(
         std::string_view username,
@@ -196,37 +778,33 @@ public:
         boost::asio::yield_context yield
     ) final override
     {
+        latency_timer timer(histogram_id::mysql_create_user);
+
         mysql::diagnostics diag;
-        error_code ec;
         mysql::results result;
 
         // Get a connection
-        auto conn = pool_.async_get_connection(diag, yield[ec]);
-        if (ec)
-            return error_with_message{ec, diag.server_message()};
+        auto conn = get_connection(mysql_pool_kind::write, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
 
         // Execute the insertion
-        conn->async_execute(
-            mysql::with_params(
-                "INSERT INTO users (username, email, password) VALUES ({}, {}, {})",
-                username,
-                email,
-                hashed_password
-            ),
+        auto ec = conn->execute_statement(
+            stmt_id::create_user,
+            [&](const mysql::statement& stmt) { return stmt.bind(username, email, hashed_password); },
             result,
             diag,
-            yield[ec]
+            yield
         );
 
         // Detect duplicates
         if (ec == mysql::common_server_errc::er_dup_entry)
         {
-            // As per MySQL documentation, error messages for er_dup_entry
-            // are formatted as: Duplicate entry '%s' for key %d
-            if (diag.server_message().ends_with("'users.username'"))
-                return error_with_message{errc::username_exists, ""};
-            else if (diag.server_message().ends_with("'users.email'"))
-                return error_with_message{errc::email_exists, ""};
+            // A failed insertion doesn't modify the connection state
+            conn->return_without_reset();
+            auto dup_ec = duplicate_user_error(diag);
+            if (dup_ec)
+                return error_with_message{dup_ec, ""};
         }
 
         // Unknown errors
@@ -235,67 +813,280 @@ public:
 
         // Done. MySQL reports last_insert_id as an uint64_t to be able to handle
         // any column type, but our id field is defined as BIGINT (int64).
-        // The connection is returned to the pool automatically. The statement
-        // is deallocated automatically by the connection pool.
+        // Inserting doesn't modify the connection state, so we can
+        // explicitly return it, keeping our prepared statements.
+        conn->return_without_reset();
         return static_cast<std::int64_t>(result.last_insert_id());
     }
 
-    result_with_message<auth_user> get_user_by_email(std::string_view email, boost::asio::yield_context yield)
-        final override
+    result_with_message<std::vector<result<std::int64_t>>> create_users(
+        boost::span<const new_user> users,
+        boost::asio::yield_context yield
+    ) final override
     {
+        latency_timer timer(histogram_id::mysql_create_users);
+
+        // Check that we have one user, at least.
+        // Otherwise, the generated queries wouldn't be valid.
+        std::vector<result<std::int64_t>> res(users.size());
+        if (users.empty())
+            return res;
+
         mysql::diagnostics diag;
         error_code ec;
+        mysql::results result;
 
         // Get a connection
-        auto conn = pool_.async_get_connection(diag, yield[ec]);
+        auto conn = get_connection(mysql_pool_kind::write, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // If any of the following fails, the connection is returned to the pool
+        // without calling return_without_reset. Resetting it rolls the transaction back
+        (*conn)->async_execute("START TRANSACTION", result, diag, yield[ec]);
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
-        // static_results requires that SQL field names
-        // match with C++ struct field names, so we use SQL aliases
+        // Look up the usernames and emails that are already taken, so these users
+        // can be skipped, rather than making the insertion fail
+        std::vector<std::string_view> usernames, emails;
+        usernames.reserve(users.size());
+        emails.reserve(users.size());
+        for (const auto& u : users)
+        {
+            usernames.push_back(u.username);
+            emails.push_back(u.email);
+        }
+        mysql::static_results<std::tuple<std::string, std::string>> existing;
+        (*conn)->async_execute(
+            mysql::with_params(
+                "SELECT username, email FROM users WHERE username IN ({}) OR email IN ({})",
+                usernames,
+                emails
+            ),
+            existing,
+            diag,
+            yield[ec]
+        );
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
+        // Users reusing a username or email, even if it belongs to an earlier user in the list,
+        // are reported as duplicates. The rest are inserted
+        std::unordered_set<std::string_view> taken_usernames, taken_emails;
+        for (const auto& row : existing.rows())
+        {
+            taken_usernames.insert(std::get<0>(row));
+            taken_emails.insert(std::get<1>(row));
+        }
+        std::vector<std::size_t> to_insert;
+        to_insert.reserve(users.size());
+        for (std::size_t i = 0; i < users.size(); ++i)
+        {
+            if (taken_usernames.count(users[i].username))
+                res[i] = error_code(errc::username_exists);
+            else if (taken_emails.count(users[i].email))
+                res[i] = error_code(errc::email_exists);
+            else
+            {
+                taken_usernames.insert(users[i].username);
+                taken_emails.insert(users[i].email);
+                to_insert.push_back(i);
+            }
+        }
+
+        if (!to_insert.empty())
+        {
+            // Insert all the users with a single statement
+            (*conn)->async_execute(
+                mysql::with_params(
+                    "INSERT INTO users (username, email, password) VALUES {}",
+                    mysql::sequence(
+                        to_insert,
+                        [users](std::size_t i, mysql::format_context_base& ctx) {
+                            mysql::format_sql_to(
+                                ctx,
+                                "({}, {}, {})",
+                                users[i].username,
+                                users[i].email,
+                                users[i].hashed_password
+                            );
+                        }
+                    )
+                ),
+                result,
+                diag,
+                yield[ec]
+            );
+
+            if (ec == mysql::common_server_errc::er_dup_entry)
+            {
+                // Another user was created concurrently, or two users differ only in case
+                // (comparisons are case-insensitive). Only the failed statement is rolled back,
+                // so insert the users one by one within the transaction, to find out which ones fail
+                for (auto i : to_insert)
+                {
+                    ec = conn->execute_statement(
+                        stmt_id::create_user,
+                        [&u = users[i]](const mysql::statement& stmt) {
+                            return stmt.bind(u.username, u.email, u.hashed_password);
+                        },
+                        result,
+                        diag,
+                        yield
+                    );
+                    auto dup_ec = ec == mysql::common_server_errc::er_dup_entry ? duplicate_user_error(diag)
+                                                                                : error_code();
+                    if (dup_ec)
+                        res[i] = dup_ec;
+                    else if (ec)
+                        return error_with_message{ec, diag.server_message()};
+                    else
+                        res[i] = static_cast<std::int64_t>(result.last_insert_id());
+                }
+            }
+            else if (ec)
+            {
+                return error_with_message{ec, diag.server_message()};
+            }
+            else
+            {
+                // IDs generated by a multi-row INSERT are not guaranteed to be consecutive
+                // (it depends on innodb_autoinc_lock_mode), so retrieve them
+                std::vector<std::string_view> inserted_emails;
+                inserted_emails.reserve(to_insert.size());
+                for (auto i : to_insert)
+                    inserted_emails.push_back(users[i].email);
+                mysql::static_results<std::tuple<std::int64_t, std::string>> ids;
+                (*conn)->async_execute(
+                    mysql::with_params("SELECT id, email FROM users WHERE email IN ({})", inserted_emails),
+                    ids,
+                    diag,
+                    yield[ec]
+                );
+                if (ec)
+                    return error_with_message{ec, diag.server_message()};
+                std::unordered_map<std::string_view, std::int64_t> ids_by_email;
+                for (const auto& row : ids.rows())
+                    ids_by_email.emplace(std::get<1>(row), std::get<0>(row));
+                for (auto i : to_insert)
+                {
+                    auto it = ids_by_email.find(users[i].email);
+                    if (it == ids_by_email.end())
+                        return error_with_message{errc::not_found, "Inserted user not found"};
+                    res[i] = it->second;
+                }
+            }
+        }
+
+        (*conn)->async_execute("COMMIT", result, diag, yield[ec]);
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
+        // The transaction is over, so the connection state is the same as before.
+        // We can explicitly return it, keeping our prepared statements.
+        conn->return_without_reset();
+        return res;
+    }
+
+    result_with_message<auth_user> get_user_by_email(std::string_view email, boost::asio::yield_context yield)
+        final override
+    {
+        latency_timer timer(histogram_id::mysql_get_user_by_email);
+
+        mysql::diagnostics diag;
+
+        // Get a connection
+        auto conn = get_connection(mysql_pool_kind::read, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Run the query
         mysql::static_results<auth_user> result;
-        conn->async_execute(
-            mysql::with_params("SELECT id, password AS hashed_password FROM users WHERE email = {}", email),
+        auto ec = conn->execute_statement(
+            stmt_id::get_user_by_email,
+            [email](const mysql::statement& stmt) { return stmt.bind(email); },
             result,
             diag,
-            yield[ec]
+            yield
         );
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
-        // Result.
-        // The connection is returned to the pool automatically. The statement
-        // is deallocated automatically by the connection pool.
+        // We didn't do anything modifying the connection state, so we can
+        // explicitly return it, keeping our prepared statements.
+        conn->return_without_reset();
+
+        // Result
         if (result.rows().empty())
             return error_with_message{errc::not_found, ""};
         return std::move(result.rows()[0]);
     }
 
-    result_with_message<user> get_user_by_id(std::int64_t user_id, boost::asio::yield_context yield)
-        final override
+    error_with_message update_password(
+        std::int64_t user_id,
+        std::string_view old_hashed_password,
+        std::string_view new_hashed_password,
+        boost::asio::yield_context yield
+    ) final override
     {
+        latency_timer timer(histogram_id::mysql_update_password);
+
         mysql::diagnostics diag;
-        error_code ec;
+        mysql::results result;
 
         // Get a connection
-        auto conn = pool_.async_get_connection(diag, yield[ec]);
+        auto conn = get_connection(mysql_pool_kind::write, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Run the update. If the password changed in the meantime, no rows are affected
+        auto ec = conn->execute_statement(
+            stmt_id::update_password,
+            [&](const mysql::statement& stmt) {
+                return stmt.bind(new_hashed_password, user_id, old_hashed_password);
+            },
+            result,
+            diag,
+            yield
+        );
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
+        // Updating doesn't modify the connection state
+        conn->return_without_reset();
+        return {};
+    }
+
+    result_with_message<user> get_user_by_id(std::int64_t user_id, boost::asio::yield_context yield)
+        final override
+    {
+        latency_timer timer(histogram_id::mysql_get_user_by_id);
+
+        mysql::diagnostics diag;
+
+        // Get a connection
+        auto conn = get_connection(mysql_pool_kind::read, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
         // Run the query
         mysql::static_results<user> result;
-        conn->async_execute(
-            mysql::with_params("SELECT id, username  FROM users WHERE id = {}", user_id),
+        auto ec = conn->execute_statement(
+            stmt_id::get_user_by_id,
+            [user_id](const mysql::statement& stmt) { return stmt.bind(user_id); },
             result,
             diag,
-            yield[ec]
+            yield
         );
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
-        // Result.
-        // The connection is returned to the pool automatically. The statement
-        // is deallocated automatically by the connection pool.
+        // We didn't do anything modifying the connection state, so we can
+        // explicitly return it, keeping our prepared statements.
+        conn->return_without_reset();
+
+        // Result
         if (result.rows().empty())
             return error_with_message{errc::not_found, ""};
         return std::move(result.rows()[0]);
@@ -306,26 +1097,202 @@ public:
         boost::asio::yield_context yield
     ) final override
     {
+        latency_timer timer(histogram_id::mysql_get_usernames);
+
         // Check that we have one user ID, at least.
         // Otherwise, the generated query may not be valid.
         if (user_ids.empty())
             return {};
 
+        // Usernames never change, so we can read them from a replica
+        auto res = query_usernames(mysql_pool_kind::replica, user_ids, timer.get_trace(), yield);
+        if (res.has_error() || !replica_pool_)
+            return res;
+
+        // A user that is missing from the replica may have been created recently,
+        // and not replicated yet. Callers may cache absences, so confirm them with the primary
+        std::vector<std::int64_t> misses;
+        for (auto user_id : user_ids)
+        {
+            if (!res->count(user_id))
+                misses.push_back(user_id);
+        }
+        if (misses.empty())
+            return res;
+        auto primary_res = query_usernames(mysql_pool_kind::write, misses, timer.get_trace(), yield);
+        if (primary_res.has_error())
+            return std::move(primary_res).error();
+        res->merge(*primary_res);
+        return res;
+    }
+
+    result_with_message<std::vector<room>> get_rooms(boost::asio::yield_context yield) final override
+    {
+        latency_timer timer(histogram_id::mysql_get_rooms);
+
         mysql::diagnostics diag;
         error_code ec;
 
         // Get a connection
-        auto conn = pool_.async_get_connection(diag, yield[ec]);
+        auto conn = get_connection(mysql_pool_kind::read, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Run the query. This is infrequent, so we don't prepare it
+        mysql::static_results<std::tuple<std::string, std::string>> result;
+        (*conn)->async_execute(
+            "SELECT id, name FROM rooms ORDER BY display_order, id",
+            result,
+            diag,
+            yield[ec]
+        );
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
-        // Execute the query.
-        // We can safely do this because we checked that user_ids is not empty.
-        // Otherwise, the client-side generated query wouldn't be valid.
-        using row_t = std::tuple<std::int64_t, std::string>;
-        mysql::static_results<row_t> result;
-        conn->async_execute(
-            mysql::with_params("SELECT id, username FROM users WHERE id IN ({})", user_ids),
+        // We didn't do anything modifying the connection state
+        conn->return_without_reset();
+        return to_rooms(result.rows());
+    }
+
+    result_with_message<std::vector<room>> get_user_rooms(
+        std::int64_t user_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::mysql_get_user_rooms);
+
+        mysql::diagnostics diag;
+
+        // Get a connection
+        auto conn = get_connection(mysql_pool_kind::read, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Run the query
+        mysql::static_results<std::tuple<std::string, std::string>> result;
+        auto ec = conn->execute_statement(
+            stmt_id::get_user_rooms,
+            [user_id](const mysql::statement& stmt) { return stmt.bind(user_id); },
+            result,
+            diag,
+            yield
+        );
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
+        // We didn't do anything modifying the connection state
+        conn->return_without_reset();
+        return to_rooms(result.rows());
+    }
+
+    result_with_message<room> join_room(
+        std::int64_t user_id,
+        std::string_view room_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::mysql_join_room);
+
+        mysql::diagnostics diag;
+
+        // Get a connection. We read the room from the primary, too, so rooms
+        // are visible as soon as they're created
+        auto conn = get_connection(mysql_pool_kind::write, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Check that the room exists
+        mysql::static_results<std::tuple<std::string, std::string>> room_result;
+        auto ec = conn->execute_statement(
+            stmt_id::get_room_by_id,
+            [room_id](const mysql::statement& stmt) { return stmt.bind(room_id); },
+            room_result,
+            diag,
+            yield
+        );
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+        if (room_result.rows().empty())
+        {
+            conn->return_without_reset();
+            return error_with_message{errc::not_found, ""};
+        }
+
+        // Insert the membership
+        mysql::results result;
+        ec = conn->execute_statement(
+            stmt_id::insert_room_member,
+            [user_id, room_id](const mysql::statement& stmt) { return stmt.bind(user_id, room_id); },
+            result,
+            diag,
+            yield
+        );
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
+        // Inserting doesn't modify the connection state
+        conn->return_without_reset();
+        return std::move(to_rooms(room_result.rows()).front());
+    }
+
+    error_with_message archive_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::mysql_archive_messages);
+
+        // Messages are stored with their IDs split in two, so they can be ordered
+        // and compared. Messages with invalid IDs are skipped.
+        struct archived_message
+        {
+            parsed_message_id id;
+            const message* msg;
+        };
+        std::vector<archived_message> rows;
+        rows.reserve(messages.size());
+        for (const auto& msg : messages)
+        {
+            if (auto id = parse_message_id(msg.id))
+                rows.push_back({*id, &msg});
+        }
+
+        // Check that we have one row, at least.
+        // Otherwise, the generated query wouldn't be valid.
+        if (rows.empty())
+            return {};
+
+        mysql::diagnostics diag;
+        error_code ec;
+        mysql::results result;
+
+        // Get a connection
+        auto conn = get_connection(mysql_pool_kind::write, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Insert all messages with a single statement. INSERT IGNORE skips messages
+        // that were already archived (e.g. by another server instance)
+        (*conn)->async_execute(
+            mysql::with_params(
+                "INSERT IGNORE INTO messages (room_id, id_ms, id_seq, user_id, content, timestamp) VALUES {}",
+                mysql::sequence(
+                    rows,
+                    [room_id](const archived_message& row, mysql::format_context_base& ctx) {
+                        mysql::format_sql_to(
+                            ctx,
+                            "({}, {}, {}, {}, {}, {})",
+                            room_id,
+                            row.id.ms,
+                            row.id.seq,
+                            row.msg->user_id,
+                            row.msg->content,
+                            serialize_timestamp(row.msg->timestamp)
+                        );
+                    }
+                )
+            ),
             result,
             diag,
             yield[ec]
@@ -333,16 +1300,92 @@ public:
         if (ec)
             return error_with_message{ec, diag.server_message()};
 
+        // Inserting doesn't modify the connection state
+        conn->return_without_reset();
+        return {};
+    }
+
+    result_with_message<std::vector<message>> get_archived_messages(
+        std::string_view room_id,
+        std::optional<std::string_view> before_id,
+        std::size_t max_count,
+        bool allow_replica,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::mysql_get_archived_messages);
+
+        // An invalid ID can't match any message
+        std::optional<parsed_message_id> parsed_before_id;
+        if (before_id)
+        {
+            parsed_before_id = parse_message_id(*before_id);
+            if (!parsed_before_id)
+                return std::vector<message>{};
+        }
+
+        mysql::diagnostics diag;
+        error_code ec;
+
+        // Get a connection
+        auto pool_kind = allow_replica ? mysql_pool_kind::replica : mysql_pool_kind::read;
+        auto conn = get_connection(pool_kind, timer.get_trace(), yield);
+        if (conn.has_error())
+            return std::move(conn).error();
+
+        // Run the query. The primary key allows retrieving messages in order efficiently
+        using row_t = std::tuple<std::uint64_t, std::uint64_t, std::int64_t, std::string, std::int64_t>;
+        mysql::static_results<row_t> result;
+        if (parsed_before_id)
+        {
+            (*conn)->async_execute(
+                mysql::with_params(
+                    "SELECT id_ms, id_seq, user_id, content, timestamp FROM messages "
+                    "WHERE room_id = {0} AND (id_ms < {1} OR (id_ms = {1} AND id_seq < {2})) "
+                    "ORDER BY id_ms DESC, id_seq DESC LIMIT {3}",
+                    room_id,
+                    parsed_before_id->ms,
+                    parsed_before_id->seq,
+                    max_count
+                ),
+                result,
+                diag,
+                yield[ec]
+            );
+        }
+        else
+        {
+            (*conn)->async_execute(
+                mysql::with_params(
+                    "SELECT id_ms, id_seq, user_id, content, timestamp FROM messages "
+                    "WHERE room_id = {} ORDER BY id_ms DESC, id_seq DESC LIMIT {}",
+                    room_id,
+                    max_count
+                ),
+                result,
+                diag,
+                yield[ec]
+            );
+        }
+        if (ec)
+            return error_with_message{ec, diag.server_message()};
+
         // We didn't do anything modifying the connection state, so we can
         // explicitly return it, indicating that no reset is required.
-        conn.return_without_reset();
+        conn->return_without_reset();
 
-        // Result
-        std::unordered_map<std::int64_t, std::string> res;
-        for (auto& elm : result.rows())
-            res.insert({std::get<0>(elm), std::move(std::get<1>(elm))});
-
-        // Done
+        // Compose the result
+        std::vector<message> res;
+        res.reserve(result.rows().size());
+        for (auto& row : result.rows())
+        {
+            res.push_back(message{
+                format_message_id({std::get<0>(row), std::get<1>(row)}),
+                std::move(std::get<3>(row)),
+                parse_timestamp(std::get<4>(row)),
+                std::get<2>(row),
+            });
+        }
         return res;
     }
 };
@@ -351,5 +1394,20 @@ public:
 
 std::unique_ptr<mysql_client> chat::create_mysql_client(boost::asio::any_io_executor ex)
 {
-    return std::unique_ptr<mysql_client>{new mysql_client_impl(std::move(ex))};
+    auto write_config = load_pool_config("MYSQL_", nullptr);
+    auto read_config = load_pool_config("MYSQL_READ_", &write_config);
+
+    // Staleness-tolerant reads are only sent to a replica if one is configured
+    std::optional<pool_config> replica_config;
+    if (!get_env_string("MYSQL_REPLICA_HOST", "").empty())
+        replica_config = load_pool_config("MYSQL_REPLICA_", &read_config);
+
+    return std::unique_ptr<mysql_client>{
+        new mysql_client_impl(std::move(ex), std::move(write_config), read_config, replica_config)
+    };
+}
+
+mysql_pool_stats chat::get_mysql_pool_stats(mysql_pool_kind kind)
+{
+    return global_pool_registry().total(kind);
 }
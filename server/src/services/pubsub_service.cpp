@@ -9,58 +9,423 @@
 
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/core/span.hpp>
-#include <boost/multi_index/indexed_by.hpp>
-#include <boost/multi_index/mem_fun.hpp>
-#include <boost/multi_index/member.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index_container.hpp>
+#include <boost/redis/connection.hpp>
+#include <boost/redis/ignore.hpp>
+#include <boost/redis/request.hpp>
+#include <boost/redis/response.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <openssl/rand.h>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+#include "services/redis_serialization.hpp"
+#include "services/topic_registry.hpp"
+#include "util/base64.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+#include "util/token_bucket.hpp"
+#include "util/tracing.hpp"
+#include "util/websocket_frame.hpp"
 
 using namespace chat;
 
 namespace {
 
+// All Redis channels used for pubsub have this prefix, followed by the topic ID
+constexpr std::string_view channel_prefix = "pubsub:";
+
+// Same, for ephemeral messages. These are delivered as such by the receiving instances
+constexpr std::string_view ephemeral_channel_prefix = "ephemeral:";
+
+// Same, for messages published to a user's sessions, followed by the user ID
+constexpr std::string_view user_channel_prefix = "user:";
+
+// How a message is delivered
+enum class delivery_kind
+{
+    regular,    // to the subscribers of a topic
+    ephemeral,  // to the subscribers of a topic, as an ephemeral message
+    user,       // to the sessions of a user. The topic ID is the user ID
+};
+
+// The Redis channel prefix for each kind of message
+static std::string_view channel_prefix_for(delivery_kind kind)
+{
+    switch (kind)
+    {
+    case delivery_kind::ephemeral: return ephemeral_channel_prefix;
+    case delivery_kind::user: return user_channel_prefix;
+    case delivery_kind::regular:
+    default: return channel_prefix;
+    }
+}
+
+// Number of random bytes in a node ID
+constexpr std::size_t node_id_size = 12;
+
+// Generates an ID that uniquely identifies this server instance
+static std::string generate_node_id()
+{
+    std::array<unsigned char, node_id_size> id{};
+    int ec = RAND_bytes(id.data(), id.size());
+    if (ec <= 0)
+        throw std::runtime_error("Generating node ID: RAND_bytes");
+    return base64_encode(id);
+}
+
+// Exchanges messages with other server instances using Redis Pub/Sub.
+// Uses a dedicated connection, since a connection in subscriber mode
+// can't be used to run regular commands.
+// Messages are published to the channel pubsub:<topic_id> (ephemeral:<topic_id>
+// for ephemeral messages, and user:<user_id> for the messages published to a user's sessions),
+// with payload "<node_id> <message>". The node ID is used
+// to discard messages published by this same instance, which have already been delivered locally.
+// Not thread-safe: must be used from the thread running its executor.
+class redis_broadcaster
+{
+public:
+    // Invoked when a message published by another instance is received
+    using callback_type = std::function<
+        void(std::string_view topic_id, std::shared_ptr<const framed_message> message, delivery_kind kind)>;
+
+    redis_broadcaster(boost::asio::any_io_executor ex, callback_type cb)
+        : conn_(ex), retry_timer_(ex), node_id_(generate_node_id()), on_remote_message_(std::move(cb))
+    {
+    }
+
+    boost::asio::any_io_executor get_executor() { return conn_.get_executor(); }
+
+    void start_run()
+    {
+        boost::redis::config cfg;
+        cfg.addr.host = get_env_string("REDIS_HOST", "localhost");
+        cfg.health_check_interval = std::chrono::seconds::zero();  // Disable health checks for now
+        conn_.async_run(cfg, {}, boost::asio::detached);
+
+        // Launch the subscriber loop
+        boost::asio::spawn(
+            conn_.get_executor(),
+            [this](boost::asio::yield_context yield) { receive_loop(yield); },
+            boost::asio::detached
+        );
+    }
+
+    void cancel()
+    {
+        conn_.cancel();
+        retry_timer_.cancel();
+    }
+
+    void publish(std::string_view topic_id, std::string_view message, delivery_kind kind)
+    {
+        // Compose the payload
+        std::string channel{channel_prefix_for(kind)};
+        channel += topic_id;
+        std::string payload;
+        payload.reserve(node_id_.size() + message.size() + 1u);
+        payload += node_id_;
+        payload += ' ';
+        payload += message;
+
+        // Compose the request. It must be kept alive until the operation completes.
+        // Publishing is fire-and-forget: errors are logged, but not reported
+        auto req = std::make_shared<boost::redis::request>();
+        req->push("PUBLISH", channel, payload);
+        conn_.async_exec(*req, boost::redis::ignore, [req](error_code ec, std::size_t) {
+            if (ec)
+                log_error(ec, "Publishing a message to Redis");
+        });
+    }
+
+private:
+    // Delays between subscription attempts, while Redis is unavailable
+    static constexpr std::chrono::milliseconds min_retry_delay{100};
+    static constexpr std::chrono::milliseconds max_retry_delay{5000};
+
+    boost::redis::connection conn_;
+    boost::asio::steady_timer retry_timer_;
+    std::string node_id_;
+    callback_type on_remote_message_;
+
+    // Handles a message received from Redis
+    void on_push(const redis_pubsub_message& msg)
+    {
+        // Get the topic ID from the channel name
+        std::string_view topic_id;
+        delivery_kind kind{};
+        for (auto candidate : {delivery_kind::regular, delivery_kind::ephemeral, delivery_kind::user})
+        {
+            auto prefix = channel_prefix_for(candidate);
+            if (msg.channel.substr(0, prefix.size()) == prefix)
+            {
+                topic_id = msg.channel.substr(prefix.size());
+                kind = candidate;
+                break;
+            }
+        }
+        if (topic_id.empty())
+            return;
+
+        // Split the payload into the node ID and the message itself
+        auto sep_pos = msg.payload.find(' ');
+        if (sep_pos == std::string_view::npos)
+        {
+            log_error(errc::redis_parse_error, "Parsing a Redis pubsub message", msg.payload);
+            return;
+        }
+        auto origin_node_id = msg.payload.substr(0, sep_pos);
+
+        // Messages published by this node have already been delivered
+        if (origin_node_id == node_id_)
+            return;
+
+        auto message = std::make_shared<const framed_message>(msg.payload.substr(sep_pos + 1u));
+        on_remote_message_(topic_id, std::move(message), kind);
+    }
+
+    void receive_loop(boost::asio::yield_context yield)
+    {
+        // Subscribe to all the channels we use
+        boost::redis::request req;
+        req.push(
+            "PSUBSCRIBE",
+            std::string(channel_prefix) + '*',
+            std::string(ephemeral_channel_prefix) + '*',
+            std::string(user_channel_prefix) + '*'
+        );
+
+        // Pushes will be stored here
+        boost::redis::generic_response resp;
+        conn_.set_receive_response(resp);
+
+        // The connection reconnects automatically after a failure, but
+        // subscriptions are lost in the process. Re-subscribe after every reconnection.
+        // While Redis is down, subscribing fails straight away, so back off between attempts
+        auto retry_delay = min_retry_delay;
+        while (conn_.will_reconnect())
+        {
+            error_code ec;
+            conn_.async_exec(req, boost::redis::ignore, yield[ec]);
+            if (ec)
+            {
+                retry_timer_.expires_after(retry_delay);
+                retry_timer_.async_wait(yield[ec]);
+                retry_delay = (std::min)(retry_delay * 2, max_retry_delay);
+                continue;
+            }
+            retry_delay = min_retry_delay;
+
+            while (true)
+            {
+                // Wait for pushes. This fails when the connection is lost
+                conn_.async_receive(yield[ec]);
+                if (ec)
+                    break;
+
+                // Errors here are most likely a bug. Log and discard the pushes
+                if (resp.has_error())
+                {
+                    log_error(errc::redis_command_failed, "Receiving Redis pushes", resp.error().diagnostic);
+                    resp = boost::redis::generic_response{};
+                    continue;
+                }
+
+                // Each receive operation corresponds to a single push, but
+                // resp may also contain other pushes read afterwards. Process only the first one
+                const auto& nodes = resp.value();
+                if (!nodes.empty())
+                {
+                    auto push_size = (std::min)(nodes.front().aggregate_size + 1u, nodes.size());
+                    auto msgs = parse_pubsub_pushes({nodes.data(), push_size});
+                    if (msgs.has_error())
+                        log_error(msgs.error(), "Parsing Redis pushes");
+                    else
+                        for (const auto& msg : *msgs)
+                            on_push(msg);
+                }
+
+                // Discard the processed push
+                boost::redis::consume_one(resp);
+            }
+        }
+    }
+};
+
 class pubsub_service_impl final : public pubsub_service
 {
-    // The type of elements held by our container
-    struct subscription
+    // Subscriptions held by this shard
+    topic_registry registry_;
+
+    // The sessions of each user, keyed by user ID. Kept apart from regular topics,
+    // so user IDs never clash with room IDs
+    topic_registry user_registry_;
+    boost::asio::any_io_executor ex_;
+
+    // Other shards in the same group, if any. These run in other threads,
+    // so they must be accessed only by posting to their executors.
+    std::vector<pubsub_service_impl*> peers_;
+
+    // If cross-node delivery is enabled, the object that exchanges messages with
+    // other server instances. A single shard in the group owns it, and the
+    // others access it by posting to its executor. nullptr if disabled.
+    std::unique_ptr<redis_broadcaster> owned_broadcaster_;
+    redis_broadcaster* broadcaster_{};
+
+    // Ephemeral messages waiting for the coalescing window to end, in publication order.
+    // pending_index_ maps "<topic_id>\0<coalesce_key>" to positions in pending_ephemeral_
+    struct pending_message
     {
         std::string topic_id;
-        std::shared_ptr<message_subscriber> subscriber;
-
-        std::string_view topic_id_sv() const noexcept { return topic_id; }
-        const message_subscriber* subscriber_ptr() const noexcept { return subscriber.get(); }
+        std::string message;
     };
+    ephemeral_config ephemeral_cfg_;
+    std::vector<pending_message> pending_ephemeral_;
+    std::unordered_map<std::string, std::size_t> pending_index_;
+    boost::asio::steady_timer flush_timer_;
+    token_bucket ephemeral_budget_;
 
-    // We need to efficiently index our container by both topic ID and subscriber
-    // identity. We use a Boost.MultiIndex container to maintain such indices,
-    // so that both operations run in logarithmic time.
-    // This is a multimap-like container, but with logN access times.
-    // clang-format off
-    using container_type = boost::multi_index::multi_index_container<
-        subscription,
-        boost::multi_index::indexed_by<
-            // Index by topic ID
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::const_mem_fun<subscription, std::string_view, &subscription::topic_id_sv>
-            >,
-            // Index by subscriber identity (comparing pointers)
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::const_mem_fun<subscription, const message_subscriber*, &subscription::subscriber_ptr>
-            >
-        >
-    >;
-    // clang-format on
-
-    container_type ct_;
-    boost::asio::any_io_executor ex_;
+    // Invokes the subscriber callbacks for this shard's subscriptions
+    void dispatch(
+        std::string_view topic_id,
+        const std::shared_ptr<const framed_message>& msg_ptr,
+        delivery_kind kind
+    )
+    {
+        // Notify all subscribers for this topic. Callbacks don't block (they usually just enqueue
+        // the message), so we don't need a coroutine per subscriber
+        latency_timer timer(histogram_id::publish_fanout);
+        const auto& registry = kind == delivery_kind::user ? user_registry_ : registry_;
+        for (const auto& subscriber : registry.subscribers(topic_id))
+        {
+            if (kind == delivery_kind::ephemeral)
+                subscriber->on_ephemeral_message(msg_ptr);
+            else
+                subscriber->on_message(msg_ptr);
+        }
+    }
+
+    // Delivers a message to the subscribers of all shards in this server instance
+    void deliver_in_node(
+        std::string_view topic_id,
+        const std::shared_ptr<const framed_message>& msg_ptr,
+        delivery_kind kind
+    )
+    {
+        // Notify our subscribers
+        dispatch(topic_id, msg_ptr, kind);
+
+        // Notify subscribers in other shards. This must run in the peer's thread
+        if (!peers_.empty())
+        {
+            auto topic_ptr = std::make_shared<const std::string>(topic_id);
+            for (auto* peer : peers_)
+            {
+                boost::asio::post(peer->ex_, [peer, topic_ptr, msg_ptr, kind] {
+                    peer->dispatch(*topic_ptr, msg_ptr, kind);
+                });
+            }
+        }
+    }
+
+    // Sends a message to other server instances, if cross-node delivery is enabled.
+    // The broadcaster may live in another thread
+    void broadcast(
+        std::string_view topic_id,
+        const std::shared_ptr<const framed_message>& msg_ptr,
+        delivery_kind kind
+    )
+    {
+        if (owned_broadcaster_)
+        {
+            owned_broadcaster_->publish(topic_id, msg_ptr->payload(), kind);
+        }
+        else if (broadcaster_)
+        {
+            boost::asio::post(
+                broadcaster_->get_executor(),
+                [broadcaster = broadcaster_, topic = std::string(topic_id), msg_ptr, kind] {
+                    broadcaster->publish(topic, msg_ptr->payload(), kind);
+                }
+            );
+        }
+    }
+
+    // Frames and delivers an ephemeral message, everywhere
+    void deliver_ephemeral(std::string_view topic_id, std::string_view message)
+    {
+        auto msg_ptr = std::make_shared<const framed_message>(message);
+        increment_counter(counter_id::ephemeral_published);
+        deliver_in_node(topic_id, msg_ptr, delivery_kind::ephemeral);
+        broadcast(topic_id, msg_ptr, delivery_kind::ephemeral);
+    }
+
+    // Delivers the ephemeral messages whose coalescing window has ended
+    void flush_ephemeral()
+    {
+        // Delivering may cause more messages to be published, so detach the pending ones first
+        auto pending = std::move(pending_ephemeral_);
+        pending_ephemeral_.clear();
+        pending_index_.clear();
+        for (const auto& msg : pending)
+            deliver_ephemeral(msg.topic_id, msg.message);
+    }
 
 public:
-    pubsub_service_impl(boost::asio::any_io_executor ex) : ex_(std::move(ex)) {}
+    pubsub_service_impl(boost::asio::any_io_executor ex, const ephemeral_config& ephemeral_cfg)
+        : ex_(ex),
+          ephemeral_cfg_(ephemeral_cfg),
+          flush_timer_(std::move(ex)),
+          ephemeral_budget_(ephemeral_cfg.rate.capacity, token_bucket::clock_type::now())
+    {
+    }
+
+    // Adds a shard to the group this service is part of
+    void add_peer(pubsub_service_impl& peer) { peers_.push_back(&peer); }
+
+    // Makes this shard own a broadcaster, delivering messages from other
+    // server instances to all the shards in the group
+    redis_broadcaster& create_broadcaster()
+    {
+        owned_broadcaster_ = std::make_unique<redis_broadcaster>(
+            ex_,
+            [this](std::string_view topic_id, std::shared_ptr<const framed_message> msg, delivery_kind kind) {
+                deliver_in_node(topic_id, msg, kind);
+            }
+        );
+        broadcaster_ = owned_broadcaster_.get();
+        return *broadcaster_;
+    }
+
+    // Makes this shard use a broadcaster owned by another shard
+    void set_broadcaster(redis_broadcaster& value) { broadcaster_ = &value; }
+
+    void start_run() override final
+    {
+        if (owned_broadcaster_)
+            owned_broadcaster_->start_run();
+    }
+
+    void cancel() override final
+    {
+        if (owned_broadcaster_)
+            owned_broadcaster_->cancel();
+    }
 
     void subscribe(
         std::shared_ptr<message_subscriber> subscriber,
@@ -68,44 +433,170 @@ public:
     ) override final
     {
         // Create a subscription for each requested topic
-        for (auto topic_id : topic_ids)
-        {
-            ct_.insert(subscription{std::string(topic_id), subscriber});
-        }
+        registry_.subscribe(std::move(subscriber), topic_ids);
+    }
+
+    void subscribe_user(std::shared_ptr<message_subscriber> subscriber, std::int64_t user_id) override final
+    {
+        auto key = std::to_string(user_id);
+        std::string_view keys[] = {key};
+        user_registry_.subscribe(std::move(subscriber), keys);
     }
 
     void unsubscribe(message_subscriber& subscriber) override final
     {
         // Remove any subscription matching the given subscriber
-        ct_.get<1>().erase(&subscriber);
+        registry_.unsubscribe(subscriber);
+        user_registry_.unsubscribe(subscriber);
+    }
+
+    std::size_t num_subscribers(std::string_view topic_id) const override final
+    {
+        return registry_.subscribers(topic_id).size();
     }
 
     void publish(std::string_view topic_id, std::string message) override final
     {
-        // Place the string into a shared object, to avoid making an individual
-        // copy per subscription
-        auto msg_ptr = std::make_shared<std::string>(std::move(message));
+        // If we're being traced, record framing and delivering to this shard's subscribers
+        auto* tr = take_handed_off_trace();
+
+        // Frame the message once and place it into a shared object, to avoid making an individual
+        // copy per subscription. The message is never modified, and the reference
+        // count is atomic, so it can be safely shared between threads
+        std::shared_ptr<const framed_message> msg_ptr;
+        {
+            trace_span span(tr, "pubsub.frame");
+            msg_ptr = std::make_shared<const framed_message>(message);
+        }
+        increment_counter(counter_id::messages_published);
+
+        // Notify subscribers in this server instance. We do this directly,
+        // rather than waiting for Redis to echo the message back, to minimize latency
+        traced_call(tr, [&] { deliver_in_node(topic_id, msg_ptr, delivery_kind::regular); });
+
+        // Notify other server instances
+        broadcast(topic_id, msg_ptr, delivery_kind::regular);
+    }
+
+    void publish_to_user(std::int64_t user_id, std::string message) override final
+    {
+        auto key = std::to_string(user_id);
+        auto msg_ptr = std::make_shared<const framed_message>(message);
+        increment_counter(counter_id::user_messages_published);
+        deliver_in_node(key, msg_ptr, delivery_kind::user);
+        broadcast(key, msg_ptr, delivery_kind::user);
+    }
 
-        // Get all subscriptions for this topic
-        auto [first, last] = ct_.equal_range(topic_id);
+    void publish_ephemeral(std::string_view topic_id, std::string_view coalesce_key, std::string message)
+        override final
+    {
+        // If a message with the same key is already waiting, replace it. Consumers are only
+        // interested in the latest state (e.g. the last message read)
+        std::string index_key;
+        if (ephemeral_cfg_.coalesce_window.count() > 0)
+        {
+            index_key.reserve(topic_id.size() + coalesce_key.size() + 1u);
+            index_key += topic_id;
+            index_key += '\0';
+            index_key += coalesce_key;
+            auto it = pending_index_.find(index_key);
+            if (it != pending_index_.end())
+            {
+                pending_ephemeral_[it->second].message = std::move(message);
+                increment_counter(counter_id::ephemeral_coalesced);
+                return;
+            }
+        }
 
-        // Launch the subscriber callbacks in parallel
-        for (auto it = first; it != last; ++it)
+        // Ephemeral messages are the first thing to give up under load
+        if (!ephemeral_budget_.try_take(ephemeral_cfg_.rate, 1.0, token_bucket::clock_type::now()))
         {
-            boost::asio::spawn(
-                ex_,
-                [subs = it->subscriber, msg_ptr](boost::asio::yield_context yield) {
-                    subs->on_message(*msg_ptr, yield);
-                },
-                boost::asio::detached
-            );
+            increment_counter(counter_id::ephemeral_rate_limited);
+            return;
+        }
+
+        // Without coalescing, deliver the message right away. Subscribers are still notified
+        // asynchronously, so callers may publish from within subscriber callbacks
+        if (index_key.empty())
+        {
+            boost::asio::post(ex_, [this, topic = std::string(topic_id), message = std::move(message)] {
+                deliver_ephemeral(topic, message);
+            });
+            return;
+        }
+
+        // Wait for the coalescing window to end. A single timer serves all messages
+        // published within the window. The timer is owned by this object, so the handler
+        // only accesses it if it wasn't cancelled
+        pending_index_.emplace(std::move(index_key), pending_ephemeral_.size());
+        pending_ephemeral_.push_back({std::string(topic_id), std::move(message)});
+        if (pending_ephemeral_.size() == 1u)
+        {
+            flush_timer_.expires_after(ephemeral_cfg_.coalesce_window);
+            flush_timer_.async_wait([this](error_code ec) {
+                if (!ec)
+                    flush_ephemeral();
+            });
         }
     }
 };
 
 }  // namespace
 
-std::unique_ptr<pubsub_service> chat::create_pubsub_service(boost::asio::any_io_executor ex)
+const ephemeral_config& chat::get_ephemeral_config()
 {
-    return std::unique_ptr<pubsub_service>{new pubsub_service_impl(std::move(ex))};
-}
\ No newline at end of file
+    static const ephemeral_config res = [] {
+        ephemeral_config cfg;
+        cfg.coalesce_window = std::chrono::milliseconds(get_env_size("EPHEMERAL_COALESCE_MS", 200u));
+        auto rate = (std::max)(get_env_size("EPHEMERAL_RATE_PER_SECOND", 1000u), std::size_t(1u));
+        cfg.rate = {static_cast<double>(rate), static_cast<double>(rate)};
+        return cfg;
+    }();
+    return res;
+}
+
+std::unique_ptr<pubsub_service> chat::create_pubsub_service(
+    boost::asio::any_io_executor ex,
+    const ephemeral_config& ephemeral_cfg
+)
+{
+    return std::unique_ptr<pubsub_service>{new pubsub_service_impl(std::move(ex), ephemeral_cfg)};
+}
+
+std::vector<std::unique_ptr<pubsub_service>> chat::create_sharded_pubsub_service(
+    boost::span<const boost::asio::any_io_executor> executors,
+    bool cross_node,
+    const ephemeral_config& ephemeral_cfg
+)
+{
+    // Create the shards
+    std::vector<std::unique_ptr<pubsub_service_impl>> shards;
+    shards.reserve(executors.size());
+    for (const auto& ex : executors)
+        shards.push_back(std::make_unique<pubsub_service_impl>(ex, ephemeral_cfg));
+
+    // Make each shard aware of the others
+    for (auto& shard : shards)
+    {
+        for (auto& peer : shards)
+        {
+            if (peer != shard)
+                shard->add_peer(*peer);
+        }
+    }
+
+    // If enabled, the first shard exchanges messages with other instances
+    if (cross_node && !shards.empty())
+    {
+        auto& broadcaster = shards.front()->create_broadcaster();
+        for (std::size_t i = 1; i < shards.size(); ++i)
+            shards[i]->set_broadcaster(broadcaster);
+    }
+
+    // Convert to the interface type
+    std::vector<std::unique_ptr<pubsub_service>> res;
+    res.reserve(shards.size());
+    for (auto& shard : shards)
+        res.push_back(std::move(shard));
+    return res;
+}
@@ -9,74 +9,607 @@
 
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/detached.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/redis/adapter/result.hpp>
 #include <boost/redis/connection.hpp>
 #include <boost/redis/request.hpp>
+#include <boost/redis/resp3/type.hpp>
 #include <boost/redis/response.hpp>
 
-#include <cstdlib>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include "error.hpp"
+#include "services/redis_cluster.hpp"
 #include "services/redis_serialization.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+#include "util/run_parallel.hpp"
+#include "util/tracing.hpp"
 
 using namespace chat;
 
+// Adds a command to retrieve a room's history to req. XREVRANGE will get all messages
+// for a room, since the beginning or the passed message, in reverse order, up to message_batch_size.
+// If since_message_id is set, the range ends before that message, so only newer ones are returned.
+// If there are more of them than message_batch_size, the result is the same as without it
+template <class Request>
+static void push_room_history_request(Request& req, const redis_client::room_histoy_request& room_req)
+{
+    std::string stream_ref = room_req.last_message_id ? "(" : "+";
+    if (room_req.last_message_id)
+        stream_ref.append(*room_req.last_message_id);
+    std::string end_ref = room_req.since_message_id ? "(" : "-";
+    if (room_req.since_message_id)
+        end_ref.append(*room_req.since_message_id);
+    req.push("XREVRANGE", room_req.room_id, stream_ref, end_ref, "COUNT", redis_client::message_batch_size);
+}
+
+// Converts a time point to seconds since the epoch, as used in sorted set scores
+static std::int64_t unix_seconds(std::chrono::system_clock::time_point tp) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+}
+
 namespace {
 
-class redis_client_impl final : public redis_client
+// Messages passed to store_messages, waiting for the next group commit.
+// Lives in the stack of the coroutine calling store_messages.
+struct pending_store
+{
+    std::string_view room_id;
+    boost::span<const message> messages;
+
+    // Set by the group commit
+    result_with_message<std::vector<std::string>> result;
+    std::chrono::steady_clock::time_point exec_start;  // When the batch was sent, for tracing
+
+    // Notified when result has been set
+    boost::asio::experimental::channel<void(error_code)> done;
+};
+
+// A token bucket, stored as a hash with the number of tokens and the time
+// it was last refilled, in milliseconds. Run as a script so that refilling and
+// taking tokens is atomic. Arguments: capacity, refill rate (tokens per second), cost.
+// Checks with zero cost don't modify the bucket
+static constexpr std::string_view take_tokens_script = R"LUA(
+local t = redis.call('TIME')
+local now = tonumber(t[1]) * 1000 + math.floor(tonumber(t[2]) / 1000)
+local capacity = tonumber(ARGV[1])
+local rate = tonumber(ARGV[2]) / 1000
+local cost = tonumber(ARGV[3])
+local bucket = redis.call('HMGET', KEYS[1], 'tokens', 'ts')
+local tokens = tonumber(bucket[1]) or capacity
+local ts = tonumber(bucket[2]) or now
+tokens = math.min(capacity, tokens + math.max(0, now - ts) * rate)
+local allowed = tokens >= math.max(cost, 1)
+if allowed then tokens = tokens - cost end
+if cost > 0 then
+  redis.call('HSET', KEYS[1], 'tokens', tostring(tokens), 'ts', now)
+  redis.call('PEXPIRE', KEYS[1], math.ceil((capacity - tokens) / rate) + 1000)
+end
+if allowed then return 1 else return 0 end
+)LUA";
+
+// Appends messages with explicit IDs to a stream. Arguments: the stream max length,
+// followed by an (ID, payload) pair per message. XADD fails if the ID is not
+// greater than the last one in the stream. In this case, Redis assigns the ID,
+// which keeps the stream ordered. If a message with the same ID is already in the stream
+// (e.g. because a replay was interrupted), it's not stored again. Running as a script makes
+// this atomic, so no other message can get in between. Returns the IDs used. Errors are caught,
+// since messages before the failing one have already been stored: a message that can't
+// be stored gets an empty ID, and the following ones are still attempted
+static constexpr std::string_view store_with_ids_script = R"LUA(
+local res = {}
+for i = 2, #ARGV, 2 do
+  local id = redis.pcall('XADD', KEYS[1], 'MAXLEN', '~', ARGV[1], ARGV[i], 'payload', ARGV[i + 1])
+  if type(id) == 'table' then
+    local existing = redis.pcall('XRANGE', KEYS[1], ARGV[i], ARGV[i])
+    if type(existing) == 'table' and existing.err == nil and #existing > 0 then
+      id = ARGV[i]
+    else
+      id = redis.pcall('XADD', KEYS[1], 'MAXLEN', '~', ARGV[1], '*', 'payload', ARGV[i + 1])
+      if type(id) == 'table' then
+        id = ''
+      end
+    end
+  end
+  res[#res + 1] = id
+end
+return res
+)LUA";
+
+// Composes a request for a cluster node that is importing a slot. ASKING only allows
+// the command that follows it to run in the importing node, so it's pushed before every command.
+// Has the subset of boost::redis::request's interface used by the functions composing requests
+class asking_request
 {
-    boost::redis::connection conn_;
+    boost::redis::request& req_;
 
 public:
-    redis_client_impl(boost::asio::any_io_executor ex) : conn_(std::move(ex)) {}
+    explicit asking_request(boost::redis::request& req) noexcept : req_(req) {}
 
-    void start_run() final override
+    template <class... Args>
+    void push(std::string_view cmd, const Args&... args)
     {
-        // The host to connect to. Defaults to localhost
-        const char* host_c_str = std::getenv("REDIS_HOST");
-        std::string host = host_c_str ? host_c_str : "localhost";
+        req_.push("ASKING");
+        req_.push(cmd, args...);
+    }
+
+    template <class... Args>
+    void push_range(Args&&... args)
+    {
+        req_.push("ASKING");
+        req_.push_range(std::forward<Args>(args)...);
+    }
+};
 
-        boost::redis::config cfg;
-        cfg.addr.host = std::move(host);
-        cfg.health_check_interval = std::chrono::seconds::zero();  // Disable health checks for now
-        conn_.async_run(cfg, {}, boost::asio::detached);
+// Removes the responses to the ASKING commands pushed by asking_request,
+// which precede the response to every command
+static void remove_asking_responses(std::vector<boost::redis::resp3::node>& nodes)
+{
+    std::size_t num_responses = 0u, out = 0u;
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        // Each response starts with a top-level node
+        if (nodes[i].depth == 0u)
+            ++num_responses;
+        if (num_responses % 2u == 0u)
+            nodes[out++] = std::move(nodes[i]);
     }
+    nodes.resize(out);
+}
 
-    void cancel() final override { conn_.cancel(); }
+// Commands are sent over different connections depending on their class.
+// A connection processes commands in order, so this prevents expensive
+// commands (like big history reads) from delaying cheap ones (like session lookups)
+enum class command_class
+{
+    // SET/GET/DEL for sessions, and rate limiting. Small and latency sensitive
+    sessions,
 
-    result_with_message<std::vector<message_batch>> get_room_history(
-        boost::span<const room_histoy_request> input,
-        boost::asio::yield_context yield
-    ) final override
+    // XADD and XTRIM. A single connection keeps group commits in order
+    writes,
+
+    // XREVRANGE and XRANGE. Responses may be big. May use several connections
+    history,
+};
+
+// The connections to a single Redis node
+class node_connections
+{
+    std::string host_;
+    std::string port_;
+    boost::redis::connection session_conn_;
+    boost::redis::connection write_conn_;
+    std::vector<std::unique_ptr<boost::redis::connection>> history_conns_;
+    std::size_t next_history_conn_{0};
+
+public:
+    node_connections(
+        boost::asio::any_io_executor ex,
+        std::string host,
+        std::string port,
+        std::size_t num_history_conns
+    )
+        : host_(std::move(host)), port_(std::move(port)), session_conn_(ex), write_conn_(ex)
     {
-        assert(!input.empty());
+        for (std::size_t i = 0; i < num_history_conns; ++i)
+            history_conns_.push_back(std::make_unique<boost::redis::connection>(ex));
+    }
 
-        // Compose the request. XREVRANGE will get all messages for a room,
-        // since the beginning, in reverse order, up to message_batch_size
-        boost::redis::request req;
-        for (const auto& room_req : input)
+    const std::string& host() const noexcept { return host_; }
+
+    // Returns the connection to use for a command. History reads are distributed
+    // between their connections in a round-robin fashion
+    boost::redis::connection& get(command_class cls) noexcept
+    {
+        switch (cls)
         {
-            std::string stream_ref = room_req.last_message_id ? "(" : "+";
-            if (room_req.last_message_id)
-                stream_ref.append(*room_req.last_message_id);
-            req.push("XREVRANGE", room_req.room_id, stream_ref, "-", "COUNT", message_batch_size);
+        case command_class::sessions: return session_conn_;
+        case command_class::writes: return write_conn_;
+        default:
+        {
+            auto& res = *history_conns_[next_history_conn_];
+            next_history_conn_ = (next_history_conn_ + 1u) % history_conns_.size();
+            return res;
+        }
         }
+    }
 
-        // Run it
+    void run(boost::redis::config cfg)
+    {
+        cfg.addr.host = host_;
+        cfg.addr.port = port_;
+        session_conn_.async_run(cfg, {}, boost::asio::detached);
+        write_conn_.async_run(cfg, {}, boost::asio::detached);
+        for (auto& conn : history_conns_)
+            conn->async_run(cfg, {}, boost::asio::detached);
+    }
+
+    void cancel()
+    {
+        session_conn_.cancel();
+        write_conn_.cancel();
+        for (auto& conn : history_conns_)
+            conn->cancel();
+    }
+};
+
+class redis_client_impl final : public redis_client
+{
+    // How many times we follow MOVED and ASK redirections for a request before giving up
+    static constexpr int max_redirections = 3;
+
+    boost::asio::any_io_executor ex_;
+    boost::redis::config cfg_;
+    std::size_t num_history_conns_;
+    bool running_{false};
+
+    // The nodes we're connected to. In standalone mode, there is a single node.
+    // In cluster mode, the first node is the one we got from the config (the seed node),
+    // and nodes are added as they are discovered. Nodes are never removed
+    std::vector<std::unique_ptr<node_connections>> nodes_;
+    std::map<std::string, std::size_t, std::less<>> node_indices_;  // host:port => index in nodes_
+
+    // Cluster mode. Maps hash slots to indices in nodes_. Until the slot map is loaded,
+    // everything is sent to the seed node, which redirects us as required
+    bool cluster_mode_;
+    std::vector<std::size_t> slot_nodes_;
+    bool slot_refresh_in_progress_{false};
+
+    // Standalone mode only. If set, history reads that tolerate stale data are sent here
+    std::unique_ptr<node_connections> replica_;
+
+    // If set, store_messages fails immediately while we're not connected, instead of waiting
+    // for the connection to be re-established. Used when messages can be spooled
+    bool fail_fast_stores_;
+
+    // Returns the index of the node at the given address, connecting to it if required
+    std::size_t get_node(std::string_view host, std::string_view port)
+    {
+        std::string address;
+        address.append(host).append(":").append(port);
+        auto it = node_indices_.find(address);
+        if (it != node_indices_.end())
+            return it->second;
+
+        nodes_.push_back(
+            std::make_unique<node_connections>(ex_, std::string(host), std::string(port), num_history_conns_)
+        );
+        if (running_)
+            nodes_.back()->run(cfg_);
+        auto idx = nodes_.size() - 1u;
+        node_indices_.emplace(std::move(address), idx);
+        return idx;
+    }
+
+    // Reloads the slot map from the given node, in the background. Only one refresh
+    // runs at a time
+    void schedule_slot_refresh(std::size_t node_idx)
+    {
+        if (slot_refresh_in_progress_)
+            return;
+        slot_refresh_in_progress_ = true;
+        boost::asio::spawn(
+            ex_,
+            [this, node_idx](boost::asio::yield_context yield) {
+                auto err = refresh_slots(node_idx, yield);
+                if (err.ec && err.ec != boost::asio::error::operation_aborted)
+                    log_error(err, "Loading the Redis Cluster slot map");
+                slot_refresh_in_progress_ = false;
+            },
+            boost::asio::detached
+        );
+    }
+
+    error_with_message refresh_slots(std::size_t node_idx, boost::asio::yield_context yield)
+    {
+        boost::redis::request req;
+        req.push("CLUSTER", "SLOTS");
         boost::redis::generic_response res;
         error_code ec;
-        conn_.async_exec(req, res, yield[ec]);
+        nodes_[node_idx]->get(command_class::sessions).async_exec(req, res, yield[ec]);
         if (ec)
             return error_with_message{ec};
-
-        // Verify success. If any of the nodes contains a Redis error (e.g.
-        // because we sent an invalid command), this will contain an error.
         if (res.has_error())
             CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_command_failed, std::move(res).error().diagnostic)
 
+        auto ranges = parse_cluster_slots(*res);
+        if (ranges.has_error())
+            return error_with_message{ranges.error()};
+        for (const auto& range : *ranges)
+        {
+            // An empty host means the node we asked. ? means that the node's address is unknown
+            if (range.host == "?")
+                continue;
+            auto idx = get_node(range.host.empty() ? nodes_[node_idx]->host() : range.host, range.port);
+            std::fill(slot_nodes_.begin() + range.first, slot_nodes_.begin() + range.last + 1u, idx);
+        }
+        return {};
+    }
+
+    // Executes a request over a connection of the given class. compose(req) must add the commands
+    // to req. In cluster mode, all the commands must refer to key (or to keys in the same hash slot),
+    // which is used to pick the node to send the request to. If the node responds with a redirection,
+    // the request is re-sent to the node it indicates. Since all the commands in the request
+    // involve the same slot, either all of them or none of them are redirected, so this
+    // doesn't execute any command twice. This holds for ASK redirections too, because ASKING
+    // is sent before every command. Fails if Redis returns an error for any of the commands.
+    // If fail_fast is set, fails with boost::redis::error::not_connected while we're not connected,
+    // without sending the request
+    template <class ComposeFn>
+    error_with_message exec(
+        command_class cls,
+        std::string_view key,
+        ComposeFn&& compose,
+        boost::redis::generic_response& res,
+        boost::asio::yield_context yield,
+        bool fail_fast = false
+    )
+    {
+        std::size_t node_idx = cluster_mode_ ? slot_nodes_[redis_hash_slot(key)] : 0u;
+        bool asking = false;
+
+        for (int attempt = 0;; ++attempt)
+        {
+            // Compose the request. ASKING allows the next command to be executed
+            // in a node that is importing the slot
+            boost::redis::request req;
+            if (asking)
+            {
+                asking_request asking_req(req);
+                compose(asking_req);
+            }
+            else
+            {
+                compose(req);
+            }
+            if (fail_fast)
+                req.get_config().cancel_if_not_connected = true;
+
+            // Execute it
+            res = boost::redis::generic_response{};
+            error_code ec;
+            nodes_[node_idx]->get(cls).async_exec(req, res, yield[ec]);
+            if (ec)
+                return error_with_message{ec};
+
+            if (!res.has_error())
+            {
+                // Remove the responses to ASKING, so callers only see their commands
+                if (asking)
+                    remove_asking_responses(*res);
+                return {};
+            }
+
+            // Some command failed. Redirections are followed, while any other Redis
+            // error (e.g. because we sent an invalid command) fails the request
+            auto redirect = cluster_mode_ ? parse_redis_redirect(res.error().diagnostic)
+                                          : std::optional<redis_redirect>();
+            if (!redirect || attempt >= max_redirections)
+                CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_command_failed, std::move(res).error().diagnostic)
+
+            // Follow the redirection. MOVED means that our slot map is outdated
+            const auto& host = redirect->host.empty() ? nodes_[node_idx]->host() : redirect->host;
+            node_idx = get_node(host, redirect->port);
+            asking = redirect->is_ask;
+            if (!asking)
+            {
+                slot_nodes_[redirect->slot] = node_idx;
+                schedule_slot_refresh(node_idx);
+            }
+        }
+    }
+
+    // Executes a history read. If pref allows it and a replica is configured, the read
+    // is served by the replica. If it can't (e.g. because it's not connected), we fall back to the primary
+    template <class ComposeFn>
+    error_with_message exec_history_read(
+        read_preference pref,
+        std::string_view key,
+        ComposeFn&& compose,
+        boost::redis::generic_response& res,
+        boost::asio::yield_context yield
+    )
+    {
+        if (pref == read_preference::replica && replica_)
+        {
+            // Don't wait for the replica to reconnect
+            boost::redis::request req;
+            req.get_config().cancel_if_not_connected = true;
+            compose(req);
+
+            error_code ec;
+            replica_->get(command_class::history).async_exec(req, res, yield[ec]);
+            if (!ec && !res.has_error())
+                return {};
+        }
+        return exec(command_class::history, key, compose, res, yield);
+    }
+
+    // Group commit. XADDs issued by all the sessions in this thread are
+    // gathered and sent to Redis as a single request.
+    // How long to wait for more commands before sending a batch. If zero, we
+    // only wait for the sessions that are ready to run in the current event loop iteration
+    std::chrono::microseconds group_commit_window_;
+
+    // A batch is sent as soon as it has this number of commands
+    std::size_t group_commit_max_commands_;
+
+    // Room streams are trimmed to approximately this length when adding messages
+    std::size_t stream_max_length_;
+
+    std::vector<pending_store*> pending_stores_;
+    std::size_t pending_commands_{0};
+    bool group_commit_scheduled_{false};
+    boost::asio::steady_timer group_commit_timer_;
+
+    void schedule_group_commit()
+    {
+        if (!group_commit_scheduled_)
+        {
+            group_commit_scheduled_ = true;
+            boost::asio::spawn(
+                ex_,
+                [this](boost::asio::yield_context yield) { run_group_commit(yield); },
+                boost::asio::detached
+            );
+        }
+        else if (pending_commands_ >= group_commit_max_commands_)
+        {
+            // The batch is full. Send it without waiting for the window to elapse
+            group_commit_timer_.cancel();
+        }
+    }
+
+    void run_group_commit(boost::asio::yield_context yield)
+    {
+        // Wait for other sessions to add their messages to the batch
+        error_code ec;
+        if (group_commit_window_.count() == 0)
+        {
+            boost::asio::post(yield);
+        }
+        else if (pending_commands_ < group_commit_max_commands_)
+        {
+            // Cancelling the timer means that the batch is full
+            group_commit_timer_.expires_after(group_commit_window_);
+            group_commit_timer_.async_wait(yield[ec]);
+        }
+
+        // Take ownership of the batch. Messages stored from now on go into the next batch,
+        // which may be executed concurrently with this one
+        auto batch = std::move(pending_stores_);
+        pending_stores_.clear();
+        pending_commands_ = 0u;
+        group_commit_scheduled_ = false;
+        auto exec_start = std::chrono::steady_clock::now();
+        for (auto* store : batch)
+            store->exec_start = exec_start;
+
+        // Run the batch and notify the callers. In cluster mode, rooms may be served by different
+        // nodes. Each store refers to a single room, so we send each one as a separate request
+        // (concurrently, so Boost.Redis still coalesces the ones for the same node into a single write).
+        // This way, redirections can be followed without re-executing any command
+        if (cluster_mode_)
+        {
+            run_parallel(
+                batch.size(),
+                [&batch, this](std::size_t i, boost::asio::yield_context child_yield) {
+                    batch[i]->result = execute_stores({&batch[i], 1u}, child_yield);
+                },
+                yield
+            );
+        }
+        else
+        {
+            auto res = execute_stores(batch, yield);
+            std::size_t offset = 0u;
+            for (auto* store : batch)
+            {
+                if (res.has_error())
+                {
+                    store->result = res.error();
+                }
+                else
+                {
+                    auto first = res->begin() + offset;
+                    auto last = first + store->messages.size();
+                    store->result = std::vector<std::string>(
+                        std::make_move_iterator(first),
+                        std::make_move_iterator(last)
+                    );
+                    offset += store->messages.size();
+                }
+            }
+        }
+        for (auto* store : batch)
+            store->done.try_send(error_code());
+    }
+
+    // Sends all the XADDs in a batch as a single request. Returns the IDs
+    // of all the inserted messages, in order. In cluster mode, all stores must refer to the same room
+    result_with_message<std::vector<std::string>> execute_stores(
+        boost::span<pending_store* const> batch,
+        boost::asio::yield_context yield
+    )
+    {
+        // Compose the request. This appends each message to its room and
+        // auto-assigns it an ID.
+        std::size_t num_messages = 0u;
+        auto compose = [&](auto& req) {
+            num_messages = 0u;
+            for (const auto* store : batch)
+            {
+                for (const auto& msg : store->messages)
+                {
+                    req.push(
+                        "XADD",
+                        store->room_id,
+                        "MAXLEN",
+                        "~",
+                        stream_max_length_,
+                        "*",
+                        "payload",
+                        serialize_redis_message(msg)
+                    );
+                }
+                num_messages += store->messages.size();
+            }
+        };
+
+        // Execute it. If any of the commands fails, the entire batch fails
+        boost::redis::generic_response res;
+        const auto& room_id = batch.front()->room_id;
+        auto err = exec(command_class::writes, room_id, compose, res, yield, fail_fast_stores_);
+        if (err.ec)
+            return err;
+
+        // Parse the response
+        auto result = parse_batch_xadd_response(*res);
+        if (result.has_error())
+            return error_with_message{result.error()};
+        if (result->size() != num_messages)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        return std::move(*result);
+    }
+
+    // Retrieves history for the given rooms, as a single request
+    result_with_message<std::vector<message_batch>> get_room_history_impl(
+        boost::span<const room_histoy_request> input,
+        read_preference pref,
+        boost::asio::yield_context yield
+    )
+    {
+        // Compose the request
+        auto compose = [input](auto& req) {
+            for (const auto& room_req : input)
+                push_room_history_request(req, room_req);
+        };
+
+        // Run it
+        boost::redis::generic_response res;
+        auto err = exec_history_read(pref, input.front().room_id, compose, res, yield);
+        if (err.ec)
+            return err;
+
         // Parse the response
         auto result = parse_room_history_batch(*res);
         if (result.has_error())
@@ -89,37 +622,276 @@ public:
         return std::move(*result);
     }
 
+public:
+    redis_client_impl(boost::asio::any_io_executor ex, bool fail_fast_stores)
+        : ex_(ex),
+          num_history_conns_((std::max)(get_env_size("REDIS_HISTORY_CONNECTIONS", 2u), std::size_t(1))),
+          cluster_mode_(get_env_bool("REDIS_CLUSTER", false)),
+          fail_fast_stores_(fail_fast_stores),
+          group_commit_window_(get_env_size("REDIS_GROUP_COMMIT_WINDOW_US", 0u)),
+          group_commit_max_commands_(get_env_size("REDIS_GROUP_COMMIT_MAX_COMMANDS", 256u)),
+          stream_max_length_(get_env_size("REDIS_STREAM_MAXLEN", 100000u)),
+          group_commit_timer_(ex)
+    {
+        // The host to connect to. Defaults to localhost. In cluster mode, this is
+        // the node we ask for the slot map
+        cfg_.addr.host = get_env_string("REDIS_HOST", "localhost");
+
+        // Health checks detect unresponsive servers, so we reconnect (and spool
+        // messages in the meantime, if enabled). Disabled by default
+        cfg_.health_check_interval = std::chrono::seconds(get_env_size("REDIS_HEALTH_CHECK_INTERVAL", 0u));
+
+        get_node(cfg_.addr.host, cfg_.addr.port);
+        if (cluster_mode_)
+            slot_nodes_.resize(redis_num_slots, 0u);
+
+        // Replicas are only supported in standalone mode
+        auto replica_host = get_env_string("REDIS_REPLICA_HOST", "");
+        if (!replica_host.empty())
+        {
+            if (cluster_mode_)
+            {
+                log_error(errc::invalid_config, "REDIS_REPLICA_HOST is ignored in cluster mode");
+            }
+            else
+            {
+                auto replica_port = get_env_string("REDIS_REPLICA_PORT", "6379");
+                replica_ = std::make_unique<node_connections>(ex, replica_host, replica_port, num_history_conns_);
+            }
+        }
+    }
+
+    void start_run() final override
+    {
+        running_ = true;
+        for (auto& node : nodes_)
+            node->run(cfg_);
+        if (replica_)
+            replica_->run(cfg_);
+        if (cluster_mode_)
+            schedule_slot_refresh(0u);
+    }
+
+    void cancel() final override
+    {
+        running_ = false;
+        for (auto& node : nodes_)
+            node->cancel();
+        if (replica_)
+            replica_->cancel();
+        group_commit_timer_.cancel();
+    }
+
+    result_with_message<std::vector<message_batch>> get_room_history(
+        boost::span<const room_histoy_request> input,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_get_room_history);
+
+        assert(!input.empty());
+
+        // In standalone mode, all rooms are retrieved with a single request
+        if (!cluster_mode_)
+            return get_room_history_impl(input, pref, yield);
+
+        // In cluster mode, rooms may be served by different nodes.
+        // Retrieve each room with a separate request, concurrently
+        std::vector<result_with_message<std::vector<message_batch>>> results(
+            input.size(),
+            error_with_message{boost::asio::error::operation_aborted}
+        );
+        run_parallel(
+            input.size(),
+            [&](std::size_t i, boost::asio::yield_context child_yield) {
+                results[i] = get_room_history_impl(input.subspan(i, 1u), pref, child_yield);
+            },
+            yield
+        );
+
+        // Merge the results, in order
+        std::vector<message_batch> res;
+        res.reserve(input.size());
+        for (auto& room_result : results)
+        {
+            if (room_result.has_error())
+                return std::move(room_result).error();
+            if (room_result->size() != 1u)
+                CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+            res.push_back(std::move(room_result->front()));
+        }
+        return res;
+    }
+
+    result_with_message<std::vector<boost::redis::resp3::node>> get_room_history_nodes(
+        const room_histoy_request& input,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_get_room_history_nodes);
+
+        // Run the request
+        boost::redis::generic_response res;
+        auto err = exec_history_read(
+            pref,
+            input.room_id,
+            [&input](auto& req) { push_room_history_request(req, input); },
+            res,
+            yield
+        );
+        if (err.ec)
+            return err;
+
+        // The nodes are parsed by the caller
+        return std::move(*res);
+    }
+
     result_with_message<std::vector<std::string>> store_messages(
         std::string_view room_id,
         boost::span<const message> messages,
         boost::asio::yield_context yield
     ) final override
     {
-        // Compose the request. This appends a message to the given room and
-        // auto-assigns it an ID.
-        boost::redis::request req;
-        for (const auto& msg : messages)
-            req.push("XADD", room_id, "*", "payload", serialize_redis_message(msg));
+        latency_timer timer(histogram_id::redis_store_messages);
+
+        if (messages.empty())
+            return std::vector<std::string>();
+
+        // Add the messages to the next group commit, and wait for it to complete
+        auto enqueued = std::chrono::steady_clock::now();
+        pending_store store{
+            room_id,
+            messages,
+            error_with_message{boost::asio::error::operation_aborted},
+            enqueued,
+            boost::asio::experimental::channel<void(error_code)>(yield.get_executor(), 1u),
+        };
+        pending_stores_.push_back(&store);
+        pending_commands_ += messages.size();
+        schedule_group_commit();
 
-        // Execute it
-        boost::redis::generic_response res;
         error_code ec;
-        conn_.async_exec(req, res, yield[ec]);
+        store.done.async_receive(yield[ec]);
         if (ec)
             return error_with_message{ec};
 
-        // Verify success. If any of the nodes contains a Redis error (e.g.
-        // because we sent an invalid command), this will contain an error.
-        if (res.has_error())
-            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_command_failed, std::move(res).error().diagnostic)
+        // Split the time between waiting for the batch to fill and executing it
+        if (auto* tr = timer.get_trace())
+        {
+            tr->add_span("redis.group_commit_wait", enqueued, store.exec_start);
+            tr->add_span("redis.exec", store.exec_start, std::chrono::steady_clock::now());
+        }
+        return std::move(store.result);
+    }
 
-        // Parse the response
-        auto result = parse_batch_xadd_response(*res);
+    result_with_message<std::vector<std::string>> store_messages_with_ids(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_store_messages_with_ids);
+
+        if (messages.empty())
+            return std::vector<std::string>();
+
+        // Compose the request: EVAL <script> 1 <room_id> <max length> <id1> <payload1>...
+        // Like other writes, it's sent over the writes connection
+        std::vector<std::string> args;
+        args.reserve(messages.size() * 2u + 3u);
+        args.emplace_back("1");
+        args.emplace_back(room_id);
+        args.push_back(std::to_string(stream_max_length_));
+        for (const auto& msg : messages)
+        {
+            args.push_back(msg.id);
+            args.push_back(serialize_redis_message(msg));
+        }
+        auto compose = [&args](auto& req) {
+            req.push_range("EVAL", store_with_ids_script, args.begin(), args.end());
+        };
+
+        // Execute it
+        boost::redis::generic_response res;
+        auto err = exec(command_class::writes, room_id, compose, res, yield);
+        if (err.ec)
+            return err;
+
+        // The script returns an array with the ID of each message, empty for the ones it couldn't store
+        auto result = parse_string_array(*res);
         if (result.has_error())
             return error_with_message{result.error()};
+        if (result->size() != messages.size())
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
         return std::move(*result);
     }
 
+    result_with_message<std::vector<message>> get_oldest_messages(
+        std::string_view room_id,
+        std::size_t keep_count,
+        std::size_t max_count,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_get_oldest_messages);
+
+        // Compose the request. XRANGE returns messages oldest first
+        auto compose = [room_id, max_count](auto& req) {
+            req.push("XLEN", room_id);
+            req.push("XRANGE", room_id, "-", "+", "COUNT", max_count);
+        };
+
+        // Execute it
+        boost::redis::generic_response res;
+        auto err = exec(command_class::history, room_id, compose, res, yield);
+        if (err.ec)
+            return err;
+
+        // Parse the response. The first node is the stream length
+        auto nodes = node_span(*res);
+        if (nodes.empty() || nodes[0].data_type != boost::redis::resp3::type::number)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        std::size_t length = 0u;
+        const auto& length_str = nodes[0].value;
+        auto length_res = std::from_chars(length_str.data(), length_str.data() + length_str.size(), length);
+        if (length_res.ec != std::errc{})
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        auto batches = parse_room_history_batch(nodes.subspan(1));
+        if (batches.has_error())
+            return error_with_message{batches.error()};
+        if (batches->size() != 1u)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+
+        // Exclude the messages we should keep
+        auto& msgs = batches->front().messages;
+        std::size_t num_archivable = length > keep_count ? length - keep_count : 0u;
+        if (msgs.size() > num_archivable)
+            msgs.resize(num_archivable);
+        return std::move(msgs);
+    }
+
+    error_with_message trim_messages(
+        std::string_view room_id,
+        std::string_view min_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_trim_messages);
+
+        // Compose the request. An approximate trim (~) only removes entire stream nodes
+        // (100 entries by default), so archiving batches smaller than a node would never
+        // be removed, and get_oldest_messages would keep returning them. Trim exactly
+        auto compose = [room_id, min_id](auto& req) {
+            req.push("XTRIM", room_id, "MINID", min_id);
+        };
+
+        // Execute it
+        boost::redis::generic_response res;
+        return exec(command_class::writes, room_id, compose, res, yield);
+    }
+
     error_with_message set_nonexisting_key(
         std::string_view key,
         std::string_view value,
@@ -127,55 +899,193 @@ public:
         boost::asio::yield_context yield
     ) final override
     {
+        latency_timer timer(histogram_id::redis_set_nonexisting_key);
+
         // Compose the request. NX prevents key overwrites, EX sets the TTL
-        boost::redis::request req;
-        req.push("SET", key, value, "NX", "EX", ttl.count());
+        auto compose = [key, value, ttl](auto& req) {
+            req.push("SET", key, value, "NX", "EX", ttl.count());
+        };
 
         // Execute it
-        boost::redis::response<std::optional<std::string>> res;
-        error_code ec;
-        conn_.async_exec(req, res, yield[ec]);
-        if (ec)
-            return error_with_message{ec};
+        boost::redis::generic_response res;
+        auto err = exec(command_class::sessions, key, compose, res, yield);
+        if (err.ec)
+            return err;
 
-        // Check
-        auto& result = std::get<0>(res);
-        if (result.has_error())
-            return error_with_message{errc::redis_parse_error, std::move(result).error().diagnostic};
-        return result.value().has_value() ? error_with_message{} : error_with_message{errc::already_exists};
+        // SET NX returns OK if the key was set, and null otherwise
+        if (res->size() != 1u)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        if (res->front().data_type == boost::redis::resp3::type::null)
+            return error_with_message{errc::already_exists};
+        return error_with_message{};
     }
 
     result_with_message<std::int64_t> get_int_key(std::string_view key, boost::asio::yield_context yield)
         final override
     {
-        // Compose the request
-        boost::redis::request req;
-        req.push("GET", key);
+        latency_timer timer(histogram_id::redis_get_int_key);
 
-        // Execute it
-        boost::redis::response<std::optional<std::int64_t>> res;
-        error_code ec;
-        conn_.async_exec(req, res, yield[ec]);
-        if (ec)
-            return error_with_message{ec};
-
-        // Check for errors
-        auto& result = std::get<0>(res);
-        if (result.has_error())
-            return error_with_message{errc::redis_parse_error, std::move(result).error().diagnostic};
-        auto opt = result.value();
+        // Execute the request
+        boost::redis::generic_response res;
+        auto err = exec(
+            command_class::sessions,
+            key,
+            [key](auto& req) { req.push("GET", key); },
+            res,
+            yield
+        );
+        if (err.ec)
+            return err;
 
         // Check whether the key was present
-        if (opt.has_value())
-            return opt.value();
-        else
+        if (res->size() != 1u)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        const auto& node = res->front();
+        if (node.data_type == boost::redis::resp3::type::null)
             return error_with_message{errc::not_found};
+
+        // Parse the value
+        std::int64_t value = 0;
+        auto parse_res = std::from_chars(node.value.data(), node.value.data() + node.value.size(), value);
+        if (parse_res.ec != std::errc{} || parse_res.ptr != node.value.data() + node.value.size())
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        return value;
+    }
+
+    error_with_message delete_key(std::string_view key, boost::asio::yield_context yield) final override
+    {
+        latency_timer timer(histogram_id::redis_delete_key);
+
+        // Execute the request. DEL returns the number of keys removed, which we don't need
+        boost::redis::generic_response res;
+        return exec(
+            command_class::sessions,
+            key,
+            [key](auto& req) { req.push("DEL", key); },
+            res,
+            yield
+        );
+    }
+
+    result_with_message<bool> take_tokens(
+        std::string_view key,
+        token_bucket_params params,
+        double cost,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_take_tokens);
+
+        // Compose the request. Rate limiting is cheap and latency sensitive, like session lookups
+        auto compose = [key, params, cost](auto& req) {
+            req.push(
+                "EVAL",
+                take_tokens_script,
+                1,
+                key,
+                std::to_string(params.capacity),
+                std::to_string(params.refill_per_second),
+                std::to_string(cost)
+            );
+        };
+
+        // Execute it
+        boost::redis::generic_response res;
+        auto err = exec(command_class::sessions, key, compose, res, yield);
+        if (err.ec)
+            return err;
+
+        // The script returns 1 if the tokens were taken, and 0 otherwise
+        if (res->size() != 1u || res->front().data_type != boost::redis::resp3::type::number)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        return res->front().value == "1";
+    }
+
+    error_with_message add_to_expiring_set(
+        std::string_view key,
+        std::string_view member,
+        std::chrono::system_clock::time_point expiry,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_add_to_expiring_set);
+
+        // Members are stored in a sorted set, scored by their expiry time
+        auto compose = [key, member, expiry](auto& req) {
+            req.push("ZADD", key, unix_seconds(expiry), member);
+            req.push("ZREMRANGEBYSCORE", key, "-inf", unix_seconds(std::chrono::system_clock::now()));
+        };
+
+        // Execute it. ZADD and ZREMRANGEBYSCORE return counts, which we don't need
+        boost::redis::generic_response res;
+        return exec(command_class::sessions, key, compose, res, yield);
+    }
+
+    result_with_message<std::vector<std::string>> get_expiring_set(
+        std::string_view key,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_get_expiring_set);
+
+        // Execute the request. The lower bound is exclusive
+        auto compose = [key](auto& req) {
+            auto min_score = "(" + std::to_string(unix_seconds(std::chrono::system_clock::now()));
+            req.push("ZRANGEBYSCORE", key, min_score, "+inf");
+        };
+        boost::redis::generic_response res;
+        auto err = exec(command_class::sessions, key, compose, res, yield);
+        if (err.ec)
+            return err;
+
+        // The response is an array of blob strings
+        if (res->empty() || res->front().data_type != boost::redis::resp3::type::array)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        std::vector<std::string> members;
+        members.reserve(res->size() - 1u);
+        for (auto it = res->begin() + 1; it != res->end(); ++it)
+            members.push_back(std::move(it->value));
+        return members;
+    }
+
+    result_with_message<bool> expiring_set_contains(
+        std::string_view key,
+        std::string_view member,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        latency_timer timer(histogram_id::redis_expiring_set_contains);
+
+        // Execute the request
+        boost::redis::generic_response res;
+        auto err = exec(
+            command_class::sessions,
+            key,
+            [key, member](auto& req) { req.push("ZSCORE", key, member); },
+            res,
+            yield
+        );
+        if (err.ec)
+            return err;
+
+        // ZSCORE returns null if the member is not present, and its score otherwise.
+        // Depending on the protocol version, scores are doubles or strings
+        if (res->size() != 1u)
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        const auto& node = res->front();
+        if (node.data_type == boost::redis::resp3::type::null)
+            return false;
+        std::int64_t expiry = 0;
+        auto parse_res = std::from_chars(node.value.data(), node.value.data() + node.value.size(), expiry);
+        if (parse_res.ec != std::errc{})
+            CHAT_RETURN_ERROR_WITH_MESSAGE(errc::redis_parse_error, "")
+        return expiry > unix_seconds(std::chrono::system_clock::now());
     }
 };
 
 }  // namespace
 
-std::unique_ptr<redis_client> chat::create_redis_client(boost::asio::any_io_executor ex)
+std::unique_ptr<redis_client> chat::create_redis_client(boost::asio::any_io_executor ex, bool fail_fast_stores)
 {
-    return std::unique_ptr<redis_client>{new redis_client_impl(std::move(ex))};
+    return std::unique_ptr<redis_client>{new redis_client_impl(std::move(ex), fail_fast_stores)};
 }
\ No newline at end of file
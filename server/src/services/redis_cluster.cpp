@@ -0,0 +1,186 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/redis_cluster.hpp"
+
+#include <boost/redis/resp3/type.hpp>
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+namespace resp3 = boost::redis::resp3;
+
+// CRC16, as specified by the Redis Cluster spec (XMODEM variant: polynomial 0x1021, initial value 0)
+static std::uint16_t crc16(std::string_view data)
+{
+    std::uint16_t crc = 0;
+    for (unsigned char c : data)
+    {
+        crc ^= static_cast<std::uint16_t>(c << 8);
+        for (int i = 0; i < 8; ++i)
+            crc = (crc & 0x8000u) ? static_cast<std::uint16_t>((crc << 1) ^ 0x1021u)
+                                  : static_cast<std::uint16_t>(crc << 1);
+    }
+    return crc;
+}
+
+std::uint16_t chat::redis_hash_slot(std::string_view key)
+{
+    // If there is a non-empty hash tag, only hash it
+    auto open_pos = key.find('{');
+    if (open_pos != std::string_view::npos)
+    {
+        auto close_pos = key.find('}', open_pos + 1u);
+        if (close_pos != std::string_view::npos && close_pos != open_pos + 1u)
+            key = key.substr(open_pos + 1u, close_pos - open_pos - 1u);
+    }
+    return static_cast<std::uint16_t>(crc16(key) % redis_num_slots);
+}
+
+// Parses a slot number
+static std::optional<std::uint16_t> parse_slot(std::string_view from)
+{
+    std::uint16_t res = 0;
+    auto parse_res = std::from_chars(from.data(), from.data() + from.size(), res);
+    if (parse_res.ec != std::errc{} || parse_res.ptr != from.data() + from.size() || res >= redis_num_slots)
+        return std::nullopt;
+    return res;
+}
+
+std::optional<redis_redirect> chat::parse_redis_redirect(std::string_view error_message)
+{
+    // Error kind
+    bool is_ask = false;
+    if (error_message.substr(0, 6) == "MOVED ")
+        error_message.remove_prefix(6);
+    else if (error_message.substr(0, 4) == "ASK ")
+        error_message.remove_prefix(4), is_ask = true;
+    else
+        return std::nullopt;
+
+    // Slot
+    auto space_pos = error_message.find(' ');
+    if (space_pos == std::string_view::npos)
+        return std::nullopt;
+    auto slot = parse_slot(error_message.substr(0, space_pos));
+    if (!slot)
+        return std::nullopt;
+
+    // Host and port. IPv6 addresses contain colons, so the port is after the last one.
+    // The host may be empty, meaning the host we sent the command to
+    auto address = error_message.substr(space_pos + 1u);
+    auto colon_pos = address.rfind(':');
+    if (colon_pos == std::string_view::npos || colon_pos + 1u == address.size())
+        return std::nullopt;
+    return redis_redirect{
+        is_ask,
+        *slot,
+        std::string(address.substr(0, colon_pos)),
+        std::string(address.substr(colon_pos + 1u)),
+    };
+}
+
+static bool is_string_type(resp3::type t) noexcept
+{
+    return t == resp3::type::blob_string || t == resp3::type::simple_string;
+}
+
+result<std::vector<redis_slot_range>> chat::parse_cluster_slots(boost::span<const resp3::node> from)
+{
+    // Each range has the form [first, last, [host, port, id, ...], replicas...]
+    enum class state
+    {
+        first,
+        last,
+        primary,
+        host,
+        port,
+        done,
+    };
+
+    // Top-level array
+    if (from.empty() || from[0].data_type != resp3::type::array || from[0].depth != 0u)
+        CHAT_RETURN_ERROR(errc::redis_parse_error)
+
+    std::vector<redis_slot_range> res;
+    redis_slot_range current{};
+    auto st = state::done;
+
+    for (const auto& node : from.subspan(1))
+    {
+        if (node.depth == 0u)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+
+        if (node.depth == 1u)
+        {
+            // A new range begins. The previous one must have been complete
+            if (st != state::done || node.data_type != resp3::type::array)
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            current = redis_slot_range{};
+            st = state::first;
+        }
+        else if (node.depth == 2u && (st == state::first || st == state::last))
+        {
+            if (node.data_type != resp3::type::number)
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            auto slot = parse_slot(node.value);
+            if (!slot)
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            if (st == state::first)
+            {
+                current.first = *slot;
+                st = state::last;
+            }
+            else
+            {
+                if (*slot < current.first)
+                    CHAT_RETURN_ERROR(errc::redis_parse_error)
+                current.last = *slot;
+                st = state::primary;
+            }
+        }
+        else if (node.depth == 2u && st == state::primary)
+        {
+            if (node.data_type != resp3::type::array)
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            st = state::host;
+        }
+        else if (node.depth == 3u && st == state::host)
+        {
+            if (!is_string_type(node.data_type))
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            current.host = node.value;
+            st = state::port;
+        }
+        else if (node.depth == 3u && st == state::port)
+        {
+            if (node.data_type != resp3::type::number)
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+            current.port = node.value;
+            res.push_back(std::move(current));
+            st = state::done;
+        }
+        else if (st != state::done)
+        {
+            // Malformed range (e.g. the primary node lacks a host or port)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+        }
+        // Else: node IDs, metadata and replicas, which we ignore
+    }
+
+    if (st != state::done)
+        CHAT_RETURN_ERROR(errc::redis_parse_error)
+    return res;
+}
@@ -9,12 +9,15 @@
 
 #include <boost/describe/class.hpp>
 #include <boost/json/parse.hpp>
-#include <boost/json/serialize.hpp>
-#include <boost/json/value_from.hpp>
 #include <boost/json/value_to.hpp>
 #include <boost/redis/resp3/type.hpp>
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
 #include <string>
+#include <string_view>
 
 #include "error.hpp"
 #include "timestamp.hpp"
@@ -34,29 +37,113 @@ struct redis_wire_message
 };
 BOOST_DESCRIBE_STRUCT(redis_wire_message, (), (content, timestamp, user_id))
 
-}  // namespace
+// Messages are stored using a compact binary format:
+//    version byte (binary_format_v1)
+//    user_id, as a zigzag-encoded varint
+//    timestamp, as a zigzag-encoded varint
+//    content length, as a varint
+//    content, as raw bytes
+// Old versions stored messages as JSON objects. A JSON object can't start with
+// the version byte, so both formats can be told apart by looking at the first byte.
+constexpr unsigned char binary_format_v1 = 0x01;
+
+// Maximum size of a varint encoding a 64-bit integer
+constexpr std::size_t max_varint_size = 10u;
 
-static message to_message(const redis_wire_message& from, std::string id)
+void append_varint(std::uint64_t value, std::string& to)
 {
-    return chat::message{
-        std::move(id),
-        std::string(from.content),
-        parse_timestamp(from.timestamp),
-        from.user_id,
-    };
+    while (value >= 0x80u)
+    {
+        to.push_back(static_cast<char>((value & 0x7fu) | 0x80u));
+        value >>= 7u;
+    }
+    to.push_back(static_cast<char>(value));
 }
 
-result<std::vector<message_batch>> chat::parse_room_history_batch(node_span nodes)
+// Parses a varint from the beginning of from, removing it from the input.
+// Returns false on error
+bool parse_varint(std::string_view& from, std::uint64_t& to)
 {
-    std::vector<message_batch> res;
+    std::uint64_t res = 0u;
+    for (std::size_t i = 0; i < from.size() && i < max_varint_size; ++i)
+    {
+        auto byte = static_cast<unsigned char>(from[i]);
+        res |= static_cast<std::uint64_t>(byte & 0x7fu) << (7u * i);
+        if (!(byte & 0x80u))
+        {
+            from.remove_prefix(i + 1u);
+            to = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Zigzag encoding makes small negative numbers use few bytes
+std::uint64_t zigzag_encode(std::int64_t value) noexcept
+{
+    return (static_cast<std::uint64_t>(value) << 1u) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+std::int64_t zigzag_decode(std::uint64_t value) noexcept
+{
+    return static_cast<std::int64_t>((value >> 1u) ^ (~(value & 1u) + 1u));
+}
+
+// Parses a message in binary format, without the version byte.
+// The returned content points into from
+std::optional<redis_wire_message> parse_binary_message(std::string_view from)
+{
+    std::uint64_t user_id = 0u, timestamp = 0u, content_size = 0u;
+    if (!parse_varint(from, user_id) || !parse_varint(from, timestamp) || !parse_varint(from, content_size))
+        return std::nullopt;
+    if (content_size != from.size())
+        return std::nullopt;
+    return redis_wire_message{from, zigzag_decode(timestamp), zigzag_decode(user_id)};
+}
+
+}  // namespace
+
+// Parses a message payload, in either binary or JSON format, and calls
+// on_message(const redis_wire_message& msg, bool in_place). If in_place is true,
+// msg.content points into payload. Otherwise, it's only valid until on_message returns.
+template <class OnMessage>
+static error_code parse_redis_message(std::string_view payload, OnMessage&& on_message)
+{
+    // Binary format. The content can be used in-place
+    if (!payload.empty() && static_cast<unsigned char>(payload.front()) == binary_format_v1)
+    {
+        auto msg = parse_binary_message(payload.substr(1));
+        if (!msg)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+        on_message(*msg, true);
+        return {};
+    }
+
+    // Legacy JSON format. The content points into the parsed DOM
     error_code ec;
+    auto jv = boost::json::parse(payload, ec);
+    if (ec)
+        CHAT_RETURN_ERROR(ec)
+    auto msg = boost::json::try_value_to<redis_wire_message>(jv);
+    if (msg.has_error())
+        CHAT_RETURN_ERROR(msg.error())
+    on_message(msg.value(), false);
+    return {};
+}
 
+// Parses a batch of room history responses. Calls on_response() when a new response
+// begins, and on_message(std::string_view id, const redis_wire_message& msg, bool in_place)
+// for every message (see parse_redis_message). id points into nodes.
+template <class OnResponse, class OnMessage>
+static error_code parse_room_history_impl(node_span nodes, OnResponse&& on_response, OnMessage&& on_message)
+{
     // We need a one-pass parser. Every response has the following format:
     // list of MessageEntry:
     //    MessageEntry[0]: string (id)
     //    MessageEntry[1]: list<string> (key-value pairs; always an even number)
     // Since manipulating nodes is cumbersome, we have a single key named "payload",
-    // with a single value containing a JSON
+    // with a single value containing the serialized message
     // This function is capable of parsing multiple, batched responses
     enum state_t
     {
@@ -71,7 +158,7 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
     struct parser_data_t
     {
         state_t state{wants_level0_list};
-        const std::string* id{};
+        std::string_view id{};
     } data;
 
     for (const auto& node : nodes)
@@ -83,7 +170,7 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
             if (node.depth != 0u)
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
-            res.emplace_back();
+            on_response();
             data.state = wants_level0_or_entry_list;
         }
         else if (data.state == wants_level0_or_entry_list)
@@ -94,7 +181,7 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
             if (node.depth == 0u)
             {
                 // New response
-                res.emplace_back();
+                on_response();
                 data.state = wants_level0_or_entry_list;
             }
             else if (node.depth == 1u)
@@ -116,7 +203,7 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
             if (node.depth != 2u)
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
-            data.id = &node.value;
+            data.id = node.value;
             data.state = wants_attr_list;
         }
         else if (data.state == wants_attr_list)
@@ -126,7 +213,7 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
             if (node.depth != 2u)
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
-            if (node.aggregate_size != 2u)  // single key/value pair, serialized as JSON
+            if (node.aggregate_size != 2u)  // single key/value pair
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
             data.state = wants_key;
         }
@@ -145,24 +232,22 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
         else if (data.state == wants_value)
         {
             // We're in the attribute list, waiting for the value. It contains
-            // a JSON payload with the message contents
+            // a payload with the message contents
             if (node.data_type != resp3::type::blob_string)
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
             if (node.depth != 3u)
                 CHAT_RETURN_ERROR(errc::redis_parse_error)
 
             // Parse payload
-            auto jv = boost::json::parse(node.value, ec);
+            auto ec = parse_redis_message(node.value, [&](const redis_wire_message& msg, bool in_place) {
+                on_message(data.id, msg, in_place);
+            });
             if (ec)
-                CHAT_RETURN_ERROR(ec)
-            auto msg = boost::json::try_value_to<redis_wire_message>(jv);
-            if (msg.has_error())
-                CHAT_RETURN_ERROR(msg.error())
-            res.back().messages.push_back(to_message(msg.value(), *data.id));
+                return ec;
 
             // Reset parser state
             data.state = wants_level0_or_entry_list;
-            data.id = nullptr;
+            data.id = {};
         }
     }
 
@@ -170,6 +255,48 @@ result<std::vector<message_batch>> chat::parse_room_history_batch(node_span node
     if (data.state != wants_level0_or_entry_list && data.state != wants_level0_list)
         CHAT_RETURN_ERROR(errc::redis_parse_error)
 
+    return {};
+}
+
+result<std::vector<message_batch>> chat::parse_room_history_batch(node_span nodes)
+{
+    std::vector<message_batch> res;
+    auto ec = parse_room_history_impl(
+        nodes,
+        [&res] { res.emplace_back(); },
+        [&res](std::string_view id, const redis_wire_message& msg, bool) {
+            res.back().messages.push_back(message{
+                std::string(id),
+                std::string(msg.content),
+                parse_timestamp(msg.timestamp),
+                msg.user_id,
+            });
+        }
+    );
+    if (ec)
+        return ec;
+    return res;
+}
+
+result<message_view_batch> chat::parse_room_history_views(node_span nodes)
+{
+    message_view_batch res;
+    std::size_t num_responses = 0u;
+    auto ec = parse_room_history_impl(
+        nodes,
+        [&num_responses] { ++num_responses; },
+        [&res](std::string_view id, const redis_wire_message& msg, bool in_place) {
+            // Messages in the legacy format can't reference the response
+            auto content = msg.content;
+            if (!in_place)
+                content = res.storage.emplace_back(content);
+            res.messages.push_back(message_view{id, content, parse_timestamp(msg.timestamp), msg.user_id});
+        }
+    );
+    if (ec)
+        return ec;
+    if (num_responses != 1u)
+        CHAT_RETURN_ERROR(errc::redis_parse_error)
     return res;
 }
 
@@ -194,11 +321,85 @@ result<std::vector<std::string>> chat::parse_batch_xadd_response(node_span nodes
     return res;
 }
 
+result<std::vector<std::string>> chat::parse_string_array(node_span nodes)
+{
+    // The response has the following format:
+    //    array (aggregate), depth 0
+    //        string, depth 1, once per element
+    if (nodes.empty() || nodes[0].depth != 0u || nodes[0].data_type != resp3::type::array)
+        CHAT_RETURN_ERROR(errc::redis_parse_error)
+    std::size_t num_elms = nodes[0].aggregate_size;
+    if (nodes.size() != num_elms + 1u)
+        CHAT_RETURN_ERROR(errc::redis_parse_error)
+
+    std::vector<std::string> res;
+    res.reserve(num_elms);
+    for (const auto& node : nodes.subspan(1))
+    {
+        if (node.depth != 1u || node.data_type != resp3::type::blob_string)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+        res.push_back(node.value);
+    }
+
+    return res;
+}
+
+result<std::vector<redis_pubsub_message>> chat::parse_pubsub_pushes(node_span nodes)
+{
+    // Every push has the following format:
+    //    push (aggregate), depth 0
+    //        string (push kind, e.g. pmessage or psubscribe), depth 1
+    //        other attributes, depth 1. For pmessage, pattern, channel and payload
+    std::vector<redis_pubsub_message> res;
+
+    std::size_t i = 0;
+    while (i < nodes.size())
+    {
+        // Top-level push node
+        const auto& push_node = nodes[i];
+        if (push_node.depth != 0u || push_node.data_type != resp3::type::push)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+        std::size_t num_attrs = push_node.aggregate_size;
+        if (nodes.size() - i - 1u < num_attrs)
+            CHAT_RETURN_ERROR(errc::redis_parse_error)
+
+        // Attributes. Our pushes don't contain nested aggregates
+        auto attrs = nodes.subspan(i + 1u, num_attrs);
+        for (const auto& attr : attrs)
+        {
+            if (attr.depth != 1u || resp3::is_aggregate(attr.data_type))
+                CHAT_RETURN_ERROR(errc::redis_parse_error)
+        }
+
+        // Only pmessage pushes carry actual messages
+        if (num_attrs == 4u && attrs[0].value == "pmessage")
+            res.push_back(redis_pubsub_message{attrs[2].value, attrs[3].value});
+
+        i += num_attrs + 1u;
+    }
+
+    return res;
+}
+
 std::string chat::serialize_redis_message(const message& msg)
 {
-    // Construct the wire message
-    redis_wire_message redis_msg{msg.content, serialize_timestamp(msg.timestamp), msg.user_id};
+    std::string res;
+    res.reserve(1u + 3u * max_varint_size + msg.content.size());
+    res.push_back(static_cast<char>(binary_format_v1));
+    append_varint(zigzag_encode(msg.user_id), res);
+    append_varint(zigzag_encode(serialize_timestamp(msg.timestamp)), res);
+    append_varint(msg.content.size(), res);
+    res += msg.content;
+    return res;
+}
 
-    // Serialize it to JSON
-    return boost::json::serialize(boost::json::value_from(redis_msg));
+result<message> chat::deserialize_redis_message(std::string_view payload)
+{
+    message res;
+    auto ec = parse_redis_message(payload, [&res](const redis_wire_message& msg, bool) {
+        res = message{"", std::string(msg.content), parse_timestamp(msg.timestamp), msg.user_id};
+    });
+    if (ec)
+        return ec;
+    return res;
 }
@@ -0,0 +1,363 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/room_history_cache.hpp"
+
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "error.hpp"
+#include "message_id.hpp"
+#include "services/history_snapshot.hpp"
+
+using namespace chat;
+
+room_history_cache::room_entry& room_history_cache::get_entry(std::string_view room_id)
+{
+    auto it = rooms_.find(room_id);
+    if (it == rooms_.end())
+        it = rooms_.emplace(std::string(room_id), room_entry{}).first;
+    return it->second;
+}
+
+void room_history_cache::add_newest(room_entry& entry, message msg)
+{
+    // Messages may be received more than once (e.g. if they were received
+    // while loading and were also included in the loaded batch)
+    auto it = std::find_if(entry.messages.begin(), entry.messages.end(), [&msg](const message& m) {
+        return m.id == msg.id;
+    });
+    if (it != entry.messages.end())
+        return;
+
+    // Insert the message and remove older ones, if required
+    entry.messages.push_front(std::move(msg));
+    while (entry.messages.size() > max_messages_)
+    {
+        entry.messages.pop_back();
+        entry.has_more = true;
+    }
+}
+
+void room_history_cache::prune_usernames()
+{
+    // Messages may reference at most rooms * max_messages users. Only prune when the map
+    // grows well beyond that, so the cost is amortized
+    if (usernames_.size() <= 2u * rooms_.size() * max_messages_)
+        return;
+
+    std::unordered_set<std::int64_t> used_ids;
+    for (const auto& room : rooms_)
+        for (const auto& msg : room.second.messages)
+            used_ids.insert(msg.user_id);
+
+    for (auto it = usernames_.begin(); it != usernames_.end();)
+    {
+        if (used_ids.count(it->first))
+            ++it;
+        else
+            it = usernames_.erase(it);
+    }
+}
+
+std::optional<std::pair<std::vector<message_batch>, username_map>> room_history_cache::get(
+    boost::span<const std::string_view> room_ids
+) const
+{
+    std::pair<std::vector<message_batch>, username_map> res;
+    res.first.reserve(room_ids.size());
+
+    for (auto room_id : room_ids)
+    {
+        // Look up the room
+        auto it = rooms_.find(room_id);
+        if (it == rooms_.end() || !it->second.loaded)
+            return std::nullopt;
+        const auto& entry = it->second;
+
+        // Copy the messages and the usernames they reference
+        message_batch batch{{entry.messages.begin(), entry.messages.end()}, entry.has_more};
+        for (const auto& msg : batch.messages)
+        {
+            auto username_it = usernames_.find(msg.user_id);
+            if (username_it != usernames_.end())
+                res.second.insert(*username_it);
+        }
+        res.first.push_back(std::move(batch));
+    }
+
+    return res;
+}
+
+void room_history_cache::begin_load(boost::span<const std::string_view> room_ids)
+{
+    for (auto room_id : room_ids)
+    {
+        auto& entry = get_entry(room_id);
+
+        // Subscribe to the room, so we get notified of new messages.
+        // This must happen before the load starts, to avoid missing messages
+        if (!entry.subscribed)
+        {
+            pubsub_->subscribe(shared_from_this(), {&room_id, 1u});
+            entry.subscribed = true;
+        }
+
+        ++entry.pending_loads;
+    }
+}
+
+void room_history_cache::finish_load(
+    boost::span<const std::string_view> room_ids,
+    boost::span<const message_batch> batches,
+    const username_map& usernames
+)
+{
+    assert(room_ids.size() == batches.size());
+
+    for (std::size_t i = 0; i < room_ids.size(); ++i)
+    {
+        auto& entry = get_entry(room_ids[i]);
+        assert(entry.pending_loads > 0u);
+        --entry.pending_loads;
+
+        // If another load populated the entry, it's already being kept up to date.
+        // Entries populated from a snapshot may be missing messages, so they're replaced
+        if (!entry.loaded || entry.stale)
+        {
+            // Store the loaded messages
+            const auto& msgs = batches[i].messages;
+            entry.messages.assign(msgs.begin(), msgs.begin() + (std::min)(msgs.size(), max_messages_));
+            entry.has_more = batches[i].has_more || msgs.size() > max_messages_;
+
+            // Encode them once, so composing events doesn't need to serialize them again
+            for (auto& msg : entry.messages)
+            {
+                if (!msg.encoded)
+                {
+                    auto it = usernames.find(msg.user_id);
+                    auto username = it == usernames.end() ? std::string_view() : std::string_view(it->second);
+                    msg.encoded = encode_message(msg, username);
+                }
+            }
+
+            // Add any messages received while loading
+            for (auto& msg : entry.received_while_loading)
+                add_newest(entry, std::move(msg));
+            entry.received_while_loading.clear();
+            entry.loaded = true;
+            entry.stale = false;
+        }
+
+        if (entry.pending_loads == 0u)
+            entry.received_while_loading.clear();
+    }
+
+    // Store the usernames
+    for (const auto& username : usernames)
+        usernames_.insert(username);
+    prune_usernames();
+}
+
+void room_history_cache::abort_load(boost::span<const std::string_view> room_ids)
+{
+    for (auto room_id : room_ids)
+    {
+        auto& entry = get_entry(room_id);
+        assert(entry.pending_loads > 0u);
+        if (--entry.pending_loads == 0u)
+            entry.received_while_loading.clear();
+    }
+}
+
+void room_history_cache::load_snapshot(const history_snapshot& snapshot)
+{
+    // The usernames, required to encode the messages
+    username_map usernames;
+    for (const auto& u : snapshot.usernames())
+        usernames.emplace(u.first, std::string(u.second));
+
+    for (const auto& room : snapshot.rooms())
+    {
+        // Entries loaded from the database are more up to date, and entries being loaded will be soon
+        auto& entry = get_entry(room.id);
+        if (entry.loaded || entry.pending_loads > 0u)
+            continue;
+
+        // Subscribe to the room, so the entry gets new messages
+        if (!entry.subscribed)
+        {
+            pubsub_->subscribe(shared_from_this(), {&room.id, 1u});
+            entry.subscribed = true;
+        }
+
+        // Copy the messages out of the snapshot, encoding them
+        entry.messages.clear();
+        for (std::size_t i = 0; i < room.messages.size() && i < max_messages_; ++i)
+        {
+            const auto& view = room.messages[i];
+            message msg{std::string(view.id), std::string(view.content), view.timestamp, view.user_id};
+            auto it = usernames.find(msg.user_id);
+            auto username = it == usernames.end() ? std::string_view() : std::string_view(it->second);
+            msg.encoded = encode_message(msg, username);
+            entry.messages.push_back(std::move(msg));
+        }
+        entry.has_more = room.has_more || room.messages.size() > max_messages_;
+        entry.loaded = true;
+        entry.stale = true;
+    }
+
+    // Store the usernames
+    for (auto& username : usernames)
+        usernames_.insert(std::move(username));
+    prune_usernames();
+}
+
+void room_history_cache::save_snapshot(history_snapshot_builder& builder) const
+{
+    std::unordered_set<std::int64_t> user_ids;
+    for (const auto& room : rooms_)
+    {
+        // Stale entries would carry the messages they miss over to the next run
+        const auto& entry = room.second;
+        if (!entry.loaded || entry.stale)
+            continue;
+
+        builder.begin_room(room.first, entry.has_more, entry.messages.size());
+        for (const auto& msg : entry.messages)
+        {
+            builder.add_message(msg);
+            user_ids.insert(msg.user_id);
+        }
+    }
+
+    for (auto user_id : user_ids)
+    {
+        auto it = usernames_.find(user_id);
+        if (it != usernames_.end())
+            builder.add_username(user_id, it->second);
+    }
+}
+
+// Updates the IDs of messages that were broadcast before being stored, and removes the ones that
+// couldn't be stored. messages is sorted by ID, newest first or oldest first, depending on newest_first.
+// New IDs may change the order of the messages, so it's restored
+template <class MessageContainer>
+static void apply_corrections(
+    MessageContainer& messages,
+    boost::span<const message_id_correction> corrections,
+    const username_map& usernames,
+    bool newest_first
+)
+{
+    bool changed = false;
+    for (const auto& correction : corrections)
+    {
+        auto it = std::find_if(messages.begin(), messages.end(), [&correction](const message& m) {
+            return m.id == correction.id;
+        });
+        if (it == messages.end())
+            continue;
+        changed = true;
+        if (correction.new_id.empty())
+        {
+            messages.erase(it);
+        }
+        else
+        {
+            // The encoded message contains the ID, so it must be encoded again
+            it->id = correction.new_id;
+            auto username_it = usernames.find(it->user_id);
+            it->encoded = encode_message(
+                *it,
+                username_it == usernames.end() ? std::string_view() : std::string_view(username_it->second)
+            );
+        }
+    }
+
+    // Restore the order. We never generate invalid IDs, but they would be treated as the oldest ones
+    if (changed)
+    {
+        auto key = [](const message& m) { return parse_message_id(m.id).value_or(parsed_message_id{}); };
+        std::stable_sort(messages.begin(), messages.end(), [&](const message& lhs, const message& rhs) {
+            return newest_first ? key(rhs) < key(lhs) : key(lhs) < key(rhs);
+        });
+    }
+}
+
+void room_history_cache::on_corrections(parsed_server_messages_corrected_event& evt)
+{
+    auto it = rooms_.find(evt.room_id);
+    if (it == rooms_.end())
+        return;
+    auto& entry = it->second;
+    apply_corrections(entry.messages, evt.corrections, usernames_, true);
+    apply_corrections(entry.received_while_loading, evt.corrections, usernames_, false);
+}
+
+void room_history_cache::on_message(std::shared_ptr<const framed_message> message)
+{
+    // Parse the message. The DOM used for parsing is no longer needed once this returns.
+    // Messages broadcast before being stored may be followed by corrections, which are rare
+    auto evt = parse_server_messages_event(message->payload(), parse_arena_.json_storage());
+    parse_arena_.reset();
+    if (evt.has_error())
+    {
+        auto corrections = parse_server_messages_corrected_event(
+            message->payload(),
+            parse_arena_.json_storage()
+        );
+        parse_arena_.reset();
+        if (corrections.has_error())
+            log_error(evt.error(), "Parsing a message in room_history_cache");
+        else
+            on_corrections(*corrections);
+        return;
+    }
+
+    // Find the entry
+    auto it = rooms_.find(evt->room_id);
+    if (it == rooms_.end())
+        return;
+    auto& entry = it->second;
+
+    // Encode the messages once, so composing events doesn't need to serialize them again
+    for (auto& msg : evt->messages)
+        msg.encoded = encode_message(msg, evt->usernames[msg.user_id]);
+
+    // Update it. If it's being loaded, record the messages for later.
+    // Entries populated from a snapshot are served while they're reloaded, so they need both
+    bool record = entry.pending_loads > 0u && (!entry.loaded || entry.stale);
+    if (!entry.loaded && !record)
+        return;
+    if (record)
+    {
+        entry.received_while_loading.insert(
+            entry.received_while_loading.end(),
+            evt->messages.begin(),
+            evt->messages.end()
+        );
+    }
+    if (entry.loaded)
+    {
+        for (auto& msg : evt->messages)
+            add_newest(entry, std::move(msg));
+    }
+
+    // Update the usernames
+    for (auto& username : evt->usernames)
+        usernames_[username.first] = std::move(username.second);
+    prune_usernames();
+}
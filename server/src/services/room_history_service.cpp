@@ -7,16 +7,34 @@
 
 #include "services/room_history_service.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "api/api_types.hpp"
 #include "business_types.hpp"
+#include "message_id.hpp"
 #include "services/mysql_client.hpp"
 #include "services/redis_client.hpp"
+#include "services/redis_serialization.hpp"
+#include "services/room_history_cache.hpp"
+#include "util/metrics.hpp"
+#include "util/run_parallel.hpp"
 
 using namespace chat;
 
+// Maximum number of archive reads a single request runs concurrently
+static constexpr std::size_t max_concurrent_archive_reads = 4u;
+
 static std::vector<std::int64_t> unique_user_ids(const std::vector<message_batch>& input)
 {
     std::unordered_set<std::int64_t> set;
@@ -26,46 +44,335 @@ static std::vector<std::int64_t> unique_user_ids(const std::vector<message_batch
     return std::vector<std::int64_t>(set.begin(), set.end());
 }
 
+// Completes a batch that has fewer messages than a full batch with archived messages,
+// older than the ones in it, or than first_message_id if the batch is empty
+static error_with_message complete_from_archive(
+    mysql_client& mysql,
+    std::string_view room_id,
+    std::optional<std::string_view> first_message_id,
+    bool allow_replica,
+    message_batch& batch,
+    boost::asio::yield_context yield
+)
+{
+    // Archived messages are older than anything in Redis
+    std::optional<std::string_view> before_id = first_message_id;
+    if (!batch.messages.empty())
+        before_id = batch.messages.back().id;
+
+    std::size_t remaining = redis_client::message_batch_size - batch.messages.size();
+    auto archived_result = mysql.get_archived_messages(room_id, before_id, remaining, allow_replica, yield);
+    if (archived_result.has_error())
+        return std::move(archived_result).error();
+
+    batch.has_more = archived_result->size() == remaining;
+    batch.messages.insert(
+        batch.messages.end(),
+        std::make_move_iterator(archived_result->begin()),
+        std::make_move_iterator(archived_result->end())
+    );
+    return {};
+}
+
+// Composes a key identifying a set of rooms, for request coalescing
+static std::string room_ids_key(boost::span<const std::string_view> room_ids)
+{
+    std::string res;
+    for (auto room_id : room_ids)
+    {
+        res += room_id;
+        res.push_back('\0');
+    }
+    return res;
+}
+
 result_with_message<std::pair<std::vector<message_batch>, username_map>> room_history_service::
     get_room_history(boost::span<const std::string_view> room_ids, boost::asio::yield_context yield)
 {
+    if (!cache_)
+        return get_room_history_uncached(room_ids, std::nullopt, {}, true, yield);
+
+    // Try to serve the request from the cache
+    auto cached = cache_->get(room_ids);
+    if (cached)
+        return std::move(*cached);
+
+    // Not cached. Load the history and store it in the cache
+    return load_into_cache(room_ids, yield);
+}
+
+error_with_message room_history_service::reload_cached_history(
+    boost::span<const std::string_view> room_ids,
+    boost::asio::yield_context yield
+)
+{
+    assert(cache_ != nullptr);
+    auto res = load_into_cache(room_ids, yield);
+    if (res.has_error())
+        return std::move(res).error();
+    return {};
+}
+
+result_with_message<std::pair<std::vector<message_batch>, username_map>> room_history_service::
+    load_into_cache(boost::span<const std::string_view> room_ids, boost::asio::yield_context yield)
+{
+    // If somebody else is already loading these rooms, wait for them.
+    // The cache relies on loads seeing every message published before they start
+    // (later ones are received via pubsub), so they can't be served by replicas
+    return cache_->loads().run(
+        room_ids_key(room_ids),
+        [this, room_ids](boost::asio::yield_context yield) {
+            cache_->begin_load(room_ids);
+            auto res = get_room_history_uncached(room_ids, std::nullopt, {}, false, yield);
+            if (res.has_error())
+                cache_->abort_load(room_ids);
+            else
+                cache_->finish_load(room_ids, res->first, res->second);
+            return res;
+        },
+        yield
+    );
+}
+
+result_with_message<std::pair<std::vector<message_batch>, username_map>> room_history_service::
+    get_room_history_uncached(
+        boost::span<const std::string_view> room_ids,
+        std::optional<std::string_view> first_message_id,
+        boost::span<const std::string_view> since_ids,
+        bool allow_replica,
+        boost::asio::yield_context yield
+    )
+{
+    assert(since_ids.empty() || since_ids.size() == room_ids.size());
+
     // Compose an array of requests for Redis
     std::vector<redis_client::room_histoy_request> redis_req;
     redis_req.resize(room_ids.size());
     for (std::size_t i = 0; i < room_ids.size(); ++i)
+    {
         redis_req[i].room_id = room_ids[i];
+        redis_req[i].last_message_id = first_message_id;
+        if (!since_ids.empty() && !since_ids[i].empty())
+            redis_req[i].since_message_id = since_ids[i];
+    }
 
     // Lookup messages
-    auto batches_result = redis_->get_room_history(redis_req, yield);
+    using pref_t = redis_client::read_preference;
+    auto pref = allow_replica ? pref_t::replica : pref_t::primary;
+    auto batches_result = redis_->get_room_history(redis_req, pref, yield);
     if (batches_result.has_error())
         return std::move(batches_result).error();
     assert(batches_result->size() == room_ids.size());
 
-    // Collect the IDs we need to lookup
-    auto user_ids = unique_user_ids(*batches_result);
+    // Redis only holds the most recent messages of each room. Older ones are archived
+    // into MySQL. Find the rooms for which Redis didn't have enough messages
+    std::vector<std::size_t> archive_rooms;
+    for (std::size_t i = 0; i < room_ids.size(); ++i)
+    {
+        auto& batch = (*batches_result)[i];
+        if (batch.messages.size() >= redis_client::message_batch_size)
+            continue;
 
-    // Look them up
-    auto usernames_result = mysql_->get_usernames(user_ids, yield);
+        // If the client has some history, and Redis returned less than a batch, these are
+        // all the messages the client missed. Redis holds many more messages than a batch,
+        // so none of them has been archived
+        if (redis_req[i].since_message_id)
+        {
+            batch.is_delta = true;
+            continue;
+        }
+        archive_rooms.push_back(i);
+    }
+
+    // The users that sent the messages in Redis are known already, so they're looked up
+    // concurrently with the archive reads. Rooms are read from the archive concurrently, too,
+    // but only a few at a time, so requests for many rooms don't take all the connections
+    auto user_ids = unique_user_ids(*batches_result);
+    result_with_message<username_map> usernames_result{username_map{}};
+    error_with_message archive_err;
+    std::size_t next_archive_room = 0u;
+    std::size_t num_archive_tasks = (std::min)(archive_rooms.size(), max_concurrent_archive_reads);
+    run_parallel(
+        num_archive_tasks + 1u,
+        [&](std::size_t task_idx, boost::asio::yield_context task_yield) {
+            if (task_idx == 0u)
+            {
+                usernames_result = mysql_->get_usernames(user_ids, task_yield);
+                return;
+            }
+            while (next_archive_room < archive_rooms.size() && !archive_err.ec)
+            {
+                auto i = archive_rooms[next_archive_room++];
+                auto err = complete_from_archive(
+                    *mysql_,
+                    room_ids[i],
+                    first_message_id,
+                    allow_replica,
+                    (*batches_result)[i],
+                    task_yield
+                );
+                if (err.ec && !archive_err.ec)
+                    archive_err = std::move(err);
+            }
+        },
+        yield
+    );
+    if (archive_err.ec)
+        return archive_err;
     if (usernames_result.has_error())
         return std::move(usernames_result).error();
 
+    // Archived messages may have been sent by other users. This only requires another
+    // round trip if a room's recent history in Redis didn't include all its senders
+    std::unordered_set<std::int64_t> known_ids(user_ids.begin(), user_ids.end());
+    std::vector<std::int64_t> missing_ids;
+    for (auto i : archive_rooms)
+    {
+        for (const auto& msg : (*batches_result)[i].messages)
+        {
+            if (known_ids.insert(msg.user_id).second)
+                missing_ids.push_back(msg.user_id);
+        }
+    }
+    if (!missing_ids.empty())
+    {
+        auto missing_result = mysql_->get_usernames(missing_ids, yield);
+        if (missing_result.has_error())
+            return std::move(missing_result).error();
+        usernames_result->insert(missing_result->begin(), missing_result->end());
+    }
+
     return std::pair{std::move(*batches_result), std::move(*usernames_result)};
 }
 
+// Reduces a batch with the most recent messages of a room (newest first) to the messages
+// newer than since_id, if it contains all of them. Otherwise, the client missed
+// too many messages, and the batch is kept as is
+static void make_delta(message_batch& batch, std::string_view since_id)
+{
+    auto since = parse_message_id(since_id);
+    if (!since)
+        return;
+
+    // Find the first message the client already has
+    auto it = std::find_if(batch.messages.begin(), batch.messages.end(), [&since](const message& msg) {
+        auto id = parse_message_id(msg.id);
+        return id && !(*since < *id);
+    });
+
+    // If there is none, and there are older messages, some missed messages are not in the batch
+    if (it == batch.messages.end() && batch.has_more)
+        return;
+
+    batch.messages.erase(it, batch.messages.end());
+    batch.has_more = false;
+    batch.is_delta = true;
+}
+
+result_with_message<std::pair<std::vector<message_batch>, username_map>> room_history_service::
+    get_room_history_since(
+        boost::span<const std::string_view> room_ids,
+        boost::span<const std::string_view> since_ids,
+        boost::asio::yield_context yield
+    )
+{
+    assert(room_ids.size() == since_ids.size());
+
+    // With a cache, the most recent history is usually in memory, and computing deltas from it
+    // doesn't access the databases. Otherwise, only the missed messages are retrieved from Redis
+    auto res = cache_ ? get_room_history(room_ids, yield)
+                      : get_room_history_uncached(room_ids, std::nullopt, since_ids, true, yield);
+    if (res.has_error())
+        return res;
+
+    for (std::size_t i = 0; i < room_ids.size(); ++i)
+    {
+        if (since_ids[i].empty())
+            continue;
+        auto& batch = res->first[i];
+        if (!batch.is_delta)
+            make_delta(batch, since_ids[i]);
+        auto counter = batch.is_delta ? counter_id::hello_rooms_delta : counter_id::hello_rooms_full_resync;
+        increment_counter(counter);
+    }
+    return res;
+}
+
 result_with_message<std::pair<message_batch, username_map>> room_history_service::get_room_history(
     std::string_view room_id,
+    std::optional<std::string_view> first_message_id,
     boost::asio::yield_context yield
 )
 {
     // Compose an aray with a single request
     std::array<std::string_view, 1> room_ids{room_id};
 
-    // Call the batch function
-    auto res = get_room_history(room_ids, yield);
+    // Call the batch function. Paginated requests are never cached
+    auto res = first_message_id ? get_room_history_uncached(room_ids, first_message_id, {}, true, yield)
+                                : get_room_history(room_ids, yield);
     if (res.has_error())
         return std::move(res).error();
     assert(res->first.size() == 1u);
 
     // Result
     return std::pair{std::move(res->first.front()), std::move(res->second)};
-}
\ No newline at end of file
+}
+result_with_message<std::string> room_history_service::get_room_history_event(
+    std::string_view room_id,
+    std::optional<std::string_view> first_message_id,
+    boost::asio::yield_context yield
+)
+{
+    // Requests for the most recent history are served from the cache, when possible
+    if (cache_ && !first_message_id)
+    {
+        auto res = get_room_history(room_id, std::nullopt, yield);
+        if (res.has_error())
+            return std::move(res).error();
+        return room_history_event{room_id, res->first, res->second}.to_json();
+    }
+
+    // Lookup messages. The returned views point into nodes
+    auto nodes = redis_->get_room_history_nodes(
+        {room_id, first_message_id},
+        redis_client::read_preference::replica,
+        yield
+    );
+    if (nodes.has_error())
+        return std::move(nodes).error();
+    auto batch = parse_room_history_views(*nodes);
+    if (batch.has_error())
+        return error_with_message{batch.error()};
+    auto& views = batch->messages;
+    bool has_more = views.size() >= redis_client::message_batch_size;
+
+    // If Redis didn't have enough messages, complete the batch from the archive.
+    // This is uncommon, so we don't mind copying these
+    std::vector<message> archived;
+    if (views.size() < redis_client::message_batch_size)
+    {
+        std::optional<std::string_view> before_id = first_message_id;
+        if (!views.empty())
+            before_id = views.back().id;
+        std::size_t remaining = redis_client::message_batch_size - views.size();
+        auto archived_result = mysql_->get_archived_messages(room_id, before_id, remaining, true, yield);
+        if (archived_result.has_error())
+            return std::move(archived_result).error();
+        archived = std::move(*archived_result);
+        has_more = archived.size() == remaining;
+        for (const auto& msg : archived)
+            views.push_back(message_view{msg.id, msg.content, msg.timestamp, msg.user_id});
+    }
+
+    // Look up usernames
+    std::unordered_set<std::int64_t> user_id_set;
+    for (const auto& msg : views)
+        user_id_set.insert(msg.user_id);
+    std::vector<std::int64_t> user_ids(user_id_set.begin(), user_id_set.end());
+    auto usernames = mysql_->get_usernames(user_ids, yield);
+    if (usernames.has_error())
+        return std::move(usernames).error();
+
+    // Compose the event
+    return room_history_view_event{room_id, views, has_more, *usernames}.to_json();
+}
@@ -0,0 +1,377 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/search_index.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "business_types.hpp"
+#include "util/env.hpp"
+#include "util/run_on.hpp"
+
+using namespace chat;
+
+std::vector<std::string> chat::tokenize_search_terms(std::string_view text)
+{
+    std::vector<std::string> res;
+    std::string current;
+    auto finish_term = [&] {
+        if (!current.empty() && current.size() <= max_search_term_size)
+            res.push_back(current);
+        current.clear();
+    };
+
+    for (char c : text)
+    {
+        auto uc = static_cast<unsigned char>(c);
+        if (uc >= 0x80u || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+            current += c;
+        else if (c >= 'A' && c <= 'Z')
+            current += static_cast<char>(c - 'A' + 'a');
+        else
+            finish_term();
+    }
+    finish_term();
+
+    std::sort(res.begin(), res.end());
+    res.erase(std::unique(res.begin(), res.end()), res.end());
+    return res;
+}
+
+namespace {
+
+// Approximate memory used by each entry of the containers below, on top of their contents
+constexpr std::size_t message_overhead = sizeof(message);
+constexpr std::size_t term_overhead = 64u;
+
+// The messages containing a term, as increasing message numbers.
+// Each number is stored as the difference with the previous one, as a varint
+struct posting_list
+{
+    std::string data;
+    std::uint64_t last_number{0u};
+
+    void push_back(std::uint64_t number)
+    {
+        auto delta = number - last_number;
+        last_number = number;
+        while (delta >= 0x80u)
+        {
+            data.push_back(static_cast<char>((delta & 0x7fu) | 0x80u));
+            delta >>= 7;
+        }
+        data.push_back(static_cast<char>(delta));
+    }
+
+    // Decodes the numbers greater or equal than min_number
+    std::vector<std::uint64_t> decode(std::uint64_t min_number) const
+    {
+        std::vector<std::uint64_t> res;
+        std::uint64_t number = 0u;
+        unsigned shift = 0u;
+        std::uint64_t delta = 0u;
+        for (char c : data)
+        {
+            auto byte = static_cast<unsigned char>(c);
+            delta |= static_cast<std::uint64_t>(byte & 0x7fu) << shift;
+            if (byte & 0x80u)
+            {
+                shift += 7u;
+                continue;
+            }
+            number += delta;
+            if (number >= min_number)
+                res.push_back(number);
+            delta = 0u;
+            shift = 0u;
+        }
+        return res;
+    }
+};
+
+std::size_t message_bytes(const message& msg) noexcept
+{
+    return message_overhead + msg.id.size() + msg.content.size();
+}
+
+}  // namespace
+
+struct search_index::room_index
+{
+    const std::string id;
+    std::deque<message> messages;      // oldest first
+    std::uint64_t first_number{0u};    // The number of messages.front()
+    std::size_t evicted_messages{0u};  // Since posting lists were last rebuilt
+    std::unordered_map<std::string, posting_list> postings;
+    std::size_t bytes{0u};
+
+    explicit room_index(std::string id) : id(std::move(id)) {}
+
+    void index_message(const message& msg, std::uint64_t number)
+    {
+        for (auto& term : tokenize_search_terms(msg.content))
+        {
+            auto it = postings.find(term);
+            if (it == postings.end())
+            {
+                bytes += term_overhead + term.size();
+                it = postings.emplace(std::move(term), posting_list()).first;
+            }
+            auto prev_size = it->second.data.size();
+            it->second.push_back(number);
+            bytes += it->second.data.size() - prev_size;
+        }
+    }
+
+    // Posting lists keep the numbers of removed messages, which are skipped when searching.
+    // Rebuilding the lists once enough messages have been removed keeps memory bounded
+    void rebuild_postings()
+    {
+        postings.clear();
+        bytes = 0u;
+        for (std::size_t i = 0; i < messages.size(); ++i)
+        {
+            bytes += message_bytes(messages[i]);
+            index_message(messages[i], first_number + i);
+        }
+        evicted_messages = 0u;
+    }
+
+    void add(const message& msg, std::size_t max_messages)
+    {
+        messages.push_back(msg);
+        bytes += message_bytes(msg);
+        index_message(msg, first_number + messages.size() - 1u);
+
+        while (messages.size() > max_messages)
+        {
+            bytes -= message_bytes(messages.front());
+            messages.pop_front();
+            ++first_number;
+            ++evicted_messages;
+        }
+        if (evicted_messages >= (std::max)(max_messages / 2u, std::size_t(1)))
+            rebuild_postings();
+    }
+
+    std::vector<message> search(boost::span<const std::string> terms, std::size_t max_results) const
+    {
+        // Look up the posting lists. Start with the shortest one, to keep intermediate results small
+        std::vector<const posting_list*> lists;
+        for (const auto& term : terms)
+        {
+            auto it = postings.find(term);
+            if (it == postings.end())
+                return {};
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const posting_list* lhs, const posting_list* rhs) {
+            return lhs->data.size() < rhs->data.size();
+        });
+
+        // Intersect them
+        auto numbers = lists.front()->decode(first_number);
+        std::vector<std::uint64_t> other, intersection;
+        for (std::size_t i = 1; i < lists.size() && !numbers.empty(); ++i)
+        {
+            other = lists[i]->decode(first_number);
+            intersection.clear();
+            std::set_intersection(
+                numbers.begin(),
+                numbers.end(),
+                other.begin(),
+                other.end(),
+                std::back_inserter(intersection)
+            );
+            numbers.swap(intersection);
+        }
+
+        // Compose the results, most recent first
+        std::vector<message> res;
+        for (auto it = numbers.rbegin(); it != numbers.rend() && res.size() < max_results; ++it)
+            res.push_back(messages[*it - first_number]);
+        return res;
+    }
+};
+
+search_index::search_index(search_index_config cfg) : cfg_(cfg)
+{
+    if (cfg_.max_room_messages == 0u)
+        cfg_.max_room_messages = 1u;
+}
+
+search_index::~search_index() {}
+
+search_index::room_index* search_index::find_room(std::string_view room_id) const
+{
+    auto it = room_lookup_.find(std::string(room_id));
+    return it == room_lookup_.end() ? nullptr : it->second->get();
+}
+
+void search_index::add_messages(std::string_view room_id, boost::span<const message> messages)
+{
+    if (messages.empty())
+        return;
+
+    // Find the room, creating it if required, and mark it as the most recently updated one
+    auto it = room_lookup_.find(std::string(room_id));
+    if (it == room_lookup_.end())
+    {
+        rooms_.push_front(std::make_unique<room_index>(std::string(room_id)));
+        room_lookup_.emplace(std::string(room_id), rooms_.begin());
+    }
+    else
+    {
+        rooms_.splice(rooms_.begin(), rooms_, it->second);
+    }
+    auto& room = *rooms_.front();
+
+    // Index the messages, updating the memory accounting
+    total_bytes_ -= room.bytes;
+    for (const auto& msg : messages)
+        room.add(msg, cfg_.max_room_messages);
+    total_bytes_ += room.bytes;
+
+    // Remove rooms if we're over budget
+    while (total_bytes_ > cfg_.max_bytes && rooms_.size() > 1u)
+    {
+        auto& victim = *rooms_.back();
+        total_bytes_ -= victim.bytes;
+        room_lookup_.erase(victim.id);
+        rooms_.pop_back();
+    }
+}
+
+std::vector<message> search_index::search(
+    std::string_view room_id,
+    std::string_view query,
+    std::size_t max_results
+) const
+{
+    auto terms = tokenize_search_terms(query);
+    if (terms.empty() || max_results == 0u)
+        return {};
+    auto room = find_room(room_id);
+    if (!room)
+        return {};
+    return room->search(terms, max_results);
+}
+
+std::size_t search_index::num_rooms() const { return rooms_.size(); }
+
+std::size_t search_index::memory_usage() const { return total_bytes_; }
+
+struct sharded_search_index::shard
+{
+    boost::asio::any_io_executor ex;
+
+    // Only accessed from ex's thread
+    search_index index;
+
+    // Updated by ex's thread, so metrics can be read from any thread
+    std::atomic<std::size_t> num_rooms{0u};
+    std::atomic<std::size_t> memory_usage{0u};
+
+    shard(boost::asio::any_io_executor ex, search_index_config cfg) : ex(std::move(ex)), index(cfg) {}
+};
+
+sharded_search_index::sharded_search_index(
+    boost::span<const boost::asio::any_io_executor> executors,
+    search_index_config cfg
+)
+{
+    cfg.max_bytes = (std::max)(cfg.max_bytes / (std::max)(executors.size(), std::size_t(1)), std::size_t(1));
+    shards_.reserve(executors.size());
+    for (const auto& ex : executors)
+        shards_.push_back(std::make_unique<shard>(ex, cfg));
+}
+
+sharded_search_index::~sharded_search_index() {}
+
+sharded_search_index::shard& sharded_search_index::owner(std::string_view room_id) const
+{
+    return *shards_[std::hash<std::string_view>{}(room_id) % shards_.size()];
+}
+
+void sharded_search_index::add_messages(std::string_view room_id, boost::span<const message> messages)
+{
+    if (messages.empty())
+        return;
+
+    // The caller's data may not outlive this call, so we copy it
+    auto& s = owner(room_id);
+    boost::asio::post(
+        s.ex,
+        [&s, room = std::string(room_id), msgs = std::vector<message>(messages.begin(), messages.end())] {
+            s.index.add_messages(room, msgs);
+            s.num_rooms.store(s.index.num_rooms(), std::memory_order_relaxed);
+            s.memory_usage.store(s.index.memory_usage(), std::memory_order_relaxed);
+        }
+    );
+}
+
+std::vector<message> sharded_search_index::search(
+    std::string_view room_id,
+    std::string_view query,
+    std::size_t max_results,
+    boost::asio::yield_context yield
+) const
+{
+    // Don't bother the owner with queries that can't match anything
+    if (tokenize_search_terms(query).empty() || max_results == 0u)
+        return {};
+    const auto& s = owner(room_id);
+    return run_on(s.ex, [&] { return s.index.search(room_id, query, max_results); }, yield);
+}
+
+std::size_t sharded_search_index::num_rooms() const noexcept
+{
+    std::size_t res = 0u;
+    for (const auto& s : shards_)
+        res += s->num_rooms.load(std::memory_order_relaxed);
+    return res;
+}
+
+std::size_t sharded_search_index::memory_usage() const noexcept
+{
+    std::size_t res = 0u;
+    for (const auto& s : shards_)
+        res += s->memory_usage.load(std::memory_order_relaxed);
+    return res;
+}
+
+std::unique_ptr<sharded_search_index> chat::create_sharded_search_index(
+    boost::span<const boost::asio::any_io_executor> executors
+)
+{
+    if (!get_env_bool("SEARCH_INDEX_ENABLED", true))
+        return nullptr;
+    return std::make_unique<sharded_search_index>(
+        executors,
+        search_index_config{
+            get_env_size("SEARCH_INDEX_ROOM_MESSAGES", 10000u),
+            get_env_size("SEARCH_INDEX_MAX_MB", 64u) * 1024u * 1024u,
+        }
+    );
+}
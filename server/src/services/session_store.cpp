@@ -82,4 +82,12 @@ result_with_message<std::int64_t> session_store::get_user_by_session(
 {
     auto redis_key = get_redis_key(session_id);
     return redis_->get_int_key(redis_key, yield);
-}
\ No newline at end of file
+}
+error_with_message session_store::invalidate_session(
+    std::string_view session_id,
+    boost::asio::yield_context yield
+)
+{
+    auto redis_key = get_redis_key(session_id);
+    return redis_->delete_key(redis_key, yield);
+}
@@ -0,0 +1,215 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/session_token.hpp"
+
+#include <boost/core/span.hpp>
+
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+#include "util/base64.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+namespace {
+
+constexpr unsigned char token_version = 1u;
+constexpr std::size_t token_id_size = 12u;  // bytes
+constexpr std::size_t signature_size = 32u;
+
+// version (1), key ID (4), expiry (8), user ID (8) and token ID, followed by the username
+constexpr std::size_t header_size = 1u + 4u + 8u + 8u + token_id_size;
+
+using signature_type = std::array<unsigned char, signature_size>;
+
+void append_uint(std::vector<unsigned char>& to, std::uint64_t value, std::size_t size)
+{
+    for (std::size_t i = 0; i < size; ++i)
+        to.push_back(static_cast<unsigned char>(value >> (8u * i)));
+}
+
+std::uint64_t read_uint(const unsigned char* from, std::size_t size)
+{
+    std::uint64_t res = 0u;
+    for (std::size_t i = 0; i < size; ++i)
+        res |= static_cast<std::uint64_t>(from[i]) << (8u * i);
+    return res;
+}
+
+signature_type compute_signature(std::string_view secret, boost::span<const unsigned char> payload)
+{
+    signature_type res{};
+    unsigned int size = 0u;
+    auto* ok = HMAC(
+        EVP_sha256(),
+        secret.data(),
+        static_cast<int>(secret.size()),
+        payload.data(),
+        payload.size(),
+        res.data(),
+        &size
+    );
+    if (!ok || size != signature_size)
+        throw std::runtime_error("Signing session token: HMAC");
+    return res;
+}
+
+}  // namespace
+
+result<std::vector<session_token_key>> chat::parse_session_token_keys(std::string_view input)
+{
+    std::vector<session_token_key> res;
+    for (std::size_t pos = 0u; pos != std::string_view::npos;)
+    {
+        // Split the next key
+        auto comma = input.find(',', pos);
+        auto entry = input.substr(pos, comma == std::string_view::npos ? comma : comma - pos);
+        pos = comma == std::string_view::npos ? comma : comma + 1u;
+
+        // Parse it
+        auto colon = entry.find(':');
+        if (colon == std::string_view::npos)
+            CHAT_RETURN_ERROR(errc::invalid_config)
+        std::uint32_t id = 0u;
+        auto id_str = entry.substr(0, colon);
+        auto parse_res = std::from_chars(id_str.data(), id_str.data() + id_str.size(), id);
+        if (id_str.empty() || parse_res.ec != std::errc{} || parse_res.ptr != id_str.data() + id_str.size())
+            CHAT_RETURN_ERROR(errc::invalid_config)
+        auto secret = entry.substr(colon + 1u);
+        if (secret.size() < min_session_token_secret_size)
+            CHAT_RETURN_ERROR(errc::invalid_config)
+
+        // IDs must be unique, or we wouldn't know which key to verify with
+        for (const auto& key : res)
+        {
+            if (key.id == id)
+                CHAT_RETURN_ERROR(errc::invalid_config)
+        }
+        res.push_back({id, std::string(secret)});
+    }
+    return res;
+}
+
+session_token_signer::session_token_signer(std::vector<session_token_key> keys) : keys_(std::move(keys))
+{
+    assert(!keys_.empty());
+}
+
+std::string session_token_signer::sign(
+    std::int64_t user_id,
+    std::string_view username,
+    std::chrono::system_clock::time_point expiry
+) const
+{
+    const auto& key = keys_.front();
+
+    // Generate a token ID. This uses the public random generator because it's exposed to the user
+    std::array<unsigned char, token_id_size> token_id{};
+    if (RAND_bytes(token_id.data(), token_id.size()) <= 0)
+        throw std::runtime_error("Generating session token ID: RAND_bytes");
+
+    // Compose the payload
+    auto expiry_s = std::chrono::duration_cast<std::chrono::seconds>(expiry.time_since_epoch()).count();
+    std::vector<unsigned char> payload;
+    payload.reserve(header_size + username.size());
+    payload.push_back(token_version);
+    append_uint(payload, key.id, 4u);
+    append_uint(payload, static_cast<std::uint64_t>(expiry_s), 8u);
+    append_uint(payload, static_cast<std::uint64_t>(user_id), 8u);
+    payload.insert(payload.end(), token_id.begin(), token_id.end());
+    payload.insert(payload.end(), username.begin(), username.end());
+
+    // Sign it
+    auto signature = compute_signature(key.secret, payload);
+    auto res = base64_encode(payload, false);
+    res += '.';
+    res += base64_encode(signature, false);
+    return res;
+}
+
+result<session_token_claims> session_token_signer::verify(
+    std::string_view token,
+    std::chrono::system_clock::time_point now
+) const
+{
+    // Split and decode the token
+    auto dot = token.find('.');
+    if (dot == std::string_view::npos)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+    auto payload = base64_decode(token.substr(0, dot), false);
+    auto signature = base64_decode(token.substr(dot + 1u), false);
+    if (payload.has_error() || signature.has_error())
+        CHAT_RETURN_ERROR(errc::requires_auth)
+    if (payload->size() < header_size || (*payload)[0] != token_version)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+    if (signature->size() != signature_size)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+
+    // Find the key that signed it
+    const unsigned char* p = payload->data();
+    auto key_id = static_cast<std::uint32_t>(read_uint(p + 1u, 4u));
+    const session_token_key* key = nullptr;
+    for (const auto& k : keys_)
+    {
+        if (k.id == key_id)
+            key = &k;
+    }
+    if (!key)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+
+    // Check the signature, in constant time
+    auto expected = compute_signature(key->secret, *payload);
+    if (CRYPTO_memcmp(expected.data(), signature->data(), signature_size) != 0)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+
+    // Check expiry
+    auto expiry_s = static_cast<std::int64_t>(read_uint(p + 5u, 8u));
+    std::chrono::system_clock::time_point expiry{std::chrono::seconds(expiry_s)};
+    if (expiry <= now)
+        CHAT_RETURN_ERROR(errc::requires_auth)
+
+    return session_token_claims{
+        static_cast<std::int64_t>(read_uint(p + 13u, 8u)),
+        std::string(reinterpret_cast<const char*>(p + header_size), payload->size() - header_size),
+        expiry,
+        base64_encode({p + 21u, token_id_size}, false),
+    };
+}
+
+const session_token_signer* chat::global_session_token_signer()
+{
+    static const std::unique_ptr<session_token_signer> res = []() -> std::unique_ptr<session_token_signer> {
+        auto keys_str = get_env_string("SESSION_TOKEN_KEYS", "");
+        if (keys_str.empty())
+            return nullptr;
+        auto keys = parse_session_token_keys(keys_str);
+        if (keys.has_error())
+        {
+            log_error(keys.error(), "Invalid SESSION_TOKEN_KEYS, session tokens are disabled");
+            return nullptr;
+        }
+        return std::make_unique<session_token_signer>(std::move(*keys));
+    }();
+    return res.get();
+}
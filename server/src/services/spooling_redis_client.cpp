@@ -0,0 +1,370 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/core/span.hpp>
+#include <boost/redis/error.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "error.hpp"
+#include "message_id.hpp"
+#include "services/message_sequencer.hpp"
+#include "services/message_spool.hpp"
+#include "services/pubsub_service.hpp"
+#include "services/redis_client.hpp"
+#include "util/circuit_breaker.hpp"
+#include "util/metrics.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Decorates a redis_client, storing messages in a local spool while Redis is unavailable.
+// Stores that fail open a circuit breaker, so we don't wait for Redis on every message while
+// it's down. Messages stored while the spool is not empty are spooled too, so they're stored
+// in the order they were sent. If this client runs in the shard owning the spool,
+// a background task replays the spool once Redis is back.
+class spooling_redis_client final : public redis_client
+{
+    std::unique_ptr<redis_client> inner_;
+    shared_message_spool& spool_;
+    pubsub_service& pubsub_;
+    circuit_breaker_params params_;
+    circuit_breaker breaker_;
+    boost::asio::steady_timer replay_timer_;
+    bool running_{false};
+
+    // Stores messages in the spool, assigning them IDs. Returns the IDs
+    result_with_message<std::vector<std::string>> spool_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    )
+    {
+        std::vector<message> msgs(messages.begin(), messages.end());
+        std::vector<std::string> ids;
+        ids.reserve(msgs.size());
+        for (auto& msg : msgs)
+        {
+            msg.id = format_message_id(global_message_sequencer().next());
+            ids.push_back(msg.id);
+        }
+
+        auto ec = spool_.append(room_id, msgs, yield);
+        if (ec)
+        {
+            increment_counter(counter_id::redis_spool_rejected, msgs.size());
+            CHAT_RETURN_ERROR_WITH_MESSAGE(ec, "Redis is unavailable and the message spool is full")
+        }
+        increment_counter(counter_id::redis_spooled_messages, msgs.size());
+        return ids;
+    }
+
+    void on_failure(const error_with_message& err, std::string_view what)
+    {
+        log_error(err, what);
+        if (breaker_.on_failure(circuit_breaker::clock_type::now()))
+            increment_counter(counter_id::redis_breaker_opened);
+    }
+
+    // Lets clients know about messages that were stored with a different ID, or not stored at all
+    void publish_corrections(std::string_view room_id, boost::span<const message_id_correction> corrections)
+    {
+        if (!corrections.empty())
+            pubsub_.publish(room_id, server_messages_corrected_event{room_id, corrections}.to_json());
+    }
+
+    // Stores a run of spooled messages for the same room. Returns false if Redis is unavailable
+    bool replay_run(boost::span<const spooled_message> run, boost::asio::yield_context yield)
+    {
+        const auto& room_id = run.front().room_id;
+        std::vector<message> msgs;
+        msgs.reserve(run.size());
+        for (const auto& spooled : run)
+            msgs.push_back(spooled.msg);
+
+        std::vector<message_id_correction> corrections;
+        auto ids = inner_->store_messages_with_ids(room_id, msgs, yield);
+        if (ids.has_error())
+        {
+            // If Redis rejected the command, retrying won't help. Drop the messages,
+            // so they don't block the ones after them
+            if (ids.error().ec != errc::redis_command_failed)
+            {
+                on_failure(ids.error(), "Replaying the message spool");
+                return false;
+            }
+            log_error(ids.error(), "Replaying the message spool. Messages have been dropped");
+            increment_counter(counter_id::redis_spool_dropped, msgs.size());
+            for (const auto& msg : msgs)
+                corrections.push_back(message_id_correction{msg.id, ""});
+        }
+        else
+        {
+            // IDs only change if a message with a greater ID was stored while we were replaying.
+            // Messages that Redis failed to store have an empty ID. They're dropped, like above
+            breaker_.on_success();
+            std::size_t num_dropped = 0u;
+            for (std::size_t i = 0; i < msgs.size() && i < ids->size(); ++i)
+            {
+                auto& new_id = ids.value()[i];
+                if (new_id == msgs[i].id)
+                    continue;
+                if (new_id.empty())
+                    ++num_dropped;
+                else if (auto parsed = parse_message_id(new_id))
+                    global_message_sequencer().observe(*parsed);
+                corrections.push_back(message_id_correction{msgs[i].id, std::move(new_id)});
+            }
+            if (num_dropped)
+            {
+                log_error(
+                    errc::redis_command_failed,
+                    "Replaying the message spool. Messages have been dropped"
+                );
+            }
+            increment_counter(counter_id::redis_spool_replayed, msgs.size() - num_dropped);
+            increment_counter(counter_id::redis_spool_dropped, num_dropped);
+        }
+
+        spool_.pop(run.size());
+        publish_corrections(room_id, corrections);
+        return true;
+    }
+
+    // Stores the spooled messages in Redis, oldest first, until the spool is empty
+    // or Redis fails. The spool is shared by all shards, but only its owner replays it
+    void replay(boost::asio::yield_context yield)
+    {
+        while (running_ && !spool_.empty() && breaker_.allow(circuit_breaker::clock_type::now()))
+        {
+            auto msgs = spool_.peek(message_batch_size);
+            for (std::size_t first = 0; first < msgs.size();)
+            {
+                auto last = first + 1u;
+                while (last < msgs.size() && msgs[last].room_id == msgs[first].room_id)
+                    ++last;
+                if (!replay_run({msgs.data() + first, last - first}, yield))
+                    return;
+                first = last;
+            }
+        }
+    }
+
+    void run_replay_loop(boost::asio::yield_context yield)
+    {
+        while (running_)
+        {
+            error_code ec;
+            replay_timer_.expires_after(params_.open_duration);
+            replay_timer_.async_wait(yield[ec]);
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+
+            if (!spool_.empty())
+                replay(yield);
+        }
+    }
+
+public:
+    spooling_redis_client(
+        boost::asio::any_io_executor ex,
+        std::unique_ptr<redis_client> inner,
+        shared_message_spool& spool,
+        pubsub_service& pubsub,
+        circuit_breaker_params params
+    )
+        : inner_(std::move(inner)),
+          spool_(spool),
+          pubsub_(pubsub),
+          params_(params),
+          breaker_(params),
+          replay_timer_(std::move(ex))
+    {
+    }
+
+    void start_run() final override
+    {
+        inner_->start_run();
+        running_ = true;
+        if (spool_.owner() != replay_timer_.get_executor())
+            return;
+        boost::asio::spawn(
+            replay_timer_.get_executor(),
+            [this](boost::asio::yield_context yield) { run_replay_loop(yield); },
+            boost::asio::detached
+        );
+    }
+
+    void cancel() final override
+    {
+        running_ = false;
+        replay_timer_.cancel();
+        inner_->cancel();
+    }
+
+    result_with_message<std::vector<message_batch>> get_room_history(
+        boost::span<const room_histoy_request> reqs,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_room_history(reqs, pref, yield);
+    }
+
+    result_with_message<std::vector<boost::redis::resp3::node>> get_room_history_nodes(
+        const room_histoy_request& req,
+        read_preference pref,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_room_history_nodes(req, pref, yield);
+    }
+
+    result_with_message<std::vector<std::string>> store_messages(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        // Keep messages in order while there are spooled messages, and don't wait for Redis while it's down
+        if (!spool_.empty() || !breaker_.allow(circuit_breaker::clock_type::now()))
+            return spool_messages(room_id, messages, yield);
+
+        auto res = inner_->store_messages(room_id, messages, yield);
+        if (res.has_value())
+        {
+            breaker_.on_success();
+            return res;
+        }
+
+        // Only spool messages that never reached Redis. If the connection was lost after
+        // sending them, they may have been stored, and spooling them would store them twice
+        if (res.error().ec != boost::redis::error::not_connected)
+        {
+            on_failure(res.error(), "Storing messages");
+            return res;
+        }
+        on_failure(res.error(), "Storing messages. Spooling them");
+        return spool_messages(room_id, messages, yield);
+    }
+
+    result_with_message<std::vector<std::string>> store_messages_with_ids(
+        std::string_view room_id,
+        boost::span<const message> messages,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->store_messages_with_ids(room_id, messages, yield);
+    }
+
+    result_with_message<std::vector<message>> get_oldest_messages(
+        std::string_view room_id,
+        std::size_t keep_count,
+        std::size_t max_count,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_oldest_messages(room_id, keep_count, max_count, yield);
+    }
+
+    error_with_message trim_messages(
+        std::string_view room_id,
+        std::string_view min_id,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->trim_messages(room_id, min_id, yield);
+    }
+
+    error_with_message set_nonexisting_key(
+        std::string_view key,
+        std::string_view value,
+        std::chrono::seconds ttl,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->set_nonexisting_key(key, value, ttl, yield);
+    }
+
+    result_with_message<std::int64_t> get_int_key(std::string_view key, boost::asio::yield_context yield)
+        final override
+    {
+        return inner_->get_int_key(key, yield);
+    }
+
+    error_with_message delete_key(std::string_view key, boost::asio::yield_context yield) final override
+    {
+        return inner_->delete_key(key, yield);
+    }
+
+    result_with_message<bool> take_tokens(
+        std::string_view key,
+        token_bucket_params params,
+        double cost,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->take_tokens(key, params, cost, yield);
+    }
+
+    error_with_message add_to_expiring_set(
+        std::string_view key,
+        std::string_view member,
+        std::chrono::system_clock::time_point expiry,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->add_to_expiring_set(key, member, expiry, yield);
+    }
+
+    result_with_message<std::vector<std::string>> get_expiring_set(
+        std::string_view key,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->get_expiring_set(key, yield);
+    }
+
+    result_with_message<bool> expiring_set_contains(
+        std::string_view key,
+        std::string_view member,
+        boost::asio::yield_context yield
+    ) final override
+    {
+        return inner_->expiring_set_contains(key, member, yield);
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<redis_client> chat::create_spooling_redis_client(
+    boost::asio::any_io_executor ex,
+    std::unique_ptr<redis_client> inner,
+    shared_message_spool& spool,
+    pubsub_service& pubsub,
+    circuit_breaker_params params
+)
+{
+    return std::unique_ptr<redis_client>{
+        new spooling_redis_client(std::move(ex), std::move(inner), spool, pubsub, params)
+    };
+}
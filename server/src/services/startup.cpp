@@ -0,0 +1,179 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/startup.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/assert/source_location.hpp>
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+#include "services/history_snapshot.hpp"
+#include "services/mysql_client.hpp"
+#include "services/room_history_cache.hpp"
+#include "services/room_history_service.hpp"
+#include "shared_state.hpp"
+#include "util/log.hpp"
+
+using namespace chat;
+
+startup_tracker::startup_tracker(std::size_t num_shards) noexcept
+    : start_(std::chrono::steady_clock::now()), pending_steps_(num_shards + 1u), pending_reloads_(num_shards)
+{
+}
+
+std::chrono::milliseconds startup_tracker::startup_time() const noexcept
+{
+    auto ms = startup_ms_.load(std::memory_order_acquire);
+    return std::chrono::milliseconds(ms < 0 ? 0 : ms);
+}
+
+void startup_tracker::on_step_done() noexcept
+{
+    // The last step to finish records the startup time
+    if (pending_steps_.fetch_sub(1u, std::memory_order_acq_rel) != 1u)
+        return;
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+    startup_ms_.store(ms, std::memory_order_release);
+    if (should_log(log_level::info))
+        log_message(log_level::info, "Server ready after " + std::to_string(ms) + "ms");
+}
+
+void startup_tracker::on_db_ready() noexcept
+{
+    if (!db_ready_.exchange(true, std::memory_order_acq_rel))
+        on_step_done();
+}
+
+void startup_tracker::on_shard_warm() noexcept { on_step_done(); }
+
+void startup_tracker::on_shard_reloaded() noexcept
+{
+    pending_reloads_.fetch_sub(1u, std::memory_order_acq_rel);
+}
+
+// Unknown exceptions are propagated to the io_context, terminating the program
+static constexpr auto rethrow_handler = [](std::exception_ptr ex) {
+    if (ex)
+        std::rethrow_exception(ex);
+};
+
+// Loads the data served in hello events into the shard's caches. The history
+// of all rooms is requested at once, so it's retrieved in a single Redis round trip.
+// History is loaded even if it's cached, in case it was populated from a snapshot
+static error_with_message warm_caches(shared_state& st, boost::asio::yield_context yield)
+{
+    auto rooms = st.mysql().get_rooms(yield);
+    if (rooms.has_error())
+        return std::move(rooms).error();
+
+    std::vector<std::string_view> room_ids;
+    room_ids.reserve(rooms->size());
+    for (const auto& r : *rooms)
+        room_ids.push_back(r.id);
+    room_history_service svc(st.redis(), st.mysql(), &st.history_cache());
+    return svc.reload_cached_history(room_ids, yield);
+}
+
+// If is_warm, the shard's caches were populated from a snapshot, and on_shard_warm was already called
+static void launch_warmup(
+    boost::asio::any_io_executor ex,
+    std::shared_ptr<shared_state> st,
+    startup_tracker& tracker,
+    bool is_warm
+)
+{
+    boost::asio::spawn(
+        std::move(ex),
+        [st = std::move(st), &tracker, is_warm](boost::asio::yield_context yield) {
+            // Redis or MySQL may not be available yet, so retry with backoff
+            constexpr std::chrono::milliseconds max_delay(2000);
+            std::chrono::milliseconds delay(100);
+            boost::asio::steady_timer timer(yield.get_executor());
+            while (true)
+            {
+                auto err = warm_caches(*st, yield);
+                if (!err.ec)
+                    break;
+                log_error(err, "Warming up caches");
+
+                error_code ec;
+                timer.expires_after(delay);
+                timer.async_wait(yield[ec]);
+                if (ec)
+                    return;
+                delay = (std::min)(delay * 2, max_delay);
+            }
+            tracker.on_shard_reloaded();
+            if (!is_warm)
+                tracker.on_shard_warm();
+        },
+        boost::asio::detached
+    );
+}
+
+void chat::launch_startup(
+    boost::span<const boost::asio::any_io_executor> executors,
+    boost::span<const std::shared_ptr<shared_state>> shards,
+    startup_tracker& tracker,
+    std::shared_ptr<const history_snapshot> snapshot
+)
+{
+    assert(!shards.empty() && executors.size() == shards.size());
+
+    // Populate the caches from the snapshot, if any. This doesn't need the databases.
+    // Each shard copies what it needs, and the snapshot is unmapped once all of them are done
+    bool is_warm = snapshot != nullptr;
+    if (snapshot)
+    {
+        for (std::size_t i = 0; i < shards.size(); ++i)
+        {
+            boost::asio::post(executors[i], [st = shards[i], snapshot, &tracker] {
+                st->history_cache().load_snapshot(*snapshot);
+                tracker.on_shard_warm();
+            });
+        }
+    }
+
+    boost::asio::spawn(
+        executors.front(),
+        [executors = std::vector<boost::asio::any_io_executor>(executors.begin(), executors.end()),
+         shards = std::vector<std::shared_ptr<shared_state>>(shards.begin(), shards.end()),
+         &tracker,
+         is_warm](boost::asio::yield_context yield) {
+            // Set up the schema, once. This retries until MySQL accepts connections.
+            // If this fails is because something really bad happened (e.g. the SQL execution failed),
+            // so we throw an exception. If the wait was cancelled, we're shutting down
+            auto err = shards.front()->mysql().setup_db(yield);
+            if (err.ec == boost::asio::error::operation_aborted)
+                return;
+            if (err.ec)
+                throw_exception_from_error(err, BOOST_CURRENT_LOCATION);
+            tracker.on_db_ready();
+
+            // Warm up all shards at once
+            for (std::size_t i = 0; i < shards.size(); ++i)
+                launch_warmup(executors[i], shards[i], tracker, is_warm);
+        },
+        rethrow_handler
+    );
+}
@@ -0,0 +1,109 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/topic_registry.hpp"
+
+#include <boost/core/span.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "services/pubsub_service.hpp"
+
+using namespace chat;
+
+topic_registry::topic_handle topic_registry::intern(std::string_view topic_id)
+{
+    auto it = handles_.find(topic_id);
+    if (it != handles_.end())
+        return it->second;
+    auto handle = static_cast<topic_handle>(topics_.size());
+    topics_.emplace_back();
+    handles_.emplace(topic_id, handle);
+    return handle;
+}
+
+std::optional<topic_registry::topic_handle> topic_registry::find(std::string_view topic_id) const noexcept
+{
+    auto it = handles_.find(topic_id);
+    if (it == handles_.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void topic_registry::subscribe(
+    std::shared_ptr<message_subscriber> subscriber,
+    boost::span<const std::string_view> topic_ids
+)
+{
+    auto& positions = positions_[subscriber.get()];
+    positions.reserve(positions.size() + topic_ids.size());
+    for (auto topic_id : topic_ids)
+    {
+        auto handle = intern(topic_id);
+        auto& topic_subscribers = topics_[handle];
+        positions.push_back({handle, static_cast<std::uint32_t>(topic_subscribers.size())});
+        topic_subscribers.push_back(subscriber);
+    }
+}
+
+void topic_registry::unsubscribe(const message_subscriber& subscriber)
+{
+    auto it = positions_.find(&subscriber);
+    if (it == positions_.end())
+        return;
+
+    // Take the subscriber's positions, since we may need to update them while iterating
+    auto removed = std::move(it->second);
+    positions_.erase(it);
+
+    for (std::size_t i = 0; i < removed.size(); ++i)
+    {
+        // Move the last subscriber into the removed slot
+        auto pos = removed[i];
+        auto& topic_subscribers = topics_[pos.handle];
+        assert(topic_subscribers[pos.index].get() == &subscriber);
+        auto last_index = static_cast<std::uint32_t>(topic_subscribers.size() - 1u);
+        if (pos.index != last_index)
+        {
+            topic_subscribers[pos.index] = std::move(topic_subscribers.back());
+
+            // Update the moved subscriber's position. If it's the subscriber being removed
+            // (subscribed twice to the same topic), it's one of the positions we haven't processed yet
+            auto* moved = topic_subscribers[pos.index].get();
+            boost::span<position> moved_positions = removed;
+            if (moved == &subscriber)
+                moved_positions = moved_positions.subspan(i + 1u);
+            else
+                moved_positions = positions_.find(moved)->second;
+            for (auto& moved_pos : moved_positions)
+            {
+                if (moved_pos.handle == pos.handle && moved_pos.index == last_index)
+                {
+                    moved_pos.index = pos.index;
+                    break;
+                }
+            }
+        }
+        topic_subscribers.pop_back();
+    }
+}
+
+boost::span<const std::shared_ptr<message_subscriber>> topic_registry::subscribers(std::string_view topic_id
+) const noexcept
+{
+    auto handle = find(topic_id);
+    if (!handle)
+        return {};
+    return subscribers(*handle);
+}
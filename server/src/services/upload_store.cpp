@@ -0,0 +1,486 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/upload_store.hpp"
+
+#include <boost/core/span.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+namespace {
+
+constexpr std::size_t max_content_type_size = 100u;
+
+error_code errno_code() { return error_code(errno, boost::system::system_category()); }
+
+// Closes a file descriptor on scope exit
+struct fd_guard
+{
+    int fd;
+    ~fd_guard()
+    {
+        if (fd != -1)
+            ::close(fd);
+    }
+    int release() noexcept { return std::exchange(fd, -1); }
+};
+
+std::string upload_path(std::string_view dir, std::string_view id, std::string_view extension)
+{
+    std::string res;
+    res.reserve(dir.size() + id.size() + extension.size() + 1u);
+    res += dir;
+    res += '/';
+    res += id;
+    res += extension;
+    return res;
+}
+
+// Lists the names of the entries in a directory, other than . and ..
+result<std::vector<std::string>> list_directory(const std::string& path)
+{
+    std::unique_ptr<DIR, decltype(&::closedir)> dir(::opendir(path.c_str()), &::closedir);
+    if (!dir)
+        return errno_code();
+    std::vector<std::string> res;
+    while (true)
+    {
+        errno = 0;
+        const auto* entry = ::readdir(dir.get());
+        if (!entry)
+            break;
+        std::string_view name(entry->d_name);
+        if (name != "." && name != "..")
+            res.emplace_back(name);
+    }
+    if (errno != 0)
+        return errno_code();
+    return res;
+}
+
+// Whether a file modified at mtime hasn't been written for ttl
+bool is_stale(std::time_t mtime, std::chrono::seconds ttl)
+{
+    return std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(mtime) >= ttl;
+}
+
+// The state of an upload, as seen by check_pending
+enum class pending_state
+{
+    pending,  // incomplete, and written recently or open by a writer
+    gone,     // complete, or doesn't exist
+    removed,  // it was abandoned, and its files have been removed
+};
+
+// Checks whether upload id (stored in dir) is incomplete, removing its files
+// if it was abandoned: nothing was written to it for ttl, and no writer has it open
+pending_state check_pending(std::string_view dir, std::string_view id, std::chrono::seconds ttl)
+{
+    auto part_path = upload_path(dir, id, ".part");
+    fd_guard fd{::open(part_path.c_str(), O_WRONLY | O_CLOEXEC)};
+    if (fd.fd == -1)
+        return errno == ENOENT ? pending_state::gone : pending_state::pending;
+    struct stat file_stat;
+    if (::fstat(fd.fd, &file_stat) != 0)
+        return pending_state::pending;
+    if (file_stat.st_nlink == 0u)
+        return pending_state::gone;
+    if (!is_stale(file_stat.st_mtime, ttl))
+        return pending_state::pending;
+
+    // Writers hold the lock while waiting for data from the client. Once we hold it, a previous
+    // writer may have written more data, or completed the upload (renaming the file we opened)
+    if (::flock(fd.fd, LOCK_EX | LOCK_NB) != 0)
+        return pending_state::pending;
+    struct stat path_stat;
+    if (::fstat(fd.fd, &file_stat) != 0)
+        return pending_state::pending;
+    if (::stat(part_path.c_str(), &path_stat) != 0 || path_stat.st_ino != file_stat.st_ino ||
+        path_stat.st_dev != file_stat.st_dev)
+        return pending_state::gone;
+    if (!is_stale(file_stat.st_mtime, ttl))
+        return pending_state::pending;
+
+    // The contents go first, so the upload is never visible without them
+    ::unlink(part_path.c_str());
+    ::unlink(upload_path(dir, id, ".meta").c_str());
+    return pending_state::removed;
+}
+
+// Writes all of data at offset
+error_code write_all(int fd, boost::span<const char> data, std::uint64_t offset)
+{
+    while (!data.empty())
+    {
+        auto res = ::pwrite(fd, data.data(), data.size(), static_cast<off_t>(offset));
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return errno_code();
+        data = data.subspan(static_cast<std::size_t>(res));
+        offset += static_cast<std::uint64_t>(res);
+    }
+    return {};
+}
+
+// The metadata file contains the user ID, the size and the content type, one per line
+std::string serialize_metadata(std::int64_t user_id, std::uint64_t size, std::string_view content_type)
+{
+    std::string res = std::to_string(user_id);
+    res += '\n';
+    res += std::to_string(size);
+    res += '\n';
+    res += content_type;
+    res += '\n';
+    return res;
+}
+
+template <class T>
+bool parse_line(std::string_view& from, T& to)
+{
+    auto pos = from.find('\n');
+    if (pos == std::string_view::npos)
+        return false;
+    auto line = from.substr(0, pos);
+    from = from.substr(pos + 1u);
+    auto res = std::from_chars(line.data(), line.data() + line.size(), to);
+    return res.ec == std::errc{} && res.ptr == line.data() + line.size();
+}
+
+result<upload_info> parse_metadata(std::string_view from)
+{
+    upload_info res{};
+    if (!parse_line(from, res.user_id) || !parse_line(from, res.size))
+        CHAT_RETURN_ERROR(errc::upload_corrupted)
+    if (from.empty() || from.back() != '\n')
+        CHAT_RETURN_ERROR(errc::upload_corrupted)
+    res.content_type = from.substr(0, from.size() - 1u);
+    if (!is_valid_upload_content_type(res.content_type))
+        CHAT_RETURN_ERROR(errc::upload_corrupted)
+    return res;
+}
+
+}  // namespace
+
+bool chat::is_upload_id(std::string_view value) noexcept
+{
+    if (value.size() != upload_id_size)
+        return false;
+    for (char c : value)
+    {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+            return false;
+    }
+    return true;
+}
+
+bool chat::is_valid_upload_content_type(std::string_view value) noexcept
+{
+    // We only check that it's a type/subtype pair without control characters,
+    // since it's stored in a line and echoed in a header
+    if (value.empty() || value.size() > max_content_type_size)
+        return false;
+    auto slash = value.find('/');
+    if (slash == 0u || slash == std::string_view::npos || slash == value.size() - 1u)
+        return false;
+    for (char c : value)
+    {
+        if (c < 0x20 || c > 0x7e)
+            return false;
+    }
+    return true;
+}
+
+upload_writer::~upload_writer()
+{
+    // This releases the lock
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+error_code upload_writer::write(boost::span<const char> data)
+{
+    assert(data.size() <= size_ - offset_);
+    auto ec = write_all(fd_, data, offset_);
+    if (ec)
+        return ec;
+    offset_ += data.size();
+
+    // The upload is complete. Renaming makes it visible atomically
+    if (offset_ == size_)
+    {
+        auto part_path = upload_path(dir_, id_, ".part");
+        auto data_path = upload_path(dir_, id_, ".data");
+        if (::rename(part_path.c_str(), data_path.c_str()) != 0)
+            return errno_code();
+    }
+    return {};
+}
+
+upload_store::upload_store(
+    std::string dir,
+    std::uint64_t max_size,
+    std::size_t max_pending,
+    std::chrono::seconds pending_ttl
+)
+    : dir_(std::move(dir)), max_size_(max_size), max_pending_(max_pending), pending_ttl_(pending_ttl)
+{
+    if (::mkdir(dir_.c_str(), 0700) != 0 && errno != EEXIST)
+        throw std::system_error(errno, std::generic_category(), "Creating upload directory " + dir_);
+    auto pending_path = dir_ + "/pending";
+    if (::mkdir(pending_path.c_str(), 0700) != 0 && errno != EEXIST)
+        throw std::system_error(errno, std::generic_category(), "Creating upload directory " + pending_path);
+}
+
+std::string upload_store::pending_dir(std::int64_t user_id) const
+{
+    return dir_ + "/pending/" + std::to_string(user_id);
+}
+
+result<std::string> upload_store::create(
+    std::int64_t user_id,
+    std::uint64_t size,
+    std::string_view content_type
+)
+{
+    // Count the user's incomplete uploads, forgetting the ones that completed or were abandoned
+    auto user_dir = pending_dir(user_id);
+    if (::mkdir(user_dir.c_str(), 0700) != 0 && errno != EEXIST)
+        return errno_code();
+    auto pending_ids = list_directory(user_dir);
+    if (pending_ids.has_error())
+        return pending_ids.error();
+    std::size_t num_pending = 0u;
+    for (const auto& pending_id : *pending_ids)
+    {
+        if (!is_upload_id(pending_id))
+            continue;
+        if (check_pending(dir_, pending_id, pending_ttl_) == pending_state::pending)
+            ++num_pending;
+        else
+            ::unlink(upload_path(user_dir, pending_id, "").c_str());
+    }
+    if (num_pending >= max_pending_)
+        CHAT_RETURN_ERROR(errc::too_many_uploads)
+
+    // Generate an ID. This uses the public random generator because it's exposed to the user
+    std::array<unsigned char, upload_id_size / 2u> id_bytes{};
+    if (RAND_bytes(id_bytes.data(), id_bytes.size()) <= 0)
+        throw std::runtime_error("Generating upload ID: RAND_bytes");
+    constexpr const char* hex_chars = "0123456789abcdef";
+    std::string id;
+    id.reserve(upload_id_size);
+    for (auto b : id_bytes)
+    {
+        id.push_back(hex_chars[b >> 4u]);
+        id.push_back(hex_chars[b & 0x0fu]);
+    }
+
+    // Create the contents file first, so an upload is never visible without it
+    auto part_path = upload_path(dir_, id, ".part");
+    fd_guard part_fd{::open(part_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (part_fd.fd == -1)
+        return errno_code();
+
+    auto meta_path = upload_path(dir_, id, ".meta");
+    fd_guard meta_fd{::open(meta_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (meta_fd.fd == -1)
+        return errno_code();
+    auto meta = serialize_metadata(user_id, size, content_type);
+    auto ec = write_all(meta_fd.fd, meta, 0u);
+    if (ec)
+        return ec;
+
+    // Record it as pending. If this fails, the upload will be removed once it's abandoned
+    auto marker_path = upload_path(user_dir, id, "");
+    fd_guard marker_fd{::open(marker_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (marker_fd.fd == -1)
+        return errno_code();
+
+    return id;
+}
+
+result<upload_info> upload_store::get(std::string_view id) const
+{
+    // Read the metadata
+    auto meta_path = upload_path(dir_, id, ".meta");
+    fd_guard fd{::open(meta_path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd.fd == -1 && errno == ENOENT)
+        CHAT_RETURN_ERROR(errc::not_found)
+    if (fd.fd == -1)
+        return errno_code();
+    char buff[256];
+    ssize_t bytes_read = 0;
+    do
+    {
+        bytes_read = ::read(fd.fd, buff, sizeof(buff));
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0)
+        return errno_code();
+    auto res = parse_metadata(std::string_view(buff, static_cast<std::size_t>(bytes_read)));
+    if (res.has_error())
+        return res;
+
+    // Complete uploads have been renamed. Otherwise, the file size is the number of bytes received
+    struct stat file_stat;
+    if (::stat(data_path(id).c_str(), &file_stat) == 0)
+    {
+        res->offset = res->size;
+        return res;
+    }
+    if (::stat(upload_path(dir_, id, ".part").c_str(), &file_stat) == 0)
+    {
+        res->offset = static_cast<std::uint64_t>(file_stat.st_size);
+        return res;
+    }
+    if (errno == ENOENT)
+        CHAT_RETURN_ERROR(errc::not_found)
+    return errno_code();
+}
+
+result<upload_writer> upload_store::open_writer(std::string_view id)
+{
+    auto info = get(id);
+    if (info.has_error())
+        return info.error();
+    if (info->complete())
+        CHAT_RETURN_ERROR(errc::not_found)
+
+    // Lock the file, so concurrent requests (maybe from other threads) don't write to it at the same time
+    auto part_path = upload_path(dir_, id, ".part");
+    fd_guard fd{::open(part_path.c_str(), O_WRONLY | O_CLOEXEC)};
+    if (fd.fd == -1 && errno == ENOENT)
+        CHAT_RETURN_ERROR(errc::not_found)  // it was completed after we checked
+    if (fd.fd == -1)
+        return errno_code();
+    if (::flock(fd.fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        if (errno == EWOULDBLOCK)
+            CHAT_RETURN_ERROR(errc::upload_in_progress)
+        return errno_code();
+    }
+
+    // A previous writer may have written more data, or completed the upload
+    // (removing the file we opened) since we retrieved its state
+    struct stat file_stat;
+    if (::fstat(fd.fd, &file_stat) != 0)
+        return errno_code();
+    if (file_stat.st_nlink == 0u)
+        CHAT_RETURN_ERROR(errc::not_found)
+    auto offset = static_cast<std::uint64_t>(file_stat.st_size);
+    if (offset >= info->size)
+        CHAT_RETURN_ERROR(errc::upload_corrupted)
+
+    return upload_writer(fd.release(), dir_, std::string(id), info->size, offset);
+}
+
+std::string upload_store::data_path(std::string_view id) const { return upload_path(dir_, id, ".data"); }
+
+std::size_t upload_store::remove_abandoned()
+{
+    std::size_t res = 0u;
+
+    // Incomplete uploads, including the ones a crash left without a pending file,
+    // and metadata files left by crashes while an upload was being removed
+    auto names = list_directory(dir_);
+    if (names.has_error())
+    {
+        log_error(names.error(), "Removing abandoned uploads");
+        return res;
+    }
+    for (const auto& name : *names)
+    {
+        auto id = std::string_view(name).substr(0u, upload_id_size);
+        auto extension = std::string_view(name).substr(id.size());
+        if (!is_upload_id(id))
+            continue;
+        if (extension == ".part" && check_pending(dir_, id, pending_ttl_) == pending_state::removed)
+        {
+            ++res;
+        }
+        else if (extension == ".meta")
+        {
+            struct stat file_stat;
+            auto meta_path = upload_path(dir_, id, ".meta");
+            if (::stat(upload_path(dir_, id, ".part").c_str(), &file_stat) != 0 && errno == ENOENT &&
+                ::stat(data_path(id).c_str(), &file_stat) != 0 && errno == ENOENT &&
+                ::stat(meta_path.c_str(), &file_stat) == 0 && is_stale(file_stat.st_mtime, pending_ttl_))
+            {
+                ::unlink(meta_path.c_str());
+                ++res;
+            }
+        }
+    }
+
+    // Pending files of uploads that are no longer pending
+    auto users = list_directory(dir_ + "/pending");
+    if (users.has_error())
+    {
+        log_error(users.error(), "Removing abandoned uploads");
+        return res;
+    }
+    for (const auto& user : *users)
+    {
+        auto user_dir = dir_ + "/pending/" + user;
+        auto pending_ids = list_directory(user_dir);
+        if (pending_ids.has_error())
+            continue;
+        for (const auto& pending_id : *pending_ids)
+        {
+            if (is_upload_id(pending_id) &&
+                check_pending(dir_, pending_id, pending_ttl_) != pending_state::pending)
+                ::unlink(upload_path(user_dir, pending_id, "").c_str());
+        }
+    }
+
+    return res;
+}
+
+upload_store* chat::global_upload_store()
+{
+    static const std::unique_ptr<upload_store> res = []() -> std::unique_ptr<upload_store> {
+        auto dir = get_env_string("UPLOAD_DIR", "");
+        if (dir.empty())
+            return nullptr;
+        return std::make_unique<upload_store>(
+            std::move(dir),
+            get_env_size("UPLOAD_MAX_SIZE_MB", 10u) * 1024u * 1024u,
+            (std::max)(get_env_size("UPLOAD_MAX_PENDING", 5u), std::size_t(1)),
+            std::chrono::seconds((std::max)(get_env_size("UPLOAD_PENDING_TTL", 86400u), std::size_t(1)))
+        );
+    }();
+    return res.get();
+}
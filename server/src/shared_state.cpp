@@ -9,22 +9,113 @@
 
 #include <boost/asio/any_io_executor.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <memory>
 
+#include "services/broadcast_aggregator.hpp"
 #include "services/cookie_auth_service.hpp"
+#include "services/drain_controller.hpp"
+#include "services/login_rate_limiter.hpp"
+#include "services/message_spool.hpp"
 #include "services/mysql_client.hpp"
 #include "services/pubsub_service.hpp"
 #include "services/redis_client.hpp"
+#include "services/room_history_cache.hpp"
+#include "services/search_index.hpp"
+#include "services/session_token.hpp"
+#include "util/bounded_thread_pool.hpp"
+#include "util/env.hpp"
 
 using namespace chat;
 
-shared_state::shared_state(std::string doc_root, boost::asio::any_io_executor ex)
+// Creates the MySQL client for a shard, with a username cache in front of it
+static std::unique_ptr<mysql_client> create_shard_mysql_client(boost::asio::any_io_executor ex)
+{
+    return create_caching_mysql_client(
+        create_mysql_client(std::move(ex)),
+        get_env_size("USERNAME_CACHE_SIZE", 10000u),
+        std::chrono::seconds(get_env_size("USERNAME_CACHE_TTL", 300u)),
+        std::chrono::seconds(get_env_size("USERNAME_CACHE_NEGATIVE_TTL", 30u))
+    );
+}
+
+// Creates the Redis client for a shard. Stored messages are added to the search index,
+// if enabled. If the message spool is enabled, messages are spooled while Redis is unavailable.
+// Spooled messages are indexed once they're replayed, with their final IDs
+static std::unique_ptr<redis_client> create_shard_redis_client(
+    boost::asio::any_io_executor ex,
+    pubsub_service& pubsub,
+    sharded_search_index* index,
+    shared_message_spool* spool
+)
+{
+    // Stores only need to fail fast if they can be spooled
+    auto res = create_redis_client(ex, spool != nullptr);
+    if (index)
+        res = create_indexing_redis_client(std::move(res), *index);
+    if (!spool)
+        return res;
+    circuit_breaker_params params{
+        (std::max)(get_env_size("REDIS_BREAKER_FAILURES", 3u), std::size_t(1)),
+        std::chrono::milliseconds((std::max)(get_env_size("REDIS_BREAKER_OPEN_MS", 1000u), std::size_t(1))),
+    };
+    return create_spooling_redis_client(std::move(ex), std::move(res), *spool, pubsub, params);
+}
+
+// Reads the login rate limits from the environment. Rates are given per minute
+static login_rate_limiter::config get_login_rate_limiter_config()
+{
+    auto per_minute = [](const char* name, std::size_t default_value) {
+        return static_cast<double>((std::max)(get_env_size(name, default_value), std::size_t(1))) / 60.0;
+    };
+    return {
+        get_env_bool("LOGIN_RATE_LIMIT_ENABLED", true),
+        {static_cast<double>(get_env_size("LOGIN_IP_BURST", 20u)), per_minute("LOGIN_IP_PER_MINUTE", 10u)},
+        {static_cast<double>(get_env_size("LOGIN_EMAIL_FAILURES_BURST", 5u)),
+         per_minute("LOGIN_EMAIL_FAILURES_PER_MINUTE", 2u)},
+        get_env_size("LOGIN_RATE_LIMIT_CACHE_SIZE", 10000u),
+    };
+}
+
+shared_state::shared_state(
+    std::string doc_root,
+    boost::asio::any_io_executor ex,
+    std::unique_ptr<pubsub_service> pubsub,
+    bounded_thread_pool& hashing_pool,
+    scrypt_params password_params,
+    const static_file_cache& static_files,
+    admission_controller& admission,
+    startup_tracker& startup,
+    sharded_search_index* search_index,
+    shared_message_spool* spool
+)
     : impl_{
           std::move(doc_root),
-          create_redis_client(ex),
-          create_mysql_client(ex),
-          std::make_unique<cookie_auth_service>(redis(), mysql()),
-          create_pubsub_service(ex),
+          create_shard_redis_client(ex, *pubsub, search_index, spool),
+          create_shard_mysql_client(ex),
+          std::move(pubsub),
+          std::make_unique<broadcast_aggregator>(ex, *impl_.pubsub_),
+          std::make_unique<cookie_auth_service>(
+              redis(),
+              mysql(),
+              *impl_.pubsub_,
+              get_env_size("SESSION_CACHE_SIZE", 10000u),
+              std::chrono::seconds(get_env_size("SESSION_CACHE_TTL", 10u)),
+              global_session_token_signer(),
+              std::chrono::seconds(get_env_size("SESSION_REVOCATION_REFRESH", 10u))
+          ),
+          std::make_unique<login_rate_limiter>(redis(), get_login_rate_limiter_config()),
+          &hashing_pool,
+          password_params,
+          std::make_shared<room_history_cache>(*impl_.pubsub_, redis_client::message_batch_size),
+          &static_files,
+          std::make_unique<drain_controller>(ex),
+          &admission,
+          &startup,
+          search_index,
+          spool,
       }
 {
 }
@@ -0,0 +1,254 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "static_file_cache.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "util/log.hpp"
+
+using namespace chat;
+namespace fs = std::filesystem;
+
+// Removes leading and trailing whitespace
+static std::string_view trim(std::string_view value) noexcept
+{
+    auto first = value.find_first_not_of(" \t");
+    if (first == std::string_view::npos)
+        return {};
+    auto last = value.find_last_not_of(" \t");
+    return value.substr(first, last - first + 1u);
+}
+
+// Case-insensitive comparison for ASCII strings
+static bool iequals(std::string_view lhs, std::string_view rhs) noexcept
+{
+    if (lhs.size() != rhs.size())
+        return false;
+    for (std::size_t i = 0; i < lhs.size(); ++i)
+    {
+        auto to_lower = [](char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c; };
+        if (to_lower(lhs[i]) != to_lower(rhs[i]))
+            return false;
+    }
+    return true;
+}
+
+// Calls f(element) for each element in a comma-separated list, after trimming it
+template <class Function>
+static void for_each_list_element(std::string_view list, Function&& f)
+{
+    while (!list.empty())
+    {
+        auto pos = list.find(',');
+        auto elm = trim(list.substr(0, pos));
+        if (!elm.empty())
+            f(elm);
+        if (pos == std::string_view::npos)
+            break;
+        list.remove_prefix(pos + 1u);
+    }
+}
+
+// Parses the qvalue in an Accept-Encoding element (e.g. gzip;q=0.5).
+// We only care about whether it's zero (i.e. not acceptable) or not
+static bool is_acceptable(std::string_view params)
+{
+    auto pos = params.find("q=");
+    if (pos == std::string_view::npos)
+        pos = params.find("Q=");
+    if (pos == std::string_view::npos)
+        return true;
+    auto qvalue = trim(params.substr(pos + 2u));
+    return qvalue.find_first_of("123456789") != std::string_view::npos;
+}
+
+std::string_view chat::to_string(content_encoding value) noexcept
+{
+    switch (value)
+    {
+    case content_encoding::gzip: return "gzip";
+    case content_encoding::br: return "br";
+    default: return "";
+    }
+}
+
+content_encoding chat::choose_content_encoding(std::string_view accept_encoding, bool has_gzip, bool has_br)
+{
+    // Determine which encodings the client accepts. Encodings not mentioned
+    // are acceptable only if a wildcard is present
+    std::optional<bool> gzip, br, wildcard;
+    for_each_list_element(accept_encoding, [&](std::string_view elm) {
+        auto semicolon_pos = elm.find(';');
+        auto name = trim(elm.substr(0, semicolon_pos));
+        bool acceptable = semicolon_pos == std::string_view::npos || is_acceptable(elm.substr(semicolon_pos));
+        if (iequals(name, "gzip") || iequals(name, "x-gzip"))
+            gzip = acceptable;
+        else if (iequals(name, "br"))
+            br = acceptable;
+        else if (name == "*")
+            wildcard = acceptable;
+    });
+
+    if (has_br && br.value_or(wildcard.value_or(false)))
+        return content_encoding::br;
+    if (has_gzip && gzip.value_or(wildcard.value_or(false)))
+        return content_encoding::gzip;
+    return content_encoding::identity;
+}
+
+bool chat::etag_matches(std::string_view if_none_match, std::string_view etag)
+{
+    if (trim(if_none_match) == "*")
+        return true;
+
+    // Weak comparison ignores the weakness indicator
+    bool res = false;
+    for_each_list_element(if_none_match, [&](std::string_view candidate) {
+        if (candidate.substr(0, 2) == "W/")
+            candidate.remove_prefix(2);
+        if (candidate == etag)
+            res = true;
+    });
+    return res;
+}
+
+// Computes an ETag from the file contents, using 64-bit FNV-1a.
+// suffix distinguishes representations of the same file
+static std::string compute_etag(std::string_view content, std::string_view suffix)
+{
+    static constexpr char hex_digits[] = "0123456789abcdef";
+
+    std::uint64_t hash = 14695981039346656037u;
+    for (char c : content)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211u;
+    }
+
+    std::string res{'"'};
+    for (int shift = 60; shift >= 0; shift -= 4)
+        res += hex_digits[(hash >> shift) & 0x0fu];
+    res += suffix;
+    res += '"';
+    return res;
+}
+
+void static_file_cache::add(
+    std::string path,
+    std::string content,
+    std::optional<std::string> gzip,
+    std::optional<std::string> br
+)
+{
+    entry e;
+    e.identity.etag = compute_etag(content, "");
+    e.identity.content = std::move(content);
+    size_bytes_ += e.identity.content.size();
+    if (gzip)
+    {
+        // ETags are computed from the uncompressed contents, so they change when the file does
+        e.gzip = representation{std::move(*gzip), e.identity.etag};
+        e.gzip->etag.insert(e.gzip->etag.size() - 1u, "-gzip");
+        size_bytes_ += e.gzip->content.size();
+    }
+    if (br)
+    {
+        e.br = representation{std::move(*br), e.identity.etag};
+        e.br->etag.insert(e.br->etag.size() - 1u, "-br");
+        size_bytes_ += e.br->content.size();
+    }
+    entries_.insert_or_assign(std::move(path), std::move(e));
+}
+
+const static_file_cache::entry* static_file_cache::find(std::string_view path) const
+{
+    auto it = entries_.find(path);
+    return it == entries_.end() ? nullptr : &it->second;
+}
+
+// Reads an entire file. Returns an empty optional on error
+static std::optional<std::string> read_file(const fs::path& path)
+{
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+        return std::nullopt;
+    std::string res{std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+    if (is.bad())
+        return std::nullopt;
+    return res;
+}
+
+// Reads a precompressed variant of path, if it exists
+static std::optional<std::string> read_variant(const fs::path& path, std::string_view extension)
+{
+    fs::path variant_path = path;
+    variant_path += extension;
+    std::error_code ec;
+    if (!fs::is_regular_file(variant_path, ec))
+        return std::nullopt;
+    return read_file(variant_path);
+}
+
+static_file_cache static_file_cache::load(
+    const std::string& doc_root,
+    std::size_t max_total_size,
+    std::size_t max_file_size
+)
+{
+    static_file_cache res;
+    std::error_code ec;
+
+    fs::recursive_directory_iterator it(doc_root, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        // Skip directories and precompressed variants, which are loaded together with the original file
+        const auto& path = it->path();
+        if (!it->is_regular_file(ec) || path.extension() == ".gz" || path.extension() == ".br")
+            continue;
+
+        // Files exceeding the limits will be served from disk
+        auto size = it->file_size(ec);
+        if (ec || size > max_file_size)
+            continue;
+
+        // Load the file and its variants
+        auto content = read_file(path);
+        if (!content)
+            continue;
+        auto gzip = read_variant(path, ".gz");
+        auto br = read_variant(path, ".br");
+        auto total_size = content->size() + (gzip ? gzip->size() : 0u) + (br ? br->size() : 0u);
+        if (res.size_bytes_ + total_size > max_total_size)
+            continue;
+
+        // The lookup key is the URL path, which always uses forward slashes
+        auto key = "/" + fs::relative(path, doc_root, ec).generic_string();
+        if (ec)
+            continue;
+        res.add(std::move(key), std::move(*content), std::move(gzip), std::move(br));
+    }
+
+    if (should_log(log_level::info))
+    {
+        log_message(
+            log_level::info,
+            "Cached " + std::to_string(res.size()) + " static files (" + std::to_string(res.size_bytes()) +
+                " bytes)"
+        );
+    }
+
+    return res;
+}
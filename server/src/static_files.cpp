@@ -10,6 +10,10 @@
 #include <boost/beast/http/verb.hpp>
 
 #include <filesystem>
+#include <string>
+#include <string_view>
+
+#include "static_file_cache.hpp"
 
 using namespace chat;
 namespace beast = boost::beast;
@@ -53,14 +57,35 @@ response_builder::response_type chat::handle_static_file(request_context& ctx, s
     if (target_path == "/")
         target_path = "/index.html";
 
-    // Build the path to the requested file
-    std::string path = path_cat(st.doc_root(), target_path);
-
     // If the filename doesn't have an extension, we infer html
-    std::filesystem::path p(path);
-    if (p.extension().empty())
-        path.append(".html");
+    std::string url_path(target_path);
+    if (std::filesystem::path(url_path).extension().empty())
+        url_path.append(".html");
 
-    // Send the file
-    return ctx.response().file_response(path.c_str(), method == http::verb::head);
+    // Build the path to the requested file
+    std::string path = path_cat(st.doc_root(), url_path);
+
+    bool is_head = method == http::verb::head;
+
+    // Try to serve the file from memory
+    const auto* entry = st.static_files().find(url_path);
+    if (entry)
+    {
+        // Select the representation to send
+        auto enc = choose_content_encoding(
+            ctx.request_header(http::field::accept_encoding),
+            entry->gzip.has_value(),
+            entry->br.has_value()
+        );
+        const auto& repr = entry->get(enc);
+
+        // Conditional requests
+        if (etag_matches(ctx.request_header(http::field::if_none_match), repr.etag))
+            return ctx.response().not_modified(repr.etag);
+
+        return ctx.response().memory_file_response(path, repr.content, repr.etag, to_string(enc), is_head);
+    }
+
+    // Not cached. Send the file from disk
+    return ctx.response().file_response(path.c_str(), is_head, ctx.request_header(http::field::range));
 }
\ No newline at end of file
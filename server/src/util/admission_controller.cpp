@@ -0,0 +1,138 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/admission_controller.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+#include "util/env.hpp"
+#include "util/websocket_frame.hpp"
+
+using namespace chat;
+
+// Memory used to read and parse HTTP requests: Beast's default header limit (8KB),
+// our body limit (10KB) and some room for the parser's state
+static constexpr std::size_t http_buffers_size = 24u * 1024u;
+
+// Memory used by OpenSSL for each connection: two record buffers and the session state
+static constexpr std::size_t tls_buffers_size = 40u * 1024u;
+
+// The smallest stack size we allow. Handlers need some stack to run,
+// and smaller stacks would crash the server
+static constexpr std::size_t min_stack_size = 32u * 1024u;
+
+static admission_config load_admission_config()
+{
+    admission_config res;
+    res.max_connections = get_env_size("MAX_CONNECTIONS", res.max_connections);
+    res.memory_budget = get_env_size("MEMORY_BUDGET_MB", 0u) * 1024u * 1024u;
+    res.session_stack_size = (std::max)(
+        get_env_size("SESSION_STACK_SIZE_KB", res.session_stack_size / 1024u) * 1024u,
+        min_stack_size
+    );
+    res.websocket_max_message_size = get_env_size(
+        "WEBSOCKET_MAX_MESSAGE_SIZE",
+        res.websocket_max_message_size
+    );
+    return res;
+}
+
+const admission_config& chat::get_admission_config()
+{
+    static const admission_config res = load_admission_config();
+    return res;
+}
+
+std::size_t chat::http_connection_cost(const admission_config& cfg, bool tls) noexcept
+{
+    return cfg.session_stack_size + http_buffers_size + (tls ? tls_buffers_size : 0u);
+}
+
+std::size_t chat::websocket_session_cost(
+    const admission_config& cfg,
+    const websocket_compression_options& compression
+) noexcept
+{
+    std::size_t res = cfg.websocket_max_message_size;
+    if (compression.enabled)
+    {
+        // zlib's documented memory requirements, plus some room for internal structures
+        auto window_bits = static_cast<unsigned>(compression.window_bits);
+        auto mem_level = static_cast<unsigned>(compression.mem_level);
+        std::size_t deflate_size = (std::size_t(1) << (window_bits + 2u)) +
+                                   (std::size_t(1) << (mem_level + 9u));
+        std::size_t inflate_size = std::size_t(1) << window_bits;
+        res += deflate_size + inflate_size + 8u * 1024u;
+    }
+    return res;
+}
+
+bool admission_controller::try_acquire_memory(std::size_t bytes) noexcept
+{
+    auto current = memory_.load(std::memory_order_relaxed);
+    do
+    {
+        if (memory_budget_ != 0u && (current > memory_budget_ || bytes > memory_budget_ - current))
+            return false;
+    } while (!memory_.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void admission_controller::release(std::size_t connections, std::size_t bytes) noexcept
+{
+    connections_.fetch_sub(connections, std::memory_order_relaxed);
+    memory_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+admission_controller::ticket admission_controller::try_admit(std::size_t bytes) noexcept
+{
+    // Acquire a connection slot
+    auto current = connections_.load(std::memory_order_relaxed);
+    do
+    {
+        if (max_connections_ != 0u && current >= max_connections_)
+            return ticket();
+    } while (!connections_.compare_exchange_weak(current, current + 1u, std::memory_order_relaxed));
+
+    // Reserve its memory, giving the slot back on failure
+    if (!try_acquire_memory(bytes))
+    {
+        connections_.fetch_sub(1u, std::memory_order_relaxed);
+        return ticket();
+    }
+
+    return ticket(this, bytes);
+}
+
+admission_controller::ticket& admission_controller::ticket::operator=(ticket&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        if (self_)
+            self_->release(1u, bytes_);
+        self_ = rhs.self_;
+        bytes_ = rhs.bytes_;
+        rhs.self_ = nullptr;
+    }
+    return *this;
+}
+
+admission_controller::ticket::~ticket()
+{
+    if (self_)
+        self_->release(1u, bytes_);
+}
+
+bool admission_controller::ticket::reserve(std::size_t extra_bytes) noexcept
+{
+    if (!self_->try_acquire_memory(extra_bytes))
+        return false;
+    bytes_ += extra_bytes;
+    return true;
+}
@@ -9,9 +9,12 @@
 
 #include <boost/core/ignore_unused.hpp>
 
+#include <cassert>
 #include <cstddef>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include "error.hpp"
 
@@ -64,13 +67,305 @@ static constexpr signed char inverse_tab[] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1   // 240-255
 };
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHAT_BASE64_X86_KERNELS
+#endif
+
+#ifdef CHAT_BASE64_X86_KERNELS
+
+#include <immintrin.h>
+
+// Vectorized kernels for x86-64, based on Wojciech Muła's and Daniel Lemire's algorithms
+// (http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html,
+// http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html).
+// Kernels process as many complete blocks as they can, and the scalar code
+// handles the remaining input. They're compiled for their instruction set using
+// target attributes, and only called if the CPU supports it
+
+// Splits every 3 bytes in the input into four 6-bit indices, each in its own byte.
+// The input must have been shuffled so that each 32-bit lane contains bytes 1, 0, 2, 1
+__attribute__((target("ssse3"))) static __m128i split_indices_ssse3(__m128i in) noexcept
+{
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+// Translates 6-bit indices into characters of the alphabet, by adding
+// an offset that depends on the range the index falls in
+__attribute__((target("ssse3"))) static __m128i lookup_ssse3(__m128i indices) noexcept
+{
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+    );
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+__attribute__((target("ssse3"))) static __m128i shuffle_encode_input_ssse3(__m128i in) noexcept
+{
+    return _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+}
+
+// Encodes 12 input bytes into 16 characters per iteration. Reads 16 bytes
+__attribute__((target("ssse3"))) static std::size_t encode_ssse3(
+    const unsigned char* in,
+    std::size_t len,
+    char* out
+) noexcept
+{
+    std::size_t consumed = 0;
+    for (; len - consumed >= 16u; consumed += 12u, out += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + consumed));
+        v = lookup_ssse3(split_indices_ssse3(shuffle_encode_input_ssse3(v)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+    }
+    return consumed;
+}
+
+// Encodes 24 input bytes into 32 characters per iteration. Reads 28 bytes
+__attribute__((target("avx2"))) static std::size_t encode_avx2(
+    const unsigned char* in,
+    std::size_t len,
+    char* out
+) noexcept
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+    );
+    std::size_t consumed = 0;
+    for (; len - consumed >= 28u; consumed += 24u, out += 32)
+    {
+        // Each 128-bit lane gets 12 bytes of input
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + consumed))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + consumed + 12u)),
+            1
+        );
+        v = _mm256_shuffle_epi8(v, shuffle);
+
+        // Split into indices
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        // Translate to characters
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range = _mm256_or_si256(range, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        const __m256i offsets = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+        );
+        v = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+    }
+    return consumed;
+}
+
+// Decodes 16 characters into 12 bytes per iteration. Stops at the first block
+// containing characters outside the alphabet (including padding). Writes 16 bytes.
+// Returns the number of characters consumed
+__attribute__((target("ssse3"))) static std::size_t decode_ssse3(
+    const char* in,
+    std::size_t len,
+    unsigned char* out,
+    std::size_t out_capacity
+) noexcept
+{
+    // Characters are classified by their nibbles: a character is valid
+    // if the bits for its low and high nibbles don't intersect
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+    );
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+    );
+    // The offset to add to a character to get its value, by high nibble ('/' has its own entry)
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+
+    std::size_t consumed = 0;
+    std::size_t produced = 0;
+    for (; len - consumed >= 16u && out_capacity - produced >= 16u; consumed += 16u, produced += 12u)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + consumed));
+
+        // Validate
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), nibble_mask);
+        __m128i lo_nibbles = _mm_and_si128(v, nibble_mask);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+            break;
+
+        // Translate to 6-bit values
+        __m128i eq_slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_slash, hi_nibbles));
+        v = _mm_add_epi8(v, roll);
+
+        // Pack every 4 values into 3 bytes
+        __m128i merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        merged = _mm_shuffle_epi8(
+            merged,
+            _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+        );
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + produced), merged);
+    }
+    return consumed;
+}
+
+// Decodes 32 characters into 24 bytes per iteration. Like decode_ssse3, but writes 32 bytes
+__attribute__((target("avx2"))) static std::size_t decode_avx2(
+    const char* in,
+    std::size_t len,
+    unsigned char* out,
+    std::size_t out_capacity
+) noexcept
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+    );
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+    );
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+    );
+    const __m256i pack_shuffle = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+    );
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+
+    std::size_t consumed = 0;
+    std::size_t produced = 0;
+    for (; len - consumed >= 32u && out_capacity - produced >= 32u; consumed += 32u, produced += 24u)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + consumed));
+
+        // Validate
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble_mask);
+        __m256i lo_nibbles = _mm256_and_si256(v, nibble_mask);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        // Translate to 6-bit values
+        __m256i eq_slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles));
+        v = _mm256_add_epi8(v, roll);
+
+        // Pack every 4 values into 3 bytes. Each lane has 12 bytes at its beginning
+        __m256i merged = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack_shuffle);
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + produced), merged);
+    }
+    return consumed;
+}
+
+#endif
+
+// The kernel used by base64_encode and base64_decode, selected once by CPU features
+static base64_kernel select_kernel() noexcept
+{
+#ifdef CHAT_BASE64_X86_KERNELS
+    // We may run before the CPU detection code has been initialized
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return base64_kernel::avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return base64_kernel::ssse3;
+#endif
+    return base64_kernel::scalar;
+}
+
+static const base64_kernel best_kernel = select_kernel();
+
+// Encodes as many bytes as possible with the given kernel. Returns the number
+// of bytes consumed. Every 3 bytes consumed are written as 4 characters
+static std::size_t encode_blocks(
+    base64_kernel kernel,
+    const unsigned char* in,
+    std::size_t len,
+    char* out
+) noexcept
+{
+    switch (kernel)
+    {
+#ifdef CHAT_BASE64_X86_KERNELS
+    case base64_kernel::avx2:
+    {
+        // Use SSSE3 for the part that doesn't fill an AVX2 block
+        auto consumed = encode_avx2(in, len, out);
+        return consumed + encode_ssse3(in + consumed, len - consumed, out + consumed / 3u * 4u);
+    }
+    case base64_kernel::ssse3: return encode_ssse3(in, len, out);
+#endif
+    default: return 0u;
+    }
+}
+
+// Decodes as many characters as possible with the given kernel. Returns the number
+// of characters consumed, which is a multiple of 4. Every 4 characters consumed are
+// written as 3 bytes. out_capacity is the size of the output buffer
+static std::size_t decode_blocks(
+    base64_kernel kernel,
+    const char* in,
+    std::size_t len,
+    unsigned char* out,
+    std::size_t out_capacity
+) noexcept
+{
+    switch (kernel)
+    {
+#ifdef CHAT_BASE64_X86_KERNELS
+    case base64_kernel::avx2:
+    {
+        auto consumed = decode_avx2(in, len, out, out_capacity);
+        auto produced = consumed / 4u * 3u;
+        auto remaining_capacity = out_capacity - produced;
+        return consumed + decode_ssse3(in + consumed, len - consumed, out + produced, remaining_capacity);
+    }
+    case base64_kernel::ssse3: return decode_ssse3(in, len, out, out_capacity);
+#endif
+    default: return 0u;
+    }
+}
+
 // Encodes src and stores it in dest. dest must point to encoded_size(src.size()) bytes.
 // Returns the number of written characters
-static std::size_t encode(char* dest, boost::span<const unsigned char> src, bool with_padding) noexcept
+static std::size_t encode(
+    char* dest,
+    boost::span<const unsigned char> src,
+    bool with_padding,
+    base64_kernel kernel
+) noexcept
 {
-    char* out = dest;
-    const unsigned char* in = src.data();
-    std::size_t len = src.size();
+    // Encode complete blocks with the vectorized kernel, and the rest with the scalar code
+    auto vectorized = encode_blocks(kernel, src.data(), src.size(), dest);
+    char* out = dest + vectorized / 3u * 4u;
+    const unsigned char* in = src.data() + vectorized;
+    std::size_t len = src.size() - vectorized;
     const char* tab = alphabet;
 
     for (auto n = len / 3; n--;)
@@ -114,12 +409,17 @@ static std::size_t encode(char* dest, boost::span<const unsigned char> src, bool
 static result<std::pair<std::size_t, const char*>> decode(
     std::string_view from,
     unsigned char* dest,
-    bool with_padding
+    std::size_t dest_size,
+    bool with_padding,
+    base64_kernel kernel
 )
 {
-    const char* src = from.data();
-    const char* last = src + from.size();
-    auto* out = dest;
+    // Decode complete blocks with the vectorized kernel. The scalar code decodes
+    // the rest, including padding, and reports any errors
+    auto vectorized = decode_blocks(kernel, from.data(), from.size(), dest, dest_size);
+    const char* src = from.data() + vectorized;
+    const char* last = from.data() + from.size();
+    auto* out = dest + vectorized / 4u * 3u;
     unsigned char c3[3], c4[4] = {0, 0, 0, 0};
     int i = 0;
     int j = 0;
@@ -128,7 +428,7 @@ static result<std::pair<std::size_t, const char*>> decode(
 
     while (src != last && *src != '=')
     {
-        const auto v = inverse[static_cast<std::size_t>(*src)];
+        const auto v = inverse[static_cast<unsigned char>(*src)];
         if (v == -1)
             CHAT_RETURN_ERROR(errc::invalid_base64)
         ++src;
@@ -173,14 +473,28 @@ static result<std::pair<std::size_t, const char*>> decode(
     return std::pair<std::size_t, const char*>{out_len, src};
 }
 
+bool chat::base64_kernel_supported(base64_kernel kernel) noexcept
+{
+    return kernel <= best_kernel;
+}
+
 std::string chat::base64_encode(boost::span<const unsigned char> input, bool with_padding)
+{
+    return base64_encode(input, with_padding, best_kernel);
+}
+
+std::string chat::base64_encode(
+    boost::span<const unsigned char> input,
+    bool with_padding,
+    base64_kernel kernel
+)
 {
     // Allocate space
     std::size_t max_size = encoded_size(input.size());
     std::string res(max_size, '\0');
 
     // Decode
-    auto actual_size = encode(res.data(), input, with_padding);
+    auto actual_size = encode(res.data(), input, with_padding, kernel);
 
     // Remove excess space
     assert(actual_size <= max_size);
@@ -190,13 +504,22 @@ std::string chat::base64_encode(boost::span<const unsigned char> input, bool wit
 }
 
 result<std::vector<unsigned char>> chat::base64_decode(std::string_view input, bool with_padding)
+{
+    return base64_decode(input, with_padding, best_kernel);
+}
+
+result<std::vector<unsigned char>> chat::base64_decode(
+    std::string_view input,
+    bool with_padding,
+    base64_kernel kernel
+)
 {
     // Allocate space
     std::size_t max_out_size = decoded_size(input.size());
     std::vector<unsigned char> res(max_out_size, 0);
 
     // Decode
-    auto decode_result = decode(input, res.data(), with_padding);
+    auto decode_result = decode(input, res.data(), res.size(), with_padding, kernel);
     if (decode_result.has_error())
         return decode_result.error();
     auto [out_size, last] = decode_result.value();
@@ -0,0 +1,203 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/client_socket.hpp"
+
+#include <boost/asio/cancel_after.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <utility>
+
+#include "error.hpp"
+#include "util/log.hpp"
+#include "util/metrics.hpp"
+#include "util/tls_context.hpp"
+
+using namespace chat;
+
+void client_socket::ssl_deleter::operator()(ssl_st* ssl) const noexcept
+{
+    // OpenSSL removes sessions from the cache if the connection isn't shut down.
+    // Connections closed by the client are fine, even if we didn't reply with close_notify
+    if (SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)
+        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+}
+
+client_socket::client_socket(boost::asio::ip::tcp::socket&& sock) noexcept : sock_(std::move(sock)) {}
+
+client_socket::client_socket(client_socket&&) noexcept = default;
+
+client_socket& client_socket::operator=(client_socket&&) noexcept = default;
+
+client_socket::~client_socket() = default;
+
+// Translates the result of an OpenSSL I/O function that didn't succeed
+static error_code translate_ssl_error(int ssl_error) noexcept
+{
+    switch (ssl_error)
+    {
+    // The client sent close_notify, or closed the connection without sending it
+    // (we use SSL_OP_IGNORE_UNEXPECTED_EOF). For HTTP, both are a regular end of stream
+    case SSL_ERROR_ZERO_RETURN: return boost::asio::error::eof;
+
+    case SSL_ERROR_SYSCALL:
+        if (errno != 0)
+            return error_code(errno, boost::system::system_category());
+        return boost::asio::error::eof;
+
+    default: return error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+    }
+}
+
+client_socket::tls_io_result client_socket::tls_read(boost::asio::mutable_buffer buff)
+{
+    if (buff.size() == 0u)
+        return {0u, tls_wait::none, error_code()};
+
+    ERR_clear_error();
+    errno = 0;
+    std::size_t bytes_read = 0u;
+    if (SSL_read_ex(ssl_.get(), buff.data(), buff.size(), &bytes_read) == 1)
+        return {bytes_read, tls_wait::none, error_code()};
+
+    // Reading may require writing, e.g. when the peer asks for a key update
+    int err = SSL_get_error(ssl_.get(), 0);
+    if (err == SSL_ERROR_WANT_READ)
+        return {0u, tls_wait::read, error_code()};
+    if (err == SSL_ERROR_WANT_WRITE)
+        return {0u, tls_wait::write, error_code()};
+    return {0u, tls_wait::none, translate_ssl_error(err)};
+}
+
+client_socket::tls_io_result client_socket::tls_write(boost::asio::const_buffer buff)
+{
+    if (buff.size() == 0u)
+        return {0u, tls_wait::none, error_code()};
+
+    // We use SSL_MODE_ENABLE_PARTIAL_WRITE, so this behaves like a regular socket write
+    ERR_clear_error();
+    errno = 0;
+    std::size_t bytes_written = 0u;
+    if (SSL_write_ex(ssl_.get(), buff.data(), buff.size(), &bytes_written) == 1)
+        return {bytes_written, tls_wait::none, error_code()};
+
+    int err = SSL_get_error(ssl_.get(), 0);
+    if (err == SSL_ERROR_WANT_READ)
+        return {0u, tls_wait::read, error_code()};
+    if (err == SSL_ERROR_WANT_WRITE)
+        return {0u, tls_wait::write, error_code()};
+    return {0u, tls_wait::none, translate_ssl_error(err)};
+}
+
+error_code client_socket::tls_handshake(
+    const tls_context& ctx,
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+)
+{
+    error_code ec;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    // OpenSSL performs the I/O itself, so the socket must not block
+    sock_.non_blocking(true, ec);
+    if (ec)
+        return ec;
+
+    // A socket BIO is required for kTLS to be enabled
+    ssl_.reset(SSL_new(ctx.native_handle()));
+    if (!ssl_ || SSL_set_fd(ssl_.get(), static_cast<int>(sock_.native_handle())) != 1)
+    {
+        ssl_.reset();
+        return error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+    }
+    SSL_set_accept_state(ssl_.get());
+
+    while (true)
+    {
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_do_handshake(ssl_.get());
+        if (ret == 1)
+            break;
+
+        int err = SSL_get_error(ssl_.get(), ret);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        {
+            ec = translate_ssl_error(err);
+            break;
+        }
+
+        // Wait for the socket, taking into account the time already spent
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            ec = boost::asio::error::timed_out;
+            break;
+        }
+        sock_.async_wait(
+            err == SSL_ERROR_WANT_READ ? boost::asio::ip::tcp::socket::wait_read
+                                       : boost::asio::ip::tcp::socket::wait_write,
+            boost::asio::cancel_after(deadline - now, yield[ec])
+        );
+        if (ec)
+            break;
+    }
+
+    if (ec)
+    {
+        // Failed handshakes are common (scanners, clients not trusting our certificate),
+        // so they don't deserve more than a debug message
+        increment_counter(counter_id::tls_handshake_errors);
+        if (should_log(log_level::debug))
+            log_message(log_level::debug, "TLS handshake failed: " + ec.message());
+        return ec;
+    }
+
+    increment_counter(counter_id::tls_handshakes);
+    if (SSL_session_reused(ssl_.get()))
+        increment_counter(counter_id::tls_sessions_resumed);
+
+    // If the kernel took over encryption, writes bypass OpenSSL
+    ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_.get())) != 0;
+    if (ktls_send_)
+        increment_counter(counter_id::tls_ktls_send);
+
+    return error_code();
+}
+
+void client_socket::send_close_notify() noexcept
+{
+    if (!ssl_ || !SSL_is_init_finished(ssl_.get()) || (SSL_get_shutdown(ssl_.get()) & SSL_SENT_SHUTDOWN))
+        return;
+    ERR_clear_error();
+    SSL_shutdown(ssl_.get());
+}
+
+void client_socket::shutdown_send(error_code& ec) noexcept
+{
+    send_close_notify();
+    sock_.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+}
+
+void client_socket::close(error_code& ec) noexcept
+{
+    send_close_notify();
+    sock_.close(ec);
+}
@@ -7,12 +7,21 @@
 
 #include "util/cookie.hpp"
 
+#include <boost/core/bit.hpp>
+
+#include <cassert>
+#include <cstring>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string_view>
 
 #include "error.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace chat;
 
 // Copied from Boost.Beast. Returns whether a character is valid in the context
@@ -85,17 +94,30 @@ static const char* skip_ows(const char* it, const char* end) noexcept
     return it;
 }
 
-// Skips a token
-static const char* skip_token(const char* it, const char* last) noexcept
-{
-    while (it != last && is_token_char(*it))
-        ++it;
-    return it;
-}
-
-// Skips a cookie value
+// Skips a cookie value. Values can be long (e.g. analytics cookies), so we check
+// 16 characters at a time when SSE2 is available (always true for x86-64)
 static const char* skip_cookie_value(const char* it, const char* last) noexcept
 {
+#ifdef __SSE2__
+    while (last - it >= 16)
+    {
+        // Valid characters are in the [0x21, 0x7e] range, except for '"', ',', ';' and '\\'.
+        // Comparisons are signed, so characters >= 0x80 are caught by the first one
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        __m128i invalid = _mm_or_si128(
+            _mm_cmplt_epi8(v, _mm_set1_epi8(0x21)),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))
+        );
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(invalid));
+        if (mask != 0u)
+            return it + boost::core::countr_zero(mask);
+        it += 16;
+    }
+#endif
     while (it != last && is_cookie_value_char(*it))
         ++it;
     return it;
@@ -174,34 +196,20 @@ std::string set_cookie_builder::build_header() const
 // are found, increment() sets the iterator to end()
 cookie_list::cookie_list(std::string_view header) noexcept : header_(trim_ows(header)) {}
 
-void cookie_list::const_iterator::increment(bool is_first) noexcept
+// Parses a single cookie-pair starting at current, advancing it past the pair.
+// Returns std::nullopt if the input doesn't contain a valid cookie-pair
+static std::optional<cookie_pair> parse_cookie_pair(const char*& current, const char* last) noexcept
 {
-    // Check that this is not a sentinel iterator
-    assert(next_ != nullptr);
-    assert(last_ != nullptr);
-
-    const char* current = next_;
-    const char* const last = last_;
-
-    // If we're parsing subsequent cookies, skip a semicolon and a space
-    if (!is_first)
-    {
-        if (current == last || *current++ != ';')
-            return reset();
-        if (current == last || *current++ != ' ')
-            return reset();
-    }
-
-    // Cookie name. Empty cookie names are not valid
+    // Cookie name. Empty cookie names are not valid. Names are short,
+    // so locating the equal sign with memchr and then validating is cheap
     auto name_first = current;
-    current = skip_token(current, last);
-    std::string_view name(name_first, current - name_first);
-    if (name.empty())
-        return reset();
-
-    // Equal sign
-    if (current == last || *current++ != '=')
-        return reset();
+    auto* eq = static_cast<const char*>(std::memchr(current, '=', last - current));
+    if (eq == nullptr)
+        return std::nullopt;
+    std::string_view name(name_first, eq - name_first);
+    if (!is_valid_token(name))
+        return std::nullopt;
+    current = eq + 1;
 
     // Cookie value. Note that quotes are part of the value
     auto value_first = current;
@@ -215,14 +223,62 @@ void cookie_list::const_iterator::increment(bool is_first) noexcept
     if (is_quoted)
     {
         if (current == last || *current != '"')
-            return reset();
+            return std::nullopt;
         ++current;
     }
-    std::string_view value(value_first, current - value_first);
+    return cookie_pair{name, std::string_view(value_first, current - value_first)};
+}
+
+// Skips the separator between two cookie-pairs (a semicolon and a space).
+// Returns false if it's not there
+static bool skip_cookie_separator(const char*& current, const char* last) noexcept
+{
+    if (current == last || *current++ != ';')
+        return false;
+    if (current == last || *current++ != ' ')
+        return false;
+    return true;
+}
+
+void cookie_list::const_iterator::increment(bool is_first) noexcept
+{
+    // Check that this is not a sentinel iterator
+    assert(next_ != nullptr);
+    assert(last_ != nullptr);
+
+    const char* current = next_;
+    const char* const last = last_;
+
+    // If we're parsing subsequent cookies, skip a semicolon and a space
+    if (!is_first && !skip_cookie_separator(current, last))
+        return reset();
+
+    auto pair = parse_cookie_pair(current, last);
+    if (!pair)
+        return reset();
 
     // Done parsing
-    val_.name = name;
-    val_.value = value;
+    val_ = *pair;
     next_ = current;
     last_ = last;
 }
+
+std::optional<std::string_view> cookie_list::find_cookie(std::string_view name) const noexcept
+{
+    if (header_.empty())
+        return std::nullopt;
+
+    // Same as iterating, but without keeping iterator state
+    const char* current = header_.data();
+    const char* const last = header_.data() + header_.size();
+    while (true)
+    {
+        auto pair = parse_cookie_pair(current, last);
+        if (!pair)
+            return std::nullopt;
+        if (pair->name == name)
+            return pair->value;
+        if (!skip_cookie_separator(current, last))
+            return std::nullopt;
+    }
+}
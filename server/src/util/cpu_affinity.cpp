@@ -0,0 +1,69 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/cpu_affinity.hpp"
+
+#include <boost/asio/error.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <cerrno>
+#include <vector>
+
+#include "error.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+using namespace chat;
+
+#ifdef __linux__
+
+std::vector<int> chat::available_cpus()
+{
+    std::vector<int> res;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return res;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set))
+            res.push_back(cpu);
+    }
+    return res;
+}
+
+error_code chat::pin_current_thread(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return errc::invalid_config;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return res == 0 ? error_code() : error_code(res, boost::system::system_category());
+}
+
+error_code chat::set_incoming_cpu(int native_socket, int cpu)
+{
+    if (::setsockopt(native_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+        return error_code(errno, boost::system::system_category());
+    return {};
+}
+
+#else
+
+std::vector<int> chat::available_cpus() { return {}; }
+
+error_code chat::pin_current_thread(int) { return boost::asio::error::operation_not_supported; }
+
+error_code chat::set_incoming_cpu(int, int) { return boost::asio::error::operation_not_supported; }
+
+#endif
@@ -7,22 +7,197 @@
 
 #include "util/email.hpp"
 
-#include <boost/regex/v5/icu.hpp>
-#include <boost/regex/v5/regex_match.hpp>
-
-static constexpr std::string_view email_regex_str =
-    R"REGEX(^(([^<>()\[\]\\.,;:\s@"]+(\.[^<>()\[\]\\.,;:\s@"]+)*)|(".+"))@((\[[0-9]{1,3}\.[0-9]{1,3}\.[0-9]{1,3}\.[0-9]{1,3}])|(([a-zA-Z\-0-9]+\.)+[a-zA-Z]{2,}))$)REGEX";
-
-// Emails may contain Unicode characters. We use a Unicode-aware regular
-// expression to validate them. This requires ICU support. If you don't need
-// Unicode support, you can use plain boost::regex or std::regex, instead
-static const auto email_regex = boost::make_u32regex(
-    email_regex_str.begin(),
-    email_regex_str.end(),
-    boost::regex_constants::ECMAScript
-);
-
-bool chat::is_email(std::string_view email)
+#include <cstddef>
+#include <string_view>
+
+// A hand-written validator, equivalent to matching the following regular
+// expression against the code points of the UTF-8 encoded input:
+//
+//   ^(([^<>()\[\]\\.,;:\s@"]+(\.[^<>()\[\]\\.,;:\s@"]+)*)|(".+"))@
+//   ((\[[0-9]{1,3}\.[0-9]{1,3}\.[0-9]{1,3}\.[0-9]{1,3}])|(([a-zA-Z\-0-9]+\.)+[a-zA-Z]{2,}))$
+//
+// Neither alternative for the domain accepts '@', so the local part
+// extends until the last '@' in the input. Everything is constexpr, so
+// the rules are checked at compile time by the static_asserts below.
+
+namespace {
+
+constexpr bool is_ascii_digit(char c) noexcept { return c >= '0' && c <= '9'; }
+
+constexpr bool is_ascii_alpha(char c) noexcept { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+// If a whitespace character (as per Unicode) starts at str[pos], returns
+// its length in bytes. Returns zero otherwise
+constexpr std::size_t whitespace_length(std::string_view str, std::size_t pos) noexcept
 {
-    return boost::regex_match(email.begin(), email.end(), email_regex);
+    auto byte_at = [str](std::size_t i) { return i < str.size() ? static_cast<unsigned char>(str[i]) : 0u; };
+    auto b0 = byte_at(pos);
+    switch (b0)
+    {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\v':
+    case '\f':
+    case '\r': return 1u;
+    case 0xc2:
+        // U+0085 (next line), U+00A0 (no-break space)
+        return byte_at(pos + 1) == 0x85 || byte_at(pos + 1) == 0xa0 ? 2u : 0u;
+    case 0xe1:
+        // U+1680 (ogham space mark)
+        return byte_at(pos + 1) == 0x9a && byte_at(pos + 2) == 0x80 ? 3u : 0u;
+    case 0xe2:
+    {
+        // U+2000 to U+200A, U+2028, U+2029, U+202F, U+205F
+        auto b1 = byte_at(pos + 1), b2 = byte_at(pos + 2);
+        if (b1 == 0x80)
+            return (b2 >= 0x80 && b2 <= 0x8a) || b2 == 0xa8 || b2 == 0xa9 || b2 == 0xaf ? 3u : 0u;
+        return b1 == 0x81 && b2 == 0x9f ? 3u : 0u;
+    }
+    case 0xe3:
+        // U+3000 (ideographic space)
+        return byte_at(pos + 1) == 0x80 && byte_at(pos + 2) == 0x80 ? 3u : 0u;
+    default: return 0u;
+    }
 }
+
+// Characters that can't appear in an unquoted local part, other than whitespace
+constexpr bool is_local_special(char c) noexcept
+{
+    switch (c)
+    {
+    case '<':
+    case '>':
+    case '(':
+    case ')':
+    case '[':
+    case ']':
+    case '\\':
+    case ',':
+    case ';':
+    case ':':
+    case '@':
+    case '"': return true;
+    default: return false;
+    }
+}
+
+// Dot-separated, non-empty sequences of non-special characters
+constexpr bool is_dot_atom(std::string_view str) noexcept
+{
+    bool segment_empty = true;
+    for (std::size_t i = 0; i < str.size();)
+    {
+        char c = str[i];
+        if (c == '.')
+        {
+            if (segment_empty)
+                return false;
+            segment_empty = true;
+            ++i;
+        }
+        else if (is_local_special(c) || whitespace_length(str, i) != 0u)
+        {
+            return false;
+        }
+        else
+        {
+            segment_empty = false;
+            ++i;
+        }
+    }
+    return !segment_empty;
+}
+
+// Any non-empty string between double quotes
+constexpr bool is_quoted_string(std::string_view str) noexcept
+{
+    return str.size() >= 3u && str.front() == '"' && str.back() == '"';
+}
+
+constexpr bool is_local_part(std::string_view str) noexcept { return is_dot_atom(str) || is_quoted_string(str); }
+
+// [a.b.c.d], with 1 to 3 digits per component
+constexpr bool is_ip_literal(std::string_view str) noexcept
+{
+    if (str.size() < 2u || str.front() != '[' || str.back() != ']')
+        return false;
+    str = str.substr(1, str.size() - 2u);
+
+    std::size_t num_components = 1u;
+    std::size_t num_digits = 0u;
+    for (char c : str)
+    {
+        if (c == '.')
+        {
+            if (num_digits == 0u || ++num_components > 4u)
+                return false;
+            num_digits = 0u;
+        }
+        else if (!is_ascii_digit(c) || ++num_digits > 3u)
+        {
+            return false;
+        }
+    }
+    return num_components == 4u && num_digits != 0u;
+}
+
+// One or more labels of letters, digits and hyphens, each followed by a dot,
+// and a top-level domain with two letters or more
+constexpr bool is_host_name(std::string_view str) noexcept
+{
+    auto last_dot = str.rfind('.');
+    if (last_dot == std::string_view::npos)
+        return false;
+
+    // Top-level domain
+    auto tld = str.substr(last_dot + 1u);
+    if (tld.size() < 2u)
+        return false;
+    for (char c : tld)
+    {
+        if (!is_ascii_alpha(c))
+            return false;
+    }
+
+    // Labels
+    bool label_empty = true;
+    for (char c : str.substr(0, last_dot + 1u))
+    {
+        if (c == '.')
+        {
+            if (label_empty)
+                return false;
+            label_empty = true;
+        }
+        else if (is_ascii_alpha(c) || is_ascii_digit(c) || c == '-')
+        {
+            label_empty = false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool is_domain(std::string_view str) noexcept { return is_ip_literal(str) || is_host_name(str); }
+
+constexpr bool is_email_impl(std::string_view str) noexcept
+{
+    auto at = str.rfind('@');
+    return at != std::string_view::npos && is_local_part(str.substr(0, at)) &&
+           is_domain(str.substr(at + 1u));
+}
+
+static_assert(is_email_impl("email@example.com"));
+static_assert(is_email_impl("\"email\"@example.com"));
+static_assert(is_email_impl("email@[123.123.123.123]"));
+static_assert(!is_email_impl("email@example"));
+static_assert(!is_email_impl("email..email@example.com"));
+static_assert(!is_email_impl("email\xc2\xa0@example.com"));  // no-break space
+
+}  // namespace
+
+bool chat::is_email(std::string_view email) { return is_email_impl(email); }
@@ -0,0 +1,55 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/env.hpp"
+
+#include <charconv>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+
+using namespace chat;
+
+std::string chat::get_env_string(const char* name, std::string_view default_value)
+{
+    const char* value = std::getenv(name);
+    return value ? std::string(value) : std::string(default_value);
+}
+
+std::size_t chat::get_env_size(const char* name, std::size_t default_value)
+{
+    const char* value = std::getenv(name);
+    if (!value)
+        return default_value;
+
+    std::string_view value_sv(value);
+    std::size_t res = 0;
+    auto parse_result = std::from_chars(value_sv.data(), value_sv.data() + value_sv.size(), res);
+    if (parse_result.ec != std::errc() || parse_result.ptr != value_sv.data() + value_sv.size())
+    {
+        log_error(errc::invalid_config, "Invalid integer in environment variable", name);
+        return default_value;
+    }
+    return res;
+}
+
+bool chat::get_env_bool(const char* name, bool default_value)
+{
+    const char* value = std::getenv(name);
+    if (!value)
+        return default_value;
+
+    std::string_view value_sv(value);
+    if (value_sv == "1" || value_sv == "true" || value_sv == "yes" || value_sv == "on")
+        return true;
+    if (value_sv == "0" || value_sv == "false" || value_sv == "no" || value_sv == "off")
+        return false;
+    log_error(errc::invalid_config, "Invalid boolean in environment variable", name);
+    return default_value;
+}
@@ -0,0 +1,541 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/hpack.hpp"
+
+#include <boost/core/span.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+namespace {
+
+// The static table (RFC 7541, appendix A). Index 1 is the first entry
+struct static_entry
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+constexpr std::array<static_entry, 61> static_table{
+    {
+     {":authority", ""},
+     {":method", "GET"},
+     {":method", "POST"},
+     {":path", "/"},
+     {":path", "/index.html"},
+     {":scheme", "http"},
+     {":scheme", "https"},
+     {":status", "200"},
+     {":status", "204"},
+     {":status", "206"},
+     {":status", "304"},
+     {":status", "400"},
+     {":status", "404"},
+     {":status", "500"},
+     {"accept-charset", ""},
+     {"accept-encoding", "gzip, deflate"},
+     {"accept-language", ""},
+     {"accept-ranges", ""},
+     {"accept", ""},
+     {"access-control-allow-origin", ""},
+     {"age", ""},
+     {"allow", ""},
+     {"authorization", ""},
+     {"cache-control", ""},
+     {"content-disposition", ""},
+     {"content-encoding", ""},
+     {"content-language", ""},
+     {"content-length", ""},
+     {"content-location", ""},
+     {"content-range", ""},
+     {"content-type", ""},
+     {"cookie", ""},
+     {"date", ""},
+     {"etag", ""},
+     {"expect", ""},
+     {"expires", ""},
+     {"from", ""},
+     {"host", ""},
+     {"if-match", ""},
+     {"if-modified-since", ""},
+     {"if-none-match", ""},
+     {"if-range", ""},
+     {"if-unmodified-since", ""},
+     {"last-modified", ""},
+     {"link", ""},
+     {"location", ""},
+     {"max-forwards", ""},
+     {"proxy-authenticate", ""},
+     {"proxy-authorization", ""},
+     {"range", ""},
+     {"referer", ""},
+     {"refresh", ""},
+     {"retry-after", ""},
+     {"server", ""},
+     {"set-cookie", ""},
+     {"strict-transport-security", ""},
+     {"transfer-encoding", ""},
+     {"user-agent", ""},
+     {"vary", ""},
+     {"via", ""},
+     {"www-authenticate", ""},
+     }
+};
+
+// Per-entry overhead when computing table sizes
+constexpr std::size_t entry_overhead = 32u;
+
+// The length in bits of the Huffman code for each symbol (RFC 7541, appendix B).
+// The last symbol is EOS. The code is canonical, so the codes can be computed from their lengths
+constexpr std::size_t num_huffman_symbols = 257u;
+constexpr std::size_t max_huffman_length = 30u;
+constexpr std::size_t eos_symbol = 256u;
+constexpr std::array<std::uint8_t, num_huffman_symbols> huffman_lengths{
+    {
+     13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+     28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+      6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+      5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+     13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+      7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+     15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+      6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+     20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+     24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+     22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+     21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+     26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+     19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+     20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+     26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+     30,
+     }
+};
+
+// Tables to encode and decode the canonical Huffman code
+struct huffman_tables
+{
+    // Code for each symbol, right-aligned
+    std::array<std::uint32_t, num_huffman_symbols> codes{};
+
+    // Symbols sorted by code
+    std::array<std::uint16_t, num_huffman_symbols> sorted_symbols{};
+
+    // For each length: the code of the first symbol with that length,
+    // its index in sorted_symbols, and the number of symbols with that length
+    std::array<std::uint32_t, max_huffman_length + 1u> first_code{};
+    std::array<std::uint16_t, max_huffman_length + 1u> first_index{};
+    std::array<std::uint16_t, max_huffman_length + 1u> count{};
+};
+
+constexpr huffman_tables make_huffman_tables()
+{
+    huffman_tables res;
+
+    for (auto len : huffman_lengths)
+        ++res.count[len];
+
+    std::uint32_t code = 0u;
+    std::uint16_t index = 0u;
+    for (std::size_t len = 1u; len <= max_huffman_length; ++len)
+    {
+        res.first_code[len] = code;
+        res.first_index[len] = index;
+        for (std::size_t sym = 0u; sym < num_huffman_symbols; ++sym)
+        {
+            if (huffman_lengths[sym] == len)
+            {
+                res.codes[sym] = code++;
+                res.sorted_symbols[index++] = static_cast<std::uint16_t>(sym);
+            }
+        }
+        code <<= 1u;
+    }
+
+    return res;
+}
+
+constexpr huffman_tables huffman = make_huffman_tables();
+
+// Spot checks against the codes listed in the RFC
+static_assert(huffman.codes['0'] == 0x0u);
+static_assert(huffman.codes['a'] == 0x3u);
+static_assert(huffman.codes['z'] == 0x7bu);
+static_assert(huffman.codes[0] == 0x1ff8u);
+static_assert(huffman.codes[255] == 0x3ffffeeu);
+static_assert(huffman.codes[eos_symbol] == 0x3fffffffu);
+
+std::size_t huffman_encoded_size(std::string_view input) noexcept
+{
+    std::size_t bits = 0u;
+    for (char c : input)
+        bits += huffman_lengths[static_cast<unsigned char>(c)];
+    return (bits + 7u) / 8u;
+}
+
+// Integers with an N-bit prefix (RFC 7541, section 5.1). first_byte contains the bits
+// preceding the prefix
+void encode_integer(std::uint64_t value, unsigned prefix_bits, unsigned char first_byte, std::string& out)
+{
+    const std::uint64_t max_prefix = (1u << prefix_bits) - 1u;
+    if (value < max_prefix)
+    {
+        out.push_back(static_cast<char>(first_byte | value));
+        return;
+    }
+    out.push_back(static_cast<char>(first_byte | max_prefix));
+    value -= max_prefix;
+    while (value >= 128u)
+    {
+        out.push_back(static_cast<char>((value & 0x7fu) | 0x80u));
+        value >>= 7u;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Strings are Huffman-encoded if that makes them shorter
+void encode_string(std::string_view value, std::string& out)
+{
+    auto huffman_size = huffman_encoded_size(value);
+    if (huffman_size < value.size())
+    {
+        encode_integer(huffman_size, 7u, 0x80u, out);
+        hpack_huffman_encode(value, out);
+    }
+    else
+    {
+        encode_integer(value.size(), 7u, 0x00u, out);
+        out.append(value);
+    }
+}
+
+// Reads the fields of a header block
+class block_reader
+{
+    const unsigned char* it_;
+    const unsigned char* end_;
+
+public:
+    explicit block_reader(boost::span<const unsigned char> block) noexcept
+        : it_(block.data()), end_(block.data() + block.size())
+    {
+    }
+
+    bool done() const noexcept { return it_ == end_; }
+    unsigned char peek() const noexcept { return *it_; }
+
+    bool read_integer(unsigned prefix_bits, std::uint64_t& value) noexcept
+    {
+        if (it_ == end_)
+            return false;
+        const std::uint64_t max_prefix = (1u << prefix_bits) - 1u;
+        value = *it_++ & max_prefix;
+        if (value < max_prefix)
+            return true;
+
+        // Values this big are never legitimate, and would overflow
+        for (unsigned shift = 0u; shift <= 28u; shift += 7u)
+        {
+            if (it_ == end_)
+                return false;
+            unsigned char b = *it_++;
+            value += static_cast<std::uint64_t>(b & 0x7fu) << shift;
+            if ((b & 0x80u) == 0u)
+                return true;
+        }
+        return false;
+    }
+
+    error_code read_string(std::string& out)
+    {
+        out.clear();
+        if (it_ == end_)
+            return errc::hpack_decode_error;
+        bool is_huffman = (*it_ & 0x80u) != 0u;
+        std::uint64_t size = 0u;
+        if (!read_integer(7u, size) || size > static_cast<std::uint64_t>(end_ - it_))
+            return errc::hpack_decode_error;
+        boost::span<const unsigned char> data(it_, static_cast<std::size_t>(size));
+        it_ += size;
+        if (is_huffman)
+            return hpack_huffman_decode(data, out);
+        out.assign(reinterpret_cast<const char*>(data.data()), data.size());
+        return error_code();
+    }
+};
+
+// Headers that change with every response, and would just evict useful entries from the table
+bool is_volatile_header(std::string_view name) noexcept
+{
+    return name == "content-length" || name == "date" || name == "etag" || name == "last-modified" ||
+           name == "content-range" || name == "expires" || name == "age";
+}
+
+// Headers that should never be in a compression context, to prevent attacks like CRIME
+bool is_sensitive_header(std::string_view name) noexcept
+{
+    return name == "set-cookie" || name == "cookie" || name == "authorization" ||
+           name == "proxy-authorization";
+}
+
+}  // namespace
+
+void chat::hpack_huffman_encode(std::string_view input, std::string& out)
+{
+    std::uint64_t acc = 0u;
+    unsigned num_bits = 0u;
+    for (char c : input)
+    {
+        auto sym = static_cast<unsigned char>(c);
+        acc = (acc << huffman_lengths[sym]) | huffman.codes[sym];
+        num_bits += huffman_lengths[sym];
+        while (num_bits >= 8u)
+        {
+            num_bits -= 8u;
+            out.push_back(static_cast<char>(acc >> num_bits));
+        }
+    }
+
+    // Pad with the most significant bits of EOS, which are all ones
+    if (num_bits != 0u)
+        out.push_back(static_cast<char>((acc << (8u - num_bits)) | (0xffu >> num_bits)));
+}
+
+error_code chat::hpack_huffman_decode(boost::span<const unsigned char> input, std::string& out)
+{
+    std::uint32_t code = 0u;
+    std::size_t len = 0u;
+    for (unsigned char byte : input)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            code = (code << 1u) | ((byte >> bit) & 1u);
+            ++len;
+            std::uint32_t offset = code - huffman.first_code[len];
+            if (offset < huffman.count[len])
+            {
+                auto sym = huffman.sorted_symbols[huffman.first_index[len] + offset];
+                if (sym == eos_symbol)
+                    return errc::hpack_decode_error;
+                out.push_back(static_cast<char>(sym));
+                code = 0u;
+                len = 0u;
+            }
+            else if (len == max_huffman_length)
+            {
+                return errc::hpack_decode_error;
+            }
+        }
+    }
+
+    // Padding must be shorter than 8 bits, and consist of the most significant bits of EOS
+    if (len > 7u || code != (1u << len) - 1u)
+        return errc::hpack_decode_error;
+    return error_code();
+}
+
+void hpack_dynamic_table::evict(std::size_t max_size)
+{
+    while (size_ > max_size)
+    {
+        const auto& entry = entries_.back();
+        size_ -= entry.name.size() + entry.value.size() + entry_overhead;
+        entries_.pop_back();
+    }
+}
+
+void hpack_dynamic_table::set_max_size(std::size_t max_size)
+{
+    max_size_ = max_size;
+    evict(max_size);
+}
+
+void hpack_dynamic_table::add(std::string_view name, std::string_view value)
+{
+    std::size_t entry_size = name.size() + value.size() + entry_overhead;
+    if (entry_size > max_size_)
+    {
+        evict(0u);
+        return;
+    }
+    evict(max_size_ - entry_size);
+    entries_.push_front(hpack_header{std::string(name), std::string(value)});
+    size_ += entry_size;
+}
+
+error_code hpack_decoder::decode(
+    boost::span<const unsigned char> block,
+    std::vector<hpack_header>& headers,
+    std::size_t max_list_size
+)
+{
+    block_reader reader(block);
+    std::size_t list_size = 0u;
+    bool fields_seen = false;
+
+    // Looks up an index in the static and dynamic tables. The returned views
+    // are valid until the dynamic table is modified
+    auto lookup = [this](std::uint64_t index, std::string_view& name, std::string_view& value) {
+        if (index == 0u)
+            return false;
+        if (index <= static_table.size())
+        {
+            name = static_table[index - 1u].name;
+            value = static_table[index - 1u].value;
+            return true;
+        }
+        index -= static_table.size() + 1u;
+        if (index >= table_.num_entries())
+            return false;
+        const auto& entry = table_.at(static_cast<std::size_t>(index));
+        name = entry.name;
+        value = entry.value;
+        return true;
+    };
+
+    while (!reader.done())
+    {
+        unsigned char first = reader.peek();
+        std::uint64_t index = 0u;
+
+        if ((first & 0xe0u) == 0x20u)
+        {
+            // Dynamic table size update. Only allowed before any field
+            if (fields_seen || !reader.read_integer(5u, index) || index > max_table_size_)
+                return errc::hpack_decode_error;
+            table_.set_max_size(static_cast<std::size_t>(index));
+            continue;
+        }
+
+        fields_seen = true;
+        hpack_header field;
+        if (first & 0x80u)
+        {
+            // Indexed field
+            std::string_view name, value;
+            if (!reader.read_integer(7u, index) || !lookup(index, name, value))
+                return errc::hpack_decode_error;
+            field.name = name;
+            field.value = value;
+        }
+        else
+        {
+            // Literal field, with incremental indexing (01), without indexing (0000)
+            // or never indexed (0001). The name may be indexed
+            bool add_to_table = (first & 0xc0u) == 0x40u;
+            if (!reader.read_integer(add_to_table ? 6u : 4u, index))
+                return errc::hpack_decode_error;
+            if (index == 0u)
+            {
+                auto ec = reader.read_string(field.name);
+                if (ec)
+                    return ec;
+            }
+            else
+            {
+                std::string_view name, value;
+                if (!lookup(index, name, value))
+                    return errc::hpack_decode_error;
+                field.name = name;
+            }
+            auto ec = reader.read_string(field.value);
+            if (ec)
+                return ec;
+            if (add_to_table)
+                table_.add(field.name, field.value);
+        }
+
+        list_size += field.name.size() + field.value.size() + entry_overhead;
+        if (list_size > max_list_size)
+            return errc::hpack_decode_error;
+        headers.push_back(std::move(field));
+    }
+
+    return error_code();
+}
+
+void hpack_encoder::set_max_table_size(std::size_t value)
+{
+    // We never use more memory than the default, even if the peer allows it
+    if (value > hpack_default_table_size)
+        value = hpack_default_table_size;
+    if (value == table_.max_size() && !table_size_changed_)
+        return;
+    if (!table_size_changed_ || value < min_table_size_)
+        min_table_size_ = value;
+    table_size_changed_ = true;
+    table_.set_max_size(value);
+}
+
+void hpack_encoder::encode(boost::span<const hpack_header> headers, std::string& out)
+{
+    // Signal table size changes. If the table was shrunk and then grown again,
+    // the decoder must see the minimum size, too, so it evicts the same entries
+    if (table_size_changed_)
+    {
+        if (min_table_size_ < table_.max_size())
+            encode_integer(min_table_size_, 5u, 0x20u, out);
+        encode_integer(table_.max_size(), 5u, 0x20u, out);
+        table_size_changed_ = false;
+    }
+
+    for (const auto& field : headers)
+    {
+        // Look for a full match, or at least for the name
+        std::size_t name_index = 0u;
+        std::size_t full_index = 0u;
+        for (std::size_t i = 0u; i < static_table.size() && full_index == 0u; ++i)
+        {
+            if (static_table[i].name == field.name)
+            {
+                if (name_index == 0u)
+                    name_index = i + 1u;
+                if (static_table[i].value == field.value)
+                    full_index = i + 1u;
+            }
+        }
+        for (std::size_t i = 0u; i < table_.num_entries() && full_index == 0u; ++i)
+        {
+            const auto& entry = table_.at(i);
+            if (entry.name == field.name)
+            {
+                if (name_index == 0u)
+                    name_index = static_table.size() + i + 1u;
+                if (entry.value == field.value)
+                    full_index = static_table.size() + i + 1u;
+            }
+        }
+
+        bool sensitive = is_sensitive_header(field.name);
+        if (full_index != 0u && !sensitive)
+        {
+            encode_integer(full_index, 7u, 0x80u, out);
+            continue;
+        }
+
+        // Literal field
+        bool add_to_table = !sensitive && !is_volatile_header(field.name);
+        if (add_to_table)
+            encode_integer(name_index, 6u, 0x40u, out);
+        else
+            encode_integer(name_index, 4u, sensitive ? 0x10u : 0x00u, out);
+        if (name_index == 0u)
+            encode_string(field.name, out);
+        encode_string(field.value, out);
+        if (add_to_table)
+            table_.add(field.name, field.value);
+    }
+}
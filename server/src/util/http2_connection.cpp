@@ -0,0 +1,714 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/http2_connection.hpp"
+
+#include <boost/core/span.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "error.hpp"
+#include "util/hpack.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Frame types
+constexpr std::uint8_t frame_data = 0x0;
+constexpr std::uint8_t frame_headers = 0x1;
+constexpr std::uint8_t frame_priority = 0x2;
+constexpr std::uint8_t frame_rst_stream = 0x3;
+constexpr std::uint8_t frame_settings = 0x4;
+constexpr std::uint8_t frame_push_promise = 0x5;
+constexpr std::uint8_t frame_ping = 0x6;
+constexpr std::uint8_t frame_goaway = 0x7;
+constexpr std::uint8_t frame_window_update = 0x8;
+constexpr std::uint8_t frame_continuation = 0x9;
+
+// Frame flags
+constexpr std::uint8_t flag_end_stream = 0x1;
+constexpr std::uint8_t flag_ack = 0x1;
+constexpr std::uint8_t flag_end_headers = 0x4;
+constexpr std::uint8_t flag_padded = 0x8;
+constexpr std::uint8_t flag_priority = 0x20;
+
+// Settings identifiers
+constexpr std::uint16_t settings_header_table_size = 0x1;
+constexpr std::uint16_t settings_enable_push = 0x2;
+constexpr std::uint16_t settings_max_concurrent_streams = 0x3;
+constexpr std::uint16_t settings_initial_window_size = 0x4;
+constexpr std::uint16_t settings_max_frame_size = 0x5;
+constexpr std::uint16_t settings_max_header_list_size = 0x6;
+
+constexpr std::size_t frame_header_size = 9u;
+constexpr std::uint32_t default_window_size = 65535u;
+constexpr std::uint32_t max_window_size = 0x7fffffffu;
+
+// We don't change the defaults for these, so they're also the sizes we accept
+constexpr std::uint32_t default_max_frame_size = 16384u;
+constexpr std::uint32_t max_frame_size_limit = 16777215u;
+
+std::uint32_t read_u32(const char* p) noexcept
+{
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return (std::uint32_t(b[0]) << 24) | (std::uint32_t(b[1]) << 16) | (std::uint32_t(b[2]) << 8) |
+           std::uint32_t(b[3]);
+}
+
+void append_u32(std::string& out, std::uint32_t value)
+{
+    out.push_back(static_cast<char>(value >> 24));
+    out.push_back(static_cast<char>(value >> 16));
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+void append_setting(std::string& out, std::uint16_t id, std::uint32_t value)
+{
+    out.push_back(static_cast<char>(id >> 8));
+    out.push_back(static_cast<char>(id));
+    append_u32(out, value);
+}
+
+void append_window_update(std::string& out, std::uint32_t stream_id, std::uint32_t increment)
+{
+    http2_append_frame_header(out, 4u, frame_window_update, 0u, stream_id);
+    append_u32(out, increment);
+}
+
+// Removes padding from a frame payload. Returns false if the padding is invalid
+bool strip_padding(std::uint8_t flags, std::string_view& payload) noexcept
+{
+    if (!(flags & flag_padded))
+        return true;
+    if (payload.empty())
+        return false;
+    auto padding = static_cast<unsigned char>(payload[0]);
+    if (padding >= payload.size())
+        return false;
+    payload = payload.substr(1u, payload.size() - 1u - padding);
+    return true;
+}
+
+// Connection-specific headers are not allowed in HTTP/2 (RFC 9113, section 8.2.2)
+bool is_connection_specific_header(std::string_view name) noexcept
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+// Field names must be lowercase, and can't contain separators. Values can't contain
+// characters that would allow splitting them when translated to HTTP/1.1 (RFC 9113, section 8.2.1)
+bool is_valid_field(const hpack_header& h) noexcept
+{
+    std::string_view name(h.name);
+    if (!name.empty() && name[0] == ':')
+        name.remove_prefix(1);
+    if (name.empty())
+        return false;
+    for (char c : name)
+    {
+        auto uc = static_cast<unsigned char>(c);
+        if (uc <= 0x20u || uc >= 0x7fu || (c >= 'A' && c <= 'Z') || c == ':')
+            return false;
+    }
+    return std::none_of(h.value.begin(), h.value.end(), [](char c) {
+        return c == '\0' || c == '\r' || c == '\n';
+    });
+}
+
+// Checks the requirements for request headers (RFC 9113, sections 8.2 and 8.3.1)
+bool is_valid_request(const std::vector<hpack_header>& headers) noexcept
+{
+    bool has_method = false, has_scheme = false, has_path = false, has_authority = false;
+    bool regular_seen = false;
+    for (const auto& h : headers)
+    {
+        if (!is_valid_field(h))
+            return false;
+        if (!h.name.empty() && h.name[0] == ':')
+        {
+            // Pseudo-headers go first, and can't be repeated
+            bool* seen = h.name == ":method"      ? &has_method
+                         : h.name == ":scheme"    ? &has_scheme
+                         : h.name == ":path"      ? &has_path
+                         : h.name == ":authority" ? &has_authority
+                                                  : nullptr;
+            if (regular_seen || !seen || *seen)
+                return false;
+            *seen = true;
+            if (h.name == ":path" && h.value.empty())
+                return false;
+        }
+        else
+        {
+            regular_seen = true;
+            if (is_connection_specific_header(h.name) || (h.name == "te" && h.value != "trailers"))
+                return false;
+        }
+    }
+
+    // CONNECT requests don't have these. We don't support them
+    return has_method && has_scheme && has_path;
+}
+
+}  // namespace
+
+void chat::http2_append_frame_header(
+    std::string& out,
+    std::size_t length,
+    std::uint8_t type,
+    std::uint8_t flags,
+    std::uint32_t stream_id
+)
+{
+    out.push_back(static_cast<char>(length >> 16));
+    out.push_back(static_cast<char>(length >> 8));
+    out.push_back(static_cast<char>(length));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    append_u32(out, stream_id & max_window_size);
+}
+
+http2_connection::http2_connection(const config& cfg)
+    : cfg_(cfg),
+      peer_initial_window_size_(default_window_size),
+      peer_max_frame_size_(default_max_frame_size),
+      connection_send_window_(default_window_size)
+{
+    // Our settings. Window and frame sizes are kept to their defaults
+    http2_append_frame_header(control_, 12u, frame_settings, 0u, 0u);
+    append_setting(control_, settings_max_concurrent_streams, cfg_.max_concurrent_streams);
+    append_setting(control_, settings_max_header_list_size, cfg_.max_header_list_size);
+}
+
+error_code http2_connection::connection_error(http2_error_code code)
+{
+    // Frames that were waiting to be sent are kept, so responses that have been
+    // generated get delivered. No more data is processed
+    if (!failed_)
+    {
+        failed_ = true;
+        http2_append_frame_header(control_, 8u, frame_goaway, 0u, 0u);
+        append_u32(control_, last_stream_id_);
+        append_u32(control_, static_cast<std::uint32_t>(code));
+        goaway_sent_ = true;
+        streams_.clear();
+        sending_.clear();
+    }
+    return errc::http2_protocol_error;
+}
+
+void http2_connection::stream_error(std::uint32_t id, http2_error_code code)
+{
+    http2_append_frame_header(control_, 4u, frame_rst_stream, 0u, id);
+    append_u32(control_, static_cast<std::uint32_t>(code));
+    streams_.erase(id);
+}
+
+error_code http2_connection::on_data(boost::span<const unsigned char> data)
+{
+    if (failed_)
+        return errc::http2_protocol_error;
+
+    input_.append(reinterpret_cast<const char*>(data.data()), data.size());
+    std::string_view remaining(input_);
+
+    // The preface must be received before any frame
+    if (!preface_received_)
+    {
+        auto size = (std::min)(remaining.size(), client_preface.size());
+        if (remaining.substr(0, size) != client_preface.substr(0, size))
+            return connection_error(http2_error_code::protocol_error);
+        if (size < client_preface.size())
+            return error_code();
+        remaining.remove_prefix(size);
+        preface_received_ = true;
+    }
+
+    // Process all the complete frames
+    error_code ec;
+    while (remaining.size() >= frame_header_size)
+    {
+        auto header = reinterpret_cast<const unsigned char*>(remaining.data());
+        std::size_t length = (std::size_t(header[0]) << 16) | (std::size_t(header[1]) << 8) | header[2];
+        if (length > default_max_frame_size)
+            return connection_error(http2_error_code::frame_size_error);
+        if (remaining.size() < frame_header_size + length)
+            break;
+        std::uint8_t type = header[3];
+        std::uint8_t flags = header[4];
+        std::uint32_t id = read_u32(remaining.data() + 5u) & max_window_size;
+        ec = on_frame(type, flags, id, remaining.substr(frame_header_size, length));
+        if (ec)
+            return ec;
+
+        // Clients sending frames that require replies (e.g. PINGs) without reading
+        // the replies would make us buffer an unbounded amount of data
+        if (control_.size() > cfg_.max_control_size)
+            return connection_error(http2_error_code::enhance_your_calm);
+        remaining.remove_prefix(frame_header_size + length);
+    }
+
+    input_.erase(0, input_.size() - remaining.size());
+    return error_code();
+}
+
+error_code http2_connection::on_frame(
+    std::uint8_t type,
+    std::uint8_t flags,
+    std::uint32_t id,
+    std::string_view payload
+)
+{
+    // Header blocks can't be interleaved with any other frame
+    if (continuation_stream_ != 0u && type != frame_continuation)
+        return connection_error(http2_error_code::protocol_error);
+
+    switch (type)
+    {
+    case frame_data: return on_data_frame(flags, id, payload);
+    case frame_headers: return on_headers(flags, id, payload);
+    case frame_continuation: return on_continuation(flags, id, payload);
+    case frame_settings: return on_settings(flags, id, payload);
+    case frame_window_update: return on_window_update(id, payload);
+    case frame_priority:
+        // Priorities are deprecated, and we don't use them
+        if (id == 0u)
+            return connection_error(http2_error_code::protocol_error);
+        if (payload.size() != 5u)
+            stream_error(id, http2_error_code::frame_size_error);
+        return error_code();
+    case frame_rst_stream:
+        if (id == 0u || id > last_stream_id_)
+            return connection_error(http2_error_code::protocol_error);
+        if (payload.size() != 4u)
+            return connection_error(http2_error_code::frame_size_error);
+        streams_.erase(id);
+        return error_code();
+    case frame_ping:
+        if (id != 0u)
+            return connection_error(http2_error_code::protocol_error);
+        if (payload.size() != 8u)
+            return connection_error(http2_error_code::frame_size_error);
+        if (!(flags & flag_ack))
+        {
+            http2_append_frame_header(control_, 8u, frame_ping, flag_ack, 0u);
+            control_.append(payload);
+        }
+        return error_code();
+    case frame_goaway:
+        if (id != 0u)
+            return connection_error(http2_error_code::protocol_error);
+        if (payload.size() < 8u)
+            return connection_error(http2_error_code::frame_size_error);
+        goaway_received_ = true;
+        return error_code();
+    case frame_push_promise:
+        // Clients can't push
+        return connection_error(http2_error_code::protocol_error);
+    default:
+        // Unknown frame types must be ignored
+        return error_code();
+    }
+}
+
+error_code http2_connection::on_headers(std::uint8_t flags, std::uint32_t id, std::string_view payload)
+{
+    // Client streams have odd identifiers
+    if (id == 0u || id % 2u == 0u)
+        return connection_error(http2_error_code::protocol_error);
+    if (!strip_padding(flags, payload))
+        return connection_error(http2_error_code::protocol_error);
+    if (flags & flag_priority)
+    {
+        if (payload.size() < 5u)
+            return connection_error(http2_error_code::frame_size_error);
+        payload.remove_prefix(5u);
+    }
+
+    // A new stream must have a higher ID than any previous one. Otherwise,
+    // this must be a trailer block for a stream that is still receiving the request
+    if (id <= last_stream_id_)
+    {
+        auto it = streams_.find(id);
+        if (it == streams_.end())
+            return connection_error(http2_error_code::stream_closed);
+        if (it->second.request_complete || !(flags & flag_end_stream))
+        {
+            // The block must still be decoded, to keep the HPACK state in sync
+            stream_error(id, http2_error_code::stream_closed);
+        }
+    }
+    else
+    {
+        last_stream_id_ = id;
+        if (!goaway_sent_)
+        {
+            if (num_active_streams() >= cfg_.max_concurrent_streams)
+                stream_error(id, http2_error_code::refused_stream);
+            else
+                streams_.emplace(id, stream(peer_initial_window_size_));
+        }
+    }
+
+    header_block_.assign(payload.data(), payload.size());
+    if (flags & flag_end_headers)
+        return on_header_block(id, flags & flag_end_stream);
+    continuation_stream_ = id;
+    continuation_end_stream_ = flags & flag_end_stream;
+    return error_code();
+}
+
+error_code http2_connection::on_continuation(std::uint8_t flags, std::uint32_t id, std::string_view payload)
+{
+    if (continuation_stream_ == 0u || id != continuation_stream_)
+        return connection_error(http2_error_code::protocol_error);
+
+    // Compressed headers can't be bigger than their decoded form
+    if (header_block_.size() + payload.size() > cfg_.max_header_list_size)
+        return connection_error(http2_error_code::protocol_error);
+    header_block_.append(payload.data(), payload.size());
+
+    if (flags & flag_end_headers)
+    {
+        continuation_stream_ = 0u;
+        return on_header_block(id, continuation_end_stream_);
+    }
+    return error_code();
+}
+
+error_code http2_connection::on_header_block(std::uint32_t id, bool end_stream)
+{
+    std::vector<hpack_header> headers;
+    auto ec = decoder_.decode(
+        {reinterpret_cast<const unsigned char*>(header_block_.data()), header_block_.size()},
+        headers,
+        cfg_.max_header_list_size
+    );
+    header_block_.clear();
+    if (ec)
+        return connection_error(http2_error_code::compression_error);
+
+    // The stream may have been refused or reset
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+        return error_code();
+    auto& s = it->second;
+
+    if (s.headers.empty())
+    {
+        if (!is_valid_request(headers))
+        {
+            stream_error(id, http2_error_code::protocol_error);
+            return error_code();
+        }
+        s.headers = std::move(headers);
+    }
+
+    // Trailers are ignored
+    if (end_stream)
+        on_request_complete(id, s);
+    return error_code();
+}
+
+error_code http2_connection::on_data_frame(std::uint8_t flags, std::uint32_t id, std::string_view payload)
+{
+    if (id == 0u || id > last_stream_id_)
+        return connection_error(http2_error_code::protocol_error);
+
+    // Flow control applies to the entire frame, including padding.
+    // We process data immediately, so we return the credit straight away
+    auto frame_size = static_cast<std::uint32_t>(payload.size());
+    if (!strip_padding(flags, payload))
+        return connection_error(http2_error_code::protocol_error);
+    if (frame_size != 0u)
+        append_window_update(control_, 0u, frame_size);
+
+    auto it = streams_.find(id);
+    if (it == streams_.end() || it->second.request_complete)
+    {
+        stream_error(id, http2_error_code::stream_closed);
+        return error_code();
+    }
+    auto& s = it->second;
+
+    if (s.body.size() + payload.size() > cfg_.max_body_size)
+    {
+        stream_error(id, http2_error_code::cancel);
+        return error_code();
+    }
+    s.body.append(payload.data(), payload.size());
+
+    if (flags & flag_end_stream)
+        on_request_complete(id, s);
+    else if (frame_size != 0u)
+        append_window_update(control_, id, frame_size);
+    return error_code();
+}
+
+error_code http2_connection::on_settings(std::uint8_t flags, std::uint32_t id, std::string_view payload)
+{
+    if (id != 0u)
+        return connection_error(http2_error_code::protocol_error);
+    if (flags & flag_ack)
+    {
+        if (!payload.empty())
+            return connection_error(http2_error_code::frame_size_error);
+        return error_code();
+    }
+    if (payload.size() % 6u != 0u)
+        return connection_error(http2_error_code::frame_size_error);
+
+    for (std::size_t i = 0u; i < payload.size(); i += 6u)
+    {
+        auto setting_id = static_cast<std::uint16_t>(
+            (static_cast<unsigned char>(payload[i]) << 8) | static_cast<unsigned char>(payload[i + 1u])
+        );
+        std::uint32_t value = read_u32(payload.data() + i + 2u);
+        switch (setting_id)
+        {
+        case settings_header_table_size: encoder_.set_max_table_size(value); break;
+        case settings_enable_push:
+            if (value > 1u)
+                return connection_error(http2_error_code::protocol_error);
+            break;
+        case settings_initial_window_size:
+        {
+            if (value > max_window_size)
+                return connection_error(http2_error_code::flow_control_error);
+
+            // Applies retroactively to all streams
+            std::int64_t delta = std::int64_t(value) - std::int64_t(peer_initial_window_size_);
+            for (auto& s : streams_)
+            {
+                s.second.send_window += delta;
+                if (s.second.send_window > max_window_size)
+                    return connection_error(http2_error_code::flow_control_error);
+            }
+            peer_initial_window_size_ = value;
+            break;
+        }
+        case settings_max_frame_size:
+            if (value < default_max_frame_size || value > max_frame_size_limit)
+                return connection_error(http2_error_code::protocol_error);
+            peer_max_frame_size_ = value;
+            break;
+        default:
+            // Unknown settings must be ignored. We don't push, and don't limit our headers
+            break;
+        }
+    }
+
+    http2_append_frame_header(control_, 0u, frame_settings, flag_ack, 0u);
+    return error_code();
+}
+
+error_code http2_connection::on_window_update(std::uint32_t id, std::string_view payload)
+{
+    if (payload.size() != 4u)
+        return connection_error(http2_error_code::frame_size_error);
+    std::uint32_t increment = read_u32(payload.data()) & max_window_size;
+
+    if (id == 0u)
+    {
+        if (increment == 0u)
+            return connection_error(http2_error_code::protocol_error);
+        connection_send_window_ += increment;
+        if (connection_send_window_ > max_window_size)
+            return connection_error(http2_error_code::flow_control_error);
+        return error_code();
+    }
+
+    if (id > last_stream_id_)
+        return connection_error(http2_error_code::protocol_error);
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+        return error_code();  // the stream may have been closed recently
+    if (increment == 0u)
+    {
+        stream_error(id, http2_error_code::protocol_error);
+        return error_code();
+    }
+    it->second.send_window += increment;
+    if (it->second.send_window > max_window_size)
+        stream_error(id, http2_error_code::flow_control_error);
+    return error_code();
+}
+
+void http2_connection::on_request_complete(std::uint32_t id, stream& s)
+{
+    s.request_complete = true;
+    requests_.push_back(http2_request{id, std::move(s.headers), std::move(s.body)});
+    handling_.insert(id);
+}
+
+std::size_t http2_connection::num_active_streams() const noexcept
+{
+    // Resetting a stream doesn't stop its handler, so a client resetting its streams
+    // straight away could otherwise have an unbounded number of them running
+    std::size_t res = streams_.size();
+    for (auto id : handling_)
+    {
+        if (!streams_.count(id))
+            ++res;
+    }
+    return res;
+}
+
+void http2_connection::submit_response(std::uint32_t stream_id, http2_response&& response)
+{
+    handling_.erase(stream_id);
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end() || it->second.has_response)
+        return;
+    auto& s = it->second;
+    s.has_response = true;
+    s.body_size = response.file ? response.file->range().size : response.body.size();
+    s.response = std::move(response);
+    sending_.push_back(stream_id);
+}
+
+void http2_connection::reset_stream(std::uint32_t stream_id, http2_error_code code)
+{
+    handling_.erase(stream_id);
+    if (streams_.count(stream_id))
+        stream_error(stream_id, code);
+}
+
+void http2_connection::shutdown()
+{
+    if (!goaway_sent_)
+    {
+        http2_append_frame_header(control_, 8u, frame_goaway, 0u, 0u);
+        append_u32(control_, last_stream_id_);
+        append_u32(control_, static_cast<std::uint32_t>(http2_error_code::no_error));
+        goaway_sent_ = true;
+    }
+}
+
+bool http2_connection::done() const noexcept
+{
+    return (goaway_sent_ || goaway_received_) && streams_.empty() && control_.empty();
+}
+
+// Writes the headers or the next DATA frame for a stream. Returns true if the stream is finished
+bool http2_connection::write_stream_frame(std::uint32_t id, stream& s, std::string& out, std::size_t max_size)
+{
+    if (!s.headers_sent)
+    {
+        std::string block;
+        encoder_.encode(s.response.headers, block);
+        s.headers_sent = true;
+        bool end_stream = s.body_size == 0u;
+
+        // Split the block between a HEADERS frame and as many CONTINUATION frames as required
+        std::string_view remaining(block);
+        std::uint8_t type = frame_headers;
+        do
+        {
+            auto chunk = remaining.substr(0, peer_max_frame_size_);
+            remaining.remove_prefix(chunk.size());
+            std::uint8_t flags = remaining.empty() ? flag_end_headers : 0u;
+            if (type == frame_headers && end_stream)
+                flags |= flag_end_stream;
+            http2_append_frame_header(out, chunk.size(), type, flags, id);
+            out.append(chunk);
+            type = frame_continuation;
+        } while (!remaining.empty());
+
+        return end_stream;
+    }
+
+    // Send as much as flow control and the frame size allow
+    std::int64_t window = (std::min)(connection_send_window_, s.send_window);
+    std::uint64_t remaining = s.body_size - s.bytes_sent;
+    std::size_t budget = max_size > out.size() + frame_header_size ? max_size - out.size() - frame_header_size
+                                                                   : 0u;
+    std::size_t size = static_cast<std::size_t>((std::min)(
+        {static_cast<std::uint64_t>((std::max)(window, std::int64_t(0))),
+         remaining,
+         static_cast<std::uint64_t>(peer_max_frame_size_),
+         static_cast<std::uint64_t>(budget)}
+    ));
+    if (size == 0u)
+        return false;
+
+    bool end_stream = size == remaining;
+    auto header_pos = out.size();
+    http2_append_frame_header(out, size, frame_data, end_stream ? flag_end_stream : 0u, id);
+    if (s.response.file)
+    {
+        auto pos = out.size();
+        out.resize(pos + size);
+        auto offset = s.response.file->range().offset + s.bytes_sent;
+        auto fd = s.response.file->native_handle();
+        auto bytes_read = ::pread(fd, &out[pos], size, static_cast<off_t>(offset));
+        if (bytes_read != static_cast<decltype(bytes_read)>(size))
+        {
+            // The file can't be read (or was truncated while being sent)
+            out.resize(header_pos);
+            stream_error(id, http2_error_code::internal_error);
+            return true;
+        }
+    }
+    else
+    {
+        out.append(s.response.body, static_cast<std::size_t>(s.bytes_sent), size);
+    }
+
+    s.bytes_sent += size;
+    s.send_window -= static_cast<std::int64_t>(size);
+    connection_send_window_ -= static_cast<std::int64_t>(size);
+    return end_stream;
+}
+
+bool http2_connection::write_frames(std::string& out, std::size_t max_size)
+{
+    auto initial_size = out.size();
+    out.append(control_);
+    control_.clear();
+
+    // Visit each stream at most once per round, writing a frame each time.
+    // Streams blocked by flow control are kept for the next call
+    bool progress = true;
+    while (progress && out.size() < max_size)
+    {
+        progress = false;
+        for (std::size_t n = sending_.size(); n != 0u && out.size() < max_size; --n)
+        {
+            auto id = sending_.front();
+            sending_.pop_front();
+            auto it = streams_.find(id);
+            if (it == streams_.end())
+                continue;  // reset
+
+            auto size_before = out.size();
+            bool finished = write_stream_frame(id, it->second, out, max_size);
+            progress = progress || out.size() != size_before;
+            if (finished)
+                streams_.erase(id);
+            else
+                sending_.push_back(id);
+        }
+    }
+
+    // Reset streams may have queued RST_STREAM frames
+    out.append(control_);
+    control_.clear();
+
+    return out.size() != initial_size;
+}
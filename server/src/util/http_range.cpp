@@ -0,0 +1,102 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/http_range.hpp"
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+using namespace chat;
+
+// Parses a non-empty string of digits
+static std::optional<std::uint64_t> parse_number(std::string_view from)
+{
+    std::uint64_t res = 0u;
+    if (from.empty() || from.front() < '0' || from.front() > '9')
+        return std::nullopt;
+    auto r = std::from_chars(from.data(), from.data() + from.size(), res);
+    if (r.ec != std::errc() || r.ptr != from.data() + from.size())
+        return std::nullopt;
+    return res;
+}
+
+static std::string_view trim(std::string_view value) noexcept
+{
+    auto first = value.find_first_not_of(" \t");
+    if (first == std::string_view::npos)
+        return {};
+    auto last = value.find_last_not_of(" \t");
+    return value.substr(first, last - first + 1u);
+}
+
+parsed_range chat::parse_range_header(std::string_view value, std::uint64_t file_size)
+{
+    constexpr parsed_range none{parsed_range::none, {}};
+    constexpr parsed_range unsatisfiable{parsed_range::unsatisfiable, {}};
+    constexpr std::string_view prefix = "bytes=";
+
+    // We only support bytes ranges
+    value = trim(value);
+    if (value.substr(0, prefix.size()) != prefix)
+        return none;
+    value.remove_prefix(prefix.size());
+
+    // Multiple ranges require multipart responses. We don't support them
+    if (value.find(',') != std::string_view::npos)
+        return none;
+
+    // first-last, first- or -suffix_length
+    auto dash_pos = value.find('-');
+    if (dash_pos == std::string_view::npos)
+        return none;
+    auto first_str = trim(value.substr(0, dash_pos));
+    auto last_str = trim(value.substr(dash_pos + 1u));
+
+    if (first_str.empty())
+    {
+        // Suffix range: the last N bytes
+        auto suffix_length = parse_number(last_str);
+        if (!suffix_length)
+            return none;
+        if (*suffix_length == 0u || file_size == 0u)
+            return unsatisfiable;
+        auto size = *suffix_length < file_size ? *suffix_length : file_size;
+        return {parsed_range::single, {file_size - size, size}};
+    }
+
+    auto first = parse_number(first_str);
+    if (!first)
+        return none;
+    std::uint64_t last = file_size == 0u ? 0u : file_size - 1u;
+    if (!last_str.empty())
+    {
+        auto parsed_last = parse_number(last_str);
+        if (!parsed_last || *parsed_last < *first)
+            return none;
+        if (*parsed_last < last)
+            last = *parsed_last;
+    }
+
+    // The first byte must be within the file
+    if (*first >= file_size)
+        return unsatisfiable;
+    return {parsed_range::single, {*first, last - *first + 1u}};
+}
+
+std::string chat::format_content_range(byte_range range, std::uint64_t file_size)
+{
+    return "bytes " + std::to_string(range.offset) + '-' + std::to_string(range.offset + range.size - 1u) +
+           '/' + std::to_string(file_size);
+}
+
+std::string chat::format_unsatisfiable_content_range(std::uint64_t file_size)
+{
+    return "bytes */" + std::to_string(file_size);
+}
@@ -0,0 +1,198 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/log.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "util/ring_buffer.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Records longer than this are truncated
+constexpr std::size_t max_record_size = 512;
+
+// Number of records that can be pending at any given time
+constexpr std::size_t buffer_capacity = 4096;
+
+// How long the background thread sleeps when there are no records
+constexpr std::chrono::milliseconds idle_wait{5};
+
+struct log_record
+{
+    log_level level;
+    std::size_t size;
+    std::array<char, max_record_size> data;
+};
+
+struct logger_state
+{
+    ring_buffer<log_record> buffer{buffer_capacity};
+    std::atomic<bool> running{false};
+    std::atomic<int> min_level{static_cast<int>(log_level::info)};
+    std::atomic<std::uint64_t> dropped{0};
+    std::uint64_t reported_dropped{0};  // only accessed by the writer
+    std::thread writer;
+};
+
+static logger_state& get_state()
+{
+    static logger_state res;
+    return res;
+}
+
+static std::string_view level_to_string(log_level level) noexcept
+{
+    switch (level)
+    {
+    case log_level::debug: return "DEBUG";
+    case log_level::info: return "INFO";
+    case log_level::warning: return "WARNING";
+    case log_level::error: return "ERROR";
+    default: return "UNKNOWN";
+    }
+}
+
+// Appends a formatted record to output
+static void format_record(log_level level, std::string_view msg, std::string& output)
+{
+    output += '[';
+    output += level_to_string(level);
+    output += "] ";
+    output += msg;
+    output += '\n';
+}
+
+static void write_output(const std::string& output)
+{
+    std::fwrite(output.data(), 1, output.size(), stderr);
+    std::fflush(stderr);
+}
+
+// Writes all pending records, using a single write call. Returns the number of records written
+static std::size_t drain(logger_state& st, std::string& output)
+{
+    output.clear();
+    std::size_t num_records = 0;
+    while (st.buffer.try_pop([&output](log_record& rec) {
+        format_record(rec.level, std::string_view(rec.data.data(), rec.size), output);
+    }))
+    {
+        ++num_records;
+    }
+
+    // Report dropped records, if any
+    auto dropped = st.dropped.load(std::memory_order_relaxed);
+    if (dropped != st.reported_dropped)
+    {
+        auto msg = std::to_string(dropped - st.reported_dropped) + " log records dropped";
+        format_record(log_level::warning, msg, output);
+        st.reported_dropped = dropped;
+    }
+
+    if (!output.empty())
+        write_output(output);
+    return num_records;
+}
+
+static void writer_loop(logger_state& st)
+{
+    std::string output;
+    while (st.running.load(std::memory_order_acquire))
+    {
+        if (drain(st, output) == 0u)
+            std::this_thread::sleep_for(idle_wait);
+    }
+}
+
+}  // namespace
+
+std::optional<log_level> chat::parse_log_level(std::string_view name) noexcept
+{
+    if (name == "debug")
+        return log_level::debug;
+    else if (name == "info")
+        return log_level::info;
+    else if (name == "warning")
+        return log_level::warning;
+    else if (name == "error")
+        return log_level::error;
+    else
+        return std::nullopt;
+}
+
+void chat::start_logging(log_level min_level)
+{
+    auto& st = get_state();
+    st.min_level.store(static_cast<int>(min_level), std::memory_order_relaxed);
+    st.running.store(true, std::memory_order_release);
+    st.writer = std::thread([&st] { writer_loop(st); });
+}
+
+void chat::stop_logging()
+{
+    auto& st = get_state();
+    if (!st.writer.joinable())
+        return;
+    st.running.store(false, std::memory_order_release);
+    st.writer.join();
+
+    // Write any records that were enqueued after the thread's last iteration
+    std::string output;
+    drain(st, output);
+}
+
+bool chat::should_log(log_level level) noexcept
+{
+    return static_cast<int>(level) >= get_state().min_level.load(std::memory_order_relaxed);
+}
+
+void chat::log_message(log_level level, std::string_view msg) noexcept
+{
+    if (!should_log(level))
+        return;
+
+    auto& st = get_state();
+    if (!st.running.load(std::memory_order_acquire))
+    {
+        // No background thread: write synchronously
+        try
+        {
+            std::string output;
+            format_record(level, msg, output);
+            write_output(output);
+        }
+        catch (...)
+        {
+        }
+        return;
+    }
+
+    bool ok = st.buffer.try_push([level, msg](log_record& rec) {
+        rec.level = level;
+        rec.size = (std::min)(msg.size(), max_record_size);
+        std::memcpy(rec.data.data(), msg.data(), rec.size);
+    });
+    if (!ok)
+        st.dropped.fetch_add(1u, std::memory_order_relaxed);
+}
+
+std::uint64_t chat::log_dropped_count() noexcept
+{
+    return get_state().dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,371 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/metrics.hpp"
+
+#include <boost/core/bit.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace chat;
+
+static constexpr std::size_t num_counters = static_cast<std::size_t>(counter_id::num_counters);
+static constexpr std::size_t num_histograms = static_cast<std::size_t>(histogram_id::num_histograms);
+
+std::size_t latency_buckets::index(std::uint64_t value) noexcept
+{
+    value = (std::min)(value, max_value);
+    if (value < (std::uint64_t(1) << sub_bucket_bits))
+        return static_cast<std::size_t>(value);
+
+    // The top sub_bucket_bits + 1 bits of the value select the bucket
+    auto exponent = static_cast<std::size_t>(boost::core::bit_width(value)) - 1u;
+    auto shift = exponent - sub_bucket_bits;
+    return (shift << sub_bucket_bits) + static_cast<std::size_t>(value >> shift);
+}
+
+std::uint64_t latency_buckets::upper_bound(std::size_t index) noexcept
+{
+    constexpr std::size_t sub_buckets = std::size_t(1) << sub_bucket_bits;
+    if (index < sub_buckets)
+        return index;
+    auto shift = (index >> sub_bucket_bits) - 1u;
+    auto top_bits = static_cast<std::uint64_t>((index & (sub_buckets - 1u)) + sub_buckets);
+    return ((top_bits + 1u) << shift) - 1u;
+}
+
+std::uint64_t histogram_snapshot::count() const noexcept
+{
+    std::uint64_t res = 0;
+    for (auto value : buckets)
+        res += value;
+    return res;
+}
+
+std::uint64_t histogram_snapshot::quantile(double q) const noexcept
+{
+    auto total = count();
+    if (total == 0u)
+        return 0u;
+
+    // The rank of the value we're looking for, starting at 1
+    auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * static_cast<double>(total)));
+    rank = std::clamp<std::uint64_t>(rank, 1u, total);
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets.size(); ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return latency_buckets::upper_bound(i);
+    }
+    return latency_buckets::max_value;  // Not reached
+}
+
+namespace {
+
+// The metrics recorded by a single thread. Only the owning thread writes to it,
+// so increments don't need read-modify-write operations. Atomics are still
+// required because format_metrics reads them from other threads
+struct metrics_shard
+{
+    using histogram_buckets = std::array<std::atomic<std::uint64_t>, latency_buckets::num_buckets>;
+
+    std::array<std::atomic<std::uint64_t>, num_counters> counters{};
+    std::array<histogram_buckets, num_histograms> buckets{};
+    std::array<std::atomic<std::uint64_t>, num_histograms> sums{};
+};
+
+// Single-writer increment
+static void add(std::atomic<std::uint64_t>& value, std::uint64_t n) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// All the shards ever created. Shards are never destroyed, so values recorded
+// by threads that exited are still exported
+class shard_registry
+{
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<metrics_shard>> shards_;
+
+public:
+    metrics_shard& create()
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        shards_.push_back(std::make_unique<metrics_shard>());
+        return *shards_.back();
+    }
+
+    template <class Fn>
+    void for_each(Fn&& fn)
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        for (const auto& shard : shards_)
+            fn(*shard);
+    }
+};
+
+static shard_registry& registry()
+{
+    static shard_registry res;
+    return res;
+}
+
+// The shard for the calling thread. Creating it requires locking, but this only happens once per thread
+static metrics_shard& local_shard()
+{
+    thread_local metrics_shard& res = registry().create();
+    return res;
+}
+
+// Metadata to export counters
+struct counter_info
+{
+    std::string_view name;
+    std::string_view help;
+};
+
+constexpr std::array<counter_info, num_counters> counter_infos{
+    {
+     {"chat_accepted_connections_total", "TCP connections accepted"},
+     {"chat_websocket_sessions_started_total", "Authenticated websocket sessions started"},
+     {"chat_websocket_sessions_finished_total", "Websocket sessions finished"},
+     {"chat_published_messages_total", "Messages published to room subscribers"},
+     {"chat_published_user_messages_total", "Messages published to all the sessions of a user"},
+     {"chat_login_rate_limited_ip_total", "Login attempts rejected because of too many attempts from an IP"},
+     {"chat_login_rate_limited_email_total", "Login attempts rejected because of failures for an email"},
+     {"chat_login_rate_limiter_errors_total", "Errors checking login rate limits in Redis"},
+     {"chat_http2_connections_total", "Connections using HTTP/2"},
+     {"chat_http2_streams_total", "Requests received over HTTP/2"},
+     {"chat_tls_handshakes_total", "TLS handshakes completed"},
+     {"chat_tls_handshake_errors_total", "TLS handshakes that failed"},
+     {"chat_tls_sessions_resumed_total", "TLS handshakes that resumed a session"},
+     {"chat_tls_ktls_send_total", "TLS connections using kernel encryption for sending"},
+     {"chat_rejected_connections_total", "Connections rejected because of connection or memory limits"},
+     {"chat_rejected_websocket_upgrades_total", "Websocket upgrades rejected because of the memory budget"},
+     {"chat_coroutine_stacks_mapped_total", "Coroutine stacks allocated from the OS"},
+     {"chat_coroutine_stacks_reused_total", "Coroutine stacks reused from the pool"},
+     {"chat_websocket_buffers_released_total", "Websocket read buffers released after a big message"},
+     {"chat_websocket_buffer_released_bytes_total", "Memory released from websocket read buffers"},
+     {"chat_ephemeral_published_total", "Ephemeral messages published to room subscribers"},
+     {"chat_ephemeral_coalesced_total", "Ephemeral messages replaced by a more recent one"},
+     {"chat_ephemeral_rate_limited_total", "Ephemeral messages discarded by the rate limit"},
+     {"chat_ephemeral_shed_total", "Ephemeral messages not sent to busy websocket clients"},
+     {"chat_hello_rooms_delta_total", "Rooms sent to reconnecting clients as deltas"},
+     {"chat_hello_rooms_full_resync_total", "Rooms sent in full to reconnecting clients"},
+     {"chat_optimistic_ids_reassigned_total", "Optimistically broadcast messages stored with a different ID"},
+     {"chat_optimistic_messages_lost_total", "Optimistically broadcast messages that couldn't be stored"},
+     {"chat_redis_spooled_messages_total", "Messages spooled locally because Redis was unavailable"},
+     {"chat_redis_spool_replayed_total", "Spooled messages stored in Redis"},
+     {"chat_redis_spool_rejected_total", "Messages rejected because the spool was full"},
+     {"chat_redis_spool_dropped_total", "Spooled messages dropped because Redis rejected them"},
+     {"chat_redis_breaker_opened_total", "Times the Redis circuit breaker opened"},
+     {"chat_session_revocation_checks_total", "Session tokens checked in Redis for revocation"},
+     {"chat_uploads_completed_total", "Uploads whose last byte has been received"},
+     {"chat_upload_bytes_total", "Bytes of uploaded files received"},
+     {"chat_accounts_imported_total", "Accounts created through bulk imports"},
+     {"chat_broadcasts_aggregated_total", "Message batches merged into another broadcast"},
+     {"chat_messages_throttled_total", "Message batches delayed because the client sent too many messages"},
+     }
+};
+
+// Metadata to export histograms. Histograms with the same name are exported
+// as a single metric family, distinguished by the given label
+struct histogram_info
+{
+    std::string_view name;
+    std::string_view help;
+    std::string_view label_value;  // the "op" label. Empty for no label
+    std::string_view span_name;    // for latency_timer spans
+};
+
+constexpr std::string_view redis_name = "chat_redis_latency_seconds";
+constexpr std::string_view redis_help = "Redis operation latency";
+constexpr std::string_view mysql_name = "chat_mysql_latency_seconds";
+constexpr std::string_view mysql_help = "MySQL operation latency";
+
+constexpr std::array<histogram_info, num_histograms> histogram_infos{
+    {
+     {"chat_publish_fanout_seconds",
+      "Time to deliver a message to the subscribers in a thread",
+      "",
+      "pubsub.fanout"},
+     {"chat_websocket_write_seconds", "Time to write a message to a websocket client", "", "websocket.write"},
+     {"chat_websocket_lock_wait_seconds",
+      "Time spent waiting for other writers of a websocket",
+      "",
+      "websocket.lock_wait"},
+     {"chat_hello_build_seconds", "Time to retrieve and serialize a hello event", "", "hello.build"},
+     {"chat_scrypt_queue_seconds", "Time spent waiting for a password hashing thread", "", "scrypt.queue"},
+     {redis_name, redis_help, "get_room_history", "redis.get_room_history"},
+     {redis_name, redis_help, "get_room_history_nodes", "redis.get_room_history_nodes"},
+     {redis_name, redis_help, "store_messages", "redis.store_messages"},
+     {redis_name, redis_help, "store_messages_with_ids", "redis.store_messages_with_ids"},
+     {redis_name, redis_help, "get_oldest_messages", "redis.get_oldest_messages"},
+     {redis_name, redis_help, "trim_messages", "redis.trim_messages"},
+     {redis_name, redis_help, "set_nonexisting_key", "redis.set_nonexisting_key"},
+     {redis_name, redis_help, "get_int_key", "redis.get_int_key"},
+     {redis_name, redis_help, "delete_key", "redis.delete_key"},
+     {redis_name, redis_help, "take_tokens", "redis.take_tokens"},
+     {redis_name, redis_help, "add_to_expiring_set", "redis.add_to_expiring_set"},
+     {redis_name, redis_help, "get_expiring_set", "redis.get_expiring_set"},
+     {redis_name, redis_help, "expiring_set_contains", "redis.expiring_set_contains"},
+     {mysql_name, mysql_help, "create_user", "mysql.create_user"},
+     {mysql_name, mysql_help, "create_users", "mysql.create_users"},
+     {mysql_name, mysql_help, "get_user_by_email", "mysql.get_user_by_email"},
+     {mysql_name, mysql_help, "update_password", "mysql.update_password"},
+     {mysql_name, mysql_help, "get_user_by_id", "mysql.get_user_by_id"},
+     {mysql_name, mysql_help, "get_usernames", "mysql.get_usernames"},
+     {mysql_name, mysql_help, "get_rooms", "mysql.get_rooms"},
+     {mysql_name, mysql_help, "get_user_rooms", "mysql.get_user_rooms"},
+     {mysql_name, mysql_help, "join_room", "mysql.join_room"},
+     {mysql_name, mysql_help, "archive_messages", "mysql.archive_messages"},
+     {mysql_name, mysql_help, "get_archived_messages", "mysql.get_archived_messages"},
+     }
+};
+
+// The quantiles exported for each histogram
+struct quantile_info
+{
+    std::string_view label;
+    double value;
+};
+constexpr std::array<quantile_info, 4> exported_quantiles{
+    {{"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}}
+};
+
+// Writes the labels for a histogram sample. quantile may be empty
+static void write_labels(std::ostream& os, std::string_view op, std::string_view quantile)
+{
+    if (op.empty() && quantile.empty())
+        return;
+    os << '{';
+    if (!op.empty())
+        os << "op=\"" << op << '"';
+    if (!op.empty() && !quantile.empty())
+        os << ',';
+    if (!quantile.empty())
+        os << "quantile=\"" << quantile << '"';
+    os << '}';
+}
+
+// Writes a value in nanoseconds as seconds
+static void write_seconds(std::ostream& os, std::uint64_t ns)
+{
+    os << static_cast<double>(ns) / 1e9;
+}
+
+}  // namespace
+
+void chat::increment_counter(counter_id id, std::uint64_t n) noexcept
+{
+    add(local_shard().counters[static_cast<std::size_t>(id)], n);
+}
+
+void chat::record_latency(histogram_id id, std::chrono::nanoseconds value) noexcept
+{
+    auto ns = static_cast<std::uint64_t>((std::max)(value.count(), std::chrono::nanoseconds::rep(0)));
+    auto& shard = local_shard();
+    auto idx = static_cast<std::size_t>(id);
+    add(shard.buckets[idx][latency_buckets::index(ns)], 1u);
+    add(shard.sums[idx], ns);
+}
+
+std::uint64_t chat::get_counter(counter_id id)
+{
+    std::uint64_t res = 0;
+    registry().for_each([&res, id](const metrics_shard& shard) {
+        res += shard.counters[static_cast<std::size_t>(id)].load(std::memory_order_relaxed);
+    });
+    return res;
+}
+
+histogram_snapshot chat::get_histogram(histogram_id id)
+{
+    histogram_snapshot res;
+    auto idx = static_cast<std::size_t>(id);
+    registry().for_each([&res, idx](const metrics_shard& shard) {
+        for (std::size_t i = 0; i < latency_buckets::num_buckets; ++i)
+            res.buckets[i] += shard.buckets[idx][i].load(std::memory_order_relaxed);
+        res.sum_ns += shard.sums[idx].load(std::memory_order_relaxed);
+    });
+    return res;
+}
+
+std::string_view chat::histogram_span_name(histogram_id id) noexcept
+{
+    return histogram_infos[static_cast<std::size_t>(id)].span_name;
+}
+
+std::string chat::format_metrics()
+{
+    std::ostringstream os;
+    os.precision(9);
+
+    // Counters
+    for (std::size_t i = 0; i < num_counters; ++i)
+    {
+        const auto& info = counter_infos[i];
+        os << "# HELP " << info.name << ' ' << info.help << '\n';
+        os << "# TYPE " << info.name << " counter\n";
+        os << info.name << ' ' << get_counter(static_cast<counter_id>(i)) << '\n';
+    }
+
+    // Gauges derived from counters
+    auto sessions_started = get_counter(counter_id::websocket_sessions_started);
+    auto sessions_finished = get_counter(counter_id::websocket_sessions_finished);
+    os << "# HELP chat_websocket_sessions Websocket sessions currently running\n";
+    os << "# TYPE chat_websocket_sessions gauge\n";
+    os << "chat_websocket_sessions " << (sessions_started - (std::min)(sessions_started, sessions_finished))
+       << '\n';
+
+    // Histograms. Entries in the same family are contiguous
+    std::string_view current_family;
+    for (std::size_t i = 0; i < num_histograms; ++i)
+    {
+        const auto& info = histogram_infos[i];
+        if (info.name != current_family)
+        {
+            os << "# HELP " << info.name << ' ' << info.help << '\n';
+            os << "# TYPE " << info.name << " summary\n";
+            current_family = info.name;
+        }
+
+        auto snapshot = get_histogram(static_cast<histogram_id>(i));
+        for (auto q : exported_quantiles)
+        {
+            os << info.name;
+            write_labels(os, info.label_value, q.label);
+            os << ' ';
+            write_seconds(os, snapshot.quantile(q.value));
+            os << '\n';
+        }
+        os << info.name << "_sum";
+        write_labels(os, info.label_value, "");
+        os << ' ';
+        write_seconds(os, snapshot.sum_ns);
+        os << '\n';
+        os << info.name << "_count";
+        write_labels(os, info.label_value, "");
+        os << ' ' << snapshot.count() << '\n';
+    }
+
+    return os.str();
+}
@@ -0,0 +1,402 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/msgpack.hpp"
+
+#include <boost/json/array.hpp>
+#include <boost/json/monotonic_resource.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/parse.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/json/string.hpp>
+#include <boost/json/value.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+
+using namespace chat;
+
+// Nesting limit when decoding. Client events are only a few levels deep.
+// This is also the default limit used by Boost.JSON when parsing
+static constexpr std::size_t max_depth = 32u;
+
+//
+// Encoding
+//
+
+// Appends value in big-endian order, using num_bytes bytes
+static void append_be(std::string& output, std::uint64_t value, std::size_t num_bytes)
+{
+    for (std::size_t i = num_bytes; i > 0u; --i)
+        output.push_back(static_cast<char>(value >> (8u * (i - 1u))));
+}
+
+// Appends a type tag followed by a big-endian value
+static void append_tagged(std::string& output, unsigned char tag, std::uint64_t value, std::size_t num_bytes)
+{
+    output.push_back(static_cast<char>(tag));
+    append_be(output, value, num_bytes);
+}
+
+static void append_uint(std::string& output, std::uint64_t value)
+{
+    if (value <= 0x7fu)
+        output.push_back(static_cast<char>(value));  // positive fixint
+    else if (value <= 0xffu)
+        append_tagged(output, 0xcc, value, 1u);
+    else if (value <= 0xffffu)
+        append_tagged(output, 0xcd, value, 2u);
+    else if (value <= 0xffffffffu)
+        append_tagged(output, 0xce, value, 4u);
+    else
+        append_tagged(output, 0xcf, value, 8u);
+}
+
+static void append_int(std::string& output, std::int64_t value)
+{
+    if (value >= 0)
+        append_uint(output, static_cast<std::uint64_t>(value));
+    else if (value >= -32)
+        output.push_back(static_cast<char>(value));  // negative fixint
+    else if (value >= (std::numeric_limits<std::int8_t>::min)())
+        append_tagged(output, 0xd0, static_cast<std::uint64_t>(value), 1u);
+    else if (value >= (std::numeric_limits<std::int16_t>::min)())
+        append_tagged(output, 0xd1, static_cast<std::uint64_t>(value), 2u);
+    else if (value >= (std::numeric_limits<std::int32_t>::min)())
+        append_tagged(output, 0xd2, static_cast<std::uint64_t>(value), 4u);
+    else
+        append_tagged(output, 0xd3, static_cast<std::uint64_t>(value), 8u);
+}
+
+static void append_double(std::string& output, double value)
+{
+    std::uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    append_tagged(output, 0xcb, bits, 8u);
+}
+
+static void append_string(std::string& output, std::string_view value)
+{
+    auto size = value.size();
+    if (size <= 31u)
+        output.push_back(static_cast<char>(0xa0u | size));  // fixstr
+    else if (size <= 0xffu)
+        append_tagged(output, 0xd9, size, 1u);
+    else if (size <= 0xffffu)
+        append_tagged(output, 0xda, size, 2u);
+    else
+        append_tagged(output, 0xdb, size, 4u);
+    output += value;
+}
+
+static void append_map_header(std::string& output, std::size_t size)
+{
+    if (size <= 15u)
+        output.push_back(static_cast<char>(0x80u | size));  // fixmap
+    else if (size <= 0xffffu)
+        append_tagged(output, 0xde, size, 2u);
+    else
+        append_tagged(output, 0xdf, size, 4u);
+}
+
+std::size_t chat::write_msgpack_array_header(unsigned char* buff, std::size_t num_elements) noexcept
+{
+    if (num_elements <= 15u)
+    {
+        buff[0] = static_cast<unsigned char>(0x90u | num_elements);  // fixarray
+        return 1u;
+    }
+    else if (num_elements <= 0xffffu)
+    {
+        buff[0] = 0xdc;
+        buff[1] = static_cast<unsigned char>(num_elements >> 8);
+        buff[2] = static_cast<unsigned char>(num_elements);
+        return 3u;
+    }
+    else
+    {
+        buff[0] = 0xdd;
+        for (std::size_t i = 0; i < 4u; ++i)
+            buff[1u + i] = static_cast<unsigned char>(num_elements >> (24u - 8u * i));
+        return 5u;
+    }
+}
+
+static void append_array_header(std::string& output, std::size_t size)
+{
+    unsigned char header[max_msgpack_array_header_size]{};
+    output.append(reinterpret_cast<const char*>(header), write_msgpack_array_header(header, size));
+}
+
+static void append_value(std::string& output, const boost::json::value& value)
+{
+    switch (value.kind())
+    {
+    case boost::json::kind::null: output.push_back(static_cast<char>(0xc0)); break;
+    case boost::json::kind::bool_: output.push_back(static_cast<char>(value.get_bool() ? 0xc3 : 0xc2)); break;
+    case boost::json::kind::int64: append_int(output, value.get_int64()); break;
+    case boost::json::kind::uint64: append_uint(output, value.get_uint64()); break;
+    case boost::json::kind::double_: append_double(output, value.get_double()); break;
+    case boost::json::kind::string: append_string(output, value.get_string()); break;
+    case boost::json::kind::array:
+        append_array_header(output, value.get_array().size());
+        for (const auto& elm : value.get_array())
+            append_value(output, elm);
+        break;
+    case boost::json::kind::object:
+        append_map_header(output, value.get_object().size());
+        for (const auto& elm : value.get_object())
+        {
+            append_string(output, elm.key());
+            append_value(output, elm.value());
+        }
+        break;
+    }
+}
+
+result<std::string> chat::json_to_msgpack(std::string_view json)
+{
+    // Parse the document. Most events fit in the initial buffer
+    unsigned char buff[4096];
+    boost::json::monotonic_resource mr(buff, sizeof(buff));
+    error_code ec;
+    auto doc = boost::json::parse(json, ec, &mr);
+    if (ec)
+        return ec;
+
+    // MessagePack is more compact than JSON, so this usually avoids reallocations
+    std::string res;
+    res.reserve(json.size());
+    append_value(res, doc);
+    return res;
+}
+
+//
+// Decoding
+//
+
+namespace {
+
+class msgpack_decoder
+{
+    const unsigned char* it_;
+    const unsigned char* end_;
+    boost::json::storage_ptr sp_;
+
+    std::size_t remaining() const noexcept { return static_cast<std::size_t>(end_ - it_); }
+
+    // Reads a big-endian unsigned integer of num_bytes bytes
+    bool read_be(std::size_t num_bytes, std::uint64_t& to) noexcept
+    {
+        if (remaining() < num_bytes)
+            return false;
+        to = 0u;
+        for (std::size_t i = 0; i < num_bytes; ++i)
+            to = (to << 8) | *it_++;
+        return true;
+    }
+
+    // Reads a signed integer of sizeof(IntType) bytes, in two's complement
+    template <class IntType>
+    bool read_signed(boost::json::value& to) noexcept
+    {
+        std::uint64_t raw = 0;
+        if (!read_be(sizeof(IntType), raw))
+            return false;
+        to = static_cast<std::int64_t>(static_cast<IntType>(raw));
+        return true;
+    }
+
+    bool read_string_contents(std::size_t size, std::string_view& to) noexcept
+    {
+        if (remaining() < size)
+            return false;
+        to = std::string_view(reinterpret_cast<const char*>(it_), size);
+        it_ += size;
+        return true;
+    }
+
+    // Reads a string, including its type tag. Used for map keys
+    bool read_string(std::string_view& to) noexcept
+    {
+        if (remaining() == 0u)
+            return false;
+        unsigned char tag = *it_++;
+        std::uint64_t size = 0;
+        if ((tag & 0xe0u) == 0xa0u)
+            size = tag & 0x1fu;
+        else if (tag == 0xd9)
+            return read_be(1u, size) && read_string_contents(size, to);
+        else if (tag == 0xda)
+            return read_be(2u, size) && read_string_contents(size, to);
+        else if (tag == 0xdb)
+            return read_be(4u, size) && read_string_contents(size, to);
+        else
+            return false;
+        return read_string_contents(size, to);
+    }
+
+    bool read_array(std::uint64_t size, std::size_t depth, boost::json::value& to)
+    {
+        // Each element takes at least one byte. This prevents huge reservations
+        if (size > remaining())
+            return false;
+        auto& arr = to.emplace_array();
+        arr.reserve(size);
+        for (std::uint64_t i = 0; i < size; ++i)
+        {
+            if (!read_value(depth + 1u, arr.emplace_back(nullptr)))
+                return false;
+        }
+        return true;
+    }
+
+    bool read_map(std::uint64_t size, std::size_t depth, boost::json::value& to)
+    {
+        // Each entry takes at least two bytes
+        if (size > remaining() / 2u)
+            return false;
+        auto& obj = to.emplace_object();
+        obj.reserve(size);
+        for (std::uint64_t i = 0; i < size; ++i)
+        {
+            std::string_view key;
+            if (!read_string(key))
+                return false;
+            if (!read_value(depth + 1u, obj[key]))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    msgpack_decoder(std::string_view data, boost::json::storage_ptr sp) noexcept
+        : it_(reinterpret_cast<const unsigned char*>(data.data())),
+          end_(it_ + data.size()),
+          sp_(std::move(sp))
+    {
+    }
+
+    bool done() const noexcept { return it_ == end_; }
+
+    bool read_value(std::size_t depth, boost::json::value& to)
+    {
+        if (depth > max_depth || remaining() == 0u)
+            return false;
+
+        unsigned char tag = *it_++;
+        std::uint64_t size = 0;
+        std::string_view str;
+
+        // Types that embed their value or size in the tag
+        if (tag <= 0x7fu)
+        {
+            to = static_cast<std::int64_t>(tag);
+            return true;
+        }
+        else if (tag >= 0xe0u)
+        {
+            to = static_cast<std::int64_t>(static_cast<std::int8_t>(tag));
+            return true;
+        }
+        else if (tag <= 0x8fu)
+        {
+            return read_map(tag & 0x0fu, depth, to);
+        }
+        else if (tag <= 0x9fu)
+        {
+            return read_array(tag & 0x0fu, depth, to);
+        }
+        else if (tag <= 0xbfu)
+        {
+            if (!read_string_contents(tag & 0x1fu, str))
+                return false;
+            to = boost::json::string(str, sp_);
+            return true;
+        }
+
+        switch (tag)
+        {
+        case 0xc0: to = nullptr; return true;
+        case 0xc2: to = false; return true;
+        case 0xc3: to = true; return true;
+        case 0xca:
+        {
+            std::uint64_t raw = 0;
+            if (!read_be(4u, raw))
+                return false;
+            auto bits = static_cast<std::uint32_t>(raw);
+            float value = 0.0f;
+            std::memcpy(&value, &bits, sizeof(value));
+            to = static_cast<double>(value);
+            return true;
+        }
+        case 0xcb:
+        {
+            std::uint64_t bits = 0;
+            if (!read_be(8u, bits))
+                return false;
+            double value = 0.0;
+            std::memcpy(&value, &bits, sizeof(value));
+            to = value;
+            return true;
+        }
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+        {
+            std::uint64_t value = 0;
+            if (!read_be(std::size_t(1u) << (tag - 0xccu), value))
+                return false;
+            if (value <= static_cast<std::uint64_t>((std::numeric_limits<std::int64_t>::max)()))
+                to = static_cast<std::int64_t>(value);
+            else
+                to = value;
+            return true;
+        }
+        case 0xd0: return read_signed<std::int8_t>(to);
+        case 0xd1: return read_signed<std::int16_t>(to);
+        case 0xd2: return read_signed<std::int32_t>(to);
+        case 0xd3: return read_signed<std::int64_t>(to);
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            if (!read_be(std::size_t(1u) << (tag - 0xd9u), size) || !read_string_contents(size, str))
+                return false;
+            to = boost::json::string(str, sp_);
+            return true;
+        case 0xdc: return read_be(2u, size) && read_array(size, depth, to);
+        case 0xdd: return read_be(4u, size) && read_array(size, depth, to);
+        case 0xde: return read_be(2u, size) && read_map(size, depth, to);
+        case 0xdf: return read_be(4u, size) && read_map(size, depth, to);
+        default: return false;  // bin, ext or the never used 0xc1
+        }
+    }
+};
+
+}  // namespace
+
+result<std::string> chat::msgpack_to_json(std::string_view data)
+{
+    // Client events are small, and usually fit in the initial buffer
+    unsigned char buff[2048];
+    boost::json::monotonic_resource mr(buff, sizeof(buff));
+    boost::json::storage_ptr sp(&mr);
+
+    msgpack_decoder decoder(data, sp);
+    boost::json::value doc(sp);
+    if (!decoder.read_value(0u, doc) || !decoder.done())
+        CHAT_RETURN_ERROR(errc::websocket_parse_error)
+    return boost::json::serialize(doc);
+}
@@ -8,17 +8,18 @@
 #include "util/password_hash.hpp"
 
 #include <openssl/rand.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <stdexcept>
 
 #include "util/scrypt.hpp"
 
 using namespace chat;
 
-std::string chat::hash_password(std::string_view passwd)
+std::string chat::hash_password(std::string_view passwd, scrypt_params params)
 {
-    // Default params
-    constexpr scrypt_params params{};
-
     // Generate the salt. We use the private random generator because these hashes
     // are never exposed to the user
     std::array<unsigned char, salt_size> salt{};
@@ -33,14 +34,26 @@ std::string chat::hash_password(std::string_view passwd)
     return scrypt_phc_serialize(params, salt, hash);
 }
 
-bool chat::verify_password(std::string_view passwd, std::string_view hashed_passwd)
+// Whether a hash created with stored is weaker than one created with current
+static bool is_weaker(const scrypt_data& stored, const scrypt_params& current) noexcept
+{
+    return stored.params.ln < current.ln || stored.params.r < current.r || stored.params.p < current.p ||
+           stored.salt.size() < salt_size || stored.hash.size() < hash_size;
+}
+
+// Verifies a password. If current_params is not null, rehashes it if required
+static password_check_result check_password(
+    std::string_view passwd,
+    std::string_view hashed_passwd,
+    const scrypt_params* current_params
+)
 {
     // Deserialize the hashed password
     auto data_result = scrypt_phc_parse(hashed_passwd);
     if (data_result.has_error())
     {
         log_error(data_result.error(), "verify_password: malformed hash");
-        return false;
+        return {false, {}};
     }
     const auto& stored_data = data_result.value();
 
@@ -48,5 +61,61 @@ bool chat::verify_password(std::string_view passwd, std::string_view hashed_pass
     auto incoming_hash = scrypt_generate_hash(passwd, stored_data.params, stored_data.salt);
 
     // Compare passwords
-    return time_safe_equals(stored_data.hash, incoming_hash);
-}
\ No newline at end of file
+    if (!time_safe_equals(stored_data.hash, incoming_hash))
+        return {false, {}};
+
+    // If the hash is weaker than the current params require, generate a new one. We can only do this
+    // after a successful login, when we know the plaintext password
+    bool rehash = current_params != nullptr && is_weaker(stored_data, *current_params);
+    return {true, rehash ? hash_password(passwd, *current_params) : std::string()};
+}
+
+bool chat::verify_password(std::string_view passwd, std::string_view hashed_passwd)
+{
+    return check_password(passwd, hashed_passwd, nullptr).matches;
+}
+
+password_check_result chat::verify_password(
+    std::string_view passwd,
+    std::string_view hashed_passwd,
+    scrypt_params current_params
+)
+{
+    return check_password(passwd, hashed_passwd, &current_params);
+}
+
+// Hashes a password with the given params, returning the time it took.
+// Takes the best of two runs, to reduce noise
+static std::chrono::steady_clock::duration measure_hash(scrypt_params params)
+{
+    constexpr unsigned char salt[salt_size]{};
+    auto res = std::chrono::steady_clock::duration::max();
+    for (int i = 0; i < 2; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        scrypt_generate_hash("calibration-password", params, salt);
+        res = (std::min)(res, std::chrono::steady_clock::now() - start);
+    }
+    return res;
+}
+
+scrypt_params chat::calibrate_scrypt_params(std::chrono::milliseconds target, std::size_t max_memory)
+{
+    max_memory = (std::min)(max_memory, scrypt_max_memory);
+    scrypt_params res{default_ln, default_r, default_p};
+
+    // Each increment in ln doubles both the time and the memory required to hash
+    // a password. Stop when the next one would exceed the time or memory budget.
+    // The defaults are used even if they exceed the budget, since that's what we'd use without calibrating
+    while (true)
+    {
+        scrypt_params next{res.ln + 1u, res.r, res.p};
+        if (scrypt_memory_size(next) > max_memory)
+            break;
+        if (measure_hash(res) * 2 > target)
+            break;
+        res = next;
+    }
+
+    return res;
+}
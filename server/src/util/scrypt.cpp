@@ -157,8 +157,6 @@ std::array<unsigned char, hash_size> chat::scrypt_generate_hash(
     boost::span<const unsigned char> salt
 )
 {
-    constexpr std::size_t max_memory = 32 << 20;  // 32MiB
-
     std::array<unsigned char, hash_size> res{};
 
     int ec = EVP_PBE_scrypt(
@@ -166,10 +164,10 @@ std::array<unsigned char, hash_size> chat::scrypt_generate_hash(
         passwd.size(),
         salt.data(),
         salt.size(),
-        1 << params.ln,  // base 2 log
+        std::uint64_t(1) << params.ln,  // base 2 log
         params.r,
         params.p,
-        max_memory,
+        scrypt_max_memory,
         res.data(),
         res.size()
     );
@@ -0,0 +1,192 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/sendfile.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/cancel_after.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/system/system_category.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef BOOST_ASIO_HAS_IO_URING
+#include <boost/asio/random_access_file.hpp>
+#endif
+
+#include "error.hpp"
+#include "util/client_socket.hpp"
+
+using namespace chat;
+
+file_transfer::~file_transfer()
+{
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+static error_code send_file_chunked(
+    client_socket& sock,
+    const file_transfer& file,
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+)
+{
+    // Portable fallback, also used when OpenSSL encrypts the data: read the file in chunks
+    // and write them to the socket.
+    // Coroutine stacks are small, so the buffer is allocated in the heap
+    constexpr std::size_t chunk_size = 64u * 1024u;
+    std::vector<char> buff(chunk_size);
+
+    error_code ec;
+
+#ifdef BOOST_ASIO_HAS_IO_URING
+    // With io_uring, file reads are asynchronous, too, so a slow disk doesn't block the event loop.
+    // The file object closes its descriptor, so it gets a copy of ours
+    int fd = ::dup(file.native_handle());
+    if (fd < 0)
+        return error_code(errno, boost::system::system_category());
+    boost::asio::random_access_file async_file(sock.get_executor());
+    async_file.assign(fd, ec);
+    if (ec)
+    {
+        ::close(fd);
+        return ec;
+    }
+#endif
+
+    auto offset = static_cast<off_t>(file.range().offset);
+    auto remaining = file.range().size;
+    while (remaining > 0u)
+    {
+        auto to_read = static_cast<std::size_t>((std::min)(remaining, std::uint64_t(chunk_size)));
+#ifdef BOOST_ASIO_HAS_IO_URING
+        auto bytes_read = static_cast<ssize_t>(async_file.async_read_some_at(
+            static_cast<std::uint64_t>(offset),
+            boost::asio::buffer(buff.data(), to_read),
+            yield[ec]
+        ));
+        if (ec)
+            return ec;  // including eof, if the file was truncated
+#else
+        ssize_t bytes_read = ::pread(file.native_handle(), buff.data(), to_read, offset);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+            return error_code(errno, boost::system::system_category());
+        if (bytes_read == 0)
+            return boost::asio::error::eof;
+#endif
+
+        boost::asio::async_write(
+            sock,
+            boost::asio::buffer(buff.data(), static_cast<std::size_t>(bytes_read)),
+            boost::asio::cancel_after(timeout, yield[ec])
+        );
+        if (ec)
+            return ec;
+        offset += bytes_read;
+        remaining -= static_cast<std::uint64_t>(bytes_read);
+    }
+
+    return {};
+}
+
+#ifdef __linux__
+
+// Sends the file using sendfile. Only valid for plaintext connections, or if the kernel encrypts the data
+static error_code send_file_kernel(
+    boost::asio::ip::tcp::socket& sock,
+    const file_transfer& file,
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+)
+{
+    // Limit the amount of data sent in a single call, so a fast client
+    // can't monopolize the thread
+    constexpr std::size_t max_chunk_size = 1024u * 1024u;
+
+    error_code ec;
+
+    // sendfile must not block the event loop
+    sock.native_non_blocking(true, ec);
+    if (ec)
+        return ec;
+
+    auto offset = static_cast<off_t>(file.range().offset);
+    auto remaining = file.range().size;
+    while (remaining > 0u)
+    {
+        auto chunk_size = static_cast<std::size_t>((std::min)(remaining, std::uint64_t(max_chunk_size)));
+        ssize_t bytes_sent = ::sendfile(sock.native_handle(), file.native_handle(), &offset, chunk_size);
+        if (bytes_sent > 0)
+        {
+            remaining -= static_cast<std::uint64_t>(bytes_sent);
+
+            // Give other coroutines a chance to run
+            if (remaining > 0u && static_cast<std::size_t>(bytes_sent) == chunk_size)
+            {
+                boost::asio::post(yield[ec]);
+                if (ec)
+                    return ec;
+            }
+        }
+        else if (bytes_sent == 0)
+        {
+            // The file was truncated after we computed its size
+            return boost::asio::error::eof;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            // The socket buffer is full. Wait until the client reads some data
+            sock.async_wait(
+                boost::asio::ip::tcp::socket::wait_write,
+                boost::asio::cancel_after(timeout, yield[ec])
+            );
+            if (ec)
+                return ec;
+        }
+        else if (errno != EINTR)
+        {
+            return error_code(errno, boost::system::system_category());
+        }
+    }
+
+    return {};
+}
+
+#endif
+
+error_code chat::async_send_file(
+    client_socket& sock,
+    const file_transfer& file,
+    std::chrono::steady_clock::duration timeout,
+    boost::asio::yield_context yield
+)
+{
+#ifdef __linux__
+    if (!sock.is_tls() || sock.ktls_send())
+        return send_file_kernel(sock.socket(), file, timeout, yield);
+#endif
+    return send_file_chunked(sock, file, timeout, yield);
+}
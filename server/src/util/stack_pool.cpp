@@ -0,0 +1,165 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/stack_pool.hpp"
+
+#include <boost/context/stack_context.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "util/admission_controller.hpp"
+#include "util/env.hpp"
+#include "util/metrics.hpp"
+
+using namespace chat;
+
+namespace {
+
+std::size_t page_size() noexcept
+{
+    static const auto res = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    return res;
+}
+
+// The maximum number of free stacks kept by each thread, for each size class.
+// Stacks beyond this are unmapped, so a connection burst doesn't pin memory forever
+std::size_t max_pooled_stacks()
+{
+    static const std::size_t res = get_env_size("STACK_POOL_MAX_SIZE", 1024u);
+    return res;
+}
+
+// The free stacks of a certain size
+struct free_list
+{
+    std::size_t size;
+    std::vector<void*> stacks;
+};
+
+// All the free stacks of a thread. There are only a couple of size classes,
+// so a linear search is the fastest option
+class stack_pool
+{
+    std::vector<free_list> lists_;
+
+public:
+    stack_pool() = default;
+    stack_pool(const stack_pool&) = delete;
+    stack_pool& operator=(const stack_pool&) = delete;
+    ~stack_pool()
+    {
+        for (auto& list : lists_)
+        {
+            for (void* stack : list.stacks)
+                ::munmap(stack, list.size);
+        }
+    }
+
+    free_list& get(std::size_t size)
+    {
+        auto it = std::find_if(lists_.begin(), lists_.end(), [size](const free_list& l) {
+            return l.size == size;
+        });
+        if (it != lists_.end())
+            return *it;
+        lists_.push_back({size, {}});
+        return lists_.back();
+    }
+
+    std::size_t num_stacks() const noexcept
+    {
+        std::size_t res = 0u;
+        for (const auto& list : lists_)
+            res += list.stacks.size();
+        return res;
+    }
+};
+
+thread_local stack_pool thread_pool;
+
+}  // namespace
+
+pooled_stack_allocator::pooled_stack_allocator(std::size_t size) noexcept
+{
+    // Round up to the page size, and add a guard page
+    auto pg = page_size();
+    size_ = ((size + pg - 1u) / pg + 1u) * pg;
+}
+
+boost::context::stack_context pooled_stack_allocator::allocate()
+{
+    auto& list = thread_pool.get(size_);
+    void* vp = nullptr;
+    if (!list.stacks.empty())
+    {
+        vp = list.stacks.back();
+        list.stacks.pop_back();
+        increment_counter(counter_id::coroutine_stacks_reused);
+    }
+    else
+    {
+        vp = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (vp == MAP_FAILED)
+            throw std::bad_alloc();
+
+        // The lowest page is the guard page. Overflowing the stack crashes the program,
+        // rather than corrupting memory. This splits the mapping in two, and may fail when
+        // the process reaches its maximum number of mappings (vm.max_map_count)
+        if (::mprotect(vp, page_size(), PROT_NONE) != 0)
+        {
+            ::munmap(vp, size_);
+            throw std::bad_alloc();
+        }
+        increment_counter(counter_id::coroutine_stacks_mapped);
+    }
+
+    // Stacks grow downwards
+    boost::context::stack_context sctx;
+    sctx.size = size_;
+    sctx.sp = static_cast<char*>(vp) + size_;
+    return sctx;
+}
+
+void pooled_stack_allocator::deallocate(boost::context::stack_context& sctx) noexcept
+{
+    assert(sctx.sp != nullptr);
+    void* vp = static_cast<char*>(sctx.sp) - sctx.size;
+    try
+    {
+        auto& list = thread_pool.get(sctx.size);
+        if (list.stacks.size() < max_pooled_stacks())
+        {
+            list.stacks.push_back(vp);
+            return;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        // Couldn't grow the pool. Unmap the stack, then
+    }
+    ::munmap(vp, sctx.size);
+}
+
+pooled_stack_allocator chat::session_stack_allocator()
+{
+    return pooled_stack_allocator(get_admission_config().session_stack_size);
+}
+
+pooled_stack_allocator chat::task_stack_allocator()
+{
+    static const std::size_t size = (std::max)(get_env_size("TASK_STACK_SIZE_KB", 64u), std::size_t(16u)) *
+                                    1024u;
+    return pooled_stack_allocator(size);
+}
+
+std::size_t chat::num_pooled_stacks() noexcept { return thread_pool.num_stacks(); }
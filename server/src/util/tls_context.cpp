@@ -0,0 +1,159 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/tls_context.hpp"
+
+#include <boost/asio/ssl/error.hpp>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <array>
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "error.hpp"
+#include "util/env.hpp"
+
+using namespace chat;
+
+// Session ticket keys are a 16 byte name, a 32 byte HMAC secret and a 32 byte AES key, which is
+// what SSL_CTX_set_tlsext_ticket_keys expects. This is the 80 byte format of nginx's ssl_session_ticket_key
+static constexpr std::size_t ticket_key_size = 80u;
+
+tls_config chat::get_tls_config()
+{
+    tls_config res;
+    res.cert_file = get_env_string("TLS_CERT_FILE", "");
+    res.key_file = get_env_string("TLS_KEY_FILE", res.cert_file);
+    res.ticket_key_file = get_env_string("TLS_TICKET_KEY_FILE", "");
+    res.session_cache_size = get_env_size("TLS_SESSION_CACHE_SIZE", res.session_cache_size);
+    res.session_timeout = get_env_size("TLS_SESSION_TIMEOUT", res.session_timeout);
+    res.ktls = get_env_bool("TLS_KTLS", res.ktls);
+    return res;
+}
+
+void tls_context::ctx_deleter::operator()(ssl_ctx_st* ctx) const noexcept { SSL_CTX_free(ctx); }
+
+tls_context::tls_context(ssl_ctx_st* ctx, std::string alpn)
+    : ctx_(ctx), alpn_(std::make_unique<std::string>(std::move(alpn)))
+{
+}
+
+// Builds an error from the last OpenSSL error, clearing the error queue
+static error_with_message make_ssl_error(std::string msg)
+{
+    unsigned long code = ERR_peek_error();
+    std::array<char, 256> reason{};
+    ERR_error_string_n(code, reason.data(), reason.size());
+    ERR_clear_error();
+    msg += ": ";
+    msg += reason.data();
+    return {error_code(static_cast<int>(code), boost::asio::error::get_ssl_category()), std::move(msg)};
+}
+
+// Selects the first protocol in our list that the client supports
+static int select_alpn(
+    SSL*,
+    const unsigned char** out,
+    unsigned char* outlen,
+    const unsigned char* in,
+    unsigned int inlen,
+    void* arg
+)
+{
+    const auto& protos = *static_cast<const std::string*>(arg);
+    unsigned char* selected = nullptr;
+    int res = SSL_select_next_proto(
+        &selected,
+        outlen,
+        reinterpret_cast<const unsigned char*>(protos.data()),
+        static_cast<unsigned int>(protos.size()),
+        in,
+        inlen
+    );
+    if (res != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+result_with_message<tls_context> tls_context::create(const tls_config& cfg)
+{
+    ERR_clear_error();
+    ssl_ctx_st* raw_ctx = SSL_CTX_new(TLS_server_method());
+    if (!raw_ctx)
+        return make_ssl_error("Creating the TLS context");
+
+    // ALPN protocols, in wire format (length-prefixed strings)
+    std::string alpn;
+    for (const auto& proto : cfg.alpn_protocols)
+    {
+        alpn.push_back(static_cast<char>(proto.size()));
+        alpn += proto;
+    }
+    tls_context res(raw_ctx, std::move(alpn));
+    SSL_CTX* ctx = res.ctx_.get();
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // Certificate and key
+    if (SSL_CTX_use_certificate_chain_file(ctx, cfg.cert_file.c_str()) != 1)
+        return make_ssl_error("Loading the TLS certificate chain from " + cfg.cert_file);
+    if (SSL_CTX_use_PrivateKey_file(ctx, cfg.key_file.c_str(), SSL_FILETYPE_PEM) != 1)
+        return make_ssl_error("Loading the TLS private key from " + cfg.key_file);
+    if (SSL_CTX_check_private_key(ctx) != 1)
+        return make_ssl_error("Checking the TLS private key");
+
+    // Writes behave like socket writes. Idle connections (most websockets) release their buffers
+    SSL_CTX_set_mode(
+        ctx,
+        SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS
+    );
+
+    // Browsers often close connections without sending close_notify.
+    // kTLS is used only if the kernel supports it
+    long options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+    if (cfg.ktls)
+        options |= SSL_OP_ENABLE_KTLS;
+    SSL_CTX_set_options(ctx, options);
+
+    // Session resumption. Clients supporting tickets (most of them) don't use the cache
+    static constexpr unsigned char session_id_context[] = "servertech-chat";
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(cfg.session_cache_size));
+    SSL_CTX_set_timeout(ctx, static_cast<long>(cfg.session_timeout));
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1u);
+    SSL_CTX_set_num_tickets(ctx, 2);
+
+    if (!cfg.ticket_key_file.empty())
+    {
+        std::ifstream ifs(cfg.ticket_key_file, std::ios::binary);
+        std::string keys{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+        if (!ifs.good() && !ifs.eof())
+            return error_with_message{errc::invalid_config, "Reading " + cfg.ticket_key_file};
+        if (keys.size() != ticket_key_size)
+        {
+            return error_with_message{
+                errc::invalid_config,
+                "TLS_TICKET_KEY_FILE should contain exactly 80 bytes, but " + cfg.ticket_key_file + " has " +
+                    std::to_string(keys.size())
+            };
+        }
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx, keys.data(), static_cast<long>(keys.size())) != 1)
+            return make_ssl_error("Setting the TLS session ticket keys");
+    }
+
+    if (!res.alpn_->empty())
+        SSL_CTX_set_alpn_select_cb(ctx, select_alpn, res.alpn_.get());
+
+    return res;
+}
@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/tracing.hpp"
+
+#include <boost/json/array.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/serialize.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "util/env.hpp"
+
+using namespace chat;
+
+thread_local trace* chat::detail::handed_off_trace = nullptr;
+
+trace_collector::trace_collector(
+    std::uint64_t sample_rate,
+    std::chrono::nanoseconds slow_threshold,
+    std::size_t capacity
+)
+    : sample_rate_(sample_rate), slow_threshold_(slow_threshold), capacity_(capacity)
+{
+    records_.reserve(capacity);
+}
+
+bool trace_collector::finish(const trace& t, trace::clock::time_point end)
+{
+    if (!enabled())
+        return false;
+
+    // Decide whether to keep it. This is the only operation shared by all traces
+    auto duration = end - t.start_time();
+    bool slow = slow_threshold_.count() != 0 && duration >= slow_threshold_;
+    bool sampled = sample_rate_ != 0u &&
+                   num_finished_.fetch_add(1u, std::memory_order_relaxed) % sample_rate_ == 0u;
+    if (!slow && !sampled)
+        return false;
+
+    // Compose the record outside the lock
+    auto wall_start = std::chrono::system_clock::now() -
+                      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                          trace::clock::now() - t.start_time()
+                      );
+    trace_record record{
+        0u,
+        t.name(),
+        wall_start,
+        duration,
+        std::vector<trace::span>(t.spans().begin(), t.spans().end()),
+        t.dropped_spans(),
+        slow,
+    };
+
+    // Store it, overwriting the oldest one if the buffer is full
+    std::lock_guard<std::mutex> guard(mtx_);
+    record.id = next_id_++;
+    if (records_.size() < capacity_)
+        records_.push_back(std::move(record));
+    else
+        records_[next_] = std::move(record);
+    next_ = (next_ + 1u) % capacity_;
+    return true;
+}
+
+std::vector<trace_record> trace_collector::records() const
+{
+    std::lock_guard<std::mutex> guard(mtx_);
+    std::vector<trace_record> res;
+    res.reserve(records_.size());
+
+    // The most recent record is the one before next_
+    for (std::size_t i = 0; i < records_.size(); ++i)
+    {
+        auto idx = (next_ + records_.size() - 1u - i) % records_.size();
+        res.push_back(records_[idx]);
+    }
+    return res;
+}
+
+trace_collector& chat::global_trace_collector()
+{
+    static trace_collector res(
+        get_env_size("TRACE_SAMPLE_RATE", 1000u),
+        std::chrono::milliseconds(get_env_size("TRACE_SLOW_THRESHOLD_MS", 100u)),
+        get_env_size("TRACE_BUFFER_SIZE", 256u)
+    );
+    return res;
+}
+
+static std::int64_t to_us(std::chrono::nanoseconds value)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(value).count();
+}
+
+std::string chat::format_traces(boost::span<const trace_record> records)
+{
+    boost::json::array res;
+    res.reserve(records.size());
+    for (const auto& record : records)
+    {
+        boost::json::array spans;
+        spans.reserve(record.spans.size());
+        for (const auto& s : record.spans)
+        {
+            boost::json::object span_obj;
+            span_obj["name"] = s.name;
+            span_obj["startUs"] = to_us(s.start);
+            span_obj["durationUs"] = to_us(s.duration);
+            spans.push_back(std::move(span_obj));
+        }
+
+        boost::json::object obj;
+        obj["id"] = record.id;
+        obj["name"] = record.name;
+        obj["startUs"] = to_us(record.start.time_since_epoch());
+        obj["durationUs"] = to_us(record.duration);
+        obj["slow"] = record.slow;
+        obj["droppedSpans"] = record.dropped_spans;
+        obj["spans"] = std::move(spans);
+        res.push_back(std::move(obj));
+    }
+    return boost::json::serialize(res);
+}
@@ -7,26 +7,255 @@
 
 #include "util/websocket.hpp"
 
+#include <boost/asio/any_completion_handler.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/experimental/channel.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
-#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/core/role.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/rfc7230.hpp>
+#include <boost/beast/websocket/error.hpp>
+#include <boost/beast/websocket/option.hpp>
 #include <boost/beast/websocket/rfc6455.hpp>
 #include <boost/beast/websocket/stream.hpp>
+#include <boost/beast/websocket/teardown.hpp>
 
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
 #include <deque>
 #include <memory>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "error.hpp"
+#include "util/admission_controller.hpp"
 #include "util/async_mutex.hpp"
+#include "util/client_socket.hpp"
+#include "util/env.hpp"
+#include "util/log.hpp"
+#include "util/metrics.hpp"
+#include "util/websocket_frame.hpp"
 
 using namespace chat;
 
+namespace {
+
+// The stream below Beast's websocket. It lets us write pre-framed messages
+// (see framed_message) directly to the socket. Writes of data messages are serialized
+// by websocket's write mutex, but Beast may write control frames (like pongs or close frames)
+// while reading. This stream makes sure that these and our frames never get interleaved:
+//   - Our writes wait until Beast doesn't have a write in progress and is between frames.
+//   - Beast writes issued while one of our writes is in progress are deferred until it completes.
+class gated_stream
+{
+    using write_handler_type = boost::asio::any_completion_handler<void(error_code, std::size_t)>;
+
+    client_socket next_;
+
+    // Tracks the frames written by Beast
+    websocket_frame_tracker tracker_;
+
+    // Is there a Beast write in progress?
+    bool beast_writing_{false};
+
+    // Is there a write of ours in progress?
+    bool raw_writing_{false};
+
+    // A Beast write that was issued while one of our writes was in progress
+    std::vector<boost::asio::const_buffer> deferred_buffers_;
+    write_handler_type deferred_handler_;
+
+    // Set when a Beast write fails. The stream may be in the middle of a frame
+    error_code beast_error_;
+
+    // Cancelled to notify our writes when Beast finishes writing a frame
+    boost::asio::steady_timer boundary_timer_;
+
+    void start_beast_write(std::vector<boost::asio::const_buffer> buffers, write_handler_type handler)
+    {
+        beast_writing_ = true;
+        auto ex = boost::asio::get_associated_executor(handler, get_executor());
+        next_.async_write_some(
+            buffers,
+            boost::asio::bind_executor(
+                ex,
+                [this, buffers, handler = std::move(handler)](
+                    error_code ec,
+                    std::size_t bytes_written
+                ) mutable {
+                    beast_writing_ = false;
+                    auto remaining = bytes_written;
+                    for (auto buff : buffers)
+                    {
+                        auto size = (std::min)(remaining, buff.size());
+                        tracker_.consume(boost::asio::buffer(buff.data(), size));
+                        remaining -= size;
+                    }
+                    if (ec)
+                        beast_error_ = ec;
+                    if (ec || tracker_.at_boundary())
+                        boundary_timer_.cancel();
+                    std::move(handler)(ec, bytes_written);
+                }
+            )
+        );
+    }
+
+public:
+    using executor_type = client_socket::executor_type;
+
+    explicit gated_stream(client_socket&& sock)
+        : next_(std::move(sock)), boundary_timer_(next_.get_executor())
+    {
+        boundary_timer_.expires_at((boost::asio::steady_timer::time_point::max)());
+    }
+
+    executor_type get_executor() noexcept { return next_.get_executor(); }
+    client_socket& next_layer() noexcept { return next_; }
+
+    template <class MutableBufferSequence, class ReadToken>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadToken&& token)
+    {
+        return next_.async_read_some(buffers, std::forward<ReadToken>(token));
+    }
+
+    // Called by Beast
+    template <class ConstBufferSequence, class WriteToken>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteToken&& token)
+    {
+        return boost::asio::async_initiate<WriteToken, void(error_code, std::size_t)>(
+            [this](write_handler_type handler, const ConstBufferSequence& buffers) {
+                std::vector<boost::asio::const_buffer> buffs(
+                    boost::asio::buffer_sequence_begin(buffers),
+                    boost::asio::buffer_sequence_end(buffers)
+                );
+                if (raw_writing_)
+                {
+                    deferred_buffers_ = std::move(buffs);
+                    deferred_handler_ = std::move(handler);
+                }
+                else
+                {
+                    start_beast_write(std::move(buffs), std::move(handler));
+                }
+            },
+            token,
+            buffers
+        );
+    }
+
+    // Writes a complete frame, without interleaving it with Beast's frames
+    error_code write_raw(boost::asio::const_buffer frame, boost::asio::yield_context yield)
+    {
+        // Wait until Beast is between frames
+        while (beast_writing_ || !tracker_.at_boundary())
+        {
+            if (beast_error_)
+                return beast_error_;
+            error_code ignored;
+            boundary_timer_.async_wait(yield[ignored]);
+        }
+
+        // Write the frame
+        error_code ec;
+        raw_writing_ = true;
+        boost::asio::async_write(next_, frame, yield[ec]);
+        raw_writing_ = false;
+
+        // Resume any Beast write issued meanwhile
+        if (deferred_handler_)
+        {
+            auto handler = std::move(deferred_handler_);
+            deferred_handler_ = nullptr;
+            start_beast_write(std::move(deferred_buffers_), std::move(handler));
+        }
+
+        return ec;
+    }
+};
+
+// Closing the websocket tears down the underlying socket.
+// TLS connections send close_notify first, without waiting for the client's
+void teardown(boost::beast::role_type role, gated_stream& s, error_code& ec)
+{
+    s.next_layer().send_close_notify();
+    boost::beast::websocket::teardown(role, s.next_layer().socket(), ec);
+}
+
+template <class TeardownHandler>
+void async_teardown(boost::beast::role_type role, gated_stream& s, TeardownHandler&& handler)
+{
+    s.next_layer().send_close_notify();
+    boost::beast::websocket::async_teardown(
+        role,
+        s.next_layer().socket(),
+        std::forward<TeardownHandler>(handler)
+    );
+}
+
+// The compression settings negotiated with a client, as reported in the handshake response
+struct negotiated_compression
+{
+    bool enabled{false};
+    bool no_context_takeover{false};
+    int window_bits{15};
+};
+
+// Selects the subprotocol to use, given the list requested by the client, in order of preference.
+// Returns an empty string if the client didn't request any, or none of them is supported
+std::string_view select_subprotocol(std::string_view protocols_header)
+{
+    static const bool msgpack_enabled = get_env_bool("WS_MSGPACK", true);
+    for (auto token : boost::beast::http::token_list(protocols_header))
+    {
+        std::string_view protocol(token.data(), token.size());
+        if (protocol == json_subprotocol)
+            return json_subprotocol;
+        if (protocol == msgpack_subprotocol && msgpack_enabled)
+            return msgpack_subprotocol;
+    }
+    return {};
+}
+
+negotiated_compression parse_negotiated_compression(std::string_view extensions_header)
+{
+    negotiated_compression res;
+    for (const auto& ext : boost::beast::http::ext_list(extensions_header))
+    {
+        if (!boost::beast::iequals(ext.first, "permessage-deflate"))
+            continue;
+        res.enabled = true;
+        for (const auto& param : ext.second)
+        {
+            if (boost::beast::iequals(param.first, "server_no_context_takeover"))
+            {
+                res.no_context_takeover = true;
+            }
+            else if (boost::beast::iequals(param.first, "server_max_window_bits"))
+            {
+                int value = 0;
+                auto first = param.second.data();
+                auto parse_res = std::from_chars(first, first + param.second.size(), value);
+                if (parse_res.ec == std::errc{})
+                    res.window_bits = value;
+            }
+        }
+    }
+    return res;
+}
+
+}  // namespace
+
 struct websocket::impl
 {
     // The actual websocket
-    boost::beast::websocket::stream<boost::beast::tcp_stream> ws;
+    boost::beast::websocket::stream<gated_stream> ws;
 
     // The upgrade HTTP request
     websocket::upgrade_request_type upgrade_request;
@@ -40,8 +269,15 @@ struct websocket::impl
     // Make sure that we don't issue two reads concurrently
     bool reading{false};
 
+    // The compression settings offered and negotiated during the handshake
+    websocket_compression_options compression_offered;
+    negotiated_compression compression;
+
+    // The negotiated subprotocol. Empty if the client didn't request one
+    std::string_view subprotocol;
+
     impl(
-        boost::asio::ip::tcp::socket&& sock,
+        client_socket&& sock,
         websocket::upgrade_request_type&& upgrade_req,
         boost::beast::flat_buffer&& buff
     )
@@ -65,16 +301,48 @@ struct websocket::impl
     }
 };
 
+// Read buffers bigger than this are released before reading the next message
+static std::size_t max_read_buffer_capacity()
+{
+    static const std::size_t res = get_env_size("WS_READ_BUFFER_MAX_IDLE_SIZE", 4096u);
+    return res;
+}
+
+std::size_t chat::reset_read_buffer(boost::beast::flat_buffer& buff, std::size_t max_capacity)
+{
+    buff.clear();
+    auto capacity = buff.capacity();
+    if (capacity <= max_capacity)
+        return 0u;
+
+    // The buffer is empty, so this deallocates it. Beast allocates it again
+    // on the next read, growing it as required by the message
+    buff.shrink_to_fit();
+    return capacity - buff.capacity();
+}
+
 static std::string_view buffer_to_sv(boost::asio::const_buffer buff) noexcept
 {
     return std::string_view(static_cast<const char*>(buff.data()), buff.size());
 }
 
-websocket::websocket(
-    boost::asio::ip::tcp::socket sock,
-    upgrade_request_type&& req,
-    boost::beast::flat_buffer buff
-)
+// Logs the contents of a websocket frame. This is expensive and verbose, so
+// it's only available if the server was built with CHAT_ENABLE_FRAME_LOGGING.
+// Frames are logged with debug level, and sampled (one every LOG_FRAME_SAMPLING frames)
+static void log_frame([[maybe_unused]] std::string_view prefix, [[maybe_unused]] std::string_view payload)
+{
+#ifdef CHAT_ENABLE_FRAME_LOGGING
+    static log_sampler sampler{get_env_size("LOG_FRAME_SAMPLING", 1u)};
+    if (should_log(log_level::debug) && sampler())
+    {
+        std::string msg{prefix};
+        msg += payload;
+        log_message(log_level::debug, msg);
+    }
+#endif
+}
+
+websocket::websocket(client_socket sock, upgrade_request_type&& req, boost::beast::flat_buffer buff)
     : impl_(new impl(std::move(sock), std::move(req), std::move(buff)))
 {
 }
@@ -89,27 +357,70 @@ websocket& websocket::operator=(websocket&& rhs) noexcept
 
 websocket::~websocket() {}
 
+boost::asio::any_io_executor websocket::get_executor() { return impl_->ws.get_executor(); }
+
 const websocket::upgrade_request_type& websocket::upgrade_request() const noexcept
 {
     return impl_->upgrade_request;
 }
 
 error_code websocket::accept(boost::asio::yield_context yield)
+{
+    return accept(default_websocket_compression_options(), yield);
+}
+
+error_code websocket::accept(
+    const websocket_compression_options& compression,
+    boost::asio::yield_context yield
+)
 {
     error_code ec;
 
+    // Offer compression. The client may accept it, and may also ask for smaller windows
+    // or no context takeover, which Beast honors
+    if (compression.enabled)
+    {
+        boost::beast::websocket::permessage_deflate opts;
+        opts.server_enable = true;
+        opts.server_max_window_bits = compression.window_bits;
+        opts.server_no_context_takeover = compression.no_context_takeover;
+        opts.compLevel = compression.level;
+        opts.memLevel = compression.mem_level;
+        opts.msg_size_threshold = compression.threshold;
+        impl_->ws.set_option(opts);
+    }
+    impl_->compression_offered = compression;
+
+    // Limit the size of incoming messages, since they're buffered in memory.
+    // Bigger messages make the session fail with message_too_big
+    impl_->ws.read_message_max(get_admission_config().websocket_max_message_size);
+
     // Set suggested timeout settings for the websocket
     impl_->ws.set_option(
         boost::beast::websocket::stream_base::timeout::suggested(boost::beast::role_type::server)
     );
 
-    // Set a decorator to change the Server of the handshake
+    // Choose the subprotocol. Sessions using MessagePack only send binary messages
+    impl_->subprotocol = select_subprotocol(
+        impl_->upgrade_request[boost::beast::http::field::sec_websocket_protocol]
+    );
+    impl_->ws.binary(impl_->subprotocol == msgpack_subprotocol);
+
+    // Set a decorator to change the Server of the handshake and confirm the subprotocol.
+    // Beast has already negotiated compression when the decorator runs, so record the outcome.
+    // This is required to know whether we can send pre-compressed frames
+    auto* self = impl_.get();
     impl_->ws.set_option(
-        boost::beast::websocket::stream_base::decorator([](boost::beast::websocket::response_type& res) {
+        boost::beast::websocket::stream_base::decorator([self](boost::beast::websocket::response_type& res) {
             res.set(
                 boost::beast::http::field::server,
                 std::string(BOOST_BEAST_VERSION_STRING) + " websocket-chat-multi"
             );
+            if (!self->subprotocol.empty())
+                res.set(boost::beast::http::field::sec_websocket_protocol, self->subprotocol);
+            self->compression = parse_negotiated_compression(
+                res[boost::beast::http::field::sec_websocket_extensions]
+            );
         })
     );
 
@@ -119,6 +430,8 @@ error_code websocket::accept(boost::asio::yield_context yield)
     return ec;
 }
 
+bool websocket::binary() const noexcept { return impl_->subprotocol == msgpack_subprotocol; }
+
 result<std::string_view> websocket::read(boost::asio::yield_context yield)
 {
     assert(!impl_->reading);
@@ -128,7 +441,16 @@ result<std::string_view> websocket::read(boost::asio::yield_context yield)
     // Perform the read
     {
         auto guard = impl_->lock_reads();
-        impl_->read_buffer.clear();
+
+        // Most client messages are small. If the last one was big,
+        // don't keep its memory while the session is idle
+        auto released = reset_read_buffer(impl_->read_buffer, max_read_buffer_capacity());
+        if (released)
+        {
+            increment_counter(counter_id::websocket_buffers_released);
+            increment_counter(counter_id::websocket_bytes_released, released);
+        }
+
         impl_->ws.async_read(impl_->read_buffer, yield[ec]);
     }
 
@@ -140,22 +462,71 @@ result<std::string_view> websocket::read(boost::asio::yield_context yield)
     auto res = buffer_to_sv(impl_->read_buffer.data());
 
     // Log it
-    std::cout << "(READ) " << res << std::endl;
+    log_frame("(READ) ", res);
 
     return res;
 }
 
-error_code websocket::write_locked_impl(std::string_view buff, boost::asio::yield_context yield)
+error_code websocket::write_locked_impl(
+    boost::span<const boost::asio::const_buffer> buffers,
+    boost::asio::yield_context yield
+)
 {
     assert(impl_->write_mtx_.locked());
 
     error_code ec;
 
-    // Perform the write
-    impl_->ws.async_write(boost::asio::buffer(buff), yield[ec]);
+    // Perform the write. All buffers are sent as a single message
+    impl_->ws.async_write(buffers, yield[ec]);
+
+    // Log it
+#ifdef CHAT_ENABLE_FRAME_LOGGING
+    for (auto buff : buffers)
+        log_frame("(WRITE) ", buffer_to_sv(buff));
+#endif
+
+    return ec;
+}
+
+error_code websocket::write_framed_locked_impl(const framed_message& msg, boost::asio::yield_context yield)
+{
+    assert(impl_->write_mtx_.locked());
+
+    // Data frames can't be sent once the closing handshake has started
+    if (!impl_->ws.is_open())
+        return boost::beast::websocket::error::closed;
+
+    error_code ec;
+    const auto& negotiated = impl_->compression;
+    if (binary())
+    {
+        // The shared compressed frame is a text frame, so it can't be used.
+        // Beast writes binary frames, since the session negotiated MessagePack
+        auto payload = msg.binary_payload();
+        if (negotiated.enabled && payload.size() >= impl_->compression_offered.threshold)
+            impl_->ws.async_write(boost::asio::buffer(payload), yield[ec]);
+        else
+            ec = impl_->ws.next_layer().write_raw(msg.binary_frame(), yield);
+    }
+    else if (negotiated.enabled && msg.has_compressed_frame() && negotiated.no_context_takeover &&
+        msg.compression_window_bits() <= negotiated.window_bits)
+    {
+        // The client can inflate the shared compressed frame
+        ec = impl_->ws.next_layer().write_raw(msg.compressed_frame(), yield);
+    }
+    else if (negotiated.enabled && msg.payload().size() >= impl_->compression_offered.threshold)
+    {
+        // The session's compressor keeps context between messages, so it must compress the message itself
+        impl_->ws.async_write(boost::asio::buffer(msg.payload()), yield[ec]);
+    }
+    else
+    {
+        // Uncompressed messages are valid even if compression was negotiated
+        ec = impl_->ws.next_layer().write_raw(msg.frame(), yield);
+    }
 
     // Log it
-    std::cout << "(WRITE) " << buff << std::endl;
+    log_frame("(WRITE) ", msg.payload());
 
     return ec;
 }
@@ -169,7 +540,32 @@ error_code websocket::write(std::string_view message, boost::asio::yield_context
     return write_locked(message, guard, yield);
 }
 
-void websocket::lock_writes_impl(boost::asio::yield_context yield) noexcept { impl_->write_mtx_.lock(yield); }
+error_code websocket::write(
+    boost::span<const boost::asio::const_buffer> buffers,
+    boost::asio::yield_context yield
+)
+{
+    // Wait for the connection to become iddle
+    auto guard = lock_writes(yield);
+
+    // Write
+    return write_locked_impl(buffers, yield);
+}
+
+error_code websocket::write(const framed_message& msg, boost::asio::yield_context yield)
+{
+    // Wait for the connection to become iddle
+    auto guard = lock_writes(yield);
+
+    // Write
+    return write_framed_locked_impl(msg, yield);
+}
+
+void websocket::lock_writes_impl(boost::asio::yield_context yield) noexcept
+{
+    latency_timer timer(histogram_id::websocket_lock_wait);
+    impl_->write_mtx_.lock(yield);
+}
 
 void websocket::unlock_writes_impl() noexcept { impl_->write_mtx_.unlock(); }
 
@@ -178,4 +574,15 @@ error_code websocket::close(unsigned close_code, boost::asio::yield_context yiel
     error_code ec;
     impl_->ws.async_close(boost::beast::websocket::close_reason(close_code), yield[ec]);
     return ec;
+}
+
+error_code websocket::close(unsigned close_code, std::string_view reason, boost::asio::yield_context yield)
+{
+    boost::beast::websocket::close_reason cr(
+        static_cast<boost::beast::websocket::close_code>(close_code),
+        reason
+    );
+    error_code ec;
+    impl_->ws.async_close(cr, yield[ec]);
+    return ec;
 }
\ No newline at end of file
@@ -0,0 +1,231 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/websocket_frame.hpp"
+
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/beast/zlib/error.hpp>
+#include <boost/beast/zlib/zlib.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+#include "util/env.hpp"
+#include "util/msgpack.hpp"
+
+using namespace chat;
+
+// Opcodes for text and binary frames
+static constexpr std::uint8_t text_opcode = 0x1u;
+static constexpr std::uint8_t binary_opcode = 0x2u;
+
+websocket_compression_options chat::load_websocket_compression_options()
+{
+    auto get_int = [](const char* name, int default_value, int min_value, int max_value) {
+        auto res = get_env_size(name, static_cast<std::size_t>(default_value));
+        return static_cast<int>(std::clamp(res, std::size_t(min_value), std::size_t(max_value)));
+    };
+
+    websocket_compression_options res;
+    res.enabled = get_env_bool("WS_DEFLATE", res.enabled);
+    res.window_bits = get_int("WS_DEFLATE_WINDOW_BITS", res.window_bits, 9, 15);
+    res.mem_level = get_int("WS_DEFLATE_MEM_LEVEL", res.mem_level, 1, 9);
+    res.level = get_int("WS_DEFLATE_LEVEL", res.level, 0, 9);
+    res.threshold = get_env_size("WS_DEFLATE_THRESHOLD", res.threshold);
+    res.no_context_takeover = get_env_bool("WS_DEFLATE_NO_CONTEXT_TAKEOVER", res.no_context_takeover);
+    return res;
+}
+
+const websocket_compression_options& chat::default_websocket_compression_options()
+{
+    static const auto res = load_websocket_compression_options();
+    return res;
+}
+
+std::size_t chat::write_frame_header(
+    unsigned char* buff,
+    std::uint8_t opcode,
+    bool compressed,
+    std::uint64_t payload_size
+) noexcept
+{
+    // FIN, RSV1 (set for compressed messages) and opcode
+    buff[0] = static_cast<unsigned char>(0x80u | (compressed ? 0x40u : 0u) | (opcode & 0x0fu));
+
+    // Payload length. Server frames are never masked
+    if (payload_size < 126u)
+    {
+        buff[1] = static_cast<unsigned char>(payload_size);
+        return 2u;
+    }
+    else if (payload_size <= 0xffffu)
+    {
+        buff[1] = 126u;
+        buff[2] = static_cast<unsigned char>(payload_size >> 8);
+        buff[3] = static_cast<unsigned char>(payload_size);
+        return 4u;
+    }
+    else
+    {
+        buff[1] = 127u;
+        for (std::size_t i = 0; i < 8u; ++i)
+            buff[2u + i] = static_cast<unsigned char>(payload_size >> (56u - 8u * i));
+        return 10u;
+    }
+}
+
+// Compresses payload as a permessage-deflate message, without context takeover.
+// out should have max_frame_header_size free bytes at the beginning, for the frame header.
+// Returns false if compression failed
+static bool compress_payload(
+    std::string_view payload,
+    const websocket_compression_options& opts,
+    std::string& out
+)
+{
+    namespace zlib = boost::beast::zlib;
+
+    zlib::deflate_stream zo;
+    zo.reset(opts.level, opts.window_bits, opts.mem_level, zlib::Strategy::normal);
+
+    // The margin accounts for the sync flush
+    out.resize(max_frame_header_size + zo.upper_bound(payload.size()) + 16u);
+
+    zlib::z_params zs;
+    zs.next_in = payload.data();
+    zs.avail_in = payload.size();
+    zs.next_out = out.data() + max_frame_header_size;
+    zs.avail_out = out.size() - max_frame_header_size;
+
+    // A sync flush makes the compressor emit everything, ending in an empty
+    // stored block (00 00 ff ff). RFC 7692 requires removing it
+    error_code ec;
+    zo.write(zs, zlib::Flush::sync, ec);
+    if ((ec && ec != zlib::error::need_buffers) || zs.avail_in != 0u || zs.total_out < 4u)
+        return false;
+    const char* tail = out.data() + max_frame_header_size + zs.total_out - 4u;
+    if (std::memcmp(tail, "\x00\x00\xff\xff", 4) != 0)
+        return false;
+    out.resize(max_frame_header_size + zs.total_out - 4u);
+    return true;
+}
+
+framed_message::framed_message(std::string_view payload, const websocket_compression_options& compression)
+{
+    // Uncompressed frame
+    unsigned char header[max_frame_header_size]{};
+    header_size_ = write_frame_header(header, text_opcode, false, payload.size());
+    frame_.reserve(header_size_ + payload.size());
+    frame_.append(reinterpret_cast<const char*>(header), header_size_);
+    frame_.append(payload);
+
+    // Compressed frame. With context takeover, each session's compressor depends on
+    // the messages previously sent to it, and must compress the message itself
+    if (!compression.enabled || !compression.no_context_takeover || payload.size() < compression.threshold)
+        return;
+    std::string compressed;
+    if (!compress_payload(payload, compression, compressed))
+        return;
+    auto compressed_size = compressed.size() - max_frame_header_size;
+    if (compressed_size >= payload.size())
+        return;
+
+    // Place the header right before the compressed payload
+    auto compressed_header_size = write_frame_header(header, text_opcode, true, compressed_size);
+    compressed_offset_ = max_frame_header_size - compressed_header_size;
+    std::memcpy(compressed.data() + compressed_offset_, header, compressed_header_size);
+    compressed_frame_ = std::move(compressed);
+    compression_window_bits_ = compression.window_bits;
+}
+
+void framed_message::ensure_binary_frame() const
+{
+    std::call_once(binary_once_, [this] {
+        // Our payloads are always valid JSON. If conversion fails, an empty payload is used
+        auto encoded = json_to_msgpack(payload());
+        auto binary_payload = encoded.has_value() ? std::string_view(*encoded) : std::string_view();
+
+        unsigned char header[max_frame_header_size]{};
+        binary_header_size_ = write_frame_header(header, binary_opcode, false, binary_payload.size());
+        binary_frame_.reserve(binary_header_size_ + binary_payload.size());
+        binary_frame_.append(reinterpret_cast<const char*>(header), binary_header_size_);
+        binary_frame_.append(binary_payload);
+    });
+}
+
+boost::asio::const_buffer framed_message::binary_frame() const
+{
+    ensure_binary_frame();
+    return boost::asio::buffer(binary_frame_);
+}
+
+std::string_view framed_message::binary_payload() const
+{
+    ensure_binary_frame();
+    return std::string_view(binary_frame_).substr(binary_header_size_);
+}
+
+std::size_t websocket_frame_tracker::expected_header_size() const noexcept
+{
+    if (header_size_ < 2u)
+        return 0u;
+    auto len = header_[1] & 0x7fu;
+    bool masked = (header_[1] & 0x80u) != 0u;
+    std::size_t res = 2u;
+    if (len == 126u)
+        res += 2u;
+    else if (len == 127u)
+        res += 8u;
+    if (masked)
+        res += 4u;
+    return res;
+}
+
+void websocket_frame_tracker::consume(boost::asio::const_buffer data) noexcept
+{
+    const auto* p = static_cast<const unsigned char*>(data.data());
+    std::size_t n = data.size();
+
+    while (n > 0u)
+    {
+        // Skip payload bytes
+        if (remaining_ > 0u)
+        {
+            auto skipped = static_cast<std::size_t>((std::min)(remaining_, static_cast<std::uint64_t>(n)));
+            remaining_ -= skipped;
+            p += skipped;
+            n -= skipped;
+            continue;
+        }
+
+        // Accumulate header bytes, until we know the payload length
+        header_[header_size_++] = *p++;
+        --n;
+        if (header_size_ != expected_header_size())
+            continue;
+        auto len = header_[1] & 0x7fu;
+        std::uint64_t payload_size = len;
+        if (len == 126u)
+        {
+            payload_size = (std::uint64_t(header_[2]) << 8) | header_[3];
+        }
+        else if (len == 127u)
+        {
+            payload_size = 0u;
+            for (std::size_t i = 0; i < 8u; ++i)
+                payload_size = (payload_size << 8) | header_[2u + i];
+        }
+        remaining_ = payload_size;
+        header_size_ = 0u;
+    }
+}
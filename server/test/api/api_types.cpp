@@ -13,6 +13,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/variant2/variant.hpp>
 
+#include <memory>
+#include <string>
 #include <string_view>
 
 #include "business_types.hpp"
@@ -109,6 +111,175 @@ BOOST_AUTO_TEST_CASE(parse_client_event_request_room_history_success)
     BOOST_TEST(evt.firstMessageId == "100-0");
 }
 
+BOOST_AUTO_TEST_CASE(parse_client_event_request_room_history_empty_id)
+{
+    // An empty ID requests the most recent messages
+    const char* input = R"%({
+        "type": "requestRoomHistory",
+        "payload": {
+            "roomId": "myRoom",
+            "firstMessageId": ""
+        }
+    })%";
+
+    // Call the function
+    auto evt_variant = parse_client_event(input);
+
+    // Validate
+    const auto& evt = boost::variant2::get<request_room_history_event>(evt_variant);
+    BOOST_TEST(evt.firstMessageId == "");
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_request_room_history_invalid_id)
+{
+    for (const char* id : {"abc", "100-", "-0", "100-0-1", "10a-0", "+"})
+    {
+        BOOST_TEST_CONTEXT(id)
+        {
+            // Data
+            std::string input = R"%({"type": "requestRoomHistory", "payload": {"roomId": "myRoom", )%";
+            input += "\"firstMessageId\": \"";
+            input += id;
+            input += "\"}}";
+
+            // Call the function
+            auto evt_variant = parse_client_event(input);
+
+            // Validate
+            auto ec = boost::variant2::get<error_code>(evt_variant);
+            BOOST_TEST(ec == error_code(errc::websocket_parse_error));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_join_room_success)
+{
+    // Data
+    const char* input = R"%({
+        "type": "joinRoom",
+        "payload": {
+            "roomId": "myRoom"
+        }
+    })%";
+
+    // Call the function
+    auto evt_variant = parse_client_event(input);
+
+    // Validate
+    const auto& evt = boost::variant2::get<join_room_event>(evt_variant);
+    BOOST_TEST(evt.roomId == "myRoom");
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_join_room_errors)
+{
+    // Missing room ID
+    auto evt_variant = parse_client_event(R"%({"type": "joinRoom", "payload": {}})%");
+    auto ec = boost::variant2::get<error_code>(evt_variant);
+    BOOST_TEST(ec == error_code(boost::json::error::size_mismatch));
+
+    // Empty room ID
+    evt_variant = parse_client_event(R"%({"type": "joinRoom", "payload": {"roomId": ""}})%");
+    ec = boost::variant2::get<error_code>(evt_variant);
+    BOOST_TEST(ec == error_code(errc::websocket_parse_error));
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_activity_success)
+{
+    // Typing
+    auto evt_variant = parse_client_event(
+        R"%({"type": "clientActivity", "payload": {"roomId": "myRoom", "kind": "typing"}})%"
+    );
+    const auto& evt = boost::variant2::get<client_activity_event>(evt_variant);
+    BOOST_TEST(evt.roomId == "myRoom");
+    BOOST_TEST(evt.kind == activity_kind::typing);
+    BOOST_TEST(evt.messageId == "");
+
+    // Presence. Message IDs are ignored
+    evt_variant = parse_client_event(
+        R"%({"type": "clientActivity", "payload": {"roomId": "r", "kind": "presence", "messageId": "1-2"}})%"
+    );
+    const auto& evt2 = boost::variant2::get<client_activity_event>(evt_variant);
+    BOOST_TEST(evt2.kind == activity_kind::presence);
+    BOOST_TEST(evt2.messageId == "");
+
+    // Read receipt
+    evt_variant = parse_client_event(
+        R"%({"type": "clientActivity", "payload": {"roomId": "r", "kind": "read", "messageId": "1-2"}})%"
+    );
+    const auto& evt3 = boost::variant2::get<client_activity_event>(evt_variant);
+    BOOST_TEST(evt3.kind == activity_kind::read);
+    BOOST_TEST(evt3.messageId == "1-2");
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_activity_errors)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+        error_code expected;
+    } test_cases[] = {
+        {"missing_kind",
+         R"%({"type": "clientActivity", "payload": {"roomId": "r"}})%",
+         boost::json::error::size_mismatch},
+        {"missing_room_id",
+         R"%({"type": "clientActivity", "payload": {"kind": "typing"}})%",
+         boost::json::error::size_mismatch},
+        {"unknown_kind",
+         R"%({"type": "clientActivity", "payload": {"roomId": "r", "kind": "dancing"}})%",
+         errc::websocket_parse_error},
+        {"read_missing_message_id",
+         R"%({"type": "clientActivity", "payload": {"roomId": "r", "kind": "read"}})%",
+         boost::json::error::size_mismatch},
+        {"read_invalid_message_id",
+         R"%({"type": "clientActivity", "payload": {"roomId": "r", "kind": "read", "messageId": "abc"}})%",
+         errc::websocket_parse_error},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto ec = boost::variant2::get<error_code>(parse_client_event(tc.input));
+            BOOST_TEST(ec == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_search_room_success)
+{
+    // Call the function
+    auto evt_variant = parse_client_event(
+        R"%({"type": "searchRoom", "payload": {"roomId": "myRoom", "query": "hello world"}})%"
+    );
+
+    // Check
+    const auto& evt = boost::variant2::get<search_room_event>(evt_variant);
+    BOOST_TEST(evt.roomId == "myRoom");
+    BOOST_TEST(evt.query == "hello world");
+}
+
+BOOST_AUTO_TEST_CASE(parse_client_event_search_room_errors)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+    } test_cases[] = {
+        {"missing_query",   R"%({"type": "searchRoom", "payload": {"roomId": "r"}})%"    },
+        {"missing_room_id", R"%({"type": "searchRoom", "payload": {"query": "hello"}})%"},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto ec = boost::variant2::get<error_code>(parse_client_event(tc.input));
+            BOOST_TEST(ec == boost::json::error::size_mismatch);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(parse_client_event_error_missing_key)
 {
     // Data
@@ -166,6 +337,30 @@ BOOST_AUTO_TEST_CASE(api_error_to_json)
     BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
 }
 
+// import_accounts_response
+BOOST_AUTO_TEST_CASE(import_accounts_response_to_json)
+{
+    // Data
+    import_account_error errors[] = {
+        {2, api_error_id::username_exists, ""                    },
+        {5, api_error_id::bad_request,     "email: invalid format"},
+    };
+    import_accounts_response res{3, errors};
+
+    // Call the function
+    auto serialized = res.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "created": 3,
+        "errors": [
+            { "line": 2, "id": "USERNAME_EXISTS", "message": "" },
+            { "line": 5, "id": "BAD_REQUEST", "message": "email: invalid format" }
+        ]
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
 // hello_event
 BOOST_AUTO_TEST_CASE(hello_event_to_json)
 {
@@ -226,6 +421,132 @@ BOOST_AUTO_TEST_CASE(hello_event_to_json)
     BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
 }
 
+// room_joined_event
+BOOST_AUTO_TEST_CASE(room_joined_event_to_json)
+{
+    // Data
+    room r{
+        "room1",
+        "Room name 1",
+        {{{"100-0", "hello room 1!", parse_timestamp(123), 11}}, false},
+    };
+    username_map usernames{
+        {11, "username1"}
+    };
+
+    // Call the function
+    auto serialized = room_joined_event{r, usernames}.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "type": "roomJoined",
+        "payload": {
+            "room": {
+                "id": "room1",
+                "name": "Room name 1",
+                "messages":[{
+                    "id": "100-0",
+                    "content":"hello room 1!",
+                    "user": {"id": 11, "username": "username1" },
+                    "timestamp": 123
+                }],
+                "hasMoreMessages": false
+            }
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
+// encode_message
+BOOST_AUTO_TEST_CASE(encode_message_escaping)
+{
+    message msg{"100-0", "quote \" backslash \\ newline \n control \x01", parse_timestamp(123), 11};
+    auto encoded = encode_message(msg, "user\t1");
+    BOOST_TEST_REQUIRE(encoded != nullptr);
+
+    const char* expected = R"%({
+        "id": "100-0",
+        "content": "quote \" backslash \\ newline \n control \u0001",
+        "user": {"id": 11, "username": "user\t1" },
+        "timestamp": 123
+    })%";
+    BOOST_TEST(boost::json::parse(*encoded) == boost::json::parse(expected));
+}
+
+BOOST_AUTO_TEST_CASE(hello_event_to_json_encoded)
+{
+    // Messages that have already been encoded are not serialized again
+    message msg{"100-0", "hello room 1!", parse_timestamp(123), 11};
+    msg.encoded = std::make_shared<const std::string>(R"%({"id":"100-0","cached":true})%");
+    std::vector<room> rooms{
+        {"room1", "Room name 1", {{msg}, false}}
+    };
+    username_map usernames{
+        {11, "username1"}
+    };
+    user me{11, "username1"};
+
+    // Call the function
+    auto serialized = hello_event{me, rooms, usernames}.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "type": "hello",
+        "payload": {
+            "me": { "id": 11, "username": "username1" },
+            "rooms":[{
+                "id": "room1",
+                "name": "Room name 1",
+                "messages":[{ "id": "100-0", "cached": true }],
+                "hasMoreMessages": false
+            }]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
+BOOST_AUTO_TEST_CASE(hello_event_to_json_delta)
+{
+    // Rooms with delta history are flagged, so the client merges the messages
+    std::vector<room> rooms{
+        {"room1", "Room name 1", {{{"100-0", "hello room 1!", parse_timestamp(123), 11}}, false, true}},
+        {"room2", "Room name 2", {{}, true}},
+    };
+    username_map usernames{
+        {11, "username1"}
+    };
+    user me{11, "username1"};
+
+    // Call the function
+    auto serialized = hello_event{me, rooms, usernames}.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "type": "hello",
+        "payload": {
+            "me": { "id": 11, "username": "username1" },
+            "rooms":[{
+                "id": "room1",
+                "name": "Room name 1",
+                "messages":[{
+                    "id": "100-0",
+                    "content":"hello room 1!",
+                    "user": {"id": 11, "username": "username1" },
+                    "timestamp": 123
+                }],
+                "hasMoreMessages": false,
+                "isDelta": true
+            }, {
+                "id": "room2",
+                "name": "Room name 2",
+                "messages":[],
+                "hasMoreMessages": true
+            }]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
 // sever_messages_event
 BOOST_AUTO_TEST_CASE(server_messages_event_to_json)
 {
@@ -261,6 +582,200 @@ BOOST_AUTO_TEST_CASE(server_messages_event_to_json)
     BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
 }
 
+// aggregated_server_messages_event
+BOOST_AUTO_TEST_CASE(aggregated_server_messages_event_to_json)
+{
+    // Data
+    std::vector<message> msgs{
+        {"100-0", "hello room 1!", parse_timestamp(123), 11},
+        {"101-0", "hello back!",   parse_timestamp(125), 12},
+    };
+    username_map usernames{
+        {11, "username1"},
+        {12, "username2"},
+    };
+    aggregated_server_messages_event evt{"myRoom", msgs, usernames};
+
+    // Call the function
+    auto serialized = evt.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "type": "serverMessages",
+        "payload": {
+            "roomId": "myRoom",
+            "messages": [{
+                "id": "100-0",
+                "content":"hello room 1!",
+                "user": {"id": 11, "username": "username1" },
+                "timestamp": 123
+            }, {
+                "id": "101-0",
+                "content": "hello back!",
+                "user": {"id": 12, "username": "username2" },
+                "timestamp": 125
+            }]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+
+    // It can be parsed back, getting all the usernames
+    auto parsed = parse_server_messages_event(serialized);
+    BOOST_TEST_REQUIRE(parsed.has_value());
+    BOOST_TEST((parsed->usernames == usernames));
+    BOOST_TEST_REQUIRE(parsed->messages.size() == 2u);
+    BOOST_TEST(parsed->messages[1].user_id == 12);
+}
+
+// server_activity_event
+BOOST_AUTO_TEST_CASE(server_activity_event_to_json)
+{
+    user sending_user{11, "username1"};
+
+    // Typing
+    auto serialized = server_activity_event{"myRoom", sending_user, activity_kind::typing, ""}.to_json();
+    const char* expected = R"%({
+        "type": "serverActivity",
+        "payload": {
+            "roomId": "myRoom",
+            "user": {"id": 11, "username": "username1" },
+            "kind": "typing"
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+
+    // Read receipts include the message ID
+    serialized = server_activity_event{"myRoom", sending_user, activity_kind::read, "100-0"}.to_json();
+    expected = R"%({
+        "type": "serverActivity",
+        "payload": {
+            "roomId": "myRoom",
+            "user": {"id": 11, "username": "username1" },
+            "kind": "read",
+            "messageId": "100-0"
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
+BOOST_AUTO_TEST_CASE(parse_server_messages_event_success)
+{
+    // Data
+    std::vector<message> msgs{
+        {"100-0", "hello room 1!", parse_timestamp(123), 11},
+        {"101-0", "hello back!",   parse_timestamp(125), 11},
+    };
+    user sending_user{11, "username1"};
+    auto serialized = server_messages_event{"myRoom", sending_user, msgs}.to_json();
+
+    // Call the function
+    auto res = parse_server_messages_event(serialized);
+
+    // Validate
+    const auto& evt = res.value();
+    BOOST_TEST(evt.room_id == "myRoom");
+    BOOST_TEST(evt.usernames.size() == 1u);
+    BOOST_TEST(evt.usernames.at(11) == "username1");
+    BOOST_TEST_REQUIRE(evt.messages.size() == 2u);
+    BOOST_TEST(evt.messages[0].id == "100-0");
+    BOOST_TEST(evt.messages[0].content == "hello room 1!");
+    BOOST_TEST((evt.messages[0].timestamp == parse_timestamp(123)));
+    BOOST_TEST(evt.messages[0].user_id == 11);
+    BOOST_TEST(evt.messages[1].id == "101-0");
+    BOOST_TEST(evt.messages[1].content == "hello back!");
+    BOOST_TEST((evt.messages[1].timestamp == parse_timestamp(125)));
+    BOOST_TEST(evt.messages[1].user_id == 11);
+}
+
+BOOST_AUTO_TEST_CASE(parse_server_messages_event_error)
+{
+    constexpr std::string_view test_cases[] = {
+        "",
+        "[]",
+        R"%({"type":"roomHistory","payload":{"roomId":"r1","messages":[]}})%",
+        R"%({"type":"serverMessages"})%",
+        R"%({"type":"serverMessages","payload":{"messages":[]}})%",
+        R"%({"type":"serverMessages","payload":{"roomId":"r1","messages":[{"id":"100-0"}]}})%",
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc)
+        {
+            auto res = parse_server_messages_event(tc);
+            BOOST_TEST(res.has_error());
+        }
+    }
+}
+
+// server_messages_corrected_event
+BOOST_AUTO_TEST_CASE(server_messages_corrected_event_to_json)
+{
+    // Data
+    std::vector<message_id_correction> corrections{
+        {"100-1", "100-0"},
+        {"101-1", ""     },
+    };
+
+    // Call the function
+    auto serialized = server_messages_corrected_event{"myRoom", corrections}.to_json();
+
+    // Validate. Lost messages don't have a new ID
+    const char* expected = R"%({
+        "type": "serverMessagesCorrected",
+        "payload": {
+            "roomId": "myRoom",
+            "messages": [
+                { "id": "100-1", "newId": "100-0" },
+                { "id": "101-1", "newId": null }
+            ]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
+BOOST_AUTO_TEST_CASE(parse_server_messages_corrected_event_success)
+{
+    // Data
+    std::vector<message_id_correction> corrections{
+        {"100-1", "100-0"},
+        {"101-1", ""     },
+    };
+    auto serialized = server_messages_corrected_event{"myRoom", corrections}.to_json();
+
+    // Call the function
+    auto res = parse_server_messages_corrected_event(serialized);
+
+    // Validate
+    const auto& evt = res.value();
+    BOOST_TEST(evt.room_id == "myRoom");
+    BOOST_TEST_REQUIRE(evt.corrections.size() == 2u);
+    BOOST_TEST(evt.corrections[0].id == "100-1");
+    BOOST_TEST(evt.corrections[0].new_id == "100-0");
+    BOOST_TEST(evt.corrections[1].id == "101-1");
+    BOOST_TEST(evt.corrections[1].new_id == "");
+}
+
+BOOST_AUTO_TEST_CASE(parse_server_messages_corrected_event_error)
+{
+    constexpr std::string_view test_cases[] = {
+        "",
+        R"%({"type":"serverMessages","payload":{"roomId":"r1","messages":[]}})%",
+        R"%({"type":"serverMessagesCorrected"})%",
+        R"%({"type":"serverMessagesCorrected","payload":{"messages":[]}})%",
+        R"%({"type":"serverMessagesCorrected","payload":{"roomId":"r1","messages":[{"newId":"1-0"}]}})%",
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc)
+        {
+            auto res = parse_server_messages_corrected_event(tc);
+            BOOST_TEST(res.has_error());
+        }
+    }
+}
+
 // room_history_event
 BOOST_AUTO_TEST_CASE(room_history_event_to_json)
 {
@@ -304,4 +819,80 @@ BOOST_AUTO_TEST_CASE(room_history_event_to_json)
     BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
 }
 
+BOOST_AUTO_TEST_CASE(room_history_view_event_to_json)
+{
+    // Data. Views produce the same output as regular messages
+    message_view msgs[] = {
+        {"100-0", "hello \"room\"", parse_timestamp(123), 11},
+        {"101-0", "hello back!",    parse_timestamp(125), 14},
+    };
+    username_map usernames{
+        {11, "username1"},
+        {12, "username2"},
+    };
+    room_history_view_event evt{"myRoom", msgs, false, usernames};
+
+    // Call the function
+    auto serialized = evt.to_json();
+
+    // Validate. Users not in the map get an empty username
+    const char* expected = R"%({
+        "type": "roomHistory",
+        "payload": {
+            "roomId": "myRoom",
+            "hasMoreMessages": false,
+            "messages": [{
+                "id": "100-0",
+                "content":"hello \"room\"",
+                "user": {"id": 11, "username": "username1" },
+                "timestamp": 123
+            }, {
+                "id": "101-0",
+                "content": "hello back!",
+                "user": {"id": 14, "username": "" },
+                "timestamp": 125
+            }]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
+BOOST_AUTO_TEST_CASE(room_search_results_event_to_json)
+{
+    // Data
+    message msgs[] = {
+        {"101-0", "hello back!",   parse_timestamp(125), 12},
+        {"100-0", "hello room 1!", parse_timestamp(123), 11},
+    };
+    username_map usernames{
+        {11, "username1"},
+        {12, "username2"},
+    };
+    room_search_results_event evt{"myRoom", "Hello", msgs, usernames};
+
+    // Call the function
+    auto serialized = evt.to_json();
+
+    // Validate
+    const char* expected = R"%({
+        "type": "roomSearchResults",
+        "payload": {
+            "roomId": "myRoom",
+            "query": "Hello",
+            "messages": [{
+                "id": "101-0",
+                "content": "hello back!",
+                "user": {"id": 12, "username": "username2" },
+                "timestamp": 125
+            }, {
+                "id": "100-0",
+                "content":"hello room 1!",
+                "user": {"id": 11, "username": "username1" },
+                "timestamp": 123
+            }]
+        }
+    })%";
+    BOOST_TEST(boost::json::parse(serialized) == boost::json::parse(expected));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
@@ -0,0 +1,169 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/json/error.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/variant2/variant.hpp>
+
+#include <string_view>
+
+#include "api/api_types.hpp"
+#include "error.hpp"
+
+using namespace chat;
+
+// The basic cases are covered by the parse_client_event tests, in api_types.cpp
+
+BOOST_AUTO_TEST_SUITE(client_event_parser_)
+
+BOOST_AUTO_TEST_CASE(reuse)
+{
+    client_event_parser parser;
+
+    // Messages
+    auto evt1 = parser.parse(
+        R"%({"type":"clientMessages",)%"
+        R"%("payload":{"roomId":"r1","messages":[{"content":"c1"},{"content":"c2"}]}})%"
+    );
+    const auto& msgs = boost::variant2::get<client_messages_event>(evt1);
+    BOOST_TEST(msgs.roomId == "r1");
+    BOOST_TEST_REQUIRE(msgs.messages.size() == 2u);
+    BOOST_TEST(msgs.messages[0].content == "c1");
+    BOOST_TEST(msgs.messages[1].content == "c2");
+
+    // An error doesn't affect subsequent messages
+    auto evt2 = parser.parse(R"%({"type":"clientMessages","payload":{"roomId":)%");
+    BOOST_TEST(boost::variant2::holds_alternative<error_code>(evt2));
+
+    // Room history. No state from the first message is left
+    auto evt3 = parser.parse(
+        R"%({"type":"requestRoomHistory","payload":{"roomId":"r2","firstMessageId":"1-0"}})%"
+    );
+    const auto& history = boost::variant2::get<request_room_history_event>(evt3);
+    BOOST_TEST(history.roomId == "r2");
+    BOOST_TEST(history.firstMessageId == "1-0");
+
+    // Messages again
+    auto evt4 = parser.parse(R"%({"type":"clientMessages","payload":{"roomId":"r3","messages":[]}})%");
+    const auto& msgs2 = boost::variant2::get<client_messages_event>(evt4);
+    BOOST_TEST(msgs2.roomId == "r3");
+    BOOST_TEST(msgs2.messages.empty());
+}
+
+BOOST_AUTO_TEST_CASE(key_order)
+{
+    // The payload may appear before the type
+    auto evt = client_event_parser().parse(
+        R"%({"payload":{"messages":[{"content":"c1"}],"roomId":"r1"},"type":"clientMessages"})%"
+    );
+    const auto& msgs = boost::variant2::get<client_messages_event>(evt);
+    BOOST_TEST(msgs.roomId == "r1");
+    BOOST_TEST_REQUIRE(msgs.messages.size() == 1u);
+    BOOST_TEST(msgs.messages[0].content == "c1");
+}
+
+BOOST_AUTO_TEST_CASE(unknown_keys)
+{
+    // Unknown keys are ignored, including any nested values
+    auto evt = client_event_parser().parse(R"%({
+        "type": "clientMessages",
+        "extra": {"type": "bad", "payload": [1, {"roomId": "bad"}], "n": null},
+        "payload": {
+            "roomId": "r1",
+            "other": [[{"content": "bad"}]],
+            "messages": [{"content": "c1", "flag": true, "nested": {"content": "bad"}}]
+        },
+        "number": 42
+    })%");
+    const auto& msgs = boost::variant2::get<client_messages_event>(evt);
+    BOOST_TEST(msgs.roomId == "r1");
+    BOOST_TEST_REQUIRE(msgs.messages.size() == 1u);
+    BOOST_TEST(msgs.messages[0].content == "c1");
+}
+
+BOOST_AUTO_TEST_CASE(escapes)
+{
+    auto evt = client_event_parser().parse(
+        R"%({"type":"clientMessages","payload":{"roomId":"r\"1","messages":[{"content":"a\nbé"}]}})%"
+    );
+    const auto& msgs = boost::variant2::get<client_messages_event>(evt);
+    BOOST_TEST(msgs.roomId == "r\"1");
+    BOOST_TEST_REQUIRE(msgs.messages.size() == 1u);
+    BOOST_TEST(msgs.messages[0].content == "a\nb\xc3\xa9");
+}
+
+BOOST_AUTO_TEST_CASE(errors)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+        error_code expected;
+    } test_cases[] = {
+        {"invalid_json",
+         R"%({"type":])%",
+         boost::json::error::syntax},
+        {"extra_data",
+         R"%({"type":"x","payload":{}} {})%",
+         boost::json::error::extra_data},
+        {"not_object",
+         R"%(["clientMessages"])%",
+         errc::websocket_parse_error},
+        {"no_type",
+         R"%({"payload":{"roomId":"r1","messages":[]}})%",
+         errc::websocket_parse_error},
+        {"no_payload",
+         R"%({"type":"clientMessages"})%",
+         errc::websocket_parse_error},
+        {"unknown_type",
+         R"%({"type":"bad","payload":{"roomId":"r1","messages":[]}})%",
+         errc::websocket_parse_error},
+        {"type_not_string",
+         R"%({"type":10,"payload":{"roomId":"r1","messages":[]}})%",
+         errc::websocket_parse_error},
+        {"payload_not_object",
+         R"%({"type":"clientMessages","payload":[]})%",
+         errc::websocket_parse_error},
+        {"room_id_not_string",
+         R"%({"type":"clientMessages","payload":{"roomId":{},"messages":[]}})%",
+         errc::websocket_parse_error},
+        {"messages_not_array",
+         R"%({"type":"clientMessages","payload":{"roomId":"r1","messages":{}}})%",
+         errc::websocket_parse_error},
+        {"message_not_object",
+         R"%({"type":"clientMessages","payload":{"roomId":"r1","messages":["c1"]}})%",
+         errc::websocket_parse_error},
+        {"content_not_string",
+         R"%({"type":"clientMessages","payload":{"roomId":"r1","messages":[{"content":1}]}})%",
+         errc::websocket_parse_error},
+        {"missing_messages",
+         R"%({"type":"clientMessages","payload":{"roomId":"r1"}})%",
+         boost::json::error::size_mismatch},
+        {"missing_content",
+         R"%({"type":"clientMessages","payload":{"roomId":"r1","messages":[{}]}})%",
+         boost::json::error::size_mismatch},
+        {"missing_first_id",
+         R"%({"type":"requestRoomHistory","payload":{"roomId":"r1"}})%",
+         boost::json::error::size_mismatch},
+        {"invalid_first_id",
+         R"%({"type":"requestRoomHistory","payload":{"roomId":"r1","firstMessageId":"a"}})%",
+         errc::websocket_parse_error},
+    };
+
+    client_event_parser parser;
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto evt = parser.parse(tc.input);
+            BOOST_TEST_REQUIRE(boost::variant2::holds_alternative<error_code>(evt));
+            BOOST_TEST(boost::variant2::get<error_code>(evt) == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,120 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "api/routes.hpp"
+
+#include <boost/beast/http/verb.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/url/parse.hpp>
+
+#include <string_view>
+
+using namespace chat;
+namespace http = boost::beast::http;
+
+namespace {
+
+api_route_match match(std::string_view target, http::verb method)
+{
+    auto url = boost::urls::parse_origin_form(target);
+    BOOST_TEST_REQUIRE(url.has_value());
+    return match_api_route(url->encoded_segments(), method);
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(routes)
+
+BOOST_AUTO_TEST_CASE(match_success)
+{
+    struct
+    {
+        std::string_view target;
+        http::verb method;
+        std::string_view expected_path;
+        std::string_view expected_param;
+    } test_cases[] = {
+        {"/api/login",           http::verb::post,  "login",           ""},
+        {"/api/create-account",  http::verb::post,  "create-account",  ""},
+        {"/api/import-accounts", http::verb::post,  "import-accounts", ""},
+        {"/api/uploads",         http::verb::post,  "uploads",         ""},
+        {"/api/uploads/abcdef",  http::verb::patch, "uploads",         "abcdef"},
+        {"/api/uploads/abcdef",  http::verb::get,   "uploads",         "abcdef"},
+        {"/api/metrics",         http::verb::get,   "metrics",         ""},
+        {"/api/ready?full=1",    http::verb::get,   "ready",           ""},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.target)
+        {
+            auto res = match(tc.target, tc.method);
+            BOOST_TEST_REQUIRE(res.route != nullptr);
+            BOOST_TEST(res.method_allowed);
+            BOOST_TEST(res.route->path == tc.expected_path);
+            BOOST_TEST(res.route->has_param == !tc.expected_param.empty());
+            BOOST_TEST(res.param == tc.expected_param);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(method_not_allowed)
+{
+    auto res = match("/api/login", http::verb::get);
+    BOOST_TEST_REQUIRE(res.route != nullptr);
+    BOOST_TEST(!res.method_allowed);
+
+    res = match("/api/metrics", http::verb::post);
+    BOOST_TEST_REQUIRE(res.route != nullptr);
+    BOOST_TEST(!res.method_allowed);
+}
+
+BOOST_AUTO_TEST_CASE(not_found)
+{
+    std::string_view test_cases[] = {
+        "/api",
+        "/api/",
+        "/api/unknown",
+        "/api/login/extra",
+        "/api/uploads/abcdef/extra",
+        "/api/Login",
+    };
+
+    for (auto target : test_cases)
+    {
+        BOOST_TEST_CONTEXT(target) { BOOST_TEST(match(target, http::verb::post).route == nullptr); }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(streams_request_body_)
+{
+    struct
+    {
+        http::verb method;
+        std::string_view target;
+        bool expected;
+    } test_cases[] = {
+        {http::verb::patch, "/api/uploads/abcdef",        true },
+        {http::verb::post,  "/api/import-accounts",       true },
+        {http::verb::post,  "/api/import-accounts?dry=1", true },
+        {http::verb::get,   "/api/uploads/abcdef",        false},
+        {http::verb::post,  "/api/uploads",               false},
+        {http::verb::get,   "/api/import-accounts",       false},
+        {http::verb::post,  "/api/import-accounts/extra", false},
+        {http::verb::post,  "/api/create-account",        false},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.target)
+        {
+            BOOST_TEST(streams_request_body(tc.method, tc.target) == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
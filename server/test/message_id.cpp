@@ -0,0 +1,87 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "message_id.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+#include <string_view>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(message_id_)
+
+BOOST_AUTO_TEST_CASE(parse_success)
+{
+    constexpr struct
+    {
+        std::string_view input;
+        std::uint64_t ms;
+        std::uint64_t seq;
+    } test_cases[] = {
+        {"1-2", 1u, 2u},
+        {"1700000000000-0", 1700000000000u, 0u},
+        {"0-0", 0u, 0u},
+        {"18446744073709551615-18446744073709551615", 18446744073709551615u, 18446744073709551615u},
+        {"1234", 1234u, 0u},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.input)
+        {
+            auto res = parse_message_id(tc.input);
+            BOOST_TEST_REQUIRE(res.has_value());
+            BOOST_TEST(res->ms == tc.ms);
+            BOOST_TEST(res->seq == tc.seq);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_error)
+{
+    constexpr std::string_view test_cases[] = {
+        "",
+        "-",
+        "1-",
+        "-1",
+        "abc",
+        "1-abc",
+        "1-2-3",
+        "+1-2",
+        "1- 2",
+        "18446744073709551616-0",
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc) { BOOST_TEST(!parse_message_id(tc).has_value()); }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(format)
+{
+    BOOST_TEST(format_message_id({0u, 0u}) == "0-0");
+    BOOST_TEST(format_message_id({1700000000000u, 42u}) == "1700000000000-42");
+
+    // Round trip
+    auto res = parse_message_id(format_message_id({10u, 20u}));
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST(res->ms == 10u);
+    BOOST_TEST(res->seq == 20u);
+}
+
+BOOST_AUTO_TEST_CASE(order)
+{
+    BOOST_TEST((parsed_message_id{1u, 5u} < parsed_message_id{2u, 0u}));
+    BOOST_TEST((parsed_message_id{2u, 0u} < parsed_message_id{2u, 1u}));
+    BOOST_TEST(!(parsed_message_id{2u, 1u} < parsed_message_id{2u, 1u}));
+    BOOST_TEST(!(parsed_message_id{3u, 0u} < parsed_message_id{2u, 9u}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,156 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/broadcast_aggregator.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "services/pubsub_service.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Records the IDs of the messages in each event received
+struct stub_subscriber final : public message_subscriber
+{
+    std::vector<std::vector<std::string>> events;
+
+    void on_message(std::shared_ptr<const framed_message> message) override final
+    {
+        auto evt = parse_server_messages_event(message->payload());
+        BOOST_TEST_REQUIRE(evt.has_value());
+        std::vector<std::string> ids;
+        for (const auto& msg : evt->messages)
+        {
+            BOOST_TEST(evt->usernames.count(msg.user_id) == 1u);
+            ids.push_back(msg.id);
+        }
+        events.push_back(std::move(ids));
+    }
+};
+
+using events_type = std::vector<std::vector<std::string>>;
+
+const user user1{1, "user1"};
+const user user2{2, "user2"};
+
+struct fixture
+{
+    boost::asio::io_context ctx;
+    std::unique_ptr<pubsub_service> pubsub{create_pubsub_service(ctx.get_executor())};
+    std::shared_ptr<stub_subscriber> sub1{std::make_shared<stub_subscriber>()};
+    std::shared_ptr<stub_subscriber> sub2{std::make_shared<stub_subscriber>()};
+
+    // Rooms with two subscribers are aggregated
+    broadcast_aggregator aggregator{
+        ctx.get_executor(),
+        *pubsub,
+        {2u, std::chrono::milliseconds(10), 4u}
+    };
+
+    fixture()
+    {
+        constexpr std::string_view sub1_topics[] = {"busy", "quiet"};
+        constexpr std::string_view sub2_topics[] = {"busy"};
+        pubsub->subscribe(sub1, sub1_topics);
+        pubsub->subscribe(sub2, sub2_topics);
+    }
+
+    void publish(std::string_view room_id, const user& u, std::vector<std::string> ids)
+    {
+        std::vector<message> msgs;
+        for (auto& id : ids)
+            msgs.push_back(message{std::move(id), "content", parse_timestamp(1000), u.id});
+        aggregator.publish_messages(room_id, u, msgs);
+    }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(broadcast_aggregator_)
+
+BOOST_FIXTURE_TEST_CASE(few_subscribers, fixture)
+{
+    // Rooms with few subscribers get an event per publication, straight away
+    publish("quiet", user1, {"1-0", "2-0"});
+    publish("quiet", user2, {"3-0"});
+    BOOST_TEST(sub1->events == (events_type{{"1-0", "2-0"}, {"3-0"}}));
+}
+
+BOOST_FIXTURE_TEST_CASE(many_subscribers, fixture)
+{
+    // Messages published within the window are merged, even if sent by different users
+    publish("busy", user1, {"1-0"});
+    publish("busy", user2, {"2-0", "3-0"});
+    BOOST_TEST(sub1->events.empty());
+    ctx.run();
+    BOOST_TEST(sub1->events == (events_type{{"1-0", "2-0", "3-0"}}));
+    BOOST_TEST(sub2->events == (events_type{{"1-0", "2-0", "3-0"}}));
+
+    // Messages published after the window get another event
+    publish("busy", user1, {"4-0"});
+    ctx.restart();
+    ctx.run();
+    BOOST_TEST(sub2->events == (events_type{{"1-0", "2-0", "3-0"}, {"4-0"}}));
+}
+
+BOOST_FIXTURE_TEST_CASE(max_messages, fixture)
+{
+    // Reaching the maximum number of messages publishes them before the window ends
+    publish("busy", user1, {"1-0", "2-0"});
+    publish("busy", user1, {"3-0", "4-0", "5-0"});
+    BOOST_TEST(sub2->events == (events_type{{"1-0", "2-0", "3-0", "4-0", "5-0"}}));
+    publish("busy", user1, {"6-0"});
+    ctx.run();
+    BOOST_TEST(sub2->events == (events_type{{"1-0", "2-0", "3-0", "4-0", "5-0"}, {"6-0"}}));
+}
+
+BOOST_FIXTURE_TEST_CASE(ordering, fixture)
+{
+    // A room that stops being busy keeps its messages in order
+    publish("busy", user1, {"1-0"});
+    pubsub->unsubscribe(*sub2);
+    publish("busy", user1, {"2-0"});
+    BOOST_TEST(sub1->events.empty());
+
+    // Flushing publishes the pending messages straight away
+    aggregator.flush();
+    BOOST_TEST(sub1->events == (events_type{{"1-0", "2-0"}}));
+    publish("busy", user1, {"3-0"});
+    BOOST_TEST(sub1->events == (events_type{{"1-0", "2-0"}, {"3-0"}}));
+}
+
+BOOST_AUTO_TEST_CASE(disabled)
+{
+    boost::asio::io_context ctx;
+    auto pubsub = create_pubsub_service(ctx.get_executor());
+    auto sub = std::make_shared<stub_subscriber>();
+    constexpr std::string_view topics[] = {"busy"};
+    pubsub->subscribe(sub, topics);
+    broadcast_aggregator aggregator{ctx.get_executor(), *pubsub, {0u, std::chrono::milliseconds(10), 4u}};
+
+    // No room is aggregated
+    std::vector<message> msgs{
+        {"1-0", "content", parse_timestamp(1000), 1}
+    };
+    aggregator.publish_messages("busy", user1, msgs);
+    aggregator.publish_messages("busy", user1, msgs);
+    BOOST_TEST(sub->events == (events_type{{"1-0"}, {"1-0"}}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,265 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/core/span.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/mysql_client.hpp"
+
+using namespace chat;
+
+namespace {
+
+// A mysql_client that serves users from memory and records the lookups performed.
+// Lookups suspend the calling coroutine, like real queries do
+class stub_mysql_client final : public mysql_client
+{
+public:
+    username_map users{
+        {1, "user1"},
+        {2, "user2"},
+        {3, "user3"},
+    };
+    std::vector<std::vector<std::int64_t>> usernames_calls;
+    std::size_t user_by_id_calls{0};
+
+    error_with_message setup_db(boost::asio::yield_context) override { return {}; }
+    void start_run() override {}
+    void cancel() override {}
+    mysql_pool_stats pool_stats(mysql_pool_kind) const override { return {}; }
+    result_with_message<std::int64_t> create_user(
+        std::string_view username,
+        std::string_view,
+        std::string_view,
+        boost::asio::yield_context
+    ) override
+    {
+        users[4] = std::string(username);
+        return 4;
+    }
+    result_with_message<std::vector<result<std::int64_t>>> create_users(
+        boost::span<const new_user>,
+        boost::asio::yield_context
+    ) override
+    {
+        return std::vector<result<std::int64_t>>{};
+    }
+    result_with_message<auth_user> get_user_by_email(std::string_view, boost::asio::yield_context) override
+    {
+        return error_with_message{errc::not_found, ""};
+    }
+    error_with_message update_password(
+        std::int64_t,
+        std::string_view,
+        std::string_view,
+        boost::asio::yield_context
+    ) override
+    {
+        return {};
+    }
+    result_with_message<user> get_user_by_id(std::int64_t user_id, boost::asio::yield_context yield) override
+    {
+        ++user_by_id_calls;
+        boost::asio::post(yield);
+        auto it = users.find(user_id);
+        if (it == users.end())
+            return error_with_message{errc::not_found, ""};
+        return user{it->first, it->second};
+    }
+    result_with_message<username_map> get_usernames(
+        boost::span<const std::int64_t> user_ids,
+        boost::asio::yield_context yield
+    ) override
+    {
+        usernames_calls.emplace_back(user_ids.begin(), user_ids.end());
+        boost::asio::post(yield);
+        username_map res;
+        for (auto id : user_ids)
+        {
+            auto it = users.find(id);
+            if (it != users.end())
+                res.insert(*it);
+        }
+        return res;
+    }
+    result_with_message<std::vector<room>> get_rooms(boost::asio::yield_context) override
+    {
+        return std::vector<room>{};
+    }
+    result_with_message<std::vector<room>> get_user_rooms(std::int64_t, boost::asio::yield_context) override
+    {
+        return std::vector<room>{};
+    }
+    result_with_message<room> join_room(std::int64_t, std::string_view, boost::asio::yield_context) override
+    {
+        return error_with_message{errc::not_found, ""};
+    }
+    error_with_message archive_messages(
+        std::string_view,
+        boost::span<const message>,
+        boost::asio::yield_context
+    ) override
+    {
+        return {};
+    }
+    result_with_message<std::vector<message>> get_archived_messages(
+        std::string_view,
+        std::optional<std::string_view>,
+        std::size_t,
+        bool,
+        boost::asio::yield_context
+    ) override
+    {
+        return std::vector<message>{};
+    }
+};
+
+struct fixture
+{
+    stub_mysql_client* stub;
+    std::unique_ptr<mysql_client> client;
+
+    fixture()
+    {
+        std::unique_ptr<stub_mysql_client> stub_ptr{new stub_mysql_client};
+        stub = stub_ptr.get();
+        client = create_caching_mysql_client(
+            std::move(stub_ptr),
+            16u,
+            std::chrono::seconds(300),
+            std::chrono::seconds(300)
+        );
+    }
+
+    // Runs all the passed functions within coroutines, concurrently, until completion
+    template <class... Fn>
+    void run(Fn... fn)
+    {
+        boost::asio::io_context ctx;
+        (boost::asio::spawn(
+             ctx,
+             std::move(fn),
+             [](std::exception_ptr ptr) {
+                 if (ptr)
+                     std::rethrow_exception(ptr);
+             }
+         ),
+         ...);
+        ctx.run();
+    }
+};
+
+using id_vector = std::vector<std::int64_t>;
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(caching_mysql_client_)
+
+BOOST_FIXTURE_TEST_CASE(get_usernames, fixture)
+{
+    run([this](boost::asio::yield_context yield) {
+        // First lookup goes to the database. Repeated IDs are only looked up once
+        const std::int64_t ids1[] = {1, 2, 1, 10};
+        auto res = client->get_usernames(ids1, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST((*res == username_map{{1, "user1"}, {2, "user2"}}));
+        BOOST_TEST_REQUIRE(stub->usernames_calls.size() == 1u);
+        BOOST_TEST(stub->usernames_calls[0] == (id_vector{1, 2, 10}));
+
+        // Only misses are looked up. Non-existent IDs are cached, too
+        const std::int64_t ids2[] = {3, 2, 10};
+        res = client->get_usernames(ids2, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST((*res == username_map{{2, "user2"}, {3, "user3"}}));
+        BOOST_TEST_REQUIRE(stub->usernames_calls.size() == 2u);
+        BOOST_TEST(stub->usernames_calls[1] == id_vector{3});
+
+        // Everything is cached
+        res = client->get_usernames(ids1, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST((*res == username_map{{1, "user1"}, {2, "user2"}}));
+        BOOST_TEST(stub->usernames_calls.size() == 2u);
+    });
+}
+
+BOOST_FIXTURE_TEST_CASE(get_user_by_id, fixture)
+{
+    run([this](boost::asio::yield_context yield) {
+        // Found
+        auto res = client->get_user_by_id(1, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res->username == "user1");
+        res = client->get_user_by_id(1, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res->id == 1);
+        BOOST_TEST(res->username == "user1");
+        BOOST_TEST(stub->user_by_id_calls == 1u);
+
+        // Not found
+        res = client->get_user_by_id(4, yield);
+        BOOST_TEST(res.error().ec == errc::not_found);
+        res = client->get_user_by_id(4, yield);
+        BOOST_TEST(res.error().ec == errc::not_found);
+        BOOST_TEST(stub->user_by_id_calls == 2u);
+
+        // Creating a user invalidates the negative entry
+        auto create_res = client->create_user("user4", "user4@test.com", "hash", yield);
+        BOOST_TEST_REQUIRE(create_res.has_value());
+        res = client->get_user_by_id(4, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res->username == "user4");
+        BOOST_TEST(stub->user_by_id_calls == 3u);
+    });
+}
+
+BOOST_FIXTURE_TEST_CASE(shared_entries, fixture)
+{
+    run([this](boost::asio::yield_context yield) {
+        // Users retrieved by get_usernames are cached for get_user_by_id
+        const std::int64_t ids[] = {1};
+        BOOST_TEST_REQUIRE(client->get_usernames(ids, yield).has_value());
+        auto res = client->get_user_by_id(1, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res->username == "user1");
+        BOOST_TEST(stub->user_by_id_calls == 0u);
+    });
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_misses, fixture)
+{
+    // Concurrent lookups for the same IDs share a single query
+    const std::int64_t ids[] = {2, 1};
+    auto get_usernames = [this, &ids](boost::asio::yield_context yield) {
+        auto res = client->get_usernames(ids, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST((*res == username_map{{1, "user1"}, {2, "user2"}}));
+    };
+    auto get_user = [this](boost::asio::yield_context yield) {
+        auto res = client->get_user_by_id(3, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res->username == "user3");
+    };
+    run(get_usernames, get_usernames, get_user, get_user);
+    BOOST_TEST(stub->usernames_calls.size() == 1u);
+    BOOST_TEST(stub->user_by_id_calls == 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,177 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/drain_controller.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Records the notifications it gets
+struct mock_drainable final : drainable
+{
+    std::vector<std::chrono::milliseconds> delays;
+
+    void on_drain(std::chrono::milliseconds reconnect_delay) override { delays.push_back(reconnect_delay); }
+};
+
+constexpr auto rethrow_handler = [](std::exception_ptr ptr) {
+    if (ptr)
+        std::rethrow_exception(ptr);
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(drain_controller_)
+
+BOOST_AUTO_TEST_CASE(start_notifies_registered)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    mock_drainable obj1, obj2, obj3;
+    auto reg1 = ctl.add(obj1);
+    auto reg2 = ctl.add(obj2);
+    {
+        auto reg3 = ctl.add(obj3);
+    }
+    BOOST_TEST(!ctl.draining());
+    BOOST_TEST(ctl.num_drainables() == 2u);
+
+    ctl.start(1000ms);
+    BOOST_TEST(ctl.draining());
+    BOOST_TEST_REQUIRE(obj1.delays.size() == 1u);
+    BOOST_TEST_REQUIRE(obj2.delays.size() == 1u);
+    BOOST_TEST(obj3.delays.size() == 0u);
+    BOOST_TEST(obj1.delays[0].count() <= 1000);
+    BOOST_TEST(obj2.delays[0].count() <= 1000);
+
+    // Starting again has no effect
+    ctl.start(1000ms);
+    BOOST_TEST(obj1.delays.size() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(late_registration)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    ctl.start(0ms);
+
+    // Notified from a separate handler
+    mock_drainable obj;
+    auto reg = ctl.add(obj);
+    BOOST_TEST(obj.delays.size() == 0u);
+    ctx.run();
+    BOOST_TEST_REQUIRE(obj.delays.size() == 1u);
+    BOOST_TEST(obj.delays[0].count() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(late_registration_removed)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    ctl.start(0ms);
+
+    // Unregistered before the notification runs
+    mock_drainable obj;
+    ctl.add(obj).reset();
+    ctx.run();
+    BOOST_TEST(obj.delays.size() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(wait_idle)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    mock_drainable obj;
+    std::optional<drain_controller::registration> reg{ctl.add(obj)};
+    std::optional<drain_controller::operation_guard> op{ctl.start_operation()};
+    BOOST_TEST(ctl.num_pending_operations() == 1u);
+    std::optional<bool> result;
+
+    ctl.start(0ms);
+
+    // Waiter
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) { result = ctl.wait_idle(10s, yield); },
+        rethrow_handler
+    );
+
+    // Finishes things, one at a time
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) {
+            boost::asio::steady_timer timer(yield.get_executor());
+            timer.expires_after(1ms);
+            timer.async_wait(yield);
+            reg.reset();
+            BOOST_TEST(!result.has_value());
+            timer.expires_after(1ms);
+            timer.async_wait(yield);
+            op.reset();
+        },
+        rethrow_handler
+    );
+
+    ctx.run();
+    BOOST_TEST_REQUIRE(result.has_value());
+    BOOST_TEST(*result);
+    BOOST_TEST(ctl.num_pending_operations() == 0u);
+    BOOST_TEST(ctl.num_drainables() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(wait_idle_already_idle)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    std::optional<bool> result;
+    ctl.start(0ms);
+
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) { result = ctl.wait_idle(10s, yield); },
+        rethrow_handler
+    );
+
+    ctx.run();
+    BOOST_TEST_REQUIRE(result.has_value());
+    BOOST_TEST(*result);
+}
+
+BOOST_AUTO_TEST_CASE(wait_idle_timeout)
+{
+    boost::asio::io_context ctx;
+    drain_controller ctl(ctx.get_executor());
+    auto op = ctl.start_operation();
+    std::optional<bool> result;
+    ctl.start(0ms);
+
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) { result = ctl.wait_idle(5ms, yield); },
+        rethrow_handler
+    );
+
+    ctx.run();
+    BOOST_TEST_REQUIRE(result.has_value());
+    BOOST_TEST(!*result);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,231 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/history_snapshot.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "error.hpp"
+#include "services/pubsub_service.hpp"
+#include "services/room_history_cache.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+namespace fs = std::filesystem;
+
+namespace {
+
+// A temporary snapshot file, removed on destruction
+struct snapshot_fixture
+{
+    fs::path path{fs::temp_directory_path() / "servertech_chat_history_snapshot"};
+
+    snapshot_fixture() { fs::remove(path); }
+    ~snapshot_fixture() { fs::remove(path); }
+
+    // Writes a snapshot with two rooms
+    void write()
+    {
+        history_snapshot_builder builder;
+        builder.begin_room("r1", true, 2u);
+        builder.add_message({"2-0", "c2", parse_timestamp(2), 10});
+        builder.add_message({"1-0", "c1", parse_timestamp(1), 11});
+        builder.begin_room("r2", false, 0u);
+        builder.add_username(10, "user10");
+        builder.add_username(11, "user11");
+        BOOST_TEST(write_history_snapshot(path.string(), builder.finish()) == error_code());
+    }
+
+    std::unique_ptr<history_snapshot> open() const
+    {
+        auto res = history_snapshot::open(path.string());
+        BOOST_TEST_REQUIRE(res.has_value());
+        return std::move(*res);
+    }
+
+    // Overwrites a byte in the file
+    void corrupt(std::size_t offset, char value) const
+    {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(offset);
+        f.put(value);
+    }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(history_snapshot_)
+
+BOOST_FIXTURE_TEST_CASE(write_open, snapshot_fixture)
+{
+    write();
+    auto snapshot = open();
+
+    // Rooms
+    BOOST_TEST_REQUIRE(snapshot->rooms().size() == 2u);
+    const auto& r1 = snapshot->rooms()[0];
+    BOOST_TEST(r1.id == "r1");
+    BOOST_TEST(r1.has_more);
+    BOOST_TEST_REQUIRE(r1.messages.size() == 2u);
+    BOOST_TEST(r1.messages[0].id == "2-0");
+    BOOST_TEST(r1.messages[0].content == "c2");
+    BOOST_TEST(serialize_timestamp(r1.messages[0].timestamp) == 2);
+    BOOST_TEST(r1.messages[0].user_id == 10);
+    BOOST_TEST(r1.messages[1].id == "1-0");
+    BOOST_TEST(snapshot->rooms()[1].id == "r2");
+    BOOST_TEST(!snapshot->rooms()[1].has_more);
+    BOOST_TEST(snapshot->rooms()[1].messages.empty());
+
+    // Usernames
+    BOOST_TEST_REQUIRE(snapshot->usernames().size() == 2u);
+    BOOST_TEST(snapshot->usernames()[0].first == 10);
+    BOOST_TEST(snapshot->usernames()[0].second == "user10");
+
+    // No temporary file is left behind
+    BOOST_TEST(!fs::exists(path.string() + ".tmp"));
+}
+
+BOOST_FIXTURE_TEST_CASE(replace, snapshot_fixture)
+{
+    // Writing a snapshot replaces the previous one
+    write();
+    history_snapshot_builder builder;
+    BOOST_TEST(write_history_snapshot(path.string(), builder.finish()) == error_code());
+    auto snapshot = open();
+    BOOST_TEST(snapshot->rooms().empty());
+    BOOST_TEST(snapshot->usernames().empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(missing_file, snapshot_fixture)
+{
+    auto res = history_snapshot::open(path.string());
+    BOOST_TEST(res.error() == boost::system::errc::no_such_file_or_directory);
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupted_body, snapshot_fixture)
+{
+    // The checksum doesn't match
+    write();
+    corrupt(30u, 'x');
+    auto res = history_snapshot::open(path.string());
+    BOOST_TEST(res.error() == error_code(errc::snapshot_corrupted));
+}
+
+BOOST_FIXTURE_TEST_CASE(other_version, snapshot_fixture)
+{
+    // Snapshots written by other versions are ignored
+    write();
+    corrupt(8u, '\x7f');
+    auto res = history_snapshot::open(path.string());
+    BOOST_TEST(res.error() == error_code(errc::snapshot_corrupted));
+}
+
+BOOST_FIXTURE_TEST_CASE(bad_file, snapshot_fixture)
+{
+    {
+        std::ofstream f(path, std::ios::binary);
+        f << std::string(16, 'x');
+    }
+    auto res = history_snapshot::open(path.string());
+    BOOST_TEST(res.error() == error_code(errc::snapshot_corrupted));
+}
+
+BOOST_FIXTURE_TEST_CASE(cache_round_trip, snapshot_fixture)
+{
+    boost::asio::io_context ctx;
+    auto pubsub = create_pubsub_service(ctx.get_executor());
+    constexpr std::string_view room_ids[] = {"r1", "r2"};
+
+    // Save a cache that was loaded from the database
+    {
+        auto cache = std::make_shared<room_history_cache>(*pubsub, 3u);
+        std::vector<message_batch> batches{
+            {{{"2-0", "c2", parse_timestamp(2), 10}, {"1-0", "c1", parse_timestamp(1), 11}}, true},
+            {{}, false},
+        };
+        cache->begin_load(room_ids);
+        cache->finish_load(room_ids, batches, {{10, "user10"}, {11, "user11"}, {12, "user12"}});
+        history_snapshot_builder builder;
+        cache->save_snapshot(builder);
+        BOOST_TEST(write_history_snapshot(path.string(), builder.finish()) == error_code());
+    }
+
+    // Load it into another cache, which serves it
+    auto cache = std::make_shared<room_history_cache>(*pubsub, 3u);
+    cache->load_snapshot(*open());
+    auto res = cache->get(room_ids);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST_REQUIRE(res->first.at(0).messages.size() == 2u);
+    BOOST_TEST(res->first[0].messages[0].id == "2-0");
+    BOOST_TEST(res->first[0].messages[0].content == "c2");
+    BOOST_TEST(res->first[0].has_more);
+    BOOST_TEST(res->first[1].messages.empty());
+    BOOST_TEST_REQUIRE(res->first[0].messages[0].encoded != nullptr);
+    BOOST_TEST(*res->first[0].messages[0].encoded == *encode_message(res->first[0].messages[0], "user10"));
+
+    BOOST_TEST((res->second == username_map{{10, "user10"}, {11, "user11"}}));
+
+    // Only referenced users are saved
+    BOOST_TEST(open()->usernames().size() == 2u);
+
+    // Entries loaded from a snapshot are not saved again
+    history_snapshot_builder builder;
+    cache->save_snapshot(builder);
+    BOOST_TEST(write_history_snapshot(path.string(), builder.finish()) == error_code());
+    BOOST_TEST(open()->rooms().empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(cache_reload, snapshot_fixture)
+{
+    boost::asio::io_context ctx;
+    auto pubsub = create_pubsub_service(ctx.get_executor());
+    auto cache = std::make_shared<room_history_cache>(*pubsub, 3u);
+    constexpr std::string_view room_ids[] = {"r1"};
+    auto cached_ids = [&] {
+        std::vector<std::string> ids;
+        for (const auto& msg : cache->get(room_ids)->first.at(0).messages)
+            ids.push_back(msg.id);
+        return ids;
+    };
+    write();
+    cache->load_snapshot(*open());
+
+    // Messages received while the entry is being reloaded are served straight away
+    cache->begin_load(room_ids);
+    message msgs[] = {
+        {"4-0", "c4", parse_timestamp(4), 10}
+    };
+    pubsub->publish("r1", server_messages_event{"r1", user{10, "user10"}, msgs}.to_json());
+    BOOST_TEST(cached_ids() == (std::vector<std::string>{"4-0", "2-0", "1-0"}));
+
+    // The loaded history replaces the snapshot's, keeping the messages received meanwhile
+    std::vector<message_batch> batches{
+        {{{"3-0", "c3", parse_timestamp(3), 10}, {"2-0", "c2", parse_timestamp(2), 10}}, false},
+    };
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+    BOOST_TEST(cached_ids() == (std::vector<std::string>{"4-0", "3-0", "2-0"}));
+    BOOST_TEST(!cache->get(room_ids)->first[0].has_more);
+
+    // Further loads don't replace it
+    cache->begin_load(room_ids);
+    std::vector<message_batch> empty_batches(1u);
+    cache->finish_load(room_ids, empty_batches, {});
+    BOOST_TEST(cached_ids() == (std::vector<std::string>{"4-0", "3-0", "2-0"}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,45 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/login_rate_limiter.hpp"
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace chat;
+using boost::asio::ip::make_address;
+
+BOOST_AUTO_TEST_SUITE(login_rate_limiter_)
+
+BOOST_AUTO_TEST_CASE(ip_key)
+{
+    BOOST_TEST(login_limit_ip_key(make_address("192.168.1.20")) == "login-limit:ip:192.168.1.20");
+
+    // IPv4-mapped addresses are treated as IPv4
+    BOOST_TEST(login_limit_ip_key(make_address("::ffff:192.168.1.20")) == "login-limit:ip:192.168.1.20");
+
+    // IPv6 addresses are grouped by /64 prefix
+    BOOST_TEST(
+        login_limit_ip_key(make_address("2001:db8:1:2:3:4:5:6")) == "login-limit:ip:2001:db8:1:2::/64"
+    );
+    BOOST_TEST(
+        login_limit_ip_key(make_address("2001:db8:1:2:3:4:5:6")) ==
+        login_limit_ip_key(make_address("2001:db8:1:2:ffff::1"))
+    );
+    BOOST_TEST(
+        login_limit_ip_key(make_address("2001:db8:1:2::1")) !=
+        login_limit_ip_key(make_address("2001:db8:1:3::1"))
+    );
+}
+
+BOOST_AUTO_TEST_CASE(email_key)
+{
+    BOOST_TEST(login_limit_email_key("Some.User@Example.com") == "login-limit:email:some.user@example.com");
+    BOOST_TEST(login_limit_email_key("") == "login-limit:email:");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
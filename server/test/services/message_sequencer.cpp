@@ -0,0 +1,117 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/message_sequencer.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "message_id.hpp"
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(message_sequencer_)
+
+BOOST_AUTO_TEST_CASE(same_millisecond)
+{
+    // The node number is stored in the lower bits of the sequence number
+    message_sequencer seq(5u);
+    BOOST_TEST(format_message_id(seq.next(100u)) == "100-5");
+    BOOST_TEST(format_message_id(seq.next(100u)) == "100-1029");
+    BOOST_TEST(format_message_id(seq.next(100u)) == "100-2053");
+
+    // A new millisecond restarts the counter
+    BOOST_TEST(format_message_id(seq.next(101u)) == "101-5");
+}
+
+BOOST_AUTO_TEST_CASE(clock_backwards)
+{
+    // IDs keep increasing, even if the clock goes back
+    message_sequencer seq(1u);
+    auto id1 = seq.next(100u);
+    auto id2 = seq.next(90u);
+    BOOST_TEST((id1 < id2));
+    BOOST_TEST(id2.ms == 100u);
+}
+
+BOOST_AUTO_TEST_CASE(node_number)
+{
+    // Different nodes generate different IDs for the same millisecond
+    message_sequencer seq1(1u), seq2(2u);
+    BOOST_TEST(format_message_id(seq1.next(100u)) == "100-1");
+    BOOST_TEST(format_message_id(seq2.next(100u)) == "100-2");
+
+    // Only the lower bits are used
+    BOOST_TEST(message_sequencer(1024u + 3u).node_number() == 3u);
+}
+
+BOOST_AUTO_TEST_CASE(counter_overflow)
+{
+    // When the counter is exhausted, IDs move to the next millisecond
+    message_sequencer seq(0u);
+    seq.observe({100u, ((std::uint64_t(1) << message_sequencer::counter_bits) - 2u) << message_sequencer::node_bits}
+    );
+    BOOST_TEST(seq.next(100u).ms == 100u);
+    BOOST_TEST(format_message_id(seq.next(100u)) == "101-0");
+}
+
+BOOST_AUTO_TEST_CASE(observe)
+{
+    // IDs generated after observing an ID are greater, whatever its node
+    message_sequencer seq(1u);
+    parsed_message_id observed{200u, (7u << message_sequencer::node_bits) | 999u};
+    seq.observe(observed);
+    auto id = seq.next(150u);
+    BOOST_TEST((observed < id));
+    BOOST_TEST(format_message_id(id) == "200-8193");
+
+    // IDs assigned by Redis have small sequence numbers
+    seq.observe({300u, 2u});
+    BOOST_TEST(format_message_id(seq.next(150u)) == "300-1025");
+
+    // Sequence numbers that don't fit in our representation move to the next millisecond
+    seq.observe({400u, 0xffffffffffffffffu});
+    BOOST_TEST(seq.next(150u).ms == 401u);
+
+    // Older IDs are ignored
+    seq.observe({10u, 0u});
+    BOOST_TEST(seq.next(150u).ms == 401u);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent)
+{
+    // IDs generated by several threads are unique, and increasing in each thread
+    message_sequencer seq(1u);
+    std::vector<std::vector<parsed_message_id>> ids(4u);
+    std::vector<std::thread> threads;
+    for (auto& thread_ids : ids)
+    {
+        threads.emplace_back([&seq, &thread_ids] {
+            for (int i = 0; i < 10000; ++i)
+                thread_ids.push_back(seq.next(100u));
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    std::vector<std::string> all;
+    for (const auto& thread_ids : ids)
+    {
+        BOOST_TEST(std::is_sorted(thread_ids.begin(), thread_ids.end()));
+        for (auto id : thread_ids)
+            all.push_back(format_message_id(id));
+    }
+    std::sort(all.begin(), all.end());
+    BOOST_TEST((std::adjacent_find(all.begin(), all.end()) == all.end()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,261 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/message_spool.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "business_types.hpp"
+#include "error.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+namespace fs = std::filesystem;
+
+namespace {
+
+// A temporary spool file, removed on destruction
+struct spool_fixture
+{
+    fs::path path{fs::temp_directory_path() / "servertech_chat_message_spool"};
+
+    spool_fixture() { fs::remove(path); }
+    ~spool_fixture() { fs::remove(path); }
+
+    std::unique_ptr<message_spool> open(std::size_t capacity = 4096u) const
+    {
+        auto res = message_spool::open(path.string(), capacity, false);
+        BOOST_TEST_REQUIRE(res.has_value());
+        return std::move(*res);
+    }
+};
+
+message make_message(std::string id, std::string content)
+{
+    return {std::move(id), std::move(content), parse_timestamp(1000), 42};
+}
+
+void check_message(const spooled_message& actual, std::string_view room_id, std::string_view id)
+{
+    BOOST_TEST(actual.room_id == room_id);
+    BOOST_TEST(actual.msg.id == id);
+    BOOST_TEST(actual.msg.content == "content " + std::string(id));
+    BOOST_TEST(serialize_timestamp(actual.msg.timestamp) == 1000);
+    BOOST_TEST(actual.msg.user_id == 42);
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(message_spool_)
+
+BOOST_FIXTURE_TEST_CASE(append_peek_pop, spool_fixture)
+{
+    auto spool = open();
+    BOOST_TEST(spool->empty());
+    BOOST_TEST(spool->peek(10u).empty());
+
+    // Append messages to two rooms
+    std::vector<message> msgs{make_message("1-1", "content 1-1"), make_message("1-2", "content 1-2")};
+    BOOST_TEST(spool->append("room1", msgs) == error_code());
+    msgs = {make_message("2-1", "content 2-1")};
+    BOOST_TEST(spool->append("room2", msgs) == error_code());
+    BOOST_TEST(!spool->empty());
+    BOOST_TEST(spool->stats().depth == 3u);
+    BOOST_TEST(spool->stats().used_bytes > 0u);
+
+    // Peeking doesn't remove messages
+    auto res = spool->peek(2u);
+    BOOST_TEST_REQUIRE(res.size() == 2u);
+    check_message(res[0], "room1", "1-1");
+    check_message(res[1], "room1", "1-2");
+    BOOST_TEST(spool->peek(10u).size() == 3u);
+
+    // Popping does
+    spool->pop(2u);
+    res = spool->peek(10u);
+    BOOST_TEST_REQUIRE(res.size() == 1u);
+    check_message(res[0], "room2", "2-1");
+
+    // Once empty, the space is reused
+    spool->pop(1u);
+    BOOST_TEST(spool->empty());
+    BOOST_TEST(spool->stats().used_bytes == 0u);
+    BOOST_TEST(spool->stats().lag.count() == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(reopen, spool_fixture)
+{
+    // Messages that weren't popped survive reopening the spool
+    {
+        auto spool = open();
+        std::vector<message> msgs{
+            make_message("1-1", "content 1-1"),
+            make_message("1-2", "content 1-2"),
+            make_message("1-3", "content 1-3"),
+        };
+        BOOST_TEST(spool->append("room1", msgs) == error_code());
+        spool->pop(1u);
+    }
+
+    auto spool = open();
+    auto res = spool->peek(10u);
+    BOOST_TEST_REQUIRE(res.size() == 2u);
+    check_message(res[0], "room1", "1-2");
+    check_message(res[1], "room1", "1-3");
+
+    // New messages are appended after them
+    std::vector<message> msgs{make_message("1-4", "content 1-4")};
+    BOOST_TEST(spool->append("room1", msgs) == error_code());
+    BOOST_TEST(spool->stats().depth == 3u);
+}
+
+BOOST_FIXTURE_TEST_CASE(reopen_empty, spool_fixture)
+{
+    // Messages that were popped are not replayed again, even if their space was not overwritten
+    {
+        auto spool = open();
+        std::vector<message> msgs{make_message("1-1", "content 1-1")};
+        BOOST_TEST(spool->append("room1", msgs) == error_code());
+        spool->pop(1u);
+        msgs = {make_message("1-2", "content 1-2")};
+        BOOST_TEST(spool->append("room1", msgs) == error_code());
+        spool->pop(1u);
+    }
+
+    auto spool = open();
+    BOOST_TEST(spool->empty());
+    BOOST_TEST(spool->peek(10u).empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupted_tail, spool_fixture)
+{
+    std::size_t used_bytes = 0u;
+    {
+        auto spool = open();
+        std::vector<message> msgs{make_message("1-1", "content 1-1")};
+        BOOST_TEST(spool->append("room1", msgs) == error_code());
+        used_bytes = spool->stats().used_bytes;
+        msgs = {make_message("1-2", "content 1-2")};
+        BOOST_TEST(spool->append("room1", msgs) == error_code());
+    }
+
+    // Simulate a crash in the middle of writing the second record
+    {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(32 + used_bytes + 20);
+        f.put('x');
+    }
+
+    // The record with a bad checksum, and anything after it, is discarded
+    auto spool = open();
+    auto res = spool->peek(10u);
+    BOOST_TEST_REQUIRE(res.size() == 1u);
+    check_message(res[0], "room1", "1-1");
+    BOOST_TEST(spool->stats().used_bytes == used_bytes);
+}
+
+BOOST_FIXTURE_TEST_CASE(full, spool_fixture)
+{
+    auto spool = open(256u);
+
+    // Either all messages are appended, or none
+    std::vector<message> msgs{
+        make_message("1-1", std::string(100, 'a')),
+        make_message("1-2", std::string(100, 'a')),
+    };
+    BOOST_TEST(spool->append("room1", msgs) == error_code(errc::spool_full));
+    BOOST_TEST(spool->empty());
+
+    // Messages that fit are appended
+    msgs.pop_back();
+    BOOST_TEST(spool->append("room1", msgs) == error_code());
+    BOOST_TEST(spool->append("room1", msgs) == error_code(errc::spool_full));
+    BOOST_TEST(spool->stats().depth == 1u);
+
+    // Space becomes available once the spool is replayed
+    spool->pop(1u);
+    BOOST_TEST(spool->append("room1", msgs) == error_code());
+}
+
+BOOST_FIXTURE_TEST_CASE(bad_file, spool_fixture)
+{
+    {
+        std::ofstream f(path, std::ios::binary);
+        f << std::string(4096, 'x');
+    }
+    auto res = message_spool::open(path.string(), 4096u, false);
+    BOOST_TEST(res.error() == error_code(errc::spool_corrupted));
+}
+
+BOOST_FIXTURE_TEST_CASE(lag, spool_fixture)
+{
+    auto spool = open();
+    message msg{"1-1", "content", timestamp_t::clock::now() - std::chrono::seconds(10), 42};
+    BOOST_TEST(spool->append("room1", {&msg, 1u}) == error_code());
+    BOOST_TEST((spool->stats().lag >= std::chrono::seconds(10)));
+}
+
+BOOST_FIXTURE_TEST_CASE(shared, spool_fixture)
+{
+    // The spool is owned by a shard running in a different thread
+    boost::asio::io_context ctx, owner_ctx;
+    shared_message_spool spool(open(), owner_ctx.get_executor());
+    BOOST_TEST(spool.empty());
+    BOOST_TEST(spool.stats().capacity_bytes == 4096u - 32u);
+
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) {
+            // Appends run in the owner, and are reflected in the state seen by other shards
+            message msg{"1-1", "content 1-1", timestamp_t::clock::now() - std::chrono::seconds(10), 42};
+            BOOST_TEST(spool.append("room1", {&msg, 1u}, yield) == error_code());
+            BOOST_TEST(!spool.empty());
+            auto stats = spool.stats();
+            BOOST_TEST(stats.depth == 1u);
+            BOOST_TEST(stats.used_bytes > 0u);
+            BOOST_TEST((stats.lag >= std::chrono::seconds(10)));
+
+            // Errors are reported to the caller
+            std::vector<message> big{make_message("1-2", std::string(8192u, 'a'))};
+            BOOST_TEST(spool.append("room1", big, yield) == error_code(errc::spool_full));
+            BOOST_TEST(spool.stats().depth == 1u);
+        },
+        [](std::exception_ptr ptr) {
+            if (ptr)
+                std::rethrow_exception(ptr);
+        }
+    );
+    auto work = boost::asio::make_work_guard(owner_ctx);
+    std::thread owner_thread([&owner_ctx] { owner_ctx.run(); });
+    ctx.run();
+    work.reset();
+    owner_thread.join();
+
+    // The owner replays the spool
+    auto res = spool.peek(10u);
+    BOOST_TEST_REQUIRE(res.size() == 1u);
+    check_message(res[0], "room1", "1-1");
+    spool.pop(1u);
+    BOOST_TEST(spool.empty());
+    BOOST_TEST(spool.stats().used_bytes == 0u);
+    BOOST_TEST((spool.stats().lag == std::chrono::milliseconds::zero()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -23,10 +24,16 @@ BOOST_AUTO_TEST_SUITE(pubsub_service_)
 struct stub_subscriber final : public message_subscriber
 {
     std::vector<std::string> messages;
+    std::vector<std::string> ephemeral_messages;
 
-    void on_message(std::string_view message, boost::asio::yield_context yield) override final
+    void on_message(std::shared_ptr<const framed_message> message) override final
     {
-        messages.emplace_back(message);
+        messages.emplace_back(message->payload());
+    }
+
+    void on_ephemeral_message(std::shared_ptr<const framed_message> message) override final
+    {
+        ephemeral_messages.emplace_back(message->payload());
     }
 };
 
@@ -91,6 +98,9 @@ BOOST_FIXTURE_TEST_CASE(unsubscribe, fixture)
 
     // Subscribe
     pubsub->subscribe(sub1, topic_ids);
+    pubsub->subscribe(sub2, topic_ids);
+    BOOST_TEST(pubsub->num_subscribers("r1") == 2u);
+    BOOST_TEST(pubsub->num_subscribers("unknown") == 0u);
 
     // Messages are received
     publish_and_run("r1", "some message");
@@ -98,6 +108,7 @@ BOOST_FIXTURE_TEST_CASE(unsubscribe, fixture)
 
     // Unsubscribe
     pubsub->unsubscribe(*sub1);
+    BOOST_TEST(pubsub->num_subscribers("r1") == 1u);
 
     // Messages are no longer received
     publish_and_run("r1", "some message");
@@ -130,4 +141,155 @@ BOOST_FIXTURE_TEST_CASE(subscribe_guarded, fixture)
     BOOST_TEST(sub1->messages == string_vector{});
 }
 
+// Sharded pubsub: messages get delivered to subscribers in all shards
+BOOST_AUTO_TEST_CASE(sharded)
+{
+    // Data
+    constexpr std::string_view topic_ids[] = {"r1"};
+    auto sub1 = create_subscriber();
+    auto sub2 = create_subscriber();
+
+    // Each shard runs in its own context. We run them sequentially here,
+    // so no actual threads are required
+    boost::asio::io_context ctx1, ctx2;
+    boost::asio::any_io_executor executors[] = {ctx1.get_executor(), ctx2.get_executor()};
+    auto shards = create_sharded_pubsub_service(executors);
+    BOOST_TEST_REQUIRE(shards.size() == 2u);
+
+    // Subscribe to each shard
+    shards[0]->subscribe(sub1, topic_ids);
+    shards[1]->subscribe(sub2, topic_ids);
+
+    // Publish on the first shard. Both subscribers get the message
+    shards[0]->publish("r1", "some message");
+    ctx1.run();
+    ctx2.run();
+    BOOST_TEST(sub1->messages == string_vector{"some message"});
+    BOOST_TEST(sub2->messages == string_vector{"some message"});
+
+    // Publish on the second shard
+    shards[1]->publish("r1", "another message");
+    ctx1.restart();
+    ctx2.restart();
+    ctx1.run();
+    ctx2.run();
+    BOOST_TEST(sub1->messages == (string_vector{"some message", "another message"}));
+    BOOST_TEST(sub2->messages == (string_vector{"some message", "another message"}));
+}
+
+// Ephemeral messages with the same key are coalesced, and delivered once the window ends
+BOOST_AUTO_TEST_CASE(ephemeral_coalesced)
+{
+    constexpr std::string_view topic_ids[] = {"r1"};
+    boost::asio::io_context ctx;
+    auto pubsub = create_pubsub_service(ctx.get_executor(), {std::chrono::milliseconds(10), {100.0, 100.0}});
+    auto sub = create_subscriber();
+    pubsub->subscribe(sub, topic_ids);
+
+    // Publish some messages. They're not delivered yet
+    pubsub->publish_ephemeral("r1", "u1:typing", "m1");
+    pubsub->publish_ephemeral("r1", "u2:typing", "m2");
+    pubsub->publish_ephemeral("r1", "u1:typing", "m3");
+    pubsub->publish_ephemeral("r2", "u1:typing", "m4");
+    BOOST_TEST(sub->ephemeral_messages == string_vector{});
+
+    // Only the latest message for each key is delivered, as an ephemeral message
+    ctx.run();
+    BOOST_TEST(sub->ephemeral_messages == (string_vector{"m3", "m2"}));
+    BOOST_TEST(sub->messages == string_vector{});
+
+    // Messages published after the window are delivered, too
+    pubsub->publish_ephemeral("r1", "u1:typing", "m5");
+    ctx.restart();
+    ctx.run();
+    BOOST_TEST(sub->ephemeral_messages == (string_vector{"m3", "m2", "m5"}));
+}
+
+// Ephemeral messages exceeding the rate limit are discarded
+BOOST_AUTO_TEST_CASE(ephemeral_rate_limited)
+{
+    constexpr std::string_view topic_ids[] = {"r1"};
+    boost::asio::io_context ctx;
+    auto pubsub = create_pubsub_service(ctx.get_executor(), {std::chrono::milliseconds(0), {2.0, 0.001}});
+    auto sub = create_subscriber();
+    pubsub->subscribe(sub, topic_ids);
+
+    // Without coalescing, every message takes a token
+    pubsub->publish_ephemeral("r1", "u1:typing", "m1");
+    pubsub->publish_ephemeral("r1", "u1:typing", "m2");
+    pubsub->publish_ephemeral("r1", "u1:typing", "m3");
+    ctx.run();
+    BOOST_TEST(sub->ephemeral_messages == (string_vector{"m1", "m2"}));
+
+    // Regular messages are not limited
+    pubsub->publish("r1", "regular");
+    ctx.restart();
+    ctx.run();
+    BOOST_TEST(sub->messages == string_vector{"regular"});
+}
+
+// Messages published to a user reach all of their sessions, in all shards
+BOOST_AUTO_TEST_CASE(publish_to_user)
+{
+    constexpr std::string_view topic_ids[] = {"42"};
+    auto sub1 = create_subscriber();
+    auto sub2 = create_subscriber();
+    auto sub3 = create_subscriber();
+    auto room_sub = create_subscriber();
+    boost::asio::io_context ctx1, ctx2;
+    boost::asio::any_io_executor executors[] = {ctx1.get_executor(), ctx2.get_executor()};
+    auto shards = create_sharded_pubsub_service(executors);
+    BOOST_TEST_REQUIRE(shards.size() == 2u);
+    shards[0]->subscribe_user(sub1, 42);
+    shards[1]->subscribe_user(sub2, 42);
+    shards[0]->subscribe_user(sub3, 43);
+
+    // User IDs don't clash with topics
+    shards[0]->subscribe(room_sub, topic_ids);
+
+    // Publish on the first shard. The user's sessions in this shard get the message synchronously
+    shards[0]->publish_to_user(42, "some message");
+    BOOST_TEST(sub1->messages == string_vector{"some message"});
+    ctx1.run();
+    ctx2.run();
+    BOOST_TEST(sub2->messages == string_vector{"some message"});
+    BOOST_TEST(sub3->messages == string_vector{});
+    BOOST_TEST(room_sub->messages == string_vector{});
+
+    // Unsubscribing removes user subscriptions, too
+    shards[1]->unsubscribe(*sub2);
+    shards[0]->publish_to_user(42, "another message");
+    ctx1.restart();
+    ctx2.restart();
+    ctx1.run();
+    ctx2.run();
+    BOOST_TEST(sub1->messages == (string_vector{"some message", "another message"}));
+    BOOST_TEST(sub2->messages == string_vector{"some message"});
+}
+
+// Ephemeral messages get delivered to subscribers in all shards
+BOOST_AUTO_TEST_CASE(ephemeral_sharded)
+{
+    constexpr std::string_view topic_ids[] = {"r1"};
+    auto sub1 = create_subscriber();
+    auto sub2 = create_subscriber();
+    boost::asio::io_context ctx1, ctx2;
+    boost::asio::any_io_executor executors[] = {ctx1.get_executor(), ctx2.get_executor()};
+    auto shards = create_sharded_pubsub_service(
+        executors,
+        false,
+        {std::chrono::milliseconds(10), {100.0, 100.0}}
+    );
+    BOOST_TEST_REQUIRE(shards.size() == 2u);
+    shards[0]->subscribe(sub1, topic_ids);
+    shards[1]->subscribe(sub2, topic_ids);
+
+    // Publish on the first shard. Both subscribers get the message
+    shards[0]->publish_ephemeral("r1", "u1:read", "m1");
+    ctx1.run();
+    ctx2.run();
+    BOOST_TEST(sub1->ephemeral_messages == string_vector{"m1"});
+    BOOST_TEST(sub2->ephemeral_messages == string_vector{"m1"});
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
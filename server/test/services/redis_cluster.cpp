@@ -0,0 +1,279 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/redis_cluster.hpp"
+
+#include <boost/redis/resp3/node.hpp>
+#include <boost/redis/resp3/type.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+
+namespace resp3 = boost::redis::resp3;
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(redis_cluster)
+
+static resp3::node array_node(std::size_t size, std::size_t depth)
+{
+    return {resp3::type::array, size, depth, ""};
+}
+
+static resp3::node string_node(std::size_t depth, std::string content)
+{
+    return {resp3::type::blob_string, 0, depth, std::move(content)};
+}
+
+static resp3::node number_node(std::size_t depth, std::string content)
+{
+    return {resp3::type::number, 0, depth, std::move(content)};
+}
+
+//
+// redis_hash_slot
+//
+BOOST_AUTO_TEST_CASE(hash_slot)
+{
+    // Values computed by CLUSTER KEYSLOT
+    BOOST_TEST(redis_hash_slot("123456789") == 12739u);
+    BOOST_TEST(redis_hash_slot("foo") == 12182u);
+    BOOST_TEST(redis_hash_slot("") == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(hash_slot_hash_tags)
+{
+    // Only the tag is hashed
+    BOOST_TEST(redis_hash_slot("{user1000}.following") == redis_hash_slot("{user1000}.followers"));
+    BOOST_TEST(redis_hash_slot("{user1000}.following") == redis_hash_slot("user1000"));
+    BOOST_TEST(redis_hash_slot("foo{bar}{zap}") == redis_hash_slot("bar"));
+    BOOST_TEST(redis_hash_slot("foo{{bar}}zap") == redis_hash_slot("{bar"));
+
+    // Empty or unterminated tags cause the whole key to be hashed
+    BOOST_TEST(redis_hash_slot("foo{}{bar}") != redis_hash_slot("bar"));
+    BOOST_TEST(redis_hash_slot("foo{}{bar}") == 8363u);
+    BOOST_TEST(redis_hash_slot("foo{bar") != redis_hash_slot("bar"));
+}
+
+//
+// parse_redis_redirect
+//
+BOOST_AUTO_TEST_CASE(parse_redirect_success)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+        bool is_ask;
+        std::uint16_t slot;
+        std::string_view host;
+        std::string_view port;
+    } test_cases[] = {
+        {"moved",      "MOVED 3999 127.0.0.1:6381", false, 3999,  "127.0.0.1", "6381"},
+        {"ask",        "ASK 3999 127.0.0.1:6381",   true,  3999,  "127.0.0.1", "6381"},
+        {"hostname",   "MOVED 0 redis-2:6379",      false, 0,     "redis-2",   "6379"},
+        {"ipv6",       "MOVED 16383 ::1:6380",      false, 16383, "::1",       "6380"},
+        {"empty_host", "MOVED 12 :6380",            false, 12,    "",          "6380"},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto res = parse_redis_redirect(tc.input);
+            BOOST_TEST_REQUIRE(res.has_value());
+            BOOST_TEST(res->is_ask == tc.is_ask);
+            BOOST_TEST(res->slot == tc.slot);
+            BOOST_TEST(res->host == tc.host);
+            BOOST_TEST(res->port == tc.port);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_redirect_error)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+    } test_cases[] = {
+        {"empty",             ""                             },
+        {"other_error",       "ERR unknown command"          },
+        {"lowercase",         "moved 3999 127.0.0.1:6381"    },
+        {"no_slot",           "MOVED"                        },
+        {"no_address",        "MOVED 3999"                   },
+        {"slot_nan",          "MOVED abc 127.0.0.1:6381"     },
+        {"slot_out_of_range", "MOVED 16384 127.0.0.1:6381"   },
+        {"slot_negative",     "MOVED -1 127.0.0.1:6381"      },
+        {"no_port",           "MOVED 3999 127.0.0.1"         },
+        {"empty_port",        "MOVED 3999 127.0.0.1:"        },
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name) { BOOST_TEST(!parse_redis_redirect(tc.input).has_value()); }
+    }
+}
+
+//
+// parse_cluster_slots
+//
+BOOST_AUTO_TEST_CASE(parse_cluster_slots_success)
+{
+    std::vector<resp3::node> nodes{
+        array_node(2, 0),
+
+        // First range, with a replica
+        array_node(4, 1),
+        number_node(2, "0"),
+        number_node(2, "5460"),
+        array_node(3, 2),
+        string_node(3, "127.0.0.1"),
+        number_node(3, "30001"),
+        string_node(3, "09dbe9720cda62f7865eabc5fd8857c5d2678366"),
+        array_node(3, 2),
+        string_node(3, "127.0.0.1"),
+        number_node(3, "30004"),
+        string_node(3, "821d8ca00d7ccf931ed3ffc7e3db0599d2271abf"),
+
+        // Second range, with node metadata
+        array_node(3, 1),
+        number_node(2, "5461"),
+        number_node(2, "16383"),
+        array_node(4, 2),
+        string_node(3, "redis-2"),
+        number_node(3, "30002"),
+        string_node(3, "c9d93d9f2c0c524ff34cc11838c2003d8c29e013"),
+        {resp3::type::map, 1, 3, ""},
+        string_node(4, "hostname"),
+        string_node(4, "redis-2"),
+    };
+
+    auto res = parse_cluster_slots(nodes);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST_REQUIRE(res->size() == 2u);
+    BOOST_TEST(res->at(0).first == 0u);
+    BOOST_TEST(res->at(0).last == 5460u);
+    BOOST_TEST(res->at(0).host == "127.0.0.1");
+    BOOST_TEST(res->at(0).port == "30001");
+    BOOST_TEST(res->at(1).first == 5461u);
+    BOOST_TEST(res->at(1).last == 16383u);
+    BOOST_TEST(res->at(1).host == "redis-2");
+    BOOST_TEST(res->at(1).port == "30002");
+}
+
+BOOST_AUTO_TEST_CASE(parse_cluster_slots_empty)
+{
+    // A cluster with no slots assigned
+    std::vector<resp3::node> nodes{array_node(0, 0)};
+    auto res = parse_cluster_slots(nodes);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST(res->empty());
+}
+
+BOOST_AUTO_TEST_CASE(parse_cluster_slots_error)
+{
+    // A valid range, to be combined with the invalid ones
+    std::vector<resp3::node> valid_range{
+        array_node(3, 1),
+        number_node(2, "0"),
+        number_node(2, "16383"),
+        array_node(3, 2),
+        string_node(3, "localhost"),
+        number_node(3, "6379"),
+        string_node(3, "id"),
+    };
+
+    struct
+    {
+        std::string_view name;
+        std::vector<resp3::node> nodes;
+    } test_cases[] = {
+        {"empty", {}},
+        {"top_level_not_array", {string_node(0, "abc")}},
+        {"range_not_array", {array_node(1, 0), string_node(1, "abc")}},
+        {"range_empty", {array_node(1, 0), array_node(0, 1)}},
+        {"first_not_number", {array_node(1, 0), array_node(3, 1), string_node(2, "0")}},
+        {"first_nan",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "abc"),
+          number_node(2, "16383"),
+          array_node(2, 2),
+          string_node(3, "localhost"),
+          number_node(3, "6379")}},
+        {"last_out_of_range",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "0"),
+          number_node(2, "16384"),
+          array_node(2, 2),
+          string_node(3, "localhost"),
+          number_node(3, "6379")}},
+        {"last_lt_first",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "10"),
+          number_node(2, "9"),
+          array_node(2, 2),
+          string_node(3, "localhost"),
+          number_node(3, "6379")}},
+        {"no_primary", {array_node(1, 0), array_node(2, 1), number_node(2, "0"), number_node(2, "16383")}},
+        {"primary_not_array",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "0"),
+          number_node(2, "16383"),
+          string_node(2, "a")}},
+        {"primary_empty",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "0"),
+          number_node(2, "16383"),
+          array_node(0, 2)}},
+        {"no_port",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "0"),
+          number_node(2, "16383"),
+          array_node(1, 2),
+          string_node(3, "localhost")}},
+        {"port_not_number",
+         {array_node(1, 0),
+          array_node(3, 1),
+          number_node(2, "0"),
+          number_node(2, "16383"),
+          array_node(2, 2),
+          string_node(3, "localhost"),
+          string_node(3, "6379")}},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            BOOST_TEST(parse_cluster_slots(tc.nodes).error() == error_code(errc::redis_parse_error));
+
+            // Also fails if a valid range precedes the invalid one
+            if (tc.nodes.size() > 1u)
+            {
+                std::vector<resp3::node> nodes{array_node(2, 0)};
+                nodes.insert(nodes.end(), valid_range.begin(), valid_range.end());
+                nodes.insert(nodes.end(), tc.nodes.begin() + 1, tc.nodes.end());
+                BOOST_TEST(parse_cluster_slots(nodes).error() == error_code(errc::redis_parse_error));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
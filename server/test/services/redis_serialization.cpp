@@ -15,8 +15,13 @@
 #include <boost/test/unit_test.hpp>
 
 #include <chrono>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "business_types.hpp"
+#include "timestamp.hpp"
 
 namespace resp3 = boost::redis::resp3;
 using namespace chat;
@@ -134,6 +139,55 @@ BOOST_AUTO_TEST_CASE(parse_room_history_error)
     BOOST_TEST(res.error() == error_code(errc::redis_parse_error));
 }
 
+BOOST_AUTO_TEST_CASE(parse_room_history_views_success)
+{
+    // Input data
+    message msg1{"100-1", "Test message", parse_timestamp(1691666793896), 11};
+    std::vector<resp3::node> nodes{
+        array_node(2, 0),
+        array_node(2, 1),
+        string_node(2, msg1.id),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, serialize_redis_message(msg1)),
+        array_node(2, 1),
+        string_node(2, "90-1"),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, R"%({"user_id":12,"content":"Legacy \"message\"","timestamp":1691666793897})%"),
+    };
+
+    // Call the function
+    auto res = parse_room_history_views(nodes);
+    const auto& val = res.value();
+
+    // Validate
+    BOOST_TEST_REQUIRE(val.messages.size() == 2u);
+    BOOST_TEST(val.messages[0].id == "100-1");
+    BOOST_TEST(val.messages[0].content == "Test message");
+    BOOST_TEST(val.messages[0].user_id == 11);
+    BOOST_TEST(serialize_timestamp(val.messages[0].timestamp) == 1691666793896);
+    BOOST_TEST(val.messages[1].id == "90-1");
+    BOOST_TEST(val.messages[1].content == "Legacy \"message\"");
+    BOOST_TEST(val.messages[1].user_id == 12);
+    BOOST_TEST(serialize_timestamp(val.messages[1].timestamp) == 1691666793897);
+
+    // Binary messages reference the response, rather than being copied
+    BOOST_TEST(val.messages[0].id.data() == nodes[2].value.data());
+    BOOST_TEST(val.messages[0].content.data() > nodes[5].value.data());
+    BOOST_TEST(val.messages[0].content.data() < nodes[5].value.data() + nodes[5].value.size());
+}
+
+BOOST_AUTO_TEST_CASE(parse_room_history_views_error)
+{
+    // Views only support a single response
+    std::vector<resp3::node> nodes{array_node(0, 0), array_node(0, 0)};
+    BOOST_TEST(parse_room_history_views(nodes).error() == error_code(errc::redis_parse_error));
+
+    // Empty input contains no responses
+    BOOST_TEST(parse_room_history_views({}).error() == error_code(errc::redis_parse_error));
+}
+
 BOOST_AUTO_TEST_CASE(parse_string_list_success)
 {
     // Input data
@@ -174,6 +228,117 @@ BOOST_AUTO_TEST_CASE(parse_string_list_error)
     BOOST_TEST(res.error() == error_code(errc::redis_parse_error));
 }
 
+BOOST_AUTO_TEST_CASE(parse_string_array_success)
+{
+    // Input data
+    std::vector<resp3::node> nodes{array_node(2, 0), string_node(1, "100-1"), string_node(1, "101-2")};
+
+    // Call the function
+    auto res = parse_string_array(nodes);
+    auto& val = res.value();
+
+    // Validate
+    BOOST_TEST(val == std::vector<std::string>({"100-1", "101-2"}));
+}
+
+BOOST_AUTO_TEST_CASE(parse_string_array_empty)
+{
+    std::vector<resp3::node> nodes{array_node(0, 0)};
+    auto res = parse_string_array(nodes);
+    BOOST_TEST(res.value().size() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(parse_string_array_error)
+{
+    constexpr struct
+    {
+        const char* name;
+        std::size_t array_size;
+        std::size_t elm_depth;
+    } test_cases[] = {
+        {"too_few_elements",  3u, 1u},
+        {"too_many_elements", 1u, 1u},
+        {"bad_depth",         2u, 0u},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            std::vector<resp3::node> nodes{
+                array_node(tc.array_size, 0),
+                string_node(tc.elm_depth, "100-1"),
+                string_node(tc.elm_depth, "101-2"),
+            };
+            BOOST_TEST(parse_string_array(nodes).error() == error_code(errc::redis_parse_error));
+        }
+    }
+
+    // Not an array
+    std::vector<resp3::node> nodes{string_node(0, "100-1")};
+    BOOST_TEST(parse_string_array(nodes).error() == error_code(errc::redis_parse_error));
+    BOOST_TEST(parse_string_array({}).error() == error_code(errc::redis_parse_error));
+}
+
+// Creates a node with push type
+static resp3::node push_node(std::size_t size) { return {resp3::type::push, size, 0, ""}; }
+
+BOOST_AUTO_TEST_CASE(parse_pubsub_pushes_success)
+{
+    // Input data
+    std::vector<resp3::node> nodes{
+        // Subscription confirmation, should be skipped
+        push_node(3),
+        string_node(1, "psubscribe"),
+        string_node(1, "pubsub:*"),
+        {resp3::type::number, 0, 1, "1"},
+        // Actual messages
+        push_node(4),
+        string_node(1, "pmessage"),
+        string_node(1, "pubsub:*"),
+        string_node(1, "pubsub:room1"),
+        string_node(1, "node1 hello"),
+        push_node(4),
+        string_node(1, "pmessage"),
+        string_node(1, "pubsub:*"),
+        string_node(1, "pubsub:room2"),
+        string_node(1, "node2 bye"),
+    };
+
+    // Call the function
+    auto res = parse_pubsub_pushes(nodes);
+    auto& val = res.value();
+
+    // Validate
+    BOOST_TEST_REQUIRE(val.size() == 2u);
+    BOOST_TEST(val[0].channel == "pubsub:room1");
+    BOOST_TEST(val[0].payload == "node1 hello");
+    BOOST_TEST(val[1].channel == "pubsub:room2");
+    BOOST_TEST(val[1].payload == "node2 bye");
+}
+
+BOOST_AUTO_TEST_CASE(parse_pubsub_pushes_error)
+{
+    struct
+    {
+        std::string_view name;
+        std::vector<resp3::node> nodes;
+    } test_cases[] = {
+        {"not_a_push",       {array_node(1, 0), string_node(1, "pmessage")}                        },
+        {"missing_attrs",    {push_node(4), string_node(1, "pmessage"), string_node(1, "pubsub:*")}},
+        {"nested_aggregate", {push_node(2), string_node(1, "pmessage"), array_node(0, 1)}          },
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto res = parse_pubsub_pushes(tc.nodes);
+            BOOST_TEST(res.error() == error_code(errc::redis_parse_error));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(serialize_redis_message_success)
 {
     // Input data
@@ -187,9 +352,111 @@ BOOST_AUTO_TEST_CASE(serialize_redis_message_success)
     // Call the function
     auto output = serialize_redis_message(input);
 
+    // Validate: version, zigzag varint user_id, zigzag varint timestamp, content length and content
+    BOOST_TEST(output == std::string("\x01\x16\xf6\x01\x0chello world!"));
+}
+
+BOOST_AUTO_TEST_CASE(deserialize_redis_message_)
+{
+    // Binary format
+    message input{"100-10", "hello world!", parse_timestamp(123), 11};
+    auto res = deserialize_redis_message(serialize_redis_message(input));
+    const auto& msg = res.value();
+    BOOST_TEST(msg.id == "");
+    BOOST_TEST(msg.content == "hello world!");
+    BOOST_TEST(serialize_timestamp(msg.timestamp) == 123);
+    BOOST_TEST(msg.user_id == 11);
+
+    // Legacy JSON format
+    res = deserialize_redis_message(R"%({"user_id":12,"content":"Legacy","timestamp":124})%");
+    BOOST_TEST(res.value().content == "Legacy");
+    BOOST_TEST(res.value().user_id == 12);
+
+    // Errors
+    BOOST_TEST(deserialize_redis_message("\x01\x16").has_error());
+    BOOST_TEST(deserialize_redis_message("").has_error());
+}
+
+BOOST_AUTO_TEST_CASE(parse_room_history_binary)
+{
+    // Serialized messages can be parsed back. Messages in the binary
+    // and JSON formats may be mixed in the same stream
+    message msg1{"100-1", "Test message", parse_timestamp(1691666793896), 11};
+    message msg2{"110-0", std::string("binary\0content\xff", 15), parse_timestamp(0), -2};
+    message msg3{"120-0", "", parse_timestamp(-1), 12};
+    std::vector<resp3::node> nodes{
+        array_node(4, 0),
+        array_node(2, 1),
+        string_node(2, msg1.id),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, serialize_redis_message(msg1)),
+        array_node(2, 1),
+        string_node(2, "105-0"),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, R"%({"user_id":11,"content":"Legacy message","timestamp":1691666793897})%"),
+        array_node(2, 1),
+        string_node(2, msg2.id),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, serialize_redis_message(msg2)),
+        array_node(2, 1),
+        string_node(2, msg3.id),
+        array_node(2, 2),
+        string_node(3, "payload"),
+        string_node(3, serialize_redis_message(msg3)),
+    };
+
+    // Call the function
+    auto res = parse_room_history_batch(nodes);
+    const auto& val = res.value();
+
     // Validate
-    const char* expected = R"%({"user_id":11,"content":"hello world!","timestamp":123})%";
-    BOOST_TEST(boost::json::parse(output) == boost::json::parse(expected));
+    BOOST_TEST_REQUIRE(val.size() == 1u);
+    const auto& msgs = val[0].messages;
+    BOOST_TEST_REQUIRE(msgs.size() == 4u);
+    for (auto [idx, expected] : {std::pair{0u, &msg1}, std::pair{2u, &msg2}, std::pair{3u, &msg3}})
+    {
+        BOOST_TEST_CONTEXT(idx)
+        {
+            BOOST_TEST(msgs[idx].id == expected->id);
+            BOOST_TEST(msgs[idx].content == expected->content);
+            BOOST_TEST(msgs[idx].user_id == expected->user_id);
+            BOOST_TEST(serialize_timestamp(msgs[idx].timestamp) == serialize_timestamp(expected->timestamp));
+        }
+    }
+    BOOST_TEST(msgs[1].content == "Legacy message");
+}
+
+BOOST_AUTO_TEST_CASE(parse_room_history_binary_error)
+{
+    constexpr std::string_view test_cases[] = {
+        "\x01",          // no fields
+        "\x01\x16",      // missing timestamp
+        "\x01\x16\xf6",  // unterminated varint
+        "\x01\x16\xf6\x01\x05"
+        "abc",  // content too short
+        "\x01\x16\xf6\x01\x01"
+        "abc",  // content too long
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.size())
+        {
+            std::vector<resp3::node> nodes{
+                array_node(1, 0),
+                array_node(2, 1),
+                string_node(2, "100-1"),
+                array_node(2, 2),
+                string_node(3, "payload"),
+                string_node(3, std::string(tc)),
+            };
+            auto res = parse_room_history_batch(nodes);
+            BOOST_TEST(res.error() == error_code(errc::redis_parse_error));
+        }
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
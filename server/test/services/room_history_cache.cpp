@@ -0,0 +1,214 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/room_history_cache.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "api/api_types.hpp"
+#include "business_types.hpp"
+#include "services/pubsub_service.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+
+namespace {
+
+struct fixture
+{
+    boost::asio::io_context ctx;
+    std::unique_ptr<pubsub_service> pubsub{create_pubsub_service(ctx.get_executor())};
+    std::shared_ptr<room_history_cache> cache{std::make_shared<room_history_cache>(*pubsub, 3u)};
+    static constexpr std::string_view room_ids[] = {"r1", "r2"};
+
+    // Publishes a message, as chat sessions do
+    void publish(std::string_view room_id, std::string id, const user& sender)
+    {
+        message msgs[] = {
+            {std::move(id), "content", parse_timestamp(100), sender.id}
+        };
+        pubsub->publish(room_id, server_messages_event{room_id, sender, msgs}.to_json());
+    }
+
+    // Returns the IDs of the cached messages for a room
+    std::vector<std::string> cached_ids(std::size_t room_idx)
+    {
+        auto res = cache->get(room_ids);
+        BOOST_TEST_REQUIRE(res.has_value());
+        std::vector<std::string> ids;
+        for (const auto& msg : res->first.at(room_idx).messages)
+            ids.push_back(msg.id);
+        return ids;
+    }
+};
+
+using string_vector = std::vector<std::string>;
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(room_history_cache_)
+
+BOOST_FIXTURE_TEST_CASE(load, fixture)
+{
+    // Initially empty
+    BOOST_TEST(!cache->get(room_ids).has_value());
+
+    // Load
+    std::vector<message_batch> batches{
+        {{{"2-0", "c2", parse_timestamp(2), 10}, {"1-0", "c1", parse_timestamp(1), 11}}, false},
+        {{}, false},
+    };
+    cache->begin_load(room_ids);
+    BOOST_TEST(!cache->get(room_ids).has_value());
+    cache->finish_load(room_ids, batches, {{10, "user10"}, {11, "user11"}});
+
+    // Retrieve
+    auto res = cache->get(room_ids);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST_REQUIRE(res->first.size() == 2u);
+    BOOST_TEST(cached_ids(0) == (string_vector{"2-0", "1-0"}));
+    BOOST_TEST(!res->first[0].has_more);
+    BOOST_TEST(res->first[1].messages.empty());
+    BOOST_TEST((res->second == username_map{{10, "user10"}, {11, "user11"}}));
+
+    // Messages are stored encoded
+    BOOST_TEST_REQUIRE(res->first[0].messages[0].encoded != nullptr);
+    BOOST_TEST(*res->first[0].messages[0].encoded == *encode_message(batches[0].messages[0], "user10"));
+}
+
+BOOST_FIXTURE_TEST_CASE(new_messages, fixture)
+{
+    // Load
+    std::vector<message_batch> batches{
+        {{{"2-0", "c2", parse_timestamp(2), 10}, {"1-0", "c1", parse_timestamp(1), 10}}, false},
+        {{}, false},
+    };
+    cache->begin_load(room_ids);
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+
+    // New messages are added to the cache
+    publish("r1", "3-0", user{12, "user12"});
+    BOOST_TEST(cached_ids(0) == (string_vector{"3-0", "2-0", "1-0"}));
+    BOOST_TEST(!cache->get(room_ids)->first[0].has_more);
+    BOOST_TEST(cache->get(room_ids)->second.at(12) == "user12");
+    BOOST_TEST(cache->get(room_ids)->first[0].messages[0].encoded != nullptr);
+
+    // Old messages are discarded
+    publish("r1", "4-0", user{12, "user12"});
+    BOOST_TEST(cached_ids(0) == (string_vector{"4-0", "3-0", "2-0"}));
+    BOOST_TEST(cache->get(room_ids)->first[0].has_more);
+
+    // Other rooms are not affected
+    BOOST_TEST(cached_ids(1) == string_vector{});
+}
+
+BOOST_FIXTURE_TEST_CASE(messages_while_loading, fixture)
+{
+    // Start loading
+    cache->begin_load(room_ids);
+
+    // Messages arrive. One of them is included in the loaded batch
+    publish("r1", "2-0", user{10, "user10"});
+    publish("r1", "3-0", user{10, "user10"});
+
+    // Finish loading
+    std::vector<message_batch> batches{
+        {{{"2-0", "c2", parse_timestamp(2), 10}, {"1-0", "c1", parse_timestamp(1), 10}}, false},
+        {{}, false},
+    };
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+
+    // All messages are present, without duplicates
+    BOOST_TEST(cached_ids(0) == (string_vector{"3-0", "2-0", "1-0"}));
+}
+
+BOOST_FIXTURE_TEST_CASE(abort_load, fixture)
+{
+    // A failed load leaves the cache empty
+    cache->begin_load(room_ids);
+    publish("r1", "2-0", user{10, "user10"});
+    cache->abort_load(room_ids);
+    BOOST_TEST(!cache->get(room_ids).has_value());
+
+    // Messages while not loading are ignored
+    publish("r1", "3-0", user{10, "user10"});
+
+    // A subsequent load works
+    std::vector<message_batch> batches{
+        {{{"1-0", "c1", parse_timestamp(1), 10}}, false},
+        {{}, false},
+    };
+    cache->begin_load(room_ids);
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+    BOOST_TEST(cached_ids(0) == string_vector{"1-0"});
+}
+
+BOOST_FIXTURE_TEST_CASE(corrections, fixture)
+{
+    // Load
+    std::vector<message_batch> batches{
+        {{{"1-0", "c1", parse_timestamp(1), 10}}, false},
+        {{}, false},
+    };
+    cache->begin_load(room_ids);
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+
+    // Messages broadcast before being stored
+    publish("r1", "5-1", user{10, "user10"});
+    publish("r1", "6-1", user{10, "user10"});
+    BOOST_TEST(cached_ids(0) == (string_vector{"6-1", "5-1", "1-0"}));
+
+    // Redis stored them with different IDs, changing their order
+    std::vector<message_id_correction> corrections{
+        {"5-1", "7-0"},
+        {"3-0", "8-0"},  // not in the cache, ignored
+    };
+    pubsub->publish("r1", server_messages_corrected_event{"r1", corrections}.to_json());
+    BOOST_TEST(cached_ids(0) == (string_vector{"7-0", "6-1", "1-0"}));
+
+    // The encoded message uses the new ID
+    auto res = cache->get(room_ids);
+    const auto& corrected = res->first[0].messages[0];
+    BOOST_TEST_REQUIRE(corrected.encoded != nullptr);
+    BOOST_TEST(*corrected.encoded == *encode_message(corrected, "user10"));
+
+    // Lost messages are removed
+    corrections = {
+        {"6-1", ""}
+    };
+    pubsub->publish("r1", server_messages_corrected_event{"r1", corrections}.to_json());
+    BOOST_TEST(cached_ids(0) == (string_vector{"7-0", "1-0"}));
+}
+
+BOOST_FIXTURE_TEST_CASE(corrections_while_loading, fixture)
+{
+    // Messages arrive while loading, and get corrected
+    cache->begin_load(room_ids);
+    publish("r1", "5-1", user{10, "user10"});
+    publish("r1", "6-1", user{10, "user10"});
+    std::vector<message_id_correction> corrections{
+        {"5-1", "7-0"},
+        {"6-1", ""   },
+    };
+    pubsub->publish("r1", server_messages_corrected_event{"r1", corrections}.to_json());
+
+    // Finish loading
+    std::vector<message_batch> batches{
+        {{{"1-0", "c1", parse_timestamp(1), 10}}, false},
+        {{}, false},
+    };
+    cache->finish_load(room_ids, batches, {{10, "user10"}});
+    BOOST_TEST(cached_ids(0) == (string_vector{"7-0", "1-0"}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,227 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/search_index.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "business_types.hpp"
+#include "timestamp.hpp"
+
+using namespace chat;
+
+namespace {
+
+message make_message(std::string id, std::string content)
+{
+    return {std::move(id), std::move(content), parse_timestamp(1000), 42};
+}
+
+// The IDs of the messages returned by a search
+std::vector<std::string> search_ids(
+    const search_index& index,
+    std::string_view room_id,
+    std::string_view query,
+    std::size_t max_results = 100u
+)
+{
+    std::vector<std::string> res;
+    for (const auto& msg : index.search(room_id, query, max_results))
+        res.push_back(msg.id);
+    return res;
+}
+
+constexpr search_index_config default_config{100u, 1024u * 1024u};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(search_index_)
+
+BOOST_AUTO_TEST_CASE(tokenize_search_terms_)
+{
+    using vec = std::vector<std::string>;
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+        vec expected;
+    } test_cases[] = {
+        {"empty",        "",                        vec{}                              },
+        {"one_word",     "hello",                   vec{"hello"}                       },
+        {"sorted",       "world hello",             vec{"hello", "world"}              },
+        {"lowercase",    "Hello WORLD",             vec{"hello", "world"}              },
+        {"punctuation",  "hello, world! (again)",   vec{"again", "hello", "world"}     },
+        {"digits",       "room 42b",                vec{"42b", "room"}                 },
+        {"duplicates",   "hi HI hi",                vec{"hi"}                          },
+        {"non_ascii",    "caf\xc3\xa9 ni\xc3\xb1o", vec{"caf\xc3\xa9", "ni\xc3\xb1o"}},
+        {"only_symbols", "!!! ... ???",             vec{}                              },
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            BOOST_TEST(tokenize_search_terms(tc.input) == tc.expected);
+        }
+    }
+
+    // Terms that are too long are discarded
+    auto long_term = std::string(max_search_term_size + 1u, 'a');
+    BOOST_TEST(tokenize_search_terms(long_term + " b") == vec{"b"});
+    BOOST_TEST(tokenize_search_terms(long_term.substr(1u)) == vec{long_term.substr(1u)});
+}
+
+BOOST_AUTO_TEST_CASE(search)
+{
+    search_index index(default_config);
+    std::vector<message> msgs{
+        make_message("1-1", "Hello world"),
+        make_message("1-2", "hello there"),
+        make_message("1-3", "The world is big"),
+    };
+    index.add_messages("room1", msgs);
+    msgs = {make_message("2-1", "hello from room 2")};
+    index.add_messages("room2", msgs);
+
+    // Results are the messages containing all the terms, most recent first
+    BOOST_TEST(search_ids(index, "room1", "hello") == std::vector<std::string>({"1-2", "1-1"}));
+    BOOST_TEST(search_ids(index, "room1", "WORLD") == std::vector<std::string>({"1-3", "1-1"}));
+    BOOST_TEST(search_ids(index, "room1", "hello world") == std::vector<std::string>({"1-1"}));
+    BOOST_TEST(search_ids(index, "room2", "hello") == std::vector<std::string>({"2-1"}));
+
+    // Messages are returned in full
+    auto res = index.search("room1", "big", 10u);
+    BOOST_TEST_REQUIRE(res.size() == 1u);
+    BOOST_TEST(res[0].content == "The world is big");
+    BOOST_TEST(res[0].user_id == 42);
+    BOOST_TEST(serialize_timestamp(res[0].timestamp) == 1000);
+
+    // No results
+    BOOST_TEST(search_ids(index, "room1", "goodbye").empty());
+    BOOST_TEST(search_ids(index, "room1", "hello goodbye").empty());
+    BOOST_TEST(search_ids(index, "room1", "").empty());
+    BOOST_TEST(search_ids(index, "room1", "!!").empty());
+    BOOST_TEST(search_ids(index, "room3", "hello").empty());
+
+    // Limiting the number of results keeps the most recent ones
+    BOOST_TEST(search_ids(index, "room1", "hello", 1u) == std::vector<std::string>({"1-2"}));
+    BOOST_TEST(search_ids(index, "room1", "hello", 0u).empty());
+}
+
+BOOST_AUTO_TEST_CASE(max_room_messages)
+{
+    // Only the most recent messages of each room are kept
+    search_index index({4u, 1024u * 1024u});
+    for (int i = 0; i < 20; ++i)
+    {
+        std::vector<message> msgs{make_message("1-" + std::to_string(i), "common " + std::to_string(i))};
+        index.add_messages("room1", msgs);
+    }
+    std::vector<std::string> expected{"1-19", "1-18", "1-17", "1-16"};
+    BOOST_TEST(search_ids(index, "room1", "common") == expected);
+    BOOST_TEST(search_ids(index, "room1", "15").empty());
+    BOOST_TEST(search_ids(index, "room1", "17") == std::vector<std::string>({"1-17"}));
+}
+
+BOOST_AUTO_TEST_CASE(max_bytes)
+{
+    // When the index uses too much memory, the least recently updated rooms are removed
+    search_index index({1000u, 4096u});
+    std::vector<message> msgs{make_message("1-1", std::string(1000, 'a') + " hello")};
+    index.add_messages("room1", msgs);
+    index.add_messages("room2", msgs);
+    index.add_messages("room3", msgs);
+    BOOST_TEST(index.num_rooms() == 3u);
+    index.add_messages("room1", msgs);  // room1 is now the most recently updated
+    index.add_messages("room4", msgs);
+    BOOST_TEST(index.memory_usage() <= 4096u);
+    BOOST_TEST(search_ids(index, "room2", "hello").empty());
+    BOOST_TEST(search_ids(index, "room4", "hello").size() == 1u);
+    BOOST_TEST(search_ids(index, "room1", "hello").size() == 2u);
+
+    // The most recently updated room is never removed
+    search_index small_index({1000u, 10u});
+    small_index.add_messages("room1", msgs);
+    BOOST_TEST(search_ids(small_index, "room1", "hello").size() == 1u);
+    small_index.add_messages("room2", msgs);
+    BOOST_TEST(small_index.num_rooms() == 1u);
+    BOOST_TEST(search_ids(small_index, "room2", "hello").size() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(posting_list_encoding)
+{
+    // Message numbers needing several varint bytes are decoded correctly
+    search_index index({1000u, 64u * 1024u * 1024u});
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::vector<message> msgs{
+            make_message("1-" + std::to_string(i), i % 300 == 0 ? "rare common" : "common")
+        };
+        index.add_messages("room1", msgs);
+    }
+    std::vector<std::string> expected{"1-900", "1-600", "1-300", "1-0"};
+    BOOST_TEST(search_ids(index, "room1", "rare") == expected);
+    BOOST_TEST(search_ids(index, "room1", "common", 1000u).size() == 1000u);
+}
+
+BOOST_AUTO_TEST_CASE(sharded)
+{
+    // Rooms are partitioned between shards running in different threads,
+    // and can be updated and searched from any of them
+    boost::asio::io_context ctx, other_ctx;
+    std::vector<boost::asio::any_io_executor> executors{ctx.get_executor(), other_ctx.get_executor()};
+    sharded_search_index index(executors, default_config);
+
+    boost::asio::spawn(
+        ctx,
+        [&](boost::asio::yield_context yield) {
+            for (int i = 0; i < 10; ++i)
+            {
+                std::vector<message> msgs{make_message("1-" + std::to_string(i), "hello")};
+                index.add_messages("room" + std::to_string(i), msgs);
+            }
+
+            // Searches are run by the owner after the messages posted before them
+            for (int i = 0; i < 10; ++i)
+            {
+                auto res = index.search("room" + std::to_string(i), "hello", 10u, yield);
+                BOOST_TEST_REQUIRE(res.size() == 1u);
+                BOOST_TEST(res[0].id == "1-" + std::to_string(i));
+            }
+            BOOST_TEST(index.search("room0", "goodbye", 10u, yield).empty());
+            BOOST_TEST(index.search("room0", "", 10u, yield).empty());
+            BOOST_TEST(index.search("room10", "hello", 10u, yield).empty());
+
+            // Statistics add up all the shards
+            BOOST_TEST(index.num_rooms() == 10u);
+            BOOST_TEST(index.memory_usage() > 0u);
+        },
+        [](std::exception_ptr ptr) {
+            if (ptr)
+                std::rethrow_exception(ptr);
+        }
+    );
+
+    auto work = boost::asio::make_work_guard(other_ctx);
+    std::thread other_thread([&other_ctx] { other_ctx.run(); });
+    ctx.run();
+    work.reset();
+    other_thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,177 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/session_token.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+namespace {
+
+using clock_type = std::chrono::system_clock;
+const auto t0 = clock_type::time_point{} + std::chrono::hours(24 * 365 * 50);
+const auto expiry = t0 + std::chrono::hours(1);
+
+const std::string secret1(32, 'a');
+const std::string secret2(40, 'b');
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(session_token_)
+
+BOOST_AUTO_TEST_CASE(sign_verify)
+{
+    session_token_signer signer({
+        {1u, secret1}
+    });
+    auto token = signer.sign(42, "some_user", expiry);
+    BOOST_TEST(is_session_token(token));
+
+    auto claims = signer.verify(token, t0);
+    BOOST_TEST_REQUIRE(claims.has_value());
+    BOOST_TEST(claims->user_id == 42);
+    BOOST_TEST(claims->username == "some_user");
+    BOOST_TEST((claims->expiry == expiry));
+    BOOST_TEST(!claims->token_id.empty());
+
+    // Each token gets a different ID
+    auto token2 = signer.sign(42, "some_user", expiry);
+    BOOST_TEST(token2 != token);
+    BOOST_TEST(signer.verify(token2, t0)->token_id != claims->token_id);
+}
+
+BOOST_AUTO_TEST_CASE(session_ids_are_not_tokens)
+{
+    // Session IDs stored in Redis are base64 strings
+    BOOST_TEST(!is_session_token("kHtT6D5yJtQbY1hvD5V6zg=="));
+    BOOST_TEST(!is_session_token(""));
+}
+
+BOOST_AUTO_TEST_CASE(expired)
+{
+    session_token_signer signer({
+        {1u, secret1}
+    });
+    auto token = signer.sign(42, "some_user", expiry);
+    BOOST_TEST(signer.verify(token, expiry - std::chrono::seconds(1)).has_value());
+    BOOST_TEST(signer.verify(token, expiry).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify(token, expiry + std::chrono::hours(1)).error() == errc::requires_auth);
+}
+
+BOOST_AUTO_TEST_CASE(key_rotation)
+{
+    session_token_signer old_signer({
+        {1u, secret1}
+    });
+    session_token_signer new_signer({
+        {2u, secret2},
+        {1u, secret1}
+    });
+    session_token_signer rotated_signer({
+        {2u, secret2}
+    });
+    auto old_token = old_signer.sign(42, "some_user", expiry);
+    auto new_token = new_signer.sign(43, "other_user", expiry);
+
+    // Tokens signed with the old key are accepted until the key is removed
+    BOOST_TEST(new_signer.verify(old_token, t0)->user_id == 42);
+    BOOST_TEST(new_signer.verify(new_token, t0)->user_id == 43);
+    BOOST_TEST(rotated_signer.verify(new_token, t0)->user_id == 43);
+    BOOST_TEST(rotated_signer.verify(old_token, t0).error() == errc::requires_auth);
+    BOOST_TEST(old_signer.verify(new_token, t0).error() == errc::requires_auth);
+
+    // A key with the same ID but a different secret doesn't verify the token
+    session_token_signer other_secret({
+        {1u, secret2}
+    });
+    BOOST_TEST(other_secret.verify(old_token, t0).error() == errc::requires_auth);
+}
+
+BOOST_AUTO_TEST_CASE(tampered)
+{
+    session_token_signer signer({
+        {1u, secret1}
+    });
+    auto token = signer.sign(42, "some_user", expiry);
+    auto dot = token.find('.');
+
+    // Changing any character invalidates the token (or its base64 encoding).
+    // The last character of each part may only contain padding bits, which are ignored
+    for (std::size_t i = 0; i < token.size(); ++i)
+    {
+        if (i == dot || i == dot - 1u || i == token.size() - 1u)
+            continue;
+        BOOST_TEST_CONTEXT(i)
+        {
+            auto modified = token;
+            modified[i] = modified[i] == 'A' ? 'B' : 'A';
+            BOOST_TEST(!signer.verify(modified, t0).has_value());
+        }
+    }
+
+    // Malformed tokens
+    BOOST_TEST(signer.verify("", t0).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify(".", t0).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify(token.substr(0, dot), t0).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify(token.substr(0, dot + 1u), t0).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify(token + "A", t0).error() == errc::requires_auth);
+    BOOST_TEST(signer.verify("AAAA." + token.substr(dot + 1u), t0).error() == errc::requires_auth);
+}
+
+BOOST_AUTO_TEST_CASE(parse_session_token_keys_success)
+{
+    auto keys = parse_session_token_keys("2:" + secret2 + ",1:" + secret1);
+    BOOST_TEST_REQUIRE(keys.has_value());
+    BOOST_TEST_REQUIRE(keys->size() == 2u);
+    BOOST_TEST(keys->at(0).id == 2u);
+    BOOST_TEST(keys->at(0).secret == secret2);
+    BOOST_TEST(keys->at(1).id == 1u);
+    BOOST_TEST(keys->at(1).secret == secret1);
+
+    // Secrets may contain colons
+    keys = parse_session_token_keys("10:" + secret1 + ":x");
+    BOOST_TEST_REQUIRE(keys.has_value());
+    BOOST_TEST(keys->at(0).id == 10u);
+    BOOST_TEST(keys->at(0).secret == secret1 + ":x");
+}
+
+BOOST_AUTO_TEST_CASE(parse_session_token_keys_error)
+{
+    struct
+    {
+        std::string_view name;
+        std::string input;
+    } test_cases[] = {
+        {"empty",          ""                                   },
+        {"no_colon",       secret1                              },
+        {"empty_id",       ":" + secret1                        },
+        {"invalid_id",     "a1:" + secret1                      },
+        {"negative_id",    "-1:" + secret1                      },
+        {"short_secret",   "1:" + secret1.substr(1u)            },
+        {"duplicate_id",   "1:" + secret1 + ",1:" + secret2     },
+        {"trailing_comma", "1:" + secret1 + ","                 },
+        {"empty_entry",    "1:" + secret1 + ",,2:" + secret2    },
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            BOOST_TEST(parse_session_token_keys(tc.input).error() == errc::invalid_config);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/startup.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(startup_tracker_)
+
+BOOST_AUTO_TEST_CASE(lifecycle)
+{
+    startup_tracker tracker(2u);
+    BOOST_TEST(!tracker.db_ready());
+    BOOST_TEST(!tracker.ready());
+    BOOST_TEST(tracker.startup_time().count() == 0);
+
+    tracker.on_db_ready();
+    BOOST_TEST(tracker.db_ready());
+    BOOST_TEST(!tracker.ready());
+
+    // Notifying the schema twice doesn't count as a shard
+    tracker.on_db_ready();
+    BOOST_TEST(!tracker.ready());
+
+    // Ready once all shards have warmed up
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    tracker.on_shard_warm();
+    BOOST_TEST(!tracker.ready());
+    tracker.on_shard_warm();
+    BOOST_TEST(tracker.ready());
+    BOOST_TEST(tracker.startup_time().count() >= 5);
+
+    // History is reloaded once all shards have loaded their caches from the databases
+    BOOST_TEST(!tracker.history_reloaded());
+    tracker.on_shard_reloaded();
+    BOOST_TEST(!tracker.history_reloaded());
+    tracker.on_shard_reloaded();
+    BOOST_TEST(tracker.history_reloaded());
+}
+
+BOOST_AUTO_TEST_CASE(warm_from_snapshot)
+{
+    // Shards warmed up from a snapshot are warm before the schema is set up,
+    // but the server is only ready once it is
+    startup_tracker tracker(1u);
+    tracker.on_shard_warm();
+    BOOST_TEST(!tracker.ready());
+    BOOST_TEST(tracker.startup_time().count() == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    tracker.on_db_ready();
+    BOOST_TEST(tracker.ready());
+    BOOST_TEST(tracker.startup_time().count() >= 5);
+
+    // The history is reloaded afterwards
+    BOOST_TEST(!tracker.history_reloaded());
+    tracker.on_shard_reloaded();
+    BOOST_TEST(tracker.history_reloaded());
+}
+
+BOOST_AUTO_TEST_CASE(concurrent)
+{
+    // Shards warm up in their own threads
+    startup_tracker tracker(8u);
+    tracker.on_db_ready();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i)
+        threads.emplace_back([&tracker] { tracker.on_shard_warm(); });
+    for (auto& t : threads)
+        t.join();
+    BOOST_TEST(tracker.ready());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
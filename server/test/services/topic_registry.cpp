@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/topic_registry.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "services/pubsub_service.hpp"
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(topic_registry_)
+
+struct stub_subscriber final : public message_subscriber
+{
+    void on_message(std::shared_ptr<const framed_message>) override final {}
+};
+
+// The subscribers of a topic, sorted, to make comparisons independent of the order
+static std::vector<const message_subscriber*> get_subscribers(
+    const topic_registry& reg,
+    std::string_view topic_id
+)
+{
+    std::vector<const message_subscriber*> res;
+    for (const auto& sub : reg.subscribers(topic_id))
+        res.push_back(sub.get());
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static std::vector<const message_subscriber*> sorted(std::vector<const message_subscriber*> v)
+{
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(intern)
+{
+    topic_registry reg;
+
+    // Handles are dense
+    BOOST_TEST(reg.intern("t1") == 0u);
+    BOOST_TEST(reg.intern("t2") == 1u);
+    BOOST_TEST(reg.intern("t1") == 0u);
+    BOOST_TEST(reg.num_topics() == 2u);
+
+    // Lookup
+    BOOST_TEST(reg.find("t2").value() == 1u);
+    BOOST_TEST(!reg.find("t3").has_value());
+}
+
+BOOST_AUTO_TEST_CASE(subscribe_unsubscribe)
+{
+    topic_registry reg;
+    auto sub1 = std::make_shared<stub_subscriber>();
+    auto sub2 = std::make_shared<stub_subscriber>();
+    auto sub3 = std::make_shared<stub_subscriber>();
+    const std::string_view topics12[] = {"t1", "t2"};
+    const std::string_view topics2[] = {"t2"};
+    const std::string_view topics13[] = {"t1", "t3"};
+
+    reg.subscribe(sub1, topics12);
+    reg.subscribe(sub2, topics2);
+    reg.subscribe(sub3, topics13);
+    BOOST_TEST(get_subscribers(reg, "t1") == sorted({sub1.get(), sub3.get()}));
+    BOOST_TEST(get_subscribers(reg, "t2") == sorted({sub1.get(), sub2.get()}));
+    BOOST_TEST(get_subscribers(reg, "t3") == sorted({sub3.get()}));
+    BOOST_TEST(get_subscribers(reg, "other").empty());
+
+    // Removing the first subscriber moves others to its slots
+    reg.unsubscribe(*sub1);
+    BOOST_TEST(get_subscribers(reg, "t1") == sorted({sub3.get()}));
+    BOOST_TEST(get_subscribers(reg, "t2") == sorted({sub2.get()}));
+    BOOST_TEST(get_subscribers(reg, "t3") == sorted({sub3.get()}));
+
+    // Moved subscribers can be removed, too
+    reg.unsubscribe(*sub3);
+    BOOST_TEST(get_subscribers(reg, "t1").empty());
+    BOOST_TEST(get_subscribers(reg, "t2") == sorted({sub2.get()}));
+    BOOST_TEST(get_subscribers(reg, "t3").empty());
+
+    // Unsubscribing twice is a no-op
+    reg.unsubscribe(*sub3);
+    BOOST_TEST(get_subscribers(reg, "t2") == sorted({sub2.get()}));
+
+    // Topics stay interned
+    BOOST_TEST(reg.num_topics() == 3u);
+}
+
+BOOST_AUTO_TEST_CASE(unsubscribe_not_subscribed)
+{
+    topic_registry reg;
+    stub_subscriber sub;
+    reg.unsubscribe(sub);
+    BOOST_TEST(reg.num_topics() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(duplicate_subscriptions)
+{
+    // A subscriber subscribed several times to a topic gets all its subscriptions removed
+    topic_registry reg;
+    auto sub1 = std::make_shared<stub_subscriber>();
+    auto sub2 = std::make_shared<stub_subscriber>();
+    const std::string_view topics1[] = {"t1", "t1", "t1"};
+    const std::string_view topics2[] = {"t1"};
+    reg.subscribe(sub2, topics2);
+    reg.subscribe(sub1, topics1);
+    reg.subscribe(sub2, topics2);
+    BOOST_TEST(reg.subscribers("t1").size() == 5u);
+
+    reg.unsubscribe(*sub1);
+    BOOST_TEST(get_subscribers(reg, "t1") == sorted({sub2.get(), sub2.get()}));
+
+    reg.unsubscribe(*sub2);
+    BOOST_TEST(get_subscribers(reg, "t1").empty());
+}
+
+BOOST_AUTO_TEST_CASE(many_subscribers)
+{
+    // Remove subscribers in an order different to the insertion one,
+    // to exercise the position updates
+    topic_registry reg;
+    const std::string_view topics[] = {"t1", "t2"};
+    std::vector<std::shared_ptr<stub_subscriber>> subs;
+    for (int i = 0; i < 20; ++i)
+    {
+        subs.push_back(std::make_shared<stub_subscriber>());
+        reg.subscribe(subs.back(), topics);
+    }
+
+    std::vector<const message_subscriber*> expected;
+    for (const auto& sub : subs)
+        expected.push_back(sub.get());
+
+    for (std::size_t i : {3u, 0u, 19u, 10u, 11u, 1u, 18u})
+    {
+        reg.unsubscribe(*subs[i]);
+        expected.erase(std::find(expected.begin(), expected.end(), subs[i].get()));
+        BOOST_TEST_CONTEXT(i)
+        {
+            BOOST_TEST(get_subscribers(reg, "t1") == sorted(expected));
+            BOOST_TEST(get_subscribers(reg, "t2") == sorted(expected));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
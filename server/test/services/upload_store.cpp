@@ -0,0 +1,272 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "services/upload_store.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "error.hpp"
+
+using namespace chat;
+namespace fs = std::filesystem;
+
+namespace {
+
+// An empty temporary directory
+fs::path make_upload_dir()
+{
+    auto res = fs::temp_directory_path() / "servertech_chat_uploads";
+    fs::remove_all(res);
+    return res;
+}
+
+// A store in a temporary directory, removed on destruction
+struct upload_fixture
+{
+    fs::path dir{make_upload_dir()};
+    upload_store store{dir.string(), 100u, 3u, std::chrono::hours(1)};
+
+    ~upload_fixture() { fs::remove_all(dir); }
+
+    std::string create(std::uint64_t size = 10u, std::int64_t user_id = 42)
+    {
+        auto res = store.create(user_id, size, "image/png");
+        BOOST_TEST_REQUIRE(res.has_value());
+        return std::move(*res);
+    }
+
+    fs::path file_path(const std::string& id, std::string_view extension) const
+    {
+        return dir / (id + std::string(extension));
+    }
+
+    // Makes an upload look like it hasn't been written for a while
+    void make_stale(const std::string& id) const
+    {
+        auto path = file_path(id, ".part");
+        fs::last_write_time(path, fs::last_write_time(path) - std::chrono::hours(2));
+    }
+
+    std::string read_data(const std::string& id) const
+    {
+        std::ifstream is(store.data_path(id), std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
+};
+
+void write(upload_writer& writer, std::string_view data)
+{
+    BOOST_TEST_REQUIRE(writer.write({data.data(), data.size()}) == error_code());
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(upload_store_)
+
+BOOST_AUTO_TEST_CASE(is_upload_id_)
+{
+    struct
+    {
+        std::string_view name;
+        std::string_view input;
+        bool expected;
+    } test_cases[] = {
+        {"valid",     "0123456789abcdef0123456789abcdef",  true },
+        {"empty",     "",                                  false},
+        {"short",     "0123456789abcdef0123456789abcde",   false},
+        {"long",      "0123456789abcdef0123456789abcdef0", false},
+        {"uppercase", "0123456789ABCDEF0123456789abcdef",  false},
+        {"traversal", "../../../../../../../../etc/passw", false},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            BOOST_TEST(is_upload_id(tc.input) == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(is_valid_upload_content_type_)
+{
+    struct
+    {
+        std::string_view name;
+        std::string input;
+        bool expected;
+    } test_cases[] = {
+        {"simple",        "image/png",                 true },
+        {"params",        "text/plain; charset=utf-8", true },
+        {"empty",         "",                          false},
+        {"no_slash",      "image",                     false},
+        {"empty_type",    "/png",                      false},
+        {"empty_subtype", "image/",                    false},
+        {"newline",       "image/png\nfoo",            false},
+        {"too_long",      "a/" + std::string(99, 'b'), false},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            BOOST_TEST(is_valid_upload_content_type(tc.input) == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(create_and_write)
+{
+    upload_fixture fix;
+    auto id = fix.create();
+    BOOST_TEST(is_upload_id(id));
+
+    // A new upload is empty
+    auto info = fix.store.get(id);
+    BOOST_TEST_REQUIRE(info.has_value());
+    BOOST_TEST(info->user_id == 42);
+    BOOST_TEST(info->size == 10u);
+    BOOST_TEST(info->offset == 0u);
+    BOOST_TEST(info->content_type == "image/png");
+    BOOST_TEST(!info->complete());
+
+    // Write some data
+    {
+        auto writer = fix.store.open_writer(id);
+        BOOST_TEST_REQUIRE(writer.has_value());
+        BOOST_TEST(writer->offset() == 0u);
+        write(*writer, "0123");
+        BOOST_TEST(writer->offset() == 4u);
+    }
+    BOOST_TEST(fix.store.get(id)->offset == 4u);
+    BOOST_TEST(!fs::exists(fix.store.data_path(id)));
+
+    // Resume and complete it
+    {
+        auto writer = fix.store.open_writer(id);
+        BOOST_TEST_REQUIRE(writer.has_value());
+        BOOST_TEST(writer->offset() == 4u);
+        write(*writer, "45");
+        write(*writer, "6789");
+    }
+    info = fix.store.get(id);
+    BOOST_TEST_REQUIRE(info.has_value());
+    BOOST_TEST(info->complete());
+    BOOST_TEST(fix.read_data(id) == "0123456789");
+
+    // Complete uploads can't be written
+    BOOST_TEST(fix.store.open_writer(id).error() == error_code(errc::not_found));
+}
+
+BOOST_AUTO_TEST_CASE(single_writer)
+{
+    // Only one writer can have an upload open at a time
+    upload_fixture fix;
+    auto id = fix.create();
+    auto writer = fix.store.open_writer(id);
+    BOOST_TEST_REQUIRE(writer.has_value());
+    BOOST_TEST(fix.store.open_writer(id).error() == error_code(errc::upload_in_progress));
+
+    // Closing it releases the lock
+    *writer = upload_writer();
+    BOOST_TEST(fix.store.open_writer(id).has_value());
+}
+
+BOOST_AUTO_TEST_CASE(not_found)
+{
+    upload_fixture fix;
+    const std::string id = "0123456789abcdef0123456789abcdef";
+    BOOST_TEST(fix.store.get(id).error() == error_code(errc::not_found));
+    BOOST_TEST(fix.store.open_writer(id).error() == error_code(errc::not_found));
+}
+
+BOOST_AUTO_TEST_CASE(ids_are_unique)
+{
+    upload_fixture fix;
+    BOOST_TEST(fix.create() != fix.create());
+}
+
+BOOST_AUTO_TEST_CASE(max_pending)
+{
+    // Each user may have a limited number of incomplete uploads
+    upload_fixture fix;
+    auto id = fix.create(4u);
+    fix.create();
+    fix.create();
+    BOOST_TEST(fix.store.create(42, 10u, "image/png").error() == error_code(errc::too_many_uploads));
+
+    // Other users are not affected
+    fix.create(10u, 43);
+
+    // Completing an upload makes room for another one
+    {
+        auto writer = fix.store.open_writer(id);
+        BOOST_TEST_REQUIRE(writer.has_value());
+        write(*writer, "0123");
+    }
+    fix.create();
+    BOOST_TEST(fix.store.create(42, 10u, "image/png").error() == error_code(errc::too_many_uploads));
+
+    // As does abandoning one
+    auto abandoned = fix.create(10u, 43);
+    fix.create(10u, 43);
+    fix.make_stale(abandoned);
+    fix.create(10u, 43);
+    BOOST_TEST(fix.store.get(abandoned).error() == error_code(errc::not_found));
+}
+
+BOOST_AUTO_TEST_CASE(remove_abandoned)
+{
+    upload_fixture fix;
+    auto abandoned = fix.create();
+    auto recent = fix.create();
+    auto open = fix.create();
+    auto complete = fix.create(4u, 43);
+    {
+        auto writer = fix.store.open_writer(complete);
+        BOOST_TEST_REQUIRE(writer.has_value());
+        write(*writer, "0123");
+    }
+    fix.make_stale(abandoned);
+    fix.make_stale(open);
+    auto writer = fix.store.open_writer(open);
+    BOOST_TEST_REQUIRE(writer.has_value());
+
+    // Only uploads that haven't been written for a while and aren't open are removed
+    BOOST_TEST(fix.store.remove_abandoned() == 1u);
+    BOOST_TEST(fix.store.get(abandoned).error() == error_code(errc::not_found));
+    BOOST_TEST(!fs::exists(fix.file_path(abandoned, ".part")));
+    BOOST_TEST(!fs::exists(fix.file_path(abandoned, ".meta")));
+    BOOST_TEST(!fs::exists(fix.dir / "pending" / "42" / abandoned));
+    BOOST_TEST(fix.store.get(recent).has_value());
+    BOOST_TEST(fix.store.get(open).has_value());
+    BOOST_TEST(fix.store.get(complete)->complete());
+
+    // Pending files of complete uploads are removed, too
+    BOOST_TEST(!fs::exists(fix.dir / "pending" / "43" / complete));
+    BOOST_TEST(fs::exists(fix.dir / "pending" / "42" / recent));
+
+    // Metadata files left by crashes are removed
+    *writer = upload_writer();
+    fs::remove(fix.file_path(recent, ".part"));
+    auto meta = fix.file_path(recent, ".meta");
+    fs::last_write_time(meta, fs::last_write_time(meta) - std::chrono::hours(2));
+    BOOST_TEST(fix.store.remove_abandoned() == 2u);
+    BOOST_TEST(!fs::exists(meta));
+    BOOST_TEST(!fs::exists(fix.file_path(open, ".part")));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
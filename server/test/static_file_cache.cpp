@@ -0,0 +1,162 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "static_file_cache.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+using namespace chat;
+namespace fs = std::filesystem;
+
+namespace {
+
+// A temporary document root, removed on destruction
+struct doc_root_fixture
+{
+    fs::path root{fs::temp_directory_path() / "servertech_chat_static_file_cache"};
+
+    doc_root_fixture()
+    {
+        fs::remove_all(root);
+        fs::create_directories(root / "sub");
+    }
+    ~doc_root_fixture() { fs::remove_all(root); }
+
+    void write(std::string_view rel_path, std::string_view content) const
+    {
+        std::ofstream os(root / rel_path, std::ios::binary);
+        os.write(content.data(), content.size());
+    }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(static_file_cache_)
+
+BOOST_AUTO_TEST_CASE(choose_content_encoding_)
+{
+    constexpr struct
+    {
+        std::string_view accept_encoding;
+        bool has_gzip;
+        bool has_br;
+        content_encoding expected;
+    } test_cases[] = {
+        {"gzip, deflate, br",    true,  true,  content_encoding::br      },
+        {"gzip, deflate, br",    true,  false, content_encoding::gzip    },
+        {"gzip, deflate, br",    false, false, content_encoding::identity},
+        {"gzip",                 true,  true,  content_encoding::gzip    },
+        {"GZip;q=0.5",           true,  true,  content_encoding::gzip    },
+        {"x-gzip",               true,  false, content_encoding::gzip    },
+        {"br;q=0, gzip",         true,  true,  content_encoding::gzip    },
+        {"br;q=0.000, gzip;q=0", true,  true,  content_encoding::identity},
+        {"*",                    true,  true,  content_encoding::br      },
+        {"*;q=0",                true,  true,  content_encoding::identity},
+        {"*, br;q=0",            true,  true,  content_encoding::gzip    },
+        {"identity",             true,  true,  content_encoding::identity},
+        {"",                     true,  true,  content_encoding::identity},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.accept_encoding)
+        {
+            auto actual = choose_content_encoding(tc.accept_encoding, tc.has_gzip, tc.has_br);
+            BOOST_TEST(to_string(actual) == to_string(tc.expected));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(etag_matches_)
+{
+    BOOST_TEST(etag_matches(R"("abc")", R"("abc")"));
+    BOOST_TEST(etag_matches(R"(W/"abc")", R"("abc")"));
+    BOOST_TEST(etag_matches(R"("other", "abc")", R"("abc")"));
+    BOOST_TEST(etag_matches("*", R"("abc")"));
+    BOOST_TEST(!etag_matches(R"("other")", R"("abc")"));
+    BOOST_TEST(!etag_matches(R"("abc-gzip")", R"("abc")"));
+    BOOST_TEST(!etag_matches("", R"("abc")"));
+}
+
+BOOST_AUTO_TEST_CASE(add_find)
+{
+    static_file_cache cache;
+    cache.add("/index.html", "<html></html>", std::string("gzipped"), std::nullopt);
+
+    // Found
+    const auto* entry = cache.find("/index.html");
+    BOOST_TEST_REQUIRE(entry != nullptr);
+    BOOST_TEST(entry->identity.content == "<html></html>");
+    BOOST_TEST_REQUIRE(entry->gzip.has_value());
+    BOOST_TEST(entry->get(content_encoding::gzip).content == "gzipped");
+    BOOST_TEST(!entry->br.has_value());
+    BOOST_TEST(cache.size_bytes() == 20u);
+
+    // ETags are quoted and differ between representations
+    const auto& etag = entry->identity.etag;
+    BOOST_TEST(etag.size() > 2u);
+    BOOST_TEST(etag.front() == '"');
+    BOOST_TEST(etag.back() == '"');
+    BOOST_TEST(entry->gzip->etag != etag);
+
+    // ETags depend on content
+    cache.add("/other.html", "<html>other</html>", std::nullopt, std::nullopt);
+    BOOST_TEST(cache.find("/other.html")->identity.etag != etag);
+
+    // Not found
+    BOOST_TEST(cache.find("/index") == nullptr);
+    BOOST_TEST(cache.find("/index.html.gz") == nullptr);
+}
+
+BOOST_FIXTURE_TEST_CASE(load, doc_root_fixture)
+{
+    write("index.html", "hello");
+    write("index.html.gz", "hello gzip");
+    write("index.html.br", "hello br");
+    write("sub/app.js", "var a;");
+    write("big.txt", std::string(100, 'a'));
+
+    auto cache = static_file_cache::load(root.string(), 1000u, 50u);
+
+    // Files and their variants are loaded
+    const auto* entry = cache.find("/index.html");
+    BOOST_TEST_REQUIRE(entry != nullptr);
+    BOOST_TEST(entry->identity.content == "hello");
+    BOOST_TEST(entry->get(content_encoding::gzip).content == "hello gzip");
+    BOOST_TEST(entry->get(content_encoding::br).content == "hello br");
+    BOOST_TEST_REQUIRE(cache.find("/sub/app.js") != nullptr);
+    BOOST_TEST(!cache.find("/sub/app.js")->gzip.has_value());
+
+    // Variants are not served on their own, and big files are served from disk
+    BOOST_TEST(cache.find("/index.html.gz") == nullptr);
+    BOOST_TEST(cache.find("/big.txt") == nullptr);
+    BOOST_TEST(cache.size() == 2u);
+}
+
+BOOST_FIXTURE_TEST_CASE(load_max_total_size, doc_root_fixture)
+{
+    write("a.js", "0123456789");
+    write("b.js", "0123456789");
+
+    // Only one of the files fits
+    auto cache = static_file_cache::load(root.string(), 15u, 50u);
+    BOOST_TEST(cache.size() == 1u);
+    BOOST_TEST(cache.size_bytes() == 10u);
+}
+
+BOOST_AUTO_TEST_CASE(load_nonexistent_root)
+{
+    auto cache = static_file_cache::load("/this/directory/does/not/exist", 1000u, 50u);
+    BOOST_TEST(cache.size() == 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
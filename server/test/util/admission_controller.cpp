@@ -0,0 +1,117 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/admission_controller.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <utility>
+
+#include "util/websocket_frame.hpp"
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(admission_controller_)
+
+BOOST_AUTO_TEST_CASE(max_connections)
+{
+    admission_controller ctl(2u, 0u);
+    auto t1 = ctl.try_admit(100u);
+    auto t2 = ctl.try_admit(100u);
+    auto t3 = ctl.try_admit(100u);
+    BOOST_TEST(static_cast<bool>(t1));
+    BOOST_TEST(static_cast<bool>(t2));
+    BOOST_TEST(!t3);
+    BOOST_TEST(ctl.num_connections() == 2u);
+    BOOST_TEST(ctl.reserved_memory() == 200u);
+
+    // Releasing a connection makes room for another one
+    t1 = admission_controller::ticket();
+    BOOST_TEST(ctl.num_connections() == 1u);
+    BOOST_TEST(ctl.reserved_memory() == 100u);
+    auto t4 = ctl.try_admit(100u);
+    BOOST_TEST(static_cast<bool>(t4));
+}
+
+BOOST_AUTO_TEST_CASE(memory_budget)
+{
+    admission_controller ctl(0u, 250u);
+    auto t1 = ctl.try_admit(100u);
+    auto t2 = ctl.try_admit(100u);
+    auto t3 = ctl.try_admit(100u);
+    BOOST_TEST(static_cast<bool>(t1));
+    BOOST_TEST(static_cast<bool>(t2));
+    BOOST_TEST(!t3);
+
+    // Rejected connections don't count
+    BOOST_TEST(ctl.num_connections() == 2u);
+    BOOST_TEST(ctl.reserved_memory() == 200u);
+
+    // Smaller connections may still fit
+    auto t4 = ctl.try_admit(50u);
+    BOOST_TEST(static_cast<bool>(t4));
+    BOOST_TEST(ctl.reserved_memory() == 250u);
+}
+
+BOOST_AUTO_TEST_CASE(reserve)
+{
+    admission_controller ctl(0u, 250u);
+    auto t1 = ctl.try_admit(100u);
+    BOOST_TEST_REQUIRE(static_cast<bool>(t1));
+    BOOST_TEST(t1.reserve(100u));
+    BOOST_TEST(t1.reserved_memory() == 200u);
+
+    // Exceeding the budget leaves the ticket unchanged
+    BOOST_TEST(!t1.reserve(100u));
+    BOOST_TEST(t1.reserved_memory() == 200u);
+    BOOST_TEST(ctl.reserved_memory() == 200u);
+
+    // Everything is released together
+    {
+        auto t2 = std::move(t1);
+        BOOST_TEST(!t1);
+        BOOST_TEST(t2.reserved_memory() == 200u);
+    }
+    BOOST_TEST(ctl.num_connections() == 0u);
+    BOOST_TEST(ctl.reserved_memory() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(unlimited)
+{
+    admission_controller ctl(0u, 0u);
+    auto t1 = ctl.try_admit(1000000u);
+    auto t2 = ctl.try_admit(1000000u);
+    BOOST_TEST(static_cast<bool>(t1));
+    BOOST_TEST(static_cast<bool>(t2));
+    BOOST_TEST(t1.reserve(1000000u));
+    BOOST_TEST(ctl.reserved_memory() == 3000000u);
+}
+
+BOOST_AUTO_TEST_CASE(costs)
+{
+    admission_config cfg;
+    cfg.session_stack_size = 64u * 1024u;
+    cfg.websocket_max_message_size = 16u * 1024u;
+
+    // Stacks and TLS are accounted for
+    BOOST_TEST(http_connection_cost(cfg, false) > cfg.session_stack_size);
+    BOOST_TEST(http_connection_cost(cfg, true) > http_connection_cost(cfg, false));
+
+    // Compression state is accounted for, and depends on the window size
+    websocket_compression_options compression;
+    compression.enabled = false;
+    BOOST_TEST(websocket_session_cost(cfg, compression) == cfg.websocket_max_message_size);
+    compression.enabled = true;
+    compression.window_bits = 9;
+    auto small_window_cost = websocket_session_cost(cfg, compression);
+    compression.window_bits = 15;
+    auto big_window_cost = websocket_session_cost(cfg, compression);
+    BOOST_TEST(small_window_cost > cfg.websocket_max_message_size);
+    BOOST_TEST(big_window_cost > small_window_cost);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
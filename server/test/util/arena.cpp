@@ -0,0 +1,71 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/arena.hpp"
+
+#include <boost/json/parse.hpp>
+#include <boost/json/value.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <memory_resource>
+#include <vector>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(arena_)
+
+BOOST_AUTO_TEST_CASE(reset_reuses_memory)
+{
+    arena a(1024u);
+
+    // Allocate some memory
+    const void* first = nullptr;
+    {
+        std::pmr::vector<int> v(a.resource());
+        v.reserve(16u);
+        first = v.data();
+    }
+
+    // Without resetting, memory is not reused
+    {
+        std::pmr::vector<int> v(a.resource());
+        v.reserve(16u);
+        BOOST_TEST(v.data() != first);
+    }
+
+    // After resetting, allocations start from the beginning of the buffer again
+    a.reset();
+    {
+        std::pmr::vector<int> v(a.resource());
+        v.reserve(16u);
+        BOOST_TEST(v.data() == first);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(exhausted)
+{
+    // Allocations larger than the buffer still succeed
+    arena a(64u);
+    std::pmr::vector<char> v(a.resource());
+    v.resize(4096u, 'a');
+    BOOST_TEST(v.back() == 'a');
+}
+
+BOOST_AUTO_TEST_CASE(json)
+{
+    arena a;
+    for (int i = 0; i < 3; ++i)
+    {
+        auto val = boost::json::parse(R"({"key": [1, 2, "a long enough string value"]})", a.json_storage());
+        BOOST_TEST(val.storage().get() == a.json_storage().get());
+        BOOST_TEST(val.at("key").at(2).as_string() == "a long enough string value");
+        val = nullptr;
+        a.reset();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
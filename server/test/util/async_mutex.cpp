@@ -10,13 +10,18 @@
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/experimental/channel.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <cstddef>
 #include <exception>
 #include <functional>
+#include <thread>
+#include <vector>
 
 #include "error.hpp"
 
@@ -138,4 +143,132 @@ BOOST_AUTO_TEST_CASE(lock_contention)
     });
 }
 
+BOOST_AUTO_TEST_CASE(fifo_order)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        // I/O objects
+        async_mutex mtx(yield.get_executor());
+        std::vector<int> order;
+
+        // Lock the mutex, and launch coroutines that wait for it
+        mtx.lock(yield);
+        for (int i = 0; i < 3; ++i)
+        {
+            spawn_coroutine(yield.get_executor(), [&mtx, &order, i](boost::asio::yield_context yield) {
+                mtx.lock(yield);
+                order.push_back(i);
+                mtx.unlock();
+            });
+        }
+        boost::asio::post(yield);
+        BOOST_TEST(mtx.num_waiters() == 3u);
+
+        // Waiters acquire the mutex in the order they called lock
+        mtx.unlock();
+        while (mtx.locked())
+            boost::asio::post(yield);
+        BOOST_TEST(order == std::vector<int>({0, 1, 2}));
+    });
+}
+
+BOOST_AUTO_TEST_CASE(direct_handoff)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        // I/O objects
+        async_mutex mtx(yield.get_executor());
+        bool acquired = false;
+
+        // Lock the mutex, and launch a coroutine that waits for it
+        mtx.lock(yield);
+        spawn_coroutine(yield.get_executor(), [&](boost::asio::yield_context yield) {
+            mtx.lock(yield);
+            acquired = true;
+            mtx.unlock();
+        });
+        boost::asio::post(yield);
+
+        // Unlocking hands the mutex to the waiter. It's not released in between,
+        // so another coroutine can't get it before the waiter (barging)
+        mtx.unlock();
+        BOOST_TEST(mtx.locked());
+        BOOST_TEST(mtx.num_waiters() == 0u);
+        BOOST_TEST(!mtx.try_lock());
+        BOOST_TEST(!acquired);
+
+        // Coroutines calling lock now wait for the waiter to finish
+        mtx.lock(yield);
+        BOOST_TEST(acquired);
+        mtx.unlock();
+        BOOST_TEST(!mtx.locked());
+    });
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_lock)
+{
+    // I/O objects
+    concurrent_async_mutex mtx;
+
+    // Coroutines running in different threads and io_contexts
+    // increment a counter that is only protected by the mutex
+    constexpr std::size_t num_threads = 4u, num_coroutines = 4u, num_iterations = 1000u;
+    std::size_t counter = 0u;
+    std::size_t max_holders = 0u, holders = 0u;
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&] {
+            boost::asio::io_context ctx;
+            for (std::size_t j = 0; j < num_coroutines; ++j)
+            {
+                spawn_coroutine(ctx.get_executor(), [&](boost::asio::yield_context yield) {
+                    for (std::size_t k = 0; k < num_iterations; ++k)
+                    {
+                        auto guard = mtx.lock_with_guard(yield);
+                        ++holders;
+                        max_holders = (std::max)(max_holders, holders);
+                        auto value = counter;
+                        boost::asio::post(yield);  // Let other coroutines run while we hold the mutex
+                        counter = value + 1u;
+                        --holders;
+                    }
+                });
+            }
+            ctx.run();
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    BOOST_TEST(counter == num_threads * num_coroutines * num_iterations);
+    BOOST_TEST(max_holders == 1u);
+    BOOST_TEST(!mtx.locked());
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_fifo_order)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        // I/O objects
+        concurrent_async_mutex mtx;
+        std::vector<int> order;
+
+        // Lock the mutex, and launch coroutines that wait for it
+        mtx.lock(yield);
+        for (int i = 0; i < 3; ++i)
+        {
+            spawn_coroutine(yield.get_executor(), [&mtx, &order, i](boost::asio::yield_context yield) {
+                auto guard = mtx.lock_with_guard(yield);
+                order.push_back(i);
+            });
+        }
+        boost::asio::post(yield);
+
+        // Ownership is handed to the waiters in order
+        mtx.unlock();
+        BOOST_TEST(!mtx.try_lock());
+        mtx.lock(yield);
+        BOOST_TEST(order == std::vector<int>({0, 1, 2}));
+        mtx.unlock();
+    });
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,7 +10,10 @@
 #include <boost/core/span.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <cstddef>
+#include <string>
 #include <string_view>
+#include <vector>
 
 using namespace chat;
 using namespace std::string_view_literals;
@@ -140,4 +143,69 @@ BOOST_AUTO_TEST_CASE(decode_error)
     }
 }
 
+// The vectorized kernels process long inputs in blocks, and the scalar code takes over at the end.
+// Check that all supported kernels produce the same results for lengths around block boundaries
+constexpr base64_kernel all_kernels[] = {base64_kernel::scalar, base64_kernel::ssse3, base64_kernel::avx2};
+
+static std::vector<unsigned char> make_input(std::size_t size)
+{
+    std::vector<unsigned char> res(size);
+    for (std::size_t i = 0; i < size; ++i)
+        res[i] = static_cast<unsigned char>(i * 97u + 13u);
+    return res;
+}
+
+BOOST_AUTO_TEST_CASE(kernels_scalar_supported) { BOOST_TEST(base64_kernel_supported(base64_kernel::scalar)); }
+
+BOOST_AUTO_TEST_CASE(kernels_roundtrip)
+{
+    for (std::size_t size = 0; size < 200u; ++size)
+    {
+        auto input = make_input(size);
+        auto expected = base64_encode(input, true, base64_kernel::scalar);
+        auto expected_no_padding = base64_encode(input, false, base64_kernel::scalar);
+
+        for (auto kernel : all_kernels)
+        {
+            if (!base64_kernel_supported(kernel))
+                continue;
+            BOOST_TEST_CONTEXT("size=" << size << ", kernel=" << static_cast<int>(kernel))
+            {
+                BOOST_TEST(base64_encode(input, true, kernel) == expected);
+                BOOST_TEST(base64_encode(input, false, kernel) == expected_no_padding);
+
+                auto decoded = base64_decode(expected, true, kernel);
+                BOOST_TEST_REQUIRE(decoded.error() == error_code());
+                BOOST_TEST(*decoded == input);
+
+                decoded = base64_decode(expected_no_padding, false, kernel);
+                BOOST_TEST_REQUIRE(decoded.error() == error_code());
+                BOOST_TEST(*decoded == input);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernels_decode_error)
+{
+    // An invalid character at any position within a long input is detected,
+    // regardless of the block it falls in
+    auto encoded = base64_encode(make_input(96u));  // 128 characters
+    for (char invalid : {'!', '-', '_', ' ', '\0', '\x80', '\xff'})
+    {
+        for (std::size_t pos = 0; pos < encoded.size(); ++pos)
+        {
+            std::string input = encoded;
+            input[pos] = invalid;
+            for (auto kernel : all_kernels)
+            {
+                if (!base64_kernel_supported(kernel))
+                    continue;
+                BOOST_TEST_CONTEXT("pos=" << pos << ", char=" << int(invalid) << ", kernel=" << int(kernel))
+                BOOST_TEST(base64_decode(input, true, kernel).error() == error_code(errc::invalid_base64));
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/bloom_filter.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <string>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(bloom_filter_)
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+    bloom_filter filter;
+    BOOST_TEST(!filter.contains(""));
+    BOOST_TEST(!filter.contains("abc"));
+}
+
+BOOST_AUTO_TEST_CASE(no_false_negatives)
+{
+    bloom_filter filter(1000u);
+    for (int i = 0; i < 1000; ++i)
+        filter.add("token-" + std::to_string(i));
+    for (int i = 0; i < 1000; ++i)
+        BOOST_TEST(filter.contains("token-" + std::to_string(i)));
+}
+
+BOOST_AUTO_TEST_CASE(false_positive_rate)
+{
+    // When sized for its elements, the filter rarely contains elements that weren't added
+    bloom_filter filter(1000u);
+    for (int i = 0; i < 1000; ++i)
+        filter.add("token-" + std::to_string(i));
+    std::size_t false_positives = 0u;
+    for (int i = 0; i < 10000; ++i)
+    {
+        if (filter.contains("other-" + std::to_string(i)))
+            ++false_positives;
+    }
+    BOOST_TEST(false_positives < 300u);  // 3%, the expected rate being 1%
+}
+
+BOOST_AUTO_TEST_CASE(memory_usage)
+{
+    // Small filters use a minimum size
+    BOOST_TEST(bloom_filter(0u).memory_usage() == 80u);
+    BOOST_TEST(bloom_filter(10u).memory_usage() == 80u);
+
+    // 10 bits per element
+    BOOST_TEST(bloom_filter(6400u).memory_usage() == 8000u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
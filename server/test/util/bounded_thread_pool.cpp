@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/bounded_thread_pool.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "error.hpp"
+
+using namespace chat;
+
+// Spawns a coroutine and runs it until completion
+static void run_coroutine(std::function<void(boost::asio::yield_context)> fn)
+{
+    boost::asio::io_context ctx;
+    boost::asio::spawn(ctx, std::move(fn), [](std::exception_ptr ptr) {
+        if (ptr)
+            std::rethrow_exception(ptr);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_SUITE(bounded_thread_pool_)
+
+BOOST_AUTO_TEST_CASE(run_success)
+{
+    bounded_thread_pool pool(1, 10);
+
+    run_coroutine([&](boost::asio::yield_context yield) {
+        // The function runs in a thread different to the caller's
+        auto caller_id = std::this_thread::get_id();
+        auto res = pool.run([caller_id] { return std::this_thread::get_id() != caller_id; }, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res.value());
+
+        // Non-trivial return types work
+        auto res2 = pool.run([] { return std::string("abc"); }, yield);
+        BOOST_TEST_REQUIRE(res2.has_value());
+        BOOST_TEST(res2.value() == "abc");
+
+        // After the coroutine resumes, it's running in the original thread
+        BOOST_TEST((std::this_thread::get_id() == caller_id));
+    });
+
+    auto stats = pool.stats();
+    BOOST_TEST(stats.pending == 0u);
+    BOOST_TEST(stats.rejected == 0u);
+    BOOST_TEST(stats.completed == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(run_exception)
+{
+    bounded_thread_pool pool(1, 10);
+
+    run_coroutine([&](boost::asio::yield_context yield) {
+        // Exceptions are propagated to the calling coroutine
+        BOOST_CHECK_THROW(
+            pool.run([]() -> int { throw std::runtime_error("error"); }, yield),
+            std::runtime_error
+        );
+
+        // The pool is still usable after that
+        auto res = pool.run([] { return 42; }, yield);
+        BOOST_TEST_REQUIRE(res.has_value());
+        BOOST_TEST(res.value() == 42);
+    });
+
+    BOOST_TEST(pool.stats().pending == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(run_queue_full)
+{
+    // A pool that doesn't allow any pending work
+    bounded_thread_pool pool(1, 0);
+
+    run_coroutine([&](boost::asio::yield_context yield) {
+        bool called = false;
+        auto res = pool.run(
+            [&called] {
+                called = true;
+                return 0;
+            },
+            yield
+        );
+        BOOST_TEST(res.error() == error_code(errc::queue_full));
+        BOOST_TEST(!called);
+    });
+
+    auto stats = pool.stats();
+    BOOST_TEST(stats.pending == 0u);
+    BOOST_TEST(stats.rejected == 1u);
+    BOOST_TEST(stats.completed == 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,87 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/circuit_breaker.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+
+using namespace chat;
+using std::chrono::milliseconds;
+
+BOOST_AUTO_TEST_SUITE(circuit_breaker_)
+
+// Opens after 3 failures, for 1 second
+constexpr circuit_breaker_params params{3u, milliseconds(1000)};
+
+BOOST_AUTO_TEST_CASE(opens_after_failures)
+{
+    auto now = circuit_breaker::clock_type::now();
+    circuit_breaker breaker(params);
+    BOOST_TEST(breaker.allow(now));
+
+    // Failures below the threshold don't open the circuit
+    BOOST_TEST(!breaker.on_failure(now));
+    BOOST_TEST(!breaker.on_failure(now));
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::closed));
+    BOOST_TEST(breaker.allow(now));
+
+    // Reaching it does
+    BOOST_TEST(breaker.on_failure(now));
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::open));
+    BOOST_TEST(!breaker.allow(now));
+    BOOST_TEST(!breaker.allow(now + milliseconds(999)));
+}
+
+BOOST_AUTO_TEST_CASE(success_resets_failures)
+{
+    // Only consecutive failures count
+    auto now = circuit_breaker::clock_type::now();
+    circuit_breaker breaker(params);
+    breaker.on_failure(now);
+    breaker.on_failure(now);
+    breaker.on_success();
+    breaker.on_failure(now);
+    breaker.on_failure(now);
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::closed));
+}
+
+BOOST_AUTO_TEST_CASE(probe_success)
+{
+    auto now = circuit_breaker::clock_type::now();
+    circuit_breaker breaker(params);
+    for (int i = 0; i < 3; ++i)
+        breaker.on_failure(now);
+
+    // Once the open duration elapses, a single probe is let through
+    BOOST_TEST(breaker.allow(now + milliseconds(1000)));
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::half_open));
+    BOOST_TEST(!breaker.allow(now + milliseconds(1000)));
+
+    // A successful probe closes the circuit
+    breaker.on_success();
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::closed));
+    BOOST_TEST(breaker.allow(now + milliseconds(1000)));
+}
+
+BOOST_AUTO_TEST_CASE(probe_failure)
+{
+    auto now = circuit_breaker::clock_type::now();
+    circuit_breaker breaker(params);
+    for (int i = 0; i < 3; ++i)
+        breaker.on_failure(now);
+
+    // A failed probe opens the circuit again, for another open duration
+    BOOST_TEST(breaker.allow(now + milliseconds(1000)));
+    BOOST_TEST(!breaker.on_failure(now + milliseconds(1000)));
+    BOOST_TEST((breaker.get_state() == circuit_breaker::state::open));
+    BOOST_TEST(!breaker.allow(now + milliseconds(1999)));
+    BOOST_TEST(breaker.allow(now + milliseconds(2000)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
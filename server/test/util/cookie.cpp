@@ -9,8 +9,11 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <optional>
 #include <ostream>
+#include <string>
 #include <string_view>
+#include <vector>
 
 using namespace chat;
 
@@ -88,4 +91,46 @@ BOOST_AUTO_TEST_CASE(cookie_list_)
     }
 }
 
+BOOST_AUTO_TEST_CASE(find_cookie)
+{
+    // Long values are scanned in blocks
+    const std::string long_value(100, 'a');
+    const std::string long_sid = long_value + "b";
+    const std::string long_header = "_ga=" + long_value + "; sid=" + long_sid;
+    const std::string long_header_invalid = long_header + ",x; other=val";
+
+    struct
+    {
+        std::string_view header;
+        std::string_view name;
+        std::optional<std::string_view> expected;
+    } test_cases[] = {
+        {"",                         "name",  std::nullopt},
+        {"name=val",                 "name",  "val"       },
+        {"name=",                    "name",  ""          },
+        {"name=\"val\"",             "name",  "\"val\""   },
+        {"  name=val; lang=en-US  ", "lang",  "en-US"     },
+        {"name=val; name=other",     "name",  "val"       },
+        {"name=val; lang=en-US",     "other", std::nullopt},
+        {"name=val; lang=en-US",     "nam",   std::nullopt},
+        {"invalid; lang=en-US",      "lang",  std::nullopt},
+        {"name=val;lang=en-US",      "lang",  std::nullopt},
+        {"name=v\\al; lang=en-US",   "lang",  std::nullopt},
+        {"name=val; lang=\"invalid", "lang",  std::nullopt},
+        {long_header,                "sid",   long_sid    },
+        {long_header_invalid,        "other", std::nullopt},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.header << ", " << tc.name)
+        {
+            auto actual = cookie_list(tc.header).find_cookie(tc.name);
+            BOOST_TEST(actual.has_value() == tc.expected.has_value());
+            if (actual && tc.expected)
+                BOOST_TEST(*actual == *tc.expected);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,58 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/cpu_affinity.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(cpu_affinity)
+
+BOOST_AUTO_TEST_CASE(shard_cpu_)
+{
+    // CPUs are assigned in order, wrapping around
+    std::vector<int> cpus{2, 3, 6};
+    BOOST_TEST(shard_cpu(cpus, 0u) == 2);
+    BOOST_TEST(shard_cpu(cpus, 1u) == 3);
+    BOOST_TEST(shard_cpu(cpus, 2u) == 6);
+    BOOST_TEST(shard_cpu(cpus, 3u) == 2);
+    BOOST_TEST(shard_cpu(cpus, 7u) == 3);
+}
+
+#ifdef __linux__
+
+BOOST_AUTO_TEST_CASE(pin_current_thread_)
+{
+    auto cpus = available_cpus();
+    BOOST_TEST_REQUIRE(!cpus.empty());
+    BOOST_TEST(std::is_sorted(cpus.begin(), cpus.end()));
+
+    // Pin a separate thread, so the test runner's affinity is unchanged
+    error_code ec;
+    std::vector<int> pinned_cpus;
+    std::thread t([&] {
+        ec = pin_current_thread(cpus.back());
+        pinned_cpus = available_cpus();
+    });
+    t.join();
+    BOOST_TEST(ec == error_code());
+    BOOST_TEST(pinned_cpus == std::vector<int>{cpus.back()});
+
+    // Invalid CPUs are rejected
+    BOOST_TEST(pin_current_thread(-1) != error_code());
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -33,6 +33,8 @@ BOOST_AUTO_TEST_CASE(is_email_valid)
         "email@example.co.jp",
         "firstname-lastname@example.com",
         "\xc3\xb1@example.com",  // spanish enye, UTF-8 encoded
+        "email@[123.123.123.123]",
+        "\"email@quoted\"@example.com",
     };
 
     for (auto tc : test_cases)
@@ -58,6 +60,13 @@ BOOST_AUTO_TEST_CASE(is_email_invalid)
         "Abc..123@example.com",
         "”(),:;<>[\\]@example.com",
         "this\\ is\"really\"not\\allowed@example.com",
+        "\"\"@example.com",
+        "email@[123.123.123]",
+        "email@[1234.123.123.123]",
+        "email@example.c",
+        "email@example.c0m",
+        "email\xc2\xa0name@example.com",  // no-break space, UTF-8 encoded
+        "",
     };
 
     for (auto tc : test_cases)
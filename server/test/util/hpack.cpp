@@ -0,0 +1,240 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/hpack.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+namespace {
+
+constexpr std::size_t max_list_size = 16384u;
+
+// Parses a hex string like "8286 8441", ignoring spaces
+std::vector<unsigned char> from_hex(std::string_view hex)
+{
+    std::vector<unsigned char> res;
+    auto digit = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+    for (std::size_t i = 0; i < hex.size(); ++i)
+    {
+        if (hex[i] == ' ')
+            continue;
+        res.push_back(static_cast<unsigned char>(digit(hex[i]) * 16 + digit(hex[i + 1])));
+        ++i;
+    }
+    return res;
+}
+
+boost::span<const unsigned char> to_span(const std::string& s)
+{
+    return {reinterpret_cast<const unsigned char*>(s.data()), s.size()};
+}
+
+std::string to_string(const std::vector<hpack_header>& headers)
+{
+    std::string res;
+    for (const auto& h : headers)
+        res += h.name + ": " + h.value + "\n";
+    return res;
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(hpack)
+
+BOOST_AUTO_TEST_CASE(huffman)
+{
+    // RFC 7541, appendix C.4
+    std::string encoded;
+    hpack_huffman_encode("www.example.com", encoded);
+    BOOST_TEST((encoded == std::string_view("\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff")));
+
+    encoded.clear();
+    hpack_huffman_encode("custom-value", encoded);
+    BOOST_TEST((encoded == std::string_view("\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf")));
+
+    // Roundtrip all byte values
+    std::string all;
+    for (int i = 0; i < 256; ++i)
+        all.push_back(static_cast<char>(i));
+    encoded.clear();
+    hpack_huffman_encode(all, encoded);
+    std::string decoded;
+    BOOST_TEST(hpack_huffman_decode(to_span(encoded), decoded) == error_code());
+    BOOST_TEST(decoded == all);
+}
+
+BOOST_AUTO_TEST_CASE(huffman_errors)
+{
+    std::string out;
+
+    // Padding longer than 7 bits
+    auto long_padding = from_hex("f1e3 c2e5 f23a 6ba0 ab90 f4ff ff");
+    BOOST_TEST(hpack_huffman_decode(long_padding, out) == error_code(errc::hpack_decode_error));
+
+    // Padding that's not a prefix of EOS: '0' is 00000, so 0x00 has 3 bits of zero padding
+    auto zero_padding = from_hex("00");
+    BOOST_TEST(hpack_huffman_decode(zero_padding, out) == error_code(errc::hpack_decode_error));
+
+    // EOS itself
+    auto eos = from_hex("ffff ffff");
+    BOOST_TEST(hpack_huffman_decode(eos, out) == error_code(errc::hpack_decode_error));
+}
+
+BOOST_AUTO_TEST_CASE(decode_requests_without_huffman)
+{
+    // RFC 7541, appendix C.3.1
+    hpack_decoder decoder;
+    std::vector<hpack_header> headers;
+    auto block = from_hex("8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d");
+    BOOST_TEST_REQUIRE(decoder.decode(block, headers, max_list_size) == error_code());
+    BOOST_TEST(
+        to_string(headers) == ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+    );
+    BOOST_TEST(decoder.table().size() == 57u);
+}
+
+BOOST_AUTO_TEST_CASE(decode_requests_with_huffman)
+{
+    // RFC 7541, appendix C.4. Blocks share the dynamic table
+    hpack_decoder decoder;
+    std::vector<hpack_header> headers;
+
+    auto block1 = from_hex("8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff");
+    BOOST_TEST_REQUIRE(decoder.decode(block1, headers, max_list_size) == error_code());
+    BOOST_TEST(
+        to_string(headers) == ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+    );
+    BOOST_TEST(decoder.table().size() == 57u);
+
+    headers.clear();
+    auto block2 = from_hex("8286 84be 5886 a8eb 1064 9cbf");
+    BOOST_TEST_REQUIRE(decoder.decode(block2, headers, max_list_size) == error_code());
+    BOOST_TEST(
+        to_string(headers) ==
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"
+    );
+    BOOST_TEST(decoder.table().size() == 110u);
+
+    headers.clear();
+    auto block3 = from_hex("8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf");
+    BOOST_TEST_REQUIRE(decoder.decode(block3, headers, max_list_size) == error_code());
+    BOOST_TEST(
+        to_string(headers) ==
+        ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+        "custom-key: custom-value\n"
+    );
+    BOOST_TEST(decoder.table().size() == 164u);
+    BOOST_TEST(decoder.table().num_entries() == 3u);
+}
+
+BOOST_AUTO_TEST_CASE(decode_errors)
+{
+    std::vector<hpack_header> headers;
+    auto check_error = [&headers](std::string_view hex) {
+        hpack_decoder decoder;
+        auto block = from_hex(hex);
+        BOOST_TEST(decoder.decode(block, headers, max_list_size) == error_code(errc::hpack_decode_error));
+    };
+
+    // Index zero, and past the end of the tables
+    check_error("80");
+    check_error("be");
+
+    // Truncated string and integer
+    check_error("4088 25a8");
+    check_error("ff");
+
+    // Table size bigger than the one we advertised, and after a field
+    check_error("3fe2 1f");
+    check_error("8220");
+
+    // Header list too big
+    hpack_decoder decoder;
+    auto block = from_hex("8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d");
+    BOOST_TEST(decoder.decode(block, headers, 64u) == error_code(errc::hpack_decode_error));
+}
+
+BOOST_AUTO_TEST_CASE(encode_roundtrip)
+{
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+    std::vector<hpack_header> response{
+        {":status",        "200"                    },
+        {"server",         "beast"                  },
+        {"content-type",   "application/javascript"},
+        {"content-length", "12345"                  },
+        {"set-cookie",     "sid=abc; HttpOnly"      },
+    };
+
+    // The first block inserts server and content-type in the dynamic table
+    std::string block1;
+    encoder.encode(response, block1);
+    std::vector<hpack_header> headers;
+    BOOST_TEST_REQUIRE(decoder.decode(to_span(block1), headers, max_list_size) == error_code());
+    BOOST_TEST(to_string(headers) == to_string(response));
+    BOOST_TEST(encoder.table().num_entries() == 2u);
+    BOOST_TEST(decoder.table().size() == encoder.table().size());
+
+    // The second one references them, so it's much smaller
+    std::string block2;
+    encoder.encode(response, block2);
+    headers.clear();
+    BOOST_TEST_REQUIRE(decoder.decode(to_span(block2), headers, max_list_size) == error_code());
+    BOOST_TEST(to_string(headers) == to_string(response));
+    BOOST_TEST(block2.size() + 20u < block1.size());
+    BOOST_TEST(encoder.table().num_entries() == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(encode_sensitive)
+{
+    // set-cookie is sent as never indexed (0001), with the name from the static table
+    hpack_encoder encoder;
+    std::vector<hpack_header> response{
+        {"set-cookie", "a"},
+    };
+    std::string block;
+    encoder.encode(response, block);
+    BOOST_TEST((block == std::string_view("\x1f\x28\x01" "a", 4)));
+    BOOST_TEST(encoder.table().num_entries() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(encode_table_size_update)
+{
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+    std::vector<hpack_header> response{
+        {"cache-control", "no-cache"},
+    };
+    std::vector<hpack_header> headers;
+
+    std::string block;
+    encoder.encode(response, block);
+    BOOST_TEST_REQUIRE(decoder.decode(to_span(block), headers, max_list_size) == error_code());
+
+    // Shrinking and growing again signals both sizes, so the decoder evicts its entries, too
+    encoder.set_max_table_size(0u);
+    encoder.set_max_table_size(1024u);
+    block.clear();
+    encoder.encode(response, block);
+    BOOST_TEST(block.substr(0, 4) == std::string_view("\x20\x3f\xe1\x07", 4));
+    headers.clear();
+    BOOST_TEST_REQUIRE(decoder.decode(to_span(block), headers, max_list_size) == error_code());
+    BOOST_TEST(to_string(headers) == to_string(response));
+    BOOST_TEST(decoder.table().max_size() == 1024u);
+    BOOST_TEST(decoder.table().num_entries() == 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
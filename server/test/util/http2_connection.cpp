@@ -0,0 +1,508 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/http2_connection.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+#include "util/hpack.hpp"
+
+using namespace chat;
+
+namespace {
+
+constexpr std::uint8_t data_type = 0x0;
+constexpr std::uint8_t headers_type = 0x1;
+constexpr std::uint8_t rst_stream_type = 0x3;
+constexpr std::uint8_t settings_type = 0x4;
+constexpr std::uint8_t ping_type = 0x6;
+constexpr std::uint8_t goaway_type = 0x7;
+constexpr std::uint8_t window_update_type = 0x8;
+constexpr std::uint8_t continuation_type = 0x9;
+
+constexpr std::uint8_t end_stream = 0x1;
+constexpr std::uint8_t ack = 0x1;
+constexpr std::uint8_t end_headers = 0x4;
+
+struct frame
+{
+    std::uint8_t type;
+    std::uint8_t flags;
+    std::uint32_t stream_id;
+    std::string payload;
+};
+
+std::uint32_t read_u32(std::string_view p)
+{
+    auto b = reinterpret_cast<const unsigned char*>(p.data());
+    return (std::uint32_t(b[0]) << 24) | (std::uint32_t(b[1]) << 16) | (std::uint32_t(b[2]) << 8) | b[3];
+}
+
+std::string u32(std::uint32_t value)
+{
+    std::string res;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        res.push_back(static_cast<char>(value >> shift));
+    return res;
+}
+
+std::string make_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload)
+{
+    std::string res;
+    http2_append_frame_header(res, payload.size(), type, flags, id);
+    res.append(payload);
+    return res;
+}
+
+std::vector<frame> parse_frames(std::string_view data)
+{
+    std::vector<frame> res;
+    while (data.size() >= 9u)
+    {
+        auto b = reinterpret_cast<const unsigned char*>(data.data());
+        std::size_t length = (std::size_t(b[0]) << 16) | (std::size_t(b[1]) << 8) | b[2];
+        BOOST_TEST_REQUIRE(data.size() >= 9u + length);
+        std::uint32_t id = read_u32(data.substr(5)) & 0x7fffffffu;
+        res.push_back({b[3], b[4], id, std::string(data.substr(9, length))});
+        data.remove_prefix(9u + length);
+    }
+    BOOST_TEST(data.empty());
+    return res;
+}
+
+// Encodes headers as a client would, with its own encoder. Blocks must be
+// encoded in the order they're sent
+struct client
+{
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+
+    std::string headers_frame(std::uint32_t id, std::vector<hpack_header> headers, std::uint8_t flags)
+    {
+        std::string block;
+        encoder.encode(headers, block);
+        return make_frame(headers_type, flags | end_headers, id, block);
+    }
+
+    std::vector<hpack_header> decode(const frame& f)
+    {
+        std::vector<hpack_header> res;
+        auto ec = decoder.decode(
+            {reinterpret_cast<const unsigned char*>(f.payload.data()), f.payload.size()},
+            res,
+            16384u
+        );
+        BOOST_TEST(ec == error_code());
+        return res;
+    }
+};
+
+std::vector<hpack_header> get_request(std::string path = "/api/rooms")
+{
+    return {
+        {":method",    "GET"      },
+        {":scheme",    "http"     },
+        {":path",      std::move(path)},
+        {":authority", "localhost"},
+    };
+}
+
+boost::span<const unsigned char> to_span(const std::string& s)
+{
+    return {reinterpret_cast<const unsigned char*>(s.data()), s.size()};
+}
+
+std::string preface_and_settings()
+{
+    return std::string(http2_connection::client_preface) + make_frame(settings_type, 0u, 0u, "");
+}
+
+// Writes all the pending frames
+std::vector<frame> write_all(http2_connection& conn)
+{
+    std::string out;
+    while (conn.write_frames(out, 1024u * 1024u))
+        ;
+    return parse_frames(out);
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(http2_connection_)
+
+BOOST_AUTO_TEST_CASE(settings_exchange)
+{
+    http2_connection conn({});
+    BOOST_TEST(conn.on_data(to_span(preface_and_settings())) == error_code());
+
+    // Our settings, then the acknowledgement of theirs
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 2u);
+    BOOST_TEST(frames[0].type == settings_type);
+    BOOST_TEST(frames[0].flags == 0u);
+    BOOST_TEST(frames[0].payload.size() == 12u);
+    BOOST_TEST(frames[1].type == settings_type);
+    BOOST_TEST(frames[1].flags == ack);
+
+    // Pings are echoed
+    BOOST_TEST(conn.on_data(to_span(make_frame(ping_type, 0u, 0u, "abcdefgh"))) == error_code());
+    frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 1u);
+    BOOST_TEST(frames[0].type == ping_type);
+    BOOST_TEST(frames[0].flags == ack);
+    BOOST_TEST(frames[0].payload == "abcdefgh");
+}
+
+BOOST_AUTO_TEST_CASE(bad_preface)
+{
+    http2_connection conn({});
+    write_all(conn);
+
+    // A partial preface is fine
+    std::string partial(http2_connection::client_preface.substr(0, 10));
+    BOOST_TEST(conn.on_data(to_span(partial)) == error_code());
+
+    // HTTP/1.1 is not
+    std::string http1 = "GET / HTTP/1.1\r\n";
+    BOOST_TEST(conn.on_data(to_span(http1)) == error_code(errc::http2_protocol_error));
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 1u);
+    BOOST_TEST(frames[0].type == goaway_type);
+    BOOST_TEST(read_u32(frames[0].payload.substr(4)) == 0x1u);
+}
+
+BOOST_AUTO_TEST_CASE(request_response)
+{
+    http2_connection conn({});
+    client cli;
+
+    // A request delivered byte by byte
+    std::string input = preface_and_settings() + cli.headers_frame(1u, get_request(), end_stream);
+    for (char c : input)
+    {
+        std::string byte(1, c);
+        BOOST_TEST_REQUIRE(conn.on_data(to_span(byte)) == error_code());
+    }
+    write_all(conn);
+
+    auto requests = conn.take_requests();
+    BOOST_TEST_REQUIRE(requests.size() == 1u);
+    BOOST_TEST(requests[0].stream_id == 1u);
+    BOOST_TEST(requests[0].headers.size() == 4u);
+    BOOST_TEST(requests[0].headers[2].value == "/api/rooms");
+    BOOST_TEST(requests[0].body == "");
+    BOOST_TEST(conn.take_requests().empty());
+
+    // The response
+    http2_response res{
+        {{":status", "200"}, {"content-type", "application/json"}},
+        "{\"rooms\":[]}",
+        {}
+    };
+    conn.submit_response(1u, std::move(res));
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 2u);
+    BOOST_TEST(frames[0].type == headers_type);
+    BOOST_TEST(frames[0].flags == end_headers);
+    BOOST_TEST(frames[0].stream_id == 1u);
+    auto headers = cli.decode(frames[0]);
+    BOOST_TEST_REQUIRE(headers.size() == 2u);
+    BOOST_TEST(headers[0].value == "200");
+    BOOST_TEST(headers[1].value == "application/json");
+    BOOST_TEST(frames[1].type == data_type);
+    BOOST_TEST(frames[1].flags == end_stream);
+    BOOST_TEST(frames[1].payload == "{\"rooms\":[]}");
+    BOOST_TEST(conn.num_streams() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(request_with_body_and_continuation)
+{
+    http2_connection conn({});
+    client cli;
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(preface_and_settings())) == error_code());
+    write_all(conn);
+
+    // Headers split in two frames, then the body in two DATA frames
+    std::vector<hpack_header> headers{
+        {":method",       "POST"            },
+        {":scheme",       "http"            },
+        {":path",         "/api/login"      },
+        {"content-type", "application/json"},
+    };
+    std::string block;
+    cli.encoder.encode(headers, block);
+    std::string input = make_frame(headers_type, 0u, 3u, block.substr(0, 5)) +
+                        make_frame(continuation_type, end_headers, 3u, block.substr(5)) +
+                        make_frame(data_type, 0u, 3u, "{\"a\":") +
+                        make_frame(data_type, end_stream, 3u, "1}");
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+
+    auto requests = conn.take_requests();
+    BOOST_TEST_REQUIRE(requests.size() == 1u);
+    BOOST_TEST(requests[0].stream_id == 3u);
+    BOOST_TEST(requests[0].headers.size() == 4u);
+    BOOST_TEST(requests[0].body == "{\"a\":1}");
+
+    // Received data is credited back to the connection and the stream (while it's open)
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 3u);
+    BOOST_TEST(frames[0].type == window_update_type);
+    BOOST_TEST(frames[0].stream_id == 0u);
+    BOOST_TEST(read_u32(frames[0].payload) == 5u);
+    BOOST_TEST(frames[1].type == window_update_type);
+    BOOST_TEST(frames[1].stream_id == 3u);
+    BOOST_TEST(frames[2].type == window_update_type);
+    BOOST_TEST(frames[2].stream_id == 0u);
+    BOOST_TEST(read_u32(frames[2].payload) == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(flow_control)
+{
+    http2_connection conn({});
+    client cli;
+    std::string input = preface_and_settings() + cli.headers_frame(1u, get_request(), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    conn.take_requests();
+    write_all(conn);
+
+    auto data_size = [](const std::vector<frame>& frames) {
+        std::size_t res = 0u;
+        for (const auto& f : frames)
+        {
+            if (f.type == data_type)
+            {
+                BOOST_TEST(f.payload.size() <= 16384u);
+                res += f.payload.size();
+            }
+        }
+        return res;
+    };
+
+    // A body bigger than the default windows (65535)
+    http2_response res{{{":status", "200"}}, std::string(200000u, 'a'), {}};
+    conn.submit_response(1u, std::move(res));
+    BOOST_TEST(data_size(write_all(conn)) == 65535u);
+
+    // Nothing else is sent until the client allows it
+    std::string out;
+    BOOST_TEST(!conn.write_frames(out, 1024u));
+
+    // The connection window is limiting
+    input = make_frame(window_update_type, 0u, 1u, u32(100000u)) +
+            make_frame(window_update_type, 0u, 0u, u32(1000u));
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(data_size(write_all(conn)) == 1000u);
+
+    // The stream window is limiting
+    input = make_frame(window_update_type, 0u, 0u, u32(200000u));
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(data_size(write_all(conn)) == 99000u);
+    BOOST_TEST(conn.num_streams() == 1u);
+
+    // SETTINGS_INITIAL_WINDOW_SIZE applies to open streams, too
+    input = make_frame(settings_type, 0u, 0u, std::string("\x00\x04", 2) + u32(100000u));
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    auto frames = write_all(conn);
+    BOOST_TEST(data_size(frames) == 200000u - 165535u);
+    BOOST_TEST(frames.back().type == data_type);
+    BOOST_TEST(frames.back().flags == end_stream);
+    BOOST_TEST(conn.num_streams() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_streams)
+{
+    http2_connection::config cfg;
+    cfg.max_concurrent_streams = 2u;
+    http2_connection conn(cfg);
+    client cli;
+    std::string input = preface_and_settings();
+    input += cli.headers_frame(1u, get_request("/a"), end_stream);
+    input += cli.headers_frame(3u, get_request("/b"), end_stream);
+    input += cli.headers_frame(5u, get_request("/c"), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().size() == 2u);
+
+    // The third one is refused
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 3u);
+    BOOST_TEST(frames[2].type == rst_stream_type);
+    BOOST_TEST(frames[2].stream_id == 5u);
+    BOOST_TEST(read_u32(frames[2].payload) == 0x7u);
+
+    // Responses can be submitted in any order
+    conn.submit_response(3u, http2_response{{{":status", "204"}}, "", {}});
+    conn.submit_response(1u, http2_response{{{":status", "404"}}, "", {}});
+    frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 2u);
+    BOOST_TEST(frames[0].stream_id == 3u);
+    BOOST_TEST(frames[0].flags == (end_stream | end_headers));
+    BOOST_TEST(cli.decode(frames[0])[0].value == "204");
+    BOOST_TEST(frames[1].stream_id == 1u);
+    BOOST_TEST(cli.decode(frames[1])[0].value == "404");
+}
+
+BOOST_AUTO_TEST_CASE(reset_streams_count_until_handled)
+{
+    http2_connection::config cfg;
+    cfg.max_concurrent_streams = 1u;
+    http2_connection conn(cfg);
+    client cli;
+    std::string input = preface_and_settings();
+    input += cli.headers_frame(1u, get_request("/a"), end_stream);
+    input += make_frame(rst_stream_type, 0u, 1u, u32(0x8u));
+    input += cli.headers_frame(3u, get_request("/b"), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().size() == 1u);
+    BOOST_TEST(conn.num_streams() == 0u);
+
+    // The handler for the reset stream is still running, so the second one is refused
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 3u);
+    BOOST_TEST(frames[2].type == rst_stream_type);
+    BOOST_TEST(frames[2].stream_id == 3u);
+    BOOST_TEST(read_u32(frames[2].payload) == 0x7u);
+
+    // Once it finishes, new streams are accepted
+    conn.submit_response(1u, http2_response{{{":status", "200"}}, "", {}});
+    input = cli.headers_frame(5u, get_request("/c"), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().size() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(control_flood)
+{
+    http2_connection::config cfg;
+    cfg.max_control_size = 1024u;
+    http2_connection conn(cfg);
+    std::string input = preface_and_settings();
+    for (int i = 0; i < 100; ++i)
+        input += make_frame(ping_type, 0u, 0u, "abcdefgh");
+
+    // PING acknowledgements that are never retrieved exceed the limit
+    BOOST_TEST(conn.on_data(to_span(input)) == error_code(errc::http2_protocol_error));
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(!frames.empty());
+    BOOST_TEST(frames.back().type == goaway_type);
+    BOOST_TEST(read_u32(frames.back().payload.substr(4)) == 0xbu);
+}
+
+BOOST_AUTO_TEST_CASE(stream_errors)
+{
+    http2_connection::config cfg;
+    cfg.max_body_size = 4u;
+    http2_connection conn(cfg);
+    client cli;
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(preface_and_settings())) == error_code());
+    write_all(conn);
+
+    // Missing :path, uppercase names, connection-specific headers and newlines are malformed
+    auto no_path = get_request();
+    no_path.erase(no_path.begin() + 2);
+    auto uppercase = get_request();
+    uppercase.push_back({"Accept", "*/*"});
+    auto connection = get_request();
+    connection.push_back({"connection", "keep-alive"});
+    auto newline = get_request();
+    newline.push_back({"x-header", "a\r\nset-cookie: b"});
+
+    // A body bigger than the limit is cancelled
+    std::string input = cli.headers_frame(1u, no_path, end_stream);
+    input += cli.headers_frame(3u, uppercase, end_stream);
+    input += cli.headers_frame(5u, connection, end_stream);
+    input += cli.headers_frame(7u, newline, end_stream);
+    input += cli.headers_frame(9u, get_request(), 0u);
+    input += make_frame(data_type, 0u, 9u, "hello");
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().empty());
+
+    std::vector<std::uint32_t> reset_codes;
+    for (const auto& f : write_all(conn))
+    {
+        if (f.type == rst_stream_type)
+            reset_codes.push_back(read_u32(f.payload));
+    }
+    BOOST_TEST(reset_codes == (std::vector<std::uint32_t>{0x1u, 0x1u, 0x1u, 0x1u, 0x8u}));
+    BOOST_TEST(conn.num_streams() == 0u);
+
+    // Responses to reset streams are ignored
+    conn.submit_response(9u, http2_response{{{":status", "200"}}, "", {}});
+    std::string out;
+    BOOST_TEST(!conn.write_frames(out, 1024u));
+}
+
+BOOST_AUTO_TEST_CASE(connection_errors)
+{
+    auto check_error = [](std::string frames, std::uint32_t expected_code) {
+        http2_connection conn({});
+        std::string input = preface_and_settings() + frames;
+        BOOST_TEST(conn.on_data(to_span(input)) == error_code(errc::http2_protocol_error));
+        auto output = write_all(conn);
+        BOOST_TEST_REQUIRE(!output.empty());
+        BOOST_TEST(output.back().type == goaway_type);
+        BOOST_TEST(read_u32(output.back().payload.substr(4)) == expected_code);
+    };
+
+    client cli;
+
+    // Even stream IDs are reserved for the server
+    check_error(cli.headers_frame(2u, get_request(), end_stream), 0x1u);
+
+    // Stream IDs must increase
+    client cli2;
+    std::string frames = cli2.headers_frame(3u, get_request(), end_stream);
+    frames += cli2.headers_frame(1u, get_request(), end_stream);
+    check_error(frames, 0x5u);
+
+    // Invalid HPACK data
+    check_error(make_frame(headers_type, end_headers | end_stream, 1u, "\x80"), 0x9u);
+
+    // A frame interleaved with a header block
+    check_error(make_frame(headers_type, 0u, 1u, "\x82") + make_frame(ping_type, 0u, 0u, "abcdefgh"), 0x1u);
+
+    // Window overflow
+    check_error(make_frame(window_update_type, 0u, 0u, u32(0x7fffffffu)), 0x3u);
+
+    // Frames bigger than the default maximum size
+    check_error(make_frame(data_type, 0u, 1u, std::string(16385u, 'a')), 0x6u);
+}
+
+BOOST_AUTO_TEST_CASE(shutdown)
+{
+    http2_connection conn({});
+    client cli;
+    std::string input = preface_and_settings() + cli.headers_frame(1u, get_request(), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().size() == 1u);
+    write_all(conn);
+
+    // A GOAWAY with the last stream we processed. The request in progress is completed
+    conn.shutdown();
+    auto frames = write_all(conn);
+    BOOST_TEST_REQUIRE(frames.size() == 1u);
+    BOOST_TEST(frames[0].type == goaway_type);
+    BOOST_TEST(read_u32(frames[0].payload) == 1u);
+    BOOST_TEST(read_u32(frames[0].payload.substr(4)) == 0u);
+    BOOST_TEST(!conn.done());
+
+    // New streams are ignored
+    input = cli.headers_frame(3u, get_request(), end_stream);
+    BOOST_TEST_REQUIRE(conn.on_data(to_span(input)) == error_code());
+    BOOST_TEST(conn.take_requests().empty());
+
+    conn.submit_response(1u, http2_response{{{":status", "200"}}, "", {}});
+    write_all(conn);
+    BOOST_TEST(conn.done());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
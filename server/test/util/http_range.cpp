@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/http_range.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+#include <string_view>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(http_range)
+
+BOOST_AUTO_TEST_CASE(parse_range_header_single)
+{
+    constexpr struct
+    {
+        std::string_view value;
+        std::uint64_t offset;
+        std::uint64_t size;
+    } test_cases[] = {
+        {"bytes=0-99",      0u,   100u },
+        {"bytes=100-199",   100u, 100u },
+        {"bytes=900-",      900u, 100u },
+        {"bytes=500-5000",  500u, 500u },
+        {"bytes=999-999",   999u, 1u   },
+        {"bytes=-100",      900u, 100u },
+        {"bytes=-5000",     0u,   1000u},
+        {" bytes=10-19 ",   10u,  10u  },
+        {"bytes= 10 - 19 ", 10u,  10u  },
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.value)
+        {
+            auto res = parse_range_header(tc.value, 1000u);
+            BOOST_TEST_REQUIRE(res.kind == parsed_range::single);
+            BOOST_TEST(res.range.offset == tc.offset);
+            BOOST_TEST(res.range.size == tc.size);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_range_header_none)
+{
+    // Invalid or unsupported ranges are ignored
+    constexpr std::string_view test_cases[] = {
+        "",
+        "bytes=",
+        "bytes=-",
+        "bytes=10",
+        "bytes=abc-10",
+        "bytes=10-abc",
+        "bytes=20-10",
+        "bytes=+10-20",
+        "bytes=0-10,20-30",
+        "items=0-10",
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc) { BOOST_TEST(parse_range_header(tc, 1000u).kind == parsed_range::none); }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_range_header_unsatisfiable)
+{
+    BOOST_TEST(parse_range_header("bytes=1000-", 1000u).kind == parsed_range::unsatisfiable);
+    BOOST_TEST(parse_range_header("bytes=2000-3000", 1000u).kind == parsed_range::unsatisfiable);
+    BOOST_TEST(parse_range_header("bytes=-0", 1000u).kind == parsed_range::unsatisfiable);
+    BOOST_TEST(parse_range_header("bytes=0-", 0u).kind == parsed_range::unsatisfiable);
+    BOOST_TEST(parse_range_header("bytes=-10", 0u).kind == parsed_range::unsatisfiable);
+}
+
+BOOST_AUTO_TEST_CASE(format_content_range_)
+{
+    BOOST_TEST(format_content_range({0u, 100u}, 1000u) == "bytes 0-99/1000");
+    BOOST_TEST(format_content_range({999u, 1u}, 1000u) == "bytes 999-999/1000");
+    BOOST_TEST(format_unsatisfiable_content_range(1000u) == "bytes */1000");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
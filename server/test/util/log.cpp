@@ -0,0 +1,48 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/log.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <optional>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(log_)
+
+BOOST_AUTO_TEST_CASE(parse_log_level_)
+{
+    BOOST_TEST((parse_log_level("debug") == log_level::debug));
+    BOOST_TEST((parse_log_level("info") == log_level::info));
+    BOOST_TEST((parse_log_level("warning") == log_level::warning));
+    BOOST_TEST((parse_log_level("error") == log_level::error));
+    BOOST_TEST((parse_log_level("") == std::nullopt));
+    BOOST_TEST((parse_log_level("INFO") == std::nullopt));
+    BOOST_TEST((parse_log_level("other") == std::nullopt));
+}
+
+BOOST_AUTO_TEST_CASE(sampler)
+{
+    // Lets through one of every 3 events, starting by the first one
+    log_sampler s{3u};
+    BOOST_TEST(s());
+    BOOST_TEST(!s());
+    BOOST_TEST(!s());
+    BOOST_TEST(s());
+
+    // A rate of 1 lets everything through
+    log_sampler s1{1u};
+    BOOST_TEST(s1());
+    BOOST_TEST(s1());
+
+    // A rate of 0 disables logging
+    log_sampler s0{0u};
+    BOOST_TEST(!s0());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
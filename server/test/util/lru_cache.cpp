@@ -0,0 +1,96 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/lru_cache.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <string>
+
+using namespace chat;
+
+namespace {
+
+using cache_type = lru_cache<int, std::string>;
+const auto t0 = cache_type::clock_type::time_point{} + std::chrono::hours(1);
+const auto t1 = t0 + std::chrono::seconds(10);
+const auto t2 = t0 + std::chrono::seconds(20);
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(lru_cache_)
+
+BOOST_AUTO_TEST_CASE(put_get)
+{
+    cache_type cache(4u);
+    BOOST_TEST(cache.get(1, t0) == nullptr);
+
+    cache.put(1, "v1", t1);
+    cache.put(2, "v2", t1);
+    BOOST_TEST(cache.size() == 2u);
+    BOOST_TEST_REQUIRE(cache.get(1, t0) != nullptr);
+    BOOST_TEST(*cache.get(1, t0) == "v1");
+    BOOST_TEST_REQUIRE(cache.get(2, t0) != nullptr);
+    BOOST_TEST(*cache.get(2, t0) == "v2");
+    BOOST_TEST(cache.get(3, t0) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(expiry)
+{
+    cache_type cache(4u);
+    cache.put(1, "v1", t1);
+    cache.put(2, "v2", t2);
+
+    // Expired entries are removed on lookup
+    BOOST_TEST(cache.get(1, t1) == nullptr);
+    BOOST_TEST(cache.size() == 1u);
+    BOOST_TEST(cache.get(2, t1) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(eviction)
+{
+    cache_type cache(2u);
+    cache.put(1, "v1", t2);
+    cache.put(2, "v2", t2);
+
+    // Using 1 makes 2 the least recently used entry
+    BOOST_TEST(cache.get(1, t0) != nullptr);
+    cache.put(3, "v3", t2);
+    BOOST_TEST(cache.size() == 2u);
+    BOOST_TEST(cache.get(2, t0) == nullptr);
+    BOOST_TEST(cache.get(1, t0) != nullptr);
+    BOOST_TEST(cache.get(3, t0) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(replace)
+{
+    cache_type cache(2u);
+    cache.put(1, "v1", t1);
+    cache.put(2, "v2", t2);
+
+    // Replacing updates the value and the expiry, and marks the entry as used
+    cache.put(1, "other", t2);
+    BOOST_TEST(cache.size() == 2u);
+    BOOST_TEST_REQUIRE(cache.get(1, t1) != nullptr);
+    BOOST_TEST(*cache.get(1, t1) == "other");
+    cache.put(3, "v3", t2);
+    BOOST_TEST(cache.get(2, t0) == nullptr);
+    BOOST_TEST(cache.get(1, t0) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(erase)
+{
+    cache_type cache(2u);
+    cache.put(1, "v1", t1);
+    cache.erase(1);
+    cache.erase(2);  // not present
+    BOOST_TEST(cache.size() == 0u);
+    BOOST_TEST(cache.get(1, t0) == nullptr);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
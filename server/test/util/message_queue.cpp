@@ -0,0 +1,205 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/message_queue.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "error.hpp"
+#include "util/websocket_frame.hpp"
+
+using namespace chat;
+
+// Spawns a coroutine, detached. Rethrows any exceptions
+static void spawn_coroutine(
+    boost::asio::any_io_executor ex,
+    std::function<void(boost::asio::yield_context)> fn
+)
+{
+    boost::asio::spawn(std::move(ex), std::move(fn), [](std::exception_ptr ptr) {
+        if (ptr)
+            std::rethrow_exception(ptr);
+    });
+}
+
+// Spawns a coroutine and runs it until completion
+static void run_coroutine(void (*fn)(boost::asio::yield_context))
+{
+    boost::asio::io_context ctx;
+    spawn_coroutine(ctx.get_executor(), fn);
+    ctx.run();
+}
+
+static message_queue::message_type make_message(std::string value)
+{
+    return std::make_shared<const framed_message>(value);
+}
+
+BOOST_AUTO_TEST_SUITE(message_queue_)
+
+BOOST_AUTO_TEST_CASE(push_pop)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 4u, overflow_policy::drop_oldest);
+
+        // Push some messages
+        q.push(make_message("m1"));
+        q.push(make_message("m2"));
+        BOOST_TEST(q.size() == 2u);
+
+        // They're retrieved in order
+        BOOST_TEST(q.pop(yield).value()->payload() == "m1");
+        BOOST_TEST(q.pop(yield).value()->payload() == "m2");
+        BOOST_TEST(q.size() == 0u);
+        BOOST_TEST(q.dropped() == 0u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(pop_waits)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 4u, overflow_policy::drop_oldest);
+
+        // Launch a coroutine that will push a message once we're waiting
+        spawn_coroutine(yield.get_executor(), [&](boost::asio::yield_context) {
+            q.push(make_message("m1"));
+        });
+
+        // Wait for the message
+        BOOST_TEST(q.pop(yield).value()->payload() == "m1");
+    });
+}
+
+BOOST_AUTO_TEST_CASE(try_pop)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 4u, overflow_policy::drop_oldest);
+
+        // Empty queue
+        BOOST_TEST(q.try_pop() == nullptr);
+
+        // Messages are retrieved in order, without suspending
+        q.push(make_message("m1"));
+        q.push(make_message("m2"));
+        BOOST_TEST(q.try_pop()->payload() == "m1");
+        BOOST_TEST(q.try_pop()->payload() == "m2");
+        BOOST_TEST(q.try_pop() == nullptr);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(ready)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 2u, overflow_policy::coalesce);
+        BOOST_TEST(!q.ready());
+
+        // Messages are available
+        q.push(make_message("m1"));
+        BOOST_TEST(q.ready());
+        q.pop(yield);
+        BOOST_TEST(!q.ready());
+
+        // A resync is pending
+        q.push(make_message("m2"));
+        q.push(make_message("m3"));
+        q.push(make_message("m4"));
+        BOOST_TEST(q.ready());
+        q.pop(yield);
+        BOOST_TEST(!q.ready());
+
+        // Closed
+        q.close();
+        BOOST_TEST(q.ready());
+    });
+}
+
+BOOST_AUTO_TEST_CASE(overflow_drop_oldest)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 2u, overflow_policy::drop_oldest);
+
+        // Push more messages than the queue size
+        q.push(make_message("m1"));
+        q.push(make_message("m2"));
+        q.push(make_message("m3"));
+        BOOST_TEST(q.size() == 2u);
+        BOOST_TEST(q.dropped() == 1u);
+
+        // Only the newest messages are kept
+        BOOST_TEST(q.pop(yield).value()->payload() == "m2");
+        BOOST_TEST(q.pop(yield).value()->payload() == "m3");
+    });
+}
+
+BOOST_AUTO_TEST_CASE(overflow_coalesce)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 2u, overflow_policy::coalesce);
+
+        // Push more messages than the queue size
+        q.push(make_message("m1"));
+        q.push(make_message("m2"));
+        q.push(make_message("m3"));
+
+        // While the resync is pending, messages are discarded
+        q.push(make_message("m4"));
+        BOOST_TEST(q.size() == 0u);
+        BOOST_TEST(q.dropped() == 4u);
+
+        // The consumer is asked to resync
+        BOOST_TEST(q.pop(yield).value() == nullptr);
+
+        // Messages are accepted again
+        q.push(make_message("m5"));
+        BOOST_TEST(q.pop(yield).value()->payload() == "m5");
+    });
+}
+
+BOOST_AUTO_TEST_CASE(overflow_disconnect)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 2u, overflow_policy::disconnect);
+
+        // Push more messages than the queue size
+        q.push(make_message("m1"));
+        q.push(make_message("m2"));
+        q.push(make_message("m3"));
+        BOOST_TEST(q.size() == 0u);
+        BOOST_TEST(q.dropped() == 3u);
+
+        // The consumer gets an error
+        BOOST_TEST(q.pop(yield).error() == error_code(errc::slow_consumer));
+    });
+}
+
+BOOST_AUTO_TEST_CASE(close)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        message_queue q(yield.get_executor(), 2u, overflow_policy::drop_oldest);
+
+        // Launch a coroutine that will close the queue once we're waiting
+        spawn_coroutine(yield.get_executor(), [&](boost::asio::yield_context) { q.close(); });
+
+        // The pending pop fails
+        BOOST_TEST(q.pop(yield).error() == error_code(boost::asio::error::operation_aborted));
+
+        // Subsequent pushes are discarded
+        q.push(make_message("m1"));
+        BOOST_TEST(q.size() == 0u);
+    });
+}
+
+BOOST_AUTO_TEST_SUITE_END()
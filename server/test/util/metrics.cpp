@@ -0,0 +1,149 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/metrics.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(metrics)
+
+// Metrics are process-wide, so tests check differences between values
+
+BOOST_AUTO_TEST_CASE(bucket_index_small_values)
+{
+    // Small values have a bucket each
+    for (std::uint64_t v = 0; v < 16u; ++v)
+    {
+        BOOST_TEST(latency_buckets::index(v) == v);
+        BOOST_TEST(latency_buckets::upper_bound(v) == v);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bucket_index_round_trip)
+{
+    // Every value falls into a bucket whose bounds contain it. Buckets are contiguous
+    for (std::uint64_t v = 0; v < (1u << 16); ++v)
+    {
+        auto idx = latency_buckets::index(v);
+        BOOST_TEST_REQUIRE(idx < latency_buckets::num_buckets);
+        BOOST_TEST_REQUIRE(latency_buckets::upper_bound(idx) >= v);
+        if (idx > 0u)
+            BOOST_TEST_REQUIRE(latency_buckets::upper_bound(idx - 1u) < v);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bucket_index_relative_error)
+{
+    // The upper bound of the bucket is within 12.5% of the value
+    for (std::uint64_t v : {17u, 100u, 1000u, 123456u, 1000000000u})
+    {
+        BOOST_TEST_CONTEXT(v)
+        {
+            auto bound = latency_buckets::upper_bound(latency_buckets::index(v));
+            BOOST_TEST(bound - v <= v / 8u);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bucket_index_max_value)
+{
+    constexpr auto last = latency_buckets::num_buckets - 1u;
+    BOOST_TEST(latency_buckets::index(latency_buckets::max_value) == last);
+    BOOST_TEST(latency_buckets::upper_bound(last) == latency_buckets::max_value);
+
+    // Bigger values are clamped
+    BOOST_TEST(latency_buckets::index(~std::uint64_t(0)) == last);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_quantile)
+{
+    histogram_snapshot snapshot;
+
+    // Empty
+    BOOST_TEST(snapshot.count() == 0u);
+    BOOST_TEST(snapshot.quantile(0.5) == 0u);
+
+    // 90 values of 10 and 10 values of 1000
+    snapshot.buckets[latency_buckets::index(10u)] = 90u;
+    snapshot.buckets[latency_buckets::index(1000u)] = 10u;
+    auto high = latency_buckets::upper_bound(latency_buckets::index(1000u));
+    BOOST_TEST(snapshot.count() == 100u);
+    BOOST_TEST(snapshot.quantile(0.0) == 10u);
+    BOOST_TEST(snapshot.quantile(0.5) == 10u);
+    BOOST_TEST(snapshot.quantile(0.9) == 10u);
+    BOOST_TEST(snapshot.quantile(0.91) == high);
+    BOOST_TEST(snapshot.quantile(1.0) == high);
+}
+
+BOOST_AUTO_TEST_CASE(counters_aggregate_threads)
+{
+    auto before = get_counter(counter_id::messages_published);
+
+    // Record from several threads
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([] {
+            for (int j = 0; j < 1000; ++j)
+                increment_counter(counter_id::messages_published);
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    increment_counter(counter_id::messages_published, 5u);
+
+    // Values recorded by threads that exited are kept
+    BOOST_TEST(get_counter(counter_id::messages_published) - before == 4005u);
+}
+
+BOOST_AUTO_TEST_CASE(record_latency_)
+{
+    auto before = get_histogram(histogram_id::hello_build);
+
+    std::thread t([] { record_latency(histogram_id::hello_build, std::chrono::microseconds(3)); });
+    t.join();
+    record_latency(histogram_id::hello_build, std::chrono::microseconds(5));
+    record_latency(histogram_id::hello_build, std::chrono::nanoseconds(-1));  // recorded as zero
+
+    auto after = get_histogram(histogram_id::hello_build);
+    BOOST_TEST(after.count() - before.count() == 3u);
+    BOOST_TEST(after.sum_ns - before.sum_ns == 8000u);
+}
+
+BOOST_AUTO_TEST_CASE(format_metrics_)
+{
+    record_latency(histogram_id::redis_store_messages, std::chrono::milliseconds(1));
+    auto res = format_metrics();
+
+    // Counters
+    BOOST_TEST(res.find("# TYPE chat_accepted_connections_total counter\n") != std::string::npos);
+    BOOST_TEST(res.find("# TYPE chat_websocket_sessions gauge\n") != std::string::npos);
+
+    // Histograms in a family share their metadata, and are distinguished by label
+    BOOST_TEST(res.find("# TYPE chat_redis_latency_seconds summary\n") != std::string::npos);
+    BOOST_TEST(
+        res.find("# TYPE chat_redis_latency_seconds summary\n") ==
+        res.rfind("# TYPE chat_redis_latency_seconds summary\n")
+    );
+    BOOST_TEST(
+        res.find("chat_redis_latency_seconds{op=\"store_messages\",quantile=\"0.99\"} ") != std::string::npos
+    );
+    BOOST_TEST(res.find("chat_redis_latency_seconds_count{op=\"store_messages\"} ") != std::string::npos);
+    BOOST_TEST(res.find("chat_hello_build_seconds{quantile=\"0.5\"} ") != std::string::npos);
+    BOOST_TEST(res.find("chat_hello_build_seconds_sum ") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,212 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/msgpack.hpp"
+
+#include <boost/json/parse.hpp>
+#include <boost/json/value.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "error.hpp"
+
+using namespace chat;
+using namespace std::string_view_literals;
+
+BOOST_AUTO_TEST_SUITE(msgpack)
+
+constexpr struct
+{
+    std::string_view json;
+    std::string_view msgpack;
+} encode_cases[] = {
+    {"null", "\xc0"sv},
+    {"true", "\xc3"sv},
+    {"false", "\xc2"sv},
+    {"0", "\x00"sv},
+    {"127", "\x7f"sv},
+    {"128", "\xcc\x80"sv},
+    {"255", "\xcc\xff"sv},
+    {"256", "\xcd\x01\x00"sv},
+    {"65536", "\xce\x00\x01\x00\x00"sv},
+    {"4294967296", "\xcf\x00\x00\x00\x01\x00\x00\x00\x00"sv},
+    {"18446744073709551615", "\xcf\xff\xff\xff\xff\xff\xff\xff\xff"sv},
+    {"-1", "\xff"sv},
+    {"-32", "\xe0"sv},
+    {"-33", "\xd0\xdf"sv},
+    {"-128", "\xd0\x80"sv},
+    {"-129", "\xd1\xff\x7f"sv},
+    {"-32769", "\xd2\xff\xff\x7f\xff"sv},
+    {"-2147483649", "\xd3\xff\xff\xff\xff\x7f\xff\xff\xff"sv},
+    {"1.5", "\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00"sv},
+    {R"("")", "\xa0"sv},
+    {R"("abc")", "\xa3" "abc"sv},
+    {"[]", "\x90"sv},
+    {"{}", "\x80"sv},
+    {R"([1,"a",null])", "\x93\x01\xa1" "a\xc0"sv},
+    {R"({"type":"a","p":[1,true]})", "\x82\xa4" "type\xa1" "a\xa1" "p\x92\x01\xc3"sv},
+};
+
+BOOST_AUTO_TEST_CASE(json_to_msgpack_success)
+{
+    for (auto tc : encode_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.json)
+        {
+            auto res = json_to_msgpack(tc.json);
+            BOOST_TEST_REQUIRE(res.has_value());
+            BOOST_TEST(*res == tc.msgpack);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(json_to_msgpack_sizes)
+{
+    // Strings
+    auto str = [](std::size_t size) { return '"' + std::string(size, 'a') + '"'; };
+    BOOST_TEST(json_to_msgpack(str(31u))->substr(0, 1) == "\xbf");
+    BOOST_TEST(json_to_msgpack(str(32u))->substr(0, 2) == "\xd9\x20");
+    BOOST_TEST(json_to_msgpack(str(256u))->substr(0, 3) == "\xda\x01\x00"sv);
+    BOOST_TEST(json_to_msgpack(str(65536u))->substr(0, 5) == "\xdb\x00\x01\x00\x00"sv);
+
+    // Arrays and maps
+    BOOST_TEST(json_to_msgpack("[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]")->substr(0, 1) == "\x9f");
+    BOOST_TEST(json_to_msgpack("[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]")->substr(0, 3) == "\xdc\x00\x10"sv);
+    std::string obj = "{";
+    for (char c = 'a'; c < 'a' + 16; ++c)
+        obj += std::string(obj.size() > 1u ? "," : "") + '"' + c + "\":0";
+    obj += '}';
+    BOOST_TEST(json_to_msgpack(obj)->substr(0, 3) == "\xde\x00\x10"sv);
+}
+
+BOOST_AUTO_TEST_CASE(json_to_msgpack_error)
+{
+    for (std::string_view json : {"", "{", "[1,]", "abc"})
+    {
+        BOOST_TEST_CONTEXT(json) { BOOST_TEST(json_to_msgpack(json).has_error()); }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_to_json_roundtrip)
+{
+    for (auto tc : encode_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.json)
+        {
+            auto res = msgpack_to_json(tc.msgpack);
+            BOOST_TEST_REQUIRE(res.has_value());
+            BOOST_TEST(boost::json::parse(*res) == boost::json::parse(tc.json));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_to_json_non_canonical)
+{
+    // Encoders may use bigger representations than required, or 32-bit floats
+    constexpr struct
+    {
+        std::string_view msgpack;
+        std::string_view json;
+    } test_cases[] = {
+        {"\xd0\x01"sv, "1"},
+        {"\xcd\x00\x05"sv, "5"},
+        {"\xd3\x00\x00\x00\x00\x00\x00\x00\x07"sv, "7"},
+        {"\xca\x3f\xc0\x00\x00"sv, "1.5"},
+        {"\xd9\x01" "a"sv, R"("a")"},
+        {"\xdc\x00\x01\x01"sv, "[1]"},
+        {"\xde\x00\x01\xa1" "a\x01"sv, R"({"a":1})"},
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.json)
+        {
+            auto res = msgpack_to_json(tc.msgpack);
+            BOOST_TEST_REQUIRE(res.has_value());
+            BOOST_TEST(boost::json::parse(*res) == boost::json::parse(tc.json));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_to_json_event)
+{
+    // A typical client event
+    auto encoded = json_to_msgpack(R"({"type":"clientMessages","payload":{"roomId":"beast","messages":[]}})");
+    BOOST_TEST_REQUIRE(encoded.has_value());
+    auto res = msgpack_to_json(*encoded);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST(*res == R"({"type":"clientMessages","payload":{"roomId":"beast","messages":[]}})");
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_to_json_error)
+{
+    constexpr struct
+    {
+        std::string_view name;
+        std::string_view msgpack;
+    } test_cases[] = {
+        {"empty", ""sv},
+        {"never_used", "\xc1"sv},
+        {"bin", "\xc4\x01" "a"sv},
+        {"ext", "\xd4\x01\x02"sv},
+        {"non_string_key", "\x81\x01\x02"sv},
+        {"truncated_string", "\xa3" "ab"sv},
+        {"truncated_int", "\xcd\x01"sv},
+        {"truncated_array", "\x92\x01"sv},
+        {"truncated_map", "\x81\xa1" "a"sv},
+        {"trailing_bytes", "\x01\x02"sv},
+        {"huge_array", "\xdd\xff\xff\xff\xff"sv},
+        {"huge_map", "\xdf\xff\xff\xff\xff"sv},
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            auto res = msgpack_to_json(tc.msgpack);
+            BOOST_TEST(res.error() == error_code(errc::websocket_parse_error));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_to_json_depth)
+{
+    // Deeply nested documents are rejected
+    auto nested = [](std::size_t depth) { return std::string(depth, '\x91') + '\x01'; };
+    BOOST_TEST(msgpack_to_json(nested(10u)).has_value());
+    BOOST_TEST(msgpack_to_json(nested(100u)).has_error());
+}
+
+BOOST_AUTO_TEST_CASE(write_msgpack_array_header_)
+{
+    constexpr struct
+    {
+        std::size_t num_elements;
+        std::string_view expected;
+    } test_cases[] = {
+        {0u, "\x90"sv},
+        {15u, "\x9f"sv},
+        {16u, "\xdc\x00\x10"sv},
+        {65535u, "\xdc\xff\xff"sv},
+        {65536u, "\xdd\x00\x01\x00\x00"sv},
+    };
+
+    for (auto tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.num_elements)
+        {
+            unsigned char buff[max_msgpack_array_header_size]{};
+            auto size = write_msgpack_array_header(buff, tc.num_elements);
+            BOOST_TEST(std::string_view(reinterpret_cast<const char*>(buff), size) == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,8 +9,11 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <chrono>
 #include <string_view>
 
+#include "util/scrypt.hpp"
+
 using namespace chat;
 
 BOOST_AUTO_TEST_SUITE(password_hash)
@@ -37,4 +40,52 @@ BOOST_AUTO_TEST_CASE(success)
     BOOST_TEST(!verify_password("bad_password", hash));
 }
 
+BOOST_AUTO_TEST_CASE(rehash)
+{
+    constexpr std::string_view pasword = "some_password";
+    constexpr scrypt_params old_params{10, 8, 1};
+    constexpr scrypt_params new_params{11, 8, 1};
+    auto hash = hash_password(pasword, old_params);
+
+    // Hashes created with the current params don't need rehashing
+    auto res = verify_password(pasword, hash, old_params);
+    BOOST_TEST(res.matches);
+    BOOST_TEST(res.rehashed.empty());
+
+    // Outdated hashes are rehashed with the current params
+    res = verify_password(pasword, hash, new_params);
+    BOOST_TEST(res.matches);
+    BOOST_TEST(res.rehashed.substr(0, 19) == "$scrypt$ln=11,r=8,p");
+    BOOST_TEST(verify_password(pasword, res.rehashed));
+
+    // Hashes stronger than the current params are kept
+    auto new_hash = res.rehashed;
+    res = verify_password(pasword, new_hash, old_params);
+    BOOST_TEST(res.matches);
+    BOOST_TEST(res.rehashed.empty());
+
+    // Incorrect passwords are never rehashed
+    res = verify_password("bad_password", hash, new_params);
+    BOOST_TEST(!res.matches);
+    BOOST_TEST(res.rehashed.empty());
+}
+
+BOOST_AUTO_TEST_CASE(calibrate)
+{
+    // A zero target yields the default params
+    auto params = calibrate_scrypt_params(std::chrono::milliseconds(0), 1u << 30);
+    BOOST_TEST(params.ln == default_ln);
+    BOOST_TEST(params.r == default_r);
+    BOOST_TEST(params.p == default_p);
+
+    // The memory budget is honored
+    constexpr scrypt_params max_params{default_ln + 1u, default_r, default_p};
+    params = calibrate_scrypt_params(std::chrono::milliseconds(10000), scrypt_memory_size(max_params));
+    BOOST_TEST(params.ln <= max_params.ln);
+
+    // The defaults are never lowered, even if they exceed the memory budget
+    params = calibrate_scrypt_params(std::chrono::milliseconds(10000), 1u);
+    BOOST_TEST(params.ln == default_ln);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
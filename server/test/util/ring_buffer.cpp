@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/ring_buffer.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(ring_buffer_)
+
+BOOST_AUTO_TEST_CASE(capacity)
+{
+    BOOST_TEST(ring_buffer<int>(0u).capacity() == 2u);
+    BOOST_TEST(ring_buffer<int>(4u).capacity() == 4u);
+    BOOST_TEST(ring_buffer<int>(5u).capacity() == 8u);
+}
+
+BOOST_AUTO_TEST_CASE(push_pop)
+{
+    ring_buffer<int> buff(4u);
+    int value = 0;
+
+    // Empty buffer
+    BOOST_TEST(!buff.try_pop([&](int& v) { value = v; }));
+
+    // Elements are retrieved in order
+    BOOST_TEST(buff.try_push([](int& v) { v = 1; }));
+    BOOST_TEST(buff.try_push([](int& v) { v = 2; }));
+    BOOST_TEST(buff.try_pop([&](int& v) { value = v; }));
+    BOOST_TEST(value == 1);
+    BOOST_TEST(buff.try_pop([&](int& v) { value = v; }));
+    BOOST_TEST(value == 2);
+    BOOST_TEST(!buff.try_pop([&](int& v) { value = v; }));
+}
+
+BOOST_AUTO_TEST_CASE(full)
+{
+    ring_buffer<int> buff(2u);
+    int value = 0;
+
+    // Fill the buffer
+    BOOST_TEST(buff.try_push([](int& v) { v = 1; }));
+    BOOST_TEST(buff.try_push([](int& v) { v = 2; }));
+
+    // Pushing fails
+    BOOST_TEST(!buff.try_push([](int& v) { v = 3; }));
+
+    // After popping, there's room again. This reuses the cells
+    BOOST_TEST(buff.try_pop([&](int& v) { value = v; }));
+    BOOST_TEST(value == 1);
+    BOOST_TEST(buff.try_push([](int& v) { v = 4; }));
+    BOOST_TEST(buff.try_pop([&](int& v) { value = v; }));
+    BOOST_TEST(value == 2);
+    BOOST_TEST(buff.try_pop([&](int& v) { value = v; }));
+    BOOST_TEST(value == 4);
+}
+
+// Several producers and a single consumer. All elements are received exactly once
+BOOST_AUTO_TEST_CASE(multiple_producers)
+{
+    constexpr std::size_t num_producers = 4;
+    constexpr std::size_t elements_per_producer = 10000;
+    ring_buffer<std::size_t> buff(64u);
+
+    // Launch the producers. Each one pushes a range of values
+    std::vector<std::thread> producers;
+    for (std::size_t i = 0; i < num_producers; ++i)
+    {
+        producers.emplace_back([&buff, i] {
+            for (std::size_t j = 0; j < elements_per_producer; ++j)
+            {
+                std::size_t value = i * elements_per_producer + j;
+                while (!buff.try_push([value](std::size_t& v) { v = value; }))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    // Consume
+    std::vector<int> seen(num_producers * elements_per_producer, 0);
+    std::size_t num_received = 0;
+    while (num_received < seen.size())
+    {
+        if (buff.try_pop([&seen](std::size_t& v) { ++seen[v]; }))
+            ++num_received;
+        else
+            std::this_thread::yield();
+    }
+
+    for (auto& t : producers)
+        t.join();
+
+    // Check
+    for (std::size_t i = 0; i < seen.size(); ++i)
+        BOOST_TEST_REQUIRE(seen[i] == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
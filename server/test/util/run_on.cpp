@@ -0,0 +1,92 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/run_on.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+using namespace chat;
+
+namespace {
+
+// Runs a coroutine in one io_context, while another one runs in a separate thread
+struct fixture
+{
+    boost::asio::io_context ctx;
+    boost::asio::io_context other_ctx;
+
+    template <class Fn>
+    void run_coroutine(Fn fn)
+    {
+        boost::asio::spawn(ctx, std::move(fn), [](std::exception_ptr ptr) {
+            if (ptr)
+                std::rethrow_exception(ptr);
+        });
+        auto work = boost::asio::make_work_guard(other_ctx);
+        std::thread other_thread([this] { other_ctx.run(); });
+        ctx.run();
+        work.reset();
+        other_thread.join();
+    }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(run_on_)
+
+BOOST_FIXTURE_TEST_CASE(success, fixture)
+{
+    run_coroutine([&](boost::asio::yield_context yield) {
+        // The function runs in the other executor's thread
+        auto caller_id = std::this_thread::get_id();
+        bool in_other = run_on(
+            other_ctx.get_executor(),
+            [this] { return other_ctx.get_executor().running_in_this_thread(); },
+            yield
+        );
+        BOOST_TEST(in_other);
+
+        // It may access the caller's variables, and return non-trivial types
+        std::string prefix = "abc";
+        auto res = run_on(other_ctx.get_executor(), [&prefix] { return prefix + "def"; }, yield);
+        BOOST_TEST(res == "abcdef");
+
+        // After the coroutine resumes, it's running in the original thread
+        BOOST_TEST((std::this_thread::get_id() == caller_id));
+    });
+}
+
+BOOST_FIXTURE_TEST_CASE(exception, fixture)
+{
+    run_coroutine([&](boost::asio::yield_context yield) {
+        // Exceptions are propagated to the calling coroutine
+        BOOST_CHECK_THROW(
+            run_on(other_ctx.get_executor(), []() -> int { throw std::runtime_error("error"); }, yield),
+            std::runtime_error
+        );
+    });
+}
+
+BOOST_FIXTURE_TEST_CASE(same_executor, fixture)
+{
+    // Running in the caller's own executor works, too
+    run_coroutine([&](boost::asio::yield_context yield) {
+        auto res = run_on(ctx.get_executor(), [] { return 42; }, yield);
+        BOOST_TEST(res == 42);
+    });
+}
+
+BOOST_AUTO_TEST_SUITE_END()
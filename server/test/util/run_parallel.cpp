@@ -0,0 +1,81 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/run_parallel.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+using namespace chat;
+
+namespace {
+
+// Runs fn in a coroutine until it finishes
+template <class Function>
+void run_coroutine(Function fn)
+{
+    boost::asio::io_context ctx;
+    bool finished = false;
+    boost::asio::spawn(
+        ctx.get_executor(),
+        [&](boost::asio::yield_context yield) {
+            fn(yield);
+            finished = true;
+        },
+        [](std::exception_ptr ptr) {
+            if (ptr)
+                std::rethrow_exception(ptr);
+        }
+    );
+    ctx.run();
+    BOOST_TEST(finished);
+}
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(run_parallel_)
+
+BOOST_AUTO_TEST_CASE(concurrent)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        // All tasks start before any of them finishes
+        std::size_t started = 0u;
+        std::vector<std::size_t> started_when_done;
+        run_parallel(
+            3u,
+            [&](std::size_t, boost::asio::yield_context task_yield) {
+                ++started;
+                boost::asio::post(task_yield);
+                started_when_done.push_back(started);
+            },
+            yield
+        );
+        BOOST_TEST(started_when_done == (std::vector<std::size_t>{3u, 3u, 3u}));
+    });
+}
+
+BOOST_AUTO_TEST_CASE(single_task)
+{
+    run_coroutine([](boost::asio::yield_context yield) {
+        // A single task runs in the calling coroutine
+        std::vector<std::size_t> indices;
+        run_parallel(
+            1u,
+            [&](std::size_t idx, boost::asio::yield_context) { indices.push_back(idx); },
+            yield
+        );
+        BOOST_TEST(indices == (std::vector<std::size_t>{0u}));
+    });
+}
+
+BOOST_AUTO_TEST_SUITE_END()
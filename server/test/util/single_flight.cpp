@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/single_flight.hpp"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace chat;
+
+namespace {
+
+// Spawns a coroutine, detached. Rethrows any exceptions
+void spawn_coroutine(boost::asio::any_io_executor ex, std::function<void(boost::asio::yield_context)> fn)
+{
+    boost::asio::spawn(std::move(ex), std::move(fn), [](std::exception_ptr ptr) {
+        if (ptr)
+            std::rethrow_exception(ptr);
+    });
+}
+
+struct fixture
+{
+    boost::asio::io_context ctx;
+    single_flight<std::string> flights;
+    std::size_t calls{0};
+
+    // A call that suspends before completing, so other coroutines may join it
+    std::function<std::string(boost::asio::yield_context)> make_call(std::string result)
+    {
+        return [this, result](boost::asio::yield_context yield) {
+            ++calls;
+            boost::asio::post(yield);
+            return result;
+        };
+    }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(single_flight_)
+
+BOOST_FIXTURE_TEST_CASE(single_call, fixture)
+{
+    spawn_coroutine(ctx.get_executor(), [this](boost::asio::yield_context yield) {
+        BOOST_TEST(flights.run("k1", make_call("v1"), yield) == "v1");
+        BOOST_TEST(!flights.in_progress("k1"));
+        BOOST_TEST(flights.size() == 0u);
+
+        // Results are not cached
+        BOOST_TEST(flights.run("k1", make_call("v2"), yield) == "v2");
+    });
+    ctx.run();
+    BOOST_TEST(calls == 2u);
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_calls_same_key, fixture)
+{
+    std::vector<std::string> results;
+    for (int i = 0; i < 3; ++i)
+    {
+        spawn_coroutine(ctx.get_executor(), [this, i, &results](boost::asio::yield_context yield) {
+            results.push_back(flights.run("k1", make_call("v" + std::to_string(i)), yield));
+        });
+    }
+    ctx.run();
+
+    // Only the first call was executed, and all coroutines got its result
+    BOOST_TEST(calls == 1u);
+    BOOST_TEST(results == (std::vector<std::string>{"v0", "v0", "v0"}));
+    BOOST_TEST(flights.size() == 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_calls_different_keys, fixture)
+{
+    std::vector<std::string> results;
+    for (int i = 0; i < 2; ++i)
+    {
+        spawn_coroutine(ctx.get_executor(), [this, i, &results](boost::asio::yield_context yield) {
+            auto key = "k" + std::to_string(i);
+            results.push_back(flights.run(key, make_call("v" + std::to_string(i)), yield));
+        });
+    }
+    ctx.run();
+
+    BOOST_TEST(calls == 2u);
+    BOOST_TEST(results == (std::vector<std::string>{"v0", "v1"}));
+}
+
+BOOST_FIXTURE_TEST_CASE(forget, fixture)
+{
+    std::vector<std::string> results;
+    spawn_coroutine(ctx.get_executor(), [this, &results](boost::asio::yield_context yield) {
+        results.push_back(flights.run("k1", make_call("v0"), yield));
+    });
+    spawn_coroutine(ctx.get_executor(), [this, &results](boost::asio::yield_context yield) {
+        // The first call is in progress. Forgetting it makes us start a new one
+        BOOST_TEST(flights.in_progress("k1"));
+        flights.forget("k1");
+        BOOST_TEST(!flights.in_progress("k1"));
+        results.push_back(flights.run("k1", make_call("v1"), yield));
+    });
+    ctx.run();
+
+    BOOST_TEST(calls == 2u);
+    BOOST_TEST(results == (std::vector<std::string>{"v0", "v1"}));
+    BOOST_TEST(flights.size() == 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(exception, fixture)
+{
+    std::size_t num_exceptions = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        spawn_coroutine(ctx.get_executor(), [this, &num_exceptions](boost::asio::yield_context yield) {
+            try
+            {
+                flights.run(
+                    "k1",
+                    [this](boost::asio::yield_context yield) -> std::string {
+                        ++calls;
+                        boost::asio::post(yield);
+                        throw std::runtime_error("fail");
+                    },
+                    yield
+                );
+            }
+            catch (const std::runtime_error&)
+            {
+                ++num_exceptions;
+            }
+        });
+    }
+    ctx.run();
+
+    // Waiters get the exception, too
+    BOOST_TEST(calls == 1u);
+    BOOST_TEST(num_exceptions == 2u);
+    BOOST_TEST(flights.size() == 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/stack_pool.hpp"
+
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(stack_pool_)
+
+BOOST_AUTO_TEST_CASE(size_rounded)
+{
+    auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+
+    // A guard page is added
+    BOOST_TEST(pooled_stack_allocator(page).size() == 2u * page);
+    BOOST_TEST(pooled_stack_allocator(page + 1u).size() == 3u * page);
+    BOOST_TEST(pooled_stack_allocator(4u * page - 1u).size() == 5u * page);
+}
+
+BOOST_AUTO_TEST_CASE(reuse)
+{
+    pooled_stack_allocator alloc(32u * 1024u);
+    auto initial = num_pooled_stacks();
+
+    // The stack is writable, except for the guard page
+    auto sctx = alloc.allocate();
+    BOOST_TEST(sctx.size == alloc.size());
+    auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    std::memset(static_cast<char*>(sctx.sp) - sctx.size + page, 0xab, sctx.size - page);
+
+    // Deallocating returns it to the pool, and the next allocation reuses it
+    auto* sp = sctx.sp;
+    alloc.deallocate(sctx);
+    BOOST_TEST(num_pooled_stacks() == initial + 1u);
+    auto sctx2 = alloc.allocate();
+    BOOST_TEST(sctx2.sp == sp);
+    BOOST_TEST(num_pooled_stacks() == initial);
+    alloc.deallocate(sctx2);
+}
+
+BOOST_AUTO_TEST_CASE(size_classes)
+{
+    pooled_stack_allocator small(32u * 1024u);
+    pooled_stack_allocator big(64u * 1024u);
+
+    // Stacks of a size are not used for the other
+    auto sctx = small.allocate();
+    auto* sp = sctx.sp;
+    small.deallocate(sctx);
+    auto sctx2 = big.allocate();
+    BOOST_TEST(sctx2.sp != sp);
+    BOOST_TEST(sctx2.size == big.size());
+    big.deallocate(sctx2);
+}
+
+BOOST_AUTO_TEST_CASE(spawn)
+{
+    boost::asio::io_context ctx;
+    int value = 0;
+    auto initial = num_pooled_stacks();
+
+    // Run a couple of coroutines one after another. They reuse the same stack
+    for (int i = 0; i < 2; ++i)
+    {
+        boost::asio::spawn(
+            ctx,
+            std::allocator_arg,
+            task_stack_allocator(),
+            [&value](boost::asio::yield_context) { ++value; },
+            boost::asio::detached
+        );
+        ctx.run();
+        ctx.restart();
+    }
+
+    BOOST_TEST(value == 2);
+    BOOST_TEST(num_pooled_stacks() == initial + 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/tls_context.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "error.hpp"
+
+using namespace chat;
+
+namespace {
+
+// Generates a self-signed certificate with its key, in a temporary PEM file
+struct temp_certificate
+{
+    std::string path{"chat_test_tls_cert.pem"};
+
+    temp_certificate()
+    {
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        BOOST_TEST_REQUIRE(key != nullptr);
+        X509* cert = X509_new();
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(
+            X509_get_subject_name(cert),
+            "CN",
+            MBSTRING_ASC,
+            reinterpret_cast<const unsigned char*>("localhost"),
+            -1,
+            -1,
+            0
+        );
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        X509_sign(cert, key, EVP_sha256());
+
+        FILE* f = std::fopen(path.c_str(), "w");
+        BOOST_TEST_REQUIRE(f != nullptr);
+        PEM_write_X509(f, cert);
+        PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+        std::fclose(f);
+        X509_free(cert);
+        EVP_PKEY_free(key);
+    }
+    temp_certificate(const temp_certificate&) = delete;
+    temp_certificate& operator=(const temp_certificate&) = delete;
+    ~temp_certificate() { std::remove(path.c_str()); }
+};
+
+// A file with the given contents, removed on destruction
+struct temp_file
+{
+    std::string path;
+
+    temp_file(std::string p, const std::string& contents) : path(std::move(p))
+    {
+        std::ofstream(path, std::ios::binary) << contents;
+    }
+    temp_file(const temp_file&) = delete;
+    temp_file& operator=(const temp_file&) = delete;
+    ~temp_file() { std::remove(path.c_str()); }
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_SUITE(tls_context_)
+
+BOOST_AUTO_TEST_CASE(success)
+{
+    temp_certificate cert;
+    tls_config cfg;
+    cfg.cert_file = cert.path;
+    cfg.key_file = cert.path;
+    cfg.session_cache_size = 100u;
+    cfg.session_timeout = 60u;
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST_REQUIRE(res.has_value());
+    auto* ctx = res->native_handle();
+    BOOST_TEST(SSL_CTX_sess_get_cache_size(ctx) == 100);
+    BOOST_TEST(SSL_CTX_get_timeout(ctx) == 60);
+    BOOST_TEST((SSL_CTX_get_options(ctx) & SSL_OP_ENABLE_KTLS) != 0u);
+}
+
+BOOST_AUTO_TEST_CASE(ktls_disabled)
+{
+    temp_certificate cert;
+    tls_config cfg;
+    cfg.cert_file = cert.path;
+    cfg.key_file = cert.path;
+    cfg.ktls = false;
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST_REQUIRE(res.has_value());
+    BOOST_TEST((SSL_CTX_get_options(res->native_handle()) & SSL_OP_ENABLE_KTLS) == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(ticket_keys)
+{
+    temp_certificate cert;
+    temp_file keys("chat_test_tls_keys.bin", std::string(80u, 'k'));
+    tls_config cfg;
+    cfg.cert_file = cert.path;
+    cfg.key_file = cert.path;
+    cfg.ticket_key_file = keys.path;
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST(res.has_value());
+}
+
+BOOST_AUTO_TEST_CASE(error_ticket_keys_bad_size)
+{
+    temp_certificate cert;
+    temp_file keys("chat_test_tls_keys.bin", std::string(48u, 'k'));
+    tls_config cfg;
+    cfg.cert_file = cert.path;
+    cfg.key_file = cert.path;
+    cfg.ticket_key_file = keys.path;
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST_REQUIRE(res.has_error());
+    BOOST_TEST(res.error().ec == errc::invalid_config);
+}
+
+BOOST_AUTO_TEST_CASE(error_ticket_keys_missing)
+{
+    temp_certificate cert;
+    tls_config cfg;
+    cfg.cert_file = cert.path;
+    cfg.key_file = cert.path;
+    cfg.ticket_key_file = "chat_test_nonexisting_keys.bin";
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST_REQUIRE(res.has_error());
+    BOOST_TEST(res.error().ec == errc::invalid_config);
+}
+
+BOOST_AUTO_TEST_CASE(error_certificate_missing)
+{
+    tls_config cfg;
+    cfg.cert_file = "chat_test_nonexisting_cert.pem";
+    cfg.key_file = cfg.cert_file;
+
+    auto res = tls_context::create(cfg);
+    BOOST_TEST_REQUIRE(res.has_error());
+    BOOST_TEST(res.error().ec.failed());
+    BOOST_TEST(res.error().msg.find(cfg.cert_file) != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
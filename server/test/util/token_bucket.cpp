@@ -0,0 +1,67 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/token_bucket.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+
+using namespace chat;
+using std::chrono::milliseconds;
+
+BOOST_AUTO_TEST_SUITE(token_bucket_)
+
+// Holds 3 tokens, and gets a new one every 500ms
+constexpr token_bucket_params params{3.0, 2.0};
+
+BOOST_AUTO_TEST_CASE(take_until_empty)
+{
+    auto now = token_bucket::clock_type::now();
+    token_bucket bucket(params.capacity, now);
+    BOOST_TEST(bucket.try_take(params, 1.0, now));
+    BOOST_TEST(bucket.try_take(params, 1.0, now));
+    BOOST_TEST(bucket.try_take(params, 1.0, now));
+    BOOST_TEST(!bucket.try_take(params, 1.0, now));
+    BOOST_TEST(bucket.tokens(params, now) == 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(refill)
+{
+    auto now = token_bucket::clock_type::now();
+    token_bucket bucket(0.0, now);
+    BOOST_TEST(!bucket.try_take(params, 1.0, now + milliseconds(499)));
+    BOOST_TEST(bucket.try_take(params, 1.0, now + milliseconds(500)));
+    BOOST_TEST(!bucket.try_take(params, 1.0, now + milliseconds(500)));
+
+    // Refilling never exceeds capacity
+    BOOST_TEST(bucket.tokens(params, now + std::chrono::seconds(60)) == params.capacity);
+}
+
+BOOST_AUTO_TEST_CASE(zero_cost)
+{
+    // A zero cost checks that a token is available, without taking it
+    auto now = token_bucket::clock_type::now();
+    token_bucket bucket(1.0, now);
+    BOOST_TEST(bucket.try_take(params, 0.0, now));
+    BOOST_TEST(bucket.try_take(params, 0.0, now));
+    BOOST_TEST(bucket.tokens(params, now) == 1.0);
+    BOOST_TEST(bucket.try_take(params, 1.0, now));
+    BOOST_TEST(!bucket.try_take(params, 0.0, now));
+}
+
+BOOST_AUTO_TEST_CASE(time_going_backwards)
+{
+    // Earlier time points don't change the bucket
+    auto now = token_bucket::clock_type::now();
+    token_bucket bucket(1.0, now);
+    BOOST_TEST(bucket.tokens(params, now - milliseconds(1000)) == 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(time_to_full) { BOOST_TEST((params.time_to_full() == milliseconds(1500))); }
+
+BOOST_AUTO_TEST_SUITE_END()
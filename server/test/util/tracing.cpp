@@ -0,0 +1,169 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/tracing.hpp"
+
+#include <boost/json/parse.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "util/metrics.hpp"
+
+using namespace chat;
+using std::chrono::milliseconds;
+
+BOOST_AUTO_TEST_SUITE(tracing)
+
+BOOST_AUTO_TEST_CASE(trace_spans)
+{
+    trace t("test");
+    auto start = t.start_time();
+    t.add_span("s1", start + milliseconds(1), start + milliseconds(3));
+    {
+        trace_span span(&t, "s2");
+    }
+    {
+        trace_span span(nullptr, "s3");  // no-op
+    }
+
+    auto spans = t.spans();
+    BOOST_TEST_REQUIRE(spans.size() == 2u);
+    BOOST_TEST(spans[0].name == "s1");
+    BOOST_TEST((spans[0].start == milliseconds(1)));
+    BOOST_TEST((spans[0].duration == milliseconds(2)));
+    BOOST_TEST(spans[1].name == "s2");
+    BOOST_TEST(t.dropped_spans() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(trace_max_spans)
+{
+    trace t("test");
+    for (std::size_t i = 0; i < trace::max_spans + 2u; ++i)
+        t.add_span("s", t.start_time(), t.start_time());
+    BOOST_TEST(t.spans().size() == trace::max_spans);
+    BOOST_TEST(t.dropped_spans() == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(handoff)
+{
+    trace t("test");
+
+    // The callee takes the trace
+    auto* taken = traced_call(&t, [] { return take_handed_off_trace(); });
+    BOOST_TEST(taken == &t);
+
+    // The trace is never seen by functions not invoked with traced_call
+    traced_call(&t, [] {});
+    BOOST_TEST(take_handed_off_trace() == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(latency_timer_records_span)
+{
+    trace t("test");
+    traced_call(&t, [] { latency_timer timer(histogram_id::redis_store_messages); });
+    {
+        // Without traced_call, no span is recorded
+        latency_timer timer(histogram_id::redis_store_messages);
+    }
+
+    BOOST_TEST_REQUIRE(t.spans().size() == 1u);
+    BOOST_TEST(t.spans()[0].name == "redis.store_messages");
+}
+
+BOOST_AUTO_TEST_CASE(collector_sampling)
+{
+    // Keep one in every three traces
+    trace_collector collector(3u, milliseconds(0), 16u);
+    BOOST_TEST(collector.enabled());
+    trace t("test");
+    BOOST_TEST(collector.finish(t));
+    BOOST_TEST(!collector.finish(t));
+    BOOST_TEST(!collector.finish(t));
+    BOOST_TEST(collector.finish(t));
+
+    auto records = collector.records();
+    BOOST_TEST_REQUIRE(records.size() == 2u);
+    BOOST_TEST(records[0].id == 2u);  // most recent first
+    BOOST_TEST(records[1].id == 1u);
+    BOOST_TEST(records[0].name == "test");
+    BOOST_TEST(!records[0].slow);
+}
+
+BOOST_AUTO_TEST_CASE(collector_slow)
+{
+    // Only keep slow traces
+    trace_collector collector(0u, milliseconds(10), 16u);
+    trace t("test");
+    t.add_span("s1", t.start_time(), t.start_time() + milliseconds(20));
+    BOOST_TEST(!collector.finish(t, t.start_time() + milliseconds(9)));
+    BOOST_TEST(collector.finish(t, t.start_time() + milliseconds(20)));
+
+    auto records = collector.records();
+    BOOST_TEST_REQUIRE(records.size() == 1u);
+    BOOST_TEST(records[0].slow);
+    BOOST_TEST((records[0].duration == milliseconds(20)));
+    BOOST_TEST_REQUIRE(records[0].spans.size() == 1u);
+    BOOST_TEST(records[0].spans[0].name == "s1");
+}
+
+BOOST_AUTO_TEST_CASE(collector_overwrites_oldest)
+{
+    trace_collector collector(1u, milliseconds(0), 2u);
+    trace t("test");
+    for (int i = 0; i < 5; ++i)
+        collector.finish(t);
+
+    auto records = collector.records();
+    BOOST_TEST_REQUIRE(records.size() == 2u);
+    BOOST_TEST(records[0].id == 5u);
+    BOOST_TEST(records[1].id == 4u);
+}
+
+BOOST_AUTO_TEST_CASE(collector_disabled)
+{
+    trace t("test");
+    trace_collector no_capacity(1u, milliseconds(1), 0u);
+    BOOST_TEST(!no_capacity.enabled());
+    BOOST_TEST(!no_capacity.finish(t));
+
+    trace_collector no_policy(0u, milliseconds(0), 16u);
+    BOOST_TEST(!no_policy.enabled());
+    BOOST_TEST(!no_policy.finish(t));
+    BOOST_TEST(no_policy.records().empty());
+}
+
+BOOST_AUTO_TEST_CASE(format_traces_)
+{
+    trace_collector collector(1u, milliseconds(0), 16u);
+    trace t("clientMessages");
+    t.add_span("redis.store_messages", t.start_time() + milliseconds(1), t.start_time() + milliseconds(4));
+    collector.finish(t, t.start_time() + milliseconds(5));
+    auto records = collector.records();
+
+    auto res = boost::json::parse(format_traces(records));
+    const auto& arr = res.as_array();
+    BOOST_TEST_REQUIRE(arr.size() == 1u);
+    const auto& obj = arr[0].as_object();
+    BOOST_TEST(obj.at("id").to_number<int>() == 1);
+    BOOST_TEST(obj.at("name").as_string() == "clientMessages");
+    BOOST_TEST(obj.at("durationUs").to_number<int>() == 5000);
+    BOOST_TEST(obj.at("slow").as_bool() == false);
+    BOOST_TEST(obj.at("droppedSpans").to_number<int>() == 0);
+    const auto& spans = obj.at("spans").as_array();
+    BOOST_TEST_REQUIRE(spans.size() == 1u);
+    BOOST_TEST(spans[0].at("name").as_string() == "redis.store_messages");
+    BOOST_TEST(spans[0].at("startUs").to_number<int>() == 1000);
+    BOOST_TEST(spans[0].at("durationUs").to_number<int>() == 3000);
+}
+
+BOOST_AUTO_TEST_CASE(format_traces_empty) { BOOST_TEST(format_traces({}) == "[]"); }
+
+BOOST_AUTO_TEST_SUITE_END()
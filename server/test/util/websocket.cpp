@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/websocket.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef>
+#include <string>
+
+using namespace chat;
+
+// Fills buff with size bytes
+static void fill(boost::beast::flat_buffer& buff, std::size_t size)
+{
+    auto bufs = buff.prepare(size);
+    boost::asio::buffer_copy(bufs, boost::asio::buffer(std::string(size, 'a')));
+    buff.commit(size);
+}
+
+BOOST_AUTO_TEST_SUITE(reset_read_buffer_)
+
+BOOST_AUTO_TEST_CASE(small_buffer_kept)
+{
+    boost::beast::flat_buffer buff;
+    fill(buff, 100u);
+    auto capacity = buff.capacity();
+
+    BOOST_TEST(reset_read_buffer(buff, 4096u) == 0u);
+    BOOST_TEST(buff.size() == 0u);
+    BOOST_TEST(buff.capacity() == capacity);
+}
+
+BOOST_AUTO_TEST_CASE(big_buffer_released)
+{
+    boost::beast::flat_buffer buff;
+    fill(buff, 10000u);
+    auto capacity = buff.capacity();
+
+    BOOST_TEST(reset_read_buffer(buff, 4096u) == capacity);
+    BOOST_TEST(buff.size() == 0u);
+    BOOST_TEST(buff.capacity() == 0u);
+
+    // The buffer can be used again
+    fill(buff, 100u);
+    BOOST_TEST(buff.size() == 100u);
+}
+
+BOOST_AUTO_TEST_CASE(empty_buffer)
+{
+    boost::beast::flat_buffer buff;
+    BOOST_TEST(reset_read_buffer(buff, 0u) == 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
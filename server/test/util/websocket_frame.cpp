@@ -0,0 +1,260 @@
+//
+// Copyright (c) 2023-2024 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "util/websocket_frame.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/zlib/error.hpp>
+#include <boost/beast/zlib/inflate_stream.hpp>
+#include <boost/beast/zlib/zlib.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "error.hpp"
+
+using namespace chat;
+
+BOOST_AUTO_TEST_SUITE(websocket_frame)
+
+static std::string_view to_sv(boost::asio::const_buffer buff)
+{
+    return std::string_view(static_cast<const char*>(buff.data()), buff.size());
+}
+
+static websocket_compression_options no_compression()
+{
+    websocket_compression_options res;
+    res.enabled = false;
+    return res;
+}
+
+static websocket_compression_options shared_compression()
+{
+    websocket_compression_options res;
+    res.no_context_takeover = true;
+    res.threshold = 64u;
+    return res;
+}
+
+// Inflates a permessage-deflate payload
+static std::string inflate(std::string_view compressed, int window_bits)
+{
+    namespace zlib = boost::beast::zlib;
+
+    std::string input(compressed);
+    input += std::string_view("\x00\x00\xff\xff", 4);
+    std::string res(64u * 1024u, '\0');
+
+    zlib::inflate_stream zi;
+    zi.reset(window_bits);
+    zlib::z_params zs;
+    zs.next_in = input.data();
+    zs.avail_in = input.size();
+    zs.next_out = res.data();
+    zs.avail_out = res.size();
+    error_code ec;
+    zi.write(zs, zlib::Flush::sync, ec);
+    BOOST_TEST_REQUIRE((!ec || ec == zlib::error::need_buffers || ec == zlib::error::end_of_stream));
+    BOOST_TEST_REQUIRE(zs.avail_in == 0u);
+    res.resize(zs.total_out);
+    return res;
+}
+
+//
+// write_frame_header
+//
+BOOST_AUTO_TEST_CASE(write_frame_header_sizes)
+{
+    struct
+    {
+        std::string_view name;
+        std::uint64_t payload_size;
+        std::vector<unsigned char> expected;
+    } test_cases[] = {
+        {"empty", 0u, {0x81, 0x00}},
+        {"small", 5u, {0x81, 0x05}},
+        {"max_small", 125u, {0x81, 0x7d}},
+        {"min_medium", 126u, {0x81, 0x7e, 0x00, 0x7e}},
+        {"max_medium", 65535u, {0x81, 0x7e, 0xff, 0xff}},
+        {"min_large", 65536u, {0x81, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00}},
+        {"large", 0x0102030405060708u, {0x81, 0x7f, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08}},
+    };
+
+    for (const auto& tc : test_cases)
+    {
+        BOOST_TEST_CONTEXT(tc.name)
+        {
+            unsigned char buff[max_frame_header_size]{};
+            auto size = write_frame_header(buff, 0x1u, false, tc.payload_size);
+            std::vector<unsigned char> actual(buff, buff + size);
+            BOOST_TEST(actual == tc.expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(write_frame_header_compressed)
+{
+    // RSV1 is set
+    unsigned char buff[max_frame_header_size]{};
+    auto size = write_frame_header(buff, 0x1u, true, 10u);
+    BOOST_TEST(size == 2u);
+    BOOST_TEST(buff[0] == 0xc1u);
+    BOOST_TEST(buff[1] == 0x0au);
+}
+
+//
+// framed_message
+//
+BOOST_AUTO_TEST_CASE(framed_message_small)
+{
+    framed_message msg("hello", no_compression());
+    BOOST_TEST(msg.payload() == "hello");
+    BOOST_TEST(to_sv(msg.frame()) == std::string_view("\x81\x05hello", 7));
+    BOOST_TEST(!msg.has_compressed_frame());
+}
+
+BOOST_AUTO_TEST_CASE(framed_message_header_boundaries)
+{
+    for (std::size_t size : {125u, 126u, 65535u, 65536u})
+    {
+        BOOST_TEST_CONTEXT(size)
+        {
+            std::string payload(size, 'a');
+            framed_message msg(payload, no_compression());
+            std::size_t expected_header_size = size < 126u ? 2u : (size <= 65535u ? 4u : 10u);
+            BOOST_TEST(msg.payload() == payload);
+            BOOST_TEST(msg.frame().size() == expected_header_size + size);
+            BOOST_TEST(to_sv(msg.frame()).substr(expected_header_size) == payload);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(framed_message_compressed)
+{
+    std::string payload;
+    for (int i = 0; i < 200; ++i)
+        payload += R"({"type":"messages","roomId":"beast","messages":[]})";
+    framed_message msg(payload, shared_compression());
+
+    // The uncompressed version is always available
+    BOOST_TEST(msg.payload() == payload);
+
+    // The compressed frame has RSV1 set, and inflates to the original message
+    BOOST_TEST_REQUIRE(msg.has_compressed_frame());
+    BOOST_TEST(msg.compression_window_bits() == 15);
+    auto frame = to_sv(msg.compressed_frame());
+    unsigned char expected_header[max_frame_header_size]{};
+    auto header_size = write_frame_header(expected_header, 0x1u, true, frame.size() - 2u);
+    BOOST_TEST_REQUIRE(header_size == 2u);  // the message is very repetitive
+    BOOST_TEST(frame.substr(0, 2) == std::string_view(reinterpret_cast<const char*>(expected_header), 2));
+    BOOST_TEST(frame.size() < payload.size());
+    BOOST_TEST(inflate(frame.substr(2), 15) == payload);
+}
+
+BOOST_AUTO_TEST_CASE(framed_message_not_compressed)
+{
+    std::string compressible(1000u, 'a');
+
+    // Below the threshold
+    BOOST_TEST(!framed_message(std::string(63u, 'a'), shared_compression()).has_compressed_frame());
+
+    // Compression disabled
+    auto opts = shared_compression();
+    opts.enabled = false;
+    BOOST_TEST(!framed_message(compressible, opts).has_compressed_frame());
+
+    // With context takeover, each session must compress the message itself
+    opts = shared_compression();
+    opts.no_context_takeover = false;
+    BOOST_TEST(!framed_message(compressible, opts).has_compressed_frame());
+
+    // Compression doesn't reduce the size
+    std::string random_payload;
+    std::uint32_t seed = 42u;
+    for (int i = 0; i < 256; ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        random_payload.push_back(static_cast<char>(seed >> 24));
+    }
+    BOOST_TEST(!framed_message(random_payload, shared_compression()).has_compressed_frame());
+}
+
+BOOST_AUTO_TEST_CASE(framed_message_binary)
+{
+    // {"a":1} is a map with a single entry
+    framed_message msg(R"({"a":1})", no_compression());
+    BOOST_TEST(to_sv(msg.binary_frame()) == std::string_view("\x82\x04\x81\xa1" "a\x01", 6));
+    BOOST_TEST(msg.binary_payload() == std::string_view("\x81\xa1" "a\x01", 4));
+
+    // The text frame is not affected
+    BOOST_TEST(msg.payload() == R"({"a":1})");
+    BOOST_TEST(to_sv(msg.frame()).substr(0, 2) == std::string_view("\x81\x07", 2));
+}
+
+BOOST_AUTO_TEST_CASE(framed_message_binary_invalid_json)
+{
+    framed_message msg("hello", no_compression());
+    BOOST_TEST(to_sv(msg.binary_frame()) == std::string_view("\x82\x00", 2));
+    BOOST_TEST(msg.binary_payload().empty());
+}
+
+//
+// websocket_frame_tracker
+//
+BOOST_AUTO_TEST_CASE(tracker_frames)
+{
+    // Several frames, with all the header sizes, including a masked one and an empty one
+    std::string stream;
+    for (std::size_t size : {0u, 10u, 300u, 70000u})
+        stream += to_sv(framed_message(std::string(size, 'a'), no_compression()).frame());
+    stream += std::string_view("\x81\x83\x01\x02\x03\x04" "abc", 9);
+
+    // Consuming everything at once
+    websocket_frame_tracker tracker;
+    BOOST_TEST(tracker.at_boundary());
+    tracker.consume(boost::asio::buffer(stream));
+    BOOST_TEST(tracker.at_boundary());
+
+    // Byte by byte. We're only at a boundary after each frame ends
+    const std::size_t boundaries[] = {2u, 14u, 318u, 70328u, 70337u};
+    websocket_frame_tracker tracker2;
+    for (std::size_t i = 0; i < stream.size(); ++i)
+    {
+        tracker2.consume(boost::asio::buffer(stream.data() + i, 1u));
+        auto it = std::find(std::begin(boundaries), std::end(boundaries), i + 1u);
+        bool expected = it != std::end(boundaries);
+        BOOST_TEST_CONTEXT(i) { BOOST_TEST(tracker2.at_boundary() == expected); }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(tracker_chunks)
+{
+    framed_message msg(std::string(1000u, 'a'), no_compression());
+    auto frame = msg.frame();
+    websocket_frame_tracker tracker;
+
+    // Split in the middle of the header
+    tracker.consume(boost::asio::buffer(frame.data(), 1u));
+    BOOST_TEST(!tracker.at_boundary());
+    tracker.consume(boost::asio::buffer(frame + 1u, 3u));
+    BOOST_TEST(!tracker.at_boundary());
+
+    // Split in the middle of the payload
+    tracker.consume(boost::asio::buffer(frame + 4u, 500u));
+    BOOST_TEST(!tracker.at_boundary());
+    tracker.consume(frame + 504u);
+    BOOST_TEST(tracker.at_boundary());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
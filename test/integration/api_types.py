@@ -1,5 +1,5 @@
 from pydantic import BaseModel, Field
-from typing import List, Literal
+from typing import List, Literal, Optional
 from enum import Enum
 
 # pydantic models describing our API structures. These classes perform
@@ -55,6 +55,7 @@ class Room(BaseModel):
     name: str
     messages: List[ServerMessage]
     hasMoreMessages: bool
+    isDelta: bool = False  # Set if the room only contains the messages a reconnecting client missed
 
 
 class HelloEventPayload(BaseModel):
@@ -77,6 +78,53 @@ class ClientMessagesEvent(BaseModel):
     payload: ClientMessagesEventPayload
 
 
+class JoinRoomEventPayload(BaseModel):
+    roomId: str
+
+
+class JoinRoomEvent(BaseModel):
+    type: Literal['joinRoom']
+    payload: JoinRoomEventPayload
+
+
+class ActivityKind(Enum):
+    Typing = "typing"
+    Presence = "presence"
+    Read = "read"
+
+
+class ClientActivityEventPayload(BaseModel):
+    roomId: str
+    kind: ActivityKind
+    messageId: Optional[str] = None
+
+
+class ClientActivityEvent(BaseModel):
+    type: Literal['clientActivity']
+    payload: ClientActivityEventPayload
+
+
+class ServerActivityEventPayload(BaseModel):
+    roomId: str
+    user: User
+    kind: ActivityKind
+    messageId: Optional[str] = None
+
+
+class ServerActivityEvent(BaseModel):
+    type: Literal['serverActivity']
+    payload: ServerActivityEventPayload
+
+
+class RoomJoinedEventPayload(BaseModel):
+    room: Room
+
+
+class RoomJoinedEvent(BaseModel):
+    type: Literal['roomJoined']
+    payload: RoomJoinedEventPayload
+
+
 class ServerMessagesEventPayload(BaseModel):
     roomId: str
     messages: List[ServerMessage]
@@ -85,3 +133,39 @@ class ServerMessagesEventPayload(BaseModel):
 class ServerMessagesEvent(BaseModel):
     type: Literal['serverMessages']
     payload: ServerMessagesEventPayload
+
+
+class MessageIdCorrection(BaseModel):
+    id: str
+    newId: Optional[str]
+
+
+class ServerMessagesCorrectedEventPayload(BaseModel):
+    roomId: str
+    messages: List[MessageIdCorrection]
+
+
+class ServerMessagesCorrectedEvent(BaseModel):
+    type: Literal['serverMessagesCorrected']
+    payload: ServerMessagesCorrectedEventPayload
+
+
+class SearchRoomEventPayload(BaseModel):
+    roomId: str
+    query: str
+
+
+class SearchRoomEvent(BaseModel):
+    type: Literal['searchRoom']
+    payload: SearchRoomEventPayload
+
+
+class RoomSearchResultsEventPayload(BaseModel):
+    roomId: str
+    query: str
+    messages: List[ServerMessage]
+
+
+class RoomSearchResultsEvent(BaseModel):
+    type: Literal['roomSearchResults']
+    payload: RoomSearchResultsEventPayload
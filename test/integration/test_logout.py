@@ -0,0 +1,40 @@
+from .conftest import check_status, api_endpoint, ws_endpoint, _create_session
+from websockets.sync.client import connect
+from websockets.exceptions import ConnectionClosedError
+import requests
+
+
+def _websocket_accepted(sid: str) -> bool:
+    ''' Returns whether a websocket authenticated with sid receives a hello event. '''
+    try:
+        with connect(ws_endpoint(), close_timeout=0.1, additional_headers={'Cookie': f'sid={sid}'}) as ws:
+            ws.recv(timeout=3)
+            return True
+    except ConnectionClosedError:
+        return False
+
+
+def test_success():
+    # Use a dedicated session, since it's going to be invalidated
+    session = _create_session()
+    assert _websocket_accepted(session.sid)
+
+    # Logging out clears the cookie
+    res = check_status(requests.post(api_endpoint('logout'), cookies={'sid': session.sid}))
+    assert res.status_code == 204 # No data
+    assert res.headers['Set-Cookie'].startswith('sid=;')
+    assert 'Max-Age=0' in res.headers['Set-Cookie']
+
+    # The session is no longer valid, even if cached
+    assert not _websocket_accepted(session.sid)
+
+
+def test_without_session():
+    # Logging out without a session just clears the cookie
+    res = check_status(requests.post(api_endpoint('logout')))
+    assert res.status_code == 204
+
+
+def test_bad_method():
+    res = requests.get(api_endpoint('logout'))
+    assert res.status_code == 405
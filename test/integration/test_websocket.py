@@ -7,8 +7,16 @@ from .api_types import (
     ServerMessagesEvent,
     ClientMessagesEvent,
     ClientMessagesEventPayload,
+    JoinRoomEvent,
+    JoinRoomEventPayload,
+    RoomJoinedEvent,
+    ActivityKind,
+    ClientActivityEvent,
+    ClientActivityEventPayload,
+    ServerActivityEvent,
 )
-from typing import Generator
+from typing import Generator, List, Optional
+import msgpack
 from .conftest import ws_endpoint, GeneratedSession
 import pytest
 
@@ -21,8 +29,12 @@ import pytest
 
 
 @contextmanager
-def _connect_websocket(sid: str) -> Generator[ClientConnection, None, None]:
-    ws = connect(ws_endpoint(), close_timeout=0.1, additional_headers={
+def _connect_websocket(
+    sid: str,
+    query: str = '',
+    subprotocols: Optional[List[str]] = None
+) -> Generator[ClientConnection, None, None]:
+    ws = connect(ws_endpoint() + query, close_timeout=0.1, subprotocols=subprotocols, additional_headers={
         'Cookie': f'sid={sid}'
     })
     try:
@@ -177,6 +189,136 @@ def test_new_messages_appear_in_history(session: GeneratedSession, session2: Gen
     assert wasm_room_2.messages[0].id > wasm_room_2.messages[1].id
 
 
+def test_hello_lazy_history(session: GeneratedSession):
+    '''
+    Clients connecting with ?history=lazy get a hello without messages
+    '''
+
+    with _connect_websocket(sid=session.sid, query='?history=lazy') as websocket:
+        message = HelloEvent.model_validate_json(websocket.recv(timeout=3))
+
+        # Rooms are there, but without any messages
+        assert [r.id for r in message.payload.rooms][:4] == ['beast', 'async', 'db', 'wasm']
+        for room in message.payload.rooms:
+            assert room.messages == []
+            assert room.hasMoreMessages
+
+
+def test_hello_delta(session: GeneratedSession):
+    '''
+    Clients reconnecting with ?since=<room_id>:<message_id> only get the messages they missed
+    '''
+    def send_message(ws: ClientConnection, content: str) -> str:
+        evt = ClientMessagesEvent(
+            type='clientMessages',
+            payload=ClientMessagesEventPayload(roomId='wasm', messages=[ClientMessage(content=content)])
+        )
+        ws.send(evt.model_dump_json())
+        return ServerMessagesEvent.model_validate_json(ws.recv(timeout=3)).payload.messages[0].id
+
+    # Send a couple of messages. The client has seen the first one
+    with _connect_websocket(sid=session.sid) as websocket:
+        HelloEvent.model_validate_json(websocket.recv(timeout=3))
+        seen_id = send_message(websocket, 'Seen message')
+        missed_id = send_message(websocket, 'Missed message')
+
+    # Reconnect
+    with _connect_websocket(sid=session.sid, query=f'?since=wasm:{seen_id}') as websocket:
+        message = HelloEvent.model_validate_json(websocket.recv(timeout=3))
+        rooms = {r.id: r for r in message.payload.rooms}
+
+        # The room only contains the missed message
+        assert rooms['wasm'].isDelta
+        assert [m.id for m in rooms['wasm'].messages] == [missed_id]
+
+        # Other rooms are sent in full
+        assert not rooms['beast'].isDelta
+
+
+def test_join_room(session: GeneratedSession):
+    '''
+    Joining a room the user is already a member of sends the room again
+    '''
+
+    with _connect_websocket(sid=session.sid) as websocket:
+        HelloEvent.model_validate_json(websocket.recv(timeout=3))
+
+        # Join a default room
+        evt = JoinRoomEvent(type='joinRoom', payload=JoinRoomEventPayload(roomId='db'))
+        websocket.send(evt.model_dump_json())
+
+        # The room is sent back
+        res = RoomJoinedEvent.model_validate_json(websocket.recv(timeout=3))
+        assert res.payload.room.id == 'db'
+        assert res.payload.room.name == 'Database connectors'
+
+
+def test_activity(session: GeneratedSession, session2: GeneratedSession):
+    '''
+    Typing indicators are broadcast to other clients in the room, without being stored
+    '''
+    with _connect_websocket(sid=session.sid) as ws1:
+        with _connect_websocket(sid=session2.sid) as ws2:
+            h1 = HelloEvent.model_validate_json(ws1.recv(timeout=1))
+            HelloEvent.model_validate_json(ws2.recv(timeout=1))
+
+            # Report that the user is typing
+            evt = ClientActivityEvent(
+                type='clientActivity',
+                payload=ClientActivityEventPayload(roomId='wasm', kind=ActivityKind.Typing)
+            )
+            ws1.send(evt.model_dump_json(exclude_none=True))
+
+            # ws2 gets it, after the coalescing window
+            res = ServerActivityEvent.model_validate_json(ws2.recv(timeout=3))
+            assert res.payload.roomId == 'wasm'
+            assert res.payload.user == h1.payload.me
+            assert res.payload.kind == ActivityKind.Typing
+            assert res.payload.messageId is None
+
+
+def test_msgpack(session: GeneratedSession, session2: GeneratedSession):
+    '''
+    Clients negotiating the MessagePack subprotocol exchange the same events,
+    encoded as binary MessagePack messages
+    '''
+    with _connect_websocket(sid=session.sid, subprotocols=['chat.msgpack']) as ws1:
+        with _connect_websocket(sid=session2.sid) as ws2:
+            assert ws1.subprotocol == 'chat.msgpack'
+
+            # The hello is a binary message
+            raw_hello = ws1.recv(timeout=1)
+            assert isinstance(raw_hello, bytes)
+            h1 = HelloEvent.model_validate(msgpack.unpackb(raw_hello))
+            assert h1.payload.me.username == session.username
+            HelloEvent.model_validate_json(ws2.recv(timeout=1))
+
+            # Send a message encoded as MessagePack
+            sent_msg = ClientMessagesEvent(
+                type='clientMessages',
+                payload=ClientMessagesEventPayload(
+                    roomId="wasm",
+                    messages=[ClientMessage(content="Test message msgpack")]
+                )
+            )
+            ws1.send(msgpack.packb(sent_msg.model_dump()))
+
+            # The binary client gets it as MessagePack, and the other one as JSON
+            ws1_msg = ServerMessagesEvent.model_validate(msgpack.unpackb(ws1.recv(timeout=1)))
+            ws2_msg = ServerMessagesEvent.model_validate_json(ws2.recv(timeout=1))
+            assert ws1_msg.payload.messages[0].content == "Test message msgpack"
+            assert ws1_msg.model_dump_json() == ws2_msg.model_dump_json()
+
+
+def test_json_subprotocol(session: GeneratedSession):
+    '''
+    Clients can request the JSON subprotocol explicitly
+    '''
+    with _connect_websocket(sid=session.sid, subprotocols=['chat.json']) as ws:
+        assert ws.subprotocol == 'chat.json'
+        HelloEvent.model_validate_json(ws.recv(timeout=1))
+
+
 def test_not_authenticated():
     '''
     If we're not authenticated, the websocket is closed with a policy violation code.
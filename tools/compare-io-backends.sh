@@ -0,0 +1,125 @@
+#!/bin/bash
+
+# Compares the epoll and io_uring builds of the server (see CHAT_USE_IO_URING
+# in doc/02-local-dev.adoc). Builds the server in both modes, runs the same loadgen
+# scenario against each, and counts the system calls the server makes while measuring.
+# Prints the results as an AsciiDoc table.
+#
+# Requires Redis and MySQL to be running (e.g. docker compose up redis mysql),
+# perf, liburing-dev and the usual build dependencies. perf needs access to
+# tracepoints (e.g. sysctl kernel.perf_event_paranoid=-1, or run as root).
+# Setting STRACE=1 runs each scenario a second time under strace -c, printing
+# a breakdown by system call. strace slows the server down, so latencies from
+# that run aren't reported.
+#
+# Usage: tools/compare-io-backends.sh [loadgen options]
+# Environment: BOOST_PREFIX (/opt/boost), BUILD_DIR (/tmp/chat-io-compare),
+#              THREADS (server threads, 1), PORT (8080), WARMUP and DURATION (seconds, 5 and 30)
+
+set -e
+
+REPO_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+BOOST_PREFIX="${BOOST_PREFIX:-/opt/boost}"
+BUILD_DIR="${BUILD_DIR:-/tmp/chat-io-compare}"
+THREADS="${THREADS:-1}"
+PORT="${PORT:-8080}"
+WARMUP="${WARMUP:-5}"
+DURATION="${DURATION:-30}"
+LOADGEN_ARGS=("$@")
+if [ ${#LOADGEN_ARGS[@]} -eq 0 ]; then
+    LOADGEN_ARGS=(--clients=10000 --users=20 --senders=200 --rate=500)
+fi
+
+ulimit -n 65536
+
+# Builds the server and loadgen in $BUILD_DIR/$1, with CHAT_USE_IO_URING=$2
+build() {
+    cmake -S "$REPO_DIR/server" -B "$BUILD_DIR/$1" -DCMAKE_BUILD_TYPE=Release \
+        -DCMAKE_PREFIX_PATH="$BOOST_PREFIX" -DCHAT_BUILD_BENCHMARKS=ON -DCHAT_USE_IO_URING="$2" > /dev/null
+    cmake --build "$BUILD_DIR/$1" -j "$(nproc)" --target main loadgen > /dev/null
+}
+
+# Starts the server built in $BUILD_DIR/$1 and waits until it's ready. Sets SERVER_PID
+start_server() {
+    "$BUILD_DIR/$1/main" 127.0.0.1 "$PORT" "$BUILD_DIR" "$THREADS" > "$BUILD_DIR/$1.server.log" 2>&1 &
+    SERVER_PID=$!
+    for _ in $(seq 1 600); do
+        if curl -sf "http://127.0.0.1:$PORT/api/ready" > /dev/null; then
+            return
+        fi
+        sleep 0.1
+    done
+    echo "The $1 server didn't get ready, see $BUILD_DIR/$1.server.log" >&2
+    exit 1
+}
+
+stop_server() {
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" || true
+}
+
+# Runs loadgen against the server built in $1. Once the warmup is over,
+# runs the command passed as the remaining arguments, attached to the server
+measure() {
+    local mode=$1
+    shift
+    "$BUILD_DIR/$mode/bench/loadgen" --port="$PORT" --warmup="$WARMUP" --duration="$DURATION" \
+        "${LOADGEN_ARGS[@]}" > "$BUILD_DIR/$mode.loadgen.txt" 2> "$BUILD_DIR/$mode.loadgen.log" &
+    local loadgen_pid=$!
+
+    # loadgen creates its accounts and connects its sessions before sending messages
+    until grep -q "^Running for" "$BUILD_DIR/$mode.loadgen.log" 2> /dev/null; do
+        if ! kill -0 $loadgen_pid 2> /dev/null; then
+            echo "loadgen failed, see $BUILD_DIR/$mode.loadgen.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+    sleep "$WARMUP"
+    "$@"
+    wait $loadgen_pid
+}
+
+# Runs a scenario against each mode, printing a row of the results table
+run_mode() {
+    local mode=$1
+    start_server "$mode"
+    measure "$mode" perf stat -e raw_syscalls:sys_enter -x, -o "$BUILD_DIR/$mode.perf.txt" \
+        -p "$SERVER_PID" -- sleep "$DURATION"
+    stop_server
+
+    local syscalls delivered p99
+    syscalls=$(grep raw_syscalls "$BUILD_DIR/$mode.perf.txt" | cut -d, -f1)
+    delivered=$(sed -n 's/^  delivered: *\([0-9]*\).*/\1/p' "$BUILD_DIR/$mode.loadgen.txt")
+    p99=$(sed -n 's/.*latency ms:.*, p99 \([0-9.]*\),.*/\1/p' "$BUILD_DIR/$mode.loadgen.txt")
+    echo "| $mode | $syscalls | $(awk "BEGIN { printf \"%.0f\", $syscalls / $DURATION }") |" \
+        "$(awk "BEGIN { printf \"%.2f\", $delivered ? $syscalls / $delivered : 0 }") | $p99"
+
+    if [ "${STRACE:-0}" = "1" ]; then
+        start_server "$mode"
+        measure "$mode" timeout -s INT "$DURATION" strace -c -f -o "$BUILD_DIR/$mode.strace.txt" -p "$SERVER_PID"
+        stop_server
+    fi
+}
+
+build epoll OFF
+build io_uring ON
+
+echo "Scenario: ${LOADGEN_ARGS[*]}, server threads $THREADS, measured for $DURATION s"
+echo
+echo '[cols="1,1,1,1,1"]'
+echo '|==='
+echo '| Mode | System calls | Per second | Per delivered message | p99 latency (ms)'
+run_mode epoll
+run_mode io_uring
+echo '|==='
+
+if [ "${STRACE:-0}" = "1" ]; then
+    for mode in epoll io_uring; do
+        echo
+        echo "strace -c, $mode:"
+        head -n 15 "$BUILD_DIR/$mode.strace.txt"
+    done
+fi
+echo
+echo "Full loadgen reports are in $BUILD_DIR/<mode>.loadgen.txt"
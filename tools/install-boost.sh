@@ -9,5 +9,5 @@ cd boost_1_87_0
 # Build and install. Make sure you've got write access to /opt/boost,
 # otherwise change the --prefix argument
 ./bootstrap.sh
-./b2 --with-json --with-context --with-regex --with-url --with-test --with-charconv -d0 --prefix=/opt/boost install
+./b2 --with-json --with-context --with-url --with-test --with-charconv -d0 --prefix=/opt/boost install
 rm -rf ~/boost-src